@@ -0,0 +1,305 @@
+#include "SACAsyncCmd.h"
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACEdgeAgg.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memset */
+#include "stdio.h"
+
+typedef struct
+{
+    uint8_t state; // tAsyncCmdState
+    uint8_t tag;
+    uint8_t downlinkIndicator;
+    uint8_t failures;
+    uint32_t uplinkId;
+    uint64_t acceptedUs;
+    uint8_t downlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+} tAsyncCmdSlot;
+
+/****************** private function prototypes *********************/
+tAsyncCmdSlot *asyncCmdFindTag(uint8_t bTag);
+tAsyncCmdSlot *asyncCmdFindUplink(uint32_t uiUplinkId);
+tAsyncCmdSlot *asyncCmdFreeSlot();
+void asyncCmdRelease(tAsyncCmdSlot *pSlot);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tAsyncCmdSlot masAsyncCmdSlots[ASYNCCMD_MAXTAGS];
+static uint32_t muiAsyncCmdPending = 0;
+static uint32_t muiAsyncCmdDone = 0; // done or dropped, not queried yet
+static tAsyncCmdStats msAsyncCmdStats = {0};
+/********************************************************************/
+
+void asyncCmdInit()
+{
+    memset(masAsyncCmdSlots, 0, sizeof(masAsyncCmdSlots));
+    memset(&msAsyncCmdStats, 0, sizeof(msAsyncCmdStats));
+    muiAsyncCmdPending = 0;
+    muiAsyncCmdDone = 0;
+}
+
+/******************* asyncCmdCanAccept **********************
+    Asked before the command is queued, a refused tag must
+    not leave an untracked uplink behind.
+************************************************************/
+bool asyncCmdCanAccept(uint8_t bTag)
+{
+    tAsyncCmdSlot *pSlot = asyncCmdFindTag(bTag);
+
+    if(bTag == ASYNCCMD_TAGSUMMARY)
+    {
+        return false;
+    }
+    if(pSlot != NULL)
+    {
+        return (pSlot->state != ASYNCCMD_PENDING);
+    }
+    return (muiAsyncCmdPending < ASYNCCMD_MAXTAGS);
+}
+
+/********************* asyncCmdAccept ***********************
+    iUplinkId as returned by edgeAggSubmit(). Returns the
+    error code of the immediate reply, see SACAsyncCmd.h.
+************************************************************/
+uint8_t asyncCmdAccept(uint8_t bTag, int32_t iUplinkId, uint8_t bDownlinkIndicator)
+{
+    tAsyncCmdSlot *pSlot;
+
+    if(!asyncCmdCanAccept(bTag))
+    {
+        msAsyncCmdStats.refused += 1;
+        return I2CERRORCODE_TAGBUSY;
+    }
+    if(iUplinkId < 0 && iUplinkId != EDGEAGG_ABSORBED)
+    {
+        msAsyncCmdStats.refused += 1;
+        return I2CERRORCODE_SERVERUNREACH;
+    }
+    pSlot = asyncCmdFindTag(bTag);
+    if(pSlot != NULL)
+    {
+        asyncCmdRelease(pSlot); // done and never queried, the controller moved on
+    }
+    else
+    {
+        pSlot = asyncCmdFreeSlot();
+    }
+    memset(pSlot, 0, sizeof(tAsyncCmdSlot));
+    pSlot->tag = bTag;
+    pSlot->downlinkIndicator = bDownlinkIndicator;
+    pSlot->acceptedUs = printGetMonotonicTimeUs();
+    msAsyncCmdStats.accepted += 1;
+    if(iUplinkId == EDGEAGG_ABSORBED)
+    {
+        pSlot->state = ASYNCCMD_DONE; // suppressed or rolled up, nothing to wait for
+        muiAsyncCmdDone += 1;
+        msAsyncCmdStats.delivered += 1;
+        return I2CERRORCODE_OK;
+    }
+    pSlot->state = ASYNCCMD_PENDING;
+    pSlot->uplinkId = (uint32_t)iUplinkId;
+    muiAsyncCmdPending += 1;
+    if(muiAsyncCmdPending > msAsyncCmdStats.maxOutstanding)
+    {
+        msAsyncCmdStats.maxOutstanding = muiAsyncCmdPending;
+    }
+    return I2CERRORCODE_PENDING;
+}
+
+/****************** asyncCmdUplinkResult ********************
+    Called after every uplink (commsRecordUplinkResult(),
+    bulk blocks). pDownlink is the decked reply payload of
+    this uplink, NULL when it has none (bulk). A failed
+    uplink stays queued and the tag pending.
+************************************************************/
+void asyncCmdUplinkResult(uint32_t uiUplinkId, int iResult, const uint8_t *pDownlink)
+{
+    tAsyncCmdSlot *pSlot;
+    uint32_t uiCompletionUs;
+
+    if(muiAsyncCmdPending == 0)
+    {
+        return;
+    }
+    pSlot = asyncCmdFindUplink(uiUplinkId);
+    if(pSlot == NULL)
+    {
+        return;
+    }
+    if(iResult < 0)
+    {
+        pSlot->failures += (pSlot->failures < 0xff) ? 1 : 0;
+        return;
+    }
+    if(pDownlink != NULL)
+    {
+        memcpy(pSlot->downlink, pDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    }
+    pSlot->state = ASYNCCMD_DONE;
+    muiAsyncCmdPending -= 1;
+    muiAsyncCmdDone += 1;
+    msAsyncCmdStats.delivered += 1;
+    uiCompletionUs = (uint32_t)(printGetMonotonicTimeUs() - pSlot->acceptedUs);
+    if(uiCompletionUs > msAsyncCmdStats.maxCompletionUs)
+    {
+        msAsyncCmdStats.maxCompletionUs = uiCompletionUs;
+    }
+}
+
+/****************** asyncCmdUplinkDropped *******************
+    The uplink scheduler dropped the record from a full
+    queue, it will never be delivered.
+************************************************************/
+void asyncCmdUplinkDropped(uint32_t uiUplinkId)
+{
+    tAsyncCmdSlot *pSlot;
+
+    if(muiAsyncCmdPending == 0)
+    {
+        return;
+    }
+    pSlot = asyncCmdFindUplink(uiUplinkId);
+    if(pSlot == NULL)
+    {
+        return;
+    }
+    printf("[WARNING] (%s) %s: Tagged command 0x%02x (uplink id %u) dropped from a full queue.\n", printTimestamp(), __func__, pSlot->tag, uiUplinkId);
+    pSlot->state = ASYNCCMD_DROPPED;
+    muiAsyncCmdPending -= 1;
+    muiAsyncCmdDone += 1;
+    msAsyncCmdStats.dropped += 1;
+}
+
+/********************** asyncCmdQuery ***********************
+    Builds the status reply for bTag, see SACAsyncCmd.h.
+************************************************************/
+void asyncCmdQuery(uint8_t bTag, tCtrlDeckedReply *pReply)
+{
+    tAsyncCmdSlot *pSlot = asyncCmdFindTag(bTag);
+
+    memset(pReply, 0, sizeof(tCtrlDeckedReply));
+    pReply->startTag = IOT_FRMSTARTTAG;
+    pReply->cmdCode = ASYNCCMD_CMDCODE_STATUS;
+    pReply->endTag = IOT_FRMENDTAG;
+    msAsyncCmdStats.queries += 1;
+    if(bTag == ASYNCCMD_TAGSUMMARY)
+    {
+        pReply->errorCode = I2CERRORCODE_OK;
+        pReply->payloadSize = 4;
+        pReply->payload[0] = (uint8_t)muiAsyncCmdPending;
+        pReply->payload[1] = (uint8_t)muiAsyncCmdDone;
+        pReply->payload[2] = (uint8_t)(ASYNCCMD_MAXTAGS - muiAsyncCmdPending - muiAsyncCmdDone);
+        pReply->payload[3] = (commsGetCircuitState() != CB_OPEN) ? 1 : 0;
+        return;
+    }
+    if(pSlot == NULL)
+    {
+        pReply->errorCode = I2CERRORCODE_UNKNOWNTAG;
+        return;
+    }
+    switch(pSlot->state)
+    {
+        case ASYNCCMD_PENDING:
+            pReply->errorCode = I2CERRORCODE_PENDING;
+            pReply->payloadSize = 1;
+            pReply->payload[0] = pSlot->failures;
+            msAsyncCmdStats.pendingAnswers += 1;
+            return;
+        case ASYNCCMD_DONE:
+            pReply->errorCode = I2CERRORCODE_OK;
+            if(pSlot->downlinkIndicator == 0x01)
+            {
+                pReply->payloadSize = STRUCTS_DECKEDREPLYPAYLOADSIZE;
+                memcpy(pReply->payload, pSlot->downlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+            }
+            break;
+        default:
+            pReply->errorCode = I2CERRORCODE_SERVERUNREACH;
+            break;
+    }
+    asyncCmdRelease(pSlot);
+}
+
+uint32_t asyncCmdPending()
+{
+    return muiAsyncCmdPending;
+}
+
+const tAsyncCmdStats *asyncCmdStats()
+{
+    return &msAsyncCmdStats;
+}
+
+void asyncCmdLog()
+{
+    printf("[INFO] (%s) %s: %llu tagged commands accepted, %llu refused, %llu delivered, %llu dropped, %llu queries (%llu pending), %llu evicted, max %u outstanding, max completion %u ms.\n", printTimestamp(), __func__,
+        (unsigned long long)msAsyncCmdStats.accepted, (unsigned long long)msAsyncCmdStats.refused, (unsigned long long)msAsyncCmdStats.delivered,
+        (unsigned long long)msAsyncCmdStats.dropped, (unsigned long long)msAsyncCmdStats.queries, (unsigned long long)msAsyncCmdStats.pendingAnswers,
+        (unsigned long long)msAsyncCmdStats.evicted, msAsyncCmdStats.maxOutstanding, msAsyncCmdStats.maxCompletionUs / 1000);
+}
+
+tAsyncCmdSlot *asyncCmdFindTag(uint8_t bTag)
+{
+    int i;
+    for(i=0; i<ASYNCCMD_MAXTAGS; i+=1)
+    {
+        if(masAsyncCmdSlots[i].state != ASYNCCMD_FREE && masAsyncCmdSlots[i].tag == bTag)
+        {
+            return &masAsyncCmdSlots[i];
+        }
+    }
+    return NULL;
+}
+
+tAsyncCmdSlot *asyncCmdFindUplink(uint32_t uiUplinkId)
+{
+    int i;
+    for(i=0; i<ASYNCCMD_MAXTAGS; i+=1)
+    {
+        if(masAsyncCmdSlots[i].state == ASYNCCMD_PENDING && masAsyncCmdSlots[i].uplinkId == uiUplinkId)
+        {
+            return &masAsyncCmdSlots[i];
+        }
+    }
+    return NULL;
+}
+
+/******************** asyncCmdFreeSlot **********************
+    A free slot, else the oldest done one. asyncCmdCanAccept()
+    made sure not all of them are pending.
+************************************************************/
+tAsyncCmdSlot *asyncCmdFreeSlot()
+{
+    tAsyncCmdSlot *pOldest = NULL;
+    int i;
+    for(i=0; i<ASYNCCMD_MAXTAGS; i+=1)
+    {
+        tAsyncCmdSlot *pSlot = &masAsyncCmdSlots[i];
+        if(pSlot->state == ASYNCCMD_FREE)
+        {
+            return pSlot;
+        }
+        if(pSlot->state != ASYNCCMD_PENDING && (pOldest == NULL || pSlot->acceptedUs < pOldest->acceptedUs))
+        {
+            pOldest = pSlot;
+        }
+    }
+    msAsyncCmdStats.evicted += 1;
+    asyncCmdRelease(pOldest);
+    return pOldest;
+}
+
+void asyncCmdRelease(tAsyncCmdSlot *pSlot)
+{
+    if(pSlot->state == ASYNCCMD_PENDING)
+    {
+        muiAsyncCmdPending -= 1;
+    }
+    else if(pSlot->state != ASYNCCMD_FREE)
+    {
+        muiAsyncCmdDone -= 1;
+    }
+    pSlot->state = ASYNCCMD_FREE;
+}
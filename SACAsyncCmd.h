@@ -0,0 +1,82 @@
+#ifndef SACASYNCCMD_H
+#define SACASYNCCMD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#define ASYNCCMD_CMDCODE_SEND       0x04 // tagged send command
+#define ASYNCCMD_CMDCODE_STATUS     0x05 // status query by tag
+#define ASYNCCMD_MAXTAGS            32 // commands tracked at once, pending or done and not queried yet
+#define ASYNCCMD_TAGSUMMARY         0x00 // status query for the counts instead of one tag, not usable as a tag
+
+/*
+    Tagged commands: the controller no longer waits for the
+    uplink of its send command, several can be outstanding.
+        0x04 tagged send: # 04 tag <a send command from its
+             cmdCode on: 02|03 size dl payload[12]> \n
+             Answered right away with an empty reply
+             (# 04 errorCode 00 \n):
+                I2CERRORCODE_PENDING       queued
+                I2CERRORCODE_OK            done already, the
+                                           edge aggregation
+                                           absorbed it
+                I2CERRORCODE_SERVERUNREACH the queue refused it
+                I2CERRORCODE_TAGBUSY       tag still pending or
+                                           no free slot
+        0x05 status query: # 05 tag \n
+             Answered right away with a decked reply (always
+             STRUCTS_DECKEDREPLYTOTALSIZE bytes, cmdCode 0x05):
+                I2CERRORCODE_OK            delivered, payload
+                                           is the downlink when
+                                           dl was 0x01
+                I2CERRORCODE_PENDING       not delivered yet,
+                                           payload[0] = failed
+                                           attempts so far
+                I2CERRORCODE_SERVERUNREACH dropped from a full
+                                           queue, never delivered
+                I2CERRORCODE_UNKNOWNTAG    not tracked
+             A final answer (ok, dropped) releases the tag.
+             Tag ASYNCCMD_TAGSUMMARY answers with the counts in
+             payload[0..3]: pending, done and not queried,
+             free slots, 1 when the circuit breaker lets
+             uplinks through.
+    A tag that was not queried is reused by the next send
+    with that tag. When all slots are taken the oldest done
+    one makes room.
+    The uplinks go through the same queues as 0x02/0x03,
+    every result reaches asyncCmdUplinkResult().
+*/
+
+typedef enum
+{
+    ASYNCCMD_FREE,
+    ASYNCCMD_PENDING,
+    ASYNCCMD_DONE,
+    ASYNCCMD_DROPPED,
+} tAsyncCmdState;
+
+typedef struct
+{
+    uint64_t accepted;
+    uint64_t refused; // tag busy or queue full
+    uint64_t delivered;
+    uint64_t dropped;
+    uint64_t queries;
+    uint64_t pendingAnswers; // queries answered with I2CERRORCODE_PENDING
+    uint64_t evicted; // done, not queried, made room for a new tag
+    uint32_t maxOutstanding; // pending at the same time
+    uint32_t maxCompletionUs; // accepted until delivered
+} tAsyncCmdStats;
+
+void asyncCmdInit();
+bool asyncCmdCanAccept(uint8_t bTag);
+uint8_t asyncCmdAccept(uint8_t bTag, int32_t iUplinkId, uint8_t bDownlinkIndicator);
+void asyncCmdUplinkResult(uint32_t uiUplinkId, int iResult, const uint8_t *pDownlink);
+void asyncCmdUplinkDropped(uint32_t uiUplinkId);
+void asyncCmdQuery(uint8_t bTag, tCtrlDeckedReply *pReply);
+uint32_t asyncCmdPending();
+const tAsyncCmdStats *asyncCmdStats();
+void asyncCmdLog();
+
+#endif
@@ -0,0 +1,158 @@
+#include "SACBscHealth.h"
+#include "SACRPiIotSlave.h" /* tBscStatus */
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memset */
+#include "stdio.h"
+
+/****************** private function prototypes *********************/
+void bscHealthRecovered(uint64_t ulNowUs);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tBscHealthStats msBscHealthStats = {{0}};
+static uint32_t muiBscFailedXfers = 0;
+static uint64_t mulBscRxBusySinceUs = 0; // 0: no rx stall candidate
+static uint64_t mulBscTxPendingSinceUs = 0; // 0: tx fifo empty
+static uint32_t muiBscTxPendingBytes = 0;
+static uint64_t mulBscStallDetectedUs = 0; // 0: healthy
+static uint64_t mulBscLastRecoveryUs = 0; // monotonic time the last stage ran
+static tBscRecoveryStage meBscLastStage = BSCRECOVERY_NONE;
+static const char *masBscStageNames[BSCRECOVERY_COUNT] = {"none", "abort", "reopen", "reinit"};
+static const char *masBscStallNames[BSCSTALL_COUNT] = {"none", "failed transfers", "rx", "tx fifo"};
+/********************************************************************/
+
+void bscHealthReset()
+{
+    memset(&msBscHealthStats, 0, sizeof(msBscHealthStats));
+    muiBscFailedXfers = 0;
+    mulBscRxBusySinceUs = 0;
+    mulBscTxPendingSinceUs = 0;
+    muiBscTxPendingBytes = 0;
+    mulBscStallDetectedUs = 0;
+    mulBscLastRecoveryUs = 0;
+    meBscLastStage = BSCRECOVERY_NONE;
+}
+
+/******************** bscHealthObserve **********************
+    Called with every bscXfer() result. Detects:
+        - BSCHEALTH_MAXFAILEDXFERS results of -1 in a row;
+        - rxBusy for BSCHEALTH_RXSTALLMS without a byte;
+        - a tx fifo that doesn't change for
+          BSCHEALTH_TXSTALLMS while it holds bytes.
+    Returns the recovery stage the caller has to run now,
+    BSCRECOVERY_NONE while the peripheral looks healthy.
+************************************************************/
+tBscRecoveryStage bscHealthObserve(int iXferResult, int iRxCount, uint64_t ulNowUs)
+{
+    tBscStatus sStatus;
+    tBscStall eStall = BSCSTALL_NONE;
+    tBscRecoveryStage eStage = BSCRECOVERY_ABORT;
+
+    if(iXferResult < 0)
+    {
+        muiBscFailedXfers += 1;
+        if(muiBscFailedXfers >= BSCHEALTH_MAXFAILEDXFERS)
+        {
+            eStall = BSCSTALL_XFERERRORS;
+        }
+    }
+    else
+    {
+        muiBscFailedXfers = 0;
+        sStatus.i32 = iXferResult;
+        if(sStatus.rxBusy == 1 && iRxCount == 0)
+        {
+            if(mulBscRxBusySinceUs == 0)
+            {
+                mulBscRxBusySinceUs = ulNowUs;
+            }
+            else if(ulNowUs - mulBscRxBusySinceUs > BSCHEALTH_RXSTALLMS * 1000ULL)
+            {
+                eStall = BSCSTALL_RX;
+            }
+        }
+        else
+        {
+            mulBscRxBusySinceUs = 0;
+        }
+        if(sStatus.nBytesInTxFifo == 0)
+        {
+            mulBscTxPendingSinceUs = 0;
+        }
+        else if(mulBscTxPendingSinceUs == 0 || sStatus.nBytesInTxFifo != muiBscTxPendingBytes)
+        {
+            mulBscTxPendingSinceUs = ulNowUs; // new reply or the controller is reading
+        }
+        else if(ulNowUs - mulBscTxPendingSinceUs > BSCHEALTH_TXSTALLMS * 1000ULL)
+        {
+            eStall = BSCSTALL_TX;
+        }
+        muiBscTxPendingBytes = sStatus.nBytesInTxFifo;
+        if(eStall == BSCSTALL_NONE && mulBscStallDetectedUs != 0 && mulBscRxBusySinceUs == 0)
+        {
+            bscHealthRecovered(ulNowUs);
+        }
+    }
+    if(eStall == BSCSTALL_NONE)
+    {
+        return BSCRECOVERY_NONE;
+    }
+
+    msBscHealthStats.stalls[eStall] += 1;
+    if(mulBscStallDetectedUs == 0)
+    {
+        mulBscStallDetectedUs = ulNowUs;
+    }
+    if(meBscLastStage != BSCRECOVERY_NONE && (ulNowUs - mulBscLastRecoveryUs) < BSCHEALTH_ESCALATEMS * 1000ULL)
+    {
+        eStage = (meBscLastStage < BSCRECOVERY_REINIT) ? meBscLastStage + 1 : BSCRECOVERY_REINIT;
+    }
+    muiBscFailedXfers = 0;
+    mulBscRxBusySinceUs = 0;
+    mulBscTxPendingSinceUs = 0;
+    printf("[WARNING] (%s) %s: BSC stall (%s), recovery stage %s.\n", printTimestamp(), __func__, masBscStallNames[eStall], masBscStageNames[eStage]);
+    return eStage;
+}
+
+/****************** bscHealthRecoveryRan ********************
+    The caller ran eStage, the next healthy transfer ends
+    the recovery.
+************************************************************/
+void bscHealthRecoveryRan(tBscRecoveryStage eStage, uint64_t ulNowUs)
+{
+    msBscHealthStats.recoveries[eStage] += 1;
+    meBscLastStage = eStage;
+    mulBscLastRecoveryUs = ulNowUs;
+}
+
+void bscHealthRecovered(uint64_t ulNowUs)
+{
+    uint32_t uiDurationUs = (uint32_t)(ulNowUs - mulBscStallDetectedUs);
+
+    mulBscStallDetectedUs = 0;
+    msBscHealthStats.recovered += 1;
+    msBscHealthStats.lastRecoveryUs = uiDurationUs;
+    msBscHealthStats.totalRecoveryUs += uiDurationUs;
+    msBscHealthStats.lastStage = meBscLastStage;
+    if(uiDurationUs > msBscHealthStats.maxRecoveryUs)
+    {
+        msBscHealthStats.maxRecoveryUs = uiDurationUs;
+    }
+    printf("[INFO] (%s) %s: BSC recovered after %u us, stage %s.\n", printTimestamp(), __func__, uiDurationUs, masBscStageNames[meBscLastStage]);
+}
+
+bool bscHealthRecovering()
+{
+    return (mulBscStallDetectedUs != 0);
+}
+
+const tBscHealthStats *bscHealthStats()
+{
+    return &msBscHealthStats;
+}
+
+const char *bscHealthStageName(tBscRecoveryStage eStage)
+{
+    return masBscStageNames[eStage];
+}
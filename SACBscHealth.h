@@ -0,0 +1,56 @@
+#ifndef SACBSCHEALTH_H
+#define SACBSCHEALTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define BSCHEALTH_MAXFAILEDXFERS    3 // consecutive bscXfer() results of -1
+#define BSCHEALTH_RXSTALLMS         50 // rxBusy without a byte arriving, a 32 byte frame takes 3.2 ms
+#define BSCHEALTH_TXSTALLMS         2000 // reply not read from the tx fifo, the controller reads it right after the read enable
+#define BSCHEALTH_ESCALATEMS        1000 // a stall this soon after a recovery gets the next stage
+#define BSCHEALTH_REOPENDELAYUS     1000 // peripheral off and without address before it is opened again
+
+typedef enum
+{
+    BSCRECOVERY_NONE,
+    BSCRECOVERY_ABORT, // BK: abort the transfer, both fifos cleared, open again
+    BSCRECOVERY_REOPEN, // everything off, address cleared, abort, address and open like at startup
+    BSCRECOVERY_REINIT, // gpioTerminate(), gpioInitialise(), then reopen
+    BSCRECOVERY_COUNT,
+} tBscRecoveryStage;
+
+typedef enum
+{
+    BSCSTALL_NONE,
+    BSCSTALL_XFERERRORS,
+    BSCSTALL_RX,
+    BSCSTALL_TX,
+    BSCSTALL_COUNT,
+} tBscStall;
+
+typedef struct
+{
+    uint32_t stalls[BSCSTALL_COUNT]; // per tBscStall
+    uint32_t recoveries[BSCRECOVERY_COUNT]; // per tBscRecoveryStage that ran
+    uint32_t recovered; // stalls that ended with a healthy transfer
+    uint32_t lastRecoveryUs; // stall detected until the first healthy transfer, all stages it took
+    uint32_t maxRecoveryUs;
+    uint64_t totalRecoveryUs;
+    tBscRecoveryStage lastStage; // stage that brought the last recovery
+} tBscHealthStats;
+
+/*
+    Health supervisor of the BSC slave. Every transfer result
+    goes through bscHealthObserve(), which detects a wedged
+    peripheral and tells the caller which recovery stage to
+    run. A stall that comes back within BSCHEALTH_ESCALATEMS
+    of the previous recovery gets the next stage.
+*/
+void bscHealthReset();
+tBscRecoveryStage bscHealthObserve(int iXferResult, int iRxCount, uint64_t ulNowUs);
+void bscHealthRecoveryRan(tBscRecoveryStage eStage, uint64_t ulNowUs);
+bool bscHealthRecovering();
+const tBscHealthStats *bscHealthStats();
+const char *bscHealthStageName(tBscRecoveryStage eStage);
+
+#endif
@@ -0,0 +1,274 @@
+#include "SACBulkUpload.h"
+#include "SACConfig.h"
+#include "SACAsyncCmd.h"
+#include "SACHistory.h"
+#include "SACPrintUtils.h"
+#include "SACTrace.h"
+
+#include "string.h" /* memcpy, memset */
+#include "stdio.h"
+#include <zlib.h> /* compress2, if not installed: "sudo apt-get install zlib1g-dev" */
+
+/****************** private function prototypes *********************/
+int bulkUploadPack();
+void bulkUploadPutU32(uint8_t *pDest, uint32_t uiValue);
+void bulkUploadFinish(int iResult, uint32_t uiStored);
+void bulkUploadDone(int iResult, uint32_t uiStored);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tUplinkRecord masBulkRecords[BULK_MAXRECORDS]; // block on the way, taken from the queues
+static uint32_t muiBulkRecords = 0; // 0: no block on the way
+static uint8_t mabBulkBlock[BULK_BLOCKMAXSIZE];
+static uint8_t mabBulkBody[BULK_BODYMAXSIZE];
+static int miBulkBodyLength = 0;
+static bool mbBulkActive = false;
+static bool mbBulkComplete = true; // the last block was stored completely
+static tBulkDoneCallback mpBulkDone = NULL;
+static tBulkStats msBulkStats = {0};
+/********************************************************************/
+
+void bulkUploadInit()
+{
+    memset(&msBulkStats, 0, sizeof(msBulkStats));
+    muiBulkRecords = 0;
+    mbBulkActive = false;
+    mbBulkComplete = true;
+}
+
+/******************** bulkUploadActive **********************
+    True while the backlog goes out in blocks: from [bulk]
+    threshold queued records until it caught up. Records of
+    a block that was not stored completely still have their
+    seqNr, they go out in a block again before the drain
+    switches back.
+************************************************************/
+bool bulkUploadActive()
+{
+    const tConfig *pConfig = configGet();
+    uint32_t uiPending = uplinkSchedPending();
+
+    if(!pConfig->bulkEnabled || !commsCanBulk())
+    {
+        mbBulkActive = false;
+        return false;
+    }
+    if(!mbBulkActive && uiPending >= pConfig->bulkThreshold)
+    {
+        mbBulkActive = true;
+        msBulkStats.bursts += 1;
+        printf("[INFO] (%s) %s: %u records queued, uploading the backlog in blocks.\n", printTimestamp(), __func__, uiPending);
+    }
+    else if(mbBulkActive && muiBulkRecords == 0 && mbBulkComplete && uiPending <= BULK_CAUGHTUP)
+    {
+        mbBulkActive = false;
+        printf("[INFO] (%s) %s: Caught up, %u records queued, back to a request per record.\n", printTimestamp(), __func__, uiPending);
+        bulkUploadLog();
+    }
+    return mbBulkActive;
+}
+
+bool bulkUploadBusy()
+{
+    return (muiBulkRecords > 0);
+}
+
+/********************* bulkUploadSend ***********************
+    Blocking: packs, sends and settles one block. Returns
+    the number of records the server stored, 0 when nothing
+    may be sent now or < 0 when the block failed (its records
+    are queued again).
+************************************************************/
+int bulkUploadSend()
+{
+    uint32_t uiStored = 0;
+    int iResult;
+
+    if(muiBulkRecords > 0)
+    {
+        return -3;
+    }
+    iResult = bulkUploadPack();
+    if(iResult <= 0)
+    {
+        return iResult;
+    }
+    TRACE_BEGIN("bulk");
+    iResult = commsSendBulk(mabBulkBody, miBulkBodyLength, muiBulkRecords, &uiStored);
+    TRACE_END("bulk");
+    bulkUploadFinish(iResult, uiStored);
+    return (iResult < 0) ? iResult : (int)uiStored;
+}
+
+/********************* bulkUploadStart **********************
+    Non blocking variant of bulkUploadSend for the reactor,
+    one block at a time. Returns 0 when a block was started,
+    pDone (may be NULL) is called once it is settled.
+    Returns < 0 when nothing was started, pDone is not
+    called.
+************************************************************/
+int bulkUploadStart(tBulkDoneCallback pDone)
+{
+    int iResult;
+
+    if(muiBulkRecords > 0)
+    {
+        return -3;
+    }
+    iResult = bulkUploadPack();
+    if(iResult <= 0)
+    {
+        return -1;
+    }
+    mpBulkDone = pDone;
+    iResult = commsStartBulk(mabBulkBody, miBulkBodyLength, muiBulkRecords, bulkUploadDone);
+    if(iResult < 0)
+    {
+        uplinkSchedPutBackBlock(masBulkRecords, muiBulkRecords);
+        muiBulkRecords = 0;
+        return iResult;
+    }
+    return 0;
+}
+
+void bulkUploadDone(int iResult, uint32_t uiStored)
+{
+    bulkUploadFinish(iResult, uiStored);
+    if(mpBulkDone != NULL)
+    {
+        mpBulkDone(iResult);
+    }
+}
+
+/********************* bulkUploadPack ***********************
+    Takes the next block from the queues, numbers the
+    records that don't have a seqNr yet and compresses it
+    into mabBulkBody. Returns the number of records, 0 when
+    nothing may be sent now, -1 on a compression error (the
+    records are queued again).
+************************************************************/
+int bulkUploadPack()
+{
+    uLongf ulBodyLength = sizeof(mabBulkBody);
+    uint32_t uiNew = 0;
+    uint32_t uiSeqNr = 0;
+    int iLength = 0;
+    int iPayloadLength;
+    int iResult;
+    uint32_t i;
+
+    muiBulkRecords = uplinkSchedTakeBlock(masBulkRecords, BULK_MAXRECORDS);
+    if(muiBulkRecords == 0)
+    {
+        return 0;
+    }
+    for(i=0; i<muiBulkRecords; i+=1)
+    {
+        uiNew += (masBulkRecords[i].hasSeqNr == 0) ? 1 : 0;
+    }
+    if(uiNew > 0)
+    {
+        uiSeqNr = commsReserveSeqNrs(uiNew);
+    }
+    for(i=0; i<muiBulkRecords; i+=1)
+    {
+        tUplinkRecord *pRecord = &masBulkRecords[i];
+        if(pRecord->hasSeqNr == 0)
+        {
+            pRecord->seqNr = uiSeqNr;
+            pRecord->hasSeqNr = 1;
+            uiSeqNr += 1;
+        }
+        iPayloadLength = (int)pRecord->cmd.payloadSize - 1; // payloadsize includes the read request byte
+        iPayloadLength = (iPayloadLength < 0) ? 0 : ((iPayloadLength > STRUCTS_SENDCMDPAYLOADSIZE) ? STRUCTS_SENDCMDPAYLOADSIZE : iPayloadLength);
+        bulkUploadPutU32(&mabBulkBlock[iLength], pRecord->seqNr);
+        bulkUploadPutU32(&mabBulkBlock[iLength + 4], (uint32_t)pRecord->time);
+        mabBulkBlock[iLength + 8] = pRecord->priorityClass;
+        mabBulkBlock[iLength + 9] = pRecord->encoding;
+        mabBulkBlock[iLength + 10] = (uint8_t)iPayloadLength;
+        memcpy(&mabBulkBlock[iLength + BULK_RECORDHEADERSIZE], pRecord->cmd.payload, iPayloadLength);
+        iLength += BULK_RECORDHEADERSIZE + iPayloadLength;
+    }
+
+    TRACE_BEGIN("deflate");
+    iResult = compress2(mabBulkBody, &ulBodyLength, mabBulkBlock, iLength, BULK_COMPRESSIONLEVEL);
+    TRACE_END("deflate");
+    if(iResult != Z_OK)
+    {
+        printf("[ERROR] (%s) %s: Could not compress a block of %u records, zlib error %i.\n", printTimestamp(), __func__, muiBulkRecords, iResult);
+        uplinkSchedPutBackBlock(masBulkRecords, muiBulkRecords);
+        muiBulkRecords = 0;
+        return -1;
+    }
+    miBulkBodyLength = (int)ulBodyLength;
+    msBulkStats.bytesRaw += iLength;
+    msBulkStats.bytesCompressed += ulBodyLength;
+    printf("[INFO] (%s) %s: Block of %u records, seqNr %u..%u, %i bytes, %i compressed.\n", printTimestamp(), __func__,
+        muiBulkRecords, masBulkRecords[0].seqNr, masBulkRecords[muiBulkRecords - 1].seqNr, iLength, miBulkBodyLength);
+    return (int)muiBulkRecords;
+}
+
+void bulkUploadPutU32(uint8_t *pDest, uint32_t uiValue)
+{
+    pDest[0] = uiValue & 0xff;
+    pDest[1] = (uiValue >> 8) & 0xff;
+    pDest[2] = (uiValue >> 16) & 0xff;
+    pDest[3] = (uiValue >> 24) & 0xff;
+}
+
+/******************** bulkUploadFinish **********************
+    The first uiStored records of the block are done, the
+    others go back to the head of their queues.
+************************************************************/
+void bulkUploadFinish(int iResult, uint32_t uiStored)
+{
+    uint32_t i;
+
+    if(iResult < 0)
+    {
+        uiStored = 0;
+        msBulkStats.failed += 1;
+    }
+    else
+    {
+        msBulkStats.blocks += 1;
+    }
+    if(uiStored > muiBulkRecords)
+    {
+        uiStored = muiBulkRecords;
+    }
+    if(uiStored > 0)
+    {
+        msBulkStats.stored += uiStored;
+        msBulkStats.checkpointSeqNr = masBulkRecords[uiStored - 1].seqNr;
+    }
+    for(i=0; i<uiStored; i+=1)
+    {
+        asyncCmdUplinkResult(masBulkRecords[i].id, 0, NULL); // tagged commands in the block are delivered, without a downlink
+        historyAppend(&masBulkRecords[i], 0, NULL, HISTORY_FLAG_BULK);
+    }
+    mbBulkComplete = (uiStored == muiBulkRecords);
+    if(mbBulkComplete)
+    {
+        printf("[INFO] (%s) %s: Block of %u records stored, checkpoint seqNr %u, %u queued.\n", printTimestamp(), __func__, muiBulkRecords, msBulkStats.checkpointSeqNr, uplinkSchedPending());
+    }
+    else
+    {
+        printf("[WARNING] (%s) %s: %u of %u records stored, the rest goes out with the next block.\n", printTimestamp(), __func__, uiStored, muiBulkRecords);
+        msBulkStats.resent += muiBulkRecords - uiStored;
+        uplinkSchedPutBackBlock(&masBulkRecords[uiStored], muiBulkRecords - uiStored);
+    }
+    muiBulkRecords = 0;
+}
+
+const tBulkStats *bulkUploadStats()
+{
+    return &msBulkStats;
+}
+
+void bulkUploadLog()
+{
+    printf("[INFO] (%s) %s: %u bursts, %u blocks, %u failed, %llu records stored, %llu resent, %llu bytes compressed to %llu, checkpoint seqNr %u.\n", printTimestamp(), __func__,
+        msBulkStats.bursts, msBulkStats.blocks, msBulkStats.failed, (unsigned long long)msBulkStats.stored, (unsigned long long)msBulkStats.resent,
+        (unsigned long long)msBulkStats.bytesRaw, (unsigned long long)msBulkStats.bytesCompressed, msBulkStats.checkpointSeqNr);
+}
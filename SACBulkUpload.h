@@ -0,0 +1,71 @@
+#ifndef SACBULKUPLOAD_H
+#define SACBULKUPLOAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+#include "SACServerComms.h"
+#include "SACUplinkSched.h"
+
+#define BULK_ENABLED                0 // default of [bulk] enabled, the server must accept the POST below
+#define BULK_THRESHOLD              64 // default of [bulk] threshold: queued records that start the bulk upload
+#define BULK_CAUGHTUP               4 // back to a request per record at this many queued records
+#define BULK_MAXTHRESHOLD           (UPLSCHED_ALARMQUEUESIZE + UPLSCHED_EVENTQUEUESIZE + UPLSCHED_TELEMQUEUESIZE)
+#define BULK_MAXRECORDS             128 // records per block
+#define BULK_RECORDHEADERSIZE       11 // seqNr (4), time (4), class, encoding, payload length
+#define BULK_BLOCKMAXSIZE           (BULK_MAXRECORDS * (BULK_RECORDHEADERSIZE + STRUCTS_SENDCMDPAYLOADSIZE))
+#define BULK_BODYMAXSIZE            (HTTPMSGMAXSIZE - 512) // compressed block, the request header needs the rest
+#define BULK_COMPRESSIONLEVEL       6 // zlib, 1 (fast) .. 9 (small)
+
+/*
+    Bulk upload of the uplink backlog. Once [bulk] threshold
+    records are queued (after an outage) the drain packs up
+    to BULK_MAXRECORDS of them into one block, compresses it
+    with zlib and POSTs it:
+        POST <path>?id=<device>&bulk=<records> HTTP/1.1
+        Content-Type: application/octet-stream
+        Content-Encoding: deflate
+    The block is the records in scheduling order, little
+    endian:
+        [0..3]  seqNr
+        [4..7]  unix time the controller sent the record
+        [8]     class (tUplinkClass)
+        [9]     encoding (tUplinkEncoding)
+        [10]    payload length n
+        [11..]  payload, n bytes
+    The server answers 200 with "stored=<n>" in the body: the
+    first n records of the block are stored. That is the
+    checkpoint, the rest of the block goes back to the queue
+    and out with the next block. A record keeps the seqNr it
+    got with its first block, so after a broken connection
+    the server drops the records it already has.
+    A block is one request for the rate limit. The drain goes
+    back to a request per record when no more than
+    BULK_CAUGHTUP records are left and the last block was
+    stored completely. Downlinks only come with per record
+    uplinks. Http transport only.
+*/
+
+typedef struct
+{
+    uint32_t bursts; // times the backlog crossed the threshold
+    uint32_t blocks; // blocks answered by the server
+    uint32_t failed; // blocks without an answer or refused
+    uint64_t stored; // records the server confirmed
+    uint64_t resent; // records put back for the next block
+    uint64_t bytesRaw; // blocks before compression
+    uint64_t bytesCompressed;
+    uint32_t checkpointSeqNr; // last record the server confirmed
+} tBulkStats;
+
+typedef void (*tBulkDoneCallback)(int iResult);
+
+void bulkUploadInit();
+bool bulkUploadActive();
+bool bulkUploadBusy();
+int bulkUploadSend();
+int bulkUploadStart(tBulkDoneCallback pDone);
+const tBulkStats *bulkUploadStats();
+void bulkUploadLog();
+
+#endif
@@ -0,0 +1,471 @@
+#include "SACCoapClient.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACTrace.h"
+#include "SACConfig.h"
+
+#include "string.h" /* memcpy, memset */
+#include <stdlib.h> /* rand_r */
+#include <sys/socket.h> /* socket, connect */
+#include <netinet/in.h> /* struct sockaddr_in, struct sockaddr */
+#include <netdb.h> /* struct hostent, gethostbyname */
+#include <poll.h>
+#include <errno.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "stdio.h"
+#include "unistd.h"
+
+/*
+    Minimal CoAP (RFC 7252) client over UDP, optionally DTLS.
+    One confirmable POST per uplink, retransmitted with
+    exponential backoff until it is acknowledged. The DTLS
+    session stays up between uplinks.
+*/
+
+#define COAP_VERSION            1
+#define COAP_TYPE_CON           0
+#define COAP_TYPE_NON           1
+#define COAP_TYPE_ACK           2
+#define COAP_TYPE_RST           3
+#define COAP_CODE_EMPTY         0x00
+#define COAP_CODE_POST          0x02
+#define COAP_OPTION_URIPATH     11
+#define COAP_OPTION_URIQUERY    15
+#define COAP_TOKENLENGTH        4
+#define COAP_PAYLOADMARKER      0xFF
+
+/****************** private function prototypes *********************/
+int coapConnect();
+void coapDisconnect();
+int coapWriteMessage(uint8_t *pMessage, int iLength);
+int coapReadMessage(uint32_t uiTimeoutMs);
+int coapPutOption(int iPos, uint16_t *pLastOption, uint16_t uiOption, const char *sValue);
+int coapBuildUplink(tUplinkRecord *pRecord, uint16_t uiMessageId);
+int coapHandleResponse(uint8_t bCode, int iPayloadOffset, int iLength);
+int coapParseMessage(int iLength, uint8_t *pType, uint8_t *pCode, uint16_t *pMessageId, int *pPayloadOffset);
+void coapSendEmptyAck(uint16_t uiMessageId);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static int miCoapSocketFd = -1;
+static SSL_CTX *mpCoapDtlsContext = NULL;
+static SSL *mpCoapDtlsConn = NULL;
+static bool mbCoapConnected = false;
+static uint16_t muiCoapMessageId = 0;
+static uint8_t mabCoapToken[COAP_TOKENLENGTH];
+static unsigned int muiCoapSeed = 0;
+static uint8_t mabCoapTxMessage[COAP_MESSAGEMAXSIZE];
+static uint8_t mabCoapRxMessage[COAP_MESSAGEMAXSIZE];
+static char msCoapHost[STRUCTS_SERVREQ_MAXSTRSIZE];
+static char msCoapDeviceId[STRUCTS_SERVREQ_MAXSTRSIZE];
+static uint32_t muiCoapPort = COAP_PORT;
+/********************************************************************/
+
+const tCommsTransport sCoapTransport =
+{
+    .name = "coap",
+    .init = coapInit,
+    .sendUplink = coapSendUplink,
+    .poll = NULL,
+    .close = coapClose,
+};
+
+/************************ coapInit **************************
+    DTLS needs its own SSL context (different method), it
+    shares the OpenSSL library state set up by sslInit().
+************************************************************/
+int coapInit()
+{
+    const tConfig *pConfig = configGet();
+    snprintf(msCoapHost, sizeof(msCoapHost), "%s", pConfig->host);
+    snprintf(msCoapDeviceId, sizeof(msCoapDeviceId), "%s", pConfig->deviceId);
+    #if COAP_USEDTLS == 1
+        muiCoapPort = (pConfig->coapPort != 0) ? pConfig->coapPort : COAP_DTLSPORT;
+    #else
+        muiCoapPort = (pConfig->coapPort != 0) ? pConfig->coapPort : COAP_PORT;
+    #endif
+    muiCoapSeed = (unsigned int)printGetMonotonicTimeUs() ^ (unsigned int)getpid();
+    muiCoapMessageId = (uint16_t)rand_r(&muiCoapSeed);
+    #if COAP_USEDTLS == 1
+        mpCoapDtlsContext = SSL_CTX_new(DTLS_client_method());
+        if(mpCoapDtlsContext == NULL)
+        {
+            printf("[ERROR] (%s) %s: Could not create DTLS context.\n", printTimestamp(), __func__);
+            return -1;
+        }
+        printf("[INFO] (%s) %s: CoAP over DTLS to %s:%u.\n", printTimestamp(), __func__, msCoapHost, muiCoapPort);
+    #else
+        printf("[INFO] (%s) %s: CoAP over UDP to %s:%u.\n", printTimestamp(), __func__, msCoapHost, muiCoapPort);
+    #endif
+    return 0;
+}
+
+/********************* coapSendUplink ***********************
+    Confirmable POST, retransmitted after ACK_TIMEOUT *
+    (1..ACK_RANDOM_FACTOR), doubling every time, at most
+    COAP_MAXRETRANSMIT times, not past the commsSetDeadline()
+    deadline. Handles both a piggybacked response and an
+    empty ACK followed by a separate one.
+************************************************************/
+int coapSendUplink(tUplinkRecord *pRecord)
+{
+    uint16_t uiMessageId;
+    uint32_t uiTimeoutMs;
+    int iLength, iAttempt, iRxLength, iPayloadOffset;
+    uint8_t bType, bCode;
+    uint16_t uiRxMessageId;
+    bool bAcked = false;
+
+    if(!mbCoapConnected && coapConnect() < 0)
+    {
+        return -1;
+    }
+
+    uiMessageId = muiCoapMessageId;
+    muiCoapMessageId += 1;
+    uint32_t uiToken = (uint32_t)rand_r(&muiCoapSeed);
+    memcpy(mabCoapToken, &uiToken, COAP_TOKENLENGTH);
+    iLength = coapBuildUplink(pRecord, uiMessageId);
+    uiTimeoutMs = COAP_ACKTIMEOUTMS + (uint32_t)(rand_r(&muiCoapSeed) % (COAP_ACKTIMEOUTMS * COAP_ACKRANDOMPERCENT / 100 + 1));
+
+    TRACE_BEGIN("coapExchange");
+    for(iAttempt=0; iAttempt<=COAP_MAXRETRANSMIT && !bAcked; iAttempt+=1)
+    {
+        if(iAttempt > 0)
+        {
+            printf("[WARNING] (%s) %s: No ACK for message id %u, retransmission %i.\n", printTimestamp(), __func__, uiMessageId, iAttempt);
+        }
+        if(coapWriteMessage(mabCoapTxMessage, iLength) < 0)
+        {
+            break;
+        }
+        uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + (commsTimeoutMs(uiTimeoutMs) * 1000ULL);
+        while(!bAcked && printGetMonotonicTimeUs() < ulDeadlineUs)
+        {
+            iRxLength = coapReadMessage((uint32_t)((ulDeadlineUs - printGetMonotonicTimeUs()) / 1000));
+            if(iRxLength <= 0 || coapParseMessage(iRxLength, &bType, &bCode, &uiRxMessageId, &iPayloadOffset) < 0)
+            {
+                continue;
+            }
+            if((bType == COAP_TYPE_ACK || bType == COAP_TYPE_RST) && uiRxMessageId == uiMessageId)
+            {
+                if(bType == COAP_TYPE_RST)
+                {
+                    printf("[ERROR] (%s) %s: Server reset message id %u.\n", printTimestamp(), __func__, uiMessageId);
+                    TRACE_END("coapExchange");
+                    return -1;
+                }
+                if(bCode != COAP_CODE_EMPTY)
+                {
+                    // piggybacked response
+                    TRACE_END("coapExchange");
+                    return coapHandleResponse(bCode, iPayloadOffset, iRxLength);
+                }
+                bAcked = true; // separate response follows
+            }
+        }
+        uiTimeoutMs *= 2;
+    }
+
+    if(bAcked)
+    {
+        uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + (commsTimeoutMs(COAP_SEPARATEWAITMS) * 1000ULL);
+        while(printGetMonotonicTimeUs() < ulDeadlineUs)
+        {
+            iRxLength = coapReadMessage((uint32_t)((ulDeadlineUs - printGetMonotonicTimeUs()) / 1000));
+            if(iRxLength <= 0 || coapParseMessage(iRxLength, &bType, &bCode, &uiRxMessageId, &iPayloadOffset) < 0)
+            {
+                continue;
+            }
+            if((bType == COAP_TYPE_CON || bType == COAP_TYPE_NON) && (mabCoapRxMessage[0] & 0x0f) == COAP_TOKENLENGTH && memcmp(&mabCoapRxMessage[4], mabCoapToken, COAP_TOKENLENGTH) == 0)
+            {
+                if(bType == COAP_TYPE_CON)
+                {
+                    coapSendEmptyAck(uiRxMessageId);
+                }
+                TRACE_END("coapExchange");
+                return coapHandleResponse(bCode, iPayloadOffset, iRxLength);
+            }
+        }
+    }
+
+    TRACE_END("coapExchange");
+    printf("[ERROR] (%s) %s: Uplink message id %u got no response.\n", printTimestamp(), __func__, uiMessageId);
+    coapDisconnect(); // DTLS session might be gone (server restart), handshake again next time
+    return -1;
+}
+
+void coapClose()
+{
+    coapDisconnect();
+    if(mpCoapDtlsContext != NULL)
+    {
+        SSL_CTX_free(mpCoapDtlsContext);
+        mpCoapDtlsContext = NULL;
+    }
+}
+
+/*********************** coapConnect ************************
+    Connected UDP socket so we only see datagrams from the
+    server, DTLS handshake on top when COAP_USEDTLS == 1.
+************************************************************/
+int coapConnect()
+{
+    struct hostent *pServer;
+    struct sockaddr_in sServerAddr;
+
+    TRACE_BEGIN("coapConnect");
+    miCoapSocketFd = socket(AF_INET, SOCK_DGRAM, 0);
+    if(miCoapSocketFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Failed to open socket for \'%s\'\n", printTimestamp(), __func__, msCoapHost);
+        TRACE_END("coapConnect");
+        return -1;
+    }
+    pServer = gethostbyname(msCoapHost);
+    if(pServer == NULL)
+    {
+        printf("[ERROR] (%s) %s: No such host: \'%s\'\n", printTimestamp(), __func__, msCoapHost);
+        coapDisconnect();
+        TRACE_END("coapConnect");
+        return -1;
+    }
+    memset(&sServerAddr, 0, sizeof(sServerAddr));
+    sServerAddr.sin_family = AF_INET;
+    sServerAddr.sin_port = htons(muiCoapPort);
+    memcpy(&sServerAddr.sin_addr.s_addr, pServer->h_addr, pServer->h_length);
+    if(connect(miCoapSocketFd, (struct sockaddr *)&sServerAddr, sizeof(sServerAddr)) < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not connect udp socket. Error code %i.\n", printTimestamp(), __func__, errno);
+        coapDisconnect();
+        TRACE_END("coapConnect");
+        return -1;
+    }
+
+    #if COAP_USEDTLS == 1
+        uint32_t uiTimeoutMs = commsTimeoutMs(configGet()->socketTimeoutSec * 1000);
+        struct timeval sTimeout = {.tv_sec = uiTimeoutMs / 1000, .tv_usec = (uiTimeoutMs % 1000) * 1000};
+        BIO *pBio = BIO_new_dgram(miCoapSocketFd, BIO_NOCLOSE);
+        BIO_ctrl(pBio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &sServerAddr);
+        BIO_ctrl(pBio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &sTimeout);
+        mpCoapDtlsConn = SSL_new(mpCoapDtlsContext);
+        SSL_set_bio(mpCoapDtlsConn, pBio, pBio);
+        ERR_clear_error(); // clear error queue
+        int iResult = SSL_connect(mpCoapDtlsConn);
+        if(iResult != 1)
+        {
+            printf("[ERROR] (%s) %s: DTLS handshake failed. Error code %i.\n\t%s\n", printTimestamp(), __func__, SSL_get_error(mpCoapDtlsConn, iResult), ERR_error_string(ERR_get_error(), NULL));
+            coapDisconnect();
+            TRACE_END("coapConnect");
+            return -1;
+        }
+    #endif
+    mbCoapConnected = true;
+    TRACE_END("coapConnect");
+    return 0;
+}
+
+void coapDisconnect()
+{
+    if(mpCoapDtlsConn != NULL)
+    {
+        SSL_shutdown(mpCoapDtlsConn);
+        SSL_free(mpCoapDtlsConn); // also frees the dgram BIO
+        mpCoapDtlsConn = NULL;
+    }
+    if(miCoapSocketFd >= 0)
+    {
+        close(miCoapSocketFd);
+        miCoapSocketFd = -1;
+    }
+    mbCoapConnected = false;
+}
+
+int coapWriteMessage(uint8_t *pMessage, int iLength)
+{
+    int iResult;
+    #if COAP_USEDTLS == 1
+        iResult = SSL_write(mpCoapDtlsConn, pMessage, iLength);
+    #else
+        iResult = send(miCoapSocketFd, pMessage, iLength, 0);
+    #endif
+    if(iResult != iLength)
+    {
+        printf("[ERROR] (%s) %s: Could not send datagram, result %i.\n", printTimestamp(), __func__, iResult);
+        return -1;
+    }
+    commsAddByteCounts(iLength, 0);
+    return 0;
+}
+
+/********************** coapReadMessage *********************
+    Waits up to uiTimeoutMs for one datagram in
+    mabCoapRxMessage. Returns its length, 0 on timeout.
+************************************************************/
+int coapReadMessage(uint32_t uiTimeoutMs)
+{
+    struct pollfd sPollFd = {.fd = miCoapSocketFd, .events = POLLIN, .revents = 0};
+    int iResult;
+
+    #if COAP_USEDTLS == 1
+        if(SSL_pending(mpCoapDtlsConn) == 0 && poll(&sPollFd, 1, (int)uiTimeoutMs) <= 0)
+        {
+            return 0;
+        }
+        iResult = SSL_read(mpCoapDtlsConn, mabCoapRxMessage, sizeof(mabCoapRxMessage));
+    #else
+        if(poll(&sPollFd, 1, (int)uiTimeoutMs) <= 0)
+        {
+            return 0;
+        }
+        iResult = recv(miCoapSocketFd, mabCoapRxMessage, sizeof(mabCoapRxMessage), 0);
+    #endif
+    if(iResult < 0)
+    {
+        return 0; // e.g. ICMP port unreachable, just wait for the retransmission
+    }
+    commsAddByteCounts(0, iResult);
+    return iResult;
+}
+
+/********************** coapPutOption ***********************
+    Appends an option to mabCoapTxMessage at iPos, options
+    must be added in ascending order (delta encoding).
+************************************************************/
+int coapPutOption(int iPos, uint16_t *pLastOption, uint16_t uiOption, const char *sValue)
+{
+    int iLength = strlen(sValue);
+    int iDelta = uiOption - *pLastOption;
+    int iHeaderPos = iPos;
+    uint8_t bDeltaNibble, bLengthNibble;
+
+    iPos += 1;
+    if(iDelta < 13)
+    {
+        bDeltaNibble = iDelta;
+    }
+    else
+    {
+        bDeltaNibble = 13;
+        mabCoapTxMessage[iPos++] = iDelta - 13;
+    }
+    if(iLength < 13)
+    {
+        bLengthNibble = iLength;
+    }
+    else
+    {
+        bLengthNibble = 13;
+        mabCoapTxMessage[iPos++] = iLength - 13;
+    }
+    mabCoapTxMessage[iHeaderPos] = (bDeltaNibble << 4) | bLengthNibble;
+    memcpy(&mabCoapTxMessage[iPos], sValue, iLength);
+    *pLastOption = uiOption;
+    return iPos + iLength;
+}
+
+int coapBuildUplink(tUplinkRecord *pRecord, uint16_t uiMessageId)
+{
+    char sQuery[STRUCTS_SERVREQ_MAXSTRSIZE + 4];
+    uint16_t uiLastOption = 0;
+    int iDataLength = pRecord->cmd.payloadSize - 1; // -1 since payloadsize includes the read request byte
+    int iPos = 0;
+
+    if(iDataLength < 0 || iDataLength > STRUCTS_SENDCMDPAYLOADSIZE)
+    {
+        iDataLength = STRUCTS_SENDCMDPAYLOADSIZE;
+    }
+    mabCoapTxMessage[iPos++] = (COAP_VERSION << 6) | (COAP_TYPE_CON << 4) | COAP_TOKENLENGTH;
+    mabCoapTxMessage[iPos++] = COAP_CODE_POST;
+    mabCoapTxMessage[iPos++] = (uint8_t)(uiMessageId >> 8);
+    mabCoapTxMessage[iPos++] = (uint8_t)(uiMessageId & 0xff);
+    memcpy(&mabCoapTxMessage[iPos], mabCoapToken, COAP_TOKENLENGTH);
+    iPos += COAP_TOKENLENGTH;
+    iPos = coapPutOption(iPos, &uiLastOption, COAP_OPTION_URIPATH, COAP_UPLINKPATH);
+    snprintf(sQuery, sizeof(sQuery), "id=%s", msCoapDeviceId);
+    iPos = coapPutOption(iPos, &uiLastOption, COAP_OPTION_URIQUERY, sQuery);
+    snprintf(sQuery, sizeof(sQuery), "s=%u", commsRecordSeqNr(pRecord));
+    iPos = coapPutOption(iPos, &uiLastOption, COAP_OPTION_URIQUERY, sQuery);
+    snprintf(sQuery, sizeof(sQuery), "t=%lu", pRecord->time);
+    iPos = coapPutOption(iPos, &uiLastOption, COAP_OPTION_URIQUERY, sQuery);
+    if(pRecord->encoding != UPLENC_RAW)
+    {
+        snprintf(sQuery, sizeof(sQuery), "e=%s", commsEncodingName(pRecord->encoding)); // edge aggregation
+        iPos = coapPutOption(iPos, &uiLastOption, COAP_OPTION_URIQUERY, sQuery);
+    }
+    mabCoapTxMessage[iPos++] = COAP_PAYLOADMARKER;
+    memcpy(&mabCoapTxMessage[iPos], pRecord->cmd.payload, iDataLength);
+    return iPos + iDataLength;
+}
+
+/******************** coapParseMessage **********************
+    Validates the header of the message in mabCoapRxMessage
+    and finds the payload (skips the options).
+************************************************************/
+int coapParseMessage(int iLength, uint8_t *pType, uint8_t *pCode, uint16_t *pMessageId, int *pPayloadOffset)
+{
+    int iPos;
+    uint8_t bTokenLength;
+
+    if(iLength < 4 || (mabCoapRxMessage[0] >> 6) != COAP_VERSION)
+    {
+        return -1;
+    }
+    *pType = (mabCoapRxMessage[0] >> 4) & 0x03;
+    bTokenLength = mabCoapRxMessage[0] & 0x0f;
+    *pCode = mabCoapRxMessage[1];
+    *pMessageId = (mabCoapRxMessage[2] << 8) | mabCoapRxMessage[3];
+    iPos = 4 + bTokenLength;
+    while(iPos < iLength && mabCoapRxMessage[iPos] != COAP_PAYLOADMARKER)
+    {
+        uint8_t bDelta = mabCoapRxMessage[iPos] >> 4;
+        uint32_t uiOptionLength = mabCoapRxMessage[iPos] & 0x0f;
+        iPos += 1;
+        if(bDelta == 15 || uiOptionLength == 15)
+        {
+            return -1;
+        }
+        iPos += (bDelta == 13) ? 1 : ((bDelta == 14) ? 2 : 0);
+        if(uiOptionLength == 13 && iPos < iLength)
+        {
+            uiOptionLength = mabCoapRxMessage[iPos] + 13;
+            iPos += 1;
+        }
+        else if(uiOptionLength == 14 && iPos + 1 < iLength)
+        {
+            uiOptionLength = ((mabCoapRxMessage[iPos] << 8) | mabCoapRxMessage[iPos + 1]) + 269;
+            iPos += 2;
+        }
+        iPos += uiOptionLength;
+    }
+    *pPayloadOffset = (iPos < iLength) ? iPos + 1 : iLength;
+    return 0;
+}
+
+int coapHandleResponse(uint8_t bCode, int iPayloadOffset, int iLength)
+{
+    if((bCode >> 5) != 2)
+    {
+        printf("[ERROR] (%s) %s: Server replied %u.%02u.\n", printTimestamp(), __func__, bCode >> 5, bCode & 0x1f);
+        return -1;
+    }
+    if((iLength - iPayloadOffset) >= STRUCTS_DECKEDREPLYPAYLOADSIZE)
+    {
+        tCtrlDeckedReply *pReplyForController = getCtrlDeckedReply();
+        memcpy(pReplyForController->payload, &mabCoapRxMessage[iPayloadOffset], STRUCTS_DECKEDREPLYPAYLOADSIZE);
+        printf("[INFO] (%s) %s: Received downlink:\n", printTimestamp(), __func__);
+        printf("\t# Bytes (HEX): %s\n", printBytesAsHexString((uintptr_t)pReplyForController->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE, true, ", "));
+    }
+    return 0;
+}
+
+void coapSendEmptyAck(uint16_t uiMessageId)
+{
+    uint8_t abAck[4];
+    abAck[0] = (COAP_VERSION << 6) | (COAP_TYPE_ACK << 4);
+    abAck[1] = COAP_CODE_EMPTY;
+    abAck[2] = (uint8_t)(uiMessageId >> 8);
+    abAck[3] = (uint8_t)(uiMessageId & 0xff);
+    coapWriteMessage(abAck, sizeof(abAck));
+}
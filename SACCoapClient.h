@@ -0,0 +1,31 @@
+#ifndef SACCOAPCLIENT_H
+#define SACCOAPCLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACServerComms.h"
+
+#define COAP_USEDTLS            1 // coaps on COAP_DTLSPORT, plain CoAP on COAP_PORT otherwise
+#define COAP_PORT               5683 // default of [comms] coap_port
+#define COAP_DTLSPORT           5684 // default of [comms] coap_port with COAP_USEDTLS
+#define COAP_UPLINKPATH         "up"
+#define COAP_ACKTIMEOUTMS       2000 // RFC 7252 ACK_TIMEOUT
+#define COAP_ACKRANDOMPERCENT   50 // RFC 7252 ACK_RANDOM_FACTOR 1.5
+#define COAP_MAXRETRANSMIT      4
+#define COAP_SEPARATEWAITMS     5000 // how long to wait for a separate response after an empty ACK
+#define COAP_MESSAGEMAXSIZE     128
+
+/*
+    Uplink: confirmable POST coap(s)://<host>/up?id=<device>&s=<seqNr>&t=<unix time>
+    with the controller payload bytes as binary payload.
+    Downlink: the (piggybacked or separate) 2.xx response payload,
+    STRUCTS_DECKEDREPLYPAYLOADSIZE bytes, copied into the decked reply.
+*/
+
+extern const tCommsTransport sCoapTransport;
+
+int coapInit();
+int coapSendUplink(tUplinkRecord *pRecord);
+void coapClose();
+
+#endif
@@ -0,0 +1,512 @@
+#include "SACConfig.h"
+#include "SACPrintUtils.h"
+#include "SACServerComms.h"
+#include "SACRPiIotSlave.h"
+#include "SACEdgeAgg.h"
+#include "SACBulkUpload.h"
+#include "SACEndpoints.h"
+#include "SACLanGateway.h"
+#include "SACRules.h"
+#include "SACHistory.h"
+#include "SACUplinkSched.h"
+
+#include "string.h" /* memcpy, memset, strcmp */
+#include <strings.h> /* strcasecmp */
+#include <stdlib.h> /* strtoul */
+#include <stddef.h> /* offsetof */
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include "stdio.h"
+#include "unistd.h"
+
+#if ADDUSERREPLYINREQUEST == 1
+#define CONFIG_DEFAULTUSERREPLY     USERREPLYINREQUEST
+#else
+#define CONFIG_DEFAULTUSERREPLY     ""
+#endif
+
+#define CONFIG_DEFAULTS \
+{ \
+    .transport = COMMS_TRANSPORT, \
+    .host = IOT_HOST, \
+    .endpoints = "", \
+    .hedgePercentile = ENDPOINTS_HEDGEPERCENTILE, \
+    .path = IOT_PATH, \
+    .deviceId = IOT_DEVICEID, \
+    .useSsl = (USESSL == 1), \
+    .ktls = (HTTPUSEKTLS == 1), \
+    .ioUring = (HTTPUSEIOURING == 1), \
+    .pipelineDepth = HTTPPIPEDEPTH, \
+    .httpPort = 0, \
+    .mqttPort = 0, \
+    .coapPort = 0, \
+    .userReply = CONFIG_DEFAULTUSERREPLY, \
+    .socketTimeoutSec = HTTPSOCKETTIMEOUTSEC, \
+    .i2cPollIntervalUs = I2C_POLLINTERVALUS, \
+    .i2cEventPollIntervalUs = I2C_EVENTPOLLINTERVALUS, \
+    .housekeepingIntervalMs = HOUSEKEEPINGINTERVALMS, \
+    .aggEnabled = (EDGEAGG_ENABLED == 1), \
+    .aggFields = EDGEAGG_FIELDS, \
+    .aggMaxStalenessSec = EDGEAGG_MAXSTALENESSSEC, \
+    .aggKeyframeSec = EDGEAGG_KEYFRAMESEC, \
+    .bulkEnabled = (BULK_ENABLED == 1), \
+    .bulkThreshold = BULK_THRESHOLD, \
+    .gwAggregator = false, \
+    .gwAddress = "", \
+    .gwPort = LANGW_PORT, \
+    .rulesEnabled = (RULES_ENABLED == 1), \
+    .historyEnabled = (HISTORY_ENABLED == 1), \
+    .historyRecords = HISTORY_RECORDS, \
+    .uplinkRatePerMin = UPLSCHED_RATEPERMIN, \
+    .uplinkBurst = UPLSCHED_BURST, \
+    .generation = 0, \
+}
+
+typedef enum
+{
+    CONFIG_STRING, // size = buffer size, min = min length
+    CONFIG_UINT, // min..max
+    CONFIG_BOOL, // 0/1, yes/no, true/false, on/off
+    CONFIG_TRANSPORT, // http, mqtt, coap, lan
+    CONFIG_FIELDLAYOUT, // string, edgeAggParseLayout()
+    CONFIG_ENDPOINTLIST, // string, endpointsParse()
+} tConfigType;
+
+typedef struct
+{
+    const char *section;
+    const char *key;
+    tConfigType type;
+    size_t offset;
+    size_t size;
+    uint32_t min;
+    uint32_t max;
+    uint32_t changeFlag; // CONFIG_CHANGED_*
+} tConfigEntry;
+
+typedef enum
+{
+    CONFIG_RELOAD_IDLE,
+    CONFIG_RELOAD_RUNNING, // worker parses into the spare snapshot
+    CONFIG_RELOAD_READY, // spare snapshot valid, waits for configApplyPending()
+    CONFIG_RELOAD_FAILED, // error text in msConfigError
+} tConfigReloadState;
+
+/****************** private function prototypes *********************/
+void *configReloadThread(void *pArg);
+const tConfigEntry *configFindEntry(const char *sSection, const char *sKey);
+int configParseValue(const tConfigEntry *pEntry, const char *sValue, tConfig *pConfig);
+char *configTrim(char *sString);
+void configLog(const tConfig *pConfig);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static const tConfigEntry masConfigSchema[] =
+{
+    {"comms", "transport", CONFIG_TRANSPORT, offsetof(tConfig, transport), sizeof(uint32_t), 0, 0, CONFIG_CHANGED_TRANSPORT},
+    {"comms", "host", CONFIG_STRING, offsetof(tConfig, host), STRUCTS_SERVREQ_MAXSTRSIZE, 1, 0, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "endpoints", CONFIG_ENDPOINTLIST, offsetof(tConfig, endpoints), CONFIG_ENDPOINTSMAXSIZE, 0, 0, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "hedge_percentile", CONFIG_UINT, offsetof(tConfig, hedgePercentile), sizeof(uint32_t), 0, 99, CONFIG_CHANGED_REQUEST},
+    {"comms", "path", CONFIG_STRING, offsetof(tConfig, path), STRUCTS_SERVREQ_MAXSTRSIZE, 1, 0, CONFIG_CHANGED_REQUEST},
+    {"comms", "device_id", CONFIG_STRING, offsetof(tConfig, deviceId), STRUCTS_SERVREQ_MAXSTRSIZE, 1, 0, CONFIG_CHANGED_ENDPOINT}, // mqtt client id and topics
+    {"comms", "use_ssl", CONFIG_BOOL, offsetof(tConfig, useSsl), sizeof(bool), 0, 1, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "ktls", CONFIG_BOOL, offsetof(tConfig, ktls), sizeof(bool), 0, 1, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "io_uring", CONFIG_BOOL, offsetof(tConfig, ioUring), sizeof(bool), 0, 1, CONFIG_CHANGED_REQUEST},
+    {"comms", "http_port", CONFIG_UINT, offsetof(tConfig, httpPort), sizeof(uint32_t), 0, 65535, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "mqtt_port", CONFIG_UINT, offsetof(tConfig, mqttPort), sizeof(uint32_t), 0, 65535, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "coap_port", CONFIG_UINT, offsetof(tConfig, coapPort), sizeof(uint32_t), 0, 65535, CONFIG_CHANGED_ENDPOINT},
+    {"comms", "pipeline_depth", CONFIG_UINT, offsetof(tConfig, pipelineDepth), sizeof(uint32_t), 0, HTTPPIPE_MAXDEPTH, CONFIG_CHANGED_PIPELINE},
+    {"comms", "user_reply", CONFIG_STRING, offsetof(tConfig, userReply), STRUCTS_SERVREQ_MAXSTRSIZE, 0, 0, CONFIG_CHANGED_REQUEST},
+    {"timeouts", "socket_sec", CONFIG_UINT, offsetof(tConfig, socketTimeoutSec), sizeof(uint32_t), 1, 300, CONFIG_CHANGED_TIMEOUT},
+    {"i2c", "poll_interval_us", CONFIG_UINT, offsetof(tConfig, i2cPollIntervalUs), sizeof(uint32_t), 100, 1000000, CONFIG_CHANGED_I2C},
+    {"i2c", "event_poll_interval_us", CONFIG_UINT, offsetof(tConfig, i2cEventPollIntervalUs), sizeof(uint32_t), 100, 10000000, CONFIG_CHANGED_I2C},
+    {"i2c", "housekeeping_interval_ms", CONFIG_UINT, offsetof(tConfig, housekeepingIntervalMs), sizeof(uint32_t), 10, 60000, CONFIG_CHANGED_I2C},
+    {"aggregation", "enabled", CONFIG_BOOL, offsetof(tConfig, aggEnabled), sizeof(bool), 0, 1, CONFIG_CHANGED_AGGREGATION},
+    {"aggregation", "fields", CONFIG_FIELDLAYOUT, offsetof(tConfig, aggFields), STRUCTS_SERVREQ_MAXSTRSIZE, 2, 0, CONFIG_CHANGED_AGGREGATION},
+    {"aggregation", "max_staleness_sec", CONFIG_UINT, offsetof(tConfig, aggMaxStalenessSec), sizeof(uint32_t), 1, 86400, CONFIG_CHANGED_AGGREGATION},
+    {"aggregation", "keyframe_sec", CONFIG_UINT, offsetof(tConfig, aggKeyframeSec), sizeof(uint32_t), 60, 86400, CONFIG_CHANGED_AGGREGATION},
+    {"bulk", "enabled", CONFIG_BOOL, offsetof(tConfig, bulkEnabled), sizeof(bool), 0, 1, CONFIG_CHANGED_REQUEST},
+    {"bulk", "threshold", CONFIG_UINT, offsetof(tConfig, bulkThreshold), sizeof(uint32_t), BULK_CAUGHTUP + 1, BULK_MAXTHRESHOLD, CONFIG_CHANGED_REQUEST},
+    {"gateway", "aggregator", CONFIG_BOOL, offsetof(tConfig, gwAggregator), sizeof(bool), 0, 1, CONFIG_CHANGED_GATEWAY},
+    {"gateway", "address", CONFIG_STRING, offsetof(tConfig, gwAddress), STRUCTS_SERVREQ_MAXSTRSIZE, 0, 0, CONFIG_CHANGED_ENDPOINT | CONFIG_CHANGED_GATEWAY}, // slaves reconnect
+    {"gateway", "port", CONFIG_UINT, offsetof(tConfig, gwPort), sizeof(uint32_t), 1, 65535, CONFIG_CHANGED_ENDPOINT | CONFIG_CHANGED_GATEWAY},
+    {"rules", "enabled", CONFIG_BOOL, offsetof(tConfig, rulesEnabled), sizeof(bool), 0, 1, CONFIG_CHANGED_REQUEST},
+    {"history", "enabled", CONFIG_BOOL, offsetof(tConfig, historyEnabled), sizeof(bool), 0, 1, CONFIG_CHANGED_HISTORY},
+    {"history", "records", CONFIG_UINT, offsetof(tConfig, historyRecords), sizeof(uint32_t), HISTORY_MINRECORDS, HISTORY_MAXRECORDS, CONFIG_CHANGED_HISTORY},
+    {"uplink", "rate_per_min", CONFIG_UINT, offsetof(tConfig, uplinkRatePerMin), sizeof(uint32_t), 0, 60000, CONFIG_CHANGED_UPLINK},
+    {"uplink", "burst", CONFIG_UINT, offsetof(tConfig, uplinkBurst), sizeof(uint32_t), 1, UPLSCHED_MAXBURST, CONFIG_CHANGED_UPLINK},
+};
+static const char *masConfigTransportNames[] = {"http", "mqtt", "coap", "lan"}; // indexed by COMMS_TRANSPORT_*
+static const tConfig msConfigDefaults = CONFIG_DEFAULTS;
+static tConfig masConfigSnapshots[2] = {CONFIG_DEFAULTS, CONFIG_DEFAULTS}; // usable before configInit()
+static tConfig *mpConfigCurrent = &masConfigSnapshots[0];
+static const char *msConfigPath = CONFIG_PATH;
+static int miConfigReloadState = CONFIG_RELOAD_IDLE; // tConfigReloadState, shared with the worker
+static void (*mpConfigNotify)() = NULL;
+static char msConfigError[CONFIG_ERRORMAXSIZE];
+/********************************************************************/
+
+
+/*********************** configInit *************************
+    Loads sPath synchronously at startup. Without the file
+    the built-in defaults are used, a broken file is
+    reported and the defaults are used as well.
+************************************************************/
+int configInit(const char *sPath)
+{
+    msConfigPath = sPath;
+    configSetDefaults(&masConfigSnapshots[0]);
+    mpConfigCurrent = &masConfigSnapshots[0];
+    if(access(sPath, F_OK) != 0)
+    {
+        printf("[INFO] (%s) %s: No config file \'%s\', using the built-in defaults.\n", printTimestamp(), __func__, sPath);
+        configLog(mpConfigCurrent);
+        return 0;
+    }
+    if(configLoad(sPath, &masConfigSnapshots[1], msConfigError, sizeof(msConfigError)) < 0)
+    {
+        printf("[ERROR] (%s) %s: %s, using the built-in defaults.\n", printTimestamp(), __func__, msConfigError);
+        configLog(mpConfigCurrent);
+        return -1;
+    }
+    masConfigSnapshots[1].generation = 1;
+    mpConfigCurrent = &masConfigSnapshots[1];
+    printf("[INFO] (%s) %s: Loaded \'%s\'.\n", printTimestamp(), __func__, sPath);
+    configLog(mpConfigCurrent);
+    return 0;
+}
+
+/************************ configGet *************************
+    Current snapshot, only for the loop thread. The built-in
+    defaults until configInit() loaded the file.
+************************************************************/
+const tConfig *configGet()
+{
+    return mpConfigCurrent;
+}
+
+void configSetDefaults(tConfig *pConfig)
+{
+    memcpy(pConfig, &msConfigDefaults, sizeof(tConfig));
+}
+
+/*********************** configLoad *************************
+    Parses sPath into pConfig, starting from the defaults.
+    Touches nothing else, so the reload worker can call it.
+    Returns < 0 on error with the reason in sError, pConfig
+    is then garbage.
+************************************************************/
+int configLoad(const char *sPath, tConfig *pConfig, char *sError, int iErrorSize)
+{
+    FILE *pFile;
+    char sLine[CONFIG_LINEMAXSIZE];
+    char sSection[32] = "";
+    char *sKey;
+    char *sValue;
+    char *pEnd;
+    const tConfigEntry *pEntry;
+    int iLine = 0;
+
+    configSetDefaults(pConfig);
+    pFile = fopen(sPath, "r");
+    if(pFile == NULL)
+    {
+        snprintf(sError, iErrorSize, "Could not open \'%s\', errno %i", sPath, errno);
+        return -1;
+    }
+    while(fgets(sLine, sizeof(sLine), pFile) != NULL)
+    {
+        iLine += 1;
+        if(strchr(sLine, '\n') == NULL && !feof(pFile))
+        {
+            snprintf(sError, iErrorSize, "%s:%i: line longer than %i characters", sPath, iLine, CONFIG_LINEMAXSIZE - 2);
+            fclose(pFile);
+            return -1;
+        }
+        sKey = configTrim(sLine);
+        if(sKey[0] == 0x00 || sKey[0] == '#' || sKey[0] == ';')
+        {
+            continue;
+        }
+        if(sKey[0] == '[')
+        {
+            pEnd = strchr(sKey, ']');
+            if(pEnd == NULL || pEnd[1] != 0x00 || (size_t)(pEnd - sKey - 1) >= sizeof(sSection))
+            {
+                snprintf(sError, iErrorSize, "%s:%i: bad section header", sPath, iLine);
+                fclose(pFile);
+                return -1;
+            }
+            *pEnd = 0x00;
+            snprintf(sSection, sizeof(sSection), "%s", configTrim(&sKey[1]));
+            continue;
+        }
+        sValue = strchr(sKey, '=');
+        if(sValue == NULL)
+        {
+            snprintf(sError, iErrorSize, "%s:%i: expected key = value", sPath, iLine);
+            fclose(pFile);
+            return -1;
+        }
+        *sValue = 0x00;
+        sKey = configTrim(sKey);
+        sValue = &sValue[1];
+        for(pEnd = sValue; *pEnd != 0x00; pEnd += 1)
+        {
+            if((*pEnd == '#' || *pEnd == ';') && (pEnd == sValue || isspace((unsigned char)pEnd[-1])))
+            {
+                *pEnd = 0x00; // comment after the value
+                break;
+            }
+        }
+        sValue = configTrim(sValue);
+        pEntry = configFindEntry(sSection, sKey);
+        if(pEntry == NULL)
+        {
+            snprintf(sError, iErrorSize, "%s:%i: unknown key \'%s\' in [%s]", sPath, iLine, sKey, sSection);
+            fclose(pFile);
+            return -1;
+        }
+        if(configParseValue(pEntry, sValue, pConfig) < 0)
+        {
+            snprintf(sError, iErrorSize, "%s:%i: bad value \'%s\' for %s", sPath, iLine, sValue, sKey);
+            fclose(pFile);
+            return -1;
+        }
+    }
+    fclose(pFile);
+    return 0;
+}
+
+/******************** configReloadStart *********************
+    Starts parsing the config file again in a worker thread
+    so the i2c loop never waits for the file system. pNotify
+    (may be NULL) is called from the worker when the result
+    can be picked up with configApplyPending().
+    Returns -1 when a reload is still pending.
+************************************************************/
+int configReloadStart(void (*pNotify)())
+{
+    pthread_t sThread;
+    int iExpected = CONFIG_RELOAD_IDLE;
+
+    if(!__atomic_compare_exchange_n(&miConfigReloadState, &iExpected, CONFIG_RELOAD_RUNNING, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return -1;
+    }
+    mpConfigNotify = pNotify;
+    if(pthread_create(&sThread, NULL, configReloadThread, NULL) != 0)
+    {
+        __atomic_store_n(&miConfigReloadState, CONFIG_RELOAD_IDLE, __ATOMIC_RELEASE);
+        return -1;
+    }
+    pthread_detach(sThread);
+    return 0;
+}
+
+/********************* configReloadThread *******************
+    The current snapshot can't change while the state is
+    RUNNING, so the other one is free.
+************************************************************/
+void *configReloadThread(void *pArg)
+{
+    tConfig *pSpare = (mpConfigCurrent == &masConfigSnapshots[0]) ? &masConfigSnapshots[1] : &masConfigSnapshots[0];
+    int iResult = configLoad(msConfigPath, pSpare, msConfigError, sizeof(msConfigError));
+
+    __atomic_store_n(&miConfigReloadState, (iResult < 0) ? CONFIG_RELOAD_FAILED : CONFIG_RELOAD_READY, __ATOMIC_RELEASE);
+    if(mpConfigNotify != NULL)
+    {
+        mpConfigNotify();
+    }
+    return NULL;
+}
+
+/******************** configApplyPending ********************
+    Called by the loop between two passes of the state
+    machine. Makes a finished reload current and returns
+    what changed (CONFIG_CHANGED_*), 0 when nothing is
+    pending, the reload failed or the file didn't change.
+************************************************************/
+uint32_t configApplyPending()
+{
+    int iState = __atomic_load_n(&miConfigReloadState, __ATOMIC_ACQUIRE);
+    tConfig *pNew;
+    uint32_t uiChanged;
+
+    if(iState == CONFIG_RELOAD_FAILED)
+    {
+        printf("[ERROR] (%s) %s: Reload failed, keeping generation %u. %s.\n", printTimestamp(), __func__, mpConfigCurrent->generation, msConfigError);
+        __atomic_store_n(&miConfigReloadState, CONFIG_RELOAD_IDLE, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if(iState != CONFIG_RELOAD_READY)
+    {
+        return 0;
+    }
+    pNew = (mpConfigCurrent == &masConfigSnapshots[0]) ? &masConfigSnapshots[1] : &masConfigSnapshots[0];
+    uiChanged = configDiff(mpConfigCurrent, pNew);
+    pNew->generation = mpConfigCurrent->generation + 1;
+    mpConfigCurrent = pNew;
+    __atomic_store_n(&miConfigReloadState, CONFIG_RELOAD_IDLE, __ATOMIC_RELEASE);
+    printf("[INFO] (%s) %s: Config generation %u applied, changes 0x%02x.\n", printTimestamp(), __func__, pNew->generation, uiChanged);
+    if(uiChanged != 0)
+    {
+        configLog(pNew);
+    }
+    return uiChanged;
+}
+
+/*********************** configDiff *************************
+    CONFIG_CHANGED_* flags of the keys that differ.
+************************************************************/
+uint32_t configDiff(const tConfig *pOld, const tConfig *pNew)
+{
+    uint32_t uiChanged = 0;
+    size_t i;
+
+    for(i=0; i<sizeof(masConfigSchema) / sizeof(masConfigSchema[0]); i+=1)
+    {
+        const tConfigEntry *pEntry = &masConfigSchema[i];
+        const char *pOldValue = (const char *)pOld + pEntry->offset;
+        const char *pNewValue = (const char *)pNew + pEntry->offset;
+        bool bDiffers = (pEntry->type == CONFIG_STRING || pEntry->type == CONFIG_FIELDLAYOUT || pEntry->type == CONFIG_ENDPOINTLIST) ? (strcmp(pOldValue, pNewValue) != 0) : (memcmp(pOldValue, pNewValue, pEntry->size) != 0);
+        if(bDiffers)
+        {
+            uiChanged |= pEntry->changeFlag;
+        }
+    }
+    return uiChanged;
+}
+
+const tConfigEntry *configFindEntry(const char *sSection, const char *sKey)
+{
+    size_t i;
+    for(i=0; i<sizeof(masConfigSchema) / sizeof(masConfigSchema[0]); i+=1)
+    {
+        if(strcmp(masConfigSchema[i].section, sSection) == 0 && strcmp(masConfigSchema[i].key, sKey) == 0)
+        {
+            return &masConfigSchema[i];
+        }
+    }
+    return NULL;
+}
+
+/******************** configParseValue **********************
+    Strings end up in http request lines and mqtt topics,
+    so spaces and control characters are refused.
+************************************************************/
+int configParseValue(const tConfigEntry *pEntry, const char *sValue, tConfig *pConfig)
+{
+    uint8_t *pField = (uint8_t *)pConfig + pEntry->offset;
+    unsigned long ulValue;
+    char *pEnd;
+    size_t i;
+
+    switch(pEntry->type)
+    {
+        case CONFIG_FIELDLAYOUT:
+        case CONFIG_ENDPOINTLIST:
+            if((pEntry->type == CONFIG_FIELDLAYOUT && edgeAggParseLayout(sValue, NULL) < 0) || (pEntry->type == CONFIG_ENDPOINTLIST && endpointsParse(sValue, NULL) < 0))
+            {
+                return -1;
+            }
+            // fall through, stored like a string
+        case CONFIG_STRING:
+            if(strlen(sValue) < pEntry->min || strlen(sValue) >= pEntry->size)
+            {
+                return -1;
+            }
+            for(i=0; sValue[i] != 0x00; i+=1)
+            {
+                if(!isgraph((unsigned char)sValue[i]))
+                {
+                    return -1;
+                }
+            }
+            memcpy(pField, sValue, strlen(sValue) + 1);
+            return 0;
+
+        case CONFIG_UINT:
+            errno = 0;
+            ulValue = strtoul(sValue, &pEnd, 0);
+            if(sValue[0] == 0x00 || sValue[0] == '-' || *pEnd != 0x00 || errno != 0 || ulValue < pEntry->min || ulValue > pEntry->max)
+            {
+                return -1;
+            }
+            *(uint32_t *)pField = (uint32_t)ulValue;
+            return 0;
+
+        case CONFIG_BOOL:
+            if(strcmp(sValue, "1") == 0 || strcasecmp(sValue, "yes") == 0 || strcasecmp(sValue, "true") == 0 || strcasecmp(sValue, "on") == 0)
+            {
+                *(bool *)pField = true;
+                return 0;
+            }
+            if(strcmp(sValue, "0") == 0 || strcasecmp(sValue, "no") == 0 || strcasecmp(sValue, "false") == 0 || strcasecmp(sValue, "off") == 0)
+            {
+                *(bool *)pField = false;
+                return 0;
+            }
+            return -1;
+
+        case CONFIG_TRANSPORT:
+            for(i=0; i<sizeof(masConfigTransportNames) / sizeof(masConfigTransportNames[0]); i+=1)
+            {
+                if(strcasecmp(sValue, masConfigTransportNames[i]) == 0)
+                {
+                    *(uint32_t *)pField = (uint32_t)i;
+                    return 0;
+                }
+            }
+            return -1;
+    }
+    return -1;
+}
+
+char *configTrim(char *sString)
+{
+    char *pEnd;
+    while(isspace((unsigned char)*sString))
+    {
+        sString += 1;
+    }
+    pEnd = sString + strlen(sString);
+    while(pEnd > sString && isspace((unsigned char)pEnd[-1]))
+    {
+        pEnd -= 1;
+    }
+    *pEnd = 0x00;
+    return sString;
+}
+
+void configLog(const tConfig *pConfig)
+{
+    printf("[INFO] (%s) %s: generation %u: %s to %s%s%s, path \'%s\', device \'%s\', tls %s%s%s, socket timeout %u s, i2c poll %u/%u us, housekeeping %u ms, aggregation %s, bulk upload %s (threshold %u), LAN gateway %s:%u%s, local rules %s, history %s (%u records), rate limit %u/min (burst %u).\n", printTimestamp(), __func__,
+        pConfig->generation,
+        masConfigTransportNames[pConfig->transport],
+        pConfig->host,
+        (pConfig->endpoints[0] != 0x00) ? " via " : "",
+        pConfig->endpoints,
+        pConfig->path,
+        pConfig->deviceId,
+        pConfig->useSsl ? "on" : "off",
+        (pConfig->useSsl && pConfig->ktls) ? " (kernel offload)" : "",
+        pConfig->ioUring ? ", io_uring" : "",
+        pConfig->socketTimeoutSec,
+        pConfig->i2cPollIntervalUs,
+        pConfig->i2cEventPollIntervalUs,
+        pConfig->housekeepingIntervalMs,
+        pConfig->aggEnabled ? pConfig->aggFields : "off",
+        pConfig->bulkEnabled ? "on" : "off",
+        pConfig->bulkThreshold,
+        (pConfig->gwAddress[0] != 0x00) ? pConfig->gwAddress : "*",
+        pConfig->gwPort,
+        pConfig->gwAggregator ? " (aggregator)" : "",
+        pConfig->rulesEnabled ? "on" : "off",
+        pConfig->historyEnabled ? "on" : "off",
+        pConfig->historyRecords,
+        pConfig->uplinkRatePerMin,
+        pConfig->uplinkBurst
+        );
+}
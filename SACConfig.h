@@ -0,0 +1,96 @@
+#ifndef SACCONFIG_H
+#define SACCONFIG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#ifndef CONFIG_PATH // -D in test builds that run the whole daemon (make soaktest)
+#define CONFIG_PATH                 "/home/pi/iot/SACIot.conf"
+#endif
+#define CONFIG_LINEMAXSIZE          256
+#define CONFIG_ERRORMAXSIZE         160
+#define CONFIG_ENDPOINTSMAXSIZE     160 // [comms] endpoints list
+
+#define CONFIG_CHANGED_TRANSPORT    (1 << 0) // other uplink backend
+#define CONFIG_CHANGED_ENDPOINT     (1 << 1) // host, endpoints, port, tls or device id: reconnect
+#define CONFIG_CHANGED_REQUEST      (1 << 2) // path or user reply, used by the next request
+#define CONFIG_CHANGED_TIMEOUT      (1 << 3) // used by the next connect/exchange
+#define CONFIG_CHANGED_I2C          (1 << 4) // poll timers must be armed again
+#define CONFIG_CHANGED_AGGREGATION  (1 << 5) // the delta chain starts over with a keyframe
+#define CONFIG_CHANGED_GATEWAY      (1 << 6) // the LAN gateway aggregator listens again
+#define CONFIG_CHANGED_HISTORY      (1 << 7) // the history file is opened again
+#define CONFIG_CHANGED_UPLINK       (1 << 8) // the token bucket starts over
+#define CONFIG_CHANGED_PIPELINE     (1 << 9) // the pipelined connection is closed, the next request opens one at the new depth
+
+/*
+    Runtime configuration, an ini style file:
+        [comms]     transport, host, path, device_id, use_ssl,
+                    ktls, io_uring, http_port, mqtt_port, coap_port, user_reply,
+                    pipeline_depth, endpoints, hedge_percentile
+        [timeouts]  socket_sec
+        [i2c]       poll_interval_us, event_poll_interval_us,
+                    housekeeping_interval_ms
+        [aggregation] enabled, fields, max_staleness_sec,
+                    keyframe_sec
+        [bulk]      enabled, threshold
+        [gateway]   aggregator, address, port
+        [rules]     enabled
+        [history]   enabled, records
+        [uplink]    rate_per_min, burst
+    '#' and ';' start a comment, also after a value.
+    Keys that are not in the file keep their built-in default
+    (the #defines in the headers). Port 0 means the default
+    port for the tls setting. An unknown key or a bad value
+    rejects the whole file.
+    Snapshots are never modified once current: a reload
+    parses into the spare one and the loop swaps the pointer,
+    so a snapshot read in one pass of the loop stays
+    consistent. Don't keep the pointer across passes.
+*/
+typedef struct
+{
+    uint32_t transport; // COMMS_TRANSPORT_*
+    char host[STRUCTS_SERVREQ_MAXSTRSIZE];
+    char endpoints[CONFIG_ENDPOINTSMAXSIZE]; // http nodes serving host (SACEndpoints.h), empty: host itself
+    uint32_t hedgePercentile; // latency percentile after which a request goes to a second endpoint, 0: never
+    char path[STRUCTS_SERVREQ_MAXSTRSIZE];
+    char deviceId[STRUCTS_SERVREQ_MAXSTRSIZE];
+    bool useSsl;
+    bool ktls; // kernel TLS offload after the handshake, falls back to user space
+    bool ioUring; // reactor exchanges on io_uring, falls back to epoll
+    uint32_t pipelineDepth; // http requests in flight on one connection, 0: a connection per request
+    uint32_t httpPort;
+    uint32_t mqttPort;
+    uint32_t coapPort;
+    char userReply[STRUCTS_SERVREQ_MAXSTRSIZE]; // sent as &response= for debugging, empty: not sent
+    uint32_t socketTimeoutSec;
+    uint32_t i2cPollIntervalUs; // blocking loop sleep / reactor poll timer without bsc events
+    uint32_t i2cEventPollIntervalUs; // reactor poll timer with bsc events
+    uint32_t housekeepingIntervalMs;
+    bool aggEnabled; // edge aggregation of telemetry (SACEdgeAgg.h)
+    char aggFields[STRUCTS_SERVREQ_MAXSTRSIZE]; // payload layout, e.g. "C4C2G1G1G2I2"
+    uint32_t aggMaxStalenessSec;
+    uint32_t aggKeyframeSec;
+    bool bulkEnabled; // backlog goes out in compressed blocks (SACBulkUpload.h)
+    uint32_t bulkThreshold; // queued records that start the bulk upload
+    bool gwAggregator; // forwards the uplinks of LAN gateway slaves (SACLanGateway.h)
+    char gwAddress[STRUCTS_SERVREQ_MAXSTRSIZE]; // slave: the aggregator, aggregator: address to listen on, empty: all
+    uint32_t gwPort;
+    bool rulesEnabled; // send commands answered from the local rule table (SACRules.h)
+    bool historyEnabled; // uplinks kept in the history file (SACHistory.h)
+    uint32_t historyRecords; // size of its ring
+    uint32_t uplinkRatePerMin; // token bucket for events and telemetry (SACUplinkSched.h), 0: no rate limit
+    uint32_t uplinkBurst; // its depth
+    uint32_t generation; // 0: built-in defaults, +1 per applied reload
+} tConfig;
+
+int configInit(const char *sPath);
+const tConfig *configGet();
+void configSetDefaults(tConfig *pConfig);
+int configLoad(const char *sPath, tConfig *pConfig, char *sError, int iErrorSize);
+int configReloadStart(void (*pNotify)());
+uint32_t configApplyPending();
+uint32_t configDiff(const tConfig *pOld, const tConfig *pNew);
+
+#endif
@@ -0,0 +1,431 @@
+#include "SACEdgeAgg.h"
+#include "SACUplinkSched.h"
+#include "SACConfig.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memcmp, memset */
+#include "stdio.h"
+
+/****************** private function prototypes *********************/
+uint32_t edgeAggGetField(const uint8_t *pPayload, const tEdgeAggField *pField);
+void edgeAggSetField(uint8_t *pPayload, const tEdgeAggField *pField, uint32_t uiValue);
+int edgeAggEncodeDelta(const uint8_t *pFrom, const uint8_t *pTo, uint32_t uiRecords, uint8_t *pDest);
+int32_t edgeAggEmit(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime, uint64_t ulNowUs);
+int32_t edgeAggEmitPending(uint64_t ulNowUs);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tEdgeAggLayout msEdgeAggLayout;
+static bool mbEdgeAggLayoutValid = false;
+static tEdgeAggSink mpEdgeAggSink = uplinkSchedEnqueueEncoded;
+static tEdgeAggStats msEdgeAggStats = {0};
+static uint8_t mabEdgeAggServerView[STRUCTS_SENDCMDPAYLOADSIZE]; // payload as the server has it after the last record of the chain
+static bool mbEdgeAggChain = false; // false: the next record is a keyframe
+static uint8_t mbEdgeAggChainSeq = 0;
+static uint64_t mulEdgeAggKeyframeUs = 0;
+static uint32_t muiEdgeAggDroppedSeen = 0;
+static tCtrlSendCmd msEdgeAggPending; // newest rolled up record
+static uint32_t muiEdgeAggPendingRecords = 0; // 0: nothing pending
+static uint64_t mulEdgeAggPendingSinceUs = 0;
+static long unsigned int mulEdgeAggPendingTime = 0;
+/********************************************************************/
+
+/******************* edgeAggParseLayout *********************
+    "C4C2G1G1G2I2" -> fields, the rest of the payload is
+    filled up with gauges. pLayout may be NULL to only
+    validate. Returns the number of fields or -1.
+************************************************************/
+int edgeAggParseLayout(const char *sFields, tEdgeAggLayout *pLayout)
+{
+    tEdgeAggLayout sLayout;
+    int iOffset = 0;
+    int iWidth;
+
+    memset(&sLayout, 0, sizeof(sLayout));
+    while(*sFields != 0x00)
+    {
+        tEdgeAggField *pField = &sLayout.fields[sLayout.nFields];
+        switch(*sFields)
+        {
+            case 'C': case 'c': pField->kind = EDGEAGG_COUNTER; break;
+            case 'G': case 'g': pField->kind = EDGEAGG_GAUGE; break;
+            case 'I': case 'i': pField->kind = EDGEAGG_IGNORED; break;
+            default: return -1;
+        }
+        iWidth = sFields[1] - '0';
+        if(iWidth < 1 || iWidth > 4 || iOffset + iWidth > STRUCTS_SENDCMDPAYLOADSIZE)
+        {
+            return -1;
+        }
+        pField->offset = iOffset;
+        pField->width = iWidth;
+        iOffset += iWidth;
+        sLayout.nFields += 1;
+        sFields += 2;
+    }
+    while(iOffset < STRUCTS_SENDCMDPAYLOADSIZE)
+    {
+        tEdgeAggField *pField = &sLayout.fields[sLayout.nFields];
+        iWidth = (STRUCTS_SENDCMDPAYLOADSIZE - iOffset > 4) ? 4 : STRUCTS_SENDCMDPAYLOADSIZE - iOffset;
+        pField->kind = EDGEAGG_GAUGE;
+        pField->offset = iOffset;
+        pField->width = iWidth;
+        iOffset += iWidth;
+        sLayout.nFields += 1;
+    }
+    if(pLayout != NULL)
+    {
+        memcpy(pLayout, &sLayout, sizeof(sLayout));
+    }
+    return sLayout.nFields;
+}
+
+void edgeAggInit()
+{
+    memset(&msEdgeAggStats, 0, sizeof(msEdgeAggStats));
+    mbEdgeAggLayoutValid = (edgeAggParseLayout(configGet()->aggFields, &msEdgeAggLayout) > 0);
+    mbEdgeAggChain = false;
+    muiEdgeAggPendingRecords = 0;
+    muiEdgeAggDroppedSeen = uplinkSchedDropped(UPLCLASS_TELEMETRY);
+    if(configGet()->aggEnabled)
+    {
+        printf("[INFO] (%s) %s: Edge aggregation on, fields \'%s\', staleness %u s, keyframes every %u s.\n", printTimestamp(), __func__,
+            configGet()->aggFields, configGet()->aggMaxStalenessSec, configGet()->aggKeyframeSec);
+    }
+}
+
+/********************** edgeAggSetSink **********************
+    Where finished records go, NULL: the uplink queues.
+    For tests and benchmarks.
+************************************************************/
+void edgeAggSetSink(tEdgeAggSink pSink)
+{
+    mpEdgeAggSink = (pSink != NULL) ? pSink : uplinkSchedEnqueueEncoded;
+}
+
+/********************** edgeAggSubmit ***********************
+    Takes the place of uplinkSchedEnqueue() for send commands
+    from the controller. Returns the uplink id like
+    uplinkSchedEnqueue() when something was queued,
+    EDGEAGG_ABSORBED when the record was suppressed or
+    rolled up and -1 when the queue refused it.
+************************************************************/
+int32_t edgeAggSubmit(tCtrlSendCmd *pCmd, uint64_t ulNowUs)
+{
+    const tConfig *pConfig = configGet();
+    const uint8_t *pView = (muiEdgeAggPendingRecords > 0) ? msEdgeAggPending.payload : mabEdgeAggServerView;
+    bool bChanged = false;
+    bool bGaugeChanged = false;
+    bool bKeyframe = false;
+    int i;
+
+    msEdgeAggStats.records += 1;
+    msEdgeAggStats.bytesIn += pCmd->payloadSize - 1;
+    if(!pConfig->aggEnabled || !mbEdgeAggLayoutValid || uplinkSchedClassify(pCmd) != UPLCLASS_TELEMETRY || pCmd->payloadSize != STRUCTS_SENDCMDPAYLOADSIZE + 1)
+    {
+        msEdgeAggStats.passed += 1;
+        return edgeAggEmit(pCmd, UPLENC_RAW, printGetUnixEpochTimeAsInt(), ulNowUs);
+    }
+
+    if(uplinkSchedDropped(UPLCLASS_TELEMETRY) != muiEdgeAggDroppedSeen)
+    {
+        muiEdgeAggDroppedSeen = uplinkSchedDropped(UPLCLASS_TELEMETRY);
+        mbEdgeAggChain = false; // a delta of the chain may be gone
+    }
+    if(!mbEdgeAggChain || (ulNowUs - mulEdgeAggKeyframeUs) >= pConfig->aggKeyframeSec * 1000000ULL)
+    {
+        bKeyframe = true;
+    }
+    for(i=0; i<msEdgeAggLayout.nFields && !bKeyframe; i+=1)
+    {
+        const tEdgeAggField *pField = &msEdgeAggLayout.fields[i];
+        uint32_t uiOld = edgeAggGetField(pView, pField);
+        uint32_t uiNew = edgeAggGetField(pCmd->payload, pField);
+        uint32_t uiMask = (pField->width == 4) ? 0xffffffff : ((1U << (pField->width * 8)) - 1);
+        if(uiOld == uiNew || pField->kind == EDGEAGG_IGNORED)
+        {
+            continue;
+        }
+        bChanged = true;
+        if(pField->kind == EDGEAGG_GAUGE)
+        {
+            bGaugeChanged = true;
+        }
+        else if(((uiNew - uiOld) & uiMask) > (uiMask >> 1))
+        {
+            bKeyframe = true; // counter went back, the controller started over
+        }
+    }
+    if(bKeyframe)
+    {
+        muiEdgeAggPendingRecords = 0; // the absolute record covers the rolled up ones
+        return edgeAggEmit(pCmd, UPLENC_KEYFRAME, printGetUnixEpochTimeAsInt(), ulNowUs);
+    }
+
+    if(!bChanged)
+    {
+        msEdgeAggStats.suppressed += 1;
+        if(muiEdgeAggPendingRecords > 0)
+        {
+            memcpy(&msEdgeAggPending, pCmd, sizeof(tCtrlSendCmd)); // newest ignored fields
+        }
+        return EDGEAGG_ABSORBED;
+    }
+    memcpy(&msEdgeAggPending, pCmd, sizeof(tCtrlSendCmd));
+    mulEdgeAggPendingTime = printGetUnixEpochTimeAsInt();
+    if(muiEdgeAggPendingRecords == 0)
+    {
+        mulEdgeAggPendingSinceUs = ulNowUs;
+    }
+    muiEdgeAggPendingRecords += 1;
+    if(bGaugeChanged || (ulNowUs - mulEdgeAggPendingSinceUs) >= pConfig->aggMaxStalenessSec * 1000000ULL)
+    {
+        return edgeAggEmitPending(ulNowUs);
+    }
+    msEdgeAggStats.rolledUp += 1;
+    return EDGEAGG_ABSORBED;
+}
+
+/*********************** edgeAggPoll ************************
+    From the idle loop / housekeeping timer: sends the
+    summary whose oldest record reached the staleness bound.
+************************************************************/
+void edgeAggPoll(uint64_t ulNowUs)
+{
+    if(muiEdgeAggPendingRecords > 0 && (ulNowUs - mulEdgeAggPendingSinceUs) >= configGet()->aggMaxStalenessSec * 1000000ULL)
+    {
+        edgeAggEmitPending(ulNowUs);
+    }
+}
+
+/*********************** edgeAggFlush ***********************
+    Queues what is pending as a keyframe and ends the chain,
+    at exit and when the server or the layout changes.
+    Returns the uplink id of the keyframe, -1 when nothing
+    was pending or the queue refused it.
+************************************************************/
+int32_t edgeAggFlush()
+{
+    int32_t iId = -1;
+
+    if(muiEdgeAggPendingRecords > 0)
+    {
+        muiEdgeAggPendingRecords = 0;
+        iId = edgeAggEmit(&msEdgeAggPending, UPLENC_KEYFRAME, mulEdgeAggPendingTime, printGetMonotonicTimeUs());
+    }
+    mbEdgeAggChain = false;
+    return iId;
+}
+
+/******************** edgeAggApplyConfig ********************
+    A new server or transport doesn't know the chain, a new
+    layout can't continue it.
+************************************************************/
+void edgeAggApplyConfig(uint32_t uiChanged)
+{
+    if((uiChanged & (CONFIG_CHANGED_TRANSPORT | CONFIG_CHANGED_ENDPOINT | CONFIG_CHANGED_AGGREGATION)) == 0)
+    {
+        return;
+    }
+    edgeAggFlush();
+    mbEdgeAggLayoutValid = (edgeAggParseLayout(configGet()->aggFields, &msEdgeAggLayout) > 0);
+}
+
+const tEdgeAggStats *edgeAggStats()
+{
+    return &msEdgeAggStats;
+}
+
+void edgeAggLog()
+{
+    printf("[INFO] (%s) %s: %llu records, %llu passed, %llu suppressed, %llu rolled up, %llu keyframes, %llu deltas, %llu of %llu payload bytes sent, max staleness %u ms.\n", printTimestamp(), __func__,
+        (unsigned long long)msEdgeAggStats.records, (unsigned long long)msEdgeAggStats.passed, (unsigned long long)msEdgeAggStats.suppressed,
+        (unsigned long long)msEdgeAggStats.rolledUp, (unsigned long long)msEdgeAggStats.keyframes, (unsigned long long)msEdgeAggStats.deltas,
+        (unsigned long long)msEdgeAggStats.bytesOut, (unsigned long long)msEdgeAggStats.bytesIn, msEdgeAggStats.maxStalenessUs / 1000);
+}
+
+/*********************** edgeAggApply ***********************
+    Receiving side: applies one uplink payload to pState,
+    the absolute payload of the chain. Returns 0, or -1 for
+    a delta that doesn't continue the chain (pState is not
+    touched, wait for the next keyframe).
+************************************************************/
+int edgeAggApply(const tEdgeAggLayout *pLayout, uint8_t *pState, uint8_t *pChainSeq, const uint8_t *pPayload, int iLength, uint8_t bEncoding)
+{
+    uint8_t abState[STRUCTS_SENDCMDPAYLOADSIZE];
+    uint16_t uiBitmap;
+    int iPos = EDGEAGG_DELTAHEADERSIZE;
+    int i;
+
+    if(bEncoding != UPLENC_DELTA)
+    {
+        memcpy(pState, pPayload, (iLength < STRUCTS_SENDCMDPAYLOADSIZE) ? iLength : STRUCTS_SENDCMDPAYLOADSIZE);
+        *pChainSeq = 0;
+        return 0;
+    }
+    if(iLength < EDGEAGG_DELTAHEADERSIZE || pPayload[0] != (uint8_t)(*pChainSeq + 1))
+    {
+        return -1;
+    }
+    memcpy(abState, pState, sizeof(abState));
+    uiBitmap = pPayload[2] | (pPayload[3] << 8);
+    for(i=0; i<pLayout->nFields; i+=1)
+    {
+        const tEdgeAggField *pField = &pLayout->fields[i];
+        if((uiBitmap & (1 << i)) == 0)
+        {
+            continue;
+        }
+        if(pField->kind == EDGEAGG_COUNTER)
+        {
+            uint32_t uiIncrement = 0;
+            int iShift = 0;
+            do
+            {
+                if(iPos >= iLength || iShift > 28)
+                {
+                    return -1;
+                }
+                uiIncrement |= (uint32_t)(pPayload[iPos] & 0x7f) << iShift;
+                iShift += 7;
+            } while(pPayload[iPos++] & 0x80);
+            edgeAggSetField(abState, pField, edgeAggGetField(abState, pField) + uiIncrement);
+        }
+        else
+        {
+            if(iPos + pField->width > iLength)
+            {
+                return -1;
+            }
+            memcpy(&abState[pField->offset], &pPayload[iPos], pField->width);
+            iPos += pField->width;
+        }
+    }
+    memcpy(pState, abState, sizeof(abState));
+    *pChainSeq = pPayload[0];
+    return 0;
+}
+
+uint32_t edgeAggGetField(const uint8_t *pPayload, const tEdgeAggField *pField)
+{
+    return structsGetPayloadField(pPayload, pField->offset, pField->width);
+}
+
+void edgeAggSetField(uint8_t *pPayload, const tEdgeAggField *pField, uint32_t uiValue)
+{
+    structsSetPayloadField(pPayload, pField->offset, pField->width, uiValue);
+}
+
+/******************* edgeAggEncodeDelta *********************
+    Delta of pTo against pFrom into pDest (header included),
+    returns its length or -1 when it doesn't fit the payload.
+************************************************************/
+int edgeAggEncodeDelta(const uint8_t *pFrom, const uint8_t *pTo, uint32_t uiRecords, uint8_t *pDest)
+{
+    uint8_t abDelta[STRUCTS_SENDCMDPAYLOADSIZE + 4 * 5]; // worst case before the size check
+    uint16_t uiBitmap = 0;
+    int iPos = EDGEAGG_DELTAHEADERSIZE;
+    int i;
+
+    for(i=0; i<msEdgeAggLayout.nFields; i+=1)
+    {
+        const tEdgeAggField *pField = &msEdgeAggLayout.fields[i];
+        uint32_t uiOld = edgeAggGetField(pFrom, pField);
+        uint32_t uiNew = edgeAggGetField(pTo, pField);
+        if(uiOld == uiNew)
+        {
+            continue;
+        }
+        uiBitmap |= (1 << i);
+        if(pField->kind == EDGEAGG_COUNTER)
+        {
+            uint32_t uiIncrement = uiNew - uiOld;
+            if(pField->width < 4)
+            {
+                uiIncrement &= (1U << (pField->width * 8)) - 1;
+            }
+            do
+            {
+                abDelta[iPos++] = (uint8_t)(uiIncrement & 0x7f) | ((uiIncrement > 0x7f) ? 0x80 : 0x00);
+                uiIncrement >>= 7;
+            } while(uiIncrement > 0);
+        }
+        else
+        {
+            memcpy(&abDelta[iPos], &pTo[pField->offset], pField->width);
+            iPos += pField->width;
+        }
+        if(iPos > STRUCTS_SENDCMDPAYLOADSIZE)
+        {
+            return -1;
+        }
+    }
+    abDelta[0] = (uint8_t)(mbEdgeAggChainSeq + 1);
+    abDelta[1] = (uiRecords > 255) ? 255 : (uint8_t)uiRecords;
+    abDelta[2] = (uint8_t)(uiBitmap & 0xff);
+    abDelta[3] = (uint8_t)(uiBitmap >> 8);
+    memcpy(pDest, abDelta, iPos);
+    return iPos;
+}
+
+/********************* edgeAggEmitPending *******************
+    The rolled up records as one delta against the server's
+    view, a keyframe when the delta doesn't fit.
+************************************************************/
+int32_t edgeAggEmitPending(uint64_t ulNowUs)
+{
+    tCtrlSendCmd sCmd;
+    uint32_t uiRecords = muiEdgeAggPendingRecords;
+    uint32_t uiStalenessUs = (uint32_t)(ulNowUs - mulEdgeAggPendingSinceUs);
+    int iLength;
+
+    muiEdgeAggPendingRecords = 0;
+    if(uiStalenessUs > msEdgeAggStats.maxStalenessUs)
+    {
+        msEdgeAggStats.maxStalenessUs = uiStalenessUs;
+    }
+    memcpy(&sCmd, &msEdgeAggPending, sizeof(tCtrlSendCmd));
+    iLength = edgeAggEncodeDelta(mabEdgeAggServerView, msEdgeAggPending.payload, uiRecords, sCmd.payload);
+    if(iLength < 0)
+    {
+        return edgeAggEmit(&msEdgeAggPending, UPLENC_KEYFRAME, mulEdgeAggPendingTime, ulNowUs);
+    }
+    sCmd.payloadSize = iLength + 1; // +1 like the controller's read request byte
+    return edgeAggEmit(&sCmd, UPLENC_DELTA, mulEdgeAggPendingTime, ulNowUs);
+}
+
+/************************ edgeAggEmit ***********************
+    Hands a record to the sink and keeps the chain state in
+    line with what the server will have.
+************************************************************/
+int32_t edgeAggEmit(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime, uint64_t ulNowUs)
+{
+    int32_t iId = mpEdgeAggSink(pCmd, bEncoding, ulTime);
+
+    if(bEncoding == UPLENC_RAW)
+    {
+        msEdgeAggStats.bytesOut += pCmd->payloadSize - 1;
+        return iId;
+    }
+    if(iId < 0)
+    {
+        mbEdgeAggChain = false; // refused, the server won't see it
+        return iId;
+    }
+    msEdgeAggStats.bytesOut += pCmd->payloadSize - 1;
+    if(bEncoding == UPLENC_KEYFRAME)
+    {
+        msEdgeAggStats.keyframes += 1;
+        memcpy(mabEdgeAggServerView, pCmd->payload, STRUCTS_SENDCMDPAYLOADSIZE);
+        mbEdgeAggChain = true;
+        mbEdgeAggChainSeq = 0;
+        mulEdgeAggKeyframeUs = ulNowUs;
+    }
+    else
+    {
+        msEdgeAggStats.deltas += 1;
+        memcpy(mabEdgeAggServerView, msEdgeAggPending.payload, STRUCTS_SENDCMDPAYLOADSIZE);
+        mbEdgeAggChainSeq += 1;
+    }
+    return iId;
+}
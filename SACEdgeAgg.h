@@ -0,0 +1,96 @@
+#ifndef SACEDGEAGG_H
+#define SACEDGEAGG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#define EDGEAGG_ENABLED             0 // 1: telemetry goes through the aggregation, the server must understand UPLENC_KEYFRAME/UPLENC_DELTA
+#define EDGEAGG_FIELDS              "G4G4G4" // payload layout, see below. The default has no counters: only unchanged records are suppressed
+#define EDGEAGG_MAXSTALENESSSEC     300 // a rolled up change reaches the server at most this late
+#define EDGEAGG_KEYFRAMESEC         3600 // absolute record at least this often, also a heartbeat while nothing changes
+#define EDGEAGG_MAXFIELDS           STRUCTS_SENDCMDPAYLOADSIZE
+#define EDGEAGG_DELTAHEADERSIZE     4 // chain sequence, records, field bitmap (2)
+#define EDGEAGG_ABSORBED            -2 // edgeAggSubmit(): nothing to send now, the record is suppressed or rolled up
+
+/*
+    Edge aggregation of telemetry (uplinkSchedClassify()),
+    between the state machine and the uplink queues. Alarms
+    and events pass through untouched and right away.
+
+    The payload layout is a list of fields, a kind letter and
+    a width of 1..4 bytes (little endian), e.g. "C4C2G1G1G2I2":
+        C   counter: monotonic, sent as the increment, a
+            decrease (controller reset) sends a keyframe
+        G   gauge: absolute, a change goes out right away
+        I   ignored: not compared, sent when it changed
+    Bytes the layout leaves out are gauges.
+
+    A record equal to the server's view (ignored fields
+    aside) is suppressed. A record where only counters
+    changed is rolled up into a summary that goes out when a
+    gauge changes or EDGEAGG_MAXSTALENESSSEC after its first
+    record. Summaries are deltas against the previous
+    record of the chain:
+        [0]     chain sequence, +1 per delta, 0 = keyframe
+        [1]     controller records it holds (saturates at 255)
+        [2..3]  bitmap of the fields that follow, bit 0 =
+                first field (little endian)
+        [4..]   per field in the bitmap: counters as an
+                unsigned LEB128 increment, the others raw
+    A delta that does not fit the payload goes out as a
+    keyframe. Keyframes carry the absolute payload; one
+    starts a chain after startup, a config change, a record
+    dropped from the telemetry queue and every
+    EDGEAGG_KEYFRAMESEC. edgeAggApply() is the receiving
+    side, a server drops deltas after a sequence gap until
+    the next keyframe.
+*/
+
+typedef enum
+{
+    EDGEAGG_COUNTER,
+    EDGEAGG_GAUGE,
+    EDGEAGG_IGNORED,
+} tEdgeAggKind;
+
+typedef struct
+{
+    uint8_t kind; // tEdgeAggKind
+    uint8_t offset;
+    uint8_t width;
+} tEdgeAggField;
+
+typedef struct
+{
+    tEdgeAggField fields[EDGEAGG_MAXFIELDS];
+    int nFields;
+} tEdgeAggLayout;
+
+typedef struct
+{
+    uint64_t records; // send commands from the controller
+    uint64_t passed; // alarms, events and everything the aggregation doesn't handle
+    uint64_t suppressed; // unchanged
+    uint64_t rolledUp; // held for a summary
+    uint64_t keyframes;
+    uint64_t deltas;
+    uint64_t bytesIn; // payload bytes from the controller
+    uint64_t bytesOut; // payload bytes handed to the uplink queues
+    uint32_t maxStalenessUs; // oldest rolled up record when its summary went out
+} tEdgeAggStats;
+
+typedef int32_t (*tEdgeAggSink)(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime);
+
+int edgeAggParseLayout(const char *sFields, tEdgeAggLayout *pLayout);
+void edgeAggInit();
+void edgeAggSetSink(tEdgeAggSink pSink);
+int32_t edgeAggSubmit(tCtrlSendCmd *pCmd, uint64_t ulNowUs);
+void edgeAggPoll(uint64_t ulNowUs);
+int32_t edgeAggFlush();
+void edgeAggApplyConfig(uint32_t uiChanged);
+const tEdgeAggStats *edgeAggStats();
+void edgeAggLog();
+int edgeAggApply(const tEdgeAggLayout *pLayout, uint8_t *pState, uint8_t *pChainSeq, const uint8_t *pPayload, int iLength, uint8_t bEncoding);
+
+#endif
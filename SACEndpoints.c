@@ -0,0 +1,459 @@
+#include "SACEndpoints.h"
+#include "SACPrintUtils.h"
+#include "SACStateFile.h"
+#include "SACTrace.h"
+
+#include "string.h" /* memcpy, memset, strchr */
+#include <stdlib.h> /* strtoul */
+#include <netdb.h> /* struct hostent, gethostbyname */
+#include "stdio.h"
+
+#define ENDPOINTS_GENERATIONS       1000000 // handle = generation * ENDPOINTS_MAX + index, stays a positive int
+
+/****************** private function prototypes *********************/
+tEndpoint *endpointsFromHandle(int iEndpoint);
+int endpointsParseOne(char *sEntry, tEndpoint *pEndpoint);
+uint64_t endpointsScore(const tEndpoint *pEndpoint);
+void endpointsTakeOut(tEndpoint *pEndpoint, const char *sReason);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tEndpoint masEndpoints[ENDPOINTS_MAX];
+static int miEndpoints = 0;
+static uint32_t muiEndpointsGeneration = 0; // +1 per endpointsLoad(), results of older handles are dropped
+static uint32_t muiEndpointsSelections = 0;
+static char msEndpointsName[STRUCTS_SERVREQ_MAXSTRSIZE + 8];
+/********************************************************************/
+
+/********************* endpointsParse ***********************
+    Parses a [comms] endpoints list into pEndpoints (may be
+    NULL to only check it). Returns the number of endpoints,
+    0 for an empty list, -1 when it is malformed.
+************************************************************/
+int endpointsParse(const char *sList, tEndpoint *pEndpoints)
+{
+    char sBuffer[CONFIG_ENDPOINTSMAXSIZE];
+    tEndpoint sEndpoint;
+    char *sEntry;
+    char *sNext;
+    int iCount = 0;
+
+    if(strlen(sList) >= sizeof(sBuffer))
+    {
+        return -1;
+    }
+    if(sList[0] == 0x00)
+    {
+        return 0;
+    }
+    snprintf(sBuffer, sizeof(sBuffer), "%s", sList);
+    for(sEntry = sBuffer; sEntry != NULL; sEntry = sNext)
+    {
+        sNext = strchr(sEntry, ',');
+        if(sNext != NULL)
+        {
+            *sNext = 0x00;
+            sNext += 1;
+        }
+        if(iCount >= ENDPOINTS_MAX || endpointsParseOne(sEntry, &sEndpoint) < 0)
+        {
+            return -1;
+        }
+        if(pEndpoints != NULL)
+        {
+            memcpy(&pEndpoints[iCount], &sEndpoint, sizeof(tEndpoint));
+        }
+        iCount += 1;
+    }
+    return iCount;
+}
+
+/******************* endpointsParseOne **********************
+    host[:port][*weight], cuts sEntry apart.
+************************************************************/
+int endpointsParseOne(char *sEntry, tEndpoint *pEndpoint)
+{
+    char *pWeight = strchr(sEntry, '*');
+    char *pPort = strchr(sEntry, ':');
+    char *pEnd;
+    unsigned long ulValue;
+
+    memset(pEndpoint, 0, sizeof(tEndpoint));
+    pEndpoint->weight = 1;
+    if(pWeight != NULL)
+    {
+        *pWeight = 0x00;
+        ulValue = strtoul(&pWeight[1], &pEnd, 10);
+        if(pWeight[1] == 0x00 || *pEnd != 0x00 || ulValue < 1 || ulValue > 100)
+        {
+            return -1;
+        }
+        pEndpoint->weight = (uint32_t)ulValue;
+    }
+    if(pPort != NULL)
+    {
+        *pPort = 0x00;
+        ulValue = strtoul(&pPort[1], &pEnd, 10);
+        if(pPort[1] == 0x00 || *pEnd != 0x00 || ulValue < 1 || ulValue > 65535)
+        {
+            return -1;
+        }
+        pEndpoint->port = (uint16_t)ulValue;
+    }
+    if(sEntry[0] == 0x00 || strlen(sEntry) >= sizeof(pEndpoint->host))
+    {
+        return -1;
+    }
+    snprintf(pEndpoint->host, sizeof(pEndpoint->host), "%s", sEntry);
+    return 0;
+}
+
+/********************* endpointsLoad ************************
+    Takes the endpoint list of pConfig, at startup and after
+    a reload. Endpoints that are still in the list keep
+    their latency and error history, addresses are resolved
+    again. Requests in flight finish on their old endpoint,
+    their results are dropped.
+************************************************************/
+int endpointsLoad(const tConfig *pConfig)
+{
+    tEndpoint asNew[ENDPOINTS_MAX];
+    int iCount = endpointsParse(pConfig->endpoints, asNew);
+    int i;
+    int j;
+
+    if(iCount <= 0)
+    {
+        memset(&asNew[0], 0, sizeof(tEndpoint));
+        snprintf(asNew[0].host, sizeof(asNew[0].host), "%s", pConfig->host);
+        asNew[0].weight = 1;
+        iCount = 1;
+    }
+    for(i=0; i<iCount; i+=1)
+    {
+        for(j=0; j<miEndpoints; j+=1)
+        {
+            if(strcmp(asNew[i].host, masEndpoints[j].host) == 0 && asNew[i].port == masEndpoints[j].port)
+            {
+                uint32_t uiWeight = asNew[i].weight;
+                memcpy(&asNew[i], &masEndpoints[j], sizeof(tEndpoint));
+                asNew[i].weight = uiWeight;
+                asNew[i].resolved = false;
+                break;
+            }
+        }
+    }
+    memcpy(masEndpoints, asNew, iCount * sizeof(tEndpoint));
+    miEndpoints = iCount;
+    muiEndpointsGeneration = (muiEndpointsGeneration + 1) % ENDPOINTS_GENERATIONS;
+    for(i=0; i<miEndpoints; i+=1)
+    {
+        printf("[INFO] (%s) %s: Endpoint %i: %s, weight %u.\n", printTimestamp(), __func__, i, endpointsName(muiEndpointsGeneration * ENDPOINTS_MAX + i), masEndpoints[i].weight);
+    }
+    return miEndpoints;
+}
+
+int endpointsCount()
+{
+    return miEndpoints;
+}
+
+const tEndpoint *endpointsGet(int iIndex)
+{
+    return (iIndex >= 0 && iIndex < miEndpoints) ? &masEndpoints[iIndex] : NULL;
+}
+
+tEndpoint *endpointsFromHandle(int iEndpoint)
+{
+    if(iEndpoint < 0 || (uint32_t)(iEndpoint / ENDPOINTS_MAX) != muiEndpointsGeneration || iEndpoint % ENDPOINTS_MAX >= miEndpoints)
+    {
+        return NULL;
+    }
+    return &masEndpoints[iEndpoint % ENDPOINTS_MAX];
+}
+
+/******************** endpointsSelect ***********************
+    Endpoint for the next connection, never iExclude (-1:
+    none). Returns a handle for the other endpoints*()
+    functions or -1 when there is no other endpoint.
+************************************************************/
+int endpointsSelect(int iExclude)
+{
+    uint64_t ulNowUs = printGetMonotonicTimeUs();
+    tEndpoint *pExclude = endpointsFromHandle(iExclude);
+    uint64_t ulBestScore = 0;
+    uint64_t ulScore;
+    int iBest = -1;
+    int iOldest = -1;
+    int iFirstBack = -1;
+    int i;
+
+    for(i=0; i<miEndpoints; i+=1)
+    {
+        tEndpoint *pEndpoint = &masEndpoints[i];
+        if(pEndpoint == pExclude)
+        {
+            continue;
+        }
+        if(pEndpoint->downUntilUs > ulNowUs)
+        {
+            if(iFirstBack < 0 || pEndpoint->downUntilUs < masEndpoints[iFirstBack].downUntilUs)
+            {
+                iFirstBack = i;
+            }
+            continue;
+        }
+        ulScore = endpointsScore(pEndpoint);
+        if(iBest < 0 || ulScore < ulBestScore)
+        {
+            iBest = i;
+            ulBestScore = ulScore;
+        }
+        if(iOldest < 0 || pEndpoint->lastUsedUs < masEndpoints[iOldest].lastUsedUs)
+        {
+            iOldest = i;
+        }
+    }
+    if(iBest < 0)
+    {
+        iBest = iFirstBack; // all out of the rotation
+    }
+    if(iBest < 0)
+    {
+        return -1;
+    }
+    muiEndpointsSelections += 1;
+    if(iOldest >= 0 && iOldest != iBest && muiEndpointsSelections % ENDPOINTS_PROBEINTERVAL == 0)
+    {
+        iBest = iOldest;
+    }
+    masEndpoints[iBest].lastUsedUs = ulNowUs;
+    return (int)(muiEndpointsGeneration * ENDPOINTS_MAX) + iBest;
+}
+
+uint64_t endpointsScore(const tEndpoint *pEndpoint)
+{
+    uint64_t ulSrttUs = (pEndpoint->srttUs > 0) ? pEndpoint->srttUs : ENDPOINTS_INITIALRTTMS * 1000;
+    return ulSrttUs * (1000 + (ENDPOINTS_ERRORPENALTY - 1) * pEndpoint->errorRate) / pEndpoint->weight;
+}
+
+/******************* endpointsAddress ***********************
+    Fills pAddr for a connection to the endpoint. The
+    address of the first endpoint survives restarts in the
+    state file, the others are kept in memory for as long.
+************************************************************/
+int endpointsAddress(int iEndpoint, struct sockaddr_in *pAddr)
+{
+    tEndpoint *pEndpoint = endpointsFromHandle(iEndpoint);
+    const tConfig *pConfig = configGet();
+    bool bPrimary = (pEndpoint == &masEndpoints[0]);
+    uint32_t auiAddresses[STATEFILE_MAXADDRESSES];
+    struct hostent *pServer;
+    int iAddresses = 0;
+
+    if(pEndpoint == NULL)
+    {
+        return -1;
+    }
+    memset(pAddr, 0, sizeof(struct sockaddr_in));
+    pAddr->sin_family = AF_INET;
+    if(pEndpoint->port != 0)
+    {
+        pAddr->sin_port = htons(pEndpoint->port);
+    }
+    else
+    {
+        pAddr->sin_port = htons((pConfig->httpPort != 0) ? pConfig->httpPort : (pConfig->useSsl ? 443 : 80));
+    }
+    if(pEndpoint->resolved && (uint64_t)printGetUnixEpochTimeAsInt() <= pEndpoint->resolvedAtSec + STATEFILE_DNSMAXAGESEC)
+    {
+        pAddr->sin_addr.s_addr = pEndpoint->address;
+        return 0;
+    }
+    if(bPrimary && stateFileGetAddresses(pEndpoint->host, auiAddresses, STATEFILE_MAXADDRESSES) > 0)
+    {
+        pAddr->sin_addr.s_addr = auiAddresses[0];
+        printf("[INFO] (%s) %s: %s from cached address: s_addr=0x%x\n", printTimestamp(), __func__, pEndpoint->host, pAddr->sin_addr.s_addr);
+        return 0;
+    }
+    TRACE_BEGIN("dns");
+    pServer = gethostbyname(pEndpoint->host);
+    TRACE_END("dns");
+    if(pServer == NULL)
+    {
+        printf("[ERROR] (%s) %s: No such host: \'%s\'\n", printTimestamp(), __func__, pEndpoint->host);
+        return -1;
+    }
+    while(iAddresses < STATEFILE_MAXADDRESSES && pServer->h_addr_list[iAddresses] != NULL)
+    {
+        memcpy(&auiAddresses[iAddresses], pServer->h_addr_list[iAddresses], sizeof(uint32_t));
+        iAddresses += 1;
+    }
+    if(bPrimary)
+    {
+        stateFileSetAddresses(pEndpoint->host, auiAddresses, iAddresses);
+    }
+    pEndpoint->address = auiAddresses[0];
+    pEndpoint->resolved = true;
+    pEndpoint->resolvedAtSec = printGetUnixEpochTimeAsInt();
+    pAddr->sin_addr.s_addr = pEndpoint->address;
+    printf("[INFO] (%s) %s: Resolved %s: s_addr=0x%x, %i addresses\n", printTimestamp(), __func__, pEndpoint->host, pAddr->sin_addr.s_addr, iAddresses);
+    return 0;
+}
+
+/***************** endpointsRecordResult ********************
+    Result of a request that got a connection. Successful
+    ones are latency samples, failed ones count against the
+    error rate.
+************************************************************/
+void endpointsRecordResult(int iEndpoint, int iResult, uint64_t ulLatencyUs)
+{
+    tEndpoint *pEndpoint = endpointsFromHandle(iEndpoint);
+    uint32_t uiLatencyUs = (ulLatencyUs > UINT32_MAX) ? UINT32_MAX : (uint32_t)ulLatencyUs;
+
+    if(pEndpoint == NULL)
+    {
+        return;
+    }
+    pEndpoint->requests += 1;
+    if(iResult < 0)
+    {
+        pEndpoint->failures += 1;
+        pEndpoint->errorRate = pEndpoint->errorRate - pEndpoint->errorRate / 8 + 1000 / 8;
+        pEndpoint->consecutiveFailures += 1;
+        if(pEndpoint->consecutiveFailures >= ENDPOINTS_DOWNAFTER)
+        {
+            endpointsTakeOut(pEndpoint, "failed requests");
+        }
+        return;
+    }
+    pEndpoint->srttUs = (pEndpoint->srttUs == 0) ? uiLatencyUs : pEndpoint->srttUs - pEndpoint->srttUs / 8 + uiLatencyUs / 8;
+    pEndpoint->errorRate -= pEndpoint->errorRate / 8;
+    pEndpoint->consecutiveFailures = 0;
+    pEndpoint->downMs = 0;
+    pEndpoint->rttMs[pEndpoint->rttSamples % ENDPOINTS_RTTSAMPLES] = uiLatencyUs / 1000;
+    pEndpoint->rttSamples += 1;
+}
+
+/***************** endpointsConnectFailed *******************
+    No connection (connect, name resolution or handshake):
+    out of the rotation at once, the caller fails over.
+************************************************************/
+void endpointsConnectFailed(int iEndpoint)
+{
+    tEndpoint *pEndpoint = endpointsFromHandle(iEndpoint);
+
+    if(pEndpoint == NULL)
+    {
+        return;
+    }
+    pEndpoint->requests += 1;
+    pEndpoint->failures += 1;
+    pEndpoint->failovers += 1;
+    pEndpoint->errorRate = pEndpoint->errorRate - pEndpoint->errorRate / 8 + 1000 / 8;
+    pEndpoint->consecutiveFailures += 1;
+    pEndpoint->resolved = false; // server might have moved, resolve again next time
+    if(pEndpoint == &masEndpoints[0])
+    {
+        stateFileInvalidateAddresses();
+    }
+    endpointsTakeOut(pEndpoint, "no connection");
+}
+
+void endpointsTakeOut(tEndpoint *pEndpoint, const char *sReason)
+{
+    uint64_t ulNowUs = printGetMonotonicTimeUs();
+
+    if(pEndpoint->downUntilUs > ulNowUs)
+    {
+        return; // already out, a burst of failures doesn't stretch the period
+    }
+    pEndpoint->downMs = (pEndpoint->downMs == 0) ? ENDPOINTS_DOWNMINMS : pEndpoint->downMs * 2;
+    if(pEndpoint->downMs > ENDPOINTS_DOWNMAXMS)
+    {
+        pEndpoint->downMs = ENDPOINTS_DOWNMAXMS;
+    }
+    pEndpoint->downUntilUs = ulNowUs + (uint64_t)pEndpoint->downMs * 1000ULL;
+    printf("[WARNING] (%s) %s: Endpoint %s out of the rotation for %u ms (%s).\n", printTimestamp(), __func__, pEndpoint->host, pEndpoint->downMs, sReason);
+}
+
+/***************** endpointsHedgeDelayMs ********************
+    Time after which a request to the endpoint is sent to a
+    second one as well: the [comms] hedge_percentile of its
+    last latencies. 0: don't hedge (switched off, a single
+    endpoint or too few samples).
+************************************************************/
+uint32_t endpointsHedgeDelayMs(int iEndpoint)
+{
+    tEndpoint *pEndpoint = endpointsFromHandle(iEndpoint);
+    uint32_t uiPercentile = configGet()->hedgePercentile;
+    uint32_t auiSorted[ENDPOINTS_RTTSAMPLES];
+    uint32_t uiCount;
+    uint32_t uiValue;
+    uint32_t i;
+    uint32_t j;
+
+    if(pEndpoint == NULL || uiPercentile == 0 || miEndpoints < 2 || pEndpoint->rttSamples < ENDPOINTS_HEDGEMINSAMPLES)
+    {
+        return 0;
+    }
+    uiCount = (pEndpoint->rttSamples < ENDPOINTS_RTTSAMPLES) ? pEndpoint->rttSamples : ENDPOINTS_RTTSAMPLES;
+    for(i=0; i<uiCount; i+=1)
+    {
+        uiValue = pEndpoint->rttMs[i];
+        for(j=i; j>0 && auiSorted[j - 1] > uiValue; j-=1)
+        {
+            auiSorted[j] = auiSorted[j - 1];
+        }
+        auiSorted[j] = uiValue;
+    }
+    uiValue = auiSorted[(uiCount * uiPercentile + 99) / 100 - 1];
+    return (uiValue < ENDPOINTS_HEDGEMINMS) ? ENDPOINTS_HEDGEMINMS : uiValue;
+}
+
+/******************** endpointsHedged ***********************
+    A hedged request to the endpoint is settled, bWon: its
+    answer was used.
+************************************************************/
+void endpointsHedged(int iEndpoint, bool bWon)
+{
+    tEndpoint *pEndpoint = endpointsFromHandle(iEndpoint);
+
+    if(pEndpoint == NULL)
+    {
+        return;
+    }
+    pEndpoint->hedges += 1;
+    pEndpoint->hedgeWins += bWon ? 1 : 0;
+}
+
+/********************* endpointsName ************************
+    host or host:port for logs, valid until the next call.
+************************************************************/
+const char *endpointsName(int iEndpoint)
+{
+    tEndpoint *pEndpoint = endpointsFromHandle(iEndpoint);
+
+    if(pEndpoint == NULL)
+    {
+        return "(replaced endpoint)";
+    }
+    if(pEndpoint->port == 0)
+    {
+        return pEndpoint->host;
+    }
+    snprintf(msEndpointsName, sizeof(msEndpointsName), "%s:%u", pEndpoint->host, pEndpoint->port);
+    return msEndpointsName;
+}
+
+void endpointsLog()
+{
+    int i;
+    for(i=0; i<miEndpoints; i+=1)
+    {
+        const tEndpoint *pEndpoint = &masEndpoints[i];
+        printf("[INFO] (%s) %s: %s: %llu requests, %llu failed, %llu failed over, srtt %u ms, error rate %u.%u%%, %llu hedged (%llu won).\n", printTimestamp(), __func__,
+            endpointsName(muiEndpointsGeneration * ENDPOINTS_MAX + i), (unsigned long long)pEndpoint->requests, (unsigned long long)pEndpoint->failures, (unsigned long long)pEndpoint->failovers,
+            pEndpoint->srttUs / 1000, pEndpoint->errorRate / 10, pEndpoint->errorRate % 10, (unsigned long long)pEndpoint->hedges, (unsigned long long)pEndpoint->hedgeWins);
+    }
+}
@@ -0,0 +1,83 @@
+#ifndef SACENDPOINTS_H
+#define SACENDPOINTS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <netinet/in.h> /* struct sockaddr_in */
+#include "SACStructs.h"
+#include "SACConfig.h"
+
+#define ENDPOINTS_MAX               8
+#define ENDPOINTS_HEDGEPERCENTILE   95 // default of [comms] hedge_percentile, 0: no hedged requests
+#define ENDPOINTS_RTTSAMPLES        32 // latencies kept per endpoint for the hedge percentile
+#define ENDPOINTS_HEDGEMINSAMPLES   8 // no hedging before the endpoint has this many samples
+#define ENDPOINTS_HEDGEMINMS        20 // never hedge earlier than this
+#define ENDPOINTS_INITIALRTTMS      100 // smoothed latency of an endpoint without samples
+#define ENDPOINTS_ERRORPENALTY      10 // score factor at an error rate of 100%, half the requests failing weighs like 5.5 x the latency
+#define ENDPOINTS_DOWNAFTER         3 // consecutive failed requests that take an endpoint out, a connection error does it at once
+#define ENDPOINTS_DOWNMINMS         1000 // first time out of the rotation, doubles while it keeps failing
+#define ENDPOINTS_DOWNMAXMS         60000
+#define ENDPOINTS_PROBEINTERVAL     16 // every n-th selection goes to the longest unused healthy endpoint, keeps its latency current
+
+/*
+    Upstream endpoints of the http transport, [comms] endpoints:
+        host[:port][*weight],host[:port][*weight],...
+    e.g. "node1.example.com*2,node2.example.com,10.0.0.7:8443".
+    Port 0 or none: [comms] http_port / the tls default, weight
+    1..100, default 1. Empty: [comms] host is the only endpoint.
+    The nodes serve the same site, requests still carry
+    [comms] host in the Host header.
+    Every request result feeds a smoothed latency (srtt, 1/8
+    per sample like tcp) and a smoothed error rate of its
+    endpoint. The next connection goes to the healthy
+    endpoint with the lowest
+        srtt * (1 + (ENDPOINTS_ERRORPENALTY - 1) * error rate) / weight
+    A connection error takes the endpoint out of the rotation
+    at once and the request goes to the next one, so is
+    ENDPOINTS_DOWNAFTER failed requests in a row. When all of
+    them are out the one that comes back first is used.
+    In reactor mode a request that takes longer than the
+    [comms] hedge_percentile of its endpoint's last
+    ENDPOINTS_RTTSAMPLES latencies is sent to a second
+    endpoint as well (same bytes, same seqNr, the server drops
+    the duplicate). The first answer wins, the other exchange
+    is closed.
+*/
+
+typedef struct
+{
+    char host[STRUCTS_SERVREQ_MAXSTRSIZE];
+    uint16_t port; // 0: [comms] http_port / tls default
+    uint32_t weight;
+    bool resolved;
+    uint32_t address; // s_addr, valid with resolved
+    uint64_t resolvedAtSec; // unix time
+    uint32_t srttUs; // 0: no sample yet
+    uint32_t errorRate; // per mille, smoothed like srtt
+    uint32_t consecutiveFailures;
+    uint64_t downUntilUs; // monotonic, out of the rotation until then
+    uint32_t downMs; // current out of rotation period
+    uint64_t lastUsedUs;
+    uint32_t rttMs[ENDPOINTS_RTTSAMPLES]; // ring of the last latencies
+    uint32_t rttSamples; // total, the ring holds the last ENDPOINTS_RTTSAMPLES
+    uint64_t requests;
+    uint64_t failures;
+    uint64_t failovers; // requests that left it after a connection error
+    uint64_t hedges; // hedged requests sent to it
+    uint64_t hedgeWins; // hedged requests it answered first
+} tEndpoint;
+
+int endpointsParse(const char *sList, tEndpoint *pEndpoints);
+int endpointsLoad(const tConfig *pConfig);
+int endpointsCount();
+const tEndpoint *endpointsGet(int iIndex);
+int endpointsSelect(int iExclude);
+int endpointsAddress(int iEndpoint, struct sockaddr_in *pAddr);
+void endpointsRecordResult(int iEndpoint, int iResult, uint64_t ulLatencyUs);
+void endpointsConnectFailed(int iEndpoint);
+uint32_t endpointsHedgeDelayMs(int iEndpoint);
+void endpointsHedged(int iEndpoint, bool bWon);
+const char *endpointsName(int iEndpoint);
+void endpointsLog();
+
+#endif
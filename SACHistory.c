@@ -0,0 +1,472 @@
+#include "SACHistory.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memset */
+#include <stddef.h> /* offsetof */
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h> /* clock_gettime */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stdio.h"
+#include "unistd.h"
+
+/****************** private function prototypes *********************/
+uint64_t historyLayoutSize(uint32_t uiCapacity);
+uint64_t historyIndexOffset();
+uint64_t historyRecordsOffset(uint32_t uiCapacity);
+int historyMap(int iFd, uint64_t ulSize, bool bWritable, tHistoryView *pView);
+uint64_t historyNowMs();
+void historyStorePending();
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tHistoryView msHistoryView = {0}; // the daemon's mapping, header NULL: no history
+static tHistoryStats msHistoryStats = {0};
+static tHistoryRecord masHistoryPending[HISTORY_PENDINGRECORDS]; // appended, not in the mapping yet
+static uint32_t muiHistoryPending = 0;
+/********************************************************************/
+
+/*********************** historyOpen ************************
+    Maps sPath with room for uiRecords (rounded up to whole
+    blocks, 0: no history), creates it when needed. A file
+    with another layout or size starts over. The space is
+    allocated up front, a full disk must not turn a write
+    into the mapping into a SIGBUS.
+    Returns 0 when the records of a previous run are kept,
+    1 when starting empty and -1 when there is no history.
+************************************************************/
+int historyOpen(const char *sPath, uint32_t uiRecords)
+{
+    uint32_t uiCapacity = ((uiRecords + HISTORY_BLOCKRECORDS - 1) / HISTORY_BLOCKRECORDS) * HISTORY_BLOCKRECORDS;
+    uint64_t ulSize = historyLayoutSize(uiCapacity);
+    tHistoryHeader *pHeader;
+    struct stat sStat;
+    int iFd;
+    int iError;
+
+    memset(&msHistoryStats, 0, sizeof(msHistoryStats));
+    muiHistoryPending = 0;
+    if(uiRecords == 0)
+    {
+        printf("[INFO] (%s) %s: No uplink history ([history] enabled = no).\n", printTimestamp(), __func__);
+        return -1;
+    }
+    iFd = open(sPath, O_RDWR | O_CREAT, 0644);
+    if(iFd < 0 || fstat(iFd, &sStat) < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not open history file \'%s\', running without history.\n", printTimestamp(), __func__, sPath);
+        if(iFd >= 0)
+        {
+            close(iFd);
+        }
+        return -1;
+    }
+    if((uint64_t)sStat.st_size == ulSize && historyMap(iFd, ulSize, true, &msHistoryView) == 0)
+    {
+        close(iFd);
+        msHistoryStats.capacity = uiCapacity;
+        msHistoryStats.count = historyCount(&msHistoryView);
+        printf("[INFO] (%s) %s: History \'%s\': %llu records kept, room for %u.\n", printTimestamp(), __func__, sPath, (unsigned long long)(msHistoryStats.count - historyOldest(&msHistoryView)), uiCapacity);
+        return 0;
+    }
+    if(sStat.st_size > 0)
+    {
+        printf("[WARNING] (%s) %s: History \'%s\' has another layout or size, starting over.\n", printTimestamp(), __func__, sPath);
+    }
+    iError = (ftruncate(iFd, 0) < 0 || ftruncate(iFd, ulSize) < 0) ? errno : posix_fallocate(iFd, 0, ulSize);
+    if(iError != 0)
+    {
+        printf("[ERROR] (%s) %s: Could not allocate %llu bytes for the history (%s), running without history.\n", printTimestamp(), __func__, (unsigned long long)ulSize, strerror(iError));
+        ftruncate(iFd, 0);
+        close(iFd);
+        return -1;
+    }
+    pHeader = mmap(NULL, HISTORY_HEADERSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, iFd, 0);
+    if(pHeader == MAP_FAILED)
+    {
+        close(iFd);
+        return -1;
+    }
+    memset(pHeader, 0, HISTORY_HEADERSIZE);
+    pHeader->recordSize = sizeof(tHistoryRecord);
+    pHeader->capacity = uiCapacity;
+    pHeader->version = HISTORY_VERSION;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pHeader->magic = HISTORY_MAGIC; // last, a half written header is not taken
+    msync(pHeader, HISTORY_HEADERSIZE, MS_SYNC);
+    munmap(pHeader, HISTORY_HEADERSIZE);
+    iError = historyMap(iFd, ulSize, true, &msHistoryView);
+    close(iFd);
+    if(iError < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not map the history file.\n", printTimestamp(), __func__);
+        return -1;
+    }
+    msHistoryStats.capacity = uiCapacity;
+    printf("[INFO] (%s) %s: History \'%s\': room for %u records (%llu bytes).\n", printTimestamp(), __func__, sPath, uiCapacity, (unsigned long long)ulSize);
+    return 1;
+}
+
+/********************** historyAppend ***********************
+    Record of an uplink result (commsRecordUplinkResult()),
+    pDownlink may be NULL.
+************************************************************/
+void historyAppend(const tUplinkRecord *pRecord, int iResult, const uint8_t *pDownlink, uint8_t bFlags)
+{
+    tHistoryRecord sRecord;
+    int iSize = pRecord->cmd.payloadSize - 1; // -1 since payloadsize includes the read request byte
+
+    if(msHistoryView.header == NULL)
+    {
+        return;
+    }
+    memset(&sRecord, 0, sizeof(sRecord));
+    sRecord.unixMs = historyNowMs();
+    sRecord.eventTime = (uint32_t)pRecord->time;
+    sRecord.seqNr = pRecord->seqNr;
+    if(pRecord->sendStartUs > 0 && (bFlags & HISTORY_FLAG_BULK) == 0)
+    {
+        sRecord.latencyUs = (uint32_t)(printGetMonotonicTimeUs() - pRecord->sendStartUs);
+    }
+    sRecord.errorCode = (iResult < -32768) ? -32768 : (int16_t)((iResult > 0) ? 0 : iResult);
+    sRecord.cmdCode = pRecord->cmd.cmdCode;
+    sRecord.encoding = pRecord->encoding;
+    sRecord.uplinkSize = (iSize < 0) ? 0 : ((iSize > STRUCTS_SENDCMDPAYLOADSIZE) ? STRUCTS_SENDCMDPAYLOADSIZE : iSize);
+    memcpy(sRecord.uplink, pRecord->cmd.payload, sRecord.uplinkSize);
+    sRecord.flags = bFlags;
+    if(pDownlink != NULL && iResult >= 0)
+    {
+        memcpy(sRecord.downlink, pDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+        sRecord.flags |= HISTORY_FLAG_DOWNLINK;
+    }
+    historyWrite(&sRecord);
+}
+
+/*********************** historyWrite ***********************
+    Appends pRecord (unixMs set) to the pending records,
+    historyPoll() stores them. Memory only, unless more than
+    HISTORY_PENDINGRECORDS came in one housekeeping tick:
+    then they are stored right away.
+************************************************************/
+void historyWrite(tHistoryRecord *pRecord)
+{
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    uint32_t uiUs;
+
+    if(msHistoryView.header == NULL)
+    {
+        return;
+    }
+    if(muiHistoryPending == HISTORY_PENDINGRECORDS)
+    {
+        historyStorePending();
+    }
+    memcpy(&masHistoryPending[muiHistoryPending], pRecord, sizeof(tHistoryRecord));
+    muiHistoryPending += 1;
+    msHistoryStats.appended += 1;
+    uiUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    if(uiUs > msHistoryStats.maxAppendUs)
+    {
+        msHistoryStats.maxAppendUs = uiUs;
+    }
+}
+
+/******************* historyStorePending ********************
+    Puts the pending records into their slots, the checksum
+    is done here. Each record is written in place, then the
+    index entry, then count is released.
+************************************************************/
+void historyStorePending()
+{
+    tHistoryHeader *pHeader = (tHistoryHeader *)msHistoryView.header;
+    tHistoryRecord *pRecord;
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    uint64_t n;
+    uint32_t uiCapacity;
+    uint32_t uiUs;
+    uint32_t i;
+
+    if(pHeader == NULL || muiHistoryPending == 0)
+    {
+        return;
+    }
+    uiCapacity = pHeader->capacity;
+    n = pHeader->count; // only this process writes it
+    for(i=0; i<muiHistoryPending; i+=1, n+=1)
+    {
+        pRecord = &masHistoryPending[i];
+        if(pRecord->unixMs < pHeader->lastUnixMs)
+        {
+            pRecord->unixMs = pHeader->lastUnixMs; // the clock stepped back, the ring stays sorted
+            msHistoryStats.clockBacksteps += 1;
+        }
+        pRecord->checksum = historyChecksum(pRecord);
+        memcpy((tHistoryRecord *)&msHistoryView.records[n % uiCapacity], pRecord, sizeof(tHistoryRecord));
+        if(n % HISTORY_BLOCKRECORDS == 0)
+        {
+            ((uint64_t *)msHistoryView.index)[(n / HISTORY_BLOCKRECORDS) % (uiCapacity / HISTORY_BLOCKRECORDS)] = pRecord->unixMs;
+        }
+        pHeader->lastUnixMs = pRecord->unixMs;
+        __atomic_store_n(&pHeader->count, n + 1, __ATOMIC_RELEASE);
+    }
+    muiHistoryPending = 0;
+    msHistoryStats.count = n;
+    uiUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    if(uiUs > msHistoryStats.maxStoreUs)
+    {
+        msHistoryStats.maxStoreUs = uiUs;
+    }
+}
+
+/*********************** historyPoll ************************
+    Housekeeping: stores the pending records, reads the
+    pages of the next block ahead, so the store does not
+    wait for the disk when it gets there, and schedules the
+    write back of what was written.
+************************************************************/
+void historyPoll()
+{
+    long lPageSize = sysconf(_SC_PAGESIZE);
+    uint64_t ulSlot;
+    uintptr_t uiStart;
+    uintptr_t uiEnd;
+
+    if(msHistoryView.header == NULL)
+    {
+        return;
+    }
+    historyStorePending();
+    ulSlot = msHistoryStats.count % msHistoryView.header->capacity;
+    uiStart = (uintptr_t)&msHistoryView.records[ulSlot] & ~((uintptr_t)lPageSize - 1);
+    uiEnd = (uintptr_t)&msHistoryView.records[(ulSlot + HISTORY_BLOCKRECORDS < msHistoryView.header->capacity) ? ulSlot + HISTORY_BLOCKRECORDS : msHistoryView.header->capacity];
+    madvise((void *)uiStart, uiEnd - uiStart, MADV_WILLNEED);
+    msync((void *)msHistoryView.header, msHistoryView.size, MS_ASYNC);
+}
+
+const tHistoryStats *historyStats()
+{
+    return &msHistoryStats;
+}
+
+void historyLog()
+{
+    if(msHistoryView.header == NULL)
+    {
+        return;
+    }
+    printf("[INFO] (%s) %s: %llu records in a ring of %u, %llu appended, max append %u us, max store %u us, %llu clock back steps.\n", printTimestamp(), __func__,
+        (unsigned long long)(msHistoryStats.count - historyOldest(&msHistoryView)), msHistoryStats.capacity,
+        (unsigned long long)msHistoryStats.appended, msHistoryStats.maxAppendUs, msHistoryStats.maxStoreUs, (unsigned long long)msHistoryStats.clockBacksteps);
+}
+
+void historyClose()
+{
+    if(msHistoryView.header == NULL)
+    {
+        return;
+    }
+    historyStorePending();
+    msync((void *)msHistoryView.header, msHistoryView.size, MS_SYNC);
+    historyDetach(&msHistoryView);
+}
+
+/********************** historyAttach ***********************
+    Maps sPath read only. Returns -1 when there is no
+    history file or the layout doesn't match.
+************************************************************/
+int historyAttach(const char *sPath, tHistoryView *pView)
+{
+    struct stat sStat;
+    int iFd;
+    int iResult;
+
+    iFd = open(sPath, O_RDONLY);
+    if(iFd < 0)
+    {
+        return -1;
+    }
+    if(fstat(iFd, &sStat) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+    iResult = historyMap(iFd, sStat.st_size, false, pView);
+    close(iFd);
+    return iResult;
+}
+
+void historyDetach(tHistoryView *pView)
+{
+    if(pView->header != NULL)
+    {
+        munmap((void *)pView->header, pView->size);
+    }
+    memset(pView, 0, sizeof(tHistoryView));
+}
+
+uint64_t historyCount(const tHistoryView *pView)
+{
+    return __atomic_load_n(&pView->header->count, __ATOMIC_ACQUIRE);
+}
+
+/*********************** historyOldest **********************
+    The slot of record count - capacity is the one the next
+    write goes to, a full ring holds capacity - 1 records.
+************************************************************/
+uint64_t historyOldest(const tHistoryView *pView)
+{
+    uint64_t ulCount = historyCount(pView);
+    return (ulCount >= pView->header->capacity) ? ulCount - pView->header->capacity + 1 : 0;
+}
+
+/*********************** historyFind ************************
+    First record n with unixMs >= ulFromMs, historyCount()
+    when there is none. Binary search over the index for the
+    block, then over the records of that block.
+************************************************************/
+uint64_t historyFind(const tHistoryView *pView, uint64_t ulFromMs)
+{
+    uint64_t ulCount = historyCount(pView);
+    uint64_t ulLow = (ulCount >= pView->header->capacity) ? ulCount - pView->header->capacity + 1 : 0; // historyOldest() of ulCount
+    uint64_t ulHigh = ulCount;
+    uint64_t ulBlocks = pView->header->capacity / HISTORY_BLOCKRECORDS;
+    uint64_t ulFirstBlock = (ulLow + HISTORY_BLOCKRECORDS - 1) / HISTORY_BLOCKRECORDS; // the oldest whole block
+    uint64_t ulLastBlock = (ulCount > 0) ? (ulCount - 1) / HISTORY_BLOCKRECORDS : 0;
+    uint64_t ulMid;
+    uint64_t l;
+    uint64_t h;
+
+    if(ulCount == 0)
+    {
+        return 0;
+    }
+    if(ulFirstBlock <= ulLastBlock)
+    {
+        l = ulFirstBlock;
+        h = ulLastBlock + 1;
+        while(l < h)
+        {
+            ulMid = l + (h - l) / 2;
+            if(pView->index[ulMid % ulBlocks] < ulFromMs)
+            {
+                l = ulMid + 1;
+            }
+            else
+            {
+                h = ulMid;
+            }
+        }
+        // l: first block that starts at or after ulFromMs
+        if(l > ulFirstBlock)
+        {
+            ulLow = (l - 1) * HISTORY_BLOCKRECORDS;
+        }
+        if(l <= ulLastBlock)
+        {
+            ulHigh = l * HISTORY_BLOCKRECORDS;
+        }
+    }
+    while(ulLow < ulHigh)
+    {
+        ulMid = ulLow + (ulHigh - ulLow) / 2;
+        if(pView->records[ulMid % pView->header->capacity].unixMs < ulFromMs)
+        {
+            ulLow = ulMid + 1;
+        }
+        else
+        {
+            ulHigh = ulMid;
+        }
+    }
+    return ulLow;
+}
+
+/*********************** historyRead ************************
+    Copy of record n. False when it is not in the ring (any
+    more) or the writer may have reached its slot again
+    while it was copied.
+************************************************************/
+bool historyRead(const tHistoryView *pView, uint64_t n, tHistoryRecord *pRecord)
+{
+    uint64_t ulCount = historyCount(pView);
+
+    if(n >= ulCount || n + pView->header->capacity <= ulCount)
+    {
+        return false;
+    }
+    memcpy(pRecord, &pView->records[n % pView->header->capacity], sizeof(tHistoryRecord));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(n + pView->header->capacity <= historyCount(pView))
+    {
+        return false;
+    }
+    return (pRecord->checksum == historyChecksum(pRecord));
+}
+
+uint32_t historyChecksum(const tHistoryRecord *pRecord)
+{
+    const uint8_t *pBytes = (const uint8_t *)pRecord;
+    uint32_t uiHash = 2166136261u;
+    uint32_t i;
+    for(i=0; i<offsetof(tHistoryRecord, checksum); i+=1)
+    {
+        uiHash = (uiHash ^ pBytes[i]) * 16777619u;
+    }
+    return uiHash;
+}
+
+uint64_t historyLayoutSize(uint32_t uiCapacity)
+{
+    return historyRecordsOffset(uiCapacity) + (uint64_t)uiCapacity * sizeof(tHistoryRecord);
+}
+
+uint64_t historyIndexOffset()
+{
+    return HISTORY_HEADERSIZE;
+}
+
+uint64_t historyRecordsOffset(uint32_t uiCapacity)
+{
+    uint64_t ulIndexSize = (uint64_t)(uiCapacity / HISTORY_BLOCKRECORDS) * sizeof(uint64_t);
+    return historyIndexOffset() + ((ulIndexSize + HISTORY_HEADERSIZE - 1) / HISTORY_HEADERSIZE) * HISTORY_HEADERSIZE; // records start on a page
+}
+
+/************************ historyMap ************************
+    Maps a file of ulSize bytes and checks its header.
+************************************************************/
+int historyMap(int iFd, uint64_t ulSize, bool bWritable, tHistoryView *pView)
+{
+    uint8_t *pMap;
+    const tHistoryHeader *pHeader;
+
+    memset(pView, 0, sizeof(tHistoryView));
+    if(ulSize < HISTORY_HEADERSIZE)
+    {
+        return -1;
+    }
+    pMap = mmap(NULL, ulSize, bWritable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, iFd, 0);
+    if(pMap == MAP_FAILED)
+    {
+        return -1;
+    }
+    pHeader = (const tHistoryHeader *)pMap;
+    if(pHeader->magic != HISTORY_MAGIC || pHeader->version != HISTORY_VERSION || pHeader->recordSize != sizeof(tHistoryRecord)
+        || pHeader->capacity < HISTORY_BLOCKRECORDS || pHeader->capacity % HISTORY_BLOCKRECORDS != 0 || historyLayoutSize(pHeader->capacity) != ulSize)
+    {
+        munmap(pMap, ulSize);
+        return -1;
+    }
+    pView->header = pHeader;
+    pView->index = (const uint64_t *)(pMap + historyIndexOffset());
+    pView->records = (const tHistoryRecord *)(pMap + historyRecordsOffset(pHeader->capacity));
+    pView->size = ulSize;
+    return 0;
+}
+
+uint64_t historyNowMs()
+{
+    struct timespec sNow;
+    clock_gettime(CLOCK_REALTIME, &sNow);
+    return (uint64_t)sNow.tv_sec * 1000ULL + sNow.tv_nsec / 1000000;
+}
@@ -0,0 +1,111 @@
+#ifndef SACHISTORY_H
+#define SACHISTORY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#ifndef HISTORY_PATH // -D in test builds
+#define HISTORY_PATH                "/home/pi/iot/SACIot.history"
+#endif
+#define HISTORY_ENABLED             1 // default of [history] enabled
+#define HISTORY_RECORDS             131072 // default of [history] records, 8 MB, three months at one uplink per minute
+#define HISTORY_MINRECORDS          1024
+#define HISTORY_MAXRECORDS          (16 * 1024 * 1024) // 1 GB
+#define HISTORY_BLOCKRECORDS        256 // records per time index entry, the ring is a multiple of it
+#define HISTORY_PENDINGRECORDS      256 // appended records held in memory until historyPoll() stores them (16 kB), two bulk blocks
+#define HISTORY_MAGIC               0x53414348 // "SACH"
+#define HISTORY_VERSION             1 // bump when tHistoryRecord or the layout changes
+#define HISTORY_HEADERSIZE          4096
+#define HISTORY_FLAG_DOWNLINK       0x01 // downlink holds the server's reply
+#define HISTORY_FLAG_BULK           0x02 // stored by a bulk upload block
+
+/*
+    On-device history of the uplinks: a file of fixed size,
+    mapped shared, records in a ring. Layout:
+        header (HISTORY_HEADERSIZE) | time index (8 bytes per
+        block of HISTORY_BLOCKRECORDS, page aligned) | records
+    Record n (n counts every record ever written) sits in
+    slot n % capacity. Its unixMs never goes back, a clock
+    that steps back gets the last time again, so the records
+    are sorted by time and the index entry of a block holds
+    the unixMs of its first record: a range query is a binary
+    search over the index, then over one block.
+    The daemon is the only writer. A record is written in
+    place (checksum last), then the index entry, then count
+    is released. Readers (SACHistoryQuery) map the file read
+    only and drop a record when the writer may have reached
+    its slot again while they copied it. The slot the next
+    record goes to is never read, a full ring holds
+    capacity - 1 records. An append only copies the record
+    into memory: historyPoll() (housekeeping) stores the
+    pending ones into the mapping, where a page fault or a
+    page under write back may block for milliseconds, then
+    prefetches the next pages and schedules the write back.
+    Readers see a record one housekeeping tick later.
+*/
+
+typedef struct
+{
+    uint64_t unixMs; // when the result was known, the index key
+    uint32_t eventTime; // unix time of the event (tUplinkRecord.time)
+    uint32_t seqNr;
+    uint32_t latencyUs; // uplink exchange, 0 in a bulk block
+    int16_t errorCode; // 0: ok, < 0: commsStartUplink() and transport results
+    uint8_t cmdCode;
+    uint8_t encoding; // tUplinkEncoding
+    uint8_t uplinkSize;
+    uint8_t flags; // HISTORY_FLAG_*
+    uint8_t uplink[STRUCTS_SENDCMDPAYLOADSIZE];
+    uint8_t downlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    uint8_t reserved[14]; // 64 bytes
+    uint32_t checksum; // FNV-1a of everything above
+} tHistoryRecord;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize; // sizeof(tHistoryRecord)
+    uint32_t capacity; // records in the ring
+    uint64_t count; // records ever written, released after the record
+    uint64_t lastUnixMs;
+} tHistoryHeader;
+
+typedef struct
+{
+    const tHistoryHeader *header;
+    const uint64_t *index;
+    const tHistoryRecord *records;
+    uint64_t size; // of the mapping
+} tHistoryView;
+
+typedef struct
+{
+    uint32_t capacity;
+    uint64_t count;
+    uint64_t appended; // since open
+    uint64_t clockBacksteps; // records that got the last time again
+    uint32_t maxAppendUs; // historyWrite(), the uplink path
+    uint32_t maxStoreUs; // historyPoll() storing the pending records
+} tHistoryStats;
+
+/* writer side, the daemon */
+int historyOpen(const char *sPath, uint32_t uiRecords);
+void historyAppend(const tUplinkRecord *pRecord, int iResult, const uint8_t *pDownlink, uint8_t bFlags);
+void historyWrite(tHistoryRecord *pRecord);
+void historyPoll();
+const tHistoryStats *historyStats();
+void historyLog();
+void historyClose();
+
+/* reader side */
+int historyAttach(const char *sPath, tHistoryView *pView);
+void historyDetach(tHistoryView *pView);
+uint64_t historyOldest(const tHistoryView *pView);
+uint64_t historyCount(const tHistoryView *pView);
+uint64_t historyFind(const tHistoryView *pView, uint64_t ulFromMs);
+bool historyRead(const tHistoryView *pView, uint64_t n, tHistoryRecord *pRecord);
+uint32_t historyChecksum(const tHistoryRecord *pRecord);
+
+#endif
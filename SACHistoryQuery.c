@@ -0,0 +1,219 @@
+/*
+    Query tool for the uplink history of SACRPiIotSlave
+    (SACHistory.h), reads the file while the daemon writes.
+
+    Usage:
+        SACHistoryQuery                 records of the last hour
+        SACHistoryQuery -H <hours>      records of the last <hours> hours
+        SACHistoryQuery -s <from> [-e <to>]
+                                        records from..to, unix time or local
+                                        time "YYYY-MM-DD HH:MM[:SS]"
+        SACHistoryQuery -l <n>          the last <n> records
+        SACHistoryQuery -i              size and time span of the history
+    Options:
+        -f <file>   other history file than HISTORY_PATH
+        -c          CSV instead of text
+    The number of records and the lookup time go to stderr.
+
+    Compile:
+        gcc -Wall -o SACHistoryQuery SACHistoryQuery.c SACHistory.c SACPrintUtils.c -I.
+*/
+
+#define _XOPEN_SOURCE 700 /* strptime */
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memset */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "SACHistory.h"
+#include "SACPrintUtils.h"
+
+/******************** Prototypes ********************/
+bool queryParseTime(const char *sTime, uint64_t *pUnixMs);
+void queryPrint(const tHistoryRecord *pRecord, bool bCsv);
+void queryFormatTime(uint64_t ulUnixMs, char *sDest, size_t uiSize);
+int queryInfo(const tHistoryView *pView, const char *sPath);
+/****************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sPath = HISTORY_PATH;
+    tHistoryView sView;
+    tHistoryRecord sRecord;
+    uint64_t ulNowMs = (uint64_t)time(NULL) * 1000ULL;
+    uint64_t ulFromMs = ulNowMs - 3600ULL * 1000ULL;
+    uint64_t ulToMs = UINT64_MAX;
+    uint64_t ulLast = 0;
+    uint64_t ulStartUs;
+    uint64_t ulFindUs;
+    uint64_t ulRecords = 0;
+    uint64_t ulSkipped = 0;
+    uint64_t n;
+    bool bCsv = false;
+    bool bInfo = false;
+    int iOption;
+
+    while((iOption = getopt(argc, argv, "f:H:s:e:l:ci")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'f': sPath = optarg; break;
+            case 'H': ulFromMs = ulNowMs - (uint64_t)(atof(optarg) * 3600.0 * 1000.0); break;
+            case 'l': ulLast = strtoull(optarg, NULL, 10); break;
+            case 'c': bCsv = true; break;
+            case 'i': bInfo = true; break;
+            case 's':
+            case 'e':
+                if(!queryParseTime(optarg, (iOption == 's') ? &ulFromMs : &ulToMs))
+                {
+                    fprintf(stderr, "Can't read the time \'%s\', expected unix time or \"YYYY-MM-DD HH:MM[:SS]\".\n", optarg);
+                    return 2;
+                }
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f file] [-H hours | -s from [-e to] | -l records | -i] [-c]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if(historyAttach(sPath, &sView) < 0)
+    {
+        fprintf(stderr, "No history in \'%s\' (missing or other version %u).\n", sPath, HISTORY_VERSION);
+        return 1;
+    }
+    if(bInfo)
+    {
+        return queryInfo(&sView, sPath);
+    }
+    ulStartUs = printGetMonotonicTimeUs();
+    if(ulLast > 0)
+    {
+        n = historyCount(&sView);
+        n = (ulLast < n - historyOldest(&sView)) ? n - ulLast : historyOldest(&sView);
+        ulFromMs = 0;
+    }
+    else
+    {
+        n = historyFind(&sView, ulFromMs);
+    }
+    ulFindUs = printGetMonotonicTimeUs() - ulStartUs;
+    if(bCsv)
+    {
+        printf("time,unix_ms,event_time,seq_nr,cmd_code,encoding,error_code,latency_us,uplink,downlink,flags\n");
+    }
+    for(; n < historyCount(&sView); n+=1)
+    {
+        if(!historyRead(&sView, n, &sRecord))
+        {
+            ulSkipped += 1; // overwritten while we read it
+            continue;
+        }
+        if(sRecord.unixMs > ulToMs)
+        {
+            break;
+        }
+        queryPrint(&sRecord, bCsv);
+        ulRecords += 1;
+    }
+    fprintf(stderr, "%llu records (%llu overwritten while reading), found in %llu us.\n", (unsigned long long)ulRecords, (unsigned long long)ulSkipped, (unsigned long long)ulFindUs);
+    historyDetach(&sView);
+    return 0;
+}
+
+/********************* queryParseTime ***********************
+    Unix time (seconds) or local time, the first one that
+    reads the whole string.
+************************************************************/
+bool queryParseTime(const char *sTime, uint64_t *pUnixMs)
+{
+    struct tm sTm;
+    char *pEnd;
+    unsigned long long ulSeconds = strtoull(sTime, &pEnd, 10);
+
+    if(pEnd != sTime && *pEnd == 0x00)
+    {
+        *pUnixMs = ulSeconds * 1000ULL;
+        return true;
+    }
+    memset(&sTm, 0, sizeof(sTm));
+    pEnd = strptime(sTime, "%Y-%m-%d %H:%M:%S", &sTm);
+    if(pEnd == NULL || *pEnd != 0x00)
+    {
+        memset(&sTm, 0, sizeof(sTm));
+        pEnd = strptime(sTime, "%Y-%m-%d %H:%M", &sTm);
+    }
+    if(pEnd == NULL || *pEnd != 0x00)
+    {
+        return false;
+    }
+    sTm.tm_isdst = -1;
+    *pUnixMs = (uint64_t)mktime(&sTm) * 1000ULL;
+    return true;
+}
+
+void queryPrint(const tHistoryRecord *pRecord, bool bCsv)
+{
+    char sTime[32];
+    char sUplink[2 * STRUCTS_SENDCMDPAYLOADSIZE + 1];
+    char sDownlink[2 * STRUCTS_DECKEDREPLYPAYLOADSIZE + 1] = "";
+    char sResult[16] = "ok";
+    int i;
+
+    queryFormatTime(pRecord->unixMs, sTime, sizeof(sTime));
+    sUplink[0] = 0x00;
+    for(i=0; i<pRecord->uplinkSize && i<STRUCTS_SENDCMDPAYLOADSIZE; i+=1)
+    {
+        snprintf(&sUplink[2 * i], 3, "%02x", pRecord->uplink[i]);
+    }
+    for(i=0; i<STRUCTS_DECKEDREPLYPAYLOADSIZE && (pRecord->flags & HISTORY_FLAG_DOWNLINK); i+=1)
+    {
+        snprintf(&sDownlink[2 * i], 3, "%02x", pRecord->downlink[i]);
+    }
+    if(bCsv)
+    {
+        printf("%s,%llu,%u,%u,%u,%u,%i,%u,%s,%s,%u\n", sTime, (unsigned long long)pRecord->unixMs, pRecord->eventTime, pRecord->seqNr,
+            pRecord->cmdCode, pRecord->encoding, pRecord->errorCode, pRecord->latencyUs, sUplink, sDownlink, pRecord->flags);
+        return;
+    }
+    if(pRecord->errorCode != 0)
+    {
+        snprintf(sResult, sizeof(sResult), "error %i", pRecord->errorCode);
+    }
+    printf("%s  seq %-8u cmd 0x%02x  %-10s %9.1f ms  up %-24s  dl %s%s\n", sTime, pRecord->seqNr, pRecord->cmdCode, sResult,
+        pRecord->latencyUs / 1000.0, sUplink, (pRecord->flags & HISTORY_FLAG_DOWNLINK) ? sDownlink : "-",
+        (pRecord->flags & HISTORY_FLAG_BULK) ? "  (bulk)" : "");
+}
+
+void queryFormatTime(uint64_t ulUnixMs, char *sDest, size_t uiSize)
+{
+    time_t sSeconds = (time_t)(ulUnixMs / 1000);
+    struct tm sTm;
+    char sSecondsText[24];
+
+    localtime_r(&sSeconds, &sTm);
+    strftime(sSecondsText, sizeof(sSecondsText), "%Y-%m-%d %H:%M:%S", &sTm);
+    snprintf(sDest, uiSize, "%s.%03u", sSecondsText, (unsigned int)(ulUnixMs % 1000));
+}
+
+int queryInfo(const tHistoryView *pView, const char *sPath)
+{
+    uint64_t ulCount = historyCount(pView);
+    uint64_t ulOldest = historyOldest(pView);
+    tHistoryRecord sFirst;
+    tHistoryRecord sLast;
+    char sFrom[32] = "-";
+    char sTo[32] = "-";
+
+    if(ulCount > ulOldest && historyRead(pView, historyFind(pView, 0), &sFirst) && historyRead(pView, ulCount - 1, &sLast))
+    {
+        queryFormatTime(sFirst.unixMs, sFrom, sizeof(sFrom));
+        queryFormatTime(sLast.unixMs, sTo, sizeof(sTo));
+    }
+    printf("%s: %llu bytes, %llu of %u records, %llu written in total\n", sPath, (unsigned long long)pView->size,
+        (unsigned long long)(ulCount - ulOldest), pView->header->capacity, (unsigned long long)ulCount);
+    printf("  from %s to %s\n", sFrom, sTo);
+    return 0;
+}
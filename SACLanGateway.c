@@ -0,0 +1,981 @@
+#include "SACLanGateway.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+
+#include "string.h" /* memcpy, memset, memmove */
+#include <sys/socket.h> /* socket, connect, accept */
+#include <netinet/in.h> /* struct sockaddr_in */
+#include <netinet/tcp.h> /* TCP_NODELAY */
+#include <arpa/inet.h> /* inet_aton */
+#include <netdb.h> /* gethostbyname */
+#include <fcntl.h> /* O_NONBLOCK */
+#include <poll.h>
+#include <ctype.h>
+#include <errno.h>
+#include "stdio.h"
+#include "unistd.h"
+
+#define LANGW_UPLINKBODYSIZE    (12 + STRUCTS_SENDCMDPAYLOADSIZE)
+#define LANGW_REPLYBODYSIZE     (1 + STRUCTS_DECKEDREPLYPAYLOADSIZE)
+#define LANGW_BLOCKINGSLOT      COMMS_MAXINFLIGHT // lanSendUplink()'s in flight slot, the others are the reactor's
+
+typedef struct
+{
+    int iFd;
+    bool bConnecting; // slave: non blocking connect not done yet
+    bool bHello; // aggregator: the device id arrived
+    uint32_t uiGeneration; // aggregator: replies for an earlier connection in this slot are dropped
+    char sDeviceId[STRUCTS_SERVREQ_MAXSTRSIZE];
+    int iRxLength;
+    int iTxLength;
+    uint8_t abRx[LANGW_BUFSIZE];
+    uint8_t abTx[LANGW_BUFSIZE];
+} tLanConn;
+
+typedef int (*tLanFrameHandler)(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength);
+
+typedef enum
+{
+    LANQ_FREE,
+    LANQ_QUEUED, // waits for the upstream
+    LANQ_SENT, // commsStartUplink() took it
+} tLanQueuedState;
+
+typedef struct
+{
+    uint8_t state; // tLanQueuedState
+    int iConn; // masLanSlaves index
+    uint32_t uiGeneration;
+    uint32_t uiTag;
+    uint32_t uiOrder; // arrival, the oldest goes first, also the record id on the upstream
+    uint64_t ulDeadlineUs;
+    tUplinkRecord sRecord;
+} tLanQueued;
+
+typedef struct
+{
+    bool bUsed;
+    bool bDone; // LANGW_BLOCKINGSLOT: the reply arrived
+    int iResult;
+    uint32_t uiTag;
+    tUplinkRecord sRecord;
+    tCommsDoneCallback pDone;
+} tLanInFlight;
+
+/****************** private function prototypes *********************/
+int lanInit();
+int lanSendUplink(tUplinkRecord *pRecord);
+int lanStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone);
+void lanClose();
+int lanConnect();
+int lanQueueUplink(tLanInFlight *pSlot, tUplinkRecord *pRecord);
+void lanSlaveCallback(int iFd, uint32_t uiEvents, void *pContext);
+void lanSlaveTimeout(int iFd, uint32_t uiEvents, void *pContext);
+int lanSlaveFrame(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength);
+void lanSlaveBroken(const char *sReason);
+void lanSlaveArmTimer();
+void lanGatewayAccept(int iFd, uint32_t uiEvents, void *pContext);
+void lanGatewayConnCallback(int iFd, uint32_t uiEvents, void *pContext);
+int lanGatewayFrame(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength);
+void lanGatewayPump();
+void lanGatewayPumpTimer(int iFd, uint32_t uiEvents, void *pContext);
+void lanGatewayDone(tUplinkRecord *pRecord, int iResult);
+void lanGatewayReply(tLanQueued *pQueued, int iResult, const uint8_t *pDownlink);
+void lanGatewayDrop(tLanConn *pConn, const char *sReason);
+int lanConnQueue(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength);
+int lanConnFlush(tLanConn *pConn);
+int lanConnRead(tLanConn *pConn, tLanFrameHandler pHandler);
+void lanPutU32(uint8_t *pDest, uint32_t uiValue);
+uint32_t lanGetU32(const uint8_t *pSource);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tLanConn msLanSlave = {.iFd = -1}; // slave: the connection to the aggregator
+static tLanInFlight masLanInFlight[COMMS_MAXINFLIGHT + 1];
+static uint32_t muiLanTag = 0;
+static int miLanTimerFd = -1;
+static bool mbLanRegistered = false; // slave connection is watched by the reactor
+static char msLanAddress[STRUCTS_SERVREQ_MAXSTRSIZE];
+static uint32_t muiLanPort = LANGW_PORT;
+static tLanConn masLanSlaves[LANGW_MAXSLAVES]; // aggregator
+static tLanQueued masLanQueued[LANGW_MAXQUEUED];
+static int miLanListenFd = -1;
+static int miLanPumpTimerFd = -1;
+static uint32_t muiLanGeneration = 0;
+static uint32_t muiLanOrder = 0;
+static tLanGatewayStats msLanStats = {0};
+/********************************************************************/
+
+const tCommsTransport sLanTransport =
+{
+    .name = "lan",
+    .init = lanInit,
+    .sendUplink = lanSendUplink,
+    .poll = NULL,
+    .close = lanClose,
+    .startUplink = lanStartUplink,
+};
+
+/************************* lanInit **************************
+    Slave: connecting is postponed to the first uplink like
+    the mqtt transport. The aggregator is [gateway]
+    address:port.
+************************************************************/
+int lanInit()
+{
+    const tConfig *pConfig = configGet();
+    snprintf(msLanAddress, sizeof(msLanAddress), "%s", pConfig->gwAddress);
+    muiLanPort = pConfig->gwPort;
+    printf("[INFO] (%s) %s: LAN gateway %s:%u, device id \'%s\'.\n", printTimestamp(), __func__, msLanAddress, muiLanPort, pConfig->deviceId);
+    return 0;
+}
+
+/********************** lanSendUplink ***********************
+    Blocking variant: waits for the aggregator's reply to
+    this uplink, replies to started ones are handled on the
+    way.
+************************************************************/
+int lanSendUplink(tUplinkRecord *pRecord)
+{
+    tLanInFlight *pSlot = &masLanInFlight[LANGW_BLOCKINGSLOT];
+    uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + configGet()->socketTimeoutSec * 1000000ULL;
+    struct pollfd sPollFd;
+    int iError;
+    socklen_t uiLength;
+
+    if(msLanSlave.iFd < 0 && lanConnect() < 0)
+    {
+        return -1;
+    }
+    if(lanQueueUplink(pSlot, pRecord) < 0)
+    {
+        return -1;
+    }
+    while(!pSlot->bDone)
+    {
+        if(printGetMonotonicTimeUs() >= ulDeadlineUs)
+        {
+            lanSlaveBroken("timeout");
+            break;
+        }
+        sPollFd.fd = msLanSlave.iFd;
+        sPollFd.events = POLLIN | ((msLanSlave.bConnecting || msLanSlave.iTxLength > 0) ? POLLOUT : 0);
+        sPollFd.revents = 0;
+        if(poll(&sPollFd, 1, (int)((ulDeadlineUs - printGetMonotonicTimeUs()) / 1000) + 1) <= 0)
+        {
+            continue;
+        }
+        if(msLanSlave.bConnecting)
+        {
+            iError = 0;
+            uiLength = sizeof(iError);
+            getsockopt(msLanSlave.iFd, SOL_SOCKET, SO_ERROR, &iError, &uiLength);
+            if(iError != 0)
+            {
+                printf("[ERROR] (%s) %s: Could not connect to the LAN gateway %s:%u. Socket connect error code %i.\n", printTimestamp(), __func__, msLanAddress, muiLanPort, iError);
+                lanSlaveBroken("connect");
+                break;
+            }
+            msLanSlave.bConnecting = false;
+        }
+        if(lanConnFlush(&msLanSlave) < 0 || lanConnRead(&msLanSlave, lanSlaveFrame) < 0)
+        {
+            lanSlaveBroken("closed by the gateway");
+            break;
+        }
+    }
+    pSlot->bUsed = false;
+    return pSlot->bDone ? pSlot->iResult : -1;
+}
+
+/********************* lanStartUplink ***********************
+    Reactor variant, the reply arrives in lanSlaveFrame().
+************************************************************/
+int lanStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone)
+{
+    int i;
+
+    if(msLanSlave.iFd < 0 && lanConnect() < 0)
+    {
+        return -1;
+    }
+    if(!mbLanRegistered)
+    {
+        if(miLanTimerFd < 0)
+        {
+            miLanTimerFd = reactorTimerCreate(lanSlaveTimeout, NULL);
+        }
+        if(miLanTimerFd < 0 || reactorAddFd(msLanSlave.iFd, EPOLLIN | EPOLLOUT, lanSlaveCallback, NULL) < 0)
+        {
+            return -1;
+        }
+        mbLanRegistered = true;
+    }
+    for(i=0; i<LANGW_BLOCKINGSLOT; i+=1)
+    {
+        if(!masLanInFlight[i].bUsed)
+        {
+            break;
+        }
+    }
+    if(i == LANGW_BLOCKINGSLOT || lanQueueUplink(&masLanInFlight[i], pRecord) < 0)
+    {
+        return -1;
+    }
+    masLanInFlight[i].pDone = pDone;
+    reactorModFd(msLanSlave.iFd, EPOLLIN | EPOLLOUT);
+    lanSlaveArmTimer();
+    return 0;
+}
+
+void lanClose()
+{
+    if(msLanSlave.iFd >= 0)
+    {
+        lanSlaveBroken("transport closed");
+    }
+    if(miLanTimerFd >= 0)
+    {
+        reactorTimerClose(miLanTimerFd);
+        miLanTimerFd = -1;
+    }
+}
+
+/************************ lanConnect ************************
+    Non blocking connect, the HELLO waits in the send buffer
+    until it is done.
+************************************************************/
+int lanConnect()
+{
+    struct sockaddr_in sAddr;
+    struct hostent *pHost;
+    int iFlag = 1;
+
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_port = htons(muiLanPort);
+    if(inet_aton(msLanAddress, &sAddr.sin_addr) == 0)
+    {
+        pHost = gethostbyname(msLanAddress);
+        if(pHost == NULL)
+        {
+            printf("[ERROR] (%s) %s: No such host: \'%s\'\n", printTimestamp(), __func__, msLanAddress);
+            return -1;
+        }
+        memcpy(&sAddr.sin_addr.s_addr, pHost->h_addr, pHost->h_length);
+    }
+    msLanSlave.iFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(msLanSlave.iFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Failed to open socket for \'%s\'\n", printTimestamp(), __func__, msLanAddress);
+        return -1;
+    }
+    fcntl(msLanSlave.iFd, F_SETFL, fcntl(msLanSlave.iFd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(msLanSlave.iFd, IPPROTO_TCP, TCP_NODELAY, &iFlag, sizeof(iFlag));
+    msLanSlave.iRxLength = 0;
+    msLanSlave.iTxLength = 0;
+    msLanSlave.bConnecting = true;
+    if(connect(msLanSlave.iFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 && errno != EINPROGRESS)
+    {
+        printf("[ERROR] (%s) %s: Could not connect to the LAN gateway %s:%u. Socket connect error code %i.\n", printTimestamp(), __func__, msLanAddress, muiLanPort, errno);
+        close(msLanSlave.iFd);
+        msLanSlave.iFd = -1;
+        return -1;
+    }
+    lanConnQueue(&msLanSlave, LANGW_HELLO, 0, (const uint8_t *)configGet()->deviceId, strlen(configGet()->deviceId));
+    msLanStats.connects += 1;
+    return 0;
+}
+
+int lanQueueUplink(tLanInFlight *pSlot, tUplinkRecord *pRecord)
+{
+    uint8_t abBody[LANGW_UPLINKBODYSIZE];
+    uint32_t uiSeqNr = commsRecordSeqNr(pRecord);
+
+    lanPutU32(&abBody[0], uiSeqNr);
+    lanPutU32(&abBody[4], (uint32_t)pRecord->time);
+    abBody[8] = pRecord->encoding;
+    abBody[9] = pRecord->cmd.cmdCode;
+    abBody[10] = pRecord->cmd.downlinkIndicator;
+    abBody[11] = pRecord->cmd.payloadSize;
+    memcpy(&abBody[12], pRecord->cmd.payload, STRUCTS_SENDCMDPAYLOADSIZE);
+    muiLanTag += 1;
+    if(lanConnQueue(&msLanSlave, LANGW_UPLINK, muiLanTag, abBody, sizeof(abBody)) < 0)
+    {
+        printf("[ERROR] (%s) %s: Send buffer to the LAN gateway full.\n", printTimestamp(), __func__);
+        return -1;
+    }
+    memcpy(&pSlot->sRecord, pRecord, sizeof(tUplinkRecord));
+    pSlot->uiTag = muiLanTag;
+    pSlot->bUsed = true;
+    pSlot->bDone = false;
+    pSlot->pDone = NULL;
+    return 0;
+}
+
+void lanSlaveCallback(int iFd, uint32_t uiEvents, void *pContext)
+{
+    int iError = 0;
+    socklen_t uiLength = sizeof(iError);
+
+    if(msLanSlave.bConnecting)
+    {
+        getsockopt(msLanSlave.iFd, SOL_SOCKET, SO_ERROR, &iError, &uiLength);
+        if(iError == EINPROGRESS)
+        {
+            return;
+        }
+        if(iError != 0)
+        {
+            printf("[ERROR] (%s) %s: Could not connect to the LAN gateway %s:%u. Socket connect error code %i.\n", printTimestamp(), __func__, msLanAddress, muiLanPort, iError);
+            lanSlaveBroken("connect");
+            return;
+        }
+        msLanSlave.bConnecting = false;
+    }
+    if(lanConnFlush(&msLanSlave) < 0)
+    {
+        lanSlaveBroken("write");
+        return;
+    }
+    if((uiEvents & (EPOLLIN | EPOLLHUP | EPOLLERR)) && lanConnRead(&msLanSlave, lanSlaveFrame) < 0)
+    {
+        lanSlaveBroken("closed by the gateway");
+        return;
+    }
+    if(msLanSlave.iFd >= 0)
+    {
+        reactorModFd(msLanSlave.iFd, EPOLLIN | ((msLanSlave.iTxLength > 0) ? EPOLLOUT : 0));
+    }
+}
+
+void lanSlaveTimeout(int iFd, uint32_t uiEvents, void *pContext)
+{
+    lanSlaveBroken("timeout");
+}
+
+/********************** lanSlaveFrame ***********************
+    A reply: the downlink goes into the decked reply like on
+    the other transports.
+************************************************************/
+int lanSlaveFrame(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength)
+{
+    tLanInFlight *pSlot = NULL;
+    tUplinkRecord sRecord;
+    tCommsDoneCallback pDone;
+    int iResult;
+    int i;
+
+    if(bType != LANGW_REPLY || iLength < LANGW_REPLYBODYSIZE)
+    {
+        return 0;
+    }
+    for(i=0; i<=LANGW_BLOCKINGSLOT; i+=1)
+    {
+        if(masLanInFlight[i].bUsed && !masLanInFlight[i].bDone && masLanInFlight[i].uiTag == uiTag)
+        {
+            pSlot = &masLanInFlight[i];
+            break;
+        }
+    }
+    if(pSlot == NULL)
+    {
+        return 0; // an uplink that was given up already
+    }
+    iResult = (int8_t)pBody[0];
+    if(iResult >= 0)
+    {
+        memcpy(getCtrlDeckedReply()->payload, &pBody[1], STRUCTS_DECKEDREPLYPAYLOADSIZE);
+        msLanStats.forwarded += 1;
+    }
+    else
+    {
+        msLanStats.failed += 1;
+    }
+    if(pSlot->pDone == NULL)
+    {
+        pSlot->iResult = iResult;
+        pSlot->bDone = true;
+        return 0;
+    }
+    memcpy(&sRecord, &pSlot->sRecord, sizeof(tUplinkRecord));
+    pDone = pSlot->pDone;
+    pSlot->bUsed = false;
+    lanSlaveArmTimer();
+    commsUplinkFinished(&sRecord, iResult, pDone);
+    return 0;
+}
+
+/********************** lanSlaveBroken **********************
+    The connection is closed, what is in flight fails and
+    stays queued in the scheduler. The next uplink
+    connects again.
+************************************************************/
+void lanSlaveBroken(const char *sReason)
+{
+    tUplinkRecord sRecord;
+    tCommsDoneCallback pDone;
+    int i;
+
+    printf("[WARNING] (%s) %s: Connection to the LAN gateway lost (%s).\n", printTimestamp(), __func__, sReason);
+    if(msLanSlave.iFd >= 0)
+    {
+        if(mbLanRegistered)
+        {
+            reactorDelFd(msLanSlave.iFd);
+        }
+        close(msLanSlave.iFd);
+    }
+    msLanSlave.iFd = -1;
+    msLanSlave.iRxLength = 0;
+    msLanSlave.iTxLength = 0;
+    mbLanRegistered = false;
+    if(miLanTimerFd >= 0)
+    {
+        reactorTimerDisarm(miLanTimerFd);
+    }
+    for(i=0; i<=LANGW_BLOCKINGSLOT; i+=1)
+    {
+        if(!masLanInFlight[i].bUsed || masLanInFlight[i].bDone)
+        {
+            continue;
+        }
+        msLanStats.failed += 1;
+        if(masLanInFlight[i].pDone == NULL)
+        {
+            masLanInFlight[i].iResult = -1;
+            masLanInFlight[i].bDone = true;
+            continue;
+        }
+        memcpy(&sRecord, &masLanInFlight[i].sRecord, sizeof(tUplinkRecord));
+        pDone = masLanInFlight[i].pDone;
+        masLanInFlight[i].bUsed = false;
+        commsUplinkFinished(&sRecord, -1, pDone);
+    }
+}
+
+/******************** lanSlaveArmTimer **********************
+    Socket timeout since the last reply while uplinks are
+    in flight.
+************************************************************/
+void lanSlaveArmTimer()
+{
+    int i;
+
+    if(miLanTimerFd < 0)
+    {
+        return;
+    }
+    for(i=0; i<LANGW_BLOCKINGSLOT; i+=1)
+    {
+        if(masLanInFlight[i].bUsed)
+        {
+            reactorTimerArm(miLanTimerFd, configGet()->socketTimeoutSec * 1000, 0);
+            return;
+        }
+    }
+    reactorTimerDisarm(miLanTimerFd);
+}
+
+/********************* lanGatewayInit ***********************
+    Aggregator ([gateway] aggregator = yes, reactor mode):
+    listens on [gateway] address:port, empty address: all
+    interfaces.
+************************************************************/
+int lanGatewayInit()
+{
+    const tConfig *pConfig = configGet();
+    struct sockaddr_in sAddr;
+    int iFlag = 1;
+    int i;
+
+    if(!pConfig->gwAggregator)
+    {
+        return 0;
+    }
+    if(pConfig->transport != COMMS_TRANSPORT_HTTP)
+    {
+        printf("[ERROR] (%s) %s: The LAN gateway needs the http transport upstream, not aggregating.\n", printTimestamp(), __func__);
+        return -1;
+    }
+    if(pConfig->pipelineDepth == 0)
+    {
+        printf("[WARNING] (%s) %s: pipeline_depth is 0, a connection per forwarded uplink.\n", printTimestamp(), __func__);
+    }
+    for(i=0; i<LANGW_MAXSLAVES; i+=1)
+    {
+        masLanSlaves[i].iFd = -1;
+    }
+    memset(masLanQueued, 0, sizeof(masLanQueued));
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_port = htons(pConfig->gwPort);
+    sAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if(pConfig->gwAddress[0] != 0x00 && inet_aton(pConfig->gwAddress, &sAddr.sin_addr) == 0)
+    {
+        printf("[ERROR] (%s) %s: \'%s\' is not an IPv4 address to listen on.\n", printTimestamp(), __func__, pConfig->gwAddress);
+        return -1;
+    }
+    miLanListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(miLanListenFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Failed to open the listening socket.\n", printTimestamp(), __func__);
+        return -1;
+    }
+    fcntl(miLanListenFd, F_SETFL, fcntl(miLanListenFd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(miLanListenFd, SOL_SOCKET, SO_REUSEADDR, &iFlag, sizeof(iFlag));
+    miLanPumpTimerFd = reactorTimerCreate(lanGatewayPumpTimer, NULL);
+    if(bind(miLanListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(miLanListenFd, LANGW_MAXSLAVES) < 0 ||
+        miLanPumpTimerFd < 0 || reactorAddFd(miLanListenFd, EPOLLIN, lanGatewayAccept, NULL) < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not listen on port %u. Error code %i.\n", printTimestamp(), __func__, pConfig->gwPort, errno);
+        lanGatewayClose();
+        return -1;
+    }
+    printf("[INFO] (%s) %s: Aggregating uplinks of up to %i slaves on port %u.\n", printTimestamp(), __func__, LANGW_MAXSLAVES, pConfig->gwPort);
+    return 0;
+}
+
+/****************** lanGatewayApplyConfig *******************
+    A changed [gateway] section or upstream transport starts
+    the aggregator over, connected slaves reconnect.
+************************************************************/
+void lanGatewayApplyConfig(uint32_t uiChanged)
+{
+    if((uiChanged & (CONFIG_CHANGED_GATEWAY | CONFIG_CHANGED_TRANSPORT)) == 0)
+    {
+        return;
+    }
+    lanGatewayClose();
+    lanGatewayInit();
+}
+
+const tLanGatewayStats *lanGatewayStats()
+{
+    return &msLanStats;
+}
+
+void lanGatewayLog()
+{
+    if(msLanStats.accepted == 0 && msLanStats.connects == 0)
+    {
+        return;
+    }
+    printf("[INFO] (%s) %s: %llu slave connections, %llu connections to a gateway, %llu uplinks forwarded, %llu failed, %llu refused, max. %u queued.\n", printTimestamp(), __func__,
+        (unsigned long long)msLanStats.accepted,
+        (unsigned long long)msLanStats.connects,
+        (unsigned long long)msLanStats.forwarded,
+        (unsigned long long)msLanStats.failed,
+        (unsigned long long)msLanStats.refused,
+        msLanStats.maxQueued);
+}
+
+/******************** lanGatewayClose ***********************
+    Slaves are dropped, uplinks still on the upstream finish
+    there, their replies are discarded.
+************************************************************/
+void lanGatewayClose()
+{
+    int i;
+
+    if(miLanListenFd >= 0)
+    {
+        for(i=0; i<LANGW_MAXSLAVES; i+=1)
+        {
+            if(masLanSlaves[i].iFd >= 0)
+            {
+                lanGatewayDrop(&masLanSlaves[i], "gateway closed");
+            }
+        }
+        memset(masLanQueued, 0, sizeof(masLanQueued));
+        reactorDelFd(miLanListenFd);
+        close(miLanListenFd);
+        miLanListenFd = -1;
+    }
+    if(miLanPumpTimerFd >= 0)
+    {
+        reactorTimerClose(miLanPumpTimerFd);
+        miLanPumpTimerFd = -1;
+    }
+}
+
+void lanGatewayAccept(int iFd, uint32_t uiEvents, void *pContext)
+{
+    tLanConn *pConn = NULL;
+    int iConnFd;
+    int iFlag = 1;
+    int i;
+
+    iConnFd = accept(miLanListenFd, NULL, NULL);
+    if(iConnFd < 0)
+    {
+        return;
+    }
+    fcntl(iConnFd, F_SETFL, fcntl(iConnFd, F_GETFL, 0) | O_NONBLOCK);
+    for(i=0; i<LANGW_MAXSLAVES; i+=1)
+    {
+        if(masLanSlaves[i].iFd < 0)
+        {
+            pConn = &masLanSlaves[i];
+            break;
+        }
+    }
+    if(pConn == NULL || reactorAddFd(iConnFd, EPOLLIN, lanGatewayConnCallback, pConn) < 0)
+    {
+        printf("[WARNING] (%s) %s: No room for another slave, connection refused.\n", printTimestamp(), __func__);
+        msLanStats.refused += 1;
+        close(iConnFd);
+        return;
+    }
+    setsockopt(iConnFd, IPPROTO_TCP, TCP_NODELAY, &iFlag, sizeof(iFlag));
+    pConn->iFd = iConnFd;
+    pConn->bHello = false;
+    pConn->uiGeneration = ++muiLanGeneration;
+    pConn->sDeviceId[0] = 0x00;
+    pConn->iRxLength = 0;
+    pConn->iTxLength = 0;
+    msLanStats.accepted += 1;
+    msLanStats.slaves += 1;
+}
+
+void lanGatewayConnCallback(int iFd, uint32_t uiEvents, void *pContext)
+{
+    tLanConn *pConn = (tLanConn *)pContext;
+
+    if(lanConnFlush(pConn) < 0)
+    {
+        lanGatewayDrop(pConn, "write");
+        return;
+    }
+    if((uiEvents & (EPOLLIN | EPOLLHUP | EPOLLERR)) && lanConnRead(pConn, lanGatewayFrame) < 0)
+    {
+        lanGatewayDrop(pConn, "closed by the slave");
+        return;
+    }
+    if(pConn->iFd >= 0)
+    {
+        reactorModFd(pConn->iFd, EPOLLIN | ((pConn->iTxLength > 0) ? EPOLLOUT : 0));
+    }
+}
+
+/********************* lanGatewayFrame **********************
+    HELLO names the slave, an UPLINK becomes a record with
+    the slave's device id and sequence number and waits for
+    the upstream.
+************************************************************/
+int lanGatewayFrame(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength)
+{
+    tLanQueued *pQueued = NULL;
+    tLanQueued sRefused;
+    uint32_t uiQueued = 0;
+    int i;
+
+    if(bType == LANGW_HELLO)
+    {
+        if(iLength == 0 || iLength >= STRUCTS_SERVREQ_MAXSTRSIZE)
+        {
+            return -1;
+        }
+        for(i=0; i<iLength; i+=1)
+        {
+            if(!isalnum(pBody[i]) && pBody[i] != '-' && pBody[i] != '_' && pBody[i] != '.')
+            {
+                return -1; // goes into the request line
+            }
+            pConn->sDeviceId[i] = (char)pBody[i];
+        }
+        pConn->sDeviceId[iLength] = 0x00;
+        pConn->bHello = true;
+        printf("[INFO] (%s) %s: Slave \'%s\' connected.\n", printTimestamp(), __func__, pConn->sDeviceId);
+        return 0;
+    }
+    if(bType != LANGW_UPLINK || !pConn->bHello || iLength < LANGW_UPLINKBODYSIZE)
+    {
+        msLanStats.refused += 1;
+        return -1;
+    }
+    for(i=0; i<LANGW_MAXQUEUED; i+=1)
+    {
+        if(masLanQueued[i].state == LANQ_FREE && pQueued == NULL)
+        {
+            pQueued = &masLanQueued[i];
+        }
+        uiQueued += (masLanQueued[i].state != LANQ_FREE) ? 1 : 0;
+    }
+    if(pQueued == NULL)
+    {
+        memset(&sRefused, 0, sizeof(sRefused));
+        sRefused.iConn = pConn - masLanSlaves;
+        sRefused.uiGeneration = pConn->uiGeneration;
+        sRefused.uiTag = uiTag;
+        msLanStats.refused += 1;
+        lanGatewayReply(&sRefused, -3, NULL);
+        return 0;
+    }
+    memset(pQueued, 0, sizeof(tLanQueued));
+    pQueued->iConn = pConn - masLanSlaves;
+    pQueued->uiGeneration = pConn->uiGeneration;
+    pQueued->uiTag = uiTag;
+    pQueued->uiOrder = ++muiLanOrder;
+    pQueued->ulDeadlineUs = printGetMonotonicTimeUs() + configGet()->socketTimeoutSec * 1000000ULL;
+    pQueued->sRecord.hasSeqNr = 1;
+    pQueued->sRecord.seqNr = lanGetU32(&pBody[0]);
+    pQueued->sRecord.time = lanGetU32(&pBody[4]);
+    pQueued->sRecord.encoding = (pBody[8] < UPLENC_COUNT) ? pBody[8] : UPLENC_RAW;
+    pQueued->sRecord.cmd.startTag = IOT_FRMSTARTTAG;
+    pQueued->sRecord.cmd.cmdCode = pBody[9];
+    pQueued->sRecord.cmd.downlinkIndicator = pBody[10];
+    pQueued->sRecord.cmd.payloadSize = (pBody[11] <= STRUCTS_SENDCMDPAYLOADSIZE + 1) ? pBody[11] : STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    memcpy(pQueued->sRecord.cmd.payload, &pBody[12], STRUCTS_SENDCMDPAYLOADSIZE);
+    pQueued->sRecord.enqueueTimeUs = printGetMonotonicTimeUs();
+    memcpy(pQueued->sRecord.origin, pConn->sDeviceId, sizeof(pQueued->sRecord.origin));
+    pQueued->state = LANQ_QUEUED;
+    uiQueued += 1;
+    msLanStats.maxQueued = (uiQueued > msLanStats.maxQueued) ? uiQueued : msLanStats.maxQueued;
+    lanGatewayPump();
+    return 0;
+}
+
+/********************* lanGatewayPump ***********************
+    Starts queued uplinks, the oldest first, as long as the
+    upstream takes them. With the circuit breaker open they
+    fail right away, the slaves keep them queued.
+************************************************************/
+void lanGatewayPump()
+{
+    uint64_t ulNowUs = printGetMonotonicTimeUs();
+    tLanQueued *pOldest;
+    bool bWaiting = false;
+    int iResult;
+    int i;
+
+    while(1)
+    {
+        pOldest = NULL;
+        for(i=0; i<LANGW_MAXQUEUED; i+=1)
+        {
+            tLanQueued *pQueued = &masLanQueued[i];
+            if(pQueued->state != LANQ_QUEUED)
+            {
+                continue;
+            }
+            if(ulNowUs >= pQueued->ulDeadlineUs || !commsCircuitAllowsRequest())
+            {
+                lanGatewayReply(pQueued, commsCircuitAllowsRequest() ? -1 : -2, NULL);
+                pQueued->state = LANQ_FREE;
+                continue;
+            }
+            if(pOldest == NULL || (int32_t)(pQueued->uiOrder - pOldest->uiOrder) < 0)
+            {
+                pOldest = pQueued;
+            }
+        }
+        if(pOldest == NULL)
+        {
+            break;
+        }
+        if(!commsCanStartUplink())
+        {
+            bWaiting = true;
+            break;
+        }
+        pOldest->sRecord.id = pOldest->uiOrder;
+        pOldest->state = LANQ_SENT;
+        iResult = commsStartUplink(&pOldest->sRecord, lanGatewayDone);
+        if(iResult == -3)
+        {
+            pOldest->state = LANQ_QUEUED;
+            bWaiting = true;
+            break;
+        }
+        if(iResult < 0)
+        {
+            lanGatewayReply(pOldest, iResult, NULL);
+            pOldest->state = LANQ_FREE;
+        }
+    }
+    if(miLanPumpTimerFd >= 0)
+    {
+        if(bWaiting)
+        {
+            reactorTimerArm(miLanPumpTimerFd, LANGW_PUMPMS, 0); // this instance's own uplinks free slots without telling us
+        }
+        else
+        {
+            reactorTimerDisarm(miLanPumpTimerFd);
+        }
+    }
+}
+
+void lanGatewayPumpTimer(int iFd, uint32_t uiEvents, void *pContext)
+{
+    lanGatewayPump();
+}
+
+/********************* lanGatewayDone ***********************
+    The downlink of a forwarded uplink is in the decked
+    reply until this returns (commsUplinkFinished()).
+************************************************************/
+void lanGatewayDone(tUplinkRecord *pRecord, int iResult)
+{
+    int i;
+
+    for(i=0; i<LANGW_MAXQUEUED; i+=1)
+    {
+        if(masLanQueued[i].state == LANQ_SENT && masLanQueued[i].uiOrder == pRecord->id)
+        {
+            lanGatewayReply(&masLanQueued[i], iResult, getCtrlDeckedReply()->payload);
+            masLanQueued[i].state = LANQ_FREE;
+            break;
+        }
+    }
+    lanGatewayPump();
+}
+
+void lanGatewayReply(tLanQueued *pQueued, int iResult, const uint8_t *pDownlink)
+{
+    tLanConn *pConn = &masLanSlaves[pQueued->iConn];
+    uint8_t abBody[LANGW_REPLYBODYSIZE];
+
+    if(iResult >= 0)
+    {
+        msLanStats.forwarded += 1;
+    }
+    else
+    {
+        msLanStats.failed += 1;
+    }
+    if(pConn->iFd < 0 || pConn->uiGeneration != pQueued->uiGeneration)
+    {
+        return; // the slave is gone, it sends the uplink again
+    }
+    abBody[0] = (uint8_t)((iResult < 0) ? iResult : 0);
+    memset(&abBody[1], 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    if(iResult >= 0 && pDownlink != NULL)
+    {
+        memcpy(&abBody[1], pDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    }
+    if(lanConnQueue(pConn, LANGW_REPLY, pQueued->uiTag, abBody, sizeof(abBody)) < 0 || lanConnFlush(pConn) < 0)
+    {
+        lanGatewayDrop(pConn, "reply");
+        return;
+    }
+    if(pConn->iTxLength > 0)
+    {
+        reactorModFd(pConn->iFd, EPOLLIN | EPOLLOUT);
+    }
+}
+
+void lanGatewayDrop(tLanConn *pConn, const char *sReason)
+{
+    int i;
+
+    printf("[INFO] (%s) %s: Slave \'%s\' disconnected (%s).\n", printTimestamp(), __func__, pConn->sDeviceId, sReason);
+    reactorDelFd(pConn->iFd);
+    close(pConn->iFd);
+    pConn->iFd = -1;
+    for(i=0; i<LANGW_MAXQUEUED; i+=1)
+    {
+        if(masLanQueued[i].state == LANQ_QUEUED && &masLanSlaves[masLanQueued[i].iConn] == pConn)
+        {
+            masLanQueued[i].state = LANQ_FREE; // not sent yet, the slave sends it again
+        }
+    }
+    msLanStats.slaves -= 1;
+}
+
+int lanConnQueue(tLanConn *pConn, uint8_t bType, uint32_t uiTag, const uint8_t *pBody, int iLength)
+{
+    uint8_t *pFrame = &pConn->abTx[pConn->iTxLength];
+
+    if(iLength > 255 || pConn->iTxLength + LANGW_HEADERSIZE + iLength > LANGW_BUFSIZE)
+    {
+        return -1;
+    }
+    pFrame[0] = LANGW_MAGIC;
+    pFrame[1] = bType;
+    pFrame[2] = (uint8_t)iLength;
+    lanPutU32(&pFrame[3], uiTag);
+    memcpy(&pFrame[LANGW_HEADERSIZE], pBody, iLength);
+    pConn->iTxLength += LANGW_HEADERSIZE + iLength;
+    return 0;
+}
+
+/*********************** lanConnFlush ***********************
+    Sends what the socket takes, the rest stays queued.
+************************************************************/
+int lanConnFlush(tLanConn *pConn)
+{
+    int iResult;
+
+    if(pConn->bConnecting || pConn->iTxLength == 0)
+    {
+        return 0;
+    }
+    iResult = send(pConn->iFd, pConn->abTx, pConn->iTxLength, MSG_NOSIGNAL);
+    if(iResult < 0)
+    {
+        return (errno == EAGAIN) ? 0 : -1;
+    }
+    memmove(pConn->abTx, &pConn->abTx[iResult], pConn->iTxLength - iResult);
+    pConn->iTxLength -= iResult;
+    return 0;
+}
+
+/*********************** lanConnRead ************************
+    One read, then every complete frame to pHandler. -1 when
+    the connection is closed or broken, a handler that
+    returns < 0 breaks it as well.
+************************************************************/
+int lanConnRead(tLanConn *pConn, tLanFrameHandler pHandler)
+{
+    int iResult;
+    int iLength;
+    int iUsed = 0;
+
+    iResult = read(pConn->iFd, &pConn->abRx[pConn->iRxLength], LANGW_BUFSIZE - pConn->iRxLength);
+    if(iResult == 0 || (iResult < 0 && errno != EAGAIN))
+    {
+        return -1;
+    }
+    pConn->iRxLength += (iResult > 0) ? iResult : 0;
+    while(pConn->iRxLength - iUsed >= LANGW_HEADERSIZE)
+    {
+        if(pConn->abRx[iUsed] != LANGW_MAGIC)
+        {
+            return -1;
+        }
+        iLength = pConn->abRx[iUsed + 2];
+        if(pConn->iRxLength - iUsed < LANGW_HEADERSIZE + iLength)
+        {
+            break;
+        }
+        if(pHandler(pConn, pConn->abRx[iUsed + 1], lanGetU32(&pConn->abRx[iUsed + 3]), &pConn->abRx[iUsed + LANGW_HEADERSIZE], iLength) < 0)
+        {
+            return -1;
+        }
+        if(pConn->iFd < 0)
+        {
+            return 0; // the handler closed it (a done callback)
+        }
+        iUsed += LANGW_HEADERSIZE + iLength;
+    }
+    memmove(pConn->abRx, &pConn->abRx[iUsed], pConn->iRxLength - iUsed);
+    pConn->iRxLength -= iUsed;
+    return 0;
+}
+
+void lanPutU32(uint8_t *pDest, uint32_t uiValue)
+{
+    pDest[0] = (uint8_t)(uiValue >> 24);
+    pDest[1] = (uint8_t)(uiValue >> 16);
+    pDest[2] = (uint8_t)(uiValue >> 8);
+    pDest[3] = (uint8_t)(uiValue);
+}
+
+uint32_t lanGetU32(const uint8_t *pSource)
+{
+    return ((uint32_t)pSource[0] << 24) | ((uint32_t)pSource[1] << 16) | ((uint32_t)pSource[2] << 8) | pSource[3];
+}
@@ -0,0 +1,64 @@
+#ifndef SACLANGATEWAY_H
+#define SACLANGATEWAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACServerComms.h"
+
+#define LANGW_PORT              4790 // default of [gateway] port
+#define LANGW_MAXSLAVES         32 // slave connections an aggregator serves at the same time
+#define LANGW_MAXQUEUED         64 // forwarded uplinks waiting for or on the upstream, all slaves
+#define LANGW_PUMPMS            20 // aggregator: retry period for queued uplinks while the upstream is busy
+#define LANGW_BUFSIZE           1024 // per connection and direction
+#define LANGW_MAGIC             0xA5
+#define LANGW_HEADERSIZE        7
+#define LANGW_HELLO             0x01
+#define LANGW_UPLINK            0x02
+#define LANGW_REPLY             0x03
+
+/*
+    LAN gateway: several dispensers on one site share the
+    upstream of one instance. Slaves ([comms] transport = lan)
+    hand their uplinks over TCP to the aggregator at [gateway]
+    address:port, the aggregator ([gateway] aggregator = yes,
+    reactor mode, http upstream) queues them with its own and
+    sends them on its upstream, a single kept alive connection
+    with [comms] pipeline_depth > 0, requests of all devices
+    back to back on it. Each forwarded uplink goes out with
+    the slave's device id and sequence number, the downlink
+    goes back to the slave it came from.
+    Frames, big endian, one connection per slave:
+        magic (LANGW_MAGIC) | type | body length (1) | tag (4) | body
+    LANGW_HELLO   slave -> aggregator, first frame, body: the
+                  device id
+    LANGW_UPLINK  slave -> aggregator, body: seqNr (4) | unix
+                  time (4) | encoding | command code | downlink
+                  indicator | payload size | payload
+                  (STRUCTS_SENDCMDPAYLOADSIZE)
+    LANGW_REPLY   aggregator -> slave, same tag, body: result
+                  (signed, commsStartUplink() and transport
+                  results) | downlink (STRUCTS_DECKEDREPLYPAYLOADSIZE)
+    The slave keeps its sequence numbers and its queues: a
+    failed uplink stays queued there and is sent again.
+*/
+
+typedef struct
+{
+    uint32_t slaves; // aggregator: connected now
+    uint64_t accepted; // aggregator: slave connections
+    uint64_t forwarded; // aggregator: uplinks answered ok / slave: uplinks sent ok
+    uint64_t failed; // uplinks answered with a failure
+    uint64_t refused; // aggregator: queue full or no HELLO
+    uint32_t maxQueued; // aggregator: forwarded uplinks waiting at the same time
+    uint64_t connects; // slave: connections to the aggregator
+} tLanGatewayStats;
+
+extern const tCommsTransport sLanTransport;
+
+int lanGatewayInit();
+void lanGatewayApplyConfig(uint32_t uiChanged);
+const tLanGatewayStats *lanGatewayStats();
+void lanGatewayLog();
+void lanGatewayClose();
+
+#endif
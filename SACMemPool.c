@@ -0,0 +1,207 @@
+#include "SACMemPool.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy */
+#include "stdio.h"
+#include <pthread.h>
+#include <openssl/crypto.h> /* CRYPTO_set_mem_functions */
+
+#define MEMPOOL_HEADERSIZE      16 // keeps the blocks 16 byte aligned like malloc
+#define MEMPOOL_MAGIC           0x504f4f4c // "POOL"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t sizeClass;
+    uint8_t reserved[MEMPOOL_HEADERSIZE - 8];
+} tMemPoolHeader;
+
+typedef struct tMemPoolFreeBlock
+{
+    tMemPoolHeader header;
+    struct tMemPoolFreeBlock *next;
+} tMemPoolFreeBlock;
+
+/****************** private function prototypes *********************/
+int memPoolSizeClass(size_t uiSize);
+void *memPoolSslAlloc(size_t uiSize, const char *sFile, int iLine);
+void *memPoolSslRealloc(void *pBlock, size_t uiSize, const char *sFile, int iLine);
+void memPoolSslFree(void *pBlock, const char *sFile, int iLine);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static uint8_t maMemPoolArena[MEMPOOL_BUDGETSIZE] __attribute__((aligned(MEMPOOL_HEADERSIZE)));
+static tMemPoolFreeBlock *mapMemPoolFree[MEMPOOL_NCLASSES] = {NULL};
+static tMemPoolStats msMemPoolStats = {0};
+static pthread_mutex_t msMemPoolLock = PTHREAD_MUTEX_INITIALIZER; // OpenSSL may be used from more than one thread
+static bool mbMemPoolFailureLogged = false;
+/********************************************************************/
+
+/********************** memPoolInit *************************
+    Hands OpenSSL's allocations to the pool. Must run before
+    the first OpenSSL call: OpenSSL refuses new functions
+    once it allocated something.
+************************************************************/
+int memPoolInit()
+{
+    #if MEMPOOL_USEFORSSL == 1
+    if(CRYPTO_set_mem_functions(memPoolSslAlloc, memPoolSslRealloc, memPoolSslFree) != 1)
+    {
+        printf("[ERROR] (%s) %s: OpenSSL already allocated, it keeps using the heap.\n", printTimestamp(), __func__);
+        return -1;
+    }
+    printf("[INFO] (%s) %s: OpenSSL allocates from a %u kB budget.\n", printTimestamp(), __func__, MEMPOOL_BUDGETSIZE / 1024);
+    #endif
+    return 0;
+}
+
+/******************* memPoolSizeClass ***********************
+    Smallest class that holds uiSize plus the header, -1
+    when even the largest one is too small.
+************************************************************/
+int memPoolSizeClass(size_t uiSize)
+{
+    int iClass = 0;
+    size_t uiBlockSize = MEMPOOL_MINBLOCKSIZE;
+
+    while(uiBlockSize - MEMPOOL_HEADERSIZE < uiSize)
+    {
+        iClass += 1;
+        uiBlockSize <<= 1;
+        if(iClass == MEMPOOL_NCLASSES)
+        {
+            return -1;
+        }
+    }
+    return iClass;
+}
+
+void *memPoolAlloc(size_t uiSize)
+{
+    int iClass = memPoolSizeClass(uiSize);
+    uint32_t uiBlockSize = (iClass >= 0) ? (MEMPOOL_MINBLOCKSIZE << iClass) : 0;
+    tMemPoolHeader *pHeader = NULL;
+
+    pthread_mutex_lock(&msMemPoolLock);
+    if(iClass >= 0 && mapMemPoolFree[iClass] != NULL)
+    {
+        pHeader = &mapMemPoolFree[iClass]->header;
+        mapMemPoolFree[iClass] = mapMemPoolFree[iClass]->next;
+    }
+    else if(iClass >= 0 && msMemPoolStats.arenaUsed + uiBlockSize <= MEMPOOL_BUDGETSIZE)
+    {
+        pHeader = (tMemPoolHeader *)&maMemPoolArena[msMemPoolStats.arenaUsed];
+        pHeader->magic = MEMPOOL_MAGIC;
+        pHeader->sizeClass = iClass;
+        msMemPoolStats.arenaUsed += uiBlockSize;
+        msMemPoolStats.cut += 1;
+    }
+    if(pHeader == NULL)
+    {
+        msMemPoolStats.failed += 1;
+        pthread_mutex_unlock(&msMemPoolLock);
+        if(!mbMemPoolFailureLogged)
+        {
+            mbMemPoolFailureLogged = true; // once, a full budget fails a lot of them
+            printf("[ERROR] (%s) %s: Allocation of %u bytes failed, %u of %u bytes in use.\n", printTimestamp(), __func__, (uint32_t)uiSize, msMemPoolStats.inUse, MEMPOOL_BUDGETSIZE);
+        }
+        return NULL;
+    }
+    msMemPoolStats.allocs += 1;
+    msMemPoolStats.inUse += uiBlockSize;
+    if(msMemPoolStats.inUse > msMemPoolStats.peak)
+    {
+        msMemPoolStats.peak = msMemPoolStats.inUse;
+    }
+    pthread_mutex_unlock(&msMemPoolLock);
+    return (uint8_t *)pHeader + MEMPOOL_HEADERSIZE;
+}
+
+/******************** memPoolRealloc ************************
+    Stays in place while the new size fits the block's
+    class.
+************************************************************/
+void *memPoolRealloc(void *pBlock, size_t uiSize)
+{
+    tMemPoolHeader *pHeader;
+    void *pNew;
+
+    if(pBlock == NULL)
+    {
+        return memPoolAlloc(uiSize);
+    }
+    if(uiSize == 0)
+    {
+        memPoolFree(pBlock);
+        return NULL;
+    }
+    pHeader = (tMemPoolHeader *)((uint8_t *)pBlock - MEMPOOL_HEADERSIZE);
+    if(uiSize <= (MEMPOOL_MINBLOCKSIZE << pHeader->sizeClass) - MEMPOOL_HEADERSIZE)
+    {
+        return pBlock;
+    }
+    pNew = memPoolAlloc(uiSize);
+    if(pNew != NULL)
+    {
+        memcpy(pNew, pBlock, (MEMPOOL_MINBLOCKSIZE << pHeader->sizeClass) - MEMPOOL_HEADERSIZE);
+        memPoolFree(pBlock);
+    }
+    return pNew;
+}
+
+void memPoolFree(void *pBlock)
+{
+    tMemPoolFreeBlock *pFree;
+
+    if(pBlock == NULL)
+    {
+        return;
+    }
+    pFree = (tMemPoolFreeBlock *)((uint8_t *)pBlock - MEMPOOL_HEADERSIZE);
+    if(pFree->header.magic != MEMPOOL_MAGIC || pFree->header.sizeClass >= MEMPOOL_NCLASSES)
+    {
+        printf("[ERROR] (%s) %s: %p is not a pool block, not freed.\n", printTimestamp(), __func__, pBlock);
+        return;
+    }
+    pthread_mutex_lock(&msMemPoolLock);
+    pFree->next = mapMemPoolFree[pFree->header.sizeClass];
+    mapMemPoolFree[pFree->header.sizeClass] = pFree;
+    msMemPoolStats.frees += 1;
+    msMemPoolStats.inUse -= MEMPOOL_MINBLOCKSIZE << pFree->header.sizeClass;
+    pthread_mutex_unlock(&msMemPoolLock);
+}
+
+void memPoolGetStats(tMemPoolStats *pStats)
+{
+    pthread_mutex_lock(&msMemPoolLock);
+    memcpy(pStats, &msMemPoolStats, sizeof(tMemPoolStats));
+    pthread_mutex_unlock(&msMemPoolLock);
+}
+
+void memPoolLog()
+{
+    tMemPoolStats sStats;
+
+    memPoolGetStats(&sStats);
+    printf("[INFO] (%s) %s: %llu allocations, %llu frees, %llu failed, %u bytes in use, peak %u, %u of %u bytes cut from the arena.\n", printTimestamp(), __func__,
+        (unsigned long long)sStats.allocs, (unsigned long long)sStats.frees, (unsigned long long)sStats.failed, sStats.inUse, sStats.peak, sStats.arenaUsed, MEMPOOL_BUDGETSIZE);
+}
+
+/*************** OpenSSL allocator callbacks ****************
+    CRYPTO_set_mem_functions() signatures, file and line are
+    only used by OpenSSL's own debug allocator.
+************************************************************/
+void *memPoolSslAlloc(size_t uiSize, const char *sFile, int iLine)
+{
+    return memPoolAlloc(uiSize);
+}
+
+void *memPoolSslRealloc(void *pBlock, size_t uiSize, const char *sFile, int iLine)
+{
+    return memPoolRealloc(pBlock, uiSize);
+}
+
+void memPoolSslFree(void *pBlock, const char *sFile, int iLine)
+{
+    memPoolFree(pBlock);
+}
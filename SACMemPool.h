@@ -0,0 +1,40 @@
+#ifndef SACMEMPOOL_H
+#define SACMEMPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define MEMPOOL_USEFORSSL       1 // 1: OpenSSL allocates from the fixed budget below (CRYPTO_set_mem_functions), 0: from the heap
+#define MEMPOOL_BUDGETSIZE      (2 * 1024 * 1024) // bytes, everything OpenSSL holds at the same time. OpenSSL 3 needs ~600 kB for the context alone
+#define MEMPOOL_MINBLOCKSIZE    32 // smallest size class, header included
+#define MEMPOOL_NCLASSES        12 // power of two size classes, 32 B .. 64 KB
+
+/*
+    Fixed budget allocator. Blocks are cut from one static
+    arena the first time a size class runs dry and go to the
+    free list of their class when released, so once every
+    class has seen its peak nothing is cut anymore: cut == 0
+    over a transaction proves it allocated nothing new.
+    A request that does not fit the budget fails (NULL), it
+    never falls back to the heap.
+*/
+typedef struct
+{
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failed; // budget exhausted or larger than the largest class
+    uint64_t cut; // blocks cut from the arena
+    uint32_t inUse; // bytes in blocks handed out, headers and rounding included
+    uint32_t peak;
+    uint32_t arenaUsed; // bytes cut so far, never shrinks
+} tMemPoolStats;
+
+int memPoolInit();
+void *memPoolAlloc(size_t uiSize);
+void *memPoolRealloc(void *pBlock, size_t uiSize);
+void memPoolFree(void *pBlock);
+void memPoolGetStats(tMemPoolStats *pStats);
+void memPoolLog();
+
+#endif
@@ -0,0 +1,568 @@
+#include "SACMqttClient.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACTrace.h"
+#include "SACConfig.h"
+
+#include "string.h" /* memcpy, memset */
+#include <sys/socket.h> /* socket, connect */
+#include <netinet/in.h> /* struct sockaddr_in, struct sockaddr */
+#include <netdb.h> /* struct hostent, gethostbyname */
+#include <poll.h>
+#include <errno.h>
+#include <sys/time.h> /* struct timeval */
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "stdio.h"
+#include "unistd.h"
+
+/*
+    Minimal MQTT 3.1.1 client, just enough for the uplink:
+    CONNECT with a persistent session (clean session = 0),
+    SUBSCRIBE to the downlink topic, PUBLISH QoS 1 and
+    PINGREQ. The connection stays open between uplinks.
+*/
+
+#define MQTT_CONNECT        0x10
+#define MQTT_CONNACK        0x20
+#define MQTT_PUBLISH        0x30
+#define MQTT_PUBACK         0x40
+#define MQTT_SUBSCRIBE      0x82 // reserved flag bits 0010
+#define MQTT_SUBACK         0x90
+#define MQTT_PINGREQ        0xC0
+#define MQTT_PINGRESP       0xD0
+#define MQTT_DISCONNECT     0xE0
+
+/****************** private function prototypes *********************/
+int mqttConnect();
+void mqttDisconnect();
+int mqttWriteBytes(uint8_t *pBuffer, int iLength);
+int mqttReadBytes(uint8_t *pBuffer, int iLength);
+int mqttWritePacket(uint8_t bType, int iBodyLength);
+int mqttReadPacket(uint8_t *pType, int *pBodyLength);
+int mqttWaitForPacket(uint8_t bType, uint16_t uiPacketId, uint32_t uiTimeoutMs);
+bool mqttDataAvailable(uint32_t uiTimeoutMs);
+void mqttHandlePublish(uint8_t bFlags, int iBodyLength);
+int mqttPutString(uint8_t *pDest, const char *sString);
+uint16_t mqttNextPacketId();
+/********************************************************************/
+
+/******************** private global variables **********************/
+static int miMqttSocketFd = -1;
+static SSL *mpMqttSSLConn = NULL;
+static bool mbMqttConnected = false;
+static uint16_t muiMqttPacketId = 0;
+static uint64_t mulMqttLastTxUs = 0;
+static bool mbMqttDownlinkReceived = false;
+static char msMqttHost[STRUCTS_SERVREQ_MAXSTRSIZE];
+static char msMqttClientId[STRUCTS_SERVREQ_MAXSTRSIZE];
+static uint32_t muiMqttPort = MQTT_PORT;
+static bool mbMqttUseSsl = true;
+static char msMqttUplinkTopic[64];
+static char msMqttDownlinkTopic[64];
+static uint8_t mabMqttTxPacket[MQTT_PACKETMAXSIZE]; // 5 bytes fixed header room + body
+static uint8_t mabMqttRxPacket[MQTT_PACKETMAXSIZE];
+/********************************************************************/
+
+const tCommsTransport sMqttTransport =
+{
+    .name = "mqtt",
+    .init = mqttInit,
+    .sendUplink = mqttSendUplink,
+    .poll = mqttPoll,
+    .close = mqttClose,
+};
+
+/************************ mqttInit **************************
+    Connecting is postponed to the first uplink. The
+    endpoint is copied from the config, a reload that
+    changes it closes and initializes the transport again.
+************************************************************/
+int mqttInit()
+{
+    const tConfig *pConfig = configGet();
+    snprintf(msMqttHost, sizeof(msMqttHost), "%s", pConfig->host);
+    snprintf(msMqttClientId, sizeof(msMqttClientId), "%s", pConfig->deviceId);
+    if(pConfig->mqttPort != 0)
+    {
+        muiMqttPort = pConfig->mqttPort;
+    }
+    else
+    {
+        muiMqttPort = pConfig->useSsl ? MQTT_PORT : MQTT_PLAINPORT;
+    }
+    mbMqttUseSsl = pConfig->useSsl;
+    snprintf(msMqttUplinkTopic, sizeof(msMqttUplinkTopic), MQTT_UPLINKTOPICFMT, msMqttClientId);
+    snprintf(msMqttDownlinkTopic, sizeof(msMqttDownlinkTopic), MQTT_DOWNLINKTOPICFMT, msMqttClientId);
+    printf("[INFO] (%s) %s: MQTT broker %s:%u, uplink topic \'%s\', downlink topic \'%s\'.\n", printTimestamp(), __func__, msMqttHost, muiMqttPort, msMqttUplinkTopic, msMqttDownlinkTopic);
+    return 0;
+}
+
+/********************* mqttSendUplink ***********************
+    PUBLISH QoS 1 and wait for the PUBACK. When the
+    controller asked for a downlink, give the server up to
+    MQTT_DOWNLINKWAITMS to publish one.
+************************************************************/
+int mqttSendUplink(tUplinkRecord *pRecord)
+{
+    int iDataLength = pRecord->cmd.payloadSize - 1; // -1 since payloadsize includes the read request byte
+    uint32_t uiSeqNr = commsRecordSeqNr(pRecord);
+    uint16_t uiPacketId;
+    char sTopic[sizeof(msMqttUplinkTopic) + 16];
+    uint8_t *pBody = &mabMqttTxPacket[5];
+    int iPos;
+
+    if(iDataLength < 0 || iDataLength > STRUCTS_SENDCMDPAYLOADSIZE)
+    {
+        iDataLength = STRUCTS_SENDCMDPAYLOADSIZE;
+    }
+    if(!mbMqttConnected && mqttConnect() < 0)
+    {
+        return -1;
+    }
+
+    TRACE_BEGIN("mqttPublish");
+    uiPacketId = mqttNextPacketId();
+    if(pRecord->encoding != UPLENC_RAW)
+    {
+        snprintf(sTopic, sizeof(sTopic), "%s/%s", msMqttUplinkTopic, commsEncodingName(pRecord->encoding)); // edge aggregation: .../up/delta
+    }
+    else
+    {
+        snprintf(sTopic, sizeof(sTopic), "%s", msMqttUplinkTopic);
+    }
+    iPos = mqttPutString(pBody, sTopic);
+    pBody[iPos++] = (uint8_t)(uiPacketId >> 8);
+    pBody[iPos++] = (uint8_t)(uiPacketId & 0xff);
+    pBody[iPos++] = (uint8_t)(uiSeqNr >> 24);
+    pBody[iPos++] = (uint8_t)(uiSeqNr >> 16);
+    pBody[iPos++] = (uint8_t)(uiSeqNr >> 8);
+    pBody[iPos++] = (uint8_t)(uiSeqNr);
+    pBody[iPos++] = (uint8_t)(pRecord->time >> 24);
+    pBody[iPos++] = (uint8_t)(pRecord->time >> 16);
+    pBody[iPos++] = (uint8_t)(pRecord->time >> 8);
+    pBody[iPos++] = (uint8_t)(pRecord->time);
+    memcpy(&pBody[iPos], pRecord->cmd.payload, iDataLength);
+    iPos += iDataLength;
+
+    mbMqttDownlinkReceived = false;
+    if(mqttWritePacket(MQTT_PUBLISH | (1 << 1) /* QoS 1 */, iPos) < 0 || mqttWaitForPacket(MQTT_PUBACK, uiPacketId, configGet()->socketTimeoutSec * 1000) < 0)
+    {
+        printf("[ERROR] (%s) %s: Publishing uplink seqNr %u failed.\n", printTimestamp(), __func__, uiSeqNr);
+        mqttDisconnect();
+        TRACE_END("mqttPublish");
+        return -1;
+    }
+    TRACE_END("mqttPublish");
+    printf("[INFO] (%s) %s: Published uplink seqNr %u (%i bytes payload).\n", printTimestamp(), __func__, uiSeqNr, iDataLength);
+
+    if(pRecord->cmd.downlinkIndicator == 0x01 && !mbMqttDownlinkReceived)
+    {
+        uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + (MQTT_DOWNLINKWAITMS * 1000ULL);
+        while(!mbMqttDownlinkReceived && printGetMonotonicTimeUs() < ulDeadlineUs)
+        {
+            if(mqttDataAvailable((uint32_t)((ulDeadlineUs - printGetMonotonicTimeUs()) / 1000)))
+            {
+                uint8_t bType;
+                int iBodyLength;
+                if(mqttReadPacket(&bType, &iBodyLength) < 0)
+                {
+                    mqttDisconnect();
+                    break;
+                }
+            }
+        }
+        if(!mbMqttDownlinkReceived)
+        {
+            printf("[WARNING] (%s) %s: No downlink received within %i ms.\n", printTimestamp(), __func__, MQTT_DOWNLINKWAITMS);
+        }
+    }
+    return 0;
+}
+
+/************************ mqttPoll **************************
+    Non blocking: handles packets the broker sent on its own
+    (downlinks, PINGRESP) and keeps the session alive.
+************************************************************/
+void mqttPoll()
+{
+    uint8_t bType;
+    int iBodyLength;
+
+    if(!mbMqttConnected)
+    {
+        return;
+    }
+    while(mbMqttConnected && mqttDataAvailable(0))
+    {
+        if(mqttReadPacket(&bType, &iBodyLength) < 0)
+        {
+            mqttDisconnect();
+            return;
+        }
+    }
+    if(mbMqttConnected && (printGetMonotonicTimeUs() - mulMqttLastTxUs) > (MQTT_KEEPALIVESEC * 500000ULL))
+    {
+        if(mqttWritePacket(MQTT_PINGREQ, 0) < 0)
+        {
+            mqttDisconnect();
+        }
+    }
+}
+
+void mqttClose()
+{
+    if(mbMqttConnected)
+    {
+        mqttWritePacket(MQTT_DISCONNECT, 0);
+    }
+    mqttDisconnect();
+}
+
+/*********************** mqttConnect ************************
+    TCP (+TLS on the shared SSL context), CONNECT with
+    clean session = 0 and, when the broker has no session
+    for us yet, SUBSCRIBE to the downlink topic.
+************************************************************/
+int mqttConnect()
+{
+    struct hostent *pServer;
+    struct sockaddr_in sServerAddr;
+    uint32_t uiTimeoutMs = commsTimeoutMs(configGet()->socketTimeoutSec * 1000);
+    struct timeval sTimeout = {.tv_sec = uiTimeoutMs / 1000, .tv_usec = (uiTimeoutMs % 1000) * 1000};
+    uint8_t *pBody = &mabMqttTxPacket[5];
+    int iPos = 0;
+
+    TRACE_BEGIN("mqttConnect");
+    miMqttSocketFd = socket(AF_INET, SOCK_STREAM, 0);
+    if(miMqttSocketFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Failed to open socket for \'%s\'\n", printTimestamp(), __func__, msMqttHost);
+        TRACE_END("mqttConnect");
+        return -1;
+    }
+    setsockopt(miMqttSocketFd, SOL_SOCKET, SO_SNDTIMEO, &sTimeout, sizeof(sTimeout));
+    setsockopt(miMqttSocketFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+
+    pServer = gethostbyname(msMqttHost);
+    if(pServer == NULL)
+    {
+        printf("[ERROR] (%s) %s: No such host: \'%s\'\n", printTimestamp(), __func__, msMqttHost);
+        mqttDisconnect();
+        TRACE_END("mqttConnect");
+        return -1;
+    }
+    memset(&sServerAddr, 0, sizeof(sServerAddr));
+    sServerAddr.sin_family = AF_INET;
+    sServerAddr.sin_port = htons(muiMqttPort);
+    memcpy(&sServerAddr.sin_addr.s_addr, pServer->h_addr, pServer->h_length);
+    if(connect(miMqttSocketFd, (struct sockaddr *)&sServerAddr, sizeof(sServerAddr)) < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not connect to broker. Socket connect error code %i.\n", printTimestamp(), __func__, errno);
+        mqttDisconnect();
+        TRACE_END("mqttConnect");
+        return -1;
+    }
+
+    if(mbMqttUseSsl)
+    {
+        mpMqttSSLConn = SSL_new(sslGetContext());
+        SSL_set_fd(mpMqttSSLConn, miMqttSocketFd);
+        ERR_clear_error(); // clear error queue
+        int iResult = SSL_connect(mpMqttSSLConn);
+        if(iResult != 1)
+        {
+            printf("[ERROR] (%s) %s: Could not create SSL connection. Error code %i.\n\t%s\n", printTimestamp(), __func__, SSL_get_error(mpMqttSSLConn, iResult), ERR_error_string(ERR_get_error(), NULL));
+            mqttDisconnect();
+            TRACE_END("mqttConnect");
+            return -1;
+        }
+    }
+    mbMqttConnected = true;
+
+    // CONNECT: protocol name, level 4 (3.1.1), flags (clean session = 0), keep alive, client id
+    iPos = mqttPutString(pBody, "MQTT");
+    pBody[iPos++] = 4;
+    pBody[iPos++] = 0x00;
+    pBody[iPos++] = (uint8_t)(MQTT_KEEPALIVESEC >> 8);
+    pBody[iPos++] = (uint8_t)(MQTT_KEEPALIVESEC & 0xff);
+    iPos += mqttPutString(&pBody[iPos], msMqttClientId);
+    if(mqttWritePacket(MQTT_CONNECT, iPos) < 0 || mqttWaitForPacket(MQTT_CONNACK, 0, configGet()->socketTimeoutSec * 1000) < 0)
+    {
+        printf("[ERROR] (%s) %s: MQTT CONNECT failed.\n", printTimestamp(), __func__);
+        mqttDisconnect();
+        TRACE_END("mqttConnect");
+        return -1;
+    }
+    if(mabMqttRxPacket[1] != 0x00)
+    {
+        printf("[ERROR] (%s) %s: Broker refused connection, return code %u.\n", printTimestamp(), __func__, mabMqttRxPacket[1]);
+        mqttDisconnect();
+        TRACE_END("mqttConnect");
+        return -1;
+    }
+
+    if((mabMqttRxPacket[0] & 0x01) == 0)
+    {
+        // no session present on the broker, (re)subscribe to the downlink topic with QoS 1
+        uint16_t uiPacketId = mqttNextPacketId();
+        iPos = 0;
+        pBody[iPos++] = (uint8_t)(uiPacketId >> 8);
+        pBody[iPos++] = (uint8_t)(uiPacketId & 0xff);
+        iPos += mqttPutString(&pBody[iPos], msMqttDownlinkTopic);
+        pBody[iPos++] = 0x01;
+        if(mqttWritePacket(MQTT_SUBSCRIBE, iPos) < 0 || mqttWaitForPacket(MQTT_SUBACK, uiPacketId, configGet()->socketTimeoutSec * 1000) < 0)
+        {
+            printf("[ERROR] (%s) %s: Subscribing to \'%s\' failed.\n", printTimestamp(), __func__, msMqttDownlinkTopic);
+            mqttDisconnect();
+            TRACE_END("mqttConnect");
+            return -1;
+        }
+    }
+    TRACE_END("mqttConnect");
+    printf("[INFO] (%s) %s: Connected to MQTT broker (session %s).\n", printTimestamp(), __func__, (mabMqttRxPacket[0] & 0x01) ? "resumed" : "new");
+    return 0;
+}
+
+void mqttDisconnect()
+{
+    if(mpMqttSSLConn != NULL)
+    {
+        SSL_shutdown(mpMqttSSLConn);
+        SSL_free(mpMqttSSLConn);
+        mpMqttSSLConn = NULL;
+    }
+    if(miMqttSocketFd >= 0)
+    {
+        close(miMqttSocketFd);
+        miMqttSocketFd = -1;
+    }
+    mbMqttConnected = false;
+}
+
+int mqttWriteBytes(uint8_t *pBuffer, int iLength)
+{
+    int iBytesSent = 0;
+    int iBytesCurrentlyProcessed;
+    while(iBytesSent < iLength)
+    {
+        if(mpMqttSSLConn != NULL)
+        {
+            iBytesCurrentlyProcessed = SSL_write(mpMqttSSLConn, &pBuffer[iBytesSent], iLength - iBytesSent);
+        }
+        else
+        {
+            iBytesCurrentlyProcessed = write(miMqttSocketFd, &pBuffer[iBytesSent], iLength - iBytesSent);
+        }
+        if(iBytesCurrentlyProcessed <= 0)
+        {
+            return -1;
+        }
+        iBytesSent += iBytesCurrentlyProcessed;
+    }
+    commsAddByteCounts(iBytesSent, 0);
+    return 0;
+}
+
+int mqttReadBytes(uint8_t *pBuffer, int iLength)
+{
+    int iBytesReceived = 0;
+    int iBytesCurrentlyProcessed;
+    while(iBytesReceived < iLength)
+    {
+        if(mpMqttSSLConn != NULL)
+        {
+            iBytesCurrentlyProcessed = SSL_read(mpMqttSSLConn, &pBuffer[iBytesReceived], iLength - iBytesReceived);
+        }
+        else
+        {
+            iBytesCurrentlyProcessed = read(miMqttSocketFd, &pBuffer[iBytesReceived], iLength - iBytesReceived);
+        }
+        if(iBytesCurrentlyProcessed <= 0)
+        {
+            return -1;
+        }
+        iBytesReceived += iBytesCurrentlyProcessed;
+    }
+    commsAddByteCounts(0, iBytesReceived);
+    return 0;
+}
+
+/********************** mqttWritePacket *********************
+    The body must already be in mabMqttTxPacket[5...],
+    the fixed header is put right in front of it.
+************************************************************/
+int mqttWritePacket(uint8_t bType, int iBodyLength)
+{
+    uint8_t abLength[4];
+    int iLengthBytes = 0;
+    int iRemaining = iBodyLength;
+    do
+    {
+        abLength[iLengthBytes] = iRemaining % 128;
+        iRemaining /= 128;
+        if(iRemaining > 0)
+        {
+            abLength[iLengthBytes] |= 0x80;
+        }
+        iLengthBytes += 1;
+    } while(iRemaining > 0 && iLengthBytes < 4);
+
+    int iStart = 5 - 1 - iLengthBytes;
+    mabMqttTxPacket[iStart] = bType;
+    memcpy(&mabMqttTxPacket[iStart + 1], abLength, iLengthBytes);
+    mulMqttLastTxUs = printGetMonotonicTimeUs();
+    return mqttWriteBytes(&mabMqttTxPacket[iStart], 1 + iLengthBytes + iBodyLength);
+}
+
+/********************** mqttReadPacket **********************
+    Reads one packet into mabMqttRxPacket (body only).
+    PUBLISH packets are handled right away.
+************************************************************/
+int mqttReadPacket(uint8_t *pType, int *pBodyLength)
+{
+    uint8_t bByte;
+    int iMultiplier = 1;
+    int iLength = 0;
+    int i;
+
+    if(mqttReadBytes(pType, 1) < 0)
+    {
+        return -1;
+    }
+    for(i=0; i<4; i+=1)
+    {
+        if(mqttReadBytes(&bByte, 1) < 0)
+        {
+            return -1;
+        }
+        iLength += (bByte & 0x7f) * iMultiplier;
+        iMultiplier *= 128;
+        if((bByte & 0x80) == 0)
+        {
+            break;
+        }
+    }
+    if(iLength > MQTT_PACKETMAXSIZE)
+    {
+        printf("[ERROR] (%s) %s: Packet of %i bytes doesn\'t fit the receive buffer.\n", printTimestamp(), __func__, iLength);
+        return -1;
+    }
+    if(iLength > 0 && mqttReadBytes(mabMqttRxPacket, iLength) < 0)
+    {
+        return -1;
+    }
+    *pBodyLength = iLength;
+
+    if((*pType & 0xf0) == MQTT_PUBLISH)
+    {
+        mqttHandlePublish(*pType & 0x0f, iLength);
+    }
+    return 0;
+}
+
+/******************** mqttWaitForPacket *********************
+    Reads packets until one of type bType arrives (with
+    packet id uiPacketId for PUBACK/SUBACK), not past the
+    commsSetDeadline() deadline.
+************************************************************/
+int mqttWaitForPacket(uint8_t bType, uint16_t uiPacketId, uint32_t uiTimeoutMs)
+{
+    uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + (commsTimeoutMs(uiTimeoutMs) * 1000ULL);
+    uint8_t bRxType;
+    int iBodyLength;
+
+    while(printGetMonotonicTimeUs() < ulDeadlineUs)
+    {
+        if(!mqttDataAvailable((uint32_t)((ulDeadlineUs - printGetMonotonicTimeUs()) / 1000)))
+        {
+            continue;
+        }
+        if(mqttReadPacket(&bRxType, &iBodyLength) < 0)
+        {
+            return -1;
+        }
+        if((bRxType & 0xf0) != bType)
+        {
+            continue;
+        }
+        if(bType == MQTT_PUBACK || bType == MQTT_SUBACK)
+        {
+            if(iBodyLength < 2 || ((mabMqttRxPacket[0] << 8) | mabMqttRxPacket[1]) != uiPacketId)
+            {
+                continue;
+            }
+        }
+        return 0;
+    }
+    return -1;
+}
+
+bool mqttDataAvailable(uint32_t uiTimeoutMs)
+{
+    struct pollfd sPollFd = {.fd = miMqttSocketFd, .events = POLLIN, .revents = 0};
+    if(mpMqttSSLConn != NULL && SSL_pending(mpMqttSSLConn) > 0)
+    {
+        return true;
+    }
+    return (poll(&sPollFd, 1, (int)uiTimeoutMs) > 0);
+}
+
+/******************** mqttHandlePublish *********************
+    A downlink: copy its payload into the decked reply and
+    acknowledge it when it was sent with QoS 1.
+************************************************************/
+void mqttHandlePublish(uint8_t bFlags, int iBodyLength)
+{
+    uint8_t bQos = (bFlags >> 1) & 0x03;
+    int iTopicLength = (mabMqttRxPacket[0] << 8) | mabMqttRxPacket[1];
+    int iPos = 2 + iTopicLength;
+    uint16_t uiPacketId = 0;
+
+    if(iPos > iBodyLength)
+    {
+        return;
+    }
+    if(bQos > 0)
+    {
+        if(iPos + 2 > iBodyLength)
+        {
+            return;
+        }
+        uiPacketId = (mabMqttRxPacket[iPos] << 8) | mabMqttRxPacket[iPos + 1];
+        iPos += 2;
+    }
+    if(iTopicLength == (int)strlen(msMqttDownlinkTopic) && memcmp(&mabMqttRxPacket[2], msMqttDownlinkTopic, iTopicLength) == 0 && (iBodyLength - iPos) >= STRUCTS_DECKEDREPLYPAYLOADSIZE)
+    {
+        tCtrlDeckedReply *pReplyForController = getCtrlDeckedReply();
+        memcpy(pReplyForController->payload, &mabMqttRxPacket[iPos], STRUCTS_DECKEDREPLYPAYLOADSIZE);
+        mbMqttDownlinkReceived = true;
+        printf("[INFO] (%s) %s: Received downlink:\n", printTimestamp(), __func__);
+        printf("\t# Bytes (HEX): %s\n", printBytesAsHexString((uintptr_t)pReplyForController->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE, true, ", "));
+    }
+    if(bQos > 0)
+    {
+        mabMqttTxPacket[5] = (uint8_t)(uiPacketId >> 8);
+        mabMqttTxPacket[6] = (uint8_t)(uiPacketId & 0xff);
+        mqttWritePacket(MQTT_PUBACK, 2);
+    }
+}
+
+int mqttPutString(uint8_t *pDest, const char *sString)
+{
+    int iLength = strlen(sString);
+    pDest[0] = (uint8_t)(iLength >> 8);
+    pDest[1] = (uint8_t)(iLength & 0xff);
+    memcpy(&pDest[2], sString, iLength);
+    return iLength + 2;
+}
+
+uint16_t mqttNextPacketId()
+{
+    muiMqttPacketId += 1;
+    if(muiMqttPacketId == 0)
+    {
+        muiMqttPacketId = 1;
+    }
+    return muiMqttPacketId;
+}
@@ -0,0 +1,30 @@
+#ifndef SACMQTTCLIENT_H
+#define SACMQTTCLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACServerComms.h"
+
+#define MQTT_PORT               8883 // default of [comms] mqtt_port with use_ssl
+#define MQTT_PLAINPORT          1883 // default of [comms] mqtt_port without
+#define MQTT_KEEPALIVESEC       60
+#define MQTT_UPLINKTOPICFMT     "sac/%s/up" // %s = device id
+#define MQTT_DOWNLINKTOPICFMT   "sac/%s/down" // %s = device id
+#define MQTT_PACKETMAXSIZE      256
+#define MQTT_DOWNLINKWAITMS     2000 // how long to wait for a downlink after the PUBACK when the controller asked for one
+
+/*
+    Uplink PUBLISH payload (QoS 1), big endian:
+        seqNr (4 bytes) | unix time (4 bytes) | controller payload bytes
+    Downlink PUBLISH payload on the downlink topic:
+        STRUCTS_DECKEDREPLYPAYLOADSIZE bytes, copied into the decked reply.
+*/
+
+extern const tCommsTransport sMqttTransport;
+
+int mqttInit();
+int mqttSendUplink(tUplinkRecord *pRecord);
+void mqttPoll();
+void mqttClose();
+
+#endif
@@ -15,39 +15,50 @@ time_t sRawTime;
     Makes use of and overwrites the msTimestampBuffer.
     prints a timestamp like this:
         2020-12-04 14:13:32
+    localtime_r: glibc's localtime() checks TZ again and
+    duplicates it on the heap on every call.
 ************************************************************/
 char* printTimestamp()
 {
     memset((void *)msTimestampBuffer, 0x00, TIMESTAMPBUFFERSIZE);
-    struct tm* tm_info;    
+    struct tm tm_info;    
     sRawTime = time(NULL);
     
-    tm_info = localtime(&sRawTime);
-    strftime(msTimestampBuffer, 26, "%Y-%m-%d %H:%M:%S", tm_info);
+    localtime_r(&sRawTime, &tm_info);
+    strftime(msTimestampBuffer, 26, "%Y-%m-%d %H:%M:%S", &tm_info);
     return msTimestampBuffer;
 }
 
 /****************** printBytesAsHexString *******************
     Makes use of and overwrites the msGenericStringBuffer.
     return a pointer to the msGenericStringBuffer.
+    Output that doesn't fit the buffer is cut off after
+    the last whole byte.
 ************************************************************/
-char* printBytesAsHexString(uint32_t startAddress, int length, bool addSeparator, const char * separator)
+char* printBytesAsHexString(uintptr_t startAddress, int length, bool addSeparator, const char * separator)
 {
     char sParsedByte[GENERICSTRBUFFERSIZE] = {0x00};
     memset((void *)msGenericStringBuffer, 0x00, GENERICSTRBUFFERSIZE);
     int iBytesCurrentlyProcessed = 0;
+    int iUsed = 0;
+    int iPartLength;
     
     do
     {
         if(!addSeparator)
         {
-            sprintf(sParsedByte, "%02x", *((char *)(startAddress + iBytesCurrentlyProcessed)));
+            iPartLength = snprintf(sParsedByte, sizeof(sParsedByte), "%02x", *((uint8_t *)(startAddress + iBytesCurrentlyProcessed)));
         }
         else
         {
-            sprintf(sParsedByte, "%02x%s", *((char *)(startAddress + iBytesCurrentlyProcessed)), separator);
+            iPartLength = snprintf(sParsedByte, sizeof(sParsedByte), "%02x%s", *((uint8_t *)(startAddress + iBytesCurrentlyProcessed)), separator);
         }
-        strcat(msGenericStringBuffer, sParsedByte);
+        if(iUsed + iPartLength >= GENERICSTRBUFFERSIZE)
+        {
+            break;
+        }
+        memcpy(&msGenericStringBuffer[iUsed], sParsedByte, iPartLength + 1);
+        iUsed += iPartLength;
         iBytesCurrentlyProcessed += 1;
     } while(iBytesCurrentlyProcessed < length);
     
@@ -62,13 +73,26 @@ long unsigned int printGetUnixEpochTimeAsInt()
     return (unsigned long int)sRawTime;
 }
 
+/**************** printGetMonotonicTimeUs *******************
+    64-bit monotonic clock in micro seconds. Unlike
+    gpioTick() it does not wrap (after ~72 minutes) and
+    it does not jump when the wall clock is adjusted.
+************************************************************/
+uint64_t printGetMonotonicTimeUs()
+{
+    struct timespec sNow;
+    clock_gettime(CLOCK_MONOTONIC, &sNow);
+    return ((uint64_t)sNow.tv_sec * 1000000ULL) + ((uint64_t)sNow.tv_nsec / 1000ULL);
+}
+
 
 /******************* printSplitInBytes **********************
     If the input string is "\r36301f73deadbeef" and cSeparator = ','
     then the output will be:
         "36,30,1f,73,de,ad,be,ef,"
     
-    Discards all leading non hex digit characters.
+    Discards all leading non hex digit characters. Stops
+    at the last whole byte that fits the buffer.
 ************************************************************/
 char* printSplitByteStringInBytes(char *sByteString, char cSeparator)
 {
@@ -80,7 +104,7 @@ char* printSplitByteStringInBytes(char *sByteString, char cSeparator)
     int iHexStartIndex = -1;
     int i;
     
-    for(i=0; i<iLength && i<GENERICSTRBUFFERSIZE; i+=1)
+    for(i=0; i<iLength && iDestPointer < GENERICSTRBUFFERSIZE - 3; i+=1) // room for 2 digits, a separator and the 0x00
     {
         char cCurrChar = sByteString[i];
         if(ISVALIDHEXCHAR(cCurrChar))
@@ -151,6 +175,10 @@ int printParseHexStringToBytes(char *sByteString, uint8_t *bDestBuffer, uint8_t
     int iNParsedBytes = 0;
     char *pEnd;
     
+    if(sBytesCommaSeparated == NULL)
+    {
+        return 0; // no hex digits at all
+    }
     // load the string token function
     char *pTemp = strtok(sBytesCommaSeparated, asDelimiter);
     // first ',' has now been replaced by 0x00...
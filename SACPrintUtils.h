@@ -8,8 +8,9 @@
 #define GENERICSTRBUFFERSIZE    256
 
 char* printTimestamp();
-char* printBytesAsHexString(uint32_t startAddress, int length, bool addSeparator, const char * separator);
+char* printBytesAsHexString(uintptr_t startAddress, int length, bool addSeparator, const char * separator);
 long unsigned int printGetUnixEpochTimeAsInt();
+uint64_t printGetMonotonicTimeUs();
 char* printSplitByteStringInBytes(char *sByteString, char cSeparator);
 int printParseHexStringToBytes(char *sByteString, uint8_t *bDestBuffer, uint8_t bDestBufferSize);
 
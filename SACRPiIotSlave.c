@@ -17,7 +17,8 @@
         https://stackoverflow.com/questions/22077802/simple-c-example-of-doing-an-http-post-and-consuming-the-response
         
     Compile:
-        gcc -Wall -pthread -o SACRPiIotSlave SACRPiIotSlave.c -lpigpio -lrt -lssl -lcrypto
+        make, or:
+        gcc -Wall -pthread -o SACRPiIotSlave SACRPiIotSlave.c SACServerComms.c SACPrintUtils.c SACStructs.c SACTrace.c SACUplinkSched.c SACMqttClient.c SACCoapClient.c SACStateFile.c SACReactor.c SACStatusShm.c SACConfig.c SACMemPool.c SACBscHealth.c SACEdgeAgg.c SACBulkUpload.c SACEndpoints.c SACAsyncCmd.c SACUring.c SACLanGateway.c SACRules.c SACHistory.c -lpigpio -lrt -lssl -lcrypto -lz
 */
 
 #include <pigpio.h>
@@ -34,9 +35,24 @@
 #include "SACServerComms.h"
 #include "SACPrintUtils.h"
 #include "SACStructs.h"
+#include "SACTrace.h"
+#include "SACUplinkSched.h"
+#include "SACStateFile.h"
+#include "SACReactor.h"
+#include "SACRules.h"
+#include "SACHistory.h"
+#include "SACStatusShm.h"
+#include "SACConfig.h"
+#include "SACMemPool.h"
+#include "SACBscHealth.h"
+#include "SACEdgeAgg.h"
+#include "SACBulkUpload.h"
+#include "SACEndpoints.h"
+#include "SACAsyncCmd.h"
+#include "SACUring.h"
+#include "SACLanGateway.h"
 
 /********************** Globals *********************/
-uint32_t uSleepMicrosec = 1000; // number of micro seconds to sleep if no i2c transaction received. 32bytes take about 3.2ms to transmit.
 /* i2c transfer struct
 bsc_xfer:= a structure defining the transfer
 
@@ -52,6 +68,41 @@ typedef struct
 volatile bsc_xfer_t sI2cTransfer; // i2c transfer struct
 volatile tBscStatus sI2cStatus;
 tSmState sState = S_IDLE;
+int32_t iCurrentUplinkId = -1; // scheduler id of the send command being served, -1 while draining the backlog
+uint64_t ulLastI2cActivityUs = 0; // monotonic time of the last received i2c frame
+bool bUplinkQueueRefused = false; // the last send command found its queue full, the backlog drains without waiting for a quiet bus
+bool bUplinkCommandHeldBack = false; // the last lockstep command stayed queued behind the backlog, it drains without waiting for a quiet bus
+tBscRecoveryStage eBscRecoveryPending = BSCRECOVERY_NONE; // set by the health supervisor, runs when the state machine is back in S_IDLE
+const char *asStateNames[] = // indexed by tSmState, used as trace span names
+{
+    "S_IDLE",
+    "S_PARSEIOTHEADER",
+    "S_FLAGERROR_UNKNOWNCMD",
+    "S_FLAGERROR_INVALIDSTX",
+    "S_FLAGERROR_INVALIDETX",
+    "S_PARSECMDSEND",
+    "S_PARSECMDREADENA",
+    "S_BUILDRESPONSE",
+    "S_DISSABLEI2CPERIPH",
+    "S_SENDHTTPREQUEST",
+    "S_WAITHTTPRESPONSE",
+    "S_ENABLEI2CPERIPH",
+    "S_PARSECMDTAGGED",
+    "S_PARSECMDSTATUS",
+};
+#if USEREACTOR == 1
+int iSlaveWakeFd = -1; // eventfd: bsc event from pigpio's thread, finished uplinks
+int iBscPollTimerFd = -1;
+int iHousekeepingTimerFd = -1;
+bool bUplinkChainBusy = false; // uplinks started by S_SENDHTTPREQUEST still in flight
+uint32_t uiUplinkChainSent = 0;
+bool bUplinkChainFailed = false; // a send of the chain failed or the breaker refused it, else a record left queued gets I2CERRORCODE_BUSY
+int iConfigEventFd = -1; // eventfd: config reload parsed
+bool bBscEvents = false; // pigpio delivers bsc events, the poll timer is only a fallback
+#else
+volatile sig_atomic_t bConfigReloadRequested = 0; // set by SIGHUP
+volatile sig_atomic_t bStopRequested = 0; // set by SIGINT/SIGTERM
+#endif
 /****************************************************/
 
 
@@ -60,11 +111,36 @@ uint8_t slave_init();
 void runSlave();
 void listeningTask();
 void closeSlave();
-float getTickSec();
+double getTickSec();
+int slaveXfer();
+int slaveBscRecover(tBscRecoveryStage eStage);
 int getControlBits(int address, bool open, bool rxEnable);
 void copyDeckedReplyToI2cTxBuffer(uint8_t bCmdCode, uint8_t bErrorCode);
+void slaveParseTagged();
+void slaveParseStatus();
+void slaveReplyNow(const uint8_t *pFrame, int iLength);
 void closeSlave();
+void slavePublishStatus();
+void slaveConfigApply();
+#if USEREACTOR == 1
+void runSlaveReactor();
+void slaveService();
+void slaveServiceCallback(int iFd, uint32_t uiEvents, void *pContext);
+void slaveBscEvent(int iEvent, uint32_t uiTick);
+void slaveHousekeeping(int iFd, uint32_t uiEvents, void *pContext);
+void slaveDrainBacklog();
+void slaveDrainDone(tUplinkRecord *pRecord, int iResult);
+void slaveDrainBulkDone(int iResult);
+void slaveUplinkChainStep();
+void slaveUplinkChainDone(tUplinkRecord *pRecord, int iResult);
+void slaveSignal(int signum);
+void slaveArmTimers();
+void slaveConfigNotify();
+void slaveConfigEvent(int iFd, uint32_t uiEvents, void *pContext);
+#else
 void SIGHandler(int signum);
+void slaveSIGHUPHandler(int signum);
+#endif
 /****************************************************/
 
 
@@ -83,11 +159,11 @@ uint8_t slave_init()
     }
     // Close old device (if any)
     sI2cTransfer.control = getControlBits(I2CSALAVEADDRESS7, false, false); // To avoid conflicts when restarting
-    bscXfer(&sI2cTransfer);
+    slaveXfer();
     // Set I2C slave Address
     printf("[INFO] (%s) %s: Setting I2C slave address to 0x%02x\n", printTimestamp(), __func__, I2CSALAVEADDRESS7);
     sI2cTransfer.control = getControlBits(I2CSALAVEADDRESS7, true, true);
-    iResult = bscXfer(&sI2cTransfer); // Should now be visible in I2C-Scanners
+    iResult = slaveXfer(); // Should now be visible in I2C-Scanners
     return iResult;
 }
 
@@ -104,10 +180,15 @@ void runSlave()
         sI2cStatus.txBusy = 0;
         sI2cStatus.rxBusy = 0;
         // Start listening...
-        while(1)
-        {
-            listeningTask();
-        }
+        #if USEREACTOR == 1
+            runSlaveReactor(); // returns after SIGINT/SIGTERM
+        #else
+            while(!bStopRequested)
+            {
+                listeningTask();
+            }
+            printf("[INFO] (%s) %s: Caught SIGINT/SIGTERM, stopping.\n", printTimestamp(), __func__);
+        #endif
     }
     else
     {
@@ -120,6 +201,7 @@ void listeningTask()
 {
     //uint8_t bEtx;
     static uint8_t bErrorResponse = I2CERRORCODE_OK;   
+    tSmState ePreviousState = sState;
     tCtrlSendCmd *pLastSendCommand = getLastSendCmd(); // get the address of the last saved send command
     tCtrlReadEnaCmd *pLastReadEnaCommand = getLastReadEnaCmd(); // get the address of the last saved read enable command
     
@@ -129,7 +211,7 @@ void listeningTask()
     switch (sState)
     {
         case S_IDLE:
-            sI2cStatus.i32 = bscXfer(&sI2cTransfer);
+            sI2cStatus.i32 = slaveXfer();
             if(sI2cStatus.i32 == -1)
             {
                 printf("[WARNING] (%s) %s:(S_IDLE) Detected i2c slave timeout.\n", printTimestamp(), __func__);
@@ -139,12 +221,32 @@ void listeningTask()
             {
                 // No new data available or busy with incoming data.
                 sState = S_IDLE;
-                usleep(uSleepMicrosec);
+                #if USEREACTOR == 1
+                // backlog drain and commsPoll() run from the housekeeping timer
+                #else
+                if(sI2cStatus.rxBusy == 0 && ((printGetMonotonicTimeUs() - ulLastI2cActivityUs) > (UPLSCHED_IDLEBEFOREDRAINMS * 1000ULL) || uplinkSchedPendingClass(UPLCLASS_ALARM) > 0 || asyncCmdPending() > 0 || bUplinkQueueRefused || bUplinkCommandHeldBack) && uplinkSchedReadyToSend())
+                {
+                    // bus is quiet, use the time to send one queued uplink
+                    printf("[INFO] (%s) %s:(S_IDLE) Draining uplink backlog, %u queued.\n", printTimestamp(), __func__, uplinkSchedPending());
+                    iCurrentUplinkId = -1;
+                    sState = S_DISSABLEI2CPERIPH;
+                }
+                else
+                {
+                    commsPoll(); // keep alive and unsolicited downlinks of persistent transports
+                    edgeAggPoll(printGetMonotonicTimeUs());
+                    historyPoll();
+                    slaveConfigApply();
+                    usleep(configGet()->i2cPollIntervalUs); // 32bytes take about 3.2ms to transmit
+                }
+                #endif
             }
             else
             {
+                ulLastI2cActivityUs = printGetMonotonicTimeUs();
+                statusShmSetFrame(true, (uint8_t *)sI2cTransfer.rxBuf, sI2cTransfer.rxCnt);
                 printf("[INFO] (%s) %s:(S_IDLE) Received %d bytes\n", printTimestamp(), __func__, sI2cTransfer.rxCnt);
-                printf("\t#(%f) Bytes (HEX): %s\n", getTickSec(), printBytesAsHexString((uint32_t)sI2cTransfer.rxBuf, sI2cTransfer.rxCnt, true, ", "));
+                printf("\t#(%f) Bytes (HEX): %s\n", getTickSec(), printBytesAsHexString((uintptr_t)sI2cTransfer.rxBuf, sI2cTransfer.rxCnt, true, ", "));
                 sState = S_PARSEIOTHEADER;
             }
             break;
@@ -162,8 +264,15 @@ void listeningTask()
                         sState = S_PARSECMDREADENA;
                         break;
                     case 0x02:
+                    case UPLSCHED_CMDCODE_ALARM:
                         sState = S_PARSECMDSEND;
                         break;
+                    case ASYNCCMD_CMDCODE_SEND:
+                        sState = S_PARSECMDTAGGED;
+                        break;
+                    case ASYNCCMD_CMDCODE_STATUS:
+                        sState = S_PARSECMDSTATUS;
+                        break;
                     default:
                         sState = S_FLAGERROR_UNKNOWNCMD;
                         break;
@@ -202,8 +311,42 @@ void listeningTask()
             
         case S_PARSECMDSEND:            
             pLastSendCommand = setLastSendCmd((void *)&sI2cTransfer.rxBuf[0]);
-            printf("[INFO] (%s) %s:(S_PARSECMDSEND) IoT send command: payload size = %i, payload at 0x%x, ETX = 0x%x\n", printTimestamp(), __func__, pLastSendCommand->payloadSize, (uint32_t)pLastSendCommand->payload, pLastSendCommand->endTag);
+            printf("[INFO] (%s) %s:(S_PARSECMDSEND) IoT send command: payload size = %i, payload at %p, ETX = 0x%x\n", printTimestamp(), __func__, pLastSendCommand->payloadSize, (void *)pLastSendCommand->payload, pLastSendCommand->endTag);
             if (pLastSendCommand->endTag == IOT_FRMENDTAG)
+            {
+                iCurrentUplinkId = edgeAggSubmit(pLastSendCommand, printGetMonotonicTimeUs());
+                bUplinkQueueRefused = (iCurrentUplinkId == -1);
+            }
+            if (pLastSendCommand->endTag == IOT_FRMENDTAG && (iCurrentUplinkId >= 0 || iCurrentUplinkId == EDGEAGG_ABSORBED) && pLastSendCommand->downlinkIndicator == 0x01 && rulesEvaluate(pLastSendCommand, printGetUnixEpochTimeAsInt(), getCtrlDeckedReply()->payload))
+            {
+                // answered from the local rule table (SACRules.h), the uplink goes out in the background and the server's reply is compared
+                rulesAnswered(iCurrentUplinkId, getCtrlDeckedReply()->payload);
+                bErrorResponse = I2CERRORCODE_OK;
+                iCurrentUplinkId = -1;
+                sI2cTransfer.rxCnt = 0;
+                sState = S_IDLE;
+                #if USEREACTOR == 1
+                slaveDrainBacklog();
+                #endif
+            }
+            else if (pLastSendCommand->endTag == IOT_FRMENDTAG && iCurrentUplinkId == EDGEAGG_ABSORBED)
+            {
+                // suppressed or rolled up into a later summary, nothing to wait for
+                bErrorResponse = I2CERRORCODE_OK;
+                iCurrentUplinkId = -1;
+                sI2cTransfer.rxCnt = 0;
+                sState = S_IDLE;
+            }
+            else if (pLastSendCommand->endTag == IOT_FRMENDTAG && (iCurrentUplinkId < 0 || !commsCircuitAllowsRequest()))
+            {
+                // server is known to be down (uplink stays queued) or the queue refused it, answer right away instead of waiting for a timeout
+                printf("[WARNING] (%s) %s:(S_PARSECMDSEND) Circuit breaker open or uplink queue full, failing fast.\n", printTimestamp(), __func__);
+                bErrorResponse = I2CERRORCODE_SERVERUNREACH;
+                iCurrentUplinkId = -1;
+                sI2cTransfer.rxCnt = 0;
+                sState = S_IDLE;
+            }
+            else if (pLastSendCommand->endTag == IOT_FRMENDTAG)
             {
                 // received correct ETX
                 bErrorResponse = I2CERRORCODE_OK;
@@ -212,7 +355,7 @@ void listeningTask()
                 // sI2cTransfer.control = getControlBits(I2CSALAVEADDRESS7, true, false);
                 // bscXfer(&sI2cTransfer);
                 // // try to send http request with payload
-                // httpBuildRequestMsg((uint32_t)pLastSendCommand->payload, pLastSendCommand->payloadSize - 1); // -1 since payloadsize includes the read request byte
+                // httpBuildRequestMsg((uintptr_t)pLastSendCommand->payload, pLastSendCommand->payloadSize - 1); // -1 since payloadsize includes the read request byte
                 // if(httpSendRequest() < 0)
                 // // This might take a while ...
                 // {
@@ -240,6 +383,14 @@ void listeningTask()
             sState = S_BUILDRESPONSE;
             break;
             
+        case S_PARSECMDTAGGED:
+            slaveParseTagged(); // answered right away, the uplink goes out in the background
+            break;
+            
+        case S_PARSECMDSTATUS:
+            slaveParseStatus();
+            break;
+            
 
         case S_BUILDRESPONSE:
             printf("[INFO] (%s) %s:(S_BUILDRESPONSE) Building response for downlink indicator code 0x%02x (error code = 0x%02x)\n", printTimestamp(), __func__, pLastSendCommand->downlinkIndicator, bErrorResponse);
@@ -269,7 +420,9 @@ void listeningTask()
                     sI2cTransfer.txCnt = 5;
                     break;
             }
-            sI2cStatus.i32 = bscXfer(&sI2cTransfer);
+            statusShmSetFrame(false, (uint8_t *)sI2cTransfer.txBuf, sI2cTransfer.txCnt);
+            statusShmData()->lastErrorCode = sI2cTransfer.txBuf[2];
+            sI2cStatus.i32 = slaveXfer();
             if(sI2cStatus.i32 == -1)
             {
                 printf("[WARNING] (%s) %s:(S_IDLE) Detected i2c slave timeout.\n", printTimestamp(), __func__);
@@ -282,7 +435,7 @@ void listeningTask()
             // tell master to back off
             printf("[INFO] (%s) %s:(S_DISSABLEI2CPERIPH) Disabling I2C slave peripheral...", printTimestamp(), __func__);
             sI2cTransfer.control = getControlBits(I2CSALAVEADDRESS7, true, false);
-            sI2cStatus.i32 = bscXfer(&sI2cTransfer);
+            sI2cStatus.i32 = slaveXfer();
             printf(" CR=0x%08x\n", getRawBCSCReg(3));
             if(sI2cStatus.i32 == -1)
             {
@@ -294,24 +447,71 @@ void listeningTask()
         case S_SENDHTTPREQUEST:
             // try to send http request with payload
             printf("[INFO] (%s) %s:(S_SENDHTTPREQUEST) Sending HTTP request.\n", printTimestamp(), __func__);
-            httpBuildRequestMsg((uint32_t)pLastSendCommand->payload, pLastSendCommand->payloadSize - 1); // -1 since payloadsize includes the read request byte
-            if(httpSendRequest() < 0)
-            // This might take a while ...
+            #if USEREACTOR == 1
+            // the exchanges run in the reactor, S_WAITHTTPRESPONSE picks up the result
+            uiUplinkChainSent = 0;
+            bUplinkChainFailed = false;
+            bUplinkChainBusy = true;
+            uplinkSchedSetAwaited(iCurrentUplinkId); // goes out even when the rate limit holds back the rest
+            slaveUplinkChainStep();
+            sI2cTransfer.rxCnt = 0;
+            sState = S_WAITHTTPRESPONSE;
+            #else
+            if(iCurrentUplinkId < 0 && bulkUploadActive())
             {
-                bErrorResponse = I2CERRORCODE_SERVERUNREACH;
+                // long backlog, a block of it in one request
+                bulkUploadSend();
+            }
+            else if(iCurrentUplinkId < 0)
+            {
+                // backlog drain, nobody waits for this one
+                uplinkSchedRun(1, -1);
+            }
+            else
+            {
+                // higher priority uplinks queued before this one go first.
+                // This might take a while ...
+                uplinkSchedRun(UPLSCHED_MAXSENDSPERPASS, iCurrentUplinkId);
+                bUplinkCommandHeldBack = uplinkSchedIsPending(iCurrentUplinkId);
+                if(bUplinkCommandHeldBack)
+                {
+                    // not delivered now, it stays queued and goes out later
+                    bErrorResponse = I2CERRORCODE_SERVERUNREACH;
+                }
+                iCurrentUplinkId = -1;
             }
             
             // were done with the received data reset Rx count
             sI2cTransfer.rxCnt = 0;
             
             sState = S_ENABLEI2CPERIPH;
+            #endif
             break;
             
+        #if USEREACTOR == 1
+        case S_WAITHTTPRESPONSE:
+            if(!bUplinkChainBusy)
+            {
+                bUplinkCommandHeldBack = (iCurrentUplinkId >= 0 && uplinkSchedIsPending(iCurrentUplinkId));
+                if(bUplinkCommandHeldBack)
+                {
+                    // not delivered now, it stays queued and goes out later.
+                    // Held back by the backlog or no free exchange is
+                    // not an unreachable server.
+                    bErrorResponse = bUplinkChainFailed ? I2CERRORCODE_SERVERUNREACH : I2CERRORCODE_BUSY;
+                }
+                iCurrentUplinkId = -1;
+                uplinkSchedSetAwaited(-1);
+                sState = S_ENABLEI2CPERIPH;
+            }
+            break;
+        #endif
+            
         case S_ENABLEI2CPERIPH:
             // tell master were back
             printf("[INFO] (%s) %s:(S_ENABLEI2CPERIPH) Enabling I2C slave peripheral...", printTimestamp(), __func__);
             sI2cTransfer.control = getControlBits(I2CSALAVEADDRESS7, true, true);
-            sI2cStatus.i32 = bscXfer(&sI2cTransfer);
+            sI2cStatus.i32 = slaveXfer();
             printf(" CR=0x%08x\n", getRawBCSCReg(3));
             if(sI2cStatus.i32 == -1)
             {
@@ -325,11 +525,135 @@ void listeningTask()
             break;
     }
     
+    if(eBscRecoveryPending != BSCRECOVERY_NONE && sState == S_IDLE)
+    {
+        slaveBscRecover(eBscRecoveryPending);
+    }
+    
+    if(sState != ePreviousState)
+    {
+        TRACE_END(asStateNames[ePreviousState]);
+        TRACE_BEGIN(asStateNames[sState]);
+        if(sState == S_IDLE)
+        {
+            statusShmI2cServiced((uint32_t)(printGetMonotonicTimeUs() - ulLastI2cActivityUs));
+        }
+        slavePublishStatus();
+    }
+}
+
+/******************* slavePublishStatus *********************
+    Collects what local tools want to see and publishes it
+    in the status segment (SACStatusShm.c).
+************************************************************/
+void slavePublishStatus()
+{
+    tStatusData *pStatus = statusShmData();
+    int iClass;
+
+    pStatus->smState = sState;
+    pStatus->reactorMode = USEREACTOR;
+    pStatus->circuitState = commsGetCircuitState();
+    snprintf(pStatus->transport, sizeof(pStatus->transport), "%s", commsGetTransportName());
+    pStatus->seqNr = stateFileGetSeqNr();
+    commsGetByteCounts(&pStatus->txBytes, &pStatus->rxBytes);
+    pStatus->uplinksPending = uplinkSchedPending();
+    for(iClass=0; iClass<UPLCLASS_COUNT; iClass+=1)
+    {
+        pStatus->uplinksDropped[iClass] = uplinkSchedDropped(iClass);
+    }
+    pStatus->bscRecoveries[0] = bscHealthStats()->recoveries[BSCRECOVERY_ABORT];
+    pStatus->bscRecoveries[1] = bscHealthStats()->recoveries[BSCRECOVERY_REOPEN];
+    pStatus->bscRecoveries[2] = bscHealthStats()->recoveries[BSCRECOVERY_REINIT];
+    pStatus->lastBscRecoveryUs = bscHealthStats()->lastRecoveryUs;
+    pStatus->maxBscRecoveryUs = bscHealthStats()->maxRecoveryUs;
+    statusShmPublish();
+}
+
+double getTickSec()
+{
+    return ((double)printGetMonotonicTimeUs() * 1.0e-6); 
 }
 
-float getTickSec()
+/************************ slaveXfer *************************
+    All bscXfer calls on sI2cTransfer go through here so
+    they show up as spans in the trace and the health
+    supervisor sees every result.
+************************************************************/
+int slaveXfer()
 {
-    return ((float)gpioTick() * 1.0e-6); 
+    int iResult;
+    tBscRecoveryStage eStage;
+    TRACE_BEGIN("bscXfer");
+    iResult = bscXfer((bsc_xfer_t *)&sI2cTransfer);
+    TRACE_END("bscXfer");
+    eStage = bscHealthObserve(iResult, sI2cTransfer.rxCnt, printGetMonotonicTimeUs());
+    if(eStage > eBscRecoveryPending)
+    {
+        eBscRecoveryPending = eStage;
+    }
+    return iResult;
+}
+
+/******************** slaveBscRecover ***********************
+    Recovery of a wedged BSC peripheral in place, the
+    queues, the connections and the state survive. Stages
+    (SACBscHealth.h) escalate when the stall comes back.
+    A half received frame and an unread reply are lost,
+    the controller repeats the command.
+    Uses its own transfer struct, sI2cTransfer's buffers
+    belong to the state machine.
+************************************************************/
+int slaveBscRecover(tBscRecoveryStage eStage)
+{
+    bsc_xfer_t sXfer;
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    int iResult = 0;
+
+    eBscRecoveryPending = BSCRECOVERY_NONE;
+    memset(&sXfer, 0, sizeof(sXfer));
+    TRACE_BEGIN("bscRecover");
+    if(eStage == BSCRECOVERY_REINIT)
+    {
+        #if USEREACTOR == 1 && I2C_USEBSCEVENT == 1
+            eventSetFunc(PI_EVENT_BSC, NULL);
+        #endif
+        gpioTerminate();
+        iResult = gpioInitialise();
+        if(iResult < 0)
+        {
+            printf("[ERROR] (%s) %s: Error while initializing GPIOs. Return code = %i.\n", printTimestamp(), __func__, iResult);
+        }
+        #if USEREACTOR == 1 && I2C_USEBSCEVENT == 1
+            bBscEvents = (eventSetFunc(PI_EVENT_BSC, slaveBscEvent) == 0);
+            if(iBscPollTimerFd >= 0)
+            {
+                slaveArmTimers(); // poll interval depends on bBscEvents
+            }
+        #endif
+    }
+    if(eStage >= BSCRECOVERY_REOPEN)
+    {
+        sXfer.control = 0; // off, no address
+        bscXfer(&sXfer);
+        usleep(BSCHEALTH_REOPENDELAYUS);
+    }
+    sXfer.control = getControlBits(I2CSALAVEADDRESS7, false, false); // BK: abort, clears both fifos
+    bscXfer(&sXfer);
+    sXfer.control = getControlBits(I2CSALAVEADDRESS7, true, true);
+    if(iResult >= 0)
+    {
+        iResult = bscXfer(&sXfer);
+    }
+    sI2cTransfer.control = sXfer.control;
+    sI2cTransfer.rxCnt = 0;
+    sI2cTransfer.txCnt = 0;
+    sI2cStatus.i32 = 0;
+    sState = S_IDLE;
+    TRACE_END("bscRecover");
+    bscHealthRecoveryRan(eStage, printGetMonotonicTimeUs());
+    printf("[INFO] (%s) %s: Stage %s took %u us, result %i.\n", printTimestamp(), __func__, bscHealthStageName(eStage), (uint32_t)(printGetMonotonicTimeUs() - ulStartUs), iResult);
+    return iResult;
 }
 
 
@@ -419,39 +743,479 @@ void copyDeckedReplyToI2cTxBuffer(uint8_t bCmdCode, uint8_t bErrorCode)
     sI2cTransfer.txCnt = STRUCTS_DECKEDREPLYTOTALSIZE;
     
     printf("[INFO] (%s) %s: Filled i2c Tx buffer with %d bytes\n", printTimestamp(), __func__, sI2cTransfer.txCnt);
-    printf("\t#(%f) Bytes (HEX): %s\n", getTickSec(), printBytesAsHexString((uint32_t)sI2cTransfer.txBuf, sI2cTransfer.txCnt, true, ", "));
+    printf("\t#(%f) Bytes (HEX): %s\n", getTickSec(), printBytesAsHexString((uintptr_t)sI2cTransfer.txBuf, sI2cTransfer.txCnt, true, ", "));
+}
+
+
+/******************** slaveParseTagged **********************
+    Tagged send command (SACAsyncCmd.h): queued like 0x02
+    and 0x03, but the controller gets its answer right away
+    and queries the completion later. The bus stays enabled.
+************************************************************/
+void slaveParseTagged()
+{
+    tCtrlTaggedSendCmd *pTaggedCommand = (tCtrlTaggedSendCmd *)sI2cTransfer.rxBuf;
+    tCtrlSendCmd sSendCommand;
+    tCtrlEmptyReply sReply;
+    int32_t iUplinkId = -1;
+
+    printf("[INFO] (%s) %s:(S_PARSECMDTAGGED) Tagged send command: tag 0x%02x, cmdCode 0x%02x, payload size = %i, ETX = 0x%x\n", printTimestamp(), __func__,
+        pTaggedCommand->tag, pTaggedCommand->sendCmdCode, pTaggedCommand->payloadSize, pTaggedCommand->endTag);
+    if(sI2cTransfer.rxCnt < (int)sizeof(tCtrlTaggedSendCmd) || pTaggedCommand->endTag != IOT_FRMENDTAG)
+    {
+        sState = S_FLAGERROR_INVALIDETX;
+        return;
+    }
+    sReply.startTag = IOT_FRMSTARTTAG;
+    sReply.cmdCode = ASYNCCMD_CMDCODE_SEND;
+    sReply.payloadSize = 0x00;
+    sReply.endTag = IOT_FRMENDTAG;
+    if(pTaggedCommand->sendCmdCode != 0x02 && pTaggedCommand->sendCmdCode != UPLSCHED_CMDCODE_ALARM)
+    {
+        sReply.errorCode = I2CERRORCODE_INVALIDCMD;
+    }
+    else if(!asyncCmdCanAccept(pTaggedCommand->tag))
+    {
+        sReply.errorCode = asyncCmdAccept(pTaggedCommand->tag, -1, 0x00); // refused, counted
+    }
+    else
+    {
+        sSendCommand.startTag = IOT_FRMSTARTTAG;
+        memcpy(&sSendCommand.ui8[1], &pTaggedCommand->ui8[3], sizeof(tCtrlSendCmd) - 1);
+        iUplinkId = edgeAggSubmit(&sSendCommand, printGetMonotonicTimeUs());
+        sReply.errorCode = asyncCmdAccept(pTaggedCommand->tag, iUplinkId, sSendCommand.downlinkIndicator);
+    }
+    slaveReplyNow(sReply.ui8, sizeof(sReply.ui8));
+    sI2cTransfer.rxCnt = 0;
+    sState = S_IDLE;
+    #if USEREACTOR == 1
+        if(sReply.errorCode == I2CERRORCODE_PENDING)
+        {
+            slaveDrainBacklog(); // out now, no waiting for a quiet bus
+        }
+    #endif
+}
+
+/******************** slaveParseStatus **********************
+    Status query of a tagged command, answered right away
+    with its completion state and downlink.
+************************************************************/
+void slaveParseStatus()
+{
+    tCtrlStatusCmd *pStatusCommand = (tCtrlStatusCmd *)sI2cTransfer.rxBuf;
+    tCtrlDeckedReply sReply;
+
+    printf("[INFO] (%s) %s:(S_PARSECMDSTATUS) Status query: tag 0x%02x, ETX = 0x%x\n", printTimestamp(), __func__, pStatusCommand->tag, pStatusCommand->endTag);
+    if(sI2cTransfer.rxCnt < (int)sizeof(tCtrlStatusCmd) || pStatusCommand->endTag != IOT_FRMENDTAG)
+    {
+        sState = S_FLAGERROR_INVALIDETX;
+        return;
+    }
+    asyncCmdQuery(pStatusCommand->tag, &sReply);
+    slaveReplyNow(sReply.ui8, sizeof(sReply.ui8));
+    sI2cTransfer.rxCnt = 0;
+    sState = S_IDLE;
+}
+
+/********************** slaveReplyNow ***********************
+    Puts a reply in the tx fifo without a read enable
+    first, the controller reads it right after its write.
+************************************************************/
+void slaveReplyNow(const uint8_t *pFrame, int iLength)
+{
+    memcpy((void *)sI2cTransfer.txBuf, pFrame, iLength);
+    sI2cTransfer.txCnt = iLength;
+    printf("\t#(%f) Reply (HEX): %s\n", getTickSec(), printBytesAsHexString((uintptr_t)sI2cTransfer.txBuf, sI2cTransfer.txCnt, true, ", "));
+    statusShmSetFrame(false, (uint8_t *)sI2cTransfer.txBuf, sI2cTransfer.txCnt);
+    statusShmData()->lastErrorCode = pFrame[2];
+    sI2cStatus.i32 = slaveXfer();
+    if(sI2cStatus.i32 == -1)
+    {
+        printf("[WARNING] (%s) %s: Detected i2c slave timeout.\n", printTimestamp(), __func__);
+    }
+    sI2cTransfer.txCnt = 0;
+}
+
+#if USEREACTOR == 1
+/********************* runSlaveReactor **********************
+    Event loop version of the while(1) listeningTask() loop.
+    The state machine runs on bsc events (or the poll
+    timer), uplinks progress on their socket events in
+    between, so the controller is served while exchanges
+    are in flight.
+************************************************************/
+void runSlaveReactor()
+{
+    iSlaveWakeFd = reactorEventCreate(slaveServiceCallback, NULL);
+    iBscPollTimerFd = reactorTimerCreate(slaveServiceCallback, NULL);
+    iHousekeepingTimerFd = reactorTimerCreate(slaveHousekeeping, NULL);
+    iConfigEventFd = reactorEventCreate(slaveConfigEvent, NULL);
+    if(iSlaveWakeFd < 0 || iBscPollTimerFd < 0 || iHousekeepingTimerFd < 0 || iConfigEventFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not set up the reactor.\n", printTimestamp(), __func__);
+        return;
+    }
+    #if I2C_USEBSCEVENT == 1
+        bBscEvents = (eventSetFunc(PI_EVENT_BSC, slaveBscEvent) == 0);
+        if(!bBscEvents)
+        {
+            printf("[WARNING] (%s) %s: No bsc events, polling every %u us.\n", printTimestamp(), __func__, configGet()->i2cPollIntervalUs);
+        }
+    #endif
+    slaveArmTimers();
+    reactorRun();
+    #if I2C_USEBSCEVENT == 1
+        eventSetFunc(PI_EVENT_BSC, NULL);
+    #endif
 }
 
+/********************* slaveArmTimers ***********************
+    At startup and when a config reload changed the
+    intervals.
+************************************************************/
+void slaveArmTimers()
+{
+    const tConfig *pConfig = configGet();
+    uint32_t uiPollUs = bBscEvents ? pConfig->i2cEventPollIntervalUs : pConfig->i2cPollIntervalUs;
+    reactorTimerArmUs(iBscPollTimerFd, uiPollUs, uiPollUs);
+    reactorTimerArm(iHousekeepingTimerFd, pConfig->housekeepingIntervalMs, pConfig->housekeepingIntervalMs);
+}
+
+/*********************** slaveService ***********************
+    Runs the state machine until it waits for the bus
+    (S_IDLE) or for the uplinks (S_WAITHTTPRESPONSE).
+************************************************************/
+void slaveService()
+{
+    do
+    {
+        listeningTask();
+    } while(sState != S_IDLE && sState != S_WAITHTTPRESPONSE);
+}
+
+void slaveServiceCallback(int iFd, uint32_t uiEvents, void *pContext)
+{
+    slaveService();
+}
+
+/*********************** slaveBscEvent **********************
+    Runs in pigpio's thread, only wakes up the loop.
+************************************************************/
+void slaveBscEvent(int iEvent, uint32_t uiTick)
+{
+    reactorEventSignal(iSlaveWakeFd);
+}
+
+/******************** slaveHousekeeping *********************
+    Persistent transport upkeep and, while the bus is quiet,
+    backlog uplinks in the background. The bus stays
+    enabled for those, nobody waits for them.
+************************************************************/
+void slaveHousekeeping(int iFd, uint32_t uiEvents, void *pContext)
+{
+    commsPoll(); // keep alive and unsolicited downlinks of persistent transports
+    edgeAggPoll(printGetMonotonicTimeUs()); // summaries that reached their staleness bound
+    historyPoll();
+    slavePublishStatus(); // readers see a fresh publishedUs even when nothing happens
+    slaveDrainBacklog();
+}
+
+/******************* slaveDrainBacklog **********************
+    Starts backlog uplinks while the transport takes more,
+    right away while an alarm, tagged commands or local
+    rule answers are pending or the controller's last
+    command found its queue full or stayed queued behind
+    the backlog. After a long outage a controller that
+    keeps the bus busy would otherwise never get its
+    commands in again, and the open breaker would never
+    see a trial. The last free exchange is
+    left to the controller (commsCanStartBackgroundUplink).
+    Also called when one of them is done, so a pipelined
+    connection is refilled without waiting for the next
+    housekeeping tick. A long backlog goes out one block at
+    a time (SACBulkUpload.h).
+************************************************************/
+void slaveDrainBacklog()
+{
+    static bool bDraining = false;
+    tUplinkRecord sRecord;
+
+    if(bDraining)
+    {
+        return; // a done callback inside commsStartUplink
+    }
+    bDraining = true;
+    while(sState == S_IDLE && ((printGetMonotonicTimeUs() - ulLastI2cActivityUs) > (UPLSCHED_IDLEBEFOREDRAINMS * 1000ULL) || uplinkSchedPendingClass(UPLCLASS_ALARM) > 0 || asyncCmdPending() > 0 || rulesPending() > 0 || bUplinkQueueRefused || bUplinkCommandHeldBack) && commsCanStartBackgroundUplink())
+    {
+        if(bulkUploadActive())
+        {
+            if(bulkUploadBusy() || bulkUploadStart(slaveDrainBulkDone) < 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if(!uplinkSchedTake(&sRecord))
+        {
+            break;
+        }
+        printf("[INFO] (%s) %s: Draining uplink backlog, %u queued.\n", printTimestamp(), __func__, uplinkSchedPending());
+        if(commsStartUplink(&sRecord, slaveDrainDone) < 0)
+        {
+            uplinkSchedPutBack(&sRecord);
+            break;
+        }
+    }
+    bDraining = false;
+}
+
+void slaveDrainDone(tUplinkRecord *pRecord, int iResult)
+{
+    if(iResult < 0)
+    {
+        uplinkSchedPutBack(pRecord);
+        return;
+    }
+    slaveDrainBacklog();
+}
+
+void slaveDrainBulkDone(int iResult)
+{
+    if(iResult >= 0)
+    {
+        slaveDrainBacklog(); // the next block right away
+    }
+}
+
+/****************** slaveUplinkChainStep ********************
+    Same order as uplinkSchedRun(UPLSCHED_MAXSENDSPERPASS,
+    iCurrentUplinkId) but one exchange after the other
+    through the reactor. When nothing more goes out the
+    state machine is woken up to leave S_WAITHTTPRESPONSE.
+************************************************************/
+void slaveUplinkChainStep()
+{
+    tUplinkRecord sRecord;
+    int iResult;
+
+    if(uiUplinkChainSent < UPLSCHED_MAXSENDSPERPASS && uplinkSchedTake(&sRecord))
+    {
+        iResult = commsStartUplink(&sRecord, slaveUplinkChainDone);
+        if(iResult == 0)
+        {
+            return;
+        }
+        bUplinkChainFailed = (iResult != -3);
+        uplinkSchedPutBack(&sRecord);
+    }
+    bUplinkChainBusy = false;
+    reactorEventSignal(iSlaveWakeFd);
+}
+
+void slaveUplinkChainDone(tUplinkRecord *pRecord, int iResult)
+{
+    if(iResult < 0)
+    {
+        uplinkSchedPutBack(pRecord); // stays queued and goes out later
+        bUplinkChainFailed = true;
+        bUplinkChainBusy = false;
+        reactorEventSignal(iSlaveWakeFd);
+        return;
+    }
+    uiUplinkChainSent += 1;
+    if((int32_t)pRecord->id == iCurrentUplinkId)
+    {
+        bUplinkChainBusy = false;
+        reactorEventSignal(iSlaveWakeFd);
+        return;
+    }
+    slaveUplinkChainStep();
+}
+
+/*********************** slaveSignal ************************
+    Signals arrive through the reactor's signalfd, so this
+    runs in the loop and not in signal context.
+************************************************************/
+void slaveSignal(int signum)
+{
+    if(signum == TRACE_TOGGLESIGNAL)
+    {
+        traceSIGHandler(signum);
+        return;
+    }
+    if(signum == SIGHUP)
+    {
+        if(configReloadStart(slaveConfigNotify) < 0)
+        {
+            printf("[WARNING] (%s) %s: Config reload still pending, SIGHUP ignored.\n", printTimestamp(), __func__);
+        }
+        return;
+    }
+    printf("[INFO] (%s) %s: Caught signal %i, stopping.\n", printTimestamp(), __func__, signum);
+    reactorStop();
+}
+
+/******************** slaveConfigNotify *********************
+    Runs in the config reload worker, only wakes up the
+    loop.
+************************************************************/
+void slaveConfigNotify()
+{
+    reactorEventSignal(iConfigEventFd);
+}
+
+void slaveConfigEvent(int iFd, uint32_t uiEvents, void *pContext)
+{
+    slaveConfigApply();
+}
+#else
+/************************ SIGHandler ************************
+    SIGINT/SIGTERM. Only sets a flag, runSlave() returns
+    after the current pass of the state machine and main()
+    shuts down, like the reactor does after its signalfd.
+************************************************************/
+void SIGHandler(int signum)
+{
+    bStopRequested = 1;
+}
+
+void slaveSIGHUPHandler(int signum)
+{
+    bConfigReloadRequested = 1;
+}
+#endif
+
+/******************** slaveConfigApply **********************
+    Runs in the loop between two passes of the state
+    machine. Makes a parsed reload current and adjusts
+    what depends on it, the i2c side is never stopped.
+    The blocking loop starts the reload here as well, the
+    SIGHUP handler only sets a flag.
+************************************************************/
+void slaveConfigApply()
+{
+    uint32_t uiChanged;
+
+    #if USEREACTOR == 0
+        if(bConfigReloadRequested)
+        {
+            bConfigReloadRequested = 0;
+            configReloadStart(NULL);
+        }
+    #endif
+    uiChanged = configApplyPending();
+    if(uiChanged == 0)
+    {
+        return;
+    }
+    edgeAggApplyConfig(uiChanged); // before the transport changes, a pending summary goes to the old server's chain as a keyframe
+    if(uiChanged & (CONFIG_CHANGED_TRANSPORT | CONFIG_CHANGED_ENDPOINT | CONFIG_CHANGED_PIPELINE))
+    {
+        commsApplyConfig(uiChanged);
+    }
+    if(uiChanged & CONFIG_CHANGED_UPLINK)
+    {
+        uplinkSchedSetRateLimit(configGet()->uplinkRatePerMin, configGet()->uplinkBurst);
+    }
+    if(uiChanged & CONFIG_CHANGED_HISTORY)
+    {
+        historyClose();
+        historyOpen(HISTORY_PATH, configGet()->historyEnabled ? configGet()->historyRecords : 0);
+    }
+    #if USEREACTOR == 1
+        if(uiChanged & CONFIG_CHANGED_I2C)
+        {
+            slaveArmTimers();
+        }
+        lanGatewayApplyConfig(uiChanged);
+    #endif
+    slavePublishStatus();
+}
 
 void closeSlave()
 {
     gpioInitialise();
     sI2cTransfer.control = getControlBits(I2CSALAVEADDRESS7, false, false);
-    bscXfer(&sI2cTransfer);
+    slaveXfer();
     printf("[INFO] (%s) %s: Closed slave.\n", printTimestamp(), __func__);
     gpioTerminate();
     printf("[INFO] (%s) %s: Terminated GPIOs.\n", printTimestamp(), __func__);
 }
-
-void SIGHandler(int signum)
-{
-    closeSlave();
-    exit(signum);
-}
 /*************************************************************************************************/
 
 /*************************** main ***************************
     Program entry point
 ************************************************************/
 int main(int argc, char* argv[]){
-    signal(SIGINT, SIGHandler);
+    int32_t iSummaryId;
+    tUplinkRecord sSummary;
+    #if USEREACTOR == 1
+        const int aiSignals[] = {SIGINT, SIGTERM, SIGHUP, TRACE_TOGGLESIGNAL};
+        reactorInit(aiSignals, sizeof(aiSignals) / sizeof(aiSignals[0]), slaveSignal); // first, the threads started later inherit the signal mask
+    #else
+        signal(SIGINT, SIGHandler);
+        signal(SIGTERM, SIGHandler); // systemd stop, still flush the state file
+        signal(TRACE_TOGGLESIGNAL, traceSIGHandler);
+        signal(SIGHUP, slaveSIGHUPHandler); // reload the config file
+    #endif
+    signal(SIGPIPE, SIG_IGN); // a server closing a pipelined connection must not kill us, the write fails with EPIPE
+    memPoolInit(); // before anything touches OpenSSL
     structsInit();
-    #if USESSL == 1
-        sslInit();
+    statusShmOpen(STATUSSHM_NAME);
+    uplinkSchedInit();
+    traceInit();
+    stateFileOpen();
+    configInit(CONFIG_PATH);
+    uplinkSchedSetRateLimit(configGet()->uplinkRatePerMin, configGet()->uplinkBurst);
+    historyOpen(HISTORY_PATH, configGet()->historyEnabled ? configGet()->historyRecords : 0);
+    edgeAggInit();
+    bulkUploadInit();
+    asyncCmdInit();
+    rulesInit(); // after the config, the table is only used with [rules] enabled
+    sslInit(); // also without use_ssl, a reload may switch it on
+    commsInit();
+    #if USEREACTOR == 1
+        lanGatewayInit(); // after the transport, forwards on it
     #endif
     runSlave();
     closeSlave();
+    iSummaryId = edgeAggFlush(); // rolled up records, the queues don't survive the exit
+    if(iSummaryId >= 0 && uplinkSchedTakeId(iSummaryId, &sSummary))
+    {
+        // only the summary and under a deadline, a socket timeout per
+        // backlog record would outlast systemd's stop timeout (SIGKILL)
+        commsSetDeadline(printGetMonotonicTimeUs() + COMMS_EXITDEADLINEMS * 1000ULL);
+        if(commsSendUplink(&sSummary) < 0)
+        {
+            printf("[WARNING] (%s) %s: Edge aggregation summary not sent at exit.\n", printTimestamp(), __func__);
+        }
+        commsSetDeadline(0);
+    }
+    if(uplinkSchedPending() > 0)
+    {
+        printf("[WARNING] (%s) %s: Dropping %u queued uplinks at exit.\n", printTimestamp(), __func__, uplinkSchedPending());
+    }
+    commsClose();
     sslClose();
+    httpKtlsLog();
+    memPoolLog();
+    edgeAggLog();
+    bulkUploadLog();
+    endpointsLog();
+    asyncCmdLog();
+    rulesLog();
+    historyLog();
+    historyClose();
+    stateFileClose();
+    statusShmClose();
+    traceClose();
+    #if USEREACTOR == 1
+        lanGatewayLog();
+        lanGatewayClose();
+        uringLog();
+        uringClose();
+        reactorClose();
+    #endif
     return 0;
 }
 
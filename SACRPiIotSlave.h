@@ -4,6 +4,12 @@
 #define I2CSALAVEADDRESS7       0x5F // SAC Iot i2c slave needs to be 0x5F (7bit address)
 #define I2CSALAVEADDRESS        (I2CSALAVEADDRESS7 << 1) // 8 bit address including R/W bit (0)
 
+#define USEREACTOR                  1 // 1: single threaded epoll loop (SACReactor.c), uplinks don't block the i2c state machine. 0: blocking polling loop
+#define I2C_USEBSCEVENT             1 // reactor: wake up on pigpio's PI_EVENT_BSC, the poll timer is only a fallback then
+#define I2C_POLLINTERVALUS          1000 // reactor: bsc poll period without bsc events, 32bytes take about 3.2ms to transmit
+#define I2C_EVENTPOLLINTERVALUS     20000 // reactor: bsc poll period with bsc events
+#define HOUSEKEEPINGINTERVALMS      100 // reactor: commsPoll() and backlog drain check
+
 #define I2CERRORCODE_OK             0x00
 #define I2CERRORCODE_CMDPROCESSING  0x01
 #define I2CERRORCODE_NOCMD          0x02
@@ -12,6 +18,10 @@
 #define I2CERRORCODE_UNEXPECTEDPLSZ 0x05
 #define I2CERRORCODE_RES            0x06
 #define I2CERRORCODE_SERVERUNREACH  0x07
+#define I2CERRORCODE_PENDING        0x08 // tagged command accepted, not delivered yet (SACAsyncCmd.h)
+#define I2CERRORCODE_UNKNOWNTAG     0x09 // status query for a tag that is not tracked
+#define I2CERRORCODE_TAGBUSY        0x0A // tagged command refused: tag still pending or no free slot
+#define I2CERRORCODE_BUSY           0x0B // server reachable, but no free exchange or the backlog went first: the record stays queued, retry
 
 
 typedef union
@@ -45,7 +55,10 @@ typedef enum
     S_BUILDRESPONSE,
     S_DISSABLEI2CPERIPH,
     S_SENDHTTPREQUEST,
+    S_WAITHTTPRESPONSE, // reactor mode: uplinks of S_SENDHTTPREQUEST in flight
     S_ENABLEI2CPERIPH,
+    S_PARSECMDTAGGED, // tagged send command, answered right away
+    S_PARSECMDSTATUS, // status query of a tagged command
 } tSmState;
 
 #endif
\ No newline at end of file
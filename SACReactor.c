@@ -0,0 +1,349 @@
+#include "SACReactor.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memset */
+#include "stdio.h"
+#include "unistd.h"
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+typedef enum
+{
+    RH_FREE,
+    RH_FD, // caller reads/writes the fd itself
+    RH_TIMER, // timerfd, expirations are read before the callback
+    RH_EVENT, // eventfd, counter is read before the callback
+    RH_SIGNAL, // the signalfd
+} tReactorHandlerType;
+
+typedef struct
+{
+    tReactorHandlerType eType;
+    int iFd;
+    tReactorCallback pCallback;
+    void *pContext;
+} tReactorHandler;
+
+/****************** private function prototypes *********************/
+int reactorAddHandler(int iFd, uint32_t uiEvents, tReactorHandlerType eType, tReactorCallback pCallback, void *pContext);
+tReactorHandler *reactorFindHandler(int iFd);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static int miEpollFd = -1;
+static int miSignalFd = -1;
+static void (*mpSignalHandler)(int) = NULL;
+static tReactorHandler masHandlers[REACTOR_MAXHANDLERS];
+static volatile bool mbReactorRunning = false;
+static void (*mpReactorPreWait)() = NULL;
+/********************************************************************/
+
+/*********************** reactorInit ************************
+    Creates the epoll instance. The signals in aiSignals are
+    blocked and delivered through a signalfd, so
+    pSignalHandler runs in the loop like any other callback
+    and may do things a real signal handler can't.
+************************************************************/
+int reactorInit(const int *aiSignals, int iSignals, void (*pSignalHandler)(int))
+{
+    int i;
+    sigset_t sMask;
+
+    memset(masHandlers, 0, sizeof(masHandlers));
+    miEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if(miEpollFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not create epoll instance, errno %i.\n", printTimestamp(), __func__, errno);
+        return -1;
+    }
+    if(iSignals > 0)
+    {
+        sigemptyset(&sMask);
+        for(i=0; i<iSignals; i+=1)
+        {
+            sigaddset(&sMask, aiSignals[i]);
+        }
+        sigprocmask(SIG_BLOCK, &sMask, NULL); // before any thread is started so they inherit the mask
+        miSignalFd = signalfd(-1, &sMask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if(miSignalFd < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not create signalfd, errno %i.\n", printTimestamp(), __func__, errno);
+            return -1;
+        }
+        mpSignalHandler = pSignalHandler;
+        reactorAddHandler(miSignalFd, EPOLLIN, RH_SIGNAL, NULL, NULL);
+    }
+    printf("[INFO] (%s) %s: Reactor ready, %i signal(s) on signalfd.\n", printTimestamp(), __func__, iSignals);
+    return 0;
+}
+
+/********************** reactorAddFd ************************
+    Watches iFd for uiEvents (EPOLLIN, EPOLLOUT, ...).
+    The callback gets the returned epoll events, the fd
+    stays owned by the caller.
+************************************************************/
+int reactorAddFd(int iFd, uint32_t uiEvents, tReactorCallback pCallback, void *pContext)
+{
+    return reactorAddHandler(iFd, uiEvents, RH_FD, pCallback, pContext);
+}
+
+int reactorModFd(int iFd, uint32_t uiEvents)
+{
+    struct epoll_event sEvent;
+    tReactorHandler *pHandler = reactorFindHandler(iFd);
+    if(pHandler == NULL)
+    {
+        return -1;
+    }
+    sEvent.events = uiEvents;
+    sEvent.data.u32 = (uint32_t)(pHandler - masHandlers);
+    return epoll_ctl(miEpollFd, EPOLL_CTL_MOD, iFd, &sEvent);
+}
+
+void reactorDelFd(int iFd)
+{
+    tReactorHandler *pHandler = reactorFindHandler(iFd);
+    if(pHandler == NULL)
+    {
+        return;
+    }
+    epoll_ctl(miEpollFd, EPOLL_CTL_DEL, iFd, NULL);
+    pHandler->eType = RH_FREE;
+}
+
+/******************* reactorTimerCreate *********************
+    Returns a disarmed timerfd (CLOCK_MONOTONIC) or -1.
+************************************************************/
+int reactorTimerCreate(tReactorCallback pCallback, void *pContext)
+{
+    int iFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(iFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not create timerfd, errno %i.\n", printTimestamp(), __func__, errno);
+        return -1;
+    }
+    if(reactorAddHandler(iFd, EPOLLIN, RH_TIMER, pCallback, pContext) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+    return iFd;
+}
+
+/******************** reactorTimerArm ***********************
+    uiIntervalMs = 0: one shot.
+************************************************************/
+void reactorTimerArm(int iTimerFd, uint32_t uiInitialMs, uint32_t uiIntervalMs)
+{
+    reactorTimerArmUs(iTimerFd, uiInitialMs * 1000, uiIntervalMs * 1000);
+}
+
+void reactorTimerArmUs(int iTimerFd, uint32_t uiInitialUs, uint32_t uiIntervalUs)
+{
+    struct itimerspec sSpec;
+    if(uiInitialUs == 0)
+    {
+        uiInitialUs = 1; // 0 would disarm
+    }
+    sSpec.it_value.tv_sec = uiInitialUs / 1000000;
+    sSpec.it_value.tv_nsec = (uiInitialUs % 1000000) * 1000;
+    sSpec.it_interval.tv_sec = uiIntervalUs / 1000000;
+    sSpec.it_interval.tv_nsec = (uiIntervalUs % 1000000) * 1000;
+    timerfd_settime(iTimerFd, 0, &sSpec, NULL);
+}
+
+void reactorTimerDisarm(int iTimerFd)
+{
+    struct itimerspec sSpec;
+    memset(&sSpec, 0, sizeof(sSpec));
+    timerfd_settime(iTimerFd, 0, &sSpec, NULL);
+}
+
+void reactorTimerClose(int iTimerFd)
+{
+    reactorDelFd(iTimerFd);
+    close(iTimerFd);
+}
+
+/******************* reactorEventCreate *********************
+    Returns an eventfd that runs pCallback in the loop
+    after reactorEventSignal(), or -1.
+************************************************************/
+int reactorEventCreate(tReactorCallback pCallback, void *pContext)
+{
+    int iFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(iFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not create eventfd, errno %i.\n", printTimestamp(), __func__, errno);
+        return -1;
+    }
+    if(reactorAddHandler(iFd, EPOLLIN, RH_EVENT, pCallback, pContext) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+    return iFd;
+}
+
+/******************* reactorEventSignal *********************
+    Thread and signal safe, several signals before the loop
+    gets to it run the callback once.
+************************************************************/
+void reactorEventSignal(int iEventFd)
+{
+    uint64_t ulOne = 1;
+    if(write(iEventFd, &ulOne, sizeof(ulOne)) < 0)
+    {
+        // counter full means a wake up is pending anyway
+    }
+}
+
+/******************** reactorSetPreWait *********************
+    pPreWait runs every time before the loop waits, for work
+    the callbacks of one pass batched up (io_uring
+    submissions, SACUring.c). NULL removes it.
+************************************************************/
+void reactorSetPreWait(void (*pPreWait)())
+{
+    mpReactorPreWait = pPreWait;
+}
+
+/********************* reactorRunOnce ***********************
+    Waits at most iTimeoutMs (-1: forever) and dispatches
+    what is ready. Returns the number of events handled.
+************************************************************/
+int reactorRunOnce(int iTimeoutMs)
+{
+    struct epoll_event asEvents[REACTOR_MAXEVENTS];
+    int iEvents;
+    int i;
+    uint64_t ulCounter;
+    struct signalfd_siginfo sSigInfo;
+
+    if(mpReactorPreWait != NULL)
+    {
+        mpReactorPreWait();
+    }
+    iEvents = epoll_wait(miEpollFd, asEvents, REACTOR_MAXEVENTS, iTimeoutMs);
+    if(iEvents < 0)
+    {
+        if(errno != EINTR)
+        {
+            printf("[ERROR] (%s) %s: epoll_wait failed, errno %i.\n", printTimestamp(), __func__, errno);
+        }
+        return 0;
+    }
+    for(i=0; i<iEvents; i+=1)
+    {
+        tReactorHandler *pHandler = &masHandlers[asEvents[i].data.u32];
+        switch(pHandler->eType)
+        {
+            case RH_TIMER:
+            case RH_EVENT:
+                if(read(pHandler->iFd, &ulCounter, sizeof(ulCounter)) != sizeof(ulCounter))
+                {
+                    break; // already handled, e.g. a timer re-armed by an earlier callback in this batch
+                }
+                pHandler->pCallback(pHandler->iFd, asEvents[i].events, pHandler->pContext);
+                break;
+            case RH_SIGNAL:
+                while(read(miSignalFd, &sSigInfo, sizeof(sSigInfo)) == sizeof(sSigInfo))
+                {
+                    if(mpSignalHandler != NULL)
+                    {
+                        mpSignalHandler((int)sSigInfo.ssi_signo);
+                    }
+                }
+                break;
+            case RH_FD:
+                pHandler->pCallback(pHandler->iFd, asEvents[i].events, pHandler->pContext);
+                break;
+            default:
+                break; // removed by an earlier callback in this batch
+        }
+    }
+    return iEvents;
+}
+
+/*********************** reactorRun *************************
+    Dispatches until reactorStop() is called.
+************************************************************/
+void reactorRun()
+{
+    mbReactorRunning = true;
+    while(mbReactorRunning)
+    {
+        reactorRunOnce(-1);
+    }
+}
+
+void reactorStop()
+{
+    mbReactorRunning = false;
+}
+
+void reactorClose()
+{
+    int i;
+    for(i=0; i<REACTOR_MAXHANDLERS; i+=1)
+    {
+        if(masHandlers[i].eType == RH_TIMER || masHandlers[i].eType == RH_EVENT || masHandlers[i].eType == RH_SIGNAL)
+        {
+            close(masHandlers[i].iFd);
+        }
+        masHandlers[i].eType = RH_FREE;
+    }
+    if(miEpollFd >= 0)
+    {
+        close(miEpollFd);
+        miEpollFd = -1;
+    }
+    miSignalFd = -1;
+}
+
+int reactorAddHandler(int iFd, uint32_t uiEvents, tReactorHandlerType eType, tReactorCallback pCallback, void *pContext)
+{
+    struct epoll_event sEvent;
+    int i;
+    for(i=0; i<REACTOR_MAXHANDLERS; i+=1)
+    {
+        if(masHandlers[i].eType == RH_FREE)
+        {
+            break;
+        }
+    }
+    if(i == REACTOR_MAXHANDLERS)
+    {
+        printf("[ERROR] (%s) %s: No free reactor handler for fd %i, increase REACTOR_MAXHANDLERS.\n", printTimestamp(), __func__, iFd);
+        return -1;
+    }
+    sEvent.events = uiEvents;
+    sEvent.data.u32 = (uint32_t)i;
+    if(epoll_ctl(miEpollFd, EPOLL_CTL_ADD, iFd, &sEvent) < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not add fd %i to epoll, errno %i.\n", printTimestamp(), __func__, iFd, errno);
+        return -1;
+    }
+    masHandlers[i].eType = eType;
+    masHandlers[i].iFd = iFd;
+    masHandlers[i].pCallback = pCallback;
+    masHandlers[i].pContext = pContext;
+    return 0;
+}
+
+tReactorHandler *reactorFindHandler(int iFd)
+{
+    int i;
+    for(i=0; i<REACTOR_MAXHANDLERS; i+=1)
+    {
+        if(masHandlers[i].eType != RH_FREE && masHandlers[i].iFd == iFd)
+        {
+            return &masHandlers[i];
+        }
+    }
+    return NULL;
+}
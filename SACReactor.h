@@ -0,0 +1,40 @@
+#ifndef SACREACTOR_H
+#define SACREACTOR_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAXHANDLERS     64 // fds watched at the same time (sockets, timers, events, signals, LAN gateway slaves)
+#define REACTOR_MAXEVENTS       16 // events handled per epoll_wait
+
+/*
+    Single threaded event loop on epoll. Everything that can
+    block the daemon (the bsc poll, sockets, retry timers,
+    signals) is an fd, the callbacks run one after the other
+    in the thread that calls reactorRun(), so they share the
+    module globals without locking.
+    Only reactorEventSignal() may be called from other
+    threads (e.g. pigpio's event thread).
+*/
+
+typedef void (*tReactorCallback)(int iFd, uint32_t uiEvents, void *pContext);
+
+int reactorInit(const int *aiSignals, int iSignals, void (*pSignalHandler)(int));
+int reactorAddFd(int iFd, uint32_t uiEvents, tReactorCallback pCallback, void *pContext);
+int reactorModFd(int iFd, uint32_t uiEvents);
+void reactorDelFd(int iFd);
+int reactorTimerCreate(tReactorCallback pCallback, void *pContext);
+void reactorTimerArm(int iTimerFd, uint32_t uiInitialMs, uint32_t uiIntervalMs);
+void reactorTimerArmUs(int iTimerFd, uint32_t uiInitialUs, uint32_t uiIntervalUs);
+void reactorTimerDisarm(int iTimerFd);
+void reactorTimerClose(int iTimerFd);
+int reactorEventCreate(tReactorCallback pCallback, void *pContext);
+void reactorEventSignal(int iEventFd);
+void reactorSetPreWait(void (*pPreWait)());
+int reactorRunOnce(int iTimeoutMs);
+void reactorRun();
+void reactorStop();
+void reactorClose();
+
+#endif
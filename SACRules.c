@@ -0,0 +1,378 @@
+#include "SACRules.h"
+#include "SACConfig.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memset, memcmp */
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h> /* localtime_r */
+#include <zlib.h> /* crc32 */
+#include "stdio.h"
+#include "unistd.h"
+
+typedef struct
+{
+    uint8_t cmdCode;
+    uint8_t field;
+    uint8_t width;
+    uint8_t op; // tRulesOp
+    uint32_t a;
+    uint32_t b;
+    uint8_t downlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+} tRule;
+
+typedef struct
+{
+    bool used;
+    uint32_t uplinkId;
+    uint8_t downlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+} tRulesPending;
+
+/****************** private function prototypes *********************/
+int rulesParse(const uint8_t *pTable, int iLength, tRule *asRules, uint32_t *pVersion);
+bool rulesMatch(const tRule *pRule, const tCtrlSendCmd *pCmd, const struct tm *pTime);
+int rulesStore(const uint8_t *pTable, int iLength);
+uint32_t rulesGetU32(const uint8_t *pSource);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tRule masRules[RULES_MAXRULES];
+static tRulesPending masRulesPending[RULES_MAXPENDING];
+static uint32_t muiRulesNextPending = 0;
+static tRulesStats msRulesStats = {0};
+/********************************************************************/
+
+/************************ rulesInit *************************
+    Takes the table kept in RULES_PATH, none when the file
+    is missing or damaged.
+************************************************************/
+void rulesInit()
+{
+    uint8_t abTable[RULES_TABLEMAXSIZE];
+    int iLength = -1;
+    int iFd;
+
+    memset(&msRulesStats, 0, sizeof(msRulesStats));
+    memset(masRulesPending, 0, sizeof(masRulesPending));
+    iFd = open(RULES_PATH, O_RDONLY);
+    if(iFd >= 0)
+    {
+        iLength = read(iFd, abTable, sizeof(abTable));
+        close(iFd);
+    }
+    if(iLength > 0 && rulesInstall(abTable, iLength, false) == 0)
+    {
+        msRulesStats.installed = 0; // from the disk, not from the server
+        return;
+    }
+    printf("[INFO] (%s) %s: No rule table in %s, every downlink comes from the server.\n", printTimestamp(), __func__, RULES_PATH);
+}
+
+/********************** rulesEvaluate ***********************
+    Fills pDownlink and returns true when a rule answers
+    pCmd. ulTime is the unix time of the event.
+************************************************************/
+bool rulesEvaluate(const tCtrlSendCmd *pCmd, long unsigned int ulTime, uint8_t *pDownlink)
+{
+    time_t sTime = (time_t)ulTime;
+    struct tm sLocalTime;
+    uint32_t i;
+
+    if(!configGet()->rulesEnabled || msRulesStats.version == 0 || msRulesStats.suspended)
+    {
+        return false;
+    }
+    msRulesStats.evaluated += 1;
+    localtime_r(&sTime, &sLocalTime);
+    for(i=0; i<msRulesStats.rules; i+=1)
+    {
+        if(rulesMatch(&masRules[i], pCmd, &sLocalTime))
+        {
+            memcpy(pDownlink, masRules[i].downlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+            msRulesStats.answered += 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/********************** rulesAnswered ***********************
+    The controller got pDownlink for uplink iUplinkId, the
+    server's reply is compared with it. iUplinkId < 0: no
+    uplink goes out (edge aggregation absorbed it).
+************************************************************/
+void rulesAnswered(int32_t iUplinkId, const uint8_t *pDownlink)
+{
+    tRulesPending *pPending = &masRulesPending[muiRulesNextPending]; // the oldest when all are taken
+
+    if(iUplinkId < 0)
+    {
+        return;
+    }
+    pPending->used = true;
+    pPending->uplinkId = (uint32_t)iUplinkId;
+    memcpy(pPending->downlink, pDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    muiRulesNextPending = (muiRulesNextPending + 1) % RULES_MAXPENDING;
+}
+
+/******************** rulesUplinkResult *********************
+    Every uplink result (commsRecordUplinkResult()). A
+    failed uplink stays queued and is compared when it gets
+    through.
+************************************************************/
+void rulesUplinkResult(uint32_t uiUplinkId, int iResult, const uint8_t *pDownlink)
+{
+    int i;
+
+    if(iResult < 0)
+    {
+        return;
+    }
+    for(i=0; i<RULES_MAXPENDING; i+=1)
+    {
+        tRulesPending *pPending = &masRulesPending[i];
+        if(!pPending->used || pPending->uplinkId != uiUplinkId)
+        {
+            continue;
+        }
+        pPending->used = false;
+        if(memcmp(pPending->downlink, pDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE) == 0)
+        {
+            msRulesStats.agreed += 1;
+            return;
+        }
+        msRulesStats.disagreed += 1;
+        if(!msRulesStats.suspended)
+        {
+            printf("[WARNING] (%s) %s: Server disagrees with rule table version %u on uplink %u, local answers off until another version arrives.\n", printTimestamp(), __func__, msRulesStats.version, uiUplinkId);
+            printf("\t#local %s", printBytesAsHexString((uintptr_t)pPending->downlink, STRUCTS_DECKEDREPLYPAYLOADSIZE, false, NULL));
+            printf(", server %s\n", printBytesAsHexString((uintptr_t)pDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE, false, NULL));
+        }
+        msRulesStats.suspended = true;
+        return;
+    }
+}
+
+uint32_t rulesPending()
+{
+    uint32_t uiPending = 0;
+    int i;
+
+    for(i=0; i<RULES_MAXPENDING; i+=1)
+    {
+        uiPending += masRulesPending[i].used ? 1 : 0;
+    }
+    return uiPending;
+}
+
+/************************ rulesOffer ************************
+    Value of a RULES_HEADER response header. A table with
+    another version than the current one is installed and
+    kept on disk.
+************************************************************/
+int rulesOffer(const char *sHexTable)
+{
+    uint8_t abTable[RULES_TABLEMAXSIZE];
+    int iLength = 0;
+    int iHigh;
+    int iLow;
+
+    if(!configGet()->rulesEnabled)
+    {
+        return 0;
+    }
+    while(*sHexTable == ' ')
+    {
+        sHexTable += 1;
+    }
+    while(isxdigit((unsigned char)sHexTable[0]) && isxdigit((unsigned char)sHexTable[1]) && iLength < RULES_TABLEMAXSIZE)
+    {
+        iHigh = isdigit((unsigned char)sHexTable[0]) ? sHexTable[0] - '0' : (tolower((unsigned char)sHexTable[0]) - 'a' + 10);
+        iLow = isdigit((unsigned char)sHexTable[1]) ? sHexTable[1] - '0' : (tolower((unsigned char)sHexTable[1]) - 'a' + 10);
+        abTable[iLength] = (uint8_t)((iHigh << 4) | iLow);
+        iLength += 1;
+        sHexTable += 2;
+    }
+    if(iLength >= 4 && rulesGetU32(abTable) == msRulesStats.version)
+    {
+        return 0;
+    }
+    return rulesInstall(abTable, iLength, true);
+}
+
+/*********************** rulesInstall ***********************
+    Makes pTable current when it is valid, bStore: also
+    keeps it in RULES_PATH. A new table lifts a suspension.
+************************************************************/
+int rulesInstall(const uint8_t *pTable, int iLength, bool bStore)
+{
+    tRule asRules[RULES_MAXRULES];
+    uint32_t uiVersion;
+    int iRules = rulesParse(pTable, iLength, asRules, &uiVersion);
+
+    if(iRules < 0)
+    {
+        printf("[WARNING] (%s) %s: Rejected a rule table of %i bytes (error %i).\n", printTimestamp(), __func__, iLength, iRules);
+        msRulesStats.rejected += 1;
+        return -1;
+    }
+    memcpy(masRules, asRules, iRules * sizeof(tRule));
+    msRulesStats.rules = iRules;
+    msRulesStats.version = uiVersion;
+    msRulesStats.suspended = false;
+    msRulesStats.installed += 1;
+    memset(masRulesPending, 0, sizeof(masRulesPending)); // answers of the old table are not held against the new one
+    printf("[INFO] (%s) %s: Rule table version %u with %i rules.\n", printTimestamp(), __func__, uiVersion, iRules);
+    if(bStore)
+    {
+        rulesStore(pTable, iLength);
+    }
+    return 0;
+}
+
+uint32_t rulesVersion()
+{
+    return msRulesStats.version;
+}
+
+const tRulesStats *rulesStats()
+{
+    return &msRulesStats;
+}
+
+void rulesLog()
+{
+    printf("[INFO] (%s) %s: table version %u (%u rules%s), %llu evaluated, %llu answered locally, %llu agreed, %llu disagreed, %llu tables installed, %llu rejected.\n", printTimestamp(), __func__,
+        msRulesStats.version, msRulesStats.rules, msRulesStats.suspended ? ", suspended" : "",
+        (unsigned long long)msRulesStats.evaluated, (unsigned long long)msRulesStats.answered,
+        (unsigned long long)msRulesStats.agreed, (unsigned long long)msRulesStats.disagreed,
+        (unsigned long long)msRulesStats.installed, (unsigned long long)msRulesStats.rejected);
+}
+
+/************************ rulesParse ************************
+    Returns the number of rules, < 0 when the table is
+    damaged or not valid: -1 size, -2 crc, -3 a rule.
+************************************************************/
+int rulesParse(const uint8_t *pTable, int iLength, tRule *asRules, uint32_t *pVersion)
+{
+    const uint8_t *pRule;
+    int iRules;
+    int i;
+
+    if(iLength < 9)
+    {
+        return -1;
+    }
+    iRules = pTable[4];
+    if(iRules > RULES_MAXRULES || iLength != 5 + iRules * RULES_RULESIZE + 4)
+    {
+        return -1;
+    }
+    if(crc32(0L, pTable, iLength - 4) != rulesGetU32(&pTable[iLength - 4]))
+    {
+        return -2;
+    }
+    *pVersion = rulesGetU32(pTable);
+    if(*pVersion == 0)
+    {
+        return -1;
+    }
+    for(i=0; i<iRules; i+=1)
+    {
+        pRule = &pTable[5 + i * RULES_RULESIZE];
+        asRules[i].cmdCode = pRule[0];
+        asRules[i].field = pRule[1];
+        asRules[i].width = pRule[2];
+        asRules[i].op = pRule[3];
+        asRules[i].a = rulesGetU32(&pRule[4]);
+        asRules[i].b = rulesGetU32(&pRule[8]);
+        memcpy(asRules[i].downlink, &pRule[12], STRUCTS_DECKEDREPLYPAYLOADSIZE);
+        if(asRules[i].op >= RULES_OP_COUNT)
+        {
+            return -3;
+        }
+        if(asRules[i].field == RULES_FIELD_MINUTE || asRules[i].field == RULES_FIELD_WEEKDAY)
+        {
+            continue;
+        }
+        if(asRules[i].width < 1 || asRules[i].width > 4 || asRules[i].field + asRules[i].width > STRUCTS_SENDCMDPAYLOADSIZE)
+        {
+            return -3;
+        }
+    }
+    return iRules;
+}
+
+bool rulesMatch(const tRule *pRule, const tCtrlSendCmd *pCmd, const struct tm *pTime)
+{
+    uint32_t uiValue = 0;
+
+    if(pRule->cmdCode != 0x00 && pRule->cmdCode != pCmd->cmdCode)
+    {
+        return false;
+    }
+    if(pRule->field == RULES_FIELD_MINUTE)
+    {
+        uiValue = pTime->tm_hour * 60 + pTime->tm_min;
+    }
+    else if(pRule->field == RULES_FIELD_WEEKDAY)
+    {
+        uiValue = pTime->tm_wday;
+    }
+    else
+    {
+        uiValue = structsGetPayloadField(pCmd->payload, pRule->field, pRule->width);
+    }
+    switch(pRule->op)
+    {
+        case RULES_OP_ANY:
+            return true;
+        case RULES_OP_EQ:
+            return (uiValue == pRule->a);
+        case RULES_OP_NE:
+            return (uiValue != pRule->a);
+        case RULES_OP_LT:
+            return (uiValue < pRule->a);
+        case RULES_OP_GE:
+            return (uiValue >= pRule->a);
+        case RULES_OP_IN:
+            return (uiValue >= pRule->a && uiValue <= pRule->b);
+        case RULES_OP_OUT:
+            return (uiValue < pRule->a || uiValue > pRule->b);
+        case RULES_OP_MASK:
+            return ((uiValue & pRule->a) == pRule->b);
+        default:
+            return false;
+    }
+}
+
+/************************ rulesStore ************************
+    Written next to RULES_PATH and renamed over it, a crash
+    leaves the old table or the new one.
+************************************************************/
+int rulesStore(const uint8_t *pTable, int iLength)
+{
+    char sTempPath[256];
+    int iFd;
+
+    snprintf(sTempPath, sizeof(sTempPath), "%s.tmp", RULES_PATH);
+    iFd = open(sTempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(iFd < 0)
+    {
+        printf("[WARNING] (%s) %s: Could not write %s, the table is lost at restart.\n", printTimestamp(), __func__, sTempPath);
+        return -1;
+    }
+    if(write(iFd, pTable, iLength) != iLength || fsync(iFd) < 0)
+    {
+        close(iFd);
+        unlink(sTempPath);
+        return -1;
+    }
+    close(iFd);
+    return rename(sTempPath, RULES_PATH);
+}
+
+uint32_t rulesGetU32(const uint8_t *pSource)
+{
+    return ((uint32_t)pSource[0] << 24) | ((uint32_t)pSource[1] << 16) | ((uint32_t)pSource[2] << 8) | pSource[3];
+}
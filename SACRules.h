@@ -0,0 +1,84 @@
+#ifndef SACRULES_H
+#define SACRULES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#ifndef RULES_PATH // -D in test builds
+#define RULES_PATH                  "/home/pi/iot/SACIot.rules"
+#endif
+#define RULES_ENABLED               0 // default of [rules] enabled
+#define RULES_MAXRULES              32
+#define RULES_MAXPENDING            16 // local answers waiting for the server's reply
+#define RULES_HEADER                "X-SAC-Rules:" // response header with a rule table
+#define RULES_RULESIZE              20
+#define RULES_TABLEMAXSIZE          (5 + RULES_MAXRULES * RULES_RULESIZE + 4)
+
+#define RULES_FIELD_MINUTE          0xF0 // minute of the day of the event, local time
+#define RULES_FIELD_WEEKDAY         0xF1 // day of the week of the event, 0: sunday
+
+/*
+    Local downlink rules: the slave answers a send command
+    with dl 0x01 from a rule table instead of waiting for
+    the server, the uplink goes out in the background.
+    The server hands out the table: with [rules] enabled
+    every request carries &rules=<version of the table
+    here>, a server with another version answers with
+    RULES_HEADER <table as hex>. The table is kept in
+    RULES_PATH across restarts.
+    Table, big endian:
+        version (4) | rule count (1) | rules | crc32 (4, zlib,
+        over everything before it)
+    Rule (RULES_RULESIZE bytes), the first that matches
+    answers:
+        cmdCode (0: any) | field | width (1..4) | op | a (4) |
+        b (4) | downlink (STRUCTS_DECKEDREPLYPAYLOADSIZE)
+    field is a payload offset (the value is width bytes
+    little endian from there, structsGetPayloadField(), the
+    same fields as the edge aggregation layout) or
+    RULES_FIELD_*. op is a tRulesOp.
+    The server's reply stays authoritative: it replaces the
+    decked reply as before and is compared with the local
+    answer. After a disagreement the table is not used
+    until the server sends another version.
+*/
+
+typedef enum
+{
+    RULES_OP_ANY, // always
+    RULES_OP_EQ, // v == a
+    RULES_OP_NE, // v != a
+    RULES_OP_LT, // v < a
+    RULES_OP_GE, // v >= a
+    RULES_OP_IN, // a <= v <= b
+    RULES_OP_OUT, // v < a or v > b
+    RULES_OP_MASK, // (v & a) == b
+    RULES_OP_COUNT,
+} tRulesOp;
+
+typedef struct
+{
+    uint32_t version; // 0: no table
+    uint32_t rules;
+    bool suspended; // disagreed with the server
+    uint64_t evaluated;
+    uint64_t answered; // a rule matched
+    uint64_t agreed; // the server's reply was the same
+    uint64_t disagreed;
+    uint64_t installed; // tables taken from the server
+    uint64_t rejected; // bad tables
+} tRulesStats;
+
+void rulesInit();
+bool rulesEvaluate(const tCtrlSendCmd *pCmd, long unsigned int ulTime, uint8_t *pDownlink);
+void rulesAnswered(int32_t iUplinkId, const uint8_t *pDownlink);
+void rulesUplinkResult(uint32_t uiUplinkId, int iResult, const uint8_t *pDownlink);
+uint32_t rulesPending();
+int rulesOffer(const char *sHexTable);
+int rulesInstall(const uint8_t *pTable, int iLength, bool bStore);
+uint32_t rulesVersion();
+const tRulesStats *rulesStats();
+void rulesLog();
+
+#endif
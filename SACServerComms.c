@@ -1,45 +1,775 @@
 #include "SACServerComms.h"
 #include "SACPrintUtils.h"
 #include "SACStructs.h"
+#include "SACTrace.h"
+#include "SACMqttClient.h"
+#include "SACCoapClient.h"
+#include "SACStateFile.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACStatusShm.h"
+#include "SACConfig.h"
+#include "SACEndpoints.h"
+#include "SACAsyncCmd.h"
+#include "SACUring.h"
+#include "SACLanGateway.h"
+#include "SACRules.h"
+#include "SACHistory.h"
 
 #include "string.h" /* memcpy, memset */
+#include <strings.h> /* strncasecmp */
 #include <stdlib.h> /* atoi */
 #include <sys/socket.h> /* socket, connect */
 #include <netinet/in.h> /* struct sockaddr_in, struct sockaddr */
+#include <netinet/tcp.h> /* TCP_FASTOPEN_CONNECT, TCP_INFO */
 #include <netdb.h> /* struct hostent, gethostbyname */
 #include <openssl/ssl.h> /* for https, if not installed: "sudo apt-get install libssl-dev" */
 #include <openssl/err.h>
 #include "stdio.h"
 #include "unistd.h"
+#include <errno.h>
+#include <sys/time.h> /* struct timeval */
+#include <fcntl.h> /* O_NONBLOCK */
+#include <limits.h> /* INT_MIN */
 
 #define UPSTREAMBUFFERSIZE      12
 #define DOWNSTREAMBUFFERSIZE    32
 #define MAXSERVERREPLYLINES     64
+#define HTTPWIREBUFSIZE         (HTTPMSGMAXSIZE + 1024) // [comms] io_uring: TLS records of a request as they go over the wire
+#define HTTPURING_NONE          INT_MIN // operation result: not submitted in this step
 
-#define ADDUSERREPLYINREQUEST   1 //1
-#define USERREPLYINREQUEST      "35291f03beefbabe"
+#if COMMS_MAXINFLIGHT * 4 > URING_MAXOPS
+#error "every exchange may have a connect, send, recv and its deadline in flight"
+#endif
+
+typedef enum
+{
+    HTTPX_FREE,
+    HTTPX_CONNECTING, // waiting for the non blocking connect
+    HTTPX_HANDSHAKE, // SSL_connect wants to read or write
+    HTTPX_WRITING,
+    HTTPX_READING,
+    HTTPX_OPEN, // pipelined connection, writes and reads interleave
+} tHttpExchangeState;
+
+/*
+    One non blocking request/response exchange, driven by the
+    reactor. Each has its own buffers so COMMS_MAXINFLIGHT of
+    them can be in flight, the shared msHttpRxMessage is only
+    used by the parser once the response is complete.
+*/
+typedef struct
+{
+    tHttpExchangeState eState;
+    int iSocketFd;
+    int iTimerFd; // bounds the whole exchange to the socket timeout
+    int iHedgeTimerFd; // -1: not hedged
+    int iEndpoint; // SACEndpoints.h handle, -1: no connection
+    uint32_t uiAttempts; // endpoints tried
+    uint64_t ulStartUs; // connect to this endpoint
+    bool bHedge; // the second copy of a slow request
+    void *pTwin; // tHttpExchange, the other copy while both are running
+    bool bUseSsl; // config at the start, a reload doesn't change running exchanges
+    SSL *sSSLConn;
+    tUplinkRecord sRecord;
+    tCommsDoneCallback pDone;
+    tCommsBulkCallback pBulkDone; // bulk upload instead of sRecord/pDone
+    uint32_t uiBulkStored;
+    char sTxMessage[HTTPMSGMAXSIZE];
+    int iTxLength;
+    int iTxDone;
+    char sRxMessage[HTTPMSGMAXSIZE];
+    int iRxLength;
+    /* [comms] io_uring, see httpUringOpen() */
+    bool bUring;
+    struct sockaddr_in sAddr; // read by the kernel when the connect runs
+    int iUringOps; // operations in flight, the exchange steps when the last one completed
+    int aiUringOps[3]; // their handles, cancelled at the deadline
+    int iUringTimeout; // handle of the deadline, -1: none
+    bool bTimedOut;
+    int iUringConnect; // results since the last step, HTTPURING_NONE: not submitted
+    int iUringSent;
+    int iUringReceived;
+    BIO *pRBio; // memory BIOs between OpenSSL and the ring, owned by sSSLConn
+    BIO *pWBio;
+    int iWireTxLength;
+    int iWireTxDone;
+    char sWireTx[HTTPWIREBUFSIZE];
+    char sWireRx[HTTPWIREBUFSIZE];
+} tHttpExchange;
+
+typedef struct
+{
+    tUplinkRecord sRecord;
+    tCommsDoneCallback pDone;
+    uint32_t uiSeqNr;
+    uint32_t uiReplays; // connections that broke while it was the head
+    char sTxMessage[HTTPMSGMAXSIZE]; // kept until the response, a replay sends the same bytes (same seqNr)
+    int iTxLength;
+} tHttpPipeSlot;
+
+/*
+    The kept alive connection for [comms] pipeline_depth > 0.
+    asSlots is a ring in request order: the first uiWritten
+    slots from uiHead are on the wire, the rest still wait
+    to be written. HTTP/1.1 answers in request order, so the
+    next complete response always belongs to the head.
+*/
+typedef struct
+{
+    tHttpExchangeState eState; // FREE: not connected
+    int iSocketFd;
+    int iTimerFd; // no progress for the socket timeout while requests are outstanding: connection broken
+    int iEndpoint; // SACEndpoints.h handle
+    bool bUseSsl;
+    SSL *sSSLConn;
+    tHttpPipeSlot asSlots[HTTPPIPE_MAXDEPTH];
+    uint32_t uiHead;
+    uint32_t uiCount;
+    uint32_t uiWritten;
+    int iTxDone; // bytes of the first unwritten slot already written
+    char sRxMessage[HTTPMSGMAXSIZE];
+    int iRxLength;
+} tHttpPipe;
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT    30 // older libc headers
+#endif
 
 /****************** private function prototypes *********************/
-int httpSocketInit();
+int httpSendUplink(tUplinkRecord *pRecord);
+int httpStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone);
+int httpStartBulk(tCommsBulkCallback pDone);
+tHttpExchange *httpExchangeAlloc();
+int httpExchangeConnect(tHttpExchange *pExchange);
+int httpExchangeOpen(tHttpExchange *pExchange, int iExclude);
+void httpExchangeClose(tHttpExchange *pExchange);
+void httpExchangeFailover(tHttpExchange *pExchange);
+void httpExchangeHedge(int iFd, uint32_t uiEvents, void *pContext);
+const tCommsTransport *commsConfiguredTransport();
+uint32_t commsMaxInFlight();
+bool commsCircuitAcquire();
+void commsCircuitRecordResult(bool bSuccess);
+void commsRecordUplinkResult(tUplinkRecord *pRecord, int iResult);
+void commsBulkFinished(int iResult, uint32_t uiStored, tCommsBulkCallback pDone);
+void httpBuildUplinkMsg(tUplinkRecord *pRecord);
+void httpBuildRequestMsgFor(uintptr_t I2CRxPayloadAddress, int I2CRxPayloadLength, long unsigned int ulEventTime, uint8_t bEncoding, const char *sDeviceId, uint32_t uiSeqNr, bool bRules);
+int httpSocketInit(int iExclude);
+int httpConnect(bool bUseSsl, SSL **ppSSLConn, bool *pEarlyDataSent);
+int httpTransfer(SSL *sSSLConn, bool bEarlyDataSent);
 int httpWriteMsgToSocket(int iSocketFd, SSL *sSSLConn);
 int httpReadRespFromSocket(int iSocketFd, SSL *sSSLConn);
+bool httpRespComplete(const char *sMessage, int iBytesReceived);
+void httpPrepareSession(SSL *sSSLConn);
+void httpKtlsCheck(SSL *sSSLConn);
+void httpDropSession();
+void httpExchangeCallback(int iFd, uint32_t uiEvents, void *pContext);
+void httpExchangeTimeout(int iFd, uint32_t uiEvents, void *pContext);
+void httpExchangeStep(tHttpExchange *pExchange);
+void httpExchangeFinish(tHttpExchange *pExchange, int iResult);
+void httpExchangeComplete(tHttpExchange *pExchange);
+bool httpUringReady();
+int httpUringOpen(tHttpExchange *pExchange, int iExclude);
+int httpUringSubmit(tHttpExchange *pExchange, bool bConnect);
+void httpUringConnectDone(int iResult, void *pContext);
+void httpUringSendDone(int iResult, void *pContext);
+void httpUringRecvDone(int iResult, void *pContext);
+void httpUringTimeoutDone(int iResult, void *pContext);
+void httpUringOpDone(tHttpExchange *pExchange);
+void httpUringStep(tHttpExchange *pExchange);
+int httpUringTls(tHttpExchange *pExchange);
+int httpPipeStart(tUplinkRecord *pRecord, tCommsDoneCallback pDone);
+int httpPipeConnect();
+void httpPipeCallback(int iFd, uint32_t uiEvents, void *pContext);
+void httpPipeTimeout(int iFd, uint32_t uiEvents, void *pContext);
+void httpPipeStep(tHttpPipe *pPipe);
+void httpPipeResponse(tHttpPipe *pPipe, int iLength);
+void httpPipeBroken(tHttpPipe *pPipe, const char *sReason);
+void httpPipeDisconnect(tHttpPipe *pPipe);
+void httpPipeFailAll(tHttpPipe *pPipe);
+void httpPipeReset();
+int httpRespLength(const char *sMessage, int iBytesReceived);
+const char *httpFindHeader(const char *sMessage, const char *sName);
+bool httpServerCloses(const char *sMessage);
 int httpParseReplyMsg(char *sRawMessage);
+int httpBuildBulkMsg(const uint8_t *pBody, int iLength, uint32_t uiRecords);
+int httpParseBulkReply(const char *sMessage, uint32_t *pStored);
+int sslNewSessionCallback(SSL *sSSLConn, SSL_SESSION *pSession);
 /********************************************************************/
 
 /******************** private global variables **********************/
-char *msHttpHost;
-int miHttpPortNo;
 //char *msHttpMsgFmt;
-struct hostent *msHttpServer;
 struct sockaddr_in msHttpServerAddr;
 int miHttpSocketFd;
 char msHttpTxMessage[HTTPMSGMAXSIZE] = {0x00};
+static int miHttpTxLength = 0; // the bulk upload body is binary, strlen() doesn't do
 char msHttpRxMessage[HTTPMSGMAXSIZE] = {0x00};
 SSL_CTX *sSSLContext;
 uint32_t muiSeqNr = 0;
+static tCircuitState meCircuitState = CB_CLOSED;
+static uint32_t muiCircuitFailures = 0; // consecutive failures
+static uint32_t muiCircuitBackoffMs = 0; // current open period
+static uint64_t mulCircuitRetryAtUs = 0; // monotonic time at which the breaker goes half open
+static bool mbCircuitTrialInFlight = false; // half open: the one trial request has been sent, the rest waits for its result
+static unsigned int muiCircuitJitterSeed = 0;
+static uint64_t mulCommsTxBytes = 0;
+static uint64_t mulCommsRxBytes = 0;
+static const tCommsTransport sHttpTransport =
+{
+    .name = "http",
+    .init = NULL,
+    .sendUplink = httpSendUplink,
+    .poll = NULL,
+    .close = NULL,
+    .startUplink = httpStartUplink,
+};
+static const tCommsTransport *mpCommsTransport = &sHttpTransport;
+static SSL_SESSION *mpSSLSession = NULL; // last session ticket from the server, for resumption
+static uint64_t mulCommsStartUs = 0;
+static bool mbCommsFirstUplinkDone = false;
+static bool mbHttpEarlyDataAllowed = false; // current request may be replayed by the network
+static uint32_t muiCommsInFlight = 0;
+static uint64_t mulCommsDeadlineUs = 0; // monotonic, blocking sends give up by then, 0: none
+static tHttpExchange masHttpExchanges[COMMS_MAXINFLIGHT];
+static tHttpPipe msHttpPipe = {.eState = HTTPX_FREE, .iSocketFd = -1, .iTimerFd = -1, .iEndpoint = -1};
+static uint32_t muiHttpPipeReplays = 0;
+static tHttpKtlsStats msHttpKtlsStats = {0};
+static int miHttpKtlsLastState = -1; // bit 0 tx, bit 1 rx offloaded on the last connection, -1: none yet
+static uint32_t *mpHttpBulkStored = NULL; // set while httpSendRequest() sends a bulk upload
+static struct iovec masHttpUringBuffers[COMMS_MAXINFLIGHT * 4]; // registered with the ring: the exchange buffers
+static bool mbHttpUringFailed = false; // no io_uring here, the exchanges stay on epoll
+static uint8_t mabCommsOwnDownlink[STRUCTS_DECKEDREPLYPAYLOADSIZE]; // last downlink to this device, forwarded uplinks (SACLanGateway.h) overwrite the decked reply
 /********************************************************************/
 
 
+/********************* commsInit ****************************
+    Selects the uplink transport ([comms] transport) and
+    initializes it. sslInit() must be called first.
+    Restores the warm restart state (sequence number, TLS
+    session, last downlink) when stateFileOpen() found one.
+    A pipelined connection of an earlier init is closed, it
+    was opened for another depth.
+************************************************************/
+int commsInit()
+{
+    const uint8_t *pSessionDer;
+    uint32_t uiSessionLength;
+
+    httpPipeReset();
+    mulCommsStartUs = printGetMonotonicTimeUs();
+    muiSeqNr = stateFileGetSeqNr();
+    uiSessionLength = stateFileGetTlsSession(&pSessionDer);
+    if(uiSessionLength > 0)
+    {
+        mpSSLSession = d2i_SSL_SESSION(NULL, &pSessionDer, uiSessionLength);
+    }
+    stateFileGetLastDownlink(getCtrlDeckedReply()->payload);
+    memcpy(mabCommsOwnDownlink, getCtrlDeckedReply()->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    printf("[INFO] (%s) %s: Starting at seqNr %u, %s TLS session to resume.\n", printTimestamp(), __func__, muiSeqNr, (mpSSLSession != NULL) ? "with a" : "without");
+    mpCommsTransport = commsConfiguredTransport();
+    printf("[INFO] (%s) %s: Using uplink transport \'%s\'.\n", printTimestamp(), __func__, mpCommsTransport->name);
+    endpointsLoad(configGet());
+    if(mpCommsTransport->init != NULL)
+    {
+        return mpCommsTransport->init();
+    }
+    return 0;
+}
+
+/********************* commsSendUplink **********************
+    Sends one uplink record over the selected transport and
+    leaves the server's downlink (if any) in the decked reply
+    payload.
+    Returns -2 without touching the network while the
+    circuit breaker is open.
+************************************************************/
+int commsSendUplink(tUplinkRecord *pRecord)
+{
+    int iResult;
+    if(!commsCircuitAcquire())
+    {
+        printf("[WARNING] (%s) %s: Circuit breaker open, not sending uplink. Next trial in %llu ms.\n", printTimestamp(), __func__, (unsigned long long)((mulCircuitRetryAtUs - printGetMonotonicTimeUs()) / 1000));
+        return -2;
+    }
+    pRecord->sendStartUs = printGetMonotonicTimeUs();
+    iResult = mpCommsTransport->sendUplink(pRecord);
+    commsRecordUplinkResult(pRecord, iResult);
+    return iResult;
+}
+
+/********************* commsStartUplink *********************
+    Non blocking variant of commsSendUplink for the reactor.
+    Returns 0 when the send was started, pDone is then
+    called exactly once with the result. Returns < 0 when
+    it could not start (-2: circuit breaker open, -3: too
+    many in flight, -1: error), pDone is not called and the
+    record is still the caller's.
+    Transports without startUplink send right away.
+************************************************************/
+int commsStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone)
+{
+    int iResult;
+    if(!commsCircuitAllowsRequest())
+    {
+        return -2;
+    }
+    if(muiCommsInFlight >= commsMaxInFlight())
+    {
+        return -3;
+    }
+    commsCircuitAcquire();
+    muiCommsInFlight += 1;
+    pRecord->sendStartUs = printGetMonotonicTimeUs();
+    if(mpCommsTransport->startUplink == NULL)
+    {
+        iResult = mpCommsTransport->sendUplink(pRecord);
+        commsUplinkFinished(pRecord, iResult, pDone);
+        return 0;
+    }
+    iResult = mpCommsTransport->startUplink(pRecord, pDone);
+    if(iResult < 0)
+    {
+        muiCommsInFlight -= 1;
+        commsRecordUplinkResult(pRecord, iResult);
+        return -1;
+    }
+    return 0;
+}
+
+bool commsCanStartUplink()
+{
+    return (muiCommsInFlight < commsMaxInFlight() && commsCircuitAllowsRequest());
+}
+
+/*************** commsCanStartBackgroundUplink **************
+    Like commsCanStartUplink but keeps the last exchange
+    free for an alarm or the record the controller waits
+    on, background sends stop at commsMaxInFlight() - 1.
+************************************************************/
+bool commsCanStartBackgroundUplink()
+{
+    uint32_t uiMax = commsMaxInFlight();
+    if(uiMax > 1)
+    {
+        uiMax -= 1;
+    }
+    return (muiCommsInFlight < uiMax && commsCircuitAllowsRequest());
+}
+
+/********************* commsMaxInFlight *********************
+    One connection per uplink: COMMS_MAXINFLIGHT exchanges.
+    Pipelined http: the configured depth on one connection.
+************************************************************/
+uint32_t commsMaxInFlight()
+{
+    if(mpCommsTransport == &sHttpTransport && configGet()->pipelineDepth > 0)
+    {
+        return configGet()->pipelineDepth;
+    }
+    return COMMS_MAXINFLIGHT;
+}
+
+/********************* commsSetDeadline *********************
+    Blocking sends give up at ulDeadlineUs (monotonic), the
+    exit path sends its last summary under one. 0 lifts it.
+************************************************************/
+void commsSetDeadline(uint64_t ulDeadlineUs)
+{
+    mulCommsDeadlineUs = ulDeadlineUs;
+}
+
+/********************** commsTimeoutMs **********************
+    uiTimeoutMs, or what is left until the deadline when
+    that comes first. At least 1 ms, a 0 socket timeout
+    would wait forever.
+************************************************************/
+uint32_t commsTimeoutMs(uint32_t uiTimeoutMs)
+{
+    uint64_t ulNowUs;
+    if(mulCommsDeadlineUs == 0)
+    {
+        return uiTimeoutMs;
+    }
+    ulNowUs = printGetMonotonicTimeUs();
+    if(ulNowUs + 1000 >= mulCommsDeadlineUs)
+    {
+        return 1;
+    }
+    if((mulCommsDeadlineUs - ulNowUs) / 1000 < uiTimeoutMs)
+    {
+        return (uint32_t)((mulCommsDeadlineUs - ulNowUs) / 1000);
+    }
+    return uiTimeoutMs;
+}
+
+/******************* commsUplinkFinished ********************
+    Called by the transports when a started uplink is done.
+************************************************************/
+void commsUplinkFinished(tUplinkRecord *pRecord, int iResult, tCommsDoneCallback pDone)
+{
+    muiCommsInFlight -= 1;
+    commsRecordUplinkResult(pRecord, iResult);
+    pDone(pRecord, iResult);
+    if(pRecord->origin[0] != 0x00)
+    {
+        memcpy(getCtrlDeckedReply()->payload, mabCommsOwnDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE); // the controller reads this device's downlink
+    }
+}
+
+/***************** commsRecordUplinkResult ******************
+    Bookkeeping after every uplink, blocking or not. An
+    uplink forwarded for a LAN gateway slave only counts for
+    the circuit breaker and the status.
+************************************************************/
+void commsRecordUplinkResult(tUplinkRecord *pRecord, int iResult)
+{
+    commsCircuitRecordResult(iResult >= 0);
+    statusShmUplinkResult(iResult >= 0, (uint32_t)((printGetMonotonicTimeUs() - pRecord->sendStartUs) / 1000));
+    if(pRecord->origin[0] != 0x00)
+    {
+        return;
+    }
+    asyncCmdUplinkResult(pRecord->id, iResult, getCtrlDeckedReply()->payload);
+    rulesUplinkResult(pRecord->id, iResult, getCtrlDeckedReply()->payload);
+    historyAppend(pRecord, iResult, getCtrlDeckedReply()->payload, 0);
+    if(iResult >= 0)
+    {
+        memcpy(mabCommsOwnDownlink, getCtrlDeckedReply()->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+        stateFileSetLastDownlink(getCtrlDeckedReply()->payload);
+        if(!mbCommsFirstUplinkDone)
+        {
+            mbCommsFirstUplinkDone = true;
+            printf("[INFO] (%s) %s: First uplink done %llu ms after startup.\n", printTimestamp(), __func__, (unsigned long long)((printGetMonotonicTimeUs() - mulCommsStartUs) / 1000));
+        }
+    }
+    stateFileCommit();
+}
+
+/********************* commsCanBulk *************************
+    Bulk uploads (SACBulkUpload.h) are a http POST, the
+    persistent transports send record by record.
+************************************************************/
+bool commsCanBulk()
+{
+    return (mpCommsTransport == &sHttpTransport);
+}
+
+/********************* commsSendBulk ************************
+    Sends a compressed block of uiRecords records and returns
+    the number of them the server stored in *pStored.
+    Blocking like commsSendUplink, same return values.
+************************************************************/
+int commsSendBulk(const uint8_t *pBody, int iLength, uint32_t uiRecords, uint32_t *pStored)
+{
+    int iResult;
+    if(!commsCircuitAllowsRequest())
+    {
+        return -2;
+    }
+    if(!commsCanBulk() || httpBuildBulkMsg(pBody, iLength, uiRecords) < 0)
+    {
+        return -1;
+    }
+    commsCircuitAcquire();
+    mpHttpBulkStored = pStored;
+    iResult = httpSendRequest();
+    mpHttpBulkStored = NULL;
+    commsCircuitRecordResult(iResult >= 0);
+    return iResult;
+}
+
+/********************* commsStartBulk ***********************
+    Non blocking variant of commsSendBulk, same contract as
+    commsStartUplink. The block occupies one of the
+    in flight slots and always gets a connection of its own,
+    also with [comms] pipeline_depth.
+************************************************************/
+int commsStartBulk(const uint8_t *pBody, int iLength, uint32_t uiRecords, tCommsBulkCallback pDone)
+{
+    if(!commsCircuitAllowsRequest())
+    {
+        return -2;
+    }
+    if(muiCommsInFlight >= commsMaxInFlight())
+    {
+        return -3;
+    }
+    if(!commsCanBulk() || httpBuildBulkMsg(pBody, iLength, uiRecords) < 0)
+    {
+        return -1;
+    }
+    commsCircuitAcquire();
+    muiCommsInFlight += 1;
+    if(httpStartBulk(pDone) < 0)
+    {
+        muiCommsInFlight -= 1;
+        commsCircuitRecordResult(false);
+        return -1;
+    }
+    return 0;
+}
+
+void commsBulkFinished(int iResult, uint32_t uiStored, tCommsBulkCallback pDone)
+{
+    muiCommsInFlight -= 1;
+    commsCircuitRecordResult(iResult >= 0);
+    pDone(iResult, uiStored);
+}
+
+/*********************** commsPoll **************************
+    Services persistent transports (keep alive, unsolicited
+    downlinks). Cheap, call it from the idle loop.
+************************************************************/
+void commsPoll()
+{
+    if(mpCommsTransport != NULL && mpCommsTransport->poll != NULL)
+    {
+        mpCommsTransport->poll();
+    }
+}
+
+void commsClose()
+{
+    if(mpCommsTransport != NULL && mpCommsTransport->close != NULL)
+    {
+        mpCommsTransport->close();
+    }
+}
+
+void commsSetTransport(const tCommsTransport *pTransport)
+{
+    commsClose();
+    mpCommsTransport = pTransport;
+    if(mpCommsTransport->init != NULL)
+    {
+        mpCommsTransport->init();
+    }
+}
+
+/********************* commsApplyConfig *********************
+    Called after a config reload with its CONFIG_CHANGED_*
+    flags. Persistent transports reconnect only when the
+    endpoint changed, the http backend connects per request
+    and only forgets the old server's TLS session and
+    addresses and takes the new endpoint list. A new
+    pipeline depth closes the pipelined connection. Path,
+    user reply and timeouts are read per request and need
+    nothing here.
+************************************************************/
+void commsApplyConfig(uint32_t uiChanged)
+{
+    if(uiChanged & CONFIG_CHANGED_TRANSPORT)
+    {
+        printf("[INFO] (%s) %s: Transport changed, switching from '%s' to '%s'.\n", printTimestamp(), __func__, mpCommsTransport->name, commsConfiguredTransport()->name);
+        httpPipeReset();
+        httpDropSession();
+        stateFileInvalidateAddresses();
+        endpointsLoad(configGet());
+        commsSetTransport(commsConfiguredTransport());
+        return;
+    }
+    if(uiChanged & CONFIG_CHANGED_ENDPOINT)
+    {
+        printf("[INFO] (%s) %s: Endpoint changed, reconnecting '%s' to %s.\n", printTimestamp(), __func__, mpCommsTransport->name, configGet()->host);
+        httpPipeReset(); // unanswered requests go back to the caller, they are built again for the new endpoint
+        httpDropSession();
+        stateFileInvalidateAddresses();
+        endpointsLoad(configGet());
+        commsSetTransport(mpCommsTransport);
+        return;
+    }
+    if(uiChanged & CONFIG_CHANGED_PIPELINE)
+    {
+        printf("[INFO] (%s) %s: Pipeline depth changed to %u, closing the pipelined connection.\n", printTimestamp(), __func__, configGet()->pipelineDepth);
+        httpPipeReset(); // unanswered requests go back to the caller
+    }
+}
+
+const tCommsTransport *commsConfiguredTransport()
+{
+    switch(configGet()->transport)
+    {
+        case COMMS_TRANSPORT_MQTT:
+            return &sMqttTransport;
+        case COMMS_TRANSPORT_COAP:
+            return &sCoapTransport;
+        case COMMS_TRANSPORT_LAN:
+            return &sLanTransport;
+        default:
+            return &sHttpTransport;
+    }
+}
+
+const char *commsGetTransportName()
+{
+    return mpCommsTransport->name;
+}
+
+uint32_t commsNextSeqNr()
+{
+    return commsReserveSeqNrs(1);
+}
+
+/********************* commsRecordSeqNr *********************
+    Sequence number for an uplink of this device, also kept
+    in the record for the history (SACHistory.h). hasSeqNr
+    stays as it is, a retry gets a new number.
+************************************************************/
+uint32_t commsRecordSeqNr(tUplinkRecord *pRecord)
+{
+    uint32_t uiSeqNr = commsNextSeqNr();
+    if(pRecord->hasSeqNr == 0)
+    {
+        pRecord->seqNr = uiSeqNr;
+    }
+    return uiSeqNr;
+}
+
+/******************* commsReserveSeqNrs *********************
+    uiCount consecutive sequence numbers with one state file
+    commit, returns the first one.
+************************************************************/
+uint32_t commsReserveSeqNrs(uint32_t uiCount)
+{
+    uint32_t uiSeqNr = muiSeqNr;
+    muiSeqNr += uiCount;
+    stateFileSetSeqNr(muiSeqNr);
+    stateFileCommit(); // before the uplink goes out, a crash must never make us reuse this number
+    return uiSeqNr;
+}
+
+/******************** commsEncodingName *********************
+    Label of a tUplinkEncoding on the wire, the transports
+    leave it out for UPLENC_RAW so plain uplinks look like
+    they always did.
+************************************************************/
+const char *commsEncodingName(uint8_t bEncoding)
+{
+    static const char *asNames[UPLENC_COUNT] = {"raw", "keyframe", "delta"};
+    return (bEncoding < UPLENC_COUNT) ? asNames[bEncoding] : "raw";
+}
+
+/****************** commsAddByteCounts **********************
+    Application level bytes (without TLS/TCP overhead) per
+    transport, to compare the cost per uplink.
+************************************************************/
+void commsAddByteCounts(uint32_t uiTxBytes, uint32_t uiRxBytes)
+{
+    mulCommsTxBytes += uiTxBytes;
+    mulCommsRxBytes += uiRxBytes;
+}
+
+void commsGetByteCounts(uint64_t *pTxBytes, uint64_t *pRxBytes)
+{
+    *pTxBytes = mulCommsTxBytes;
+    *pRxBytes = mulCommsRxBytes;
+}
+
+/****************** commsCircuitAllowsRequest ****************
+    Closed: go ahead. Open: only when the backoff period has
+    elapsed, the breaker then goes half open and the next
+    request decides. Half open: only while that one trial
+    has not been sent. Doesn't take the trial, the send
+    functions do that with commsCircuitAcquire().
+************************************************************/
+bool commsCircuitAllowsRequest()
+{
+    if(meCircuitState == CB_OPEN)
+    {
+        if(printGetMonotonicTimeUs() < mulCircuitRetryAtUs)
+        {
+            return false;
+        }
+        meCircuitState = CB_HALFOPEN;
+        mbCircuitTrialInFlight = false;
+        printf("[INFO] (%s) %s: Circuit breaker half open, allowing a trial request.\n", printTimestamp(), __func__);
+    }
+    return (meCircuitState != CB_HALFOPEN || !mbCircuitTrialInFlight);
+}
+
+/********************* commsCircuitAcquire *******************
+    commsCircuitAllowsRequest() for a request that is sent
+    right after: half open it becomes the trial and every
+    other request is refused until commsCircuitRecordResult().
+************************************************************/
+bool commsCircuitAcquire()
+{
+    if(!commsCircuitAllowsRequest())
+    {
+        return false;
+    }
+    if(meCircuitState == CB_HALFOPEN)
+    {
+        mbCircuitTrialInFlight = true;
+    }
+    return true;
+}
+
+tCircuitState commsGetCircuitState()
+{
+    return meCircuitState;
+}
+
+/****************** commsCircuitRecordResult *****************
+    Exponential backoff with jitter: the open period doubles
+    after every failed trial, a random part of up to half the
+    period is added so a fleet of slaves doesn't retry in
+    lockstep after a server outage.
+************************************************************/
+void commsCircuitRecordResult(bool bSuccess)
+{
+    mbCircuitTrialInFlight = false;
+    if(bSuccess)
+    {
+        if(meCircuitState != CB_CLOSED)
+        {
+            printf("[INFO] (%s) %s: Server reachable again, circuit breaker closed.\n", printTimestamp(), __func__);
+        }
+        meCircuitState = CB_CLOSED;
+        muiCircuitFailures = 0;
+        muiCircuitBackoffMs = 0;
+        return;
+    }
+    
+    muiCircuitFailures += 1;
+    if(meCircuitState == CB_HALFOPEN || muiCircuitFailures >= CB_FAILURETHRESHOLD)
+    {
+        if(muiCircuitBackoffMs == 0)
+        {
+            muiCircuitBackoffMs = CB_BACKOFFMINMS;
+        }
+        else if(meCircuitState == CB_HALFOPEN)
+        {
+            muiCircuitBackoffMs *= 2;
+            if(muiCircuitBackoffMs > CB_BACKOFFMAXMS)
+            {
+                muiCircuitBackoffMs = CB_BACKOFFMAXMS;
+            }
+        }
+        if(muiCircuitJitterSeed == 0)
+        {
+            muiCircuitJitterSeed = (unsigned int)printGetMonotonicTimeUs() ^ (unsigned int)getpid();
+        }
+        uint32_t uiJitterMs = (uint32_t)rand_r(&muiCircuitJitterSeed) % (muiCircuitBackoffMs / 2 + 1);
+        mulCircuitRetryAtUs = printGetMonotonicTimeUs() + ((uint64_t)(muiCircuitBackoffMs + uiJitterMs) * 1000ULL);
+        meCircuitState = CB_OPEN;
+        printf("[WARNING] (%s) %s: %u consecutive failures, circuit breaker open for %u ms.\n", printTimestamp(), __func__, muiCircuitFailures, muiCircuitBackoffMs + uiJitterMs);
+    }
+}
+
+/********************** httpSendUplink **********************
+    Transport send function of the http webhook backend.
+************************************************************/
+int httpSendUplink(tUplinkRecord *pRecord)
+{
+    int iResult;
+    httpBuildUplinkMsg(pRecord);
+    mbHttpEarlyDataAllowed = (pRecord->priorityClass == UPLCLASS_TELEMETRY);
+    iResult = httpSendRequest();
+    mbHttpEarlyDataAllowed = false;
+    return iResult;
+}
+
 /************** int httpSendRequest() *********************
     Sends a http request stored in
     msHttpTxMessage[HTTPMSGMAXSIZE] and sebsequently
@@ -48,131 +778,1548 @@ uint32_t muiSeqNr = 0;
     
     Also parses the reply message payload into the global
     sCtrlDeckedReply payload field.  
+    
+    An endpoint without a connection is taken out of the
+    rotation and the request goes to the next one right away
+    (SACEndpoints.h).
 ************************************************************/
 int httpSendRequest()
 {
-    /* initialize the socket */
-    httpSocketInit();
-    
-    /* connect the socket */
+    bool bUseSsl = configGet()->useSsl;
+    SSL *sSSLConn = NULL;
+    bool bEarlyDataSent = false;
+    int iEndpoint = -1;
+    int iAttempt;
+    uint64_t ulStartUs = 0;
+    int iResult;
+
+    for(iAttempt=0; iEndpoint < 0 && iAttempt < endpointsCount(); iAttempt+=1)
+    {
+        iEndpoint = httpSocketInit(-1);
+        if(iEndpoint < 0)
+        {
+            continue;
+        }
+        ulStartUs = printGetMonotonicTimeUs();
+        if(httpConnect(bUseSsl, &sSSLConn, &bEarlyDataSent) < 0)
+        {
+            endpointsConnectFailed(iEndpoint);
+            iEndpoint = -1;
+        }
+    }
+    if(iEndpoint < 0)
+    {
+        return -1;
+    }
+    iResult = httpTransfer(sSSLConn, bEarlyDataSent);
+    endpointsRecordResult(iEndpoint, iResult, printGetMonotonicTimeUs() - ulStartUs);
+    return iResult;
+}
+
+/************************ httpConnect ***********************
+    Connects the socket httpSocketInit() prepared and does
+    the TLS handshake. The socket is closed on failure.
+    With HTTPUSEEARLYDATA the request is written before the
+    handshake completes when the resumed session allows it.
+    If the server rejects the early data, OpenSSL drops it
+    and httpTransfer() writes the request again.
+************************************************************/
+int httpConnect(bool bUseSsl, SSL **ppSSLConn, bool *pEarlyDataSent)
+{
+    SSL *sSSLConn = NULL;
+    bool bEarlyDataSent = false;
     int iResult;
+
+    *ppSSLConn = NULL;
+    *pEarlyDataSent = false;
+    TRACE_BEGIN("connect");
     iResult = connect(miHttpSocketFd, (struct sockaddr *)&msHttpServerAddr, sizeof(msHttpServerAddr));
+    TRACE_END("connect");
     if (iResult < 0)
     {
         int iErrsv = errno;
         printf("[ERROR] (%s) %s: Could not connect to socket 0x%x. Socket connect error code %i.\n", printTimestamp(), __func__, miHttpSocketFd, iErrsv);
-        return -1;
-    }
-    
-    #if USESSL == 1
-    // create an SSL connection and attach it to the socket
-    SSL *sSSLConn = SSL_new(sSSLContext);
-    SSL_set_fd(sSSLConn, miHttpSocketFd);
-    ERR_clear_error(); // clear error queue
-    iResult = SSL_connect(sSSLConn);
-    if (iResult != 1)
-    {
-        int iErrsv = SSL_get_error(sSSLConn, iResult);
-        printf("[ERROR] (%s) %s: Could not create SSL connection. Error code %i. Return Code %i.\n\t%s\n", printTimestamp(), __func__, iErrsv, iResult, ERR_error_string(ERR_get_error(), NULL));
         close(miHttpSocketFd);
         return -1;
     }
-    #endif
     
-    #if USESSL == 1
-        /* send the request via SSL */
-        iResult = httpWriteMsgToSocket(0, sSSLConn);
-        if (iResult < 0)
+    if(bUseSsl)
+    {
+        // create an SSL connection and attach it to the socket
+        sSSLConn = SSL_new(sSSLContext);
+        if(sSSLConn == NULL)
+        {
+            printf("[ERROR] (%s) %s: Could not create SSL connection object.\n", printTimestamp(), __func__); // memory budget exhausted (SACMemPool.h)
+            close(miHttpSocketFd);
+            return -1;
+        }
+        SSL_set_fd(sSSLConn, miHttpSocketFd);
+        httpPrepareSession(sSSLConn);
+        ERR_clear_error(); // clear error queue
+        #if HTTPUSEEARLYDATA == 1
+        size_t uiRequestLength = miHttpTxLength;
+        if(mbHttpEarlyDataAllowed && mpSSLSession != NULL && SSL_SESSION_get_max_early_data(mpSSLSession) >= uiRequestLength)
+        {
+            size_t uiWritten = 0;
+            TRACE_BEGIN("earlyData");
+            iResult = SSL_write_early_data(sSSLConn, msHttpTxMessage, uiRequestLength, &uiWritten);
+            TRACE_END("earlyData");
+            bEarlyDataSent = (iResult == 1 && uiWritten == uiRequestLength);
+            if(bEarlyDataSent)
+            {
+                commsAddByteCounts(uiWritten, 0);
+            }
+        }
+        #endif
+        TRACE_BEGIN("tlsHandshake");
+        iResult = SSL_connect(sSSLConn);
+        TRACE_END("tlsHandshake");
+        if (iResult != 1)
+        {
+            int iErrsv = SSL_get_error(sSSLConn, iResult);
+            printf("[ERROR] (%s) %s: Could not create SSL connection. Error code %i. Return Code %i.\n\t%s\n", printTimestamp(), __func__, iErrsv, iResult, ERR_error_string(ERR_get_error(), NULL));
+            close(miHttpSocketFd);
+            SSL_free(sSSLConn);
+            httpDropSession(); // don't offer a possibly stale session again
+            return -1;
+        }
+        httpKtlsCheck(sSSLConn);
+        if(mpSSLSession != NULL)
+        {
+            printf("[INFO] (%s) %s: TLS session %s.\n", printTimestamp(), __func__, SSL_session_reused(sSSLConn) ? "resumed" : "not resumed, full handshake");
+        }
+        if(bEarlyDataSent)
+        {
+            bEarlyDataSent = (SSL_get_early_data_status(sSSLConn) == SSL_EARLY_DATA_ACCEPTED);
+            printf("[INFO] (%s) %s: Early data %s.\n", printTimestamp(), __func__, bEarlyDataSent ? "accepted" : "rejected, resending the request");
+        }
+    }
+    
+    #if HTTPUSETCPFASTOPEN == 1
+    struct tcp_info sTcpInfo;
+    socklen_t uiTcpInfoLength = sizeof(sTcpInfo);
+    if(getsockopt(miHttpSocketFd, IPPROTO_TCP, TCP_INFO, &sTcpInfo, &uiTcpInfoLength) == 0)
+    {
+        printf("[INFO] (%s) %s: TCP fast open %s.\n", printTimestamp(), __func__, (sTcpInfo.tcpi_options & TCPI_OPT_SYN_DATA) ? "data in SYN acked" : "not used");
+    }
+    #endif
+    *ppSSLConn = sSSLConn;
+    *pEarlyDataSent = bEarlyDataSent;
+    return 0;
+}
+
+/*********************** httpTransfer ***********************
+    Writes the request on the connected socket, reads and
+    parses the response and closes the connection.
+************************************************************/
+int httpTransfer(SSL *sSSLConn, bool bEarlyDataSent)
+{
+    int iResult;
+
+    if(sSSLConn != NULL)
+    {
+        /* send the request via SSL, unless it already went out as accepted early data */
+        iResult = bEarlyDataSent ? 0 : httpWriteMsgToSocket(0, sSSLConn);
+        if (iResult < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not write to SSL socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
+            close(miHttpSocketFd);
+            SSL_shutdown(sSSLConn);
+            SSL_free(sSSLConn);
+            return -1;
+        }
+        /* receive the response via SSL */
+        iResult = httpReadRespFromSocket(0, sSSLConn);
+        if (iResult < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not read from SSL socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
+            close(miHttpSocketFd);
+            SSL_shutdown(sSSLConn);
+            SSL_free(sSSLConn);
+            return -1;
+        }
+        SSL_shutdown(sSSLConn);
+        SSL_free(sSSLConn);
+    }
+    else
+    {
+        /* send the request */
+        iResult = httpWriteMsgToSocket(miHttpSocketFd, NULL);
+        if (iResult < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not write to socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
+            close(miHttpSocketFd);
+            return -1;
+        }
+        /* receive the response */
+        iResult = httpReadRespFromSocket(miHttpSocketFd, NULL);
+        if (iResult < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not read from socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
+            close(miHttpSocketFd);
+            return -1;
+        }
+    }
+    
+    TRACE_BEGIN("parse");
+    iResult = (mpHttpBulkStored != NULL) ? httpParseBulkReply(msHttpRxMessage, mpHttpBulkStored) : httpParseReplyMsg(msHttpRxMessage);
+    TRACE_END("parse");
+    if (iResult < 0)
+    {
+        printf("[ERROR] (%s) %s: Failed to parse the server\'s reply message. Return Code = %i.\n", printTimestamp(), __func__, iResult);
+        close(miHttpSocketFd);
+        return -1;
+    }
+    
+    close(miHttpSocketFd);
+    return 0;
+}
+
+
+/******************** httpStartUplink ***********************
+    Transport start function of the http webhook backend:
+    the same request as httpSendUplink, but connect, TLS
+    handshake, write and read are driven by the reactor.
+    Name resolution still blocks when the address is not
+    cached. Early data is only used by the blocking path.
+    With [comms] pipeline_depth the request is queued on the
+    kept alive connection instead.
+************************************************************/
+int httpStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone)
+{
+    tHttpExchange *pExchange;
+
+    if(configGet()->pipelineDepth > 0)
+    {
+        return httpPipeStart(pRecord, pDone);
+    }
+    pExchange = httpExchangeAlloc();
+    if(pExchange == NULL)
+    {
+        return -1;
+    }
+    httpBuildUplinkMsg(pRecord);
+    memcpy(&pExchange->sRecord, pRecord, sizeof(tUplinkRecord));
+    pExchange->pDone = pDone;
+    pExchange->pBulkDone = NULL;
+    return httpExchangeConnect(pExchange);
+}
+
+/********************* httpStartBulk ************************
+    Sends the bulk upload httpBuildBulkMsg() left in
+    msHttpTxMessage over an exchange of its own.
+************************************************************/
+int httpStartBulk(tCommsBulkCallback pDone)
+{
+    tHttpExchange *pExchange = httpExchangeAlloc();
+    if(pExchange == NULL)
+    {
+        return -1;
+    }
+    memset(&pExchange->sRecord, 0, sizeof(tUplinkRecord));
+    pExchange->pDone = NULL;
+    pExchange->pBulkDone = pDone;
+    pExchange->uiBulkStored = 0;
+    return httpExchangeConnect(pExchange);
+}
+
+tHttpExchange *httpExchangeAlloc()
+{
+    int i;
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        if(masHttpExchanges[i].eState == HTTPX_FREE)
+        {
+            masHttpExchanges[i].iHedgeTimerFd = -1;
+            masHttpExchanges[i].iEndpoint = -1;
+            masHttpExchanges[i].uiAttempts = 0;
+            masHttpExchanges[i].bHedge = false;
+            masHttpExchanges[i].pTwin = NULL;
+            masHttpExchanges[i].bUring = false;
+            masHttpExchanges[i].iUringTimeout = -1;
+            return &masHttpExchanges[i];
+        }
+    }
+    return NULL;
+}
+
+/****************** httpExchangeConnect *********************
+    Takes the request in msHttpTxMessage and starts the non
+    blocking connect, the reactor does the rest.
+************************************************************/
+int httpExchangeConnect(tHttpExchange *pExchange)
+{
+    memcpy(pExchange->sTxMessage, msHttpTxMessage, miHttpTxLength);
+    pExchange->iTxLength = miHttpTxLength;
+    pExchange->bUseSsl = configGet()->useSsl;
+    pExchange->bUring = httpUringReady();
+    return httpExchangeOpen(pExchange, -1);
+}
+
+/******************** httpExchangeOpen **********************
+    Non blocking connect to the next endpoint (never
+    iExclude), an endpoint that refuses at once is skipped.
+    Uplinks get a hedge timer when their endpoint has a
+    latency percentile to go by.
+************************************************************/
+int httpExchangeOpen(tHttpExchange *pExchange, int iExclude)
+{
+    uint32_t uiHedgeMs;
+    int iResult;
+
+    pExchange->iTxDone = 0;
+    pExchange->iRxLength = 0;
+    memset(pExchange->sRxMessage, 0, sizeof(pExchange->sRxMessage));
+    pExchange->sSSLConn = NULL;
+    pExchange->iSocketFd = -1;
+    pExchange->iTimerFd = -1;
+    pExchange->iHedgeTimerFd = -1;
+    if(pExchange->bUring)
+    {
+        return httpUringOpen(pExchange, iExclude);
+    }
+    while(1)
+    {
+        if(pExchange->uiAttempts >= (uint32_t)endpointsCount())
+        {
+            return -1;
+        }
+        pExchange->uiAttempts += 1;
+        pExchange->iEndpoint = httpSocketInit(iExclude);
+        if(pExchange->iEndpoint < 0)
+        {
+            continue;
+        }
+        pExchange->iSocketFd = miHttpSocketFd;
+        pExchange->ulStartUs = printGetMonotonicTimeUs();
+        fcntl(pExchange->iSocketFd, F_SETFL, fcntl(pExchange->iSocketFd, F_GETFL, 0) | O_NONBLOCK);
+        iResult = connect(pExchange->iSocketFd, (struct sockaddr *)&msHttpServerAddr, sizeof(msHttpServerAddr));
+        if(iResult == 0 || errno == EINPROGRESS)
+        {
+            break;
+        }
+        printf("[ERROR] (%s) %s: Could not connect to socket 0x%x. Socket connect error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, errno);
+        close(pExchange->iSocketFd);
+        pExchange->iSocketFd = -1;
+        endpointsConnectFailed(pExchange->iEndpoint);
+        pExchange->iEndpoint = -1;
+    }
+    pExchange->iTimerFd = reactorTimerCreate(httpExchangeTimeout, pExchange);
+    if(pExchange->iTimerFd < 0 || reactorAddFd(pExchange->iSocketFd, EPOLLOUT, httpExchangeCallback, pExchange) < 0)
+    {
+        httpExchangeClose(pExchange);
+        return -1;
+    }
+    reactorTimerArm(pExchange->iTimerFd, configGet()->socketTimeoutSec * 1000, 0);
+    uiHedgeMs = (pExchange->bHedge || pExchange->pBulkDone != NULL) ? 0 : endpointsHedgeDelayMs(pExchange->iEndpoint);
+    if(uiHedgeMs > 0)
+    {
+        pExchange->iHedgeTimerFd = reactorTimerCreate(httpExchangeHedge, pExchange);
+        if(pExchange->iHedgeTimerFd >= 0)
+        {
+            reactorTimerArm(pExchange->iHedgeTimerFd, uiHedgeMs, 0);
+        }
+    }
+    pExchange->eState = HTTPX_CONNECTING;
+    return 0;
+}
+
+/******************** httpExchangeHedge *********************
+    The request is slower than the hedge percentile of its
+    endpoint: the same bytes go to another endpoint as well
+    if an in flight slot is free. The first answer wins
+    (httpExchangeFinish).
+************************************************************/
+void httpExchangeHedge(int iFd, uint32_t uiEvents, void *pContext)
+{
+    tHttpExchange *pExchange = (tHttpExchange *)pContext;
+    tHttpExchange *pTwin;
+
+    if(pExchange->eState == HTTPX_FREE || pExchange->pTwin != NULL || muiCommsInFlight >= commsMaxInFlight())
+    {
+        return;
+    }
+    pTwin = httpExchangeAlloc();
+    if(pTwin == NULL)
+    {
+        return;
+    }
+    memcpy(pTwin->sTxMessage, pExchange->sTxMessage, pExchange->iTxLength);
+    pTwin->iTxLength = pExchange->iTxLength;
+    pTwin->bUseSsl = pExchange->bUseSsl;
+    memcpy(&pTwin->sRecord, &pExchange->sRecord, sizeof(tUplinkRecord));
+    pTwin->pDone = pExchange->pDone;
+    pTwin->pBulkDone = NULL;
+    pTwin->bHedge = true;
+    if(httpExchangeOpen(pTwin, pExchange->iEndpoint) < 0)
+    {
+        return;
+    }
+    printf("[INFO] (%s) %s: No answer from %s after %llu ms, ", printTimestamp(), __func__, endpointsName(pExchange->iEndpoint), (unsigned long long)((printGetMonotonicTimeUs() - pExchange->ulStartUs) / 1000));
+    printf("hedging to %s.\n", endpointsName(pTwin->iEndpoint));
+    pTwin->pTwin = pExchange;
+    pExchange->pTwin = pTwin;
+    muiCommsInFlight += 1;
+}
+
+void httpExchangeCallback(int iFd, uint32_t uiEvents, void *pContext)
+{
+    httpExchangeStep((tHttpExchange *)pContext);
+}
+
+void httpExchangeTimeout(int iFd, uint32_t uiEvents, void *pContext)
+{
+    tHttpExchange *pExchange = (tHttpExchange *)pContext;
+    printf("[ERROR] (%s) %s: Exchange on socket 0x%x timed out in state %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, pExchange->eState);
+    httpExchangeFinish(pExchange, -1);
+}
+
+/******************* httpExchangeStep ***********************
+    Advances the exchange as far as the socket allows and
+    then waits for the next readiness event. Spurious
+    wake ups just end in another EAGAIN / SSL_ERROR_WANT_*.
+************************************************************/
+void httpExchangeStep(tHttpExchange *pExchange)
+{
+    int iResult;
+    int iError;
+    socklen_t uiLength;
+
+    while(1)
+    {
+        switch(pExchange->eState)
+        {
+            case HTTPX_CONNECTING:
+                iError = 0;
+                uiLength = sizeof(iError);
+                getsockopt(pExchange->iSocketFd, SOL_SOCKET, SO_ERROR, &iError, &uiLength);
+                if(iError == EINPROGRESS)
+                {
+                    return;
+                }
+                if(iError != 0)
+                {
+                    printf("[ERROR] (%s) %s: Could not connect to socket 0x%x. Socket connect error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, iError);
+                    httpExchangeFailover(pExchange);
+                    return;
+                }
+                if(pExchange->bUseSsl)
+                {
+                    pExchange->sSSLConn = SSL_new(sSSLContext);
+                    if(pExchange->sSSLConn == NULL)
+                    {
+                        printf("[ERROR] (%s) %s: Could not create SSL connection object.\n", printTimestamp(), __func__);
+                        httpExchangeFinish(pExchange, -1); // not the endpoint's fault, no failover
+                        return;
+                    }
+                    SSL_set_fd(pExchange->sSSLConn, pExchange->iSocketFd);
+                    httpPrepareSession(pExchange->sSSLConn);
+                    pExchange->eState = HTTPX_HANDSHAKE;
+                }
+                else
+                {
+                    pExchange->eState = HTTPX_WRITING;
+                }
+                break;
+
+            case HTTPX_HANDSHAKE:
+                ERR_clear_error();
+                iResult = SSL_connect(pExchange->sSSLConn);
+                if(iResult != 1)
+                {
+                    iError = SSL_get_error(pExchange->sSSLConn, iResult);
+                    if(iError == SSL_ERROR_WANT_READ || iError == SSL_ERROR_WANT_WRITE)
+                    {
+                        reactorModFd(pExchange->iSocketFd, (iError == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT);
+                        return;
+                    }
+                    printf("[ERROR] (%s) %s: Could not create SSL connection. Error code %i. Return Code %i.\n\t%s\n", printTimestamp(), __func__, iError, iResult, ERR_error_string(ERR_get_error(), NULL));
+                    httpDropSession();
+                    httpExchangeFailover(pExchange);
+                    return;
+                }
+                httpKtlsCheck(pExchange->sSSLConn);
+                pExchange->eState = HTTPX_WRITING;
+                break;
+
+            case HTTPX_WRITING:
+                if(pExchange->sSSLConn != NULL)
+                {
+                    iResult = SSL_write(pExchange->sSSLConn, &pExchange->sTxMessage[pExchange->iTxDone], pExchange->iTxLength - pExchange->iTxDone);
+                    iError = (iResult > 0) ? SSL_ERROR_NONE : SSL_get_error(pExchange->sSSLConn, iResult);
+                }
+                else
+                {
+                    iResult = write(pExchange->iSocketFd, &pExchange->sTxMessage[pExchange->iTxDone], pExchange->iTxLength - pExchange->iTxDone);
+                    iError = (iResult > 0) ? SSL_ERROR_NONE : ((errno == EAGAIN) ? SSL_ERROR_WANT_WRITE : SSL_ERROR_SYSCALL);
+                }
+                if(iError == SSL_ERROR_WANT_READ || iError == SSL_ERROR_WANT_WRITE)
+                {
+                    reactorModFd(pExchange->iSocketFd, (iError == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT);
+                    return;
+                }
+                if(iError != SSL_ERROR_NONE)
+                {
+                    printf("[ERROR] (%s) %s: Could not write to socket 0x%x. Error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, iError);
+                    httpExchangeFinish(pExchange, -1);
+                    return;
+                }
+                pExchange->iTxDone += iResult;
+                if(pExchange->iTxDone == pExchange->iTxLength)
+                {
+                    commsAddByteCounts(pExchange->iTxLength, 0);
+                    pExchange->eState = HTTPX_READING;
+                }
+                break;
+
+            case HTTPX_READING:
+                if(pExchange->sSSLConn != NULL)
+                {
+                    iResult = SSL_read(pExchange->sSSLConn, &pExchange->sRxMessage[pExchange->iRxLength], sizeof(pExchange->sRxMessage) - 1 - pExchange->iRxLength);
+                    iError = (iResult > 0) ? SSL_ERROR_NONE : SSL_get_error(pExchange->sSSLConn, iResult);
+                }
+                else
+                {
+                    iResult = read(pExchange->iSocketFd, &pExchange->sRxMessage[pExchange->iRxLength], sizeof(pExchange->sRxMessage) - 1 - pExchange->iRxLength);
+                    iError = (iResult > 0) ? SSL_ERROR_NONE : ((iResult == 0) ? SSL_ERROR_ZERO_RETURN : ((errno == EAGAIN) ? SSL_ERROR_WANT_READ : SSL_ERROR_SYSCALL));
+                }
+                if(iError == SSL_ERROR_WANT_READ || iError == SSL_ERROR_WANT_WRITE)
+                {
+                    reactorModFd(pExchange->iSocketFd, (iError == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT);
+                    return;
+                }
+                if(iError == SSL_ERROR_NONE)
+                {
+                    pExchange->iRxLength += iResult;
+                    pExchange->sRxMessage[pExchange->iRxLength] = 0x00;
+                    if(pExchange->iRxLength == sizeof(pExchange->sRxMessage) - 1)
+                    {
+                        printf("[ERROR] (%s) %s: Receive buffer ran out of space. Max. number of bytes: %i.\n", printTimestamp(), __func__, HTTPMSGMAXSIZE);
+                        httpExchangeFinish(pExchange, -1);
+                        return;
+                    }
+                    if(!httpRespComplete(pExchange->sRxMessage, pExchange->iRxLength))
+                    {
+                        break;
+                    }
+                }
+                else if(iError != SSL_ERROR_ZERO_RETURN && !(iError == SSL_ERROR_SYSCALL && pExchange->iRxLength > 0))
+                {
+                    printf("[ERROR] (%s) %s: Could not read from socket 0x%x. Error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, iError);
+                    httpExchangeFinish(pExchange, -1);
+                    return;
+                }
+                // complete response or the server closed the connection
+                httpExchangeComplete(pExchange);
+                return;
+
+            default:
+                return;
+        }
+    }
+}
+
+/***************** httpExchangeComplete *********************
+    The response is in sRxMessage: parse it and finish.
+************************************************************/
+void httpExchangeComplete(tHttpExchange *pExchange)
+{
+    int iResult;
+
+    commsAddByteCounts(0, pExchange->iRxLength);
+    if(pExchange->pBulkDone != NULL)
+    {
+        iResult = httpParseBulkReply(pExchange->sRxMessage, &pExchange->uiBulkStored);
+    }
+    else
+    {
+        memcpy(msHttpRxMessage, pExchange->sRxMessage, sizeof(msHttpRxMessage));
+        iResult = httpParseReplyMsg(msHttpRxMessage);
+    }
+    if(iResult < 0)
+    {
+        printf("[ERROR] (%s) %s: Failed to parse the server\'s reply message. Return Code = %i.\n", printTimestamp(), __func__, iResult);
+    }
+    httpExchangeFinish(pExchange, (iResult < 0) ? -1 : 0);
+}
+
+/****************** httpExchangeFinish **********************
+    Releases the exchange before reporting, the callback may
+    start the next uplink in the same slot. Of a hedged pair
+    the first answer is reported and the other exchange
+    closed, its elapsed time counts as a latency sample (a
+    lower bound). A failure is only reported when the other
+    exchange failed as well.
+************************************************************/
+void httpExchangeFinish(tHttpExchange *pExchange, int iResult)
+{
+    tHttpExchange *pTwin = (tHttpExchange *)pExchange->pTwin;
+    uint64_t ulNowUs = printGetMonotonicTimeUs();
+    tUplinkRecord sRecord;
+
+    endpointsRecordResult(pExchange->iEndpoint, iResult, ulNowUs - pExchange->ulStartUs);
+    httpExchangeClose(pExchange);
+    if(pExchange->bHedge)
+    {
+        endpointsHedged(pExchange->iEndpoint, iResult >= 0);
+    }
+    if(pTwin != NULL)
+    {
+        pTwin->pTwin = NULL;
+        pExchange->pTwin = NULL;
+        muiCommsInFlight -= 1; // the pair held two slots
+        if(iResult < 0)
+        {
+            return; // the other one is still running
+        }
+        endpointsRecordResult(pTwin->iEndpoint, 0, ulNowUs - pTwin->ulStartUs);
+        if(pTwin->bHedge)
+        {
+            endpointsHedged(pTwin->iEndpoint, false);
+        }
+        httpExchangeClose(pTwin);
+    }
+    if(pExchange->pBulkDone != NULL)
+    {
+        commsBulkFinished(iResult, pExchange->uiBulkStored, pExchange->pBulkDone);
+        return;
+    }
+    memcpy(&sRecord, &pExchange->sRecord, sizeof(tUplinkRecord));
+    commsUplinkFinished(&sRecord, iResult, pExchange->pDone);
+}
+
+/******************* httpExchangeClose **********************
+    Connection and timers of the exchange, the slot is free
+    afterwards. Safe to call twice.
+************************************************************/
+void httpExchangeClose(tHttpExchange *pExchange)
+{
+    if(pExchange->iSocketFd >= 0 && !pExchange->bUring)
+    {
+        reactorDelFd(pExchange->iSocketFd);
+    }
+    if(pExchange->iUringTimeout >= 0)
+    {
+        uringCancel(pExchange->iUringTimeout);
+        uringDetach(pExchange->iUringTimeout);
+        pExchange->iUringTimeout = -1;
+    }
+    if(pExchange->iTimerFd >= 0)
+    {
+        reactorTimerClose(pExchange->iTimerFd);
+    }
+    if(pExchange->iHedgeTimerFd >= 0)
+    {
+        reactorTimerClose(pExchange->iHedgeTimerFd);
+    }
+    if(pExchange->sSSLConn != NULL)
+    {
+        SSL_shutdown(pExchange->sSSLConn);
+        SSL_free(pExchange->sSSLConn); // memory BIOs included
+        pExchange->sSSLConn = NULL;
+    }
+    pExchange->pRBio = NULL;
+    pExchange->pWBio = NULL;
+    if(pExchange->iSocketFd >= 0)
+    {
+        close(pExchange->iSocketFd);
+    }
+    pExchange->iSocketFd = -1;
+    pExchange->iTimerFd = -1;
+    pExchange->iHedgeTimerFd = -1;
+    pExchange->eState = HTTPX_FREE;
+}
+
+/****************** httpExchangeFailover ********************
+    No connection: the endpoint goes out of the rotation and
+    the request to the next one, until every endpoint was
+    tried once.
+************************************************************/
+void httpExchangeFailover(tHttpExchange *pExchange)
+{
+    int iFailed = pExchange->iEndpoint;
+
+    endpointsConnectFailed(iFailed);
+    pExchange->iEndpoint = -1; // counted, httpExchangeFinish() must not count it again
+    httpExchangeClose(pExchange);
+    if(httpExchangeOpen(pExchange, iFailed) == 0)
+    {
+        printf("[WARNING] (%s) %s: Failing over to %s.\n", printTimestamp(), __func__, endpointsName(pExchange->iEndpoint));
+        return;
+    }
+    httpExchangeFinish(pExchange, -1);
+}
+
+/******************** httpUringReady ************************
+    [comms] io_uring: the reactor exchanges (a connection
+    per request and the bulk uploads) run on the ring, the
+    ring is set up the first time it is asked for. The
+    pipelined connection and hedging stay on epoll. Without
+    io_uring in the kernel everything stays on epoll, that
+    is logged once.
+************************************************************/
+bool httpUringReady()
+{
+    int i;
+
+    if(!configGet()->ioUring || mbHttpUringFailed)
+    {
+        return false;
+    }
+    if(uringReady())
+    {
+        return true;
+    }
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        masHttpUringBuffers[i * 4 + 0] = (struct iovec){masHttpExchanges[i].sTxMessage, sizeof(masHttpExchanges[i].sTxMessage)};
+        masHttpUringBuffers[i * 4 + 1] = (struct iovec){masHttpExchanges[i].sRxMessage, sizeof(masHttpExchanges[i].sRxMessage)};
+        masHttpUringBuffers[i * 4 + 2] = (struct iovec){masHttpExchanges[i].sWireTx, sizeof(masHttpExchanges[i].sWireTx)};
+        masHttpUringBuffers[i * 4 + 3] = (struct iovec){masHttpExchanges[i].sWireRx, sizeof(masHttpExchanges[i].sWireRx)};
+    }
+    if(uringInit(masHttpUringBuffers, COMMS_MAXINFLIGHT * 4) < 0)
+    {
+        printf("[WARNING] (%s) %s: Uplinks stay on epoll.\n", printTimestamp(), __func__);
+        mbHttpUringFailed = true;
+        return false;
+    }
+    return true;
+}
+
+/******************** httpUringOpen *************************
+    io_uring variant of httpExchangeOpen(). Connect, the
+    request (TLS: the ClientHello, OpenSSL works on memory
+    BIOs) and the read of the answer are linked and go to
+    the kernel together with whatever else this pass of the
+    loop queued. The exchange steps when all of them
+    completed (httpUringStep), a deadline of the socket
+    timeout cancels what is still waiting. A socket that
+    doesn't connect fails over like on epoll.
+************************************************************/
+int httpUringOpen(tHttpExchange *pExchange, int iExclude)
+{
+    do
+    {
+        if(pExchange->uiAttempts >= (uint32_t)endpointsCount())
+        {
+            return -1;
+        }
+        pExchange->uiAttempts += 1;
+        pExchange->iEndpoint = httpSocketInit(iExclude);
+    } while(pExchange->iEndpoint < 0);
+    pExchange->iSocketFd = miHttpSocketFd;
+    memcpy(&pExchange->sAddr, &msHttpServerAddr, sizeof(pExchange->sAddr));
+    pExchange->ulStartUs = printGetMonotonicTimeUs();
+    pExchange->bTimedOut = false;
+    pExchange->iUringOps = 0;
+    pExchange->iWireTxLength = 0;
+    pExchange->iWireTxDone = 0;
+    pExchange->pRBio = NULL;
+    pExchange->pWBio = NULL;
+    if(pExchange->bUseSsl)
+    {
+        pExchange->sSSLConn = SSL_new(sSSLContext);
+        pExchange->pRBio = BIO_new(BIO_s_mem());
+        pExchange->pWBio = BIO_new(BIO_s_mem());
+        if(pExchange->sSSLConn == NULL || pExchange->pRBio == NULL || pExchange->pWBio == NULL)
+        {
+            printf("[ERROR] (%s) %s: Could not create SSL connection object.\n", printTimestamp(), __func__); // memory budget exhausted (SACMemPool.h)
+            BIO_free(pExchange->pRBio);
+            BIO_free(pExchange->pWBio);
+            httpExchangeClose(pExchange);
+            return -1;
+        }
+        BIO_set_mem_eof_return(pExchange->pRBio, -1); // empty is "want read", not the end of the stream
+        SSL_set_bio(pExchange->sSSLConn, pExchange->pRBio, pExchange->pWBio);
+        SSL_set_connect_state(pExchange->sSSLConn);
+        httpPrepareSession(pExchange->sSSLConn);
+        pExchange->eState = HTTPX_HANDSHAKE;
+        if(httpUringTls(pExchange) < 0) // the ClientHello
+        {
+            httpExchangeClose(pExchange);
+            return -1;
+        }
+    }
+    else
+    {
+        pExchange->eState = HTTPX_WRITING;
+    }
+    pExchange->iUringTimeout = uringTimeout(configGet()->socketTimeoutSec * 1000, httpUringTimeoutDone, pExchange);
+    if(pExchange->iUringTimeout < 0 || httpUringSubmit(pExchange, true) < 0)
+    {
+        httpExchangeClose(pExchange);
+        return -1;
+    }
+    return 0;
+}
+
+/******************* httpUringSubmit ************************
+    Queues the next operations of the exchange: the connect
+    when asked, what there is to send (the request, TLS: the
+    records OpenSSL left in the write BIO), linked to a read
+    of the answer once everything is sent.
+************************************************************/
+int httpUringSubmit(tHttpExchange *pExchange, bool bConnect)
+{
+    const char *pTx = NULL;
+    int iTxLength = 0;
+    bool bRecv = true;
+    int iOps = 0;
+
+    if(pExchange->sSSLConn != NULL)
+    {
+        if(pExchange->iWireTxDone == pExchange->iWireTxLength)
+        {
+            pExchange->iWireTxLength = BIO_read(pExchange->pWBio, pExchange->sWireTx, sizeof(pExchange->sWireTx));
+            pExchange->iWireTxLength = (pExchange->iWireTxLength > 0) ? pExchange->iWireTxLength : 0;
+            pExchange->iWireTxDone = 0;
+        }
+        pTx = &pExchange->sWireTx[pExchange->iWireTxDone];
+        iTxLength = pExchange->iWireTxLength - pExchange->iWireTxDone;
+        bRecv = (BIO_ctrl_pending(pExchange->pWBio) == 0); // more records than fit: send first
+    }
+    else if(pExchange->iTxDone < pExchange->iTxLength)
+    {
+        pTx = &pExchange->sTxMessage[pExchange->iTxDone];
+        iTxLength = pExchange->iTxLength - pExchange->iTxDone;
+    }
+    pExchange->iUringConnect = HTTPURING_NONE;
+    pExchange->iUringSent = HTTPURING_NONE;
+    pExchange->iUringReceived = HTTPURING_NONE;
+    pExchange->aiUringOps[0] = -1;
+    pExchange->aiUringOps[1] = -1;
+    pExchange->aiUringOps[2] = -1;
+    if(bConnect)
+    {
+        pExchange->aiUringOps[iOps++] = uringConnect(pExchange->iSocketFd, (struct sockaddr *)&pExchange->sAddr, sizeof(pExchange->sAddr), (iTxLength > 0 || bRecv), httpUringConnectDone, pExchange);
+    }
+    if(iTxLength > 0)
+    {
+        pExchange->aiUringOps[iOps++] = uringSend(pExchange->iSocketFd, pTx, iTxLength, bRecv, httpUringSendDone, pExchange);
+    }
+    if(bRecv)
+    {
+        if(pExchange->sSSLConn != NULL)
+        {
+            pExchange->aiUringOps[iOps++] = uringRecv(pExchange->iSocketFd, pExchange->sWireRx, sizeof(pExchange->sWireRx), false, httpUringRecvDone, pExchange);
+        }
+        else
+        {
+            pExchange->aiUringOps[iOps++] = uringRecv(pExchange->iSocketFd, &pExchange->sRxMessage[pExchange->iRxLength], sizeof(pExchange->sRxMessage) - 1 - pExchange->iRxLength, false, httpUringRecvDone, pExchange);
+        }
+    }
+    pExchange->iUringOps = iOps; // slots can't run out, see URING_MAXOPS
+    return 0;
+}
+
+void httpUringConnectDone(int iResult, void *pContext)
+{
+    ((tHttpExchange *)pContext)->iUringConnect = iResult;
+    httpUringOpDone((tHttpExchange *)pContext);
+}
+
+void httpUringSendDone(int iResult, void *pContext)
+{
+    ((tHttpExchange *)pContext)->iUringSent = iResult;
+    httpUringOpDone((tHttpExchange *)pContext);
+}
+
+void httpUringRecvDone(int iResult, void *pContext)
+{
+    ((tHttpExchange *)pContext)->iUringReceived = iResult;
+    httpUringOpDone((tHttpExchange *)pContext);
+}
+
+void httpUringOpDone(tHttpExchange *pExchange)
+{
+    pExchange->iUringOps -= 1;
+    if(pExchange->iUringOps == 0)
+    {
+        httpUringStep(pExchange);
+    }
+}
+
+/***************** httpUringTimeoutDone *********************
+    The deadline passed: what is still in flight is
+    cancelled, the exchange fails when the last of it
+    completed.
+************************************************************/
+void httpUringTimeoutDone(int iResult, void *pContext)
+{
+    tHttpExchange *pExchange = (tHttpExchange *)pContext;
+    int i;
+
+    pExchange->iUringTimeout = -1;
+    if(iResult != -ETIME)
+    {
+        return;
+    }
+    pExchange->bTimedOut = true;
+    for(i=0; i<3; i+=1)
+    {
+        if(pExchange->aiUringOps[i] >= 0)
+        {
+            uringCancel(pExchange->aiUringOps[i]);
+        }
+    }
+}
+
+/******************** httpUringStep *************************
+    All operations of the last submission completed: take
+    their results, let OpenSSL work on what arrived and
+    submit the next ones, or finish. A recv completing with
+    -ECANCELED is the rest of a chain a short write broke,
+    the remaining bytes are sent again first.
+************************************************************/
+void httpUringStep(tHttpExchange *pExchange)
+{
+    int iResult;
+
+    if(pExchange->bTimedOut)
+    {
+        printf("[ERROR] (%s) %s: Exchange on socket 0x%x timed out in state %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, pExchange->eState);
+        httpExchangeFinish(pExchange, -1);
+        return;
+    }
+    if(pExchange->iUringConnect != HTTPURING_NONE && pExchange->iUringConnect < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not connect to socket 0x%x. Socket connect error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, -pExchange->iUringConnect);
+        httpExchangeFailover(pExchange);
+        return;
+    }
+    if(pExchange->iUringSent != HTTPURING_NONE)
+    {
+        if(pExchange->iUringSent < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not write to socket 0x%x. Error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, -pExchange->iUringSent);
+            httpExchangeFinish(pExchange, -1);
+            return;
+        }
+        if(pExchange->sSSLConn != NULL)
+        {
+            pExchange->iWireTxDone += pExchange->iUringSent;
+        }
+        else
+        {
+            pExchange->iTxDone += pExchange->iUringSent;
+            if(pExchange->iTxDone == pExchange->iTxLength)
+            {
+                commsAddByteCounts(pExchange->iTxLength, 0);
+                pExchange->eState = HTTPX_READING;
+            }
+        }
+    }
+    if(pExchange->iUringReceived != HTTPURING_NONE && pExchange->iUringReceived != -ECANCELED)
+    {
+        if(pExchange->iUringReceived < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not read from socket 0x%x. Error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, -pExchange->iUringReceived);
+            httpExchangeFinish(pExchange, -1);
+            return;
+        }
+        if(pExchange->iUringReceived == 0)
+        {
+            if(pExchange->iRxLength > 0)
+            {
+                httpExchangeComplete(pExchange); // the server closed the connection after the response
+                return;
+            }
+            printf("[ERROR] (%s) %s: Connection on socket 0x%x closed by the server without a response.\n", printTimestamp(), __func__, pExchange->iSocketFd);
+            httpExchangeFinish(pExchange, -1);
+            return;
+        }
+        if(pExchange->sSSLConn != NULL)
+        {
+            BIO_write(pExchange->pRBio, pExchange->sWireRx, pExchange->iUringReceived);
+        }
+        else
+        {
+            pExchange->iRxLength += pExchange->iUringReceived;
+            pExchange->sRxMessage[pExchange->iRxLength] = 0x00;
+            if(httpRespComplete(pExchange->sRxMessage, pExchange->iRxLength))
+            {
+                httpExchangeComplete(pExchange);
+                return;
+            }
+            if(pExchange->iRxLength == sizeof(pExchange->sRxMessage) - 1)
+            {
+                printf("[ERROR] (%s) %s: Receive buffer ran out of space. Max. number of bytes: %i.\n", printTimestamp(), __func__, HTTPMSGMAXSIZE);
+                httpExchangeFinish(pExchange, -1);
+                return;
+            }
+        }
+    }
+    if(pExchange->sSSLConn != NULL && pExchange->iWireTxDone == pExchange->iWireTxLength)
+    {
+        iResult = httpUringTls(pExchange);
+        if(iResult == -2)
+        {
+            httpExchangeFailover(pExchange);
+            return;
+        }
+        if(iResult != 0)
+        {
+            (iResult > 0) ? httpExchangeComplete(pExchange) : httpExchangeFinish(pExchange, -1);
+            return;
+        }
+    }
+    httpUringSubmit(pExchange, false);
+}
+
+/********************* httpUringTls *************************
+    Runs OpenSSL on what the read BIO holds: the handshake,
+    then the request goes into the write BIO, then the
+    response is read. Returns 0 when it needs more from the
+    server, 1 when the response is complete, -1 on failure,
+    -2 when the handshake failed (fail over).
+************************************************************/
+int httpUringTls(tHttpExchange *pExchange)
+{
+    int iResult;
+    int iError;
+
+    if(pExchange->eState == HTTPX_HANDSHAKE)
+    {
+        ERR_clear_error();
+        iResult = SSL_connect(pExchange->sSSLConn);
+        if(iResult != 1)
+        {
+            iError = SSL_get_error(pExchange->sSSLConn, iResult);
+            if(iError == SSL_ERROR_WANT_READ)
+            {
+                return 0;
+            }
+            printf("[ERROR] (%s) %s: Could not create SSL connection. Error code %i. Return Code %i.\n\t%s\n", printTimestamp(), __func__, iError, iResult, ERR_error_string(ERR_get_error(), NULL));
+            httpDropSession();
+            return -2;
+        }
+        httpKtlsCheck(pExchange->sSSLConn); // memory BIOs: always user space
+        pExchange->eState = HTTPX_WRITING;
+    }
+    if(pExchange->eState == HTTPX_WRITING)
+    {
+        iResult = SSL_write(pExchange->sSSLConn, pExchange->sTxMessage, pExchange->iTxLength); // the write BIO takes all of it
+        if(iResult != pExchange->iTxLength)
+        {
+            printf("[ERROR] (%s) %s: Could not write to socket 0x%x. Error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, SSL_get_error(pExchange->sSSLConn, iResult));
+            return -1;
+        }
+        pExchange->iTxDone = pExchange->iTxLength;
+        commsAddByteCounts(pExchange->iTxLength, 0);
+        pExchange->eState = HTTPX_READING;
+    }
+    while(1)
+    {
+        iResult = SSL_read(pExchange->sSSLConn, &pExchange->sRxMessage[pExchange->iRxLength], sizeof(pExchange->sRxMessage) - 1 - pExchange->iRxLength);
+        if(iResult > 0)
+        {
+            pExchange->iRxLength += iResult;
+            pExchange->sRxMessage[pExchange->iRxLength] = 0x00;
+            if(httpRespComplete(pExchange->sRxMessage, pExchange->iRxLength))
+            {
+                return 1;
+            }
+            if(pExchange->iRxLength == sizeof(pExchange->sRxMessage) - 1)
+            {
+                printf("[ERROR] (%s) %s: Receive buffer ran out of space. Max. number of bytes: %i.\n", printTimestamp(), __func__, HTTPMSGMAXSIZE);
+                return -1;
+            }
+            continue;
+        }
+        iError = SSL_get_error(pExchange->sSSLConn, iResult);
+        if(iError == SSL_ERROR_WANT_READ)
+        {
+            return 0;
+        }
+        if(iError == SSL_ERROR_ZERO_RETURN && pExchange->iRxLength > 0)
+        {
+            return 1;
+        }
+        printf("[ERROR] (%s) %s: Could not read from socket 0x%x. Error code %i.\n", printTimestamp(), __func__, pExchange->iSocketFd, iError);
+        return -1;
+    }
+}
+
+/********************* httpPipeStart ************************
+    Queues the request on the kept alive connection and
+    connects when there is none. The write happens from the
+    loop, so the done callback never runs inside this call.
+************************************************************/
+int httpPipeStart(tUplinkRecord *pRecord, tCommsDoneCallback pDone)
+{
+    tHttpPipe *pPipe = &msHttpPipe;
+    tHttpPipeSlot *pSlot;
+
+    if(pPipe->uiCount >= HTTPPIPE_MAXDEPTH)
+    {
+        return -1;
+    }
+    pSlot = &pPipe->asSlots[(pPipe->uiHead + pPipe->uiCount) % HTTPPIPE_MAXDEPTH];
+    httpBuildUplinkMsg(pRecord);
+    pSlot->iTxLength = strlen(msHttpTxMessage);
+    memcpy(pSlot->sTxMessage, msHttpTxMessage, pSlot->iTxLength + 1);
+    pSlot->uiSeqNr = getLastServerRequest()->seqNr;
+    pSlot->uiReplays = 0;
+    memcpy(&pSlot->sRecord, pRecord, sizeof(tUplinkRecord));
+    pSlot->pDone = pDone;
+    pPipe->uiCount += 1;
+
+    if(pPipe->eState == HTTPX_FREE)
+    {
+        if(httpPipeConnect() < 0)
+        {
+            pPipe->uiCount -= 1; // still the caller's
+            return -1;
+        }
+        return 0;
+    }
+    if(pPipe->uiCount == 1)
+    {
+        reactorTimerArm(pPipe->iTimerFd, configGet()->socketTimeoutSec * 1000, 0);
+    }
+    if(pPipe->eState == HTTPX_OPEN)
+    {
+        reactorModFd(pPipe->iSocketFd, EPOLLIN | EPOLLOUT);
+    }
+    return 0;
+}
+
+/******************** httpPipeConnect ***********************
+    Non blocking connect, everything queued is written once
+    the connection (and TLS) is up. An endpoint that refuses
+    at once is skipped.
+************************************************************/
+int httpPipeConnect()
+{
+    tHttpPipe *pPipe = &msHttpPipe;
+    int iAttempt;
+    int iResult = -1;
+
+    pPipe->bUseSsl = configGet()->useSsl;
+    pPipe->sSSLConn = NULL;
+    pPipe->uiWritten = 0;
+    pPipe->iTxDone = 0;
+    pPipe->iRxLength = 0;
+    pPipe->sRxMessage[0] = 0x00;
+    for(iAttempt=0; iResult < 0 && iAttempt < endpointsCount(); iAttempt+=1)
+    {
+        pPipe->iEndpoint = httpSocketInit(-1);
+        if(pPipe->iEndpoint < 0)
+        {
+            continue;
+        }
+        pPipe->iSocketFd = miHttpSocketFd;
+        fcntl(pPipe->iSocketFd, F_SETFL, fcntl(pPipe->iSocketFd, F_GETFL, 0) | O_NONBLOCK);
+        iResult = connect(pPipe->iSocketFd, (struct sockaddr *)&msHttpServerAddr, sizeof(msHttpServerAddr));
+        if(iResult < 0 && errno == EINPROGRESS)
+        {
+            iResult = 0;
+        }
+        else if(iResult < 0)
+        {
+            printf("[ERROR] (%s) %s: Could not connect to socket 0x%x. Socket connect error code %i.\n", printTimestamp(), __func__, pPipe->iSocketFd, errno);
+            close(pPipe->iSocketFd);
+            pPipe->iSocketFd = -1;
+            endpointsConnectFailed(pPipe->iEndpoint);
+        }
+    }
+    if(iResult < 0)
+    {
+        return -1;
+    }
+    if(pPipe->iTimerFd < 0)
+    {
+        pPipe->iTimerFd = reactorTimerCreate(httpPipeTimeout, pPipe);
+    }
+    if(pPipe->iTimerFd < 0 || reactorAddFd(pPipe->iSocketFd, EPOLLOUT, httpPipeCallback, pPipe) < 0)
+    {
+        close(pPipe->iSocketFd);
+        pPipe->iSocketFd = -1;
+        return -1;
+    }
+    reactorTimerArm(pPipe->iTimerFd, configGet()->socketTimeoutSec * 1000, 0);
+    pPipe->eState = HTTPX_CONNECTING;
+    printf("[INFO] (%s) %s: Opening pipelined connection to %s, %u requests queued.\n", printTimestamp(), __func__, endpointsName(pPipe->iEndpoint), pPipe->uiCount);
+    return 0;
+}
+
+void httpPipeCallback(int iFd, uint32_t uiEvents, void *pContext)
+{
+    httpPipeStep((tHttpPipe *)pContext);
+}
+
+void httpPipeTimeout(int iFd, uint32_t uiEvents, void *pContext)
+{
+    endpointsRecordResult(((tHttpPipe *)pContext)->iEndpoint, -1, 0);
+    httpPipeBroken((tHttpPipe *)pContext, "timeout");
+}
+
+/********************* httpPipeStep *************************
+    Connect and handshake like an exchange, then write what
+    is queued and hand every complete response to the head
+    of the ring.
+************************************************************/
+void httpPipeStep(tHttpPipe *pPipe)
+{
+    tHttpPipeSlot *pSlot;
+    bool bWantWrite = false;
+    int iResult;
+    int iError;
+    int iLength;
+    socklen_t uiLength;
+
+    switch(pPipe->eState)
+    {
+        case HTTPX_CONNECTING:
+            iError = 0;
+            uiLength = sizeof(iError);
+            getsockopt(pPipe->iSocketFd, SOL_SOCKET, SO_ERROR, &iError, &uiLength);
+            if(iError == EINPROGRESS)
+            {
+                return;
+            }
+            if(iError != 0)
+            {
+                endpointsConnectFailed(pPipe->iEndpoint); // the reconnect goes to the next endpoint
+                httpPipeBroken(pPipe, "connect");
+                return;
+            }
+            if(!pPipe->bUseSsl)
+            {
+                pPipe->eState = HTTPX_OPEN;
+                break;
+            }
+            pPipe->sSSLConn = SSL_new(sSSLContext);
+            if(pPipe->sSSLConn == NULL)
+            {
+                httpPipeBroken(pPipe, "SSL_new");
+                return;
+            }
+            SSL_set_fd(pPipe->sSSLConn, pPipe->iSocketFd);
+            httpPrepareSession(pPipe->sSSLConn);
+            pPipe->eState = HTTPX_HANDSHAKE;
+            // fall through
+        case HTTPX_HANDSHAKE:
+            ERR_clear_error();
+            iResult = SSL_connect(pPipe->sSSLConn);
+            if(iResult != 1)
+            {
+                iError = SSL_get_error(pPipe->sSSLConn, iResult);
+                if(iError == SSL_ERROR_WANT_READ || iError == SSL_ERROR_WANT_WRITE)
+                {
+                    reactorModFd(pPipe->iSocketFd, (iError == SSL_ERROR_WANT_READ) ? EPOLLIN : EPOLLOUT);
+                    return;
+                }
+                printf("[ERROR] (%s) %s: Could not create SSL connection. Error code %i. Return Code %i.\n\t%s\n", printTimestamp(), __func__, iError, iResult, ERR_error_string(ERR_get_error(), NULL));
+                httpDropSession();
+                endpointsConnectFailed(pPipe->iEndpoint);
+                httpPipeBroken(pPipe, "handshake");
+                return;
+            }
+            httpKtlsCheck(pPipe->sSSLConn);
+            pPipe->eState = HTTPX_OPEN;
+            break;
+        case HTTPX_OPEN:
+            break;
+        default:
+            return;
+    }
+
+    while(pPipe->uiWritten < pPipe->uiCount)
+    {
+        pSlot = &pPipe->asSlots[(pPipe->uiHead + pPipe->uiWritten) % HTTPPIPE_MAXDEPTH];
+        if(pPipe->sSSLConn != NULL)
+        {
+            iResult = SSL_write(pPipe->sSSLConn, &pSlot->sTxMessage[pPipe->iTxDone], pSlot->iTxLength - pPipe->iTxDone);
+            iError = (iResult > 0) ? SSL_ERROR_NONE : SSL_get_error(pPipe->sSSLConn, iResult);
+        }
+        else
+        {
+            iResult = send(pPipe->iSocketFd, &pSlot->sTxMessage[pPipe->iTxDone], pSlot->iTxLength - pPipe->iTxDone, MSG_NOSIGNAL);
+            iError = (iResult > 0) ? SSL_ERROR_NONE : ((errno == EAGAIN) ? SSL_ERROR_WANT_WRITE : SSL_ERROR_SYSCALL);
+        }
+        if(iError == SSL_ERROR_WANT_READ || iError == SSL_ERROR_WANT_WRITE)
+        {
+            bWantWrite = true;
+            break;
+        }
+        if(iError != SSL_ERROR_NONE)
+        {
+            httpPipeBroken(pPipe, "write");
+            return;
+        }
+        pPipe->iTxDone += iResult;
+        if(pPipe->iTxDone == pSlot->iTxLength)
+        {
+            commsAddByteCounts(pSlot->iTxLength, 0);
+            pPipe->uiWritten += 1;
+            pPipe->iTxDone = 0;
+        }
+    }
+
+    while(1)
+    {
+        if(pPipe->sSSLConn != NULL)
+        {
+            iResult = SSL_read(pPipe->sSSLConn, &pPipe->sRxMessage[pPipe->iRxLength], sizeof(pPipe->sRxMessage) - 1 - pPipe->iRxLength);
+            iError = (iResult > 0) ? SSL_ERROR_NONE : SSL_get_error(pPipe->sSSLConn, iResult);
+        }
+        else
         {
-            printf("[ERROR] (%s) %s: Could not write to SSL socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
-            close(miHttpSocketFd);
-            SSL_shutdown(sSSLConn);
-            return -1;
+            iResult = read(pPipe->iSocketFd, &pPipe->sRxMessage[pPipe->iRxLength], sizeof(pPipe->sRxMessage) - 1 - pPipe->iRxLength);
+            iError = (iResult > 0) ? SSL_ERROR_NONE : ((iResult == 0) ? SSL_ERROR_ZERO_RETURN : ((errno == EAGAIN) ? SSL_ERROR_WANT_READ : SSL_ERROR_SYSCALL));
         }
-        /* receive the response via SSL */
-        iResult = httpReadRespFromSocket(0, sSSLConn);
-        if (iResult < 0)
+        if(iError == SSL_ERROR_WANT_READ)
         {
-            printf("[ERROR] (%s) %s: Could not read from SSL socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
-            close(miHttpSocketFd);
-            SSL_shutdown(sSSLConn);
-            return -1;
+            break;
         }
-        SSL_shutdown(sSSLConn);
-    #else
-        /* send the request */
-        iResult = httpWriteMsgToSocket(miHttpSocketFd, NULL);
-        if (iResult < 0)
+        if(iError == SSL_ERROR_WANT_WRITE)
         {
-            printf("[ERROR] (%s) %s: Could not write to socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
-            close(miHttpSocketFd);
-            return -1;
+            bWantWrite = true;
+            break;
         }
-        /* receive the response */
-        iResult = httpReadRespFromSocket(miHttpSocketFd, NULL);
-        if (iResult < 0)
+        if(iError != SSL_ERROR_NONE)
         {
-            printf("[ERROR] (%s) %s: Could not read from socket. Return Code = %i.\n", printTimestamp(), __func__, iResult);
-            close(miHttpSocketFd);
-            return -1;
+            if(pPipe->uiCount == 0 && pPipe->iRxLength == 0)
+            {
+                httpPipeDisconnect(pPipe); // the server closed the idle connection
+            }
+            else
+            {
+                httpPipeBroken(pPipe, (iError == SSL_ERROR_ZERO_RETURN) ? "closed by the server" : "read");
+            }
+            return;
         }
-    #endif
-    
+        pPipe->iRxLength += iResult;
+        pPipe->sRxMessage[pPipe->iRxLength] = 0x00;
+        while((iLength = httpRespLength(pPipe->sRxMessage, pPipe->iRxLength)) > 0)
+        {
+            if(pPipe->uiWritten == 0)
+            {
+                httpPipeBroken(pPipe, "response without request");
+                return;
+            }
+            httpPipeResponse(pPipe, iLength);
+            if(pPipe->eState != HTTPX_OPEN)
+            {
+                return; // the server closed it after this response
+            }
+        }
+        if(pPipe->iRxLength == sizeof(pPipe->sRxMessage) - 1)
+        {
+            httpPipeBroken(pPipe, "receive buffer full");
+            return;
+        }
+    }
+
+    if(pPipe->uiCount == 0 && configGet()->pipelineDepth == 0)
+    {
+        httpPipeDisconnect(pPipe); // pipelining switched off by a reload
+        return;
+    }
+    reactorModFd(pPipe->iSocketFd, EPOLLIN | ((bWantWrite || pPipe->uiWritten < pPipe->uiCount) ? EPOLLOUT : 0));
+}
+
+/******************* httpPipeResponse ***********************
+    The first iLength bytes of the receive buffer answer
+    the head slot. The ring is updated before the done
+    callback, which may queue the next request.
+************************************************************/
+void httpPipeResponse(tHttpPipe *pPipe, int iLength)
+{
+    tHttpPipeSlot *pSlot = &pPipe->asSlots[pPipe->uiHead];
+    tUplinkRecord sRecord;
+    tCommsDoneCallback pDone;
+    bool bServerCloses;
+    int iResult;
+
+    commsAddByteCounts(0, iLength);
+    memcpy(msHttpRxMessage, pPipe->sRxMessage, iLength);
+    msHttpRxMessage[iLength] = 0x00;
+    memmove(pPipe->sRxMessage, &pPipe->sRxMessage[iLength], pPipe->iRxLength - iLength + 1);
+    pPipe->iRxLength -= iLength;
+    bServerCloses = httpServerCloses(msHttpRxMessage);
+
     iResult = httpParseReplyMsg(msHttpRxMessage);
-    if (iResult < 0)
+    if(iResult < 0)
     {
-        printf("[ERROR] (%s) %s: Failed to parse the server\'s reply message. Return Code = %i.\n", printTimestamp(), __func__, iResult);
-        close(miHttpSocketFd);
-        return -1;
+        printf("[ERROR] (%s) %s: Failed to parse the server\'s reply to seqNr %u. Return Code = %i.\n", printTimestamp(), __func__, pSlot->uiSeqNr, iResult);
+    }
+    memcpy(&sRecord, &pSlot->sRecord, sizeof(tUplinkRecord));
+    pDone = pSlot->pDone;
+    endpointsRecordResult(pPipe->iEndpoint, iResult, printGetMonotonicTimeUs() - sRecord.sendStartUs);
+    pPipe->uiHead = (pPipe->uiHead + 1) % HTTPPIPE_MAXDEPTH;
+    pPipe->uiCount -= 1;
+    pPipe->uiWritten -= 1;
+    if(pPipe->uiCount > 0)
+    {
+        reactorTimerArm(pPipe->iTimerFd, configGet()->socketTimeoutSec * 1000, 0);
+    }
+    else
+    {
+        reactorTimerDisarm(pPipe->iTimerFd);
+    }
+    if(bServerCloses)
+    {
+        httpPipeDisconnect(pPipe); // the rest is written again on a new connection, not a failure
+    }
+    commsUplinkFinished(&sRecord, (iResult < 0) ? -1 : 0, pDone);
+    if(pPipe->eState == HTTPX_FREE && pPipe->uiCount > 0 && httpPipeConnect() < 0)
+    {
+        httpPipeFailAll(pPipe);
     }
-    
-    close(miHttpSocketFd);
-    return 0;
 }
 
+/******************** httpPipeBroken ************************
+    Head of line failure: the connection is gone with
+    requests unanswered. The server may or may not have
+    seen them, they are written again in the same order on
+    a new connection with their original seqNr so the server
+    can drop duplicates. When the head was left unanswered
+    by more than HTTPPIPE_MAXREPLAYS connections it fails,
+    with everything behind it.
+************************************************************/
+void httpPipeBroken(tHttpPipe *pPipe, const char *sReason)
+{
+    tHttpPipeSlot *pHead = &pPipe->asSlots[pPipe->uiHead];
+    bool bGiveUp = false;
 
-/******************* httpSocketInit *************************
+    printf("[WARNING] (%s) %s: Pipelined connection broken (%s), %u requests unanswered, %u written.\n", printTimestamp(), __func__, sReason, pPipe->uiCount, pPipe->uiWritten);
+    if(pPipe->uiCount > 0)
+    {
+        pHead->uiReplays += 1; // only the head is to blame, the tail never had its turn
+        bGiveUp = (pHead->uiReplays > HTTPPIPE_MAXREPLAYS);
+    }
+    httpPipeDisconnect(pPipe);
+    if(pPipe->uiCount == 0)
+    {
+        return;
+    }
+    if(!bGiveUp)
+    {
+        muiHttpPipeReplays += 1;
+        if(httpPipeConnect() == 0)
+        {
+            return;
+        }
+    }
+    httpPipeFailAll(pPipe);
+}
+
+void httpPipeDisconnect(tHttpPipe *pPipe)
+{
+    if(pPipe->eState == HTTPX_FREE)
+    {
+        return;
+    }
+    reactorDelFd(pPipe->iSocketFd);
+    reactorTimerDisarm(pPipe->iTimerFd);
+    if(pPipe->sSSLConn != NULL)
+    {
+        SSL_shutdown(pPipe->sSSLConn);
+        SSL_free(pPipe->sSSLConn);
+        pPipe->sSSLConn = NULL;
+    }
+    close(pPipe->iSocketFd);
+    pPipe->iSocketFd = -1;
+    pPipe->eState = HTTPX_FREE;
+    pPipe->uiWritten = 0;
+    pPipe->iTxDone = 0;
+    pPipe->iRxLength = 0;
+}
+
+/******************** httpPipeFailAll ***********************
+    Empties the ring before the callbacks run, they may
+    start new requests.
+************************************************************/
+void httpPipeFailAll(tHttpPipe *pPipe)
+{
+    tHttpPipeSlot *pSlot;
+    tUplinkRecord asRecords[HTTPPIPE_MAXDEPTH];
+    tCommsDoneCallback apDone[HTTPPIPE_MAXDEPTH];
+    uint32_t uiCount = pPipe->uiCount;
+    uint32_t i;
+
+    for(i=0; i<uiCount; i+=1)
+    {
+        pSlot = &pPipe->asSlots[(pPipe->uiHead + i) % HTTPPIPE_MAXDEPTH];
+        memcpy(&asRecords[i], &pSlot->sRecord, sizeof(tUplinkRecord));
+        apDone[i] = pSlot->pDone;
+    }
+    pPipe->uiHead = 0;
+    pPipe->uiCount = 0;
+    for(i=0; i<uiCount; i+=1)
+    {
+        commsUplinkFinished(&asRecords[i], -1, apDone[i]);
+    }
+}
 
+/********************* httpPipeReset ************************
+    Endpoint changed: drop the connection, unanswered
+    requests fail back to their owners.
+************************************************************/
+void httpPipeReset()
+{
+    httpPipeDisconnect(&msHttpPipe);
+    httpPipeFailAll(&msHttpPipe);
+}
+
+uint32_t httpPipeReplays()
+{
+    return muiHttpPipeReplays;
+}
+
+/******************* httpSocketInit *************************
+    Opens the socket for the next connection and fills
+    msHttpServerAddr with the endpoint endpointsSelect()
+    picked, never iExclude (-1: none). Returns the endpoint
+    handle or -1, a name that doesn't resolve takes the
+    endpoint out of the rotation like a connection error.
 ************************************************************/
-int httpSocketInit()
+int httpSocketInit(int iExclude)
 {
     /* first what are we going to send and where are we going to send it? */
     /* send a post to:
         https://dashboard.safeandclean.be/mobile/webhook?id={device}&time={time}&seqNumber={seqNumber}&ack={ack}&data={data}
     */
-    #if USESSL == 1
-        miHttpPortNo = 443;
-    #else
-        miHttpPortNo = 80;
-    #endif
-    
-    msHttpHost = IOT_HOST;
+    const tConfig *pConfig = configGet();
+    int iEndpoint = endpointsSelect(iExclude);
+    if(iEndpoint < 0)
+    {
+        return -1;
+    }
     
     /* create the http socket */
     miHttpSocketFd = socket(AF_INET, SOCK_STREAM, 0);
     if (miHttpSocketFd < 0)
     {
-        printf("[ERROR] (%s) %s: Failed to open socket for \'%s\'\n", printTimestamp(), __func__, IOT_HOST);
+        printf("[ERROR] (%s) %s: Failed to open socket for \'%s\'\n", printTimestamp(), __func__, endpointsName(iEndpoint));
         return -1;
     }
     
-    /* lookup the server ip address */
-    msHttpServer = gethostbyname(msHttpHost);
-    if (msHttpServer == NULL) 
+    /* don't let a dead link block us for the full kernel tcp timeout */
+    uint32_t uiTimeoutMs = commsTimeoutMs(pConfig->socketTimeoutSec * 1000);
+    struct timeval sTimeout = {.tv_sec = uiTimeoutMs / 1000, .tv_usec = (uiTimeoutMs % 1000) * 1000};
+    setsockopt(miHttpSocketFd, SOL_SOCKET, SO_SNDTIMEO, &sTimeout, sizeof(sTimeout)); // also bounds connect()
+    setsockopt(miHttpSocketFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    
+    #if HTTPUSETCPFASTOPEN == 1
+    /* connect() returns at once, the SYN goes out with the first write (ClientHello) */
+    int iEnable = 1;
+    if(setsockopt(miHttpSocketFd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &iEnable, sizeof(iEnable)) < 0)
     {
-        printf("[ERROR] (%s) %s: No such host: \'%s\'\n", printTimestamp(), __func__, msHttpHost);
-        return -1;
+        printf("[WARNING] (%s) %s: TCP fast open not available, errno %i.\n", printTimestamp(), __func__, errno);
     }
+    #endif
     
-    /* clear and fill in the server address structure */
-    memset(&msHttpServerAddr, 0, sizeof(msHttpServerAddr));
-    msHttpServerAddr.sin_family = AF_INET;
-    msHttpServerAddr.sin_port = htons(miHttpPortNo);
-    memcpy(&msHttpServerAddr.sin_addr.s_addr, msHttpServer->h_addr, msHttpServer->h_length);
-    
-    printf("[INFO] (%s) %s: Initialized http socket: s_addr=0x%x, h_addr=%s, h_length=0x%x\n", printTimestamp(), __func__, msHttpServerAddr.sin_addr.s_addr, msHttpServer->h_addr, msHttpServer->h_length);
-    
-    return 0;
+    /* the server address, cached by SACEndpoints.c */
+    if(endpointsAddress(iEndpoint, &msHttpServerAddr) < 0)
+    {
+        close(miHttpSocketFd);
+        endpointsConnectFailed(iEndpoint);
+        return -1;
+    }
+    return iEndpoint;
 }
 
 /************* int httpWriteMsgToSocket *********************
@@ -182,19 +2329,25 @@ int httpSocketInit()
 int httpWriteMsgToSocket(int iSocketFd, SSL *sSSLConn)
 {
     int iBytesCurrentlyProcessed = 0;
-    int iBytesToProcess = strlen(msHttpTxMessage);
+    int iBytesToProcess = miHttpTxLength;
     int iBytesSent = 0;
+    const char *pHeaderEnd = strstr(msHttpTxMessage, "\r\n\r\n");
     
+    TRACE_BEGIN("write");
     do
     {
-        #if USESSL == 1
-            iBytesCurrentlyProcessed = SSL_write(sSSLConn, (char *)((uint32_t)msHttpTxMessage + (uint32_t)iBytesSent), iBytesToProcess - iBytesSent);
-        #else
-            iBytesCurrentlyProcessed = write(iSocketFd, (char *)((uint32_t)msHttpTxMessage + (uint32_t)iBytesSent), iBytesToProcess - iBytesSent);
-        #endif
+        if(sSSLConn != NULL)
+        {
+            iBytesCurrentlyProcessed = SSL_write(sSSLConn, (char *)((uintptr_t)msHttpTxMessage + (uintptr_t)iBytesSent), iBytesToProcess - iBytesSent);
+        }
+        else
+        {
+            iBytesCurrentlyProcessed = write(iSocketFd, (char *)((uintptr_t)msHttpTxMessage + (uintptr_t)iBytesSent), iBytesToProcess - iBytesSent);
+        }
         if(iBytesCurrentlyProcessed < 0)
         {
             printf("[ERROR] (%s) %s: Could not write message %s to socket 0x%x. Socket write error code %i.\n", printTimestamp(), __func__, msHttpTxMessage, miHttpSocketFd, iBytesCurrentlyProcessed);
+            TRACE_END("write");
             return -1;
         }
         if(iBytesCurrentlyProcessed == 0)
@@ -203,13 +2356,15 @@ int httpWriteMsgToSocket(int iSocketFd, SSL *sSSLConn)
         }
         iBytesSent += iBytesCurrentlyProcessed;
     } while(iBytesSent < iBytesToProcess);
+    TRACE_END("write");
+    commsAddByteCounts(iBytesSent, 0);
     
     printf("[INFO] (%s) %s: %i http request message bytes written to socket:\n"
             "******* ASCII begin *******\n"
-            "%s\n"
+            "%.*s\n"
             "******** ASCII end ********\n"
             , printTimestamp(), __func__, iBytesSent,
-            msHttpTxMessage
+            (pHeaderEnd != NULL) ? (int)(pHeaderEnd - msHttpTxMessage) + 4 : iBytesSent, msHttpTxMessage // a bulk upload body is binary
             );
     return 0;
 }
@@ -225,16 +2380,21 @@ int httpReadRespFromSocket(int iSocketFd, SSL *sSSLConn)
     int iBytesToProcess = sizeof(msHttpRxMessage) - 1;
     
     memset(msHttpRxMessage, 0, sizeof(msHttpRxMessage)); // clear buffer
+    TRACE_BEGIN("read");
     do
     {
-        #if USESSL == 1
-            iBytesCurrentlyProcessed = SSL_read(sSSLConn, (char *)((uint32_t)msHttpRxMessage + (uint32_t)iBytesReceived), iBytesToProcess - iBytesReceived);
-        #else
-            iBytesCurrentlyProcessed = read(iSocketFd, (char *)((uint32_t)msHttpRxMessage + (uint32_t)iBytesReceived), iBytesToProcess - iBytesReceived);
-        #endif    
+        if(sSSLConn != NULL)
+        {
+            iBytesCurrentlyProcessed = SSL_read(sSSLConn, (char *)((uintptr_t)msHttpRxMessage + (uintptr_t)iBytesReceived), iBytesToProcess - iBytesReceived);
+        }
+        else
+        {
+            iBytesCurrentlyProcessed = read(iSocketFd, (char *)((uintptr_t)msHttpRxMessage + (uintptr_t)iBytesReceived), iBytesToProcess - iBytesReceived);
+        }
         if(iBytesCurrentlyProcessed < 0)
         {
             printf("[ERROR] (%s) %s: Could not read response from socket 0x%x. Socket write error code %i.\n", printTimestamp(), __func__, miHttpSocketFd, iBytesCurrentlyProcessed);
+            TRACE_END("read");
             return -1;
         }
         if(iBytesCurrentlyProcessed == 0)
@@ -242,7 +2402,13 @@ int httpReadRespFromSocket(int iSocketFd, SSL *sSSLConn)
             break;
         }
         iBytesReceived += iBytesCurrentlyProcessed;
+        if(httpRespComplete(msHttpRxMessage, iBytesReceived))
+        {
+            break; // don't wait a round trip for the close when the server answered early data
+        }
     } while(iBytesReceived < iBytesToProcess);
+    TRACE_END("read");
+    commsAddByteCounts(0, iBytesReceived);
     
     if(iBytesReceived == iBytesToProcess)
     {
@@ -265,44 +2431,116 @@ int httpReadRespFromSocket(int iSocketFd, SSL *sSSLConn)
 /******************* httpBuildRequestMsg ********************
     *) befor usage, int httpSocketInit() must be executed first.
     *) Is required for int httpSendRequest().
+    *) ulEventTime is the unix time at which the controller
+       sent the data, it differs from now for queued uplinks.
+    *) bEncoding (tUplinkEncoding) other than UPLENC_RAW is
+       sent as &enc=.
+************************************************************/
+void httpBuildRequestMsg(uintptr_t I2CRxPayloadAddress, int I2CRxPayloadLength, long unsigned int ulEventTime, uint8_t bEncoding)
+{
+    httpBuildRequestMsgFor(I2CRxPayloadAddress, I2CRxPayloadLength, ulEventTime, bEncoding, configGet()->deviceId, commsNextSeqNr(), configGet()->rulesEnabled);
+}
+
+/******************* httpBuildUplinkMsg *********************
+    Request of an uplink record. A record forwarded by a LAN
+    gateway slave (origin set, SACLanGateway.h) goes out with
+    the slave's device id and sequence number.
 ************************************************************/
-void httpBuildRequestMsg(uint32_t I2CRxPayloadAddress, int I2CRxPayloadLength)
+void httpBuildUplinkMsg(tUplinkRecord *pRecord)
+{
+    if(pRecord->origin[0] != 0x00)
+    {
+        httpBuildRequestMsgFor((uintptr_t)pRecord->cmd.payload, pRecord->cmd.payloadSize - 1, pRecord->time, pRecord->encoding, pRecord->origin, pRecord->seqNr, false); // -1 since payloadsize includes the read request byte
+        return;
+    }
+    httpBuildRequestMsgFor((uintptr_t)pRecord->cmd.payload, pRecord->cmd.payloadSize - 1, pRecord->time, pRecord->encoding, configGet()->deviceId, commsRecordSeqNr(pRecord), configGet()->rulesEnabled);
+}
+
+void httpBuildRequestMsgFor(uintptr_t I2CRxPayloadAddress, int I2CRxPayloadLength, long unsigned int ulEventTime, uint8_t bEncoding, const char *sDeviceId, uint32_t uiSeqNr, bool bRules)
 {
-    char sDeviceId[256];
-    gethostname(sDeviceId, 256);
-    printf("[INFO] (%s) %s: Device ID is \'%s\'.\n", printTimestamp(), __func__, sDeviceId);
+    char sHostName[256];
+    gethostname(sHostName, 256);
+    printf("[INFO] (%s) %s: Device ID is \'%s\'.\n", printTimestamp(), __func__, sHostName);
     
     char *pUpstreamDataString = printBytesAsHexString(I2CRxPayloadAddress, I2CRxPayloadLength, false, NULL);
     printf("[INFO] (%s) %s: Built upstream data string:\n\t\'%s\'\n", printTimestamp(), __func__, pUpstreamDataString);
     
+    const tConfig *pConfig = configGet();
     tServerRequest *sRequest = getLastServerRequest();
-    sprintf(sRequest->host, "%s", IOT_HOST);
-    sprintf(sRequest->path, "%s", IOT_PATH);
-    sprintf(sRequest->deviceId, "%s", IOT_DEVICEID);
-    //sprintf(sRequest->deviceId, "%s", sDeviceId);
-    sRequest->time = printGetUnixEpochTimeAsInt();//1594998140;
-    sRequest->seqNr = muiSeqNr;
-    muiSeqNr += 1;
+    sprintf(sRequest->host, "%s", pConfig->host);
+    sprintf(sRequest->path, "%s", pConfig->path);
+    sprintf(sRequest->deviceId, "%s", sDeviceId);
+    //sprintf(sRequest->deviceId, "%s", sHostName);
+    sRequest->time = ulEventTime;//1594998140;
+    sRequest->seqNr = uiSeqNr;
     sRequest->ack = 1;
     sRequest->data = pUpstreamDataString;
         
-    sprintf(msHttpTxMessage, "GET %s?id=%s&time=%lu&seqNumber=%u&ack=%u&data=%s"
-                            #if ADDUSERREPLYINREQUEST == 1
-                                "&response=%s"
-                            #endif
-                            " HTTP/1.1\r\nHost: %s\r\n\r\n", 
+    char sRules[24] = "";
+    if(bRules)
+    {
+        snprintf(sRules, sizeof(sRules), "&rules=%u", rulesVersion()); // the server sends its table when this is not its version (SACRules.h)
+    }
+        
+    sprintf(msHttpTxMessage, "GET %s?id=%s&time=%lu&seqNumber=%u&ack=%u&data=%s%s%s%s%s%s HTTP/1.1\r\nHost: %s\r\n\r\n", 
         sRequest->path,           // path
         sRequest->deviceId,       // id=
         sRequest->time,           // time=
         sRequest->seqNr,          // seqNumber=
         sRequest->ack,            // ack=
         sRequest->data,           // data=
-        #if ADDUSERREPLYINREQUEST == 1
-            USERREPLYINREQUEST, // Add your custom reply here, only used for debugging!
-        #endif
+        (bEncoding != UPLENC_RAW) ? "&enc=" : "", // edge aggregation (SACEdgeAgg.h)
+        (bEncoding != UPLENC_RAW) ? commsEncodingName(bEncoding) : "",
+        sRules,
+        (pConfig->userReply[0] != 0x00) ? "&response=" : "", // [comms] user_reply, only used for debugging!
+        pConfig->userReply,
         sRequest->host           // Host:
         );
-        
+    miHttpTxLength = strlen(msHttpTxMessage);
+}
+
+/******************** httpBuildBulkMsg **********************
+    POST of a bulk upload block (SACBulkUpload.h), pBody is
+    the zlib stream. Returns -1 when it doesn't fit in
+    msHttpTxMessage.
+************************************************************/
+int httpBuildBulkMsg(const uint8_t *pBody, int iLength, uint32_t uiRecords)
+{
+    const tConfig *pConfig = configGet();
+    int iHeaderLength = snprintf(msHttpTxMessage, sizeof(msHttpTxMessage), "POST %s?id=%s&bulk=%u HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\nContent-Encoding: deflate\r\nContent-Length: %i\r\n\r\n",
+        pConfig->path, pConfig->deviceId, uiRecords, pConfig->host, iLength);
+    if(iHeaderLength + iLength > (int)sizeof(msHttpTxMessage))
+    {
+        printf("[ERROR] (%s) %s: Bulk upload of %i bytes does not fit the request buffer.\n", printTimestamp(), __func__, iLength);
+        return -1;
+    }
+    memcpy(&msHttpTxMessage[iHeaderLength], pBody, iLength);
+    miHttpTxLength = iHeaderLength + iLength;
+    return 0;
+}
+
+/******************* httpParseBulkReply *********************
+    The server answers a bulk upload with 200 and
+    "stored=<n>" in the body: the first n records of the
+    block are stored, the rest has to be sent again.
+************************************************************/
+int httpParseBulkReply(const char *sMessage, uint32_t *pStored)
+{
+    const char *pBody = strstr(sMessage, "\r\n\r\n");
+    const char *pStoredValue = (pBody != NULL) ? strstr(pBody, "stored=") : NULL;
+
+    if(strncmp(sMessage, "HTTP/1.1 200", 12) != 0)
+    {
+        printf("[ERROR] %s: Bulk upload not accepted:\n\t%.40s\n", __func__, sMessage);
+        return -1;
+    }
+    if(pStoredValue == NULL)
+    {
+        printf("[ERROR] %s: Bulk upload reply without stored=.\n", __func__);
+        return -3;
+    }
+    *pStored = strtoul(pStoredValue + 7, NULL, 10);
+    return 0;
 }
 
 /******************* httpParseReplyMsg **********************
@@ -336,7 +2574,7 @@ int httpParseReplyMsg(char *sRawMessage)
     int iBlankLineIndex = -1;
     int iPayloadLineIndex = -1;
     
-    //printf("\t# in hex: %s #\n", printBytesAsHexString((uint32_t)sRawMessage, iInitLength, true, ", "));
+    //printf("\t# in hex: %s #\n", printBytesAsHexString((uintptr_t)sRawMessage, iInitLength, true, ", "));
     
     // load the string token function
     char *pTemp = strtok(sRawMessage, asDelimiters);
@@ -350,7 +2588,7 @@ int httpParseReplyMsg(char *sRawMessage)
         iNTokens += 1;
 	}
     //printf("[INFO] %s: Found %i tokens.\n", __func__, iNTokens);
-    //printf("\t# in hex: %s #\n", printBytesAsHexString((uint32_t)sRawMessage, iInitLength, true, ", "));
+    //printf("\t# in hex: %s #\n", printBytesAsHexString((uintptr_t)sRawMessage, iInitLength, true, ", "));
     
     // look for the phrase "HTTP/1.1 "
     // it should be on line index 0
@@ -405,6 +2643,13 @@ int httpParseReplyMsg(char *sRawMessage)
         memset(msHttpRxMessage, 0, sizeof(msHttpRxMessage));
         return -3;
     }
+    for(i=1; i<iBlankLineIndex; i+=1)
+    {
+        if(strncasecmp(apLines[i], RULES_HEADER, strlen(RULES_HEADER)) == 0)
+        {
+            rulesOffer(apLines[i] + strlen(RULES_HEADER)); // a new local rule table
+        }
+    }
     
     // If we asked for content (ack=1) and response code = 200, the server should return content after the first linefeed.
     if(iReplyCode == 200)
@@ -418,7 +2663,7 @@ int httpParseReplyMsg(char *sRawMessage)
     tCtrlDeckedReply *pReplyForController = getCtrlDeckedReply();
     int iNBytesParsed = printParseHexStringToBytes(apLines[iPayloadLineIndex], pReplyForController->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE);
     printf("[INFO] (%s) %s: parsed %d bytes\n", printTimestamp(), __func__, iNBytesParsed);
-    printf("\t# Bytes (HEX): %s\n", printBytesAsHexString((uint32_t)pReplyForController->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE, true, ", "));
+    printf("\t# Bytes (HEX): %s\n", printBytesAsHexString((uintptr_t)pReplyForController->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE, true, ", "));
     
     // second line after the blank line is payload.
     // it should be 16 characters long
@@ -431,6 +2676,205 @@ int httpParseReplyMsg(char *sRawMessage)
     return 0;
 }
 
+/****************** httpRespComplete ************************
+    True when sMessage holds the whole response: the last
+    chunk of a chunked body, or Content-Length bytes after
+    the header.
+************************************************************/
+bool httpRespComplete(const char *sMessage, int iBytesReceived)
+{
+    return (httpRespLength(sMessage, iBytesReceived) > 0);
+}
+
+/******************* httpRespLength *************************
+    Length of the first complete response in sMessage (0
+    terminated), 0 while it is incomplete. On a pipelined
+    connection the next response may follow right behind
+    it. Chunked bodies are walked chunk by chunk, trailers
+    are not supported.
+************************************************************/
+int httpRespLength(const char *sMessage, int iBytesReceived)
+{
+    const char *pBody = strstr(sMessage, "\r\n\r\n");
+    const char *pLength;
+    const char *pLineEnd;
+    char *pEnd;
+    long lChunkSize;
+    int iPos;
+
+    if(pBody == NULL)
+    {
+        return 0;
+    }
+    pBody += 4;
+    iPos = pBody - sMessage;
+    pLength = httpFindHeader(sMessage, "Content-Length");
+    if(pLength != NULL)
+    {
+        iPos += atoi(pLength);
+        return (iBytesReceived >= iPos) ? iPos : 0;
+    }
+    while(iPos < iBytesReceived)
+    {
+        lChunkSize = strtol(&sMessage[iPos], &pEnd, 16);
+        pLineEnd = strstr(pEnd, "\r\n");
+        if(pEnd == &sMessage[iPos] || pLineEnd == NULL || lChunkSize < 0)
+        {
+            return 0;
+        }
+        iPos = (pLineEnd - sMessage) + 2;
+        if(lChunkSize == 0)
+        {
+            return (iBytesReceived - iPos >= 2 && memcmp(&sMessage[iPos], "\r\n", 2) == 0) ? iPos + 2 : 0;
+        }
+        iPos += lChunkSize + 2;
+    }
+    return 0;
+}
+
+/******************* httpFindHeader *************************
+    Value of header sName (after the colon and the spaces)
+    in the header block of sMessage, NULL when it isn't
+    there. Header names are case insensitive (RFC 9110), a
+    proxy may send them in lower case.
+************************************************************/
+const char *httpFindHeader(const char *sMessage, const char *sName)
+{
+    const char *pHeaderEnd = strstr(sMessage, "\r\n\r\n");
+    const char *pLine = strstr(sMessage, "\r\n"); // skip the status line
+    size_t uiNameLength = strlen(sName);
+
+    while(pLine != NULL && pLine < pHeaderEnd)
+    {
+        pLine += 2;
+        if(strncasecmp(pLine, sName, uiNameLength) == 0 && pLine[uiNameLength] == ':')
+        {
+            pLine += uiNameLength + 1;
+            while(*pLine == ' ' || *pLine == '\t')
+            {
+                pLine += 1;
+            }
+            return pLine;
+        }
+        pLine = strstr(pLine, "\r\n");
+    }
+    return NULL;
+}
+
+/****************** httpServerCloses ************************
+    True when the Connection header of sMessage lists the
+    close option. Options are a comma separated list and
+    case insensitive, "Connection: Close" counts as well.
+************************************************************/
+bool httpServerCloses(const char *sMessage)
+{
+    const char *pOption = httpFindHeader(sMessage, "Connection");
+
+    while(pOption != NULL && *pOption != '\r' && *pOption != 0x00)
+    {
+        if(strncasecmp(pOption, "close", 5) == 0 && strchr(" \t,\r", pOption[5]) != NULL)
+        {
+            return true;
+        }
+        pOption += strcspn(pOption, ",\r");
+        while(*pOption == ',' || *pOption == ' ' || *pOption == '\t')
+        {
+            pOption += 1;
+        }
+    }
+    return false;
+}
+
+/***************** httpPrepareSession ***********************
+    Offers the stored session for resumption, an abbreviated
+    handshake when the server still knows it.
+************************************************************/
+void httpPrepareSession(SSL *sSSLConn)
+{
+    if(mpSSLSession != NULL && !SSL_SESSION_is_resumable(mpSSLSession))
+    {
+        // a TLS 1.3 ticket is single use, the one spent on early data is gone
+        httpDropSession();
+    }
+    if(mpSSLSession != NULL)
+    {
+        SSL_set_session(sSSLConn, mpSSLSession);
+    }
+    #ifdef SSL_OP_ENABLE_KTLS
+    if(configGet()->ktls)
+    {
+        SSL_set_options(sSSLConn, SSL_OP_ENABLE_KTLS);
+    }
+    #endif
+}
+
+/********************* httpKtlsCheck ************************
+    After the handshake: did OpenSSL hand the record layer
+    to the kernel? It silently keeps it when the kernel has
+    no tls module or the cipher isn't supported there, the
+    connection works either way. Logged when the outcome
+    differs from the previous connection.
+************************************************************/
+void httpKtlsCheck(SSL *sSSLConn)
+{
+    int iState = 0;
+
+    if(!configGet()->ktls)
+    {
+        return;
+    }
+    msHttpKtlsStats.connections += 1;
+    #ifdef SSL_OP_ENABLE_KTLS
+    if(BIO_get_ktls_send(SSL_get_wbio(sSSLConn)))
+    {
+        iState |= 0x01;
+        msHttpKtlsStats.txOffloaded += 1;
+    }
+    if(BIO_get_ktls_recv(SSL_get_rbio(sSSLConn)))
+    {
+        iState |= 0x02;
+        msHttpKtlsStats.rxOffloaded += 1;
+    }
+    #endif
+    if(iState == 0)
+    {
+        msHttpKtlsStats.fallbacks += 1;
+    }
+    if(iState != miHttpKtlsLastState)
+    {
+        printf("[%s] (%s) %s: Kernel TLS %s (%s).\n", (iState == 0) ? "WARNING" : "INFO", printTimestamp(), __func__,
+            (iState == 0x03) ? "on for both directions" : (iState == 0x01) ? "on for sending only" : (iState == 0x02) ? "on for receiving only" : "not available, OpenSSL does the record layer",
+            SSL_get_cipher_name(sSSLConn));
+        miHttpKtlsLastState = iState;
+    }
+}
+
+const tHttpKtlsStats *httpKtlsStats()
+{
+    return &msHttpKtlsStats;
+}
+
+void httpKtlsLog()
+{
+    if(msHttpKtlsStats.connections == 0)
+    {
+        return;
+    }
+    printf("[INFO] (%s) %s: %llu connections with kernel TLS asked for, %llu offloaded sending, %llu offloaded receiving, %llu fell back to user space.\n", printTimestamp(), __func__,
+        (unsigned long long)msHttpKtlsStats.connections, (unsigned long long)msHttpKtlsStats.txOffloaded,
+        (unsigned long long)msHttpKtlsStats.rxOffloaded, (unsigned long long)msHttpKtlsStats.fallbacks);
+}
+
+void httpDropSession()
+{
+    if(mpSSLSession != NULL)
+    {
+        SSL_SESSION_free(mpSSLSession);
+        mpSSLSession = NULL;
+        stateFileSetTlsSession(NULL, 0);
+    }
+}
+
 /*********************** sslInit ****************************
 
 ************************************************************/
@@ -440,6 +2884,40 @@ void sslInit()
     SSL_load_error_strings();
     SSL_library_init();
     sSSLContext = SSL_CTX_new(SSLv23_client_method());
+    // keep the session tickets ourselves so they can be stored in the state file
+    SSL_CTX_set_session_cache_mode(sSSLContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(sSSLContext, sslNewSessionCallback);
+}
+
+/********************* sslGetContext ************************
+    The one SSL context, shared by all transports.
+************************************************************/
+SSL_CTX *sslGetContext()
+{
+    return sSSLContext;
+}
+
+/****************** sslNewSessionCallback *******************
+    Called by OpenSSL for every new session (ticket) from the
+    server. Returning 1 means we keep the reference.
+************************************************************/
+int sslNewSessionCallback(SSL *sSSLConn, SSL_SESSION *pSession)
+{
+    uint8_t abSessionDer[STATEFILE_TLSSESSIONMAXSIZE];
+    uint8_t *pDer = abSessionDer;
+    int iLength = i2d_SSL_SESSION(pSession, NULL);
+
+    if(mpSSLSession != NULL)
+    {
+        SSL_SESSION_free(mpSSLSession);
+    }
+    mpSSLSession = pSession;
+    if(iLength > 0 && iLength <= STATEFILE_TLSSESSIONMAXSIZE)
+    {
+        i2d_SSL_SESSION(pSession, &pDer);
+        stateFileSetTlsSession(abSessionDer, iLength);
+    }
+    return 1;
 }
 
 /*********************** sslClose ***************************
@@ -3,18 +3,101 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <openssl/ssl.h>
+#include "SACStructs.h"
 
 #define HTTPMSGMAXSIZE          4096
-#define USESSL                  1
+#define USESSL                  1 // default of [comms] use_ssl, the other comms defines below are defaults of SACConfig.h as well
+#define COMMS_TRANSPORT_HTTP    0 // https GET per uplink (webhook)
+#define COMMS_TRANSPORT_MQTT    1 // MQTT 3.1.1 over TLS, persistent session
+#define COMMS_TRANSPORT_COAP    2 // CoAP over UDP (DTLS), confirmable POST per uplink
+#define COMMS_TRANSPORT_LAN     3 // framed TCP to a LAN gateway aggregator on the site (SACLanGateway.h)
+#define COMMS_TRANSPORT         COMMS_TRANSPORT_HTTP
 #define IOT_FRMSTARTTAG         '#'
 #define IOT_FRMENDTAG           '\n'
 #define IOT_HOST                "dashboard.safeandclean.be" // Todo assert that string length is <= than STRUCTS_SERVREQ_MAXSTRSIZE
 #define IOT_PATH                "/mobile/webhook" // Todo assert that string length is <= than STRUCTS_SERVREQ_MAXSTRSIZE
 #define IOT_DEVICEID            "SC-4GTEST" // Todo assert that string length is <= than STRUCTS_SERVREQ_MAXSTRSIZE
+#define HTTPSOCKETTIMEOUTSEC    10 // bounds connect, SSL_connect and every read/write on the socket
+#define COMMS_EXITDEADLINEMS    3000 // the summary sent at exit gives up after this, well inside systemd's stop timeout
+#define ADDUSERREPLYINREQUEST   1 // 1: send USERREPLYINREQUEST as &response=, debugging only
+#define USERREPLYINREQUEST      "35291f03beefbabe"
+#ifndef HTTPUSETCPFASTOPEN // -D in test builds
+#define HTTPUSETCPFASTOPEN      0 // 1: first bytes ride on the SYN (TCP_FASTOPEN_CONNECT, needs linux >= 4.11 and bit 0 of net.ipv4.tcp_fastopen)
+#endif
+#ifndef HTTPUSEEARLYDATA // -D in test builds
+#define HTTPUSEEARLYDATA        0 // 1: telemetry requests go out as TLS 1.3 0-RTT early data on a resumed session, server must drop replayed seqNrs
+#endif
+#define HTTPUSEKTLS             0 // default of [comms] ktls: record encryption moves into the kernel after the handshake (SSL_OP_ENABLE_KTLS, needs OpenSSL >= 3.0 built with ktls and the tls kernel module), user space as before when either is missing
+#define HTTPUSEIOURING          0 // default of [comms] io_uring: reactor exchanges submit connect, send and receive in batches on an io_uring (SACUring.h, linux >= 5.5), pipelined connections and hedging stay on epoll
+#define COMMS_MAXINFLIGHT       4 // uplinks in flight at the same time in reactor mode, one connection each
+#define HTTPPIPEDEPTH           0 // default of [comms] pipeline_depth: requests in flight on one kept alive connection (reactor mode), 0: a connection per request
+#define HTTPPIPE_MAXDEPTH       32
+#define HTTPPIPE_MAXREPLAYS     2 // broken connections a request may be the unanswered head of, then it fails
+#define CB_FAILURETHRESHOLD     3 // consecutive failed requests before the circuit breaker opens
+#define CB_BACKOFFMINMS         2000 // first open period of the circuit breaker
+#define CB_BACKOFFMAXMS         300000 // open period doubles after every failed half open trial up to this value
 
+typedef enum
+{
+    CB_CLOSED, // requests go out normally
+    CB_OPEN, // server considered unreachable, requests fail fast
+    CB_HALFOPEN, // backoff elapsed, the next request is a trial
+} tCircuitState;
+
+typedef struct
+{
+    uint64_t connections; // TLS connections set up with [comms] ktls on
+    uint64_t txOffloaded; // of those, the kernel encrypts what we send
+    uint64_t rxOffloaded; // of those, the kernel decrypts what we receive
+    uint64_t fallbacks; // neither direction offloaded, OpenSSL does the record layer
+} tHttpKtlsStats;
+
+typedef void (*tCommsDoneCallback)(tUplinkRecord *pRecord, int iResult);
+typedef void (*tCommsBulkCallback)(int iResult, uint32_t uiStored);
+
+typedef struct
+{
+    const char *name;
+    int (*init)(); // may be NULL
+    int (*sendUplink)(tUplinkRecord *pRecord); // fills the decked reply payload, < 0 on failure
+    void (*poll)(); // may be NULL
+    void (*close)(); // may be NULL
+    int (*startUplink)(tUplinkRecord *pRecord, tCommsDoneCallback pDone); // may be NULL, non blocking send driven by the reactor, calls commsUplinkFinished()
+} tCommsTransport;
+
+int commsInit();
+int commsSendUplink(tUplinkRecord *pRecord);
+int commsStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone);
+bool commsCanStartUplink();
+bool commsCanStartBackgroundUplink();
+void commsSetDeadline(uint64_t ulDeadlineUs);
+uint32_t commsTimeoutMs(uint32_t uiTimeoutMs);
+void commsUplinkFinished(tUplinkRecord *pRecord, int iResult, tCommsDoneCallback pDone);
+bool commsCanBulk();
+int commsSendBulk(const uint8_t *pBody, int iLength, uint32_t uiRecords, uint32_t *pStored);
+int commsStartBulk(const uint8_t *pBody, int iLength, uint32_t uiRecords, tCommsBulkCallback pDone);
+void commsPoll();
+void commsClose();
+void commsSetTransport(const tCommsTransport *pTransport);
+void commsApplyConfig(uint32_t uiChanged);
+const char *commsGetTransportName();
+uint32_t commsNextSeqNr();
+uint32_t commsRecordSeqNr(tUplinkRecord *pRecord);
+uint32_t commsReserveSeqNrs(uint32_t uiCount);
+const char *commsEncodingName(uint8_t bEncoding);
+void commsAddByteCounts(uint32_t uiTxBytes, uint32_t uiRxBytes);
+void commsGetByteCounts(uint64_t *pTxBytes, uint64_t *pRxBytes);
+bool commsCircuitAllowsRequest();
+tCircuitState commsGetCircuitState();
 int httpSendRequest();
-void httpBuildRequestMsg(uint32_t I2CRxPayloadAddress, int I2CRxPayloadLength);
+void httpBuildRequestMsg(uintptr_t I2CRxPayloadAddress, int I2CRxPayloadLength, long unsigned int ulEventTime, uint8_t bEncoding);
+int httpParseReplyMsg(char *sRawMessage);
+uint32_t httpPipeReplays();
+const tHttpKtlsStats *httpKtlsStats();
+void httpKtlsLog();
 void sslInit();
+SSL_CTX *sslGetContext();
 void sslClose();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include "SACStateFile.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memset */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stddef.h> /* offsetof */
+#include "stdio.h"
+#include "unistd.h"
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    tStateSlot slots[2];
+} tStateFile;
+
+/****************** private function prototypes *********************/
+uint32_t stateFileCrc32(const uint8_t *pData, uint32_t uiLength);
+bool stateFileSlotValid(tStateSlot *pSlot);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tStateFile *mpStateFile = NULL; // the mapping
+static tStateSlot msStateWorking; // in memory copy, written to the file on commit
+static int miStateCurrentSlot = 0;
+static bool mbStateDownlinkValid = false;
+/********************************************************************/
+
+/********************** stateFileOpen ***********************
+    Maps STATEFILE_PATH (creates it when needed) and loads
+    the newest valid slot.
+    Returns 0 when state was restored, 1 when starting
+    fresh and -1 when the file can't be used (the daemon
+    then runs without persistence).
+************************************************************/
+int stateFileOpen()
+{
+    int iFd;
+    int iResult = 1;
+
+    memset(&msStateWorking, 0, sizeof(msStateWorking));
+    iFd = open(STATEFILE_PATH, O_RDWR | O_CREAT, 0644);
+    if(iFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not open state file \'%s\', running without warm restart.\n", printTimestamp(), __func__, STATEFILE_PATH);
+        return -1;
+    }
+    if(ftruncate(iFd, sizeof(tStateFile)) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+    mpStateFile = mmap(NULL, sizeof(tStateFile), PROT_READ | PROT_WRITE, MAP_SHARED, iFd, 0);
+    close(iFd); // No need to keep the fd open after mmap
+    if(mpStateFile == MAP_FAILED)
+    {
+        printf("[ERROR] (%s) %s: Could not map state file.\n", printTimestamp(), __func__);
+        mpStateFile = NULL;
+        return -1;
+    }
+
+    if(mpStateFile->magic == STATEFILE_MAGIC && mpStateFile->version == STATEFILE_VERSION)
+    {
+        bool bValid0 = stateFileSlotValid(&mpStateFile->slots[0]);
+        bool bValid1 = stateFileSlotValid(&mpStateFile->slots[1]);
+        if(bValid0 || bValid1)
+        {
+            if(bValid0 && bValid1)
+            {
+                miStateCurrentSlot = (mpStateFile->slots[1].generation > mpStateFile->slots[0].generation) ? 1 : 0;
+            }
+            else
+            {
+                miStateCurrentSlot = bValid1 ? 1 : 0;
+            }
+            memcpy(&msStateWorking, &mpStateFile->slots[miStateCurrentSlot], sizeof(tStateSlot));
+            mbStateDownlinkValid = true;
+            iResult = 0;
+            printf("[INFO] (%s) %s: Restored state generation %u: seqNr %u, %u cached address(es), TLS session of %u bytes.\n", printTimestamp(), __func__, msStateWorking.generation, msStateWorking.seqNr, msStateWorking.nAddresses, msStateWorking.tlsSessionLength);
+        }
+    }
+    if(iResult != 0)
+    {
+        printf("[INFO] (%s) %s: No valid state in \'%s\', starting fresh.\n", printTimestamp(), __func__, STATEFILE_PATH);
+        memset(mpStateFile, 0, sizeof(tStateFile));
+        mpStateFile->magic = STATEFILE_MAGIC;
+        mpStateFile->version = STATEFILE_VERSION;
+        miStateCurrentSlot = 1; // first commit goes to slot 0
+    }
+    return iResult;
+}
+
+/********************* stateFileCommit **********************
+    Writes the working copy to the slot that is not current.
+    The stores land in the page cache right away so they
+    survive a crash of the process, msync only schedules the
+    write back for power loss.
+************************************************************/
+void stateFileCommit()
+{
+    if(mpStateFile == NULL)
+    {
+        return;
+    }
+    int iNextSlot = 1 - miStateCurrentSlot;
+    tStateSlot *pSlot = &mpStateFile->slots[iNextSlot];
+
+    msStateWorking.generation += 1;
+    msStateWorking.crc = stateFileCrc32((uint8_t *)&msStateWorking, offsetof(tStateSlot, crc));
+    pSlot->crc = 0; // invalidate before touching the rest
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(pSlot, &msStateWorking, offsetof(tStateSlot, crc));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    pSlot->crc = msStateWorking.crc;
+    miStateCurrentSlot = iNextSlot;
+    msync(mpStateFile, sizeof(tStateFile), MS_ASYNC);
+}
+
+void stateFileClose()
+{
+    if(mpStateFile == NULL)
+    {
+        return;
+    }
+    msync(mpStateFile, sizeof(tStateFile), MS_SYNC);
+    munmap(mpStateFile, sizeof(tStateFile));
+    mpStateFile = NULL;
+}
+
+uint32_t stateFileGetSeqNr()
+{
+    return msStateWorking.seqNr;
+}
+
+void stateFileSetSeqNr(uint32_t uiSeqNr)
+{
+    msStateWorking.seqNr = uiSeqNr;
+}
+
+/******************* stateFileGetAddresses ******************
+    Returns the number of cached addresses for sHost, 0 when
+    none or when they are older than STATEFILE_DNSMAXAGESEC.
+************************************************************/
+int stateFileGetAddresses(const char *sHost, uint32_t *pAddresses, int iMaxAddresses)
+{
+    int i;
+    if(msStateWorking.nAddresses == 0 || strncmp(msStateWorking.host, sHost, sizeof(msStateWorking.host)) != 0)
+    {
+        return 0;
+    }
+    if((uint64_t)printGetUnixEpochTimeAsInt() > msStateWorking.addressesResolvedAt + STATEFILE_DNSMAXAGESEC)
+    {
+        return 0;
+    }
+    for(i=0; i<(int)msStateWorking.nAddresses && i<iMaxAddresses; i+=1)
+    {
+        pAddresses[i] = msStateWorking.addresses[i];
+    }
+    return i;
+}
+
+void stateFileSetAddresses(const char *sHost, uint32_t *pAddresses, int iAddresses)
+{
+    int i;
+    snprintf(msStateWorking.host, sizeof(msStateWorking.host), "%s", sHost);
+    for(i=0; i<iAddresses && i<STATEFILE_MAXADDRESSES; i+=1)
+    {
+        msStateWorking.addresses[i] = pAddresses[i];
+    }
+    msStateWorking.nAddresses = i;
+    msStateWorking.addressesResolvedAt = printGetUnixEpochTimeAsInt();
+}
+
+void stateFileInvalidateAddresses()
+{
+    msStateWorking.nAddresses = 0;
+}
+
+uint32_t stateFileGetTlsSession(const uint8_t **ppSession)
+{
+    *ppSession = msStateWorking.tlsSession;
+    return msStateWorking.tlsSessionLength;
+}
+
+void stateFileSetTlsSession(const uint8_t *pSession, uint32_t uiLength)
+{
+    if(uiLength > STATEFILE_TLSSESSIONMAXSIZE)
+    {
+        uiLength = 0; // doesn't fit, better no session than a truncated one
+    }
+    if(uiLength > 0)
+    {
+        memcpy(msStateWorking.tlsSession, pSession, uiLength);
+    }
+    msStateWorking.tlsSessionLength = uiLength;
+}
+
+bool stateFileGetLastDownlink(uint8_t *pDest)
+{
+    if(!mbStateDownlinkValid)
+    {
+        return false;
+    }
+    memcpy(pDest, msStateWorking.lastDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    return true;
+}
+
+void stateFileSetLastDownlink(const uint8_t *pSource)
+{
+    memcpy(msStateWorking.lastDownlink, pSource, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    mbStateDownlinkValid = true;
+}
+
+bool stateFileSlotValid(tStateSlot *pSlot)
+{
+    return (pSlot->generation != 0 && pSlot->crc == stateFileCrc32((uint8_t *)pSlot, offsetof(tStateSlot, crc)));
+}
+
+/********************* stateFileCrc32 ***********************
+    Plain bitwise CRC-32 (IEEE 802.3), the slots are small
+    and only written a few times per uplink.
+************************************************************/
+uint32_t stateFileCrc32(const uint8_t *pData, uint32_t uiLength)
+{
+    uint32_t uiCrc = 0xFFFFFFFF;
+    uint32_t i;
+    int iBit;
+    for(i=0; i<uiLength; i+=1)
+    {
+        uiCrc ^= pData[i];
+        for(iBit=0; iBit<8; iBit+=1)
+        {
+            uiCrc = (uiCrc >> 1) ^ (0xEDB88320 & (0 - (uiCrc & 1)));
+        }
+    }
+    return ~uiCrc;
+}
@@ -0,0 +1,51 @@
+#ifndef SACSTATEFILE_H
+#define SACSTATEFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#ifndef STATEFILE_PATH // -D in test builds (make soaktest)
+#define STATEFILE_PATH                  "/home/pi/iot/SACIot.state"
+#endif
+#define STATEFILE_MAGIC                 0x53414353 // "SACS"
+#define STATEFILE_VERSION               1
+#define STATEFILE_TLSSESSIONMAXSIZE     2048
+#define STATEFILE_MAXADDRESSES          4
+#define STATEFILE_DNSMAXAGESEC          3600 // resolve again after this, even if the cached address still works
+
+/*
+    State that survives a daemon restart. The file holds two
+    slots; a commit writes the slot that is not current and
+    finishes with its CRC, so a crash halfway leaves the other
+    slot intact. On open the valid slot with the highest
+    generation wins.
+*/
+typedef struct
+{
+    uint32_t generation;
+    uint32_t seqNr; // next sequence number to use
+    char host[STRUCTS_SERVREQ_MAXSTRSIZE]; // host the addresses belong to
+    uint32_t nAddresses;
+    uint32_t addresses[STATEFILE_MAXADDRESSES]; // IPv4, network byte order
+    uint64_t addressesResolvedAt; // unix time
+    uint8_t lastDownlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    uint32_t tlsSessionLength; // 0: no session
+    uint8_t tlsSession[STATEFILE_TLSSESSIONMAXSIZE]; // DER (i2d_SSL_SESSION)
+    uint32_t crc; // crc32 of everything above, written last
+} tStateSlot;
+
+int stateFileOpen();
+void stateFileCommit();
+void stateFileClose();
+uint32_t stateFileGetSeqNr();
+void stateFileSetSeqNr(uint32_t uiSeqNr);
+int stateFileGetAddresses(const char *sHost, uint32_t *pAddresses, int iMaxAddresses);
+void stateFileSetAddresses(const char *sHost, uint32_t *pAddresses, int iAddresses);
+void stateFileInvalidateAddresses();
+uint32_t stateFileGetTlsSession(const uint8_t **ppSession);
+void stateFileSetTlsSession(const uint8_t *pSession, uint32_t uiLength);
+bool stateFileGetLastDownlink(uint8_t *pDest);
+void stateFileSetLastDownlink(const uint8_t *pSource);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+    Reader for the live status segment of SACRPiIotSlave.
+
+    Usage:
+        SACStatusReader             print the status once
+        SACStatusReader -w <ms>     print it every <ms> milliseconds
+        SACStatusReader -t <sec>    reader/writer consistency test under load, on a
+                                    private segment (the daemon may keep running)
+
+    Compile:
+        gcc -Wall -pthread -o SACStatusReader SACStatusReader.c SACStatusShm.c SACPrintUtils.c -lrt
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memset */
+#include "unistd.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "SACStatusShm.h"
+#include "SACPrintUtils.h"
+
+#define READER_TESTSHMNAME      "/SACIot.status.test"
+#define READER_TESTREADERS      3
+
+/******************** Globals ***********************/
+const char *asReaderStateNames[] = // tSmState
+{
+    "S_IDLE", "S_PARSEIOTHEADER", "S_FLAGERROR_UNKNOWNCMD", "S_FLAGERROR_INVALIDSTX",
+    "S_FLAGERROR_INVALIDETX", "S_PARSECMDSEND", "S_PARSECMDREADENA", "S_BUILDRESPONSE",
+    "S_DISSABLEI2CPERIPH", "S_SENDHTTPREQUEST", "S_WAITHTTPRESPONSE", "S_ENABLEI2CPERIPH",
+    "S_PARSECMDTAGGED", "S_PARSECMDSTATUS",
+};
+const char *asReaderCircuitNames[] = {"closed", "open", "half open"}; // tCircuitState
+volatile bool bReaderTestRunning = false;
+/****************************************************/
+
+/******************** Prototypes ********************/
+void readerPrint(const tStatusData *pStatus, uint32_t uiRetries);
+int readerConsistencyTest(uint32_t uiSeconds);
+void *readerTestWriter(void *pArg);
+void *readerTestReader(void *pArg);
+/****************************************************/
+
+int main(int argc, char* argv[])
+{
+    const tStatusShm *pShm;
+    tStatusData sStatus;
+    uint32_t uiRetries;
+    int iWatchMs = -1;
+    int iOption;
+
+    while((iOption = getopt(argc, argv, "w:t:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'w':
+                iWatchMs = atoi(optarg);
+                break;
+            case 't':
+                return readerConsistencyTest(atoi(optarg));
+            default:
+                fprintf(stderr, "usage: %s [-w ms] [-t sec]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    pShm = statusShmAttach(STATUSSHM_NAME);
+    if(pShm == NULL)
+    {
+        fprintf(stderr, "No status segment \'%s\' (daemon not running or other version %u).\n", STATUSSHM_NAME, STATUSSHM_VERSION);
+        return 1;
+    }
+    do
+    {
+        if(!statusShmRead(pShm, &sStatus, &uiRetries))
+        {
+            fprintf(stderr, "No consistent status after %u retries, writer stuck?\n", uiRetries);
+            return 1;
+        }
+        readerPrint(&sStatus, uiRetries);
+        if(iWatchMs > 0)
+        {
+            usleep(iWatchMs * 1000);
+        }
+    } while(iWatchMs > 0);
+    return 0;
+}
+
+void readerPrint(const tStatusData *pStatus, uint32_t uiRetries)
+{
+    uint64_t ulAgeMs = (printGetMonotonicTimeUs() - pStatus->publishedUs) / 1000;
+    const char *sState = (pStatus->smState < sizeof(asReaderStateNames) / sizeof(asReaderStateNames[0])) ? asReaderStateNames[pStatus->smState] : "?";
+    const char *sCircuit = (pStatus->circuitState < 3) ? asReaderCircuitNames[pStatus->circuitState] : "?";
+
+    printf("pid %u, published %llu ms ago (%u retries)%s\n", pStatus->pid, (unsigned long long)ulAgeMs, uiRetries, (pStatus->checksum == statusShmChecksum(pStatus)) ? "" : " CHECKSUM MISMATCH");
+    printf("  state        %s%s\n", sState, pStatus->reactorMode ? " (reactor)" : "");
+    printf("  last rx      %s\n", printBytesAsHexString((uintptr_t)pStatus->lastRxFrame, pStatus->lastRxFrameLength, true, ", "));
+    printf("  last tx      %s\n", printBytesAsHexString((uintptr_t)pStatus->lastTxFrame, pStatus->lastTxFrameLength, true, ", "));
+    printf("  error code   0x%02x\n", pStatus->lastErrorCode);
+    printf("  link         %s, circuit %s, seqNr %u\n", pStatus->transport, sCircuit, pStatus->seqNr);
+    printf("  i2c frames   %llu, service last %u us max %u us\n", (unsigned long long)pStatus->i2cFrames, pStatus->lastI2cServiceUs, pStatus->maxI2cServiceUs);
+    printf("  uplinks      %llu ok, %llu failed, %u queued, dropped %u/%u/%u\n", (unsigned long long)pStatus->uplinksOk, (unsigned long long)pStatus->uplinksFailed, pStatus->uplinksPending, pStatus->uplinksDropped[0], pStatus->uplinksDropped[1], pStatus->uplinksDropped[2]);
+    printf("  uplink time  last %u ms, avg %u ms, max %u ms\n", pStatus->lastUplinkMs, pStatus->avgUplinkMs, pStatus->maxUplinkMs);
+    printf("  bytes        tx %llu, rx %llu\n", (unsigned long long)pStatus->txBytes, (unsigned long long)pStatus->rxBytes);
+    printf("  bsc recovery abort %u, reopen %u, reinit %u, last %u us max %u us\n", pStatus->bscRecoveries[0], pStatus->bscRecoveries[1], pStatus->bscRecoveries[2], pStatus->lastBscRecoveryUs, pStatus->maxBscRecoveryUs);
+}
+
+/***************** readerConsistencyTest ********************
+    One writer publishes as fast as it can, every field
+    derived from one counter. READER_TESTREADERS readers
+    check every copy: checksum and all fields must agree.
+    Returns 0 when no torn copy was seen.
+************************************************************/
+int readerConsistencyTest(uint32_t uiSeconds)
+{
+    pthread_t sWriter;
+    pthread_t asReaders[READER_TESTREADERS];
+    uint64_t aulResults[READER_TESTREADERS][3]; // reads, retries, torn
+    uint64_t ulReads = 0;
+    uint64_t ulRetries = 0;
+    uint64_t ulTorn = 0;
+    int i;
+
+    if(statusShmOpen(READER_TESTSHMNAME) < 0)
+    {
+        return 1;
+    }
+    memset(aulResults, 0, sizeof(aulResults));
+    bReaderTestRunning = true;
+    pthread_create(&sWriter, NULL, readerTestWriter, NULL);
+    for(i=0; i<READER_TESTREADERS; i+=1)
+    {
+        pthread_create(&asReaders[i], NULL, readerTestReader, aulResults[i]);
+    }
+    sleep(uiSeconds);
+    bReaderTestRunning = false;
+    pthread_join(sWriter, NULL);
+    for(i=0; i<READER_TESTREADERS; i+=1)
+    {
+        pthread_join(asReaders[i], NULL);
+        ulReads += aulResults[i][0];
+        ulRetries += aulResults[i][1];
+        ulTorn += aulResults[i][2];
+    }
+    statusShmClose();
+    printf("%u s, %i readers: %llu reads, %llu retries, %llu torn\n", uiSeconds, READER_TESTREADERS, (unsigned long long)ulReads, (unsigned long long)ulRetries, (unsigned long long)ulTorn);
+    return (ulTorn == 0 && ulReads > 0) ? 0 : 1;
+}
+
+void *readerTestWriter(void *pArg)
+{
+    tStatusData *pStatus = statusShmData();
+    uint64_t ulCounter = 0;
+    while(bReaderTestRunning)
+    {
+        ulCounter += 1;
+        pStatus->i2cFrames = ulCounter;
+        pStatus->uplinksOk = ulCounter;
+        pStatus->txBytes = ulCounter;
+        memset(pStatus->lastRxFrame, (uint8_t)ulCounter, sizeof(pStatus->lastRxFrame));
+        statusShmPublish();
+    }
+    return NULL;
+}
+
+void *readerTestReader(void *pArg)
+{
+    uint64_t *pResults = (uint64_t *)pArg;
+    const tStatusShm *pShm = statusShmAttach(READER_TESTSHMNAME);
+    tStatusData sStatus;
+    uint32_t uiRetries;
+    uint32_t i;
+    bool bTorn;
+
+    if(pShm == NULL)
+    {
+        pResults[2] = 1;
+        return NULL;
+    }
+    while(bReaderTestRunning)
+    {
+        if(!statusShmRead(pShm, &sStatus, &uiRetries))
+        {
+            continue;
+        }
+        pResults[0] += 1;
+        pResults[1] += uiRetries;
+        bTorn = (sStatus.checksum != statusShmChecksum(&sStatus));
+        bTorn = bTorn || sStatus.uplinksOk != sStatus.i2cFrames || sStatus.txBytes != sStatus.i2cFrames;
+        for(i=0; i<sizeof(sStatus.lastRxFrame); i+=1)
+        {
+            bTorn = bTorn || sStatus.lastRxFrame[i] != (uint8_t)sStatus.i2cFrames;
+        }
+        if(bTorn)
+        {
+            pResults[2] += 1;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,234 @@
+#include "SACStatusShm.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memset */
+#include <stddef.h> /* offsetof */
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stdio.h"
+#include "unistd.h"
+
+/******************** private global variables **********************/
+static tStatusShm *mpStatusShm = NULL; // the mapping, writer side
+static tStatusData msStatusWorking; // updated in place, copied to the segment by statusShmPublish()
+static const char *msStatusShmName = NULL;
+static uint32_t muiStatusSeq = 0; // only the writer changes seq
+/********************************************************************/
+
+/********************** statusShmOpen ***********************
+    Creates (or takes over) the segment. Returns 0 or -1,
+    the daemon then just runs without it.
+************************************************************/
+int statusShmOpen(const char *sName)
+{
+    int iFd;
+
+    memset(&msStatusWorking, 0, sizeof(msStatusWorking));
+    msStatusWorking.pid = (uint32_t)getpid();
+    iFd = shm_open(sName, O_RDWR | O_CREAT, 0644);
+    if(iFd < 0)
+    {
+        printf("[ERROR] (%s) %s: Could not open shared memory \'%s\'.\n", printTimestamp(), __func__, sName);
+        return -1;
+    }
+    if(ftruncate(iFd, sizeof(tStatusShm)) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+    mpStatusShm = mmap(NULL, sizeof(tStatusShm), PROT_READ | PROT_WRITE, MAP_SHARED, iFd, 0);
+    close(iFd);
+    if(mpStatusShm == MAP_FAILED)
+    {
+        printf("[ERROR] (%s) %s: Could not map shared memory.\n", printTimestamp(), __func__);
+        mpStatusShm = NULL;
+        return -1;
+    }
+    // continue the sequence of a previous daemon, readers still attached to it stay consistent
+    muiStatusSeq = (__atomic_load_n(&mpStatusShm->seq, __ATOMIC_RELAXED) + 1) | 1;
+    __atomic_store_n(&mpStatusShm->seq, muiStatusSeq, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    mpStatusShm->magic = STATUSSHM_MAGIC;
+    mpStatusShm->version = STATUSSHM_VERSION;
+    mpStatusShm->size = sizeof(tStatusShm);
+    muiStatusSeq += 1;
+    __atomic_store_n(&mpStatusShm->seq, muiStatusSeq, __ATOMIC_RELEASE);
+    msStatusShmName = sName;
+    statusShmPublish();
+    printf("[INFO] (%s) %s: Publishing status in \'%s\' (%u bytes).\n", printTimestamp(), __func__, sName, (uint32_t)sizeof(tStatusShm));
+    return 0;
+}
+
+void statusShmClose()
+{
+    if(mpStatusShm == NULL)
+    {
+        return;
+    }
+    munmap(mpStatusShm, sizeof(tStatusShm));
+    mpStatusShm = NULL;
+    shm_unlink(msStatusShmName); // readers keep their mapping, new ones see the daemon is gone
+}
+
+/********************** statusShmData ***********************
+    The working copy, fill in what changed and call
+    statusShmPublish().
+************************************************************/
+tStatusData *statusShmData()
+{
+    return &msStatusWorking;
+}
+
+/******************** statusShmPublish **********************
+    Copies the working copy into the segment under the
+    sequence lock. A few hundred bytes, never waits.
+************************************************************/
+void statusShmPublish()
+{
+    if(mpStatusShm == NULL)
+    {
+        return;
+    }
+    msStatusWorking.publishedUs = printGetMonotonicTimeUs();
+    msStatusWorking.publishedUnix = printGetUnixEpochTimeAsInt();
+    msStatusWorking.checksum = statusShmChecksum(&msStatusWorking);
+
+    muiStatusSeq += 1;
+    __atomic_store_n(&mpStatusShm->seq, muiStatusSeq, __ATOMIC_RELAXED); // odd: update in progress
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&mpStatusShm->data, &msStatusWorking, sizeof(tStatusData));
+    muiStatusSeq += 1;
+    __atomic_store_n(&mpStatusShm->seq, muiStatusSeq, __ATOMIC_RELEASE); // even: consistent
+}
+
+void statusShmSetFrame(bool bRx, const uint8_t *pFrame, uint32_t uiLength)
+{
+    if(uiLength > STATUSSHM_FRAMEMAXSIZE)
+    {
+        uiLength = STATUSSHM_FRAMEMAXSIZE;
+    }
+    if(bRx)
+    {
+        memcpy(msStatusWorking.lastRxFrame, pFrame, uiLength);
+        msStatusWorking.lastRxFrameLength = uiLength;
+        msStatusWorking.lastRxFrameUnix = printGetUnixEpochTimeAsInt();
+        msStatusWorking.i2cFrames += 1;
+    }
+    else
+    {
+        memcpy(msStatusWorking.lastTxFrame, pFrame, uiLength);
+        msStatusWorking.lastTxFrameLength = uiLength;
+        msStatusWorking.lastTxFrameUnix = printGetUnixEpochTimeAsInt();
+    }
+}
+
+void statusShmUplinkResult(bool bSuccess, uint32_t uiDurationMs)
+{
+    if(bSuccess)
+    {
+        msStatusWorking.uplinksOk += 1;
+    }
+    else
+    {
+        msStatusWorking.uplinksFailed += 1;
+    }
+    msStatusWorking.lastUplinkMs = uiDurationMs;
+    msStatusWorking.avgUplinkMs = (msStatusWorking.avgUplinkMs * 7 + uiDurationMs) / 8;
+    if(uiDurationMs > msStatusWorking.maxUplinkMs)
+    {
+        msStatusWorking.maxUplinkMs = uiDurationMs;
+    }
+}
+
+void statusShmI2cServiced(uint32_t uiServiceUs)
+{
+    msStatusWorking.lastI2cServiceUs = uiServiceUs;
+    if(uiServiceUs > msStatusWorking.maxI2cServiceUs)
+    {
+        msStatusWorking.maxI2cServiceUs = uiServiceUs;
+    }
+}
+
+/********************* statusShmAttach **********************
+    Maps the segment read only. Returns NULL when the daemon
+    doesn't publish one or the layout doesn't match.
+************************************************************/
+const tStatusShm *statusShmAttach(const char *sName)
+{
+    int iFd;
+    const tStatusShm *pShm;
+    struct stat sStat;
+
+    iFd = shm_open(sName, O_RDONLY, 0);
+    if(iFd < 0)
+    {
+        return NULL;
+    }
+    if(fstat(iFd, &sStat) < 0 || sStat.st_size < (off_t)sizeof(tStatusShm))
+    {
+        close(iFd);
+        return NULL;
+    }
+    pShm = mmap(NULL, sizeof(tStatusShm), PROT_READ, MAP_SHARED, iFd, 0);
+    close(iFd);
+    if(pShm == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if(pShm->magic != STATUSSHM_MAGIC || pShm->version != STATUSSHM_VERSION || pShm->size != sizeof(tStatusShm))
+    {
+        munmap((void *)pShm, sizeof(tStatusShm));
+        return NULL;
+    }
+    return pShm;
+}
+
+/********************** statusShmRead ***********************
+    Consistent copy of the published status, no syscalls.
+    pRetries (may be NULL) gets the number of retries.
+    Returns false when no consistent copy was seen within
+    STATUSSHM_READRETRIES attempts.
+************************************************************/
+bool statusShmRead(const tStatusShm *pShm, tStatusData *pData, uint32_t *pRetries)
+{
+    uint32_t uiSeqBefore;
+    uint32_t uiSeqAfter;
+    uint32_t uiTry;
+
+    for(uiTry=0; uiTry<STATUSSHM_READRETRIES; uiTry+=1)
+    {
+        uiSeqBefore = __atomic_load_n(&pShm->seq, __ATOMIC_ACQUIRE);
+        if((uiSeqBefore & 1) == 0)
+        {
+            memcpy(pData, (const void *)&pShm->data, sizeof(tStatusData));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            uiSeqAfter = __atomic_load_n(&pShm->seq, __ATOMIC_RELAXED);
+            if(uiSeqAfter == uiSeqBefore)
+            {
+                if(pRetries != NULL)
+                {
+                    *pRetries = uiTry;
+                }
+                return true;
+            }
+        }
+    }
+    if(pRetries != NULL)
+    {
+        *pRetries = uiTry;
+    }
+    return false;
+}
+
+uint32_t statusShmChecksum(const tStatusData *pData)
+{
+    const uint8_t *pBytes = (const uint8_t *)pData;
+    uint32_t uiHash = 2166136261u;
+    uint32_t i;
+    for(i=0; i<offsetof(tStatusData, checksum); i+=1)
+    {
+        uiHash = (uiHash ^ pBytes[i]) * 16777619u;
+    }
+    return uiHash;
+}
@@ -0,0 +1,84 @@
+#ifndef SACSTATUSSHM_H
+#define SACSTATUSSHM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#ifndef STATUSSHM_NAME // -D in test builds (make soaktest)
+#define STATUSSHM_NAME          "/SACIot.status" // shows up as /dev/shm/SACIot.status
+#endif
+#define STATUSSHM_MAGIC         0x53414354 // "SACT"
+#define STATUSSHM_VERSION       2 // bump when tStatusData changes
+#define STATUSSHM_FRAMEMAXSIZE  32
+#define STATUSSHM_READRETRIES   10000 // reader gives up when the writer died halfway an update
+
+/*
+    Live status of the daemon for local tools. The daemon is
+    the only writer, any number of readers map the segment
+    read only. Updates are protected by a sequence lock: the
+    writer makes seq odd, copies tStatusData, makes seq even
+    again. Readers copy and retry when seq was odd or changed
+    meanwhile, so the writer never waits for a reader.
+*/
+
+typedef struct
+{
+    uint64_t publishedUs; // monotonic time of this update
+    uint64_t publishedUnix;
+    uint32_t pid;
+    uint32_t smState; // tSmState
+    uint32_t reactorMode;
+    uint8_t lastRxFrame[STATUSSHM_FRAMEMAXSIZE]; // last frame from the controller
+    uint32_t lastRxFrameLength;
+    uint64_t lastRxFrameUnix;
+    uint8_t lastTxFrame[STATUSSHM_FRAMEMAXSIZE]; // last response to the controller (decked reply)
+    uint32_t lastTxFrameLength;
+    uint64_t lastTxFrameUnix;
+    uint8_t lastErrorCode; // I2CERRORCODE_*
+    uint8_t circuitState; // tCircuitState
+    uint8_t reserved[2];
+    char transport[8];
+    uint32_t seqNr; // next uplink sequence number
+    uint64_t i2cFrames;
+    uint64_t uplinksOk;
+    uint64_t uplinksFailed;
+    uint64_t txBytes;
+    uint64_t rxBytes;
+    uint32_t uplinksPending;
+    uint32_t uplinksDropped[3]; // per tUplinkClass
+    uint32_t lastUplinkMs; // duration of the last uplink exchange
+    uint32_t avgUplinkMs; // moving average (1/8)
+    uint32_t maxUplinkMs;
+    uint32_t lastI2cServiceUs; // frame received until the state machine is idle again
+    uint32_t maxI2cServiceUs;
+    uint32_t bscRecoveries[3]; // wedged bsc peripheral recoveries per stage: abort, reopen, gpio reinit
+    uint32_t lastBscRecoveryUs; // stall detected until the bsc worked again
+    uint32_t maxBscRecoveryUs;
+    uint32_t checksum; // FNV-1a of everything above, lets readers verify their copy
+} tStatusData;
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(tStatusShm)
+    uint32_t seq; // sequence lock, odd while the writer is busy
+    tStatusData data;
+} tStatusShm;
+
+/* writer side, the daemon */
+int statusShmOpen(const char *sName);
+void statusShmClose();
+tStatusData *statusShmData();
+void statusShmPublish();
+void statusShmSetFrame(bool bRx, const uint8_t *pFrame, uint32_t uiLength);
+void statusShmUplinkResult(bool bSuccess, uint32_t uiDurationMs);
+void statusShmI2cServiced(uint32_t uiServiceUs);
+
+/* reader side */
+const tStatusShm *statusShmAttach(const char *sName);
+bool statusShmRead(const tStatusShm *pShm, tStatusData *pData, uint32_t *pRetries);
+uint32_t statusShmChecksum(const tStatusData *pData);
+
+#endif
@@ -92,4 +92,30 @@ tCtrlDeckedReply *getCtrlDeckedReply()
 {
     return &sCtrlDeckedReply;
 }
-/********************************/
\ No newline at end of file
+/********************************/
+
+/****************** structsGetPayloadField ******************
+    Field of iWidth (1..4) bytes at iOffset of a controller
+    payload. The controller writes its fields little endian,
+    every module that reads a field (edge aggregation, local
+    rules) goes through here.
+************************************************************/
+uint32_t structsGetPayloadField(const uint8_t *pPayload, int iOffset, int iWidth)
+{
+    uint32_t uiValue = 0;
+    int i;
+    for(i=iWidth - 1; i>=0; i-=1)
+    {
+        uiValue = (uiValue << 8) | pPayload[iOffset + i];
+    }
+    return uiValue;
+}
+
+void structsSetPayloadField(uint8_t *pPayload, int iOffset, int iWidth, uint32_t uiValue)
+{
+    int i;
+    for(i=0; i<iWidth; i+=1)
+    {
+        pPayload[iOffset + i] = (uint8_t)(uiValue >> (8 * i));
+    }
+}
@@ -29,6 +29,34 @@ typedef union
     uint8_t ui8[STRUCTS_SENDCMDTOTALSIZE];
 } tCtrlSendCmd; // contains upstream payload
 
+typedef union
+{
+    struct
+    {
+        uint8_t startTag;
+        uint8_t cmdCode; // ASYNCCMD_CMDCODE_SEND
+        uint8_t tag;
+        uint8_t sendCmdCode; // 0x02 or UPLSCHED_CMDCODE_ALARM, from here on the layout of tCtrlSendCmd
+        uint8_t payloadSize;
+        uint8_t downlinkIndicator;
+        uint8_t payload[STRUCTS_SENDCMDPAYLOADSIZE];
+        uint8_t endTag;
+    };
+    uint8_t ui8[STRUCTS_SENDCMDTOTALSIZE + 2];
+} tCtrlTaggedSendCmd; // send command answered right away, completion is queried by tag
+
+typedef union
+{
+    struct
+    {
+        uint8_t startTag;
+        uint8_t cmdCode; // ASYNCCMD_CMDCODE_STATUS
+        uint8_t tag;
+        uint8_t endTag;
+    };
+    uint8_t ui8[4];
+} tCtrlStatusCmd;
+
 typedef union
 {
     struct
@@ -80,6 +108,28 @@ typedef struct
     char *data; // data as hex-string e.g. "01000000001ecc36301fffff" 
 } tServerRequest;
 
+typedef enum
+{
+    UPLENC_RAW, // payload as the controller sent it
+    UPLENC_KEYFRAME, // edge aggregation: absolute record, starts a delta chain
+    UPLENC_DELTA, // edge aggregation: changes since the previous record of the chain (SACEdgeAgg.h)
+    UPLENC_COUNT,
+} tUplinkEncoding;
+
+typedef struct
+{
+    tCtrlSendCmd cmd; // copy of the send command as received from the controller, or built by the edge aggregation
+    uint8_t priorityClass; // tUplinkClass
+    uint32_t id; // assigned by the uplink scheduler
+    long unsigned int time; // unix time at which the controller sent the command
+    uint64_t enqueueTimeUs; // monotonic time, for queueing latency
+    uint64_t sendStartUs; // monotonic time the transport got it, for the exchange duration
+    uint8_t encoding; // tUplinkEncoding of cmd.payload
+    uint8_t hasSeqNr; // bulk upload: seqNr is assigned, a block sent again keeps the numbers
+    uint32_t seqNr;
+    char origin[STRUCTS_SERVREQ_MAXSTRSIZE]; // LAN gateway: device id of the slave that forwarded it (SACLanGateway.h), empty: this device
+} tUplinkRecord;
+
 typedef struct
 {
     int replycode;
@@ -94,5 +144,7 @@ tCtrlReadEnaCmd *getLastReadEnaCmd();
 tServerReply *getLastServerReply();
 tServerRequest *getLastServerRequest();
 tCtrlDeckedReply *getCtrlDeckedReply();
+uint32_t structsGetPayloadField(const uint8_t *pPayload, int iOffset, int iWidth);
+void structsSetPayloadField(uint8_t *pPayload, int iOffset, int iWidth, uint32_t uiValue);
 
 #endif
\ No newline at end of file
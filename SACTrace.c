@@ -0,0 +1,234 @@
+#include "SACTrace.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy, memset */
+#include <pthread.h>
+#include <sys/syscall.h> /* SYS_gettid */
+#include "stdio.h"
+#include "unistd.h"
+
+/*
+    Span tracing of the state machine and the comms phases.
+    Producers (any thread) push events in a bounded lock free
+    multi producer ring (D. Vyukov's bounded queue). A single
+    background thread drains the ring and writes them to
+    TRACE_FILEPATH in the Chrome trace event format.
+    When the ring is full events are dropped and counted,
+    the producer never blocks.
+*/
+
+#define TRACE_RINGMASK      (TRACE_RINGSIZE - 1)
+
+typedef struct
+{
+    uint32_t uiSeq; // ring slot sequence (Vyukov)
+    char cPhase; // 'B' begin, 'E' end
+    int32_t iTid;
+    uint64_t ulTimeUs;
+    const char *sName;
+} tTraceEvent;
+
+/****************** private function prototypes *********************/
+void *traceFlushThread(void *pArg);
+bool traceDequeue(tTraceEvent *pDest);
+void traceOpenFile();
+void traceCloseFile();
+void traceDrainToFile();
+/********************************************************************/
+
+/******************** private global variables **********************/
+volatile sig_atomic_t bTraceEnabled = TRACE_ENABLEDATSTARTUP;
+static tTraceEvent masTraceRing[TRACE_RINGSIZE];
+static uint32_t muiTraceHead = 0; // next slot to be claimed by a producer
+static uint32_t muiTraceTail = 0; // next slot to be read by the flush thread
+static uint32_t muiTraceDropped = 0;
+static FILE *mpTraceFile = NULL;
+static bool mbTraceFirstEvent = true;
+static volatile bool mbTraceRunning = false;
+static pthread_t msTraceThread;
+static int32_t miTracePid = 0;
+static __thread int32_t miTraceTid = 0;
+/********************************************************************/
+
+/************************ traceInit *************************
+    Starts the background flush thread.
+************************************************************/
+void traceInit()
+{
+    uint32_t i;
+    for(i=0; i<TRACE_RINGSIZE; i+=1)
+    {
+        masTraceRing[i].uiSeq = i;
+    }
+    miTracePid = (int32_t)getpid();
+    mbTraceRunning = true;
+    if(pthread_create(&msTraceThread, NULL, traceFlushThread, NULL) != 0)
+    {
+        printf("[ERROR] (%s) %s: Could not start trace flush thread, tracing disabled.\n", printTimestamp(), __func__);
+        mbTraceRunning = false;
+        bTraceEnabled = 0;
+        return;
+    }
+    printf("[INFO] (%s) %s: Tracing is %s, send signal %i to toggle. Output: %s\n", printTimestamp(), __func__, bTraceEnabled ? "on" : "off", TRACE_TOGGLESIGNAL, TRACE_FILEPATH);
+}
+
+/************************ traceClose ************************
+    Stops the flush thread and finalizes the trace file.
+************************************************************/
+void traceClose()
+{
+    if(!mbTraceRunning)
+    {
+        return;
+    }
+    bTraceEnabled = 0;
+    mbTraceRunning = false;
+    pthread_join(msTraceThread, NULL);
+}
+
+/************************ traceEvent ************************
+    Never blocks. Use the TRACE_BEGIN/TRACE_END macros,
+    they skip the call when tracing is off.
+************************************************************/
+void traceEvent(const char *sName, char cPhase)
+{
+    uint64_t ulNow = printGetMonotonicTimeUs();
+    tTraceEvent *pCell;
+    uint32_t uiPos = __atomic_load_n(&muiTraceHead, __ATOMIC_RELAXED);
+
+    if(miTraceTid == 0)
+    {
+        miTraceTid = (int32_t)syscall(SYS_gettid);
+    }
+
+    while(1)
+    {
+        pCell = &masTraceRing[uiPos & TRACE_RINGMASK];
+        uint32_t uiSeq = __atomic_load_n(&pCell->uiSeq, __ATOMIC_ACQUIRE);
+        int32_t iDiff = (int32_t)(uiSeq - uiPos);
+        if(iDiff == 0)
+        {
+            // slot is free, try to claim it
+            if(__atomic_compare_exchange_n(&muiTraceHead, &uiPos, uiPos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if(iDiff < 0)
+        {
+            // ring is full, flush thread is behind
+            __atomic_fetch_add(&muiTraceDropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+        {
+            uiPos = __atomic_load_n(&muiTraceHead, __ATOMIC_RELAXED);
+        }
+    }
+
+    pCell->cPhase = cPhase;
+    pCell->iTid = miTraceTid;
+    pCell->ulTimeUs = ulNow;
+    pCell->sName = sName;
+    __atomic_store_n(&pCell->uiSeq, uiPos + 1, __ATOMIC_RELEASE);
+}
+
+/********************* traceSIGHandler **********************
+    Async signal safe, only flips the flag. The flush thread
+    opens or finalizes the file.
+************************************************************/
+void traceSIGHandler(int signum)
+{
+    bTraceEnabled = !bTraceEnabled;
+}
+
+uint32_t traceGetDroppedEvents()
+{
+    return __atomic_load_n(&muiTraceDropped, __ATOMIC_RELAXED);
+}
+
+/********************* traceDequeue *************************
+    Only called from the flush thread (single consumer).
+************************************************************/
+bool traceDequeue(tTraceEvent *pDest)
+{
+    tTraceEvent *pCell = &masTraceRing[muiTraceTail & TRACE_RINGMASK];
+    uint32_t uiSeq = __atomic_load_n(&pCell->uiSeq, __ATOMIC_ACQUIRE);
+    if(uiSeq != muiTraceTail + 1)
+    {
+        return false; // empty
+    }
+    memcpy(pDest, pCell, sizeof(tTraceEvent));
+    __atomic_store_n(&pCell->uiSeq, muiTraceTail + TRACE_RINGSIZE, __ATOMIC_RELEASE);
+    muiTraceTail += 1;
+    return true;
+}
+
+void traceOpenFile()
+{
+    mpTraceFile = fopen(TRACE_FILEPATH, "w");
+    if(mpTraceFile == NULL)
+    {
+        printf("[ERROR] (%s) %s: Could not open trace file \'%s\'.\n", printTimestamp(), __func__, TRACE_FILEPATH);
+        bTraceEnabled = 0;
+        return;
+    }
+    fprintf(mpTraceFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    mbTraceFirstEvent = true;
+    printf("[INFO] (%s) %s: Tracing started, writing to \'%s\'.\n", printTimestamp(), __func__, TRACE_FILEPATH);
+}
+
+void traceCloseFile()
+{
+    traceDrainToFile();
+    fprintf(mpTraceFile, "\n]}\n");
+    fclose(mpTraceFile);
+    mpTraceFile = NULL;
+    printf("[INFO] (%s) %s: Tracing stopped, %u events dropped so far.\n", printTimestamp(), __func__, traceGetDroppedEvents());
+}
+
+void traceDrainToFile()
+{
+    tTraceEvent sEvent;
+    while(traceDequeue(&sEvent))
+    {
+        if(mpTraceFile == NULL)
+        {
+            continue; // tracing was toggled off before the file got opened, discard
+        }
+        fprintf(mpTraceFile, "%s{\"name\":\"%s\",\"cat\":\"sac\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%i,\"tid\":%i}",
+            mbTraceFirstEvent ? "" : ",\n",
+            sEvent.sName, sEvent.cPhase, (unsigned long long)sEvent.ulTimeUs, miTracePid, sEvent.iTid);
+        mbTraceFirstEvent = false;
+    }
+    if(mpTraceFile != NULL)
+    {
+        fflush(mpTraceFile);
+    }
+}
+
+/******************** traceFlushThread **********************
+    Follows bTraceEnabled: opens the file when tracing gets
+    switched on and finalizes it when switched off.
+************************************************************/
+void *traceFlushThread(void *pArg)
+{
+    while(mbTraceRunning)
+    {
+        if(bTraceEnabled && mpTraceFile == NULL)
+        {
+            traceOpenFile();
+        }
+        traceDrainToFile();
+        if(!bTraceEnabled && mpTraceFile != NULL)
+        {
+            traceCloseFile();
+        }
+        usleep(TRACE_FLUSHINTERVALUS);
+    }
+    if(mpTraceFile != NULL)
+    {
+        traceCloseFile();
+    }
+    return NULL;
+}
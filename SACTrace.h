@@ -0,0 +1,27 @@
+#ifndef SACTRACE_H
+#define SACTRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+
+#define TRACE_RINGSIZE              8192 // number of events buffered between producers and the flush thread, must be a power of two
+#define TRACE_FILEPATH              "/tmp/SACIot_trace.json" // Chrome trace JSON, opens in chrome://tracing and ui.perfetto.dev
+#define TRACE_FLUSHINTERVALUS       100000 // flush thread wakes up every 100ms
+#define TRACE_TOGGLESIGNAL          SIGUSR2 // "kill -USR2 <pid>" toggles tracing on/off
+#define TRACE_ENABLEDATSTARTUP      0
+
+// Only costs a load and a branch when tracing is off.
+// sName must point to a string that lives forever (string literal).
+#define TRACE_BEGIN(sName)          do { if(bTraceEnabled) { traceEvent((sName), 'B'); } } while(0)
+#define TRACE_END(sName)            do { if(bTraceEnabled) { traceEvent((sName), 'E'); } } while(0)
+
+extern volatile sig_atomic_t bTraceEnabled;
+
+void traceInit();
+void traceClose();
+void traceEvent(const char *sName, char cPhase);
+void traceSIGHandler(int signum);
+uint32_t traceGetDroppedEvents();
+
+#endif
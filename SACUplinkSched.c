@@ -0,0 +1,549 @@
+#include "SACUplinkSched.h"
+#include "SACServerComms.h"
+#include "SACAsyncCmd.h"
+#include "SACPrintUtils.h"
+#include "SACTrace.h"
+
+#include "string.h" /* memcpy, memset */
+#include "stdio.h"
+
+/*
+    Uplink scheduler. Every send command from the controller
+    becomes a tUplinkRecord in one of three class queues:
+    - alarms: strict priority, exempt from the rate limit.
+    - events and telemetry: weighted round robin (records have
+      a fixed size so this equals weighted fair queueing),
+      limited by a token bucket when [uplink] rate_per_min is
+      set. The record the controller waits on doesn't wait
+      for a token, it goes out of turn when the bucket is
+      empty.
+    Records stay queued until the server accepted them, so a
+    backlog builds up during an outage and drains afterwards.
+*/
+
+typedef struct
+{
+    tUplinkRecord *pRecords;
+    uint32_t uiSize;
+    uint32_t uiHead; // index of the oldest record
+    uint32_t uiCount;
+    uint32_t uiDropped;
+    tUplinkDropPolicy eDropPolicy;
+    uint32_t uiWeight;
+} tUplinkQueue;
+
+/****************** private function prototypes *********************/
+tUplinkRecord *uplinkSchedPeek(tUplinkClass *pClass);
+tUplinkRecord *uplinkSchedPeekWrr(tUplinkClass *pClass);
+tUplinkRecord *uplinkSchedFind(int32_t iId, tUplinkClass *pClass);
+void uplinkSchedCharge(tUplinkClass eClass, const tUplinkRecord *pRecord);
+bool uplinkSchedRequeue(tUplinkRecord *pRecord);
+void uplinkSchedPop(tUplinkClass eClass, tUplinkRecord *pRecord);
+void uplinkSchedRefillTokens();
+int uplinkSchedSend(tUplinkRecord *pRecord);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tUplinkRecord masAlarmRecords[UPLSCHED_ALARMQUEUESIZE];
+static tUplinkRecord masEventRecords[UPLSCHED_EVENTQUEUESIZE];
+static tUplinkRecord masTelemRecords[UPLSCHED_TELEMQUEUESIZE];
+static tUplinkQueue masQueues[UPLCLASS_COUNT];
+static uint32_t muiNextId = 0;
+static tUplinkClass meWrrClass = UPLCLASS_EVENT; // class currently served by the round robin
+static uint32_t muiWrrCredit = UPLSCHED_EVENTWEIGHT; // records left for meWrrClass in this round
+static uint32_t muiTokensMilli = UPLSCHED_BURST * 1000; // token bucket, in 1/1000 tokens
+static uint64_t mulTokensRefilledUs = 0;
+static uint32_t muiRatePerMin = UPLSCHED_RATEPERMIN; // 0: no rate limit
+static uint32_t muiBurst = UPLSCHED_BURST;
+static int32_t miAwaitedId = -1; // record the controller waits on, exempt from the rate limit
+/********************************************************************/
+
+void uplinkSchedInit()
+{
+    memset(masQueues, 0, sizeof(masQueues));
+    masQueues[UPLCLASS_ALARM].pRecords = masAlarmRecords;
+    masQueues[UPLCLASS_ALARM].uiSize = UPLSCHED_ALARMQUEUESIZE;
+    masQueues[UPLCLASS_ALARM].eDropPolicy = UPLDROP_OLDEST; // a newer alarm supersedes an older one
+    masQueues[UPLCLASS_EVENT].pRecords = masEventRecords;
+    masQueues[UPLCLASS_EVENT].uiSize = UPLSCHED_EVENTQUEUESIZE;
+    masQueues[UPLCLASS_EVENT].eDropPolicy = UPLDROP_NEWEST; // controller gets an error and can retry
+    masQueues[UPLCLASS_EVENT].uiWeight = UPLSCHED_EVENTWEIGHT;
+    masQueues[UPLCLASS_TELEMETRY].pRecords = masTelemRecords;
+    masQueues[UPLCLASS_TELEMETRY].uiSize = UPLSCHED_TELEMQUEUESIZE;
+    masQueues[UPLCLASS_TELEMETRY].eDropPolicy = UPLDROP_OLDEST; // newer counters supersede older ones
+    masQueues[UPLCLASS_TELEMETRY].uiWeight = UPLSCHED_TELEMWEIGHT;
+    meWrrClass = UPLCLASS_EVENT;
+    muiWrrCredit = UPLSCHED_EVENTWEIGHT;
+    muiTokensMilli = muiBurst * 1000;
+    mulTokensRefilledUs = printGetMonotonicTimeUs();
+}
+
+/****************** uplinkSchedClassify *********************
+    cmdCode UPLSCHED_CMDCODE_ALARM -> alarm
+    controller asked for a downlink -> event
+    anything else -> telemetry
+************************************************************/
+tUplinkClass uplinkSchedClassify(tCtrlSendCmd *pCmd)
+{
+    if(pCmd->cmdCode == UPLSCHED_CMDCODE_ALARM)
+    {
+        return UPLCLASS_ALARM;
+    }
+    if(pCmd->downlinkIndicator == 0x01)
+    {
+        return UPLCLASS_EVENT;
+    }
+    return UPLCLASS_TELEMETRY;
+}
+
+/****************** uplinkSchedEnqueue **********************
+    Returns the id of the queued record or -1 if the record
+    was refused (queue full and drop newest policy).
+************************************************************/
+int32_t uplinkSchedEnqueue(tCtrlSendCmd *pCmd)
+{
+    return uplinkSchedEnqueueEncoded(pCmd, UPLENC_RAW, printGetUnixEpochTimeAsInt());
+}
+
+/*************** uplinkSchedEnqueueEncoded ******************
+    For records built by the edge aggregation: bEncoding
+    (tUplinkEncoding) tells the transport how to label the
+    payload, ulTime is the unix time of the newest controller
+    record it holds.
+************************************************************/
+int32_t uplinkSchedEnqueueEncoded(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime)
+{
+    tUplinkClass eClass = uplinkSchedClassify(pCmd);
+    tUplinkQueue *pQueue = &masQueues[eClass];
+
+    if(pQueue->uiCount == pQueue->uiSize)
+    {
+        pQueue->uiDropped += 1;
+        if(pQueue->eDropPolicy == UPLDROP_NEWEST)
+        {
+            printf("[WARNING] (%s) %s: Uplink queue %i full, refused new record.\n", printTimestamp(), __func__, eClass);
+            return -1;
+        }
+        printf("[WARNING] (%s) %s: Uplink queue %i full, dropped oldest record (id %u).\n", printTimestamp(), __func__, eClass, pQueue->pRecords[pQueue->uiHead].id);
+        asyncCmdUplinkDropped(pQueue->pRecords[pQueue->uiHead].id);
+        uplinkSchedPop(eClass, &pQueue->pRecords[pQueue->uiHead]);
+    }
+
+    tUplinkRecord *pRecord = &pQueue->pRecords[(pQueue->uiHead + pQueue->uiCount) % pQueue->uiSize];
+    memcpy(pRecord->cmd.ui8, pCmd->ui8, sizeof(tCtrlSendCmd));
+    pRecord->priorityClass = (uint8_t)eClass;
+    pRecord->id = muiNextId & 0x7fffffff;
+    muiNextId += 1;
+    pRecord->time = ulTime;
+    pRecord->encoding = bEncoding;
+    pRecord->hasSeqNr = 0;
+    pRecord->origin[0] = 0x00;
+    pRecord->enqueueTimeUs = printGetMonotonicTimeUs();
+    pQueue->uiCount += 1;
+    return (int32_t)pRecord->id;
+}
+
+/******************** uplinkSchedRun ************************
+    Sends queued records in scheduling order until
+    uiMaxSends records went out, the queues are empty, the
+    rate limit kicks in or record iStopAfterId was sent
+    (-1: don't stop for a specific record).
+    iStopAfterId is the record the controller waits on: it
+    goes out even when the rate limit holds back the others.
+    When iStopAfterId was sent, its server reply is the one
+    left in the decked reply.
+    Returns the number of records sent or -1 when a send
+    failed (the record stays queued).
+************************************************************/
+int uplinkSchedRun(uint32_t uiMaxSends, int32_t iStopAfterId)
+{
+    int iSent = 0;
+    tUplinkClass eClass;
+    tUplinkRecord *pRecord;
+    int32_t iAwaitedBefore = miAwaitedId;
+
+    miAwaitedId = iStopAfterId;
+    while((uint32_t)iSent < uiMaxSends)
+    {
+        pRecord = uplinkSchedPeek(&eClass);
+        if(pRecord == NULL)
+        {
+            break;
+        }
+        if(uplinkSchedSend(pRecord) < 0)
+        {
+            iSent = -1;
+            break;
+        }
+        bool bStop = ((int32_t)pRecord->id == iStopAfterId);
+        uplinkSchedCharge(eClass, pRecord);
+        uplinkSchedPop(eClass, pRecord);
+        iSent += 1;
+        if(bStop)
+        {
+            break;
+        }
+    }
+    miAwaitedId = iAwaitedBefore;
+    return iSent;
+}
+
+/******************** uplinkSchedTake ***********************
+    Removes the record that should go out next and copies it
+    to pDest, for senders that keep it while the exchange is
+    in flight (reactor mode). Charges the rate limit and the
+    round robin like uplinkSchedRun does, the record set with
+    uplinkSchedSetAwaited() is exempt.
+    Returns false when nothing may be sent now.
+************************************************************/
+bool uplinkSchedTake(tUplinkRecord *pDest)
+{
+    tUplinkClass eClass;
+    tUplinkRecord *pRecord = uplinkSchedPeek(&eClass);
+    if(pRecord == NULL)
+    {
+        return false;
+    }
+    memcpy(pDest, pRecord, sizeof(tUplinkRecord));
+    uplinkSchedCharge(eClass, pRecord);
+    uplinkSchedPop(eClass, pRecord);
+    return true;
+}
+
+/****************** uplinkSchedTakeBlock ********************
+    Takes up to uiMax records in scheduling order for one
+    bulk upload (SACBulkUpload.h). A block is one request,
+    it is charged one token and not one per record.
+    Returns the number of records copied to pDest, 0 when
+    nothing may be sent now.
+************************************************************/
+uint32_t uplinkSchedTakeBlock(tUplinkRecord *pDest, uint32_t uiMax)
+{
+    tUplinkClass eClass;
+    tUplinkRecord *pRecord;
+    uint32_t uiTaken = 0;
+    bool bCharged = false;
+
+    while(uiTaken < uiMax)
+    {
+        if(masQueues[UPLCLASS_ALARM].uiCount > 0)
+        {
+            eClass = UPLCLASS_ALARM;
+            pRecord = &masQueues[UPLCLASS_ALARM].pRecords[masQueues[UPLCLASS_ALARM].uiHead];
+        }
+        else if(bCharged)
+        {
+            pRecord = uplinkSchedPeekWrr(&eClass);
+        }
+        else
+        {
+            uplinkSchedRefillTokens(); // the rate limit, once per block
+            pRecord = (muiTokensMilli >= 1000) ? uplinkSchedPeekWrr(&eClass) : NULL;
+            if(pRecord != NULL)
+            {
+                muiTokensMilli -= 1000;
+                bCharged = true;
+            }
+        }
+        if(pRecord == NULL)
+        {
+            break;
+        }
+        memcpy(&pDest[uiTaken], pRecord, sizeof(tUplinkRecord));
+        if(eClass != UPLCLASS_ALARM)
+        {
+            muiWrrCredit -= 1;
+        }
+        uplinkSchedPop(eClass, pRecord);
+        uiTaken += 1;
+    }
+    return uiTaken;
+}
+
+/****************** uplinkSchedPutBack **********************
+    Puts a taken record whose send failed back at the head
+    of its queue and refunds its token (the awaited record
+    was not charged one). If the queue filled
+    up in the meantime the record is dropped, it is the
+    oldest one anyway.
+************************************************************/
+void uplinkSchedPutBack(tUplinkRecord *pRecord)
+{
+    if(uplinkSchedRequeue(pRecord) && pRecord->priorityClass != UPLCLASS_ALARM && (int32_t)pRecord->id != miAwaitedId && muiTokensMilli <= (muiBurst - 1) * 1000)
+    {
+        muiTokensMilli += 1000;
+    }
+}
+
+/**************** uplinkSchedPutBackBlock *******************
+    uplinkSchedPutBack for the part of a block that was not
+    stored, in the order of the block. One token is
+    refunded, the block was charged one.
+************************************************************/
+void uplinkSchedPutBackBlock(tUplinkRecord *pRecords, uint32_t uiCount)
+{
+    bool bRefund = false;
+    uint32_t i;
+
+    for(i=uiCount; i>0; i-=1)
+    {
+        if(uplinkSchedRequeue(&pRecords[i - 1]) && pRecords[i - 1].priorityClass != UPLCLASS_ALARM)
+        {
+            bRefund = true;
+        }
+    }
+    if(bRefund && muiTokensMilli <= (muiBurst - 1) * 1000)
+    {
+        muiTokensMilli += 1000;
+    }
+}
+
+bool uplinkSchedRequeue(tUplinkRecord *pRecord)
+{
+    tUplinkQueue *pQueue = &masQueues[pRecord->priorityClass];
+    if(pQueue->uiCount == pQueue->uiSize)
+    {
+        pQueue->uiDropped += 1;
+        printf("[WARNING] (%s) %s: Uplink queue %u full, dropped failed record (id %u).\n", printTimestamp(), __func__, pRecord->priorityClass, pRecord->id);
+        asyncCmdUplinkDropped(pRecord->id);
+        return false;
+    }
+    pQueue->uiHead = (pQueue->uiHead + pQueue->uiSize - 1) % pQueue->uiSize;
+    memcpy(&pQueue->pRecords[pQueue->uiHead], pRecord, sizeof(tUplinkRecord));
+    pQueue->uiCount += 1;
+    return true;
+}
+
+/******************** uplinkSchedTakeId *********************
+    Takes the record iId out of its queue wherever it is,
+    without a token. Only for the summary sent at exit, the
+    rest of the queues is dropped anyway.
+************************************************************/
+bool uplinkSchedTakeId(int32_t iId, tUplinkRecord *pDest)
+{
+    tUplinkClass eClass;
+    tUplinkRecord *pRecord = uplinkSchedFind(iId, &eClass);
+    if(pRecord == NULL)
+    {
+        return false;
+    }
+    memcpy(pDest, pRecord, sizeof(tUplinkRecord));
+    uplinkSchedPop(eClass, pRecord);
+    return true;
+}
+
+/***************** uplinkSchedIsPending *********************
+    Taken records that are in flight don't count as pending.
+************************************************************/
+bool uplinkSchedIsPending(int32_t iId)
+{
+    tUplinkClass eClass;
+    return uplinkSchedFind(iId, &eClass) != NULL;
+}
+
+/***************** uplinkSchedReadyToSend *******************
+    True when a record may go out now: something is queued,
+    the rate limit allows it and the circuit breaker is not
+    open.
+************************************************************/
+bool uplinkSchedReadyToSend()
+{
+    tUplinkClass eClass;
+    if(uplinkSchedPeek(&eClass) == NULL)
+    {
+        return false;
+    }
+    return commsCircuitAllowsRequest();
+}
+
+uint32_t uplinkSchedPending()
+{
+    return masQueues[UPLCLASS_ALARM].uiCount + masQueues[UPLCLASS_EVENT].uiCount + masQueues[UPLCLASS_TELEMETRY].uiCount;
+}
+
+uint32_t uplinkSchedPendingClass(tUplinkClass eClass)
+{
+    return masQueues[eClass].uiCount;
+}
+
+uint32_t uplinkSchedDropped(tUplinkClass eClass)
+{
+    return masQueues[eClass].uiDropped;
+}
+
+/****************** uplinkSchedSetRateLimit *****************
+    Token bucket refill rate in uplinks per minute and its
+    depth ([uplink] rate_per_min and burst), 0 turns the
+    rate limit off. The bucket starts full.
+************************************************************/
+void uplinkSchedSetRateLimit(uint32_t uiRatePerMin, uint32_t uiBurst)
+{
+    muiRatePerMin = uiRatePerMin;
+    muiBurst = (uiBurst > 0) ? uiBurst : 1;
+    muiTokensMilli = muiBurst * 1000;
+    mulTokensRefilledUs = printGetMonotonicTimeUs();
+}
+
+/******************* uplinkSchedSetAwaited ******************
+    The record the controller waits on while the reactor
+    sends it (iCurrentUplinkId), -1 when nobody waits. It
+    doesn't take a token and goes out of turn when the
+    bucket is empty, like uplinkSchedRun() does for its
+    iStopAfterId.
+************************************************************/
+void uplinkSchedSetAwaited(int32_t iId)
+{
+    miAwaitedId = iId;
+}
+
+/******************** uplinkSchedPeek ***********************
+    Returns the record that should go out next, without
+    removing it, or NULL when nothing may be sent now. That
+    is the head of its queue, except for the awaited record
+    passing the rate limit.
+************************************************************/
+tUplinkRecord *uplinkSchedPeek(tUplinkClass *pClass)
+{
+    tUplinkQueue *pQueue = &masQueues[UPLCLASS_ALARM];
+    if(pQueue->uiCount > 0)
+    {
+        *pClass = UPLCLASS_ALARM;
+        return &pQueue->pRecords[pQueue->uiHead];
+    }
+
+    uplinkSchedRefillTokens();
+    if(muiTokensMilli < 1000)
+    {
+        return uplinkSchedFind(miAwaitedId, pClass); // rate limited, only the awaited record goes
+    }
+    return uplinkSchedPeekWrr(pClass);
+}
+
+/******************* uplinkSchedPeekWrr *********************
+    Weighted round robin between events and telemetry, skips
+    empty queues. Doesn't look at the rate limit.
+************************************************************/
+tUplinkRecord *uplinkSchedPeekWrr(tUplinkClass *pClass)
+{
+    tUplinkQueue *pQueue;
+    int iTries;
+    for(iTries=0; iTries<(UPLCLASS_COUNT - 1) * 2; iTries+=1)
+    {
+        pQueue = &masQueues[meWrrClass];
+        if(pQueue->uiCount > 0 && muiWrrCredit > 0)
+        {
+            *pClass = meWrrClass;
+            return &pQueue->pRecords[pQueue->uiHead];
+        }
+        meWrrClass = (meWrrClass == UPLCLASS_EVENT) ? UPLCLASS_TELEMETRY : UPLCLASS_EVENT;
+        muiWrrCredit = masQueues[meWrrClass].uiWeight;
+    }
+    return NULL;
+}
+
+/******************** uplinkSchedFind ***********************
+    The queued record with id iId, NULL when there is none
+    (iId -1, sent or dropped).
+************************************************************/
+tUplinkRecord *uplinkSchedFind(int32_t iId, tUplinkClass *pClass)
+{
+    int iClass;
+    uint32_t i;
+
+    for(iClass=0; iId >= 0 && iClass<UPLCLASS_COUNT; iClass+=1)
+    {
+        tUplinkQueue *pQueue = &masQueues[iClass];
+        for(i=0; i<pQueue->uiCount; i+=1)
+        {
+            tUplinkRecord *pRecord = &pQueue->pRecords[(pQueue->uiHead + i) % pQueue->uiSize];
+            if((int32_t)pRecord->id == iId)
+            {
+                *pClass = (tUplinkClass)iClass;
+                return pRecord;
+            }
+        }
+    }
+    return NULL;
+}
+
+/******************* uplinkSchedCharge **********************
+    Takes the token and the round robin credit of a record
+    leaving its queue. The awaited record takes no token, if
+    it passed an empty bucket out of turn the round robin
+    didn't pick it either.
+************************************************************/
+void uplinkSchedCharge(tUplinkClass eClass, const tUplinkRecord *pRecord)
+{
+    if(eClass == UPLCLASS_ALARM)
+    {
+        return;
+    }
+    if((int32_t)pRecord->id != miAwaitedId)
+    {
+        muiTokensMilli -= 1000;
+    }
+    else if(muiTokensMilli < 1000)
+    {
+        return;
+    }
+    muiWrrCredit -= 1;
+}
+
+/********************* uplinkSchedPop ***********************
+    Removes pRecord from its queue: the head, or the
+    awaited record out of turn, the ones behind it move up.
+************************************************************/
+void uplinkSchedPop(tUplinkClass eClass, tUplinkRecord *pRecord)
+{
+    tUplinkQueue *pQueue = &masQueues[eClass];
+    uint32_t uiIndex = (uint32_t)(pRecord - pQueue->pRecords);
+    uint32_t uiTail = (pQueue->uiHead + pQueue->uiCount - 1) % pQueue->uiSize;
+    uint32_t uiNext;
+
+    if(pQueue->uiCount == 0)
+    {
+        return;
+    }
+    if(uiIndex == pQueue->uiHead)
+    {
+        pQueue->uiHead = (pQueue->uiHead + 1) % pQueue->uiSize;
+    }
+    else
+    {
+        while(uiIndex != uiTail)
+        {
+            uiNext = (uiIndex + 1) % pQueue->uiSize;
+            memcpy(&pQueue->pRecords[uiIndex], &pQueue->pRecords[uiNext], sizeof(tUplinkRecord));
+            uiIndex = uiNext;
+        }
+    }
+    pQueue->uiCount -= 1;
+}
+
+void uplinkSchedRefillTokens()
+{
+    if(muiRatePerMin == 0)
+    {
+        muiTokensMilli = muiBurst * 1000;
+        return;
+    }
+    uint64_t ulNow = printGetMonotonicTimeUs();
+    uint64_t ulNewMilli = ((ulNow - mulTokensRefilledUs) * muiRatePerMin) / 60000ULL; // us * tokens/min -> 1/1000 tokens
+    if(ulNewMilli == 0)
+    {
+        return;
+    }
+    mulTokensRefilledUs = ulNow;
+    ulNewMilli += muiTokensMilli;
+    muiTokensMilli = (ulNewMilli > muiBurst * 1000) ? muiBurst * 1000 : (uint32_t)ulNewMilli;
+}
+
+int uplinkSchedSend(tUplinkRecord *pRecord)
+{
+    int iResult;
+    TRACE_BEGIN("uplink");
+    printf("[INFO] (%s) %s: Sending uplink id %u (class %u), queued for %llu ms.\n", printTimestamp(), __func__, pRecord->id, pRecord->priorityClass, (unsigned long long)((printGetMonotonicTimeUs() - pRecord->enqueueTimeUs) / 1000));
+    iResult = commsSendUplink(pRecord);
+    TRACE_END("uplink");
+    return iResult;
+}
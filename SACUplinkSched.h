@@ -0,0 +1,52 @@
+#ifndef SACUPLINKSCHED_H
+#define SACUPLINKSCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "SACStructs.h"
+
+#define UPLSCHED_CMDCODE_ALARM          0x03 // send command flagged as alarm by the controller, same frame as 0x02
+#define UPLSCHED_ALARMQUEUESIZE         16
+#define UPLSCHED_EVENTQUEUESIZE         64
+#define UPLSCHED_TELEMQUEUESIZE         256
+#define UPLSCHED_EVENTWEIGHT            3 // weighted round robin between events and telemetry, alarms go first always
+#define UPLSCHED_TELEMWEIGHT            1
+#define UPLSCHED_RATEPERMIN             0 // default of [uplink] rate_per_min: token bucket refill rate for metered links, 0: no rate limit. Alarms and the record the controller waits on are exempt.
+#define UPLSCHED_BURST                  10 // default of [uplink] burst: token bucket depth
+#define UPLSCHED_MAXBURST               1000
+#define UPLSCHED_MAXSENDSPERPASS        4 // max uplinks sent while the controller waits for one of its own
+#define UPLSCHED_IDLEBEFOREDRAINMS      500 // only drain the backlog when the i2c bus has been quiet this long
+
+typedef enum
+{
+    UPLCLASS_ALARM, // strict priority
+    UPLCLASS_EVENT, // controller asked for a downlink
+    UPLCLASS_TELEMETRY, // routine counters
+    UPLCLASS_COUNT,
+} tUplinkClass;
+
+typedef enum
+{
+    UPLDROP_OLDEST, // queue full: make room by discarding the oldest record
+    UPLDROP_NEWEST, // queue full: refuse the new record
+} tUplinkDropPolicy;
+
+void uplinkSchedInit();
+tUplinkClass uplinkSchedClassify(tCtrlSendCmd *pCmd);
+int32_t uplinkSchedEnqueue(tCtrlSendCmd *pCmd);
+int32_t uplinkSchedEnqueueEncoded(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime);
+int uplinkSchedRun(uint32_t uiMaxSends, int32_t iStopAfterId);
+bool uplinkSchedTake(tUplinkRecord *pDest);
+bool uplinkSchedTakeId(int32_t iId, tUplinkRecord *pDest);
+void uplinkSchedPutBack(tUplinkRecord *pRecord);
+uint32_t uplinkSchedTakeBlock(tUplinkRecord *pDest, uint32_t uiMax);
+void uplinkSchedPutBackBlock(tUplinkRecord *pRecords, uint32_t uiCount);
+bool uplinkSchedIsPending(int32_t iId);
+bool uplinkSchedReadyToSend();
+uint32_t uplinkSchedPending();
+uint32_t uplinkSchedPendingClass(tUplinkClass eClass);
+uint32_t uplinkSchedDropped(tUplinkClass eClass);
+void uplinkSchedSetRateLimit(uint32_t uiRatePerMin, uint32_t uiBurst);
+void uplinkSchedSetAwaited(int32_t iId);
+
+#endif
@@ -0,0 +1,478 @@
+#include "SACUring.h"
+#include "SACReactor.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memset */
+#include "stdio.h"
+#include "unistd.h"
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h> /* struct __kernel_timespec */
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup     425 // same number on every architecture
+#define __NR_io_uring_enter     426
+#define __NR_io_uring_register  427
+#endif
+
+#define URING_OPINDEXBITS       8 // handle: generation << 8 | slot, never 0 (user_data 0 means "ignore")
+
+typedef struct
+{
+    bool inUse;
+    bool timeout; // cancelled with IORING_OP_TIMEOUT_REMOVE instead of IORING_OP_ASYNC_CANCEL
+    uint32_t handle;
+    tUringCallback pCallback; // NULL: detached, the completion only frees the slot
+    void *pContext;
+    struct __kernel_timespec sTimeout; // read by the kernel when the operation is submitted
+} tUringOp;
+
+/****************** private function prototypes *********************/
+struct io_uring_sqe *uringGetSqe();
+int uringAllocOp(tUringCallback pCallback, void *pContext);
+tUringOp *uringFindOp(uint64_t ulUserData);
+int uringBufferIndex(const void *pData, uint32_t uiLength);
+void uringReap(int iFd, uint32_t uiEvents, void *pContext);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static int miUringFd = -1;
+static uint8_t *mpUringSqRing = NULL;
+static size_t muiUringSqRingSize = 0;
+static uint8_t *mpUringCqRing = NULL;
+static size_t muiUringCqRingSize = 0;
+static struct io_uring_sqe *masUringSqes = NULL;
+static size_t muiUringSqesSize = 0;
+static unsigned *mpUringSqHead;
+static unsigned *mpUringSqTail;
+static unsigned *mpUringSqArray;
+static unsigned muiUringSqMask;
+static unsigned muiUringSqEntries;
+static unsigned *mpUringCqHead;
+static unsigned *mpUringCqTail;
+static struct io_uring_cqe *masUringCqes;
+static unsigned muiUringCqMask;
+static unsigned muiUringPending = 0; // queued, not submitted yet
+static tUringOp masUringOps[URING_MAXOPS];
+static uint32_t muiUringGeneration = 1;
+static const struct iovec *masUringBuffers = NULL;
+static int miUringBuffers = 0;
+static tUringStats msUringStats = {0};
+/********************************************************************/
+
+/*********************** uringInit **************************
+    Sets up the ring, registers the buffers (a failure there,
+    e.g. RLIMIT_MEMLOCK, only costs the fixed buffers) and
+    hooks the ring into the reactor. Returns -1 when the
+    kernel has no io_uring (older than 5.1, or disabled by
+    kernel.io_uring_disabled / seccomp).
+************************************************************/
+int uringInit(const struct iovec *asBuffers, int iBuffers)
+{
+    struct io_uring_params sParams;
+
+    if(miUringFd >= 0)
+    {
+        return 0;
+    }
+    memset(&sParams, 0, sizeof(sParams));
+    memset(masUringOps, 0, sizeof(masUringOps));
+    memset(&msUringStats, 0, sizeof(msUringStats));
+    miUringFd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &sParams);
+    if(miUringFd < 0)
+    {
+        printf("[WARNING] (%s) %s: io_uring not available, errno %i.\n", printTimestamp(), __func__, errno);
+        return -1;
+    }
+    muiUringSqRingSize = sParams.sq_off.array + sParams.sq_entries * sizeof(unsigned);
+    muiUringCqRingSize = sParams.cq_off.cqes + sParams.cq_entries * sizeof(struct io_uring_cqe);
+    if(sParams.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        muiUringSqRingSize = (muiUringCqRingSize > muiUringSqRingSize) ? muiUringCqRingSize : muiUringSqRingSize;
+        muiUringCqRingSize = 0;
+    }
+    muiUringSqesSize = sParams.sq_entries * sizeof(struct io_uring_sqe);
+    mpUringSqRing = mmap(NULL, muiUringSqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, miUringFd, IORING_OFF_SQ_RING);
+    mpUringCqRing = (muiUringCqRingSize == 0) ? mpUringSqRing : mmap(NULL, muiUringCqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, miUringFd, IORING_OFF_CQ_RING);
+    masUringSqes = mmap(NULL, muiUringSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, miUringFd, IORING_OFF_SQES);
+    if(mpUringSqRing == MAP_FAILED || mpUringCqRing == MAP_FAILED || masUringSqes == MAP_FAILED)
+    {
+        printf("[ERROR] (%s) %s: Could not map the io_uring rings, errno %i.\n", printTimestamp(), __func__, errno);
+        mpUringSqRing = (mpUringSqRing == MAP_FAILED) ? NULL : mpUringSqRing;
+        mpUringCqRing = (mpUringCqRing == MAP_FAILED) ? NULL : mpUringCqRing;
+        masUringSqes = (masUringSqes == MAP_FAILED) ? NULL : masUringSqes;
+        uringClose();
+        return -1;
+    }
+    mpUringSqHead = (unsigned *)(mpUringSqRing + sParams.sq_off.head);
+    mpUringSqTail = (unsigned *)(mpUringSqRing + sParams.sq_off.tail);
+    mpUringSqArray = (unsigned *)(mpUringSqRing + sParams.sq_off.array);
+    muiUringSqMask = *(unsigned *)(mpUringSqRing + sParams.sq_off.ring_mask);
+    muiUringSqEntries = sParams.sq_entries;
+    mpUringCqHead = (unsigned *)(mpUringCqRing + sParams.cq_off.head);
+    mpUringCqTail = (unsigned *)(mpUringCqRing + sParams.cq_off.tail);
+    masUringCqes = (struct io_uring_cqe *)(mpUringCqRing + sParams.cq_off.cqes);
+    muiUringCqMask = *(unsigned *)(mpUringCqRing + sParams.cq_off.ring_mask);
+    muiUringPending = 0;
+
+    masUringBuffers = NULL;
+    miUringBuffers = 0;
+    if(iBuffers > 0)
+    {
+        if(syscall(__NR_io_uring_register, miUringFd, IORING_REGISTER_BUFFERS, asBuffers, iBuffers) == 0)
+        {
+            masUringBuffers = asBuffers;
+            miUringBuffers = iBuffers;
+            msUringStats.fixedBuffers = true;
+        }
+        else
+        {
+            printf("[WARNING] (%s) %s: Could not register %i buffers, errno %i. Going on without fixed buffers.\n", printTimestamp(), __func__, iBuffers, errno);
+        }
+    }
+    if(reactorAddFd(miUringFd, EPOLLIN, uringReap, NULL) < 0)
+    {
+        uringClose();
+        return -1;
+    }
+    reactorSetPreWait(uringFlush);
+    printf("[INFO] (%s) %s: io_uring with %u entries, %i fixed buffers.\n", printTimestamp(), __func__, muiUringSqEntries, miUringBuffers);
+    return 0;
+}
+
+bool uringReady()
+{
+    return (miUringFd >= 0);
+}
+
+/********************** uringConnect ************************
+    pAddr is read when the operation runs, it has to stay
+    valid until the completion.
+    Returns the operation handle (for uringCancel()) or -1
+    when no slot is free, the callback is not called then.
+************************************************************/
+int uringConnect(int iFd, const struct sockaddr *pAddr, socklen_t uiLength, bool bLink, tUringCallback pCallback, void *pContext)
+{
+    int iOp = uringAllocOp(pCallback, pContext);
+    struct io_uring_sqe *pSqe;
+
+    if(iOp < 0)
+    {
+        return -1;
+    }
+    pSqe = uringGetSqe();
+    pSqe->opcode = IORING_OP_CONNECT;
+    pSqe->fd = iFd;
+    pSqe->addr = (uint64_t)(uintptr_t)pAddr;
+    pSqe->off = uiLength;
+    pSqe->flags = bLink ? IOSQE_IO_LINK : 0;
+    pSqe->user_data = (uint32_t)iOp;
+    return iOp;
+}
+
+/*********************** uringSend **************************
+    write() on the socket, IORING_OP_WRITE_FIXED when the
+    data is in a registered buffer. Same return value as
+    uringConnect().
+************************************************************/
+int uringSend(int iFd, const void *pData, uint32_t uiLength, bool bLink, tUringCallback pCallback, void *pContext)
+{
+    int iOp = uringAllocOp(pCallback, pContext);
+    int iBuffer = uringBufferIndex(pData, uiLength);
+    struct io_uring_sqe *pSqe;
+
+    if(iOp < 0)
+    {
+        return -1;
+    }
+    pSqe = uringGetSqe();
+    pSqe->opcode = (iBuffer >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_SEND;
+    pSqe->fd = iFd;
+    pSqe->addr = (uint64_t)(uintptr_t)pData;
+    pSqe->len = uiLength;
+    pSqe->buf_index = (iBuffer >= 0) ? iBuffer : 0;
+    pSqe->msg_flags = (iBuffer >= 0) ? 0 : MSG_NOSIGNAL;
+    pSqe->flags = bLink ? IOSQE_IO_LINK : 0;
+    pSqe->user_data = (uint32_t)iOp;
+    return iOp;
+}
+
+/*********************** uringRecv **************************
+    read() on the socket, IORING_OP_READ_FIXED when the
+    buffer is registered. Same return value as
+    uringConnect().
+************************************************************/
+int uringRecv(int iFd, void *pData, uint32_t uiLength, bool bLink, tUringCallback pCallback, void *pContext)
+{
+    int iOp = uringAllocOp(pCallback, pContext);
+    int iBuffer = uringBufferIndex(pData, uiLength);
+    struct io_uring_sqe *pSqe;
+
+    if(iOp < 0)
+    {
+        return -1;
+    }
+    pSqe = uringGetSqe();
+    pSqe->opcode = (iBuffer >= 0) ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    pSqe->fd = iFd;
+    pSqe->addr = (uint64_t)(uintptr_t)pData;
+    pSqe->len = uiLength;
+    pSqe->buf_index = (iBuffer >= 0) ? iBuffer : 0;
+    pSqe->flags = bLink ? IOSQE_IO_LINK : 0;
+    pSqe->user_data = (uint32_t)iOp;
+    return iOp;
+}
+
+/********************** uringTimeout ************************
+    Completes with -ETIME after uiMs, with -ECANCELED when
+    uringCancel() came first. Not linked to anything, a
+    deadline for a whole exchange.
+************************************************************/
+int uringTimeout(uint32_t uiMs, tUringCallback pCallback, void *pContext)
+{
+    int iOp = uringAllocOp(pCallback, pContext);
+    tUringOp *pOp;
+    struct io_uring_sqe *pSqe;
+
+    if(iOp < 0)
+    {
+        return -1;
+    }
+    pOp = &masUringOps[iOp & ((1 << URING_OPINDEXBITS) - 1)];
+    pOp->timeout = true;
+    pOp->sTimeout.tv_sec = uiMs / 1000;
+    pOp->sTimeout.tv_nsec = (long long)(uiMs % 1000) * 1000000;
+    pSqe = uringGetSqe();
+    pSqe->opcode = IORING_OP_TIMEOUT;
+    pSqe->fd = -1;
+    pSqe->addr = (uint64_t)(uintptr_t)&pOp->sTimeout;
+    pSqe->len = 1;
+    pSqe->off = 0; // no completion count, only the time
+    pSqe->user_data = (uint32_t)iOp;
+    return iOp;
+}
+
+/*********************** uringCancel ************************
+    The operation completes early (-ECANCELED, or -EINTR for
+    a socket operation already waiting). A handle that
+    completed already is harmless, its generation no longer
+    matches.
+************************************************************/
+void uringCancel(int iOp)
+{
+    tUringOp *pOp = uringFindOp((uint32_t)iOp);
+    struct io_uring_sqe *pSqe;
+
+    if(pOp == NULL)
+    {
+        return;
+    }
+    pSqe = uringGetSqe();
+    pSqe->opcode = pOp->timeout ? IORING_OP_TIMEOUT_REMOVE : IORING_OP_ASYNC_CANCEL;
+    pSqe->fd = -1;
+    pSqe->addr = (uint32_t)iOp;
+    pSqe->user_data = 0;
+}
+
+/*********************** uringDetach ************************
+    The completion of the operation no longer calls back,
+    for a timeout whose owner is gone. Buffers of a detached
+    send/recv are still in use until it completes.
+************************************************************/
+void uringDetach(int iOp)
+{
+    tUringOp *pOp = uringFindOp((uint32_t)iOp);
+
+    if(pOp != NULL)
+    {
+        pOp->pCallback = NULL;
+        pOp->pContext = NULL;
+    }
+}
+
+/*********************** uringFlush *************************
+    Submits what was queued since the last flush, one
+    syscall for all of it. Runs before the reactor waits.
+************************************************************/
+void uringFlush()
+{
+    int iResult;
+
+    while(muiUringPending > 0)
+    {
+        iResult = (int)syscall(__NR_io_uring_enter, miUringFd, muiUringPending, 0, 0, NULL, 0);
+        msUringStats.enters += 1;
+        if(iResult < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EBUSY)
+            {
+                printf("[ERROR] (%s) %s: io_uring_enter failed, errno %i.\n", printTimestamp(), __func__, errno);
+            }
+            return; // completions have to be reaped first, the next pass tries again
+        }
+        msUringStats.submitted += iResult;
+        if((uint32_t)iResult > msUringStats.maxBatch)
+        {
+            msUringStats.maxBatch = iResult;
+        }
+        muiUringPending -= ((unsigned)iResult < muiUringPending) ? (unsigned)iResult : muiUringPending;
+        if(iResult == 0)
+        {
+            return;
+        }
+    }
+}
+
+const tUringStats *uringStats()
+{
+    return &msUringStats;
+}
+
+void uringLog()
+{
+    if(msUringStats.enters == 0)
+    {
+        return;
+    }
+    printf("[INFO] (%s) %s: %llu operations in %llu io_uring_enter calls (max %u at once), %llu completions, %s buffers.\n", printTimestamp(), __func__,
+        (unsigned long long)msUringStats.submitted, (unsigned long long)msUringStats.enters, msUringStats.maxBatch,
+        (unsigned long long)msUringStats.completions, msUringStats.fixedBuffers ? "fixed" : "plain");
+}
+
+void uringClose()
+{
+    if(miUringFd < 0)
+    {
+        return;
+    }
+    reactorDelFd(miUringFd);
+    reactorSetPreWait(NULL);
+    if(masUringSqes != NULL)
+    {
+        munmap(masUringSqes, muiUringSqesSize);
+    }
+    if(mpUringCqRing != NULL && mpUringCqRing != mpUringSqRing)
+    {
+        munmap(mpUringCqRing, muiUringCqRingSize);
+    }
+    if(mpUringSqRing != NULL)
+    {
+        munmap(mpUringSqRing, muiUringSqRingSize);
+    }
+    close(miUringFd); // the kernel cancels what is still in flight
+    miUringFd = -1;
+    mpUringSqRing = NULL;
+    mpUringCqRing = NULL;
+    masUringSqes = NULL;
+}
+
+/********************** uringGetSqe *************************
+    Next free submission entry, cleared. A full ring is
+    submitted first.
+************************************************************/
+struct io_uring_sqe *uringGetSqe()
+{
+    unsigned uiTail = *mpUringSqTail;
+    unsigned uiIndex;
+    struct io_uring_sqe *pSqe;
+
+    while(uiTail - __atomic_load_n(mpUringSqHead, __ATOMIC_ACQUIRE) >= muiUringSqEntries)
+    {
+        uringFlush();
+    }
+    uiIndex = uiTail & muiUringSqMask;
+    pSqe = &masUringSqes[uiIndex];
+    memset(pSqe, 0, sizeof(struct io_uring_sqe));
+    mpUringSqArray[uiIndex] = uiIndex;
+    __atomic_store_n(mpUringSqTail, uiTail + 1, __ATOMIC_RELEASE); // the entry is filled in before the kernel sees it: submission is up to uringFlush()
+    muiUringPending += 1;
+    return pSqe;
+}
+
+int uringAllocOp(tUringCallback pCallback, void *pContext)
+{
+    int i;
+    for(i=0; i<URING_MAXOPS; i+=1)
+    {
+        if(!masUringOps[i].inUse)
+        {
+            masUringOps[i].inUse = true;
+            masUringOps[i].timeout = false;
+            masUringOps[i].handle = (muiUringGeneration << URING_OPINDEXBITS) | (uint32_t)i;
+            masUringOps[i].pCallback = pCallback;
+            masUringOps[i].pContext = pContext;
+            muiUringGeneration = (muiUringGeneration + 1) & 0x7fffff;
+            muiUringGeneration += (muiUringGeneration == 0) ? 1 : 0;
+            return (int)masUringOps[i].handle;
+        }
+    }
+    printf("[ERROR] (%s) %s: All %i io_uring operation slots in use.\n", printTimestamp(), __func__, URING_MAXOPS);
+    return -1;
+}
+
+tUringOp *uringFindOp(uint64_t ulUserData)
+{
+    tUringOp *pOp = &masUringOps[ulUserData & ((1 << URING_OPINDEXBITS) - 1)];
+    if(ulUserData == 0 || (ulUserData & ((1 << URING_OPINDEXBITS) - 1)) >= URING_MAXOPS || !pOp->inUse || pOp->handle != ulUserData)
+    {
+        return NULL;
+    }
+    return pOp;
+}
+
+int uringBufferIndex(const void *pData, uint32_t uiLength)
+{
+    const uint8_t *pStart = (const uint8_t *)pData;
+    int i;
+    for(i=0; i<miUringBuffers; i+=1)
+    {
+        const uint8_t *pBase = (const uint8_t *)masUringBuffers[i].iov_base;
+        if(pStart >= pBase && pStart + uiLength <= pBase + masUringBuffers[i].iov_len)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*********************** uringReap **************************
+    Reactor callback of the ring fd: dispatches every
+    completion. The slot is free before the callback runs,
+    so it may queue the next operation.
+************************************************************/
+void uringReap(int iFd, uint32_t uiEvents, void *pContext)
+{
+    unsigned uiHead = *mpUringCqHead;
+    tUringCallback pCallback;
+    void *pOpContext;
+    tUringOp *pOp;
+    uint64_t ulUserData;
+    int iResult;
+
+    while(uiHead != __atomic_load_n(mpUringCqTail, __ATOMIC_ACQUIRE))
+    {
+        ulUserData = masUringCqes[uiHead & muiUringCqMask].user_data;
+        iResult = masUringCqes[uiHead & muiUringCqMask].res;
+        uiHead += 1;
+        __atomic_store_n(mpUringCqHead, uiHead, __ATOMIC_RELEASE);
+        msUringStats.completions += 1;
+        pOp = uringFindOp(ulUserData);
+        if(pOp == NULL)
+        {
+            continue; // a cancel or timeout removal
+        }
+        pCallback = pOp->pCallback;
+        pOpContext = pOp->pContext;
+        pOp->inUse = false;
+        if(pCallback != NULL)
+        {
+            pCallback(iResult, pOpContext);
+        }
+    }
+}
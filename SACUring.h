@@ -0,0 +1,54 @@
+#ifndef SACURING_H
+#define SACURING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define URING_ENTRIES           64 // submission queue entries, the kernel makes the completion queue twice as big
+#define URING_MAXOPS            64 // operations in flight at the same time
+
+/*
+    io_uring next to the reactor, raw syscalls (no liburing).
+    Operations are queued in the submission ring while the
+    loop runs its callbacks and go to the kernel with one
+    io_uring_enter() before the loop waits again
+    (reactorSetPreWait). The ring fd is watched by the
+    reactor, completions are dispatched from there, each to
+    the callback it was queued with. Callbacks run in the
+    reactor thread like every other callback.
+    Buffers given to uringInit() are registered with the
+    kernel (fixed buffers, no page pinning per operation);
+    uringSend()/uringRecv() on an address inside one of them
+    use it, other addresses work as well. Operations may be
+    linked: the next one queued starts when this one
+    succeeded and completes with -ECANCELED otherwise.
+    Needs linux >= 5.5 (IORING_OP_CONNECT).
+*/
+
+typedef void (*tUringCallback)(int iResult, void *pContext); // iResult: as the syscall would return, -errno on failure
+
+typedef struct
+{
+    uint64_t enters; // io_uring_enter() calls
+    uint64_t submitted; // operations, links and timeouts included
+    uint64_t completions;
+    uint32_t maxBatch; // operations submitted by one io_uring_enter()
+    bool fixedBuffers; // uringInit() registered the buffers
+} tUringStats;
+
+int uringInit(const struct iovec *asBuffers, int iBuffers);
+bool uringReady();
+int uringConnect(int iFd, const struct sockaddr *pAddr, socklen_t uiLength, bool bLink, tUringCallback pCallback, void *pContext);
+int uringSend(int iFd, const void *pData, uint32_t uiLength, bool bLink, tUringCallback pCallback, void *pContext);
+int uringRecv(int iFd, void *pData, uint32_t uiLength, bool bLink, tUringCallback pCallback, void *pContext);
+int uringTimeout(uint32_t uiMs, tUringCallback pCallback, void *pContext);
+void uringCancel(int iOp);
+void uringDetach(int iOp);
+void uringFlush();
+const tUringStats *uringStats();
+void uringLog();
+void uringClose();
+
+#endif
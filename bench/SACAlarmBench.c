@@ -0,0 +1,481 @@
+/*
+    Alarm latency under a telemetry flood, run with
+    "make alarmbench".
+
+    The daemon's state machine runs over the simulated BSC
+    (like SACAsyncBench) with a transport that answers each
+    uplink after -r ms through a reactor timer, up to
+    COMMS_MAXINFLIGHT at a time. A producer queues -t
+    telemetry records per second straight into the uplink
+    scheduler, far more than the transport takes, so the
+    backlog stays full (oldest dropped). The housekeeping
+    tick drains it while the bus is quiet or an alarm is
+    queued, but never on the last free exchange. Every
+    -i ms the controller sends a lockstep command,
+    alternately an alarm 0x03 and an event 0x02 asking
+    for a downlink.
+    Once without a rate limit and once with [uplink]
+    rate_per_min -l and burst -b, reported per run:
+        alarms: ms from the controller's frame until the
+                transport delivered it, percentiles, and how
+                often the controller got SERVERUNREACH or
+                BUSY (no free exchange, went out later);
+        events: the controller's latency and downlinks that
+                were not its own or came with an error code.
+                An event is the record the controller waits
+                on, the rate limit must not hold it back;
+        telemetry delivered and dropped per second.
+
+    Usage:
+        SACAlarmBench [-s seconds] [-t telemetry/s] [-i ms] [-r rtt ms] [-l rate/min] [-b burst] [-v]
+    Exit code 1 when in either run an alarm was lost or
+    got SERVERUNREACH or BUSY, the alarm p99 is above
+    ALARMBENCH_MAXP99RTTS round trips or an event failed,
+    or when more telemetry went out than the burst and
+    the rate allow.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACBenchBsc.h"
+
+#define ALARMBENCH_SECONDS      20
+#define ALARMBENCH_TELEMPERSEC  500
+#define ALARMBENCH_INTERVALMS   1000 // between two controller commands, the backlog drains in the quiet part
+#define ALARMBENCH_RTTMS        50
+#define ALARMBENCH_RATEPERMIN   60
+#define ALARMBENCH_BURST        10
+#define ALARMBENCH_MAXCOMMANDS  4096
+#define ALARMBENCH_BYTEUS       90 // 9 bits per byte at 100 kHz
+#define ALARMBENCH_FRAMEUS      120 // start, address byte and stop per transfer
+#define ALARMBENCH_RETRYUS      2000 // controller retry after a NACK
+#define ALARMBENCH_MAXP99RTTS   4 // alarm p99 bound, in round trips
+#define ALARMBENCH_SETTLEMS     5000 // after the run: alarms still on their way
+
+typedef enum
+{
+    CTRL_WAIT, // for the next command's turn
+    CTRL_READENA, // read enable until the slave takes it
+    CTRL_READREPLY,
+} tCtrlStep;
+
+typedef struct
+{
+    const char *name;
+    uint32_t ratePerMin; // 0: no rate limit
+    uint32_t alarms;
+    uint32_t alarmsDelivered;
+    uint32_t alarmsUnreach; // controller got SERVERUNREACH or BUSY
+    uint32_t alarmP50Us;
+    uint32_t alarmP99Us;
+    uint32_t alarmMaxUs;
+    uint32_t events;
+    uint32_t eventsWrong; // not its own downlink or an error code
+    uint32_t eventP50Us;
+    uint32_t eventP99Us;
+    uint32_t telemDelivered;
+    uint32_t telemDropped;
+    double seconds;
+} tAlarmBenchRun;
+
+typedef struct
+{
+    bool busy;
+    tUplinkRecord record;
+    tCommsDoneCallback pDone;
+    int timerFd;
+} tAlarmBenchExchange;
+
+/****************** daemon internals driven by the benchmark *********************/
+extern tSmState sState;
+uint8_t slave_init();
+void slaveService();
+void slaveHousekeeping(int iFd, uint32_t uiEvents, void *pContext);
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int alarmBenchRun(tAlarmBenchRun *pRun);
+void alarmBenchControllerStep(tAlarmBenchRun *pRun, uint64_t ulNowUs);
+void alarmBenchFlood(uint64_t ulStartUs, uint64_t ulNowUs);
+int alarmBenchStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone);
+int alarmBenchSendUplink(tUplinkRecord *pRecord);
+uint32_t alarmBenchInFlight();
+void alarmBenchAnswer(int iFd, uint32_t uiEvents, void *pContext);
+uint32_t alarmBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent);
+int alarmBenchCompare(const void *pA, const void *pB);
+void alarmBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static uint32_t muiSeconds = ALARMBENCH_SECONDS;
+static uint32_t muiTelemPerSec = ALARMBENCH_TELEMPERSEC;
+static uint32_t muiIntervalMs = ALARMBENCH_INTERVALMS;
+static uint32_t muiRttMs = ALARMBENCH_RTTMS;
+static tAlarmBenchExchange masExchanges[COMMS_MAXINFLIGHT];
+static tCtrlStep meCtrlStep = CTRL_WAIT;
+static uint64_t mulCtrlBusyUntilUs = 0; // bus transfer, retry wait or interval in progress
+static uint32_t muiCtrlCommands = 0; // even: alarm, odd: event
+static uint64_t mulCtrlSentUs = 0;
+static uint64_t maulAlarmWrittenUs[ALARMBENCH_MAXCOMMANDS]; // by command counter
+static uint32_t mauiAlarmUs[ALARMBENCH_MAXCOMMANDS];
+static uint32_t mauiEventUs[ALARMBENCH_MAXCOMMANDS];
+static uint32_t muiAlarmSamples = 0;
+static uint32_t muiEventSamples = 0;
+static uint32_t muiTelemQueued = 0;
+static uint32_t muiTelemDelivered = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const tCommsTransport msAlarmBenchTransport =
+{
+    .name = "alarmbench",
+    .sendUplink = alarmBenchSendUplink,
+    .startUplink = alarmBenchStartUplink,
+};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tAlarmBenchRun asRuns[] =
+    {
+        {.name = "no rate limit", .ratePerMin = 0},
+        {.name = "rate limit", .ratePerMin = ALARMBENCH_RATEPERMIN},
+    };
+    uint32_t uiBurst = ALARMBENCH_BURST;
+    uint32_t uiAllowed;
+    bool bVerbose = false;
+    bool bPass = true;
+    char sName[32];
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "s:t:i:r:l:b:v")) != -1)
+    {
+        switch(iOption)
+        {
+            case 's': muiSeconds = atoi(optarg); break;
+            case 't': muiTelemPerSec = atoi(optarg); break;
+            case 'i': muiIntervalMs = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'l': asRuns[1].ratePerMin = atoi(optarg); break;
+            case 'b': uiBurst = atoi(optarg); break;
+            case 'v': bVerbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-s seconds] [-t telemetry/s] [-i ms] [-r rtt ms] [-l rate/min] [-b burst] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(muiSeconds == 0 || muiIntervalMs == 0 || muiSeconds * 1000 / muiIntervalMs >= ALARMBENCH_MAXCOMMANDS || asRuns[1].ratePerMin == 0 || uiBurst == 0 || uiBurst > UPLSCHED_MAXBURST)
+    {
+        fprintf(stderr, "Need fewer than %u commands per run, a rate limit and a burst of 1..%u.\n", ALARMBENCH_MAXCOMMANDS, UPLSCHED_MAXBURST);
+        return 2;
+    }
+    snprintf(sName, sizeof(sName), "%u/min, burst %u", asRuns[1].ratePerMin, uiBurst);
+    asRuns[1].name = sName;
+
+    alarmBenchQuiet(!bVerbose);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        masExchanges[i].timerFd = reactorTimerCreate(alarmBenchAnswer, &masExchanges[i]);
+    }
+    commsSetTransport(&msAlarmBenchTransport);
+    benchBscReset();
+    slave_init();
+    alarmBenchQuiet(false);
+
+    fprintf(stderr, "%u s per run, %u telemetry/s, a command every %u ms (alarm, event, ...), %u ms rtt, %u uplinks in flight\n",
+        muiSeconds, muiTelemPerSec, muiIntervalMs, muiRttMs, COMMS_MAXINFLIGHT);
+    fprintf(stderr, "%-18s %7s %9s %9s %9s %7s %7s %9s %9s %7s %9s %9s\n", "run", "alarms", "p50 ms", "p99 ms", "max ms", "unreach", "events", "p50 ms", "p99 ms", "wrong", "telem/s", "dropped/s");
+    for(i=0; i<(int)(sizeof(asRuns) / sizeof(asRuns[0])); i+=1)
+    {
+        tAlarmBenchRun *pRun = &asRuns[i];
+        alarmBenchQuiet(!bVerbose);
+        uplinkSchedSetRateLimit(pRun->ratePerMin, uiBurst); // what [uplink] rate_per_min and burst apply
+        alarmBenchRun(pRun);
+        alarmBenchQuiet(false);
+        fprintf(stderr, "%-18s %3u/%-3u %9.1f %9.1f %9.1f %7u %7u %9.1f %9.1f %7u %9.1f %9.1f\n", pRun->name, pRun->alarmsDelivered, pRun->alarms,
+            pRun->alarmP50Us / 1000.0, pRun->alarmP99Us / 1000.0, pRun->alarmMaxUs / 1000.0, pRun->alarmsUnreach,
+            pRun->events, pRun->eventP50Us / 1000.0, pRun->eventP99Us / 1000.0, pRun->eventsWrong,
+            pRun->telemDelivered / pRun->seconds, pRun->telemDropped / pRun->seconds);
+        bPass = bPass && pRun->alarms > 0 && pRun->alarmsDelivered == pRun->alarms && pRun->alarmsUnreach == 0;
+        bPass = bPass && pRun->alarmP99Us <= ALARMBENCH_MAXP99RTTS * muiRttMs * 1000; // one exchange stays free for them
+        bPass = bPass && pRun->events > 0 && pRun->eventsWrong == 0;
+    }
+    uiAllowed = uiBurst + (uint32_t)(asRuns[1].ratePerMin * asRuns[1].seconds / 60.0) + 1;
+    fprintf(stderr, "rate limit: %u telemetry delivered in %.1f s, burst and rate allow %u\n", asRuns[1].telemDelivered, asRuns[1].seconds, uiAllowed);
+    bPass = bPass && asRuns[1].telemDelivered <= uiAllowed;
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/********************** alarmBenchRun ***********************
+    Controller, producer and daemon share this thread like
+    in SACAsyncBench, the housekeeping tick is called here
+    as the reactor timer would.
+************************************************************/
+int alarmBenchRun(tAlarmBenchRun *pRun)
+{
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    uint64_t ulNowUs = ulStartUs;
+    uint64_t ulHousekeepingUs = ulStartUs;
+    uint32_t uiDroppedBefore = uplinkSchedDropped(UPLCLASS_TELEMETRY);
+
+    meCtrlStep = CTRL_WAIT;
+    mulCtrlBusyUntilUs = ulStartUs;
+    muiCtrlCommands = 0;
+    muiAlarmSamples = 0;
+    muiEventSamples = 0;
+    muiTelemQueued = 0;
+    muiTelemDelivered = 0;
+    memset(maulAlarmWrittenUs, 0, sizeof(maulAlarmWrittenUs));
+    while(ulNowUs - ulStartUs < muiSeconds * 1000000ULL || meCtrlStep != CTRL_WAIT)
+    {
+        if(ulNowUs - ulStartUs < muiSeconds * 1000000ULL)
+        {
+            alarmBenchFlood(ulStartUs, ulNowUs);
+        }
+        if(ulNowUs >= mulCtrlBusyUntilUs && (meCtrlStep != CTRL_WAIT || ulNowUs - ulStartUs < muiSeconds * 1000000ULL))
+        {
+            alarmBenchControllerStep(pRun, ulNowUs);
+        }
+        slaveService();
+        if(ulNowUs >= ulHousekeepingUs)
+        {
+            slaveHousekeeping(-1, 0, NULL);
+            ulHousekeepingUs = ulNowUs + configGet()->housekeepingIntervalMs * 1000ULL;
+        }
+        reactorRunOnce(1);
+        ulNowUs = printGetMonotonicTimeUs();
+    }
+    pRun->seconds = (ulNowUs - ulStartUs) / 1.0e6;
+    pRun->telemDelivered = muiTelemDelivered;
+    pRun->telemDropped = uplinkSchedDropped(UPLCLASS_TELEMETRY) - uiDroppedBefore;
+    while(muiAlarmSamples < pRun->alarms && printGetMonotonicTimeUs() - ulNowUs < ALARMBENCH_SETTLEMS * 1000ULL)
+    {
+        slaveService();
+        slaveHousekeeping(-1, 0, NULL);
+        reactorRunOnce(10);
+    }
+    pRun->alarmsDelivered = muiAlarmSamples;
+    uplinkSchedInit(); // the backlog of this run doesn't carry over
+    while(alarmBenchInFlight() > 0)
+    {
+        reactorRunOnce(10);
+    }
+    pRun->alarmP50Us = alarmBenchPercentile(mauiAlarmUs, muiAlarmSamples, 50);
+    pRun->alarmP99Us = alarmBenchPercentile(mauiAlarmUs, muiAlarmSamples, 99);
+    pRun->alarmMaxUs = alarmBenchPercentile(mauiAlarmUs, muiAlarmSamples, 100);
+    pRun->eventP50Us = alarmBenchPercentile(mauiEventUs, muiEventSamples, 50);
+    pRun->eventP99Us = alarmBenchPercentile(mauiEventUs, muiEventSamples, 99);
+
+    return 0;
+}
+
+/**************** alarmBenchControllerStep ******************
+    One bus transaction of the controller: the command when
+    its turn came, read enables until the slave takes one,
+    the reply.
+************************************************************/
+void alarmBenchControllerStep(tAlarmBenchRun *pRun, uint64_t ulNowUs)
+{
+    static const uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    tCtrlSendCmd sSend;
+    uint8_t abReply[STRUCTS_DECKEDREPLYTOTALSIZE];
+    uint32_t uiCounter = muiCtrlCommands;
+    bool bAlarm = (uiCounter % 2 == 0);
+    int iLength;
+
+    switch(meCtrlStep)
+    {
+        case CTRL_WAIT:
+            memset(&sSend, 0, sizeof(sSend));
+            sSend.startTag = IOT_FRMSTARTTAG;
+            sSend.cmdCode = bAlarm ? UPLSCHED_CMDCODE_ALARM : 0x02;
+            sSend.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+            sSend.downlinkIndicator = bAlarm ? 0x00 : 0x01;
+            memcpy(sSend.payload, &uiCounter, sizeof(uiCounter));
+            sSend.endTag = IOT_FRMENDTAG;
+            mulCtrlSentUs = ulNowUs;
+            if(bAlarm)
+            {
+                maulAlarmWrittenUs[uiCounter] = ulNowUs;
+                pRun->alarms += 1;
+            }
+            benchBscControllerWrite(sSend.ui8, sizeof(sSend.ui8));
+            mulCtrlBusyUntilUs = ulNowUs + ALARMBENCH_FRAMEUS + sizeof(sSend.ui8) * ALARMBENCH_BYTEUS;
+            meCtrlStep = CTRL_READENA;
+            break;
+
+        case CTRL_READENA:
+            if((getRawBCSCReg(3) & 0x1) == 0)
+            {
+                mulCtrlBusyUntilUs = ulNowUs + ALARMBENCH_FRAMEUS + ALARMBENCH_RETRYUS; // the slave holds the bus off while the uplink is on its way
+                break;
+            }
+            benchBscControllerWrite(abReadEnaFrame, sizeof(abReadEnaFrame));
+            mulCtrlBusyUntilUs = ulNowUs + ALARMBENCH_FRAMEUS + sizeof(abReadEnaFrame) * ALARMBENCH_BYTEUS;
+            meCtrlStep = CTRL_READREPLY;
+            break;
+
+        case CTRL_READREPLY:
+            memset(abReply, 0, sizeof(abReply));
+            iLength = benchBscControllerRead(abReply, sizeof(abReply));
+            if(bAlarm)
+            {
+                pRun->alarmsUnreach += (abReply[2] == I2CERRORCODE_SERVERUNREACH || abReply[2] == I2CERRORCODE_BUSY) ? 1 : 0;
+            }
+            else
+            {
+                pRun->events += 1;
+                mauiEventUs[muiEventSamples++] = (uint32_t)(printGetMonotonicTimeUs() - mulCtrlSentUs);
+                if(iLength != STRUCTS_DECKEDREPLYTOTALSIZE || abReply[2] != I2CERRORCODE_OK || memcmp(&abReply[4], &uiCounter, sizeof(uiCounter)) != 0)
+                {
+                    pRun->eventsWrong += 1;
+                }
+            }
+            muiCtrlCommands += 1;
+            mulCtrlBusyUntilUs = mulCtrlSentUs + muiIntervalMs * 1000ULL;
+            meCtrlStep = CTRL_WAIT;
+            break;
+    }
+}
+
+/******************** alarmBenchFlood ***********************
+    Telemetry due since the start of the run goes into the
+    scheduler, as the controller's 0x02 frames without a
+    downlink leave it when the link can't keep up.
+************************************************************/
+void alarmBenchFlood(uint64_t ulStartUs, uint64_t ulNowUs)
+{
+    uint32_t uiDue = (uint32_t)((ulNowUs - ulStartUs) * muiTelemPerSec / 1000000ULL);
+    tCtrlSendCmd sSend;
+
+    memset(&sSend, 0, sizeof(sSend));
+    sSend.startTag = IOT_FRMSTARTTAG;
+    sSend.cmdCode = 0x02;
+    sSend.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sSend.downlinkIndicator = 0x00;
+    sSend.endTag = IOT_FRMENDTAG;
+    while(muiTelemQueued < uiDue)
+    {
+        memcpy(sSend.payload, &muiTelemQueued, sizeof(muiTelemQueued));
+        uplinkSchedEnqueue(&sSend);
+        muiTelemQueued += 1;
+    }
+}
+
+/****************** alarmBenchStartUplink *******************
+    Answers after the rtt, the record is copied, the
+    caller's may live on its stack.
+************************************************************/
+int alarmBenchStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone)
+{
+    int i;
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        tAlarmBenchExchange *pExchange = &masExchanges[i];
+        if(!pExchange->busy)
+        {
+            memcpy(&pExchange->record, pRecord, sizeof(tUplinkRecord));
+            pExchange->pDone = pDone;
+            pExchange->busy = true;
+            reactorTimerArm(pExchange->timerFd, muiRttMs, 0);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int alarmBenchSendUplink(tUplinkRecord *pRecord)
+{
+    return -1; // reactor mode only
+}
+
+uint32_t alarmBenchInFlight()
+{
+    uint32_t uiBusy = 0;
+    int i;
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        uiBusy += masExchanges[i].busy ? 1 : 0;
+    }
+    return uiBusy;
+}
+
+/********************* alarmBenchAnswer *********************
+    The server has the record: alarms are timed from the
+    controller's frame, the downlink echoes the counter.
+************************************************************/
+void alarmBenchAnswer(int iFd, uint32_t uiEvents, void *pContext)
+{
+    tAlarmBenchExchange *pExchange = (tAlarmBenchExchange *)pContext;
+    tUplinkRecord sRecord;
+    uint32_t uiCounter;
+
+    memcpy(&sRecord, &pExchange->record, sizeof(tUplinkRecord)); // the done callback may start the next uplink in this slot
+    pExchange->busy = false;
+    memcpy(&uiCounter, sRecord.cmd.payload, sizeof(uiCounter));
+    if(sRecord.cmd.cmdCode == UPLSCHED_CMDCODE_ALARM && uiCounter < ALARMBENCH_MAXCOMMANDS && maulAlarmWrittenUs[uiCounter] != 0)
+    {
+        mauiAlarmUs[muiAlarmSamples++] = (uint32_t)(printGetMonotonicTimeUs() - maulAlarmWrittenUs[uiCounter]);
+        maulAlarmWrittenUs[uiCounter] = 0;
+    }
+    else if(sRecord.priorityClass == UPLCLASS_TELEMETRY)
+    {
+        muiTelemDelivered += 1;
+    }
+    memset(getCtrlDeckedReply()->payload, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    memcpy(getCtrlDeckedReply()->payload, sRecord.cmd.payload, sizeof(uint32_t));
+    commsUplinkFinished(&sRecord, 0, pExchange->pDone);
+}
+
+uint32_t alarmBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent)
+{
+    if(uiCount == 0)
+    {
+        return 0;
+    }
+    qsort(auiSamples, uiCount, sizeof(uint32_t), alarmBenchCompare);
+    return auiSamples[(uiCount - 1) * uiPercent / 100];
+}
+
+int alarmBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void alarmBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,424 @@
+/*
+    Tagged commands against the lockstep flow, run with
+    "make asyncbench".
+
+    The daemon's state machine runs over the simulated BSC
+    (like SACBench), the benchmark plays the controller:
+        lockstep: send command 0x02, read enables 0x01 while
+                  the slave holds the bus off (NACK, retried
+                  every ASYNCBENCH_RETRYUS), read the reply;
+        tagged:   up to -w tagged sends 0x04 outstanding,
+                  status queries 0x05 for the oldest one, a
+                  pending answer with a full window waits
+                  ASYNCBENCH_RETRYUS before the next query.
+    Every frame costs its bytes at 100 kHz on the bus. The
+    transport answers each uplink after -r ms through a
+    reactor timer, its downlink echoes the command counter,
+    every command must get its own downlink back.
+    Reported per flow: commands per second, the controller's
+    command latency (send to reply), i2c frames and NACKs.
+
+    Usage:
+        SACAsyncBench [-n commands] [-r rtt ms] [-w window] [-v]
+    Exit code 1 when a downlink was wrong or the tagged flow
+    is not ASYNCBENCH_MINSPEEDUP times faster.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACAsyncCmd.h"
+#include "SACBenchBsc.h"
+
+#define ASYNCBENCH_COMMANDS     200
+#define ASYNCBENCH_RTTMS        50
+#define ASYNCBENCH_WINDOW       8 // tagged commands outstanding at the controller
+#define ASYNCBENCH_BYTEUS       90 // 9 bits per byte at 100 kHz
+#define ASYNCBENCH_FRAMEUS      120 // start, address byte and stop per transfer
+#define ASYNCBENCH_RETRYUS      2000 // controller retry after a NACK or a pending answer
+#define ASYNCBENCH_MINSPEEDUP   2.0
+#define ASYNCBENCH_MAXSECONDS   120
+
+typedef enum
+{
+    CTRL_SEND, // next command or query
+    CTRL_READENA, // lockstep: read enable until the slave takes it
+    CTRL_READREPLY, // lockstep: decked reply
+    CTRL_READACCEPT, // tagged: reply to the tagged send
+    CTRL_READSTATUS, // tagged: reply to the status query
+} tCtrlStep;
+
+typedef struct
+{
+    const char *name;
+    bool tagged;
+    double seconds;
+    uint32_t completed;
+    uint32_t wrong; // downlink of another command or error code
+    uint32_t frames; // i2c writes and reads
+    uint32_t nacks;
+    uint32_t pendingAnswers;
+    uint64_t latencyUsSum;
+    uint32_t maxLatencyUs;
+} tAsyncBenchRun;
+
+typedef struct
+{
+    bool busy;
+    tUplinkRecord record;
+    tCommsDoneCallback pDone;
+    int timerFd;
+} tAsyncBenchExchange;
+
+typedef struct
+{
+    uint8_t tag;
+    uint32_t counter;
+    uint64_t sentUs;
+} tAsyncBenchOutstanding;
+
+/****************** daemon internals driven by the benchmark *********************/
+extern tSmState sState;
+uint8_t slave_init();
+void slaveService();
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int asyncBenchRun(tAsyncBenchRun *pRun);
+void asyncBenchControllerStep(tAsyncBenchRun *pRun);
+void asyncBenchWrite(tAsyncBenchRun *pRun, const uint8_t *pFrame, int iLength);
+int asyncBenchRead(tAsyncBenchRun *pRun, uint8_t *pDest, int iLength);
+void asyncBenchCompleted(tAsyncBenchRun *pRun, const uint8_t *pReply, uint32_t uiCounter, uint64_t ulSentUs);
+int asyncBenchStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone);
+int asyncBenchSendUplink(tUplinkRecord *pRecord);
+void asyncBenchAnswer(int iFd, uint32_t uiEvents, void *pContext);
+void asyncBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static uint32_t muiCommands = ASYNCBENCH_COMMANDS;
+static uint32_t muiRttMs = ASYNCBENCH_RTTMS;
+static uint32_t muiWindow = ASYNCBENCH_WINDOW;
+static tAsyncBenchExchange masExchanges[COMMS_MAXINFLIGHT];
+static tCtrlStep meCtrlStep = CTRL_SEND;
+static uint64_t mulCtrlBusyUntilUs = 0; // bus transfer or retry wait in progress
+static uint32_t muiCtrlSent = 0;
+static uint64_t mulCtrlSentUs = 0; // lockstep: the command being served
+static tAsyncBenchOutstanding masOutstanding[ASYNCCMD_MAXTAGS]; // tagged: fifo, oldest first
+static uint32_t muiOutstanding = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const tCommsTransport msAsyncBenchTransport =
+{
+    .name = "asyncbench",
+    .sendUplink = asyncBenchSendUplink,
+    .startUplink = asyncBenchStartUplink,
+};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tAsyncBenchRun asRuns[] =
+    {
+        {.name = "lockstep 0x02/0x01", .tagged = false},
+        {.name = "tagged 0x04/0x05", .tagged = true},
+    };
+    bool bVerbose = false;
+    bool bPass = true;
+    double dSpeedup;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "n:r:w:v")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': muiCommands = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'w': muiWindow = atoi(optarg); break;
+            case 'v': bVerbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-n commands] [-r rtt ms] [-w window] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(muiCommands == 0 || muiWindow == 0 || muiWindow > ASYNCCMD_MAXTAGS)
+    {
+        fprintf(stderr, "Need at least one command and a window of 1..%u.\n", ASYNCCMD_MAXTAGS);
+        return 2;
+    }
+
+    asyncBenchQuiet(!bVerbose);
+    structsInit();
+    uplinkSchedInit();
+    asyncCmdInit();
+    reactorInit(NULL, 0, NULL);
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        masExchanges[i].timerFd = reactorTimerCreate(asyncBenchAnswer, &masExchanges[i]);
+    }
+    commsSetTransport(&msAsyncBenchTransport);
+    benchBscReset();
+    slave_init();
+    asyncBenchQuiet(false);
+
+    fprintf(stderr, "%u commands, %u ms rtt, window %u, %u uplinks in flight\n", muiCommands, muiRttMs, muiWindow, COMMS_MAXINFLIGHT);
+    fprintf(stderr, "%-20s %9s %10s %12s %12s %8s %8s %8s %6s\n", "flow", "seconds", "cmds/s", "avg lat ms", "max lat ms", "frames", "nacks", "pending", "wrong");
+    for(i=0; i<(int)(sizeof(asRuns) / sizeof(asRuns[0])); i+=1)
+    {
+        tAsyncBenchRun *pRun = &asRuns[i];
+        asyncBenchQuiet(!bVerbose);
+        asyncBenchRun(pRun);
+        asyncBenchQuiet(false);
+        fprintf(stderr, "%-20s %9.2f %10.1f %12.1f %12.1f %8u %8u %8u %6u\n", pRun->name, pRun->seconds, pRun->completed / pRun->seconds,
+            (pRun->completed > 0) ? pRun->latencyUsSum / 1000.0 / pRun->completed : 0.0, pRun->maxLatencyUs / 1000.0,
+            pRun->frames, pRun->nacks, pRun->pendingAnswers, pRun->wrong);
+        bPass = bPass && pRun->completed == muiCommands && pRun->wrong == 0;
+    }
+    dSpeedup = (asRuns[0].completed / asRuns[0].seconds > 0) ? (asRuns[1].completed / asRuns[1].seconds) / (asRuns[0].completed / asRuns[0].seconds) : 0.0;
+    fprintf(stderr, "tagged: %.1fx the commands per second of lockstep, max %u outstanding in the slave\n", dSpeedup, asyncCmdStats()->maxOutstanding);
+    bPass = bPass && dSpeedup >= ASYNCBENCH_MINSPEEDUP;
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/********************** asyncBenchRun ***********************
+    Controller and daemon share this thread: the controller
+    acts when its bus transfer or wait is over, the state
+    machine runs like on a bsc event, the reactor delivers
+    the uplink answers in between.
+************************************************************/
+int asyncBenchRun(tAsyncBenchRun *pRun)
+{
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    uint64_t ulNowUs = ulStartUs;
+
+    meCtrlStep = CTRL_SEND;
+    mulCtrlBusyUntilUs = 0;
+    muiCtrlSent = 0;
+    muiOutstanding = 0;
+    while(pRun->completed < muiCommands && ulNowUs - ulStartUs < ASYNCBENCH_MAXSECONDS * 1000000ULL)
+    {
+        if(ulNowUs >= mulCtrlBusyUntilUs)
+        {
+            asyncBenchControllerStep(pRun);
+        }
+        slaveService();
+        ulNowUs = printGetMonotonicTimeUs();
+        reactorRunOnce((mulCtrlBusyUntilUs > ulNowUs + 1000) ? 1 : 0);
+        ulNowUs = printGetMonotonicTimeUs();
+    }
+    pRun->seconds = (ulNowUs - ulStartUs) / 1.0e6;
+    return 0;
+}
+
+/***************** asyncBenchControllerStep *****************
+    One bus transaction of the controller.
+************************************************************/
+void asyncBenchControllerStep(tAsyncBenchRun *pRun)
+{
+    static const uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    tCtrlTaggedSendCmd sTagged;
+    tCtrlSendCmd sSend;
+    tCtrlStatusCmd sStatus;
+    uint8_t abReply[STRUCTS_DECKEDREPLYTOTALSIZE];
+    uint32_t uiCounter = muiCtrlSent;
+
+    switch(meCtrlStep)
+    {
+        case CTRL_SEND:
+            if(!pRun->tagged)
+            {
+                memset(&sSend, 0, sizeof(sSend));
+                sSend.startTag = IOT_FRMSTARTTAG;
+                sSend.cmdCode = 0x02;
+                sSend.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+                sSend.downlinkIndicator = 0x01;
+                memcpy(sSend.payload, &uiCounter, sizeof(uiCounter));
+                sSend.endTag = IOT_FRMENDTAG;
+                mulCtrlSentUs = printGetMonotonicTimeUs();
+                asyncBenchWrite(pRun, sSend.ui8, sizeof(sSend.ui8));
+                meCtrlStep = CTRL_READENA;
+            }
+            else if(muiOutstanding < muiWindow && muiCtrlSent < muiCommands)
+            {
+                memset(&sTagged, 0, sizeof(sTagged));
+                sTagged.startTag = IOT_FRMSTARTTAG;
+                sTagged.cmdCode = ASYNCCMD_CMDCODE_SEND;
+                sTagged.tag = (uint8_t)(uiCounter % 255 + 1); // 0 is the summary
+                sTagged.sendCmdCode = 0x02;
+                sTagged.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+                sTagged.downlinkIndicator = 0x01;
+                memcpy(sTagged.payload, &uiCounter, sizeof(uiCounter));
+                sTagged.endTag = IOT_FRMENDTAG;
+                masOutstanding[muiOutstanding].tag = sTagged.tag;
+                masOutstanding[muiOutstanding].counter = uiCounter;
+                masOutstanding[muiOutstanding].sentUs = printGetMonotonicTimeUs();
+                asyncBenchWrite(pRun, sTagged.ui8, sizeof(sTagged.ui8));
+                meCtrlStep = CTRL_READACCEPT;
+            }
+            else if(muiOutstanding > 0)
+            {
+                sStatus.startTag = IOT_FRMSTARTTAG;
+                sStatus.cmdCode = ASYNCCMD_CMDCODE_STATUS;
+                sStatus.tag = masOutstanding[0].tag;
+                sStatus.endTag = IOT_FRMENDTAG;
+                asyncBenchWrite(pRun, sStatus.ui8, sizeof(sStatus.ui8));
+                meCtrlStep = CTRL_READSTATUS;
+            }
+            break;
+
+        case CTRL_READENA:
+            if((getRawBCSCReg(3) & 0x1) == 0)
+            {
+                pRun->nacks += 1; // the slave holds the bus off while the uplink is on its way
+                mulCtrlBusyUntilUs = printGetMonotonicTimeUs() + ASYNCBENCH_FRAMEUS + ASYNCBENCH_RETRYUS;
+                break;
+            }
+            asyncBenchWrite(pRun, abReadEnaFrame, sizeof(abReadEnaFrame));
+            meCtrlStep = CTRL_READREPLY;
+            break;
+
+        case CTRL_READREPLY:
+            asyncBenchRead(pRun, abReply, STRUCTS_DECKEDREPLYTOTALSIZE);
+            asyncBenchCompleted(pRun, abReply, muiCtrlSent, mulCtrlSentUs);
+            muiCtrlSent += 1;
+            meCtrlStep = CTRL_SEND;
+            break;
+
+        case CTRL_READACCEPT:
+            if(asyncBenchRead(pRun, abReply, sizeof(tCtrlEmptyReply)) != sizeof(tCtrlEmptyReply) || abReply[1] != ASYNCCMD_CMDCODE_SEND || abReply[2] != I2CERRORCODE_PENDING)
+            {
+                pRun->wrong += 1;
+            }
+            muiOutstanding += 1;
+            muiCtrlSent += 1;
+            meCtrlStep = CTRL_SEND;
+            break;
+
+        case CTRL_READSTATUS:
+            asyncBenchRead(pRun, abReply, STRUCTS_DECKEDREPLYTOTALSIZE);
+            meCtrlStep = CTRL_SEND;
+            if(abReply[2] == I2CERRORCODE_PENDING)
+            {
+                pRun->pendingAnswers += 1;
+                if(muiOutstanding == muiWindow || muiCtrlSent == muiCommands)
+                {
+                    mulCtrlBusyUntilUs += ASYNCBENCH_RETRYUS; // nothing else to do, ask again later
+                }
+                break;
+            }
+            asyncBenchCompleted(pRun, abReply, masOutstanding[0].counter, masOutstanding[0].sentUs);
+            muiOutstanding -= 1;
+            memmove(&masOutstanding[0], &masOutstanding[1], muiOutstanding * sizeof(tAsyncBenchOutstanding));
+            break;
+    }
+}
+
+void asyncBenchWrite(tAsyncBenchRun *pRun, const uint8_t *pFrame, int iLength)
+{
+    benchBscControllerWrite(pFrame, iLength);
+    pRun->frames += 1;
+    mulCtrlBusyUntilUs = printGetMonotonicTimeUs() + ASYNCBENCH_FRAMEUS + iLength * ASYNCBENCH_BYTEUS;
+}
+
+int asyncBenchRead(tAsyncBenchRun *pRun, uint8_t *pDest, int iLength)
+{
+    memset(pDest, 0, iLength);
+    iLength = benchBscControllerRead(pDest, iLength);
+    pRun->frames += 1;
+    mulCtrlBusyUntilUs = printGetMonotonicTimeUs() + ASYNCBENCH_FRAMEUS + iLength * ASYNCBENCH_BYTEUS;
+    return iLength;
+}
+
+/******************* asyncBenchCompleted ********************
+    A decked reply with the command's own counter in the
+    downlink.
+************************************************************/
+void asyncBenchCompleted(tAsyncBenchRun *pRun, const uint8_t *pReply, uint32_t uiCounter, uint64_t ulSentUs)
+{
+    uint32_t uiLatencyUs = (uint32_t)(printGetMonotonicTimeUs() - ulSentUs);
+
+    if(pReply[2] != I2CERRORCODE_OK || pReply[3] != STRUCTS_DECKEDREPLYPAYLOADSIZE || memcmp(&pReply[4], &uiCounter, sizeof(uiCounter)) != 0)
+    {
+        pRun->wrong += 1;
+    }
+    pRun->completed += 1;
+    pRun->latencyUsSum += uiLatencyUs;
+    if(uiLatencyUs > pRun->maxLatencyUs)
+    {
+        pRun->maxLatencyUs = uiLatencyUs;
+    }
+}
+
+/****************** asyncBenchStartUplink *******************
+    Answers after the rtt, the record is copied, the
+    caller's may live on its stack.
+************************************************************/
+int asyncBenchStartUplink(tUplinkRecord *pRecord, tCommsDoneCallback pDone)
+{
+    int i;
+    for(i=0; i<COMMS_MAXINFLIGHT; i+=1)
+    {
+        tAsyncBenchExchange *pExchange = &masExchanges[i];
+        if(!pExchange->busy)
+        {
+            memcpy(&pExchange->record, pRecord, sizeof(tUplinkRecord));
+            pExchange->pDone = pDone;
+            pExchange->busy = true;
+            reactorTimerArm(pExchange->timerFd, muiRttMs, 0);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int asyncBenchSendUplink(tUplinkRecord *pRecord)
+{
+    usleep(muiRttMs * 1000);
+    memset(getCtrlDeckedReply()->payload, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    memcpy(getCtrlDeckedReply()->payload, pRecord->cmd.payload, sizeof(uint32_t));
+    return 0;
+}
+
+void asyncBenchAnswer(int iFd, uint32_t uiEvents, void *pContext)
+{
+    tAsyncBenchExchange *pExchange = (tAsyncBenchExchange *)pContext;
+    tUplinkRecord sRecord;
+
+    memcpy(&sRecord, &pExchange->record, sizeof(tUplinkRecord)); // the done callback may start the next uplink in this slot
+    pExchange->busy = false;
+    memset(getCtrlDeckedReply()->payload, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    memcpy(getCtrlDeckedReply()->payload, sRecord.cmd.payload, sizeof(uint32_t)); // echo of the counter
+    commsUplinkFinished(&sRecord, 0, pExchange->pDone);
+}
+
+void asyncBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,489 @@
+/*
+    Benchmarks of the daemon's hot paths, run with "make bench".
+
+    Every case is timed BENCH_RUNS times for at least
+    BENCH_MINRUNUS. The median and the fastest run go to a
+    JSON file, the fastest run is compared with a stored
+    baseline: it is the least disturbed by other processes,
+    the median of a busy machine easily moves 30%.
+    The daemon's own logging goes to /dev/null while timing,
+    its cost (formatting) is included, the terminal is not.
+
+    Usage:
+        SACBench [-o results.json] [-b baseline.json] [-t tolerance%] [-r server_reply.txt] [-f filter]
+    Exit code 1 when a case got slower than the baseline
+    plus the tolerance or the baseline is missing.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/utsname.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACBenchBsc.h"
+
+#define BENCH_RUNS              7 // median and minimum of this many runs
+#define BENCH_MINRUNUS          50000 // iterations are doubled until one run takes this long
+#define BENCH_MAXCASES          32
+#define BENCH_MAXREPLIES        8
+#define BENCH_NAMESIZE          48
+#define BENCH_TOLERANCEPCT      25 // default allowed slowdown against the baseline
+#define BENCH_SMMAXSTEPS        64 // listeningTask() calls before a cycle is considered stuck
+
+typedef void (*tBenchFunc)(void *pContext);
+
+typedef struct
+{
+    char name[BENCH_NAMESIZE];
+    double nsPerOp; // median
+    double minNsPerOp;
+    uint64_t iterations; // per run
+} tBenchResult;
+
+typedef struct
+{
+    char data[HTTPMSGMAXSIZE];
+    int length;
+} tBenchReply;
+
+/****************** daemon internals driven by the benchmark *********************/
+extern tSmState sState;
+uint8_t slave_init();
+void listeningTask();
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+void benchRunCase(const char *sName, tBenchFunc pFunc, void *pContext);
+double benchRunOnce(tBenchFunc pFunc, void *pContext, uint64_t ulIterations);
+uint64_t benchNowNs();
+int benchLoadReplies(const char *sPath);
+int benchWriteJson(const char *sPath);
+int benchCompare(const char *sPath, double dTolerancePct);
+void benchQuiet(bool bQuiet);
+int benchSendUplink(tUplinkRecord *pRecord);
+int benchSmRunUntilIdle();
+int benchSmCycle();
+void benchHexEncode12(void *pContext);
+void benchHexEncode32Sep(void *pContext);
+void benchHexDecode8(void *pContext);
+void benchTimestamp(void *pContext);
+void benchBuildRequest(void *pContext);
+void benchParseReply(void *pContext);
+void benchSmSendReadCycle(void *pContext);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tBenchResult masResults[BENCH_MAXCASES];
+static int miResults = 0;
+static tBenchReply masReplies[BENCH_MAXREPLIES]; // captures from server_reply.txt
+static int miReplies = 0;
+static char masScratch[HTTPMSGMAXSIZE]; // httpParseReplyMsg() tokenizes in place
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const char *msFilter = NULL;
+static const uint8_t mabSendFrame[STRUCTS_SENDCMDTOTALSIZE] = // alarm send command, alarms bypass the token bucket
+{
+    IOT_FRMSTARTTAG, UPLSCHED_CMDCODE_ALARM, STRUCTS_SENDCMDPAYLOADSIZE + 1, 0x01,
+    0x01, 0x00, 0x00, 0x00, 0x00, 0x1e, 0xcc, 0x36, 0x30, 0x1f, 0x7f, 0x7f,
+    IOT_FRMENDTAG
+};
+static const uint8_t mabReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+static const tCommsTransport msBenchTransport =
+{
+    .name = "bench",
+    .sendUplink = benchSendUplink,
+};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sOutPath = NULL;
+    const char *sBaselinePath = NULL;
+    const char *sRepliesPath = "server_reply.txt";
+    double dTolerancePct = BENCH_TOLERANCEPCT;
+    char sName[BENCH_NAMESIZE];
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "o:b:t:r:f:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'o': sOutPath = optarg; break;
+            case 'b': sBaselinePath = optarg; break;
+            case 't': dTolerancePct = atof(optarg); break;
+            case 'r': sRepliesPath = optarg; break;
+            case 'f': msFilter = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-o results.json] [-b baseline.json] [-t tolerance%%] [-r server_reply.txt] [-f filter]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(benchLoadReplies(sRepliesPath) <= 0)
+    {
+        fprintf(stderr, "No server replies found in %s.\n", sRepliesPath);
+        return 2;
+    }
+
+    structsInit();
+    uplinkSchedInit();
+    benchQuiet(true);
+    commsSetTransport(&msBenchTransport);
+    benchBscReset();
+    slave_init(); // opens the simulated slave like on the Pi
+    if(benchSmCycle() < 0)
+    {
+        benchQuiet(false);
+        fprintf(stderr, "State machine cycle over the simulated BSC failed, not benchmarking it.\n");
+        return 1;
+    }
+
+    benchRunCase("hex_encode_12B", benchHexEncode12, NULL);
+    benchRunCase("hex_encode_32B_sep", benchHexEncode32Sep, NULL);
+    benchRunCase("hex_decode_8B", benchHexDecode8, NULL);
+    benchRunCase("timestamp", benchTimestamp, NULL);
+    benchRunCase("build_request", benchBuildRequest, NULL);
+    for(i=0; i<miReplies; i+=1)
+    {
+        snprintf(sName, sizeof(sName), "parse_reply_%i", i);
+        benchRunCase(sName, benchParseReply, &masReplies[i]);
+    }
+    benchRunCase("sm_send_read_cycle", benchSmSendReadCycle, NULL);
+    benchQuiet(false);
+
+    for(i=0; i<miResults; i+=1)
+    {
+        fprintf(stderr, "%-24s %12.1f ns/op (min %.1f, %llu iterations)\n", masResults[i].name, masResults[i].nsPerOp, masResults[i].minNsPerOp, (unsigned long long)masResults[i].iterations);
+    }
+    if(sOutPath != NULL && benchWriteJson(sOutPath) < 0)
+    {
+        return 2;
+    }
+    if(sBaselinePath != NULL)
+    {
+        return (benchCompare(sBaselinePath, dTolerancePct) < 0) ? 1 : 0;
+    }
+    return 0;
+}
+
+/********************** benchRunCase ************************
+    Doubles the iterations until a run takes BENCH_MINRUNUS,
+    then keeps the median of BENCH_RUNS runs.
+************************************************************/
+void benchRunCase(const char *sName, tBenchFunc pFunc, void *pContext)
+{
+    double adNsPerOp[BENCH_RUNS];
+    double dSwap;
+    uint64_t ulIterations = 1;
+    tBenchResult *pResult;
+    int i;
+    int j;
+
+    if((msFilter != NULL && strstr(sName, msFilter) == NULL) || miResults == BENCH_MAXCASES)
+    {
+        return;
+    }
+    while(benchRunOnce(pFunc, pContext, ulIterations) * ulIterations < BENCH_MINRUNUS * 1000.0)
+    {
+        ulIterations *= 2;
+    }
+    for(i=0; i<BENCH_RUNS; i+=1)
+    {
+        adNsPerOp[i] = benchRunOnce(pFunc, pContext, ulIterations);
+    }
+    for(i=0; i<BENCH_RUNS; i+=1)
+    {
+        for(j=i+1; j<BENCH_RUNS; j+=1)
+        {
+            if(adNsPerOp[j] < adNsPerOp[i])
+            {
+                dSwap = adNsPerOp[i];
+                adNsPerOp[i] = adNsPerOp[j];
+                adNsPerOp[j] = dSwap;
+            }
+        }
+    }
+    pResult = &masResults[miResults];
+    snprintf(pResult->name, sizeof(pResult->name), "%s", sName);
+    pResult->nsPerOp = adNsPerOp[BENCH_RUNS / 2];
+    pResult->minNsPerOp = adNsPerOp[0];
+    pResult->iterations = ulIterations;
+    miResults += 1;
+}
+
+double benchRunOnce(tBenchFunc pFunc, void *pContext, uint64_t ulIterations)
+{
+    uint64_t ulStartNs;
+    uint64_t i;
+
+    ulStartNs = benchNowNs();
+    for(i=0; i<ulIterations; i+=1)
+    {
+        pFunc(pContext);
+    }
+    return (double)(benchNowNs() - ulStartNs) / ulIterations;
+}
+
+uint64_t benchNowNs()
+{
+    struct timespec sNow;
+    clock_gettime(CLOCK_MONOTONIC, &sNow);
+    return (uint64_t)sNow.tv_sec * 1000000000ULL + sNow.tv_nsec;
+}
+
+/******************** benchLoadReplies **********************
+    server_reply.txt holds captured replies as ", "
+    separated hex bytes, a capture starts with "48, 54, 54,
+    50" ("HTTP") and may span several lines.
+************************************************************/
+int benchLoadReplies(const char *sPath)
+{
+    FILE *pFile = fopen(sPath, "r");
+    char sLine[HTTPMSGMAXSIZE];
+    tBenchReply *pReply = NULL;
+    char *pCursor;
+    char *pEnd;
+    long lByte;
+
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    while(fgets(sLine, sizeof(sLine), pFile) != NULL)
+    {
+        if(strncmp(sLine, "48, 54, 54, 50,", 15) == 0 && miReplies < BENCH_MAXREPLIES)
+        {
+            pReply = &masReplies[miReplies];
+            pReply->length = 0;
+            miReplies += 1;
+        }
+        else if(pReply == NULL || strlen(sLine) < 4 || sLine[2] != ',')
+        {
+            pReply = NULL; // log lines, blank lines: end of the capture
+            continue;
+        }
+        pCursor = sLine;
+        while(pReply->length < HTTPMSGMAXSIZE - 1)
+        {
+            lByte = strtol(pCursor, &pEnd, 16);
+            if(pEnd == pCursor)
+            {
+                break;
+            }
+            pReply->data[pReply->length] = (char)lByte;
+            pReply->length += 1;
+            pCursor = (*pEnd == ',') ? pEnd + 1 : pEnd;
+        }
+        pReply->data[pReply->length] = 0;
+    }
+    fclose(pFile);
+    return miReplies;
+}
+
+/********************* benchWriteJson ***********************
+    One result per line, benchCompare() relies on that.
+************************************************************/
+int benchWriteJson(const char *sPath)
+{
+    FILE *pFile = fopen(sPath, "w");
+    struct utsname sUname;
+    int i;
+
+    if(pFile == NULL)
+    {
+        fprintf(stderr, "Could not write %s.\n", sPath);
+        return -1;
+    }
+    uname(&sUname);
+    fprintf(pFile, "{\n  \"suite\": \"SACBench\",\n  \"machine\": \"%s\",\n  \"unix_time\": %lu,\n  \"results\": [\n", sUname.machine, printGetUnixEpochTimeAsInt());
+    for(i=0; i<miResults; i+=1)
+    {
+        fprintf(pFile, "    {\"name\": \"%s\", \"ns_per_op\": %.1f, \"min_ns_per_op\": %.1f, \"iterations\": %llu}%s\n",
+            masResults[i].name, masResults[i].nsPerOp, masResults[i].minNsPerOp, (unsigned long long)masResults[i].iterations, (i < miResults - 1) ? "," : "");
+    }
+    fprintf(pFile, "  ]\n}\n");
+    fclose(pFile);
+    return 0;
+}
+
+/********************** benchCompare ************************
+    Returns -1 when a case is slower than its baseline plus
+    dTolerancePct or there is no baseline, a check that
+    can't fail is no check. Baselines of another machine
+    type are not compared, the numbers mean nothing there.
+************************************************************/
+int benchCompare(const char *sPath, double dTolerancePct)
+{
+    FILE *pFile = fopen(sPath, "r");
+    char sLine[256];
+    char sName[BENCH_NAMESIZE];
+    char sMachine[64] = "";
+    double dBaseline;
+    double dChangePct;
+    struct utsname sUname;
+    int iRegressions = 0;
+    int i;
+
+    if(pFile == NULL)
+    {
+        fprintf(stderr, "No baseline %s, run \"make bench-baseline\" on a reference machine.\n", sPath);
+        return -1;
+    }
+    uname(&sUname);
+    fprintf(stderr, "\n%-24s %12s %12s %8s\n", "case", "min ns/op", "baseline", "change");
+    while(fgets(sLine, sizeof(sLine), pFile) != NULL)
+    {
+        if(sscanf(sLine, " \"machine\": \"%63[^\"]\"", sMachine) == 1 && strcmp(sMachine, sUname.machine) != 0)
+        {
+            fprintf(stderr, "Baseline is from a %s machine, this is %s: not comparing.\n", sMachine, sUname.machine);
+            fclose(pFile);
+            return 0;
+        }
+        if(sscanf(sLine, " {\"name\": \"%47[^\"]\", \"ns_per_op\": %*f, \"min_ns_per_op\": %lf", sName, &dBaseline) != 2)
+        {
+            continue;
+        }
+        for(i=0; i<miResults; i+=1)
+        {
+            if(strcmp(masResults[i].name, sName) == 0 && dBaseline > 0)
+            {
+                dChangePct = (masResults[i].minNsPerOp - dBaseline) * 100.0 / dBaseline;
+                fprintf(stderr, "%-24s %12.1f %12.1f %+7.1f%%%s\n", sName, masResults[i].minNsPerOp, dBaseline, dChangePct, (dChangePct > dTolerancePct) ? "  REGRESSION" : "");
+                if(dChangePct > dTolerancePct)
+                {
+                    iRegressions += 1;
+                }
+            }
+        }
+    }
+    fclose(pFile);
+    if(iRegressions > 0)
+    {
+        fprintf(stderr, "%i case(s) more than %.0f%% slower than the baseline.\n", iRegressions, dTolerancePct);
+        return -1;
+    }
+    return 0;
+}
+
+/*********************** benchQuiet *************************
+    Sends the daemon's printf output to /dev/null.
+************************************************************/
+void benchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
+
+/********************* benchSendUplink **********************
+    Uplink transport without a network: builds the request
+    like the http transport and parses the first captured
+    reply as if the server sent it.
+************************************************************/
+int benchSendUplink(tUplinkRecord *pRecord)
+{
+    httpBuildRequestMsg((uintptr_t)pRecord->cmd.payload, pRecord->cmd.payloadSize - 1, pRecord->time, pRecord->encoding);
+    memcpy(masScratch, masReplies[0].data, masReplies[0].length + 1);
+    return httpParseReplyMsg(masScratch);
+}
+
+int benchSmRunUntilIdle()
+{
+    int iSteps = 0;
+    do
+    {
+        listeningTask();
+        iSteps += 1;
+    } while(sState != S_IDLE && iSteps < BENCH_SMMAXSTEPS);
+    return (sState == S_IDLE) ? iSteps : -1;
+}
+
+/*********************** benchSmCycle ***********************
+    What the controller does for one uplink with downlink:
+    send command, read enable command, read the decked
+    reply. Returns the reply length or -1.
+************************************************************/
+int benchSmCycle()
+{
+    uint8_t abReply[BSC_FIFO_SIZE];
+    int iLength;
+
+    benchBscControllerWrite(mabSendFrame, sizeof(mabSendFrame));
+    if(benchSmRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    benchBscControllerWrite(mabReadEnaFrame, sizeof(mabReadEnaFrame));
+    if(benchSmRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    iLength = benchBscControllerRead(abReply, sizeof(abReply));
+    if(iLength != STRUCTS_DECKEDREPLYTOTALSIZE || abReply[2] != I2CERRORCODE_OK)
+    {
+        return -1;
+    }
+    return iLength;
+}
+
+void benchHexEncode12(void *pContext)
+{
+    printBytesAsHexString((uintptr_t)&mabSendFrame[4], STRUCTS_SENDCMDPAYLOADSIZE, false, NULL);
+}
+
+void benchHexEncode32Sep(void *pContext)
+{
+    static const uint8_t abFrame[32] = {0x23, 0x02, 0x0d, 0x01, 0x01, 0x00, 0x00, 0x00, 0x00, 0x1e, 0xcc, 0x36, 0x30, 0x1f, 0xff, 0xff, 0x0a};
+    printBytesAsHexString((uintptr_t)abFrame, sizeof(abFrame), true, ", ");
+}
+
+void benchHexDecode8(void *pContext)
+{
+    uint8_t abDest[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    strcpy(masScratch, "36301f73deadbeef\r");
+    printParseHexStringToBytes(masScratch, abDest, sizeof(abDest));
+}
+
+void benchTimestamp(void *pContext)
+{
+    printTimestamp();
+}
+
+void benchBuildRequest(void *pContext)
+{
+    httpBuildRequestMsg((uintptr_t)&mabSendFrame[4], STRUCTS_SENDCMDPAYLOADSIZE, printGetUnixEpochTimeAsInt(), UPLENC_RAW);
+}
+
+void benchParseReply(void *pContext)
+{
+    tBenchReply *pReply = (tBenchReply *)pContext;
+    memcpy(masScratch, pReply->data, pReply->length + 1);
+    httpParseReplyMsg(masScratch);
+}
+
+void benchSmSendReadCycle(void *pContext)
+{
+    benchSmCycle();
+}
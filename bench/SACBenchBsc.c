@@ -0,0 +1,232 @@
+#include "pigpio.h"
+#include "SACBenchBsc.h"
+#include "SACPrintUtils.h"
+
+#include "string.h" /* memcpy */
+#include <pthread.h>
+
+/*
+    Simulated BSC slave. The benchmark plays the controller:
+    benchBscControllerWrite() puts a frame in the rx fifo,
+    the next bscXfer() hands it to the daemon. What the
+    daemon copies to the tx fifo is what the controller gets
+    from benchBscControllerRead().
+    benchBscInjectFault() wedges it until the daemon does
+    what the fault needs: a BK abort, a reopen (CR written
+    as 0) or a gpioInitialise().
+    The controller may run in its own thread (SACSoakTest):
+    the fifos are locked and a controller write fires the
+    bsc event like pigpio's thread does, once the daemon
+    registered one with eventSetFunc().
+*/
+
+#define BSCSIM_CR_EN    (1 << 0)
+#define BSCSIM_CR_BK    (1 << 7)
+#define BSCSIM_CR_RXE   (1 << 9)
+#define BSCSIM_FR_RXBUSY (1 << 5)
+
+/******************** private global variables **********************/
+static uint8_t mabRxFifo[BSC_FIFO_SIZE];
+static int miRxFifoCount = 0;
+static uint8_t mabTxFifo[BSC_FIFO_SIZE];
+static int miTxFifoCount = 0;
+static uint32_t muiControl = 0;
+static uint32_t muiXfers = 0;
+static tBenchBscFault meFault = BENCHBSC_FAULT_NONE;
+static tBscRecoveryStage meFaultClearedBy = BSCRECOVERY_NONE;
+static pthread_mutex_t msBenchBscLock = PTHREAD_MUTEX_INITIALIZER;
+static eventFunc_t mpBscEventFunc = NULL;
+/********************************************************************/
+
+void benchBscReset()
+{
+    pthread_mutex_lock(&msBenchBscLock);
+    miRxFifoCount = 0;
+    miTxFifoCount = 0;
+    muiControl = 0;
+    muiXfers = 0;
+    meFault = BENCHBSC_FAULT_NONE;
+    pthread_mutex_unlock(&msBenchBscLock);
+}
+
+void benchBscInjectFault(tBenchBscFault eFault, tBscRecoveryStage eClearedBy)
+{
+    pthread_mutex_lock(&msBenchBscLock);
+    meFault = eFault;
+    meFaultClearedBy = eClearedBy;
+    pthread_mutex_unlock(&msBenchBscLock);
+}
+
+tBenchBscFault benchBscFault()
+{
+    tBenchBscFault eFault;
+    pthread_mutex_lock(&msBenchBscLock);
+    eFault = meFault;
+    pthread_mutex_unlock(&msBenchBscLock);
+    return eFault;
+}
+
+static void benchBscClearFault(tBscRecoveryStage eBy)
+{
+    if(meFault != BENCHBSC_FAULT_NONE && eBy >= meFaultClearedBy)
+    {
+        meFault = BENCHBSC_FAULT_NONE;
+    }
+}
+
+void benchBscControllerWrite(const uint8_t *pFrame, int iLength)
+{
+    eventFunc_t pEventFunc;
+
+    pthread_mutex_lock(&msBenchBscLock);
+    if(iLength > BSC_FIFO_SIZE - miRxFifoCount)
+    {
+        iLength = BSC_FIFO_SIZE - miRxFifoCount; // overrun, like the hardware the rest is lost
+    }
+    memcpy(&mabRxFifo[miRxFifoCount], pFrame, iLength);
+    miRxFifoCount += iLength;
+    pEventFunc = mpBscEventFunc;
+    pthread_mutex_unlock(&msBenchBscLock);
+    if(pEventFunc != NULL)
+    {
+        pEventFunc(PI_EVENT_BSC, gpioTick());
+    }
+}
+
+int benchBscControllerRead(uint8_t *pDest, int iMaxLength)
+{
+    int iLength = 0;
+
+    pthread_mutex_lock(&msBenchBscLock);
+    if(meFault != BENCHBSC_FAULT_TXSTUCK)
+    {
+        iLength = (miTxFifoCount < iMaxLength) ? miTxFifoCount : iMaxLength;
+        memcpy(pDest, mabTxFifo, iLength);
+        memmove(mabTxFifo, &mabTxFifo[iLength], miTxFifoCount - iLength);
+        miTxFifoCount -= iLength;
+    }
+    pthread_mutex_unlock(&msBenchBscLock);
+    return iLength;
+}
+
+/******************* benchBscRxPending **********************
+    Bytes the controller wrote that the daemon did not take
+    yet.
+************************************************************/
+int benchBscRxPending()
+{
+    int iCount;
+    pthread_mutex_lock(&msBenchBscLock);
+    iCount = miRxFifoCount;
+    pthread_mutex_unlock(&msBenchBscLock);
+    return iCount;
+}
+
+uint32_t benchBscXferCount()
+{
+    uint32_t uiXfers;
+    pthread_mutex_lock(&msBenchBscLock);
+    uiXfers = muiXfers;
+    pthread_mutex_unlock(&msBenchBscLock);
+    return uiXfers;
+}
+
+int gpioInitialise(void)
+{
+    pthread_mutex_lock(&msBenchBscLock);
+    benchBscClearFault(BSCRECOVERY_REINIT);
+    pthread_mutex_unlock(&msBenchBscLock);
+    return 0;
+}
+
+void gpioTerminate(void)
+{
+}
+
+uint32_t gpioTick(void)
+{
+    return (uint32_t)printGetMonotonicTimeUs();
+}
+
+/************************* bscXfer **************************
+    Same contract as pigpio: copies txBuf to the tx fifo,
+    empties the rx fifo into rxBuf and returns the status
+    word (FR layout, bytes copied to the tx fifo in bits
+    16-20).
+************************************************************/
+int bscXfer(bsc_xfer_t *bscxfer)
+{
+    int iCopied = 0;
+    uint32_t uiStatus;
+
+    pthread_mutex_lock(&msBenchBscLock);
+    muiXfers += 1;
+    muiControl = bscxfer->control & 0x3FFF;
+    if(bscxfer->control == 0)
+    {
+        benchBscClearFault(BSCRECOVERY_REOPEN);
+    }
+    if(muiControl & BSCSIM_CR_BK)
+    {
+        miRxFifoCount = 0; // abort clears both fifos
+        miTxFifoCount = 0;
+        benchBscClearFault(BSCRECOVERY_ABORT);
+    }
+    if(meFault == BENCHBSC_FAULT_XFERERROR)
+    {
+        pthread_mutex_unlock(&msBenchBscLock);
+        return -1;
+    }
+    if(bscxfer->txCnt > 0)
+    {
+        iCopied = bscxfer->txCnt;
+        if(iCopied > BSC_FIFO_SIZE - miTxFifoCount)
+        {
+            iCopied = BSC_FIFO_SIZE - miTxFifoCount;
+        }
+        memcpy(&mabTxFifo[miTxFifoCount], bscxfer->txBuf, iCopied);
+        miTxFifoCount += iCopied;
+    }
+    bscxfer->rxCnt = 0;
+    if((muiControl & (BSCSIM_CR_EN | BSCSIM_CR_RXE)) == (BSCSIM_CR_EN | BSCSIM_CR_RXE) && miRxFifoCount > 0 && meFault != BENCHBSC_FAULT_RXSTUCK)
+    {
+        memcpy(bscxfer->rxBuf, mabRxFifo, miRxFifoCount);
+        bscxfer->rxCnt = miRxFifoCount;
+        miRxFifoCount = 0;
+    }
+    uiStatus = (1 << 1); // rx fifo empty, busy flags clear
+    if(miTxFifoCount == 0)
+    {
+        uiStatus |= (1 << 4);
+    }
+    uiStatus |= ((miTxFifoCount > 31 ? 31 : miTxFifoCount) << 6);
+    uiStatus |= ((iCopied > 31 ? 31 : iCopied) << 16);
+    if(meFault == BENCHBSC_FAULT_RXSTUCK)
+    {
+        uiStatus |= BSCSIM_FR_RXBUSY;
+    }
+    pthread_mutex_unlock(&msBenchBscLock);
+    return (int)uiStatus;
+}
+
+uint32_t getRawBCSCReg(int iRegister)
+{
+    uint32_t uiControl;
+    pthread_mutex_lock(&msBenchBscLock);
+    uiControl = muiControl;
+    pthread_mutex_unlock(&msBenchBscLock);
+    return (iRegister == 3) ? uiControl : 0; // CR
+}
+
+/********************** eventSetFunc ************************
+    Registered by runSlaveReactor() and the gpio reinit
+    stage. Benchmarks that step the state machine
+    themselves don't use the wake up.
+************************************************************/
+int eventSetFunc(unsigned event, eventFunc_t f)
+{
+    pthread_mutex_lock(&msBenchBscLock);
+    mpBscEventFunc = f;
+    pthread_mutex_unlock(&msBenchBscLock);
+    return 0;
+}
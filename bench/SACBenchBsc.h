@@ -0,0 +1,23 @@
+#ifndef SACBENCHBSC_H
+#define SACBENCHBSC_H
+
+#include <stdint.h>
+#include "SACBscHealth.h"
+
+typedef enum
+{
+    BENCHBSC_FAULT_NONE,
+    BENCHBSC_FAULT_XFERERROR, // bscXfer() returns -1
+    BENCHBSC_FAULT_RXSTUCK, // rxBusy stays set, no byte arrives
+    BENCHBSC_FAULT_TXSTUCK, // the controller can't read the tx fifo
+} tBenchBscFault;
+
+void benchBscReset();
+void benchBscControllerWrite(const uint8_t *pFrame, int iLength);
+int benchBscControllerRead(uint8_t *pDest, int iMaxLength);
+int benchBscRxPending();
+uint32_t benchBscXferCount();
+void benchBscInjectFault(tBenchBscFault eFault, tBscRecoveryStage eClearedBy);
+tBenchBscFault benchBscFault();
+
+#endif
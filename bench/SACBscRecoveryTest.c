@@ -0,0 +1,297 @@
+/*
+    BSC stall recovery, run with "make recoverytest".
+
+    The daemon's state machine runs over the simulated BSC
+    (like SACBench). Each case wedges the simulated
+    peripheral with one fault that only goes away with a
+    given recovery stage, then keeps polling the way the
+    poll timer does until the health supervisor reports
+    the bus healthy again.
+    Checked per case:
+        - the stall is detected and recovered without a
+          restart, within RECOVERY_MAXMS;
+        - the recovery ended at the stage the fault needed
+          (escalation works, no stage more than necessary);
+        - a send / read enable / read cycle works afterwards.
+    Reported: time from the fault to the detection and to the
+    first healthy transfer, and the supervisor's own
+    measurement (detection to healthy).
+
+    Usage:
+        SACBscRecoveryTest [-v]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACBscHealth.h"
+#include "SACBenchBsc.h"
+
+#define RECOVERY_POLLUS         1000 // like the default poll interval
+#define RECOVERY_MAXMS          (BSCHEALTH_TXSTALLMS + 1000) // detection included
+#define RECOVERY_SMMAXSTEPS     64 // listeningTask() calls before a cycle is considered missed
+
+typedef struct
+{
+    const char *name;
+    tBenchBscFault fault;
+    tBscRecoveryStage clearedBy; // the stage the recovery has to reach
+} tRecoveryCase;
+
+typedef struct
+{
+    bool recovered;
+    bool cycleOk;
+    tBscRecoveryStage stage;
+    uint32_t detectUs; // fault injected until the stall was detected
+    uint32_t healthyUs; // fault injected until the first healthy transfer
+    uint32_t supervisorUs; // bscHealthStats()->lastRecoveryUs
+} tRecoveryResult;
+
+/****************** daemon internals driven by the test *************************/
+extern tSmState sState;
+uint8_t slave_init();
+void listeningTask();
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int recoveryRunCase(const tRecoveryCase *pCase, tRecoveryResult *pResult);
+int recoverySendUplink(tUplinkRecord *pRecord);
+int recoveryRunUntilIdle();
+int recoveryCycle(uint32_t uiFrame);
+void recoveryWriteFrame(uint32_t uiFrame);
+void recoveryQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static const tRecoveryCase masCases[] =
+{
+    {"xfer errors, abort", BENCHBSC_FAULT_XFERERROR, BSCRECOVERY_ABORT},
+    {"xfer errors, reopen", BENCHBSC_FAULT_XFERERROR, BSCRECOVERY_REOPEN},
+    {"xfer errors, reinit", BENCHBSC_FAULT_XFERERROR, BSCRECOVERY_REINIT},
+    {"rx stuck, abort", BENCHBSC_FAULT_RXSTUCK, BSCRECOVERY_ABORT},
+    {"rx stuck, reinit", BENCHBSC_FAULT_RXSTUCK, BSCRECOVERY_REINIT},
+    {"tx stuck, abort", BENCHBSC_FAULT_TXSTUCK, BSCRECOVERY_ABORT},
+};
+static uint32_t muiFrame = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const tCommsTransport msRecoveryTransport =
+{
+    .name = "recoverytest",
+    .sendUplink = recoverySendUplink,
+};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const int iCases = sizeof(masCases) / sizeof(masCases[0]);
+    tRecoveryResult sResult;
+    bool bVerbose = false;
+    int iFailed = 0;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "v")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'v': bVerbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    recoveryQuiet(!bVerbose);
+    structsInit();
+    uplinkSchedInit();
+    commsSetTransport(&msRecoveryTransport);
+    benchBscReset();
+    slave_init();
+    if(recoveryCycle(muiFrame++) < 0)
+    {
+        recoveryQuiet(false);
+        fprintf(stderr, "State machine cycle over the simulated BSC failed before any fault.\n");
+        return 1;
+    }
+    recoveryQuiet(false);
+
+    fprintf(stderr, "%-22s %-8s %12s %12s %14s %s\n", "case", "stage", "detect us", "healthy us", "supervisor us", "cycle");
+    for(i=0; i<iCases; i+=1)
+    {
+        recoveryQuiet(!bVerbose);
+        recoveryRunCase(&masCases[i], &sResult);
+        recoveryQuiet(false);
+        if(!sResult.recovered)
+        {
+            fprintf(stderr, "%-22s not recovered within %u ms\n", masCases[i].name, RECOVERY_MAXMS);
+            iFailed += 1;
+            continue;
+        }
+        fprintf(stderr, "%-22s %-8s %12u %12u %14u %s\n", masCases[i].name, bscHealthStageName(sResult.stage),
+            sResult.detectUs, sResult.healthyUs, sResult.supervisorUs, sResult.cycleOk ? "ok" : "failed");
+        if(sResult.stage != masCases[i].clearedBy || !sResult.cycleOk)
+        {
+            iFailed += 1;
+        }
+    }
+    fprintf(stderr, "%i cases, %i failed, %u stalls, max recovery %u us\n", iCases, iFailed,
+        bscHealthStats()->stalls[BSCSTALL_XFERERRORS] + bscHealthStats()->stalls[BSCSTALL_RX] + bscHealthStats()->stalls[BSCSTALL_TX], bscHealthStats()->maxRecoveryUs);
+    if(iFailed > 0)
+    {
+        fprintf(stderr, "FAIL\n");
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
+
+/********************* recoveryRunCase **********************
+    Waits out BSCHEALTH_ESCALATEMS first, the case before
+    must not make this one escalate. A tx fault needs a
+    reply in the fifo and an rx fault a frame on its way,
+    the cases set that up the way a controller would.
+************************************************************/
+int recoveryRunCase(const tRecoveryCase *pCase, tRecoveryResult *pResult)
+{
+    uint32_t uiRecovered = bscHealthStats()->recovered;
+    uint64_t ulStartUs;
+    uint64_t ulNowUs;
+
+    memset(pResult, 0, sizeof(tRecoveryResult));
+    usleep(BSCHEALTH_ESCALATEMS * 1000);
+    benchBscInjectFault(pCase->fault, pCase->clearedBy);
+    ulStartUs = printGetMonotonicTimeUs();
+    if(pCase->fault == BENCHBSC_FAULT_TXSTUCK)
+    {
+        uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+        recoveryWriteFrame(muiFrame++);
+        recoveryRunUntilIdle();
+        benchBscControllerWrite(abReadEnaFrame, sizeof(abReadEnaFrame));
+        recoveryRunUntilIdle();
+    }
+    else if(pCase->fault == BENCHBSC_FAULT_RXSTUCK)
+    {
+        recoveryWriteFrame(muiFrame++);
+    }
+
+    do
+    {
+        listeningTask();
+        ulNowUs = printGetMonotonicTimeUs();
+        if(pResult->detectUs == 0 && bscHealthRecovering())
+        {
+            pResult->detectUs = (uint32_t)(ulNowUs - ulStartUs);
+        }
+        if(bscHealthStats()->recovered != uiRecovered)
+        {
+            pResult->recovered = true;
+            break;
+        }
+        usleep(RECOVERY_POLLUS);
+    } while(ulNowUs - ulStartUs < RECOVERY_MAXMS * 1000ULL);
+    if(!pResult->recovered)
+    {
+        benchBscInjectFault(BENCHBSC_FAULT_NONE, BSCRECOVERY_NONE); // the next case starts healthy
+        return -1;
+    }
+    pResult->healthyUs = (uint32_t)(ulNowUs - ulStartUs);
+    pResult->supervisorUs = bscHealthStats()->lastRecoveryUs;
+    pResult->stage = bscHealthStats()->lastStage;
+    pResult->cycleOk = (benchBscFault() == BENCHBSC_FAULT_NONE && recoveryCycle(muiFrame++) >= 0);
+    return 0;
+}
+
+/******************* recoverySendUplink *********************
+    Echoes the frame counter (first payload bytes) as the
+    downlink.
+************************************************************/
+int recoverySendUplink(tUplinkRecord *pRecord)
+{
+    memset(getCtrlDeckedReply()->payload, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    memcpy(getCtrlDeckedReply()->payload, pRecord->cmd.payload, sizeof(uint32_t));
+    return 0;
+}
+
+int recoveryRunUntilIdle()
+{
+    int iSteps = 0;
+    do
+    {
+        listeningTask();
+        iSteps += 1;
+    } while(sState != S_IDLE && iSteps < RECOVERY_SMMAXSTEPS);
+    return (sState == S_IDLE) ? iSteps : -1;
+}
+
+/********************** recoveryCycle ***********************
+    One alarm send command carrying uiFrame, read enable,
+    read the decked reply.
+************************************************************/
+int recoveryCycle(uint32_t uiFrame)
+{
+    uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    uint8_t abReply[BSC_FIFO_SIZE];
+    int iLength;
+
+    recoveryWriteFrame(uiFrame);
+    if(recoveryRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    benchBscControllerWrite(abReadEnaFrame, sizeof(abReadEnaFrame));
+    if(recoveryRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    iLength = benchBscControllerRead(abReply, sizeof(abReply));
+    if(iLength != STRUCTS_DECKEDREPLYTOTALSIZE || abReply[2] != I2CERRORCODE_OK || memcmp(&abReply[4], &uiFrame, sizeof(uiFrame)) != 0)
+    {
+        return -1;
+    }
+    return iLength;
+}
+
+void recoveryWriteFrame(uint32_t uiFrame)
+{
+    tCtrlSendCmd sFrame;
+
+    memset(&sFrame, 0, sizeof(sFrame));
+    sFrame.startTag = IOT_FRMSTARTTAG;
+    sFrame.cmdCode = UPLSCHED_CMDCODE_ALARM; // alarms bypass the token bucket
+    sFrame.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sFrame.downlinkIndicator = 0x01;
+    memcpy(sFrame.payload, &uiFrame, sizeof(uiFrame));
+    sFrame.endTag = IOT_FRMENDTAG;
+    benchBscControllerWrite(sFrame.ui8, sizeof(sFrame.ui8));
+}
+
+void recoveryQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
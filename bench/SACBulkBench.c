@@ -0,0 +1,535 @@
+/*
+    Backlog drain after an outage, run with "make bulkbench".
+
+    A local server thread stands in for the webhook: a new
+    connection costs one RTT, the response goes out one RTT
+    after the request arrived. It takes the per record GETs
+    and the bulk POSTs (inflates the block), drops records
+    whose seqNr it already has and checks that every record
+    carries its own timestamp.
+    N backlogged events (one in four asks for a downlink,
+    the rest is telemetry) are drained through the reactor
+    the way the daemon does it:
+        - a request per record, COMMS_MAXINFLIGHT connections;
+        - [bulk] enabled;
+        - [bulk] enabled, the server loses the answer to every
+          K-th block after storing it and stores only half of
+          the block after that one.
+    The uplink queues hold a few hundred records, the backlog
+    is topped up as it drains until N events went out. The
+    rate limit is off, it would make the per record run take
+    N seconds.
+
+    Usage:
+        SACBulkBench [-n events] [-r rtt ms] [-k blocks per interruption] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACBulkUpload.h"
+
+#define BULKBENCH_EVENTS        10000
+#define BULKBENCH_RTTMS         10
+#define BULKBENCH_FAULTEVERY    10 // fault run: blocks per lost answer
+#define BULKBENCH_BACKLOG       UPLSCHED_TELEMQUEUESIZE // queued + in flight, a put back block always fits
+#define BULKBENCH_MAXSEQNRS     (1 << 20)
+#define BULKBENCH_BUFSIZE       (HTTPMSGMAXSIZE * 2)
+#define BULKBENCH_MAXSECONDS    900
+
+typedef struct
+{
+    const char *name;
+    bool bulk;
+    uint32_t faultEvery; // 0: no faults
+    double seconds;
+    uint32_t requests;
+    uint64_t txBytes;
+    uint64_t rxBytes;
+    uint32_t unique; // events stored
+    uint32_t duplicates; // records the server already had
+    uint32_t badTime;
+    tBulkStats bulkStats;
+} tBulkBenchRun;
+
+/****************** private function prototypes *********************/
+int bulkBenchListen();
+void *bulkBenchServer(void *pArg);
+void *bulkBenchConnection(void *pArg);
+int bulkBenchReadRequest(int iFd, char *sBuffer, int *pHeaderLength);
+void bulkBenchStore(uint32_t uiSeqNr, uint32_t uiTime, const uint8_t *pPayload, int iLength);
+int bulkBenchWriteConfig(bool bBulk);
+int bulkBenchRun(tBulkBenchRun *pRun, uint32_t uiEvents);
+bool bulkBenchEnqueue(uint32_t uiEvent);
+void bulkBenchDrain();
+void bulkBenchDone(tUplinkRecord *pRecord, int iResult);
+void bulkBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static int miListenFd = -1;
+static uint16_t muiPort = 0;
+static uint32_t muiRttMs = BULKBENCH_RTTMS;
+static pthread_mutex_t msServerLock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t mabSeqSeen[BULKBENCH_MAXSEQNRS];
+static uint8_t *mpEventSeen = NULL;
+static uint32_t muiEvents = 0;
+static uint32_t muiStartTime = 0; // unix time of event 0
+static uint32_t muiFaultEvery = 0;
+static uint32_t muiBlocks = 0;
+static uint32_t muiRequests = 0;
+static uint32_t muiUnique = 0;
+static uint32_t muiDuplicates = 0;
+static uint32_t muiBadTime = 0;
+static uint32_t muiInFlight = 0; // per record uplinks started by the drain
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    tBulkBenchRun asRuns[] =
+    {
+        {.name = "request per record"},
+        {.name = "bulk", .bulk = true},
+        {.name = "bulk, interrupted", .bulk = true, .faultEvery = BULKBENCH_FAULTEVERY},
+    };
+    uint32_t uiEvents = BULKBENCH_EVENTS;
+    pthread_t sThread;
+    bool bPass = true;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "n:r:k:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiEvents = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'k': asRuns[2].faultEvery = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n events] [-r rtt ms] [-k blocks per interruption] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    mpEventSeen = calloc(uiEvents, 1);
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACBulkBench.%i.conf", sDir, (int)getpid());
+    if(mpEventSeen == NULL || asRuns[2].faultEvery < 2 || bulkBenchListen() < 0)
+    {
+        fprintf(stderr, "Could not open the local server.\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, bulkBenchServer, NULL);
+
+    bulkBenchQuiet(true);
+    structsInit();
+    reactorInit(NULL, 0, NULL);
+    bulkBenchQuiet(false);
+
+    fprintf(stderr, "%u backlogged events, %u ms rtt\n", uiEvents, muiRttMs);
+    fprintf(stderr, "%-20s %9s %9s %10s %10s %9s %8s %8s %8s %8s\n", "run", "seconds", "requests", "tx bytes", "rx bytes", "tx/event", "stored", "dupes", "resent", "ratio");
+    for(i=0; i<(int)(sizeof(asRuns) / sizeof(asRuns[0])); i+=1)
+    {
+        tBulkBenchRun *pRun = &asRuns[i];
+        if(bulkBenchRun(pRun, uiEvents) < 0)
+        {
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return 1;
+        }
+        fprintf(stderr, "%-20s %9.2f %9u %10llu %10llu %9.1f %8u %8u %8llu %8.2f\n", pRun->name, pRun->seconds, pRun->requests,
+            (unsigned long long)pRun->txBytes, (unsigned long long)pRun->rxBytes, (double)pRun->txBytes / uiEvents,
+            pRun->unique, pRun->duplicates, (unsigned long long)pRun->bulkStats.resent,
+            (pRun->bulkStats.bytesCompressed > 0) ? (double)pRun->bulkStats.bytesRaw / pRun->bulkStats.bytesCompressed : 0.0);
+        bPass = bPass && pRun->unique == uiEvents && pRun->badTime == 0;
+        bPass = bPass && (!pRun->bulk || (pRun->txBytes < asRuns[0].txBytes && pRun->seconds < asRuns[0].seconds));
+        bPass = bPass && (pRun->faultEvery == 0 || pRun->bulkStats.failed > 0);
+    }
+    fprintf(stderr, "bulk: %.1fx faster, %.1fx fewer bytes sent\n", asRuns[0].seconds / asRuns[1].seconds, (double)asRuns[0].txBytes / asRuns[1].txBytes);
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+int bulkBenchListen()
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    miListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(miListenFd < 0 || bind(miListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(miListenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(miListenFd, (struct sockaddr *)&sAddr, &uiLength);
+    muiPort = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/******************** bulkBenchServer ***********************
+    A thread per connection, the per record run has
+    COMMS_MAXINFLIGHT of them open at the same time.
+************************************************************/
+void *bulkBenchServer(void *pArg)
+{
+    pthread_t sThread;
+    int iFd;
+
+    while(1)
+    {
+        iFd = accept(miListenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pthread_create(&sThread, NULL, bulkBenchConnection, (void *)(intptr_t)iFd);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/****************** bulkBenchConnection *********************
+    One request per connection, like the webhook without
+    pipelining.
+************************************************************/
+void *bulkBenchConnection(void *pArg)
+{
+    int iFd = (int)(intptr_t)pArg;
+    static uint8_t abBlock[BULK_BLOCKMAXSIZE * 2]; // only touched under msServerLock
+    char sBuffer[BULKBENCH_BUFSIZE];
+    char sResponse[256];
+    int iHeaderLength;
+    int iLength;
+    int iResult;
+    uLongf ulBlockLength;
+    uint32_t uiRecords = 0;
+    uint32_t uiStore;
+    uint32_t uiBlock;
+    bool bAnswer = true;
+    int iPos;
+
+    usleep(muiRttMs * 1000); // the connection setup
+    iLength = bulkBenchReadRequest(iFd, sBuffer, &iHeaderLength);
+    if(iLength < 0)
+    {
+        close(iFd);
+        return NULL;
+    }
+    usleep(muiRttMs * 1000);
+
+    pthread_mutex_lock(&msServerLock);
+    muiRequests += 1;
+    if(strncmp(sBuffer, "POST ", 5) == 0)
+    {
+        ulBlockLength = sizeof(abBlock);
+        if(uncompress(abBlock, &ulBlockLength, (uint8_t *)&sBuffer[iHeaderLength], iLength - iHeaderLength) != Z_OK)
+        {
+            ulBlockLength = 0;
+        }
+        for(iPos=0; iPos + BULK_RECORDHEADERSIZE <= (int)ulBlockLength; iPos += BULK_RECORDHEADERSIZE + abBlock[iPos + 10])
+        {
+            uiRecords += 1;
+        }
+        uiStore = uiRecords;
+        muiBlocks += 1;
+        uiBlock = muiBlocks;
+        if(muiFaultEvery > 0 && uiBlock % muiFaultEvery == 0)
+        {
+            bAnswer = false; // stored, but the answer never arrives
+        }
+        else if(muiFaultEvery > 0 && uiBlock % muiFaultEvery == 1 && uiBlock > 1)
+        {
+            uiStore = uiRecords / 2;
+        }
+        uiRecords = 0;
+        for(iPos=0; iPos + BULK_RECORDHEADERSIZE <= (int)ulBlockLength && uiRecords < uiStore; iPos += BULK_RECORDHEADERSIZE + abBlock[iPos + 10])
+        {
+            uint32_t uiSeqNr = abBlock[iPos] | (abBlock[iPos + 1] << 8) | (abBlock[iPos + 2] << 16) | ((uint32_t)abBlock[iPos + 3] << 24);
+            uint32_t uiTime = abBlock[iPos + 4] | (abBlock[iPos + 5] << 8) | (abBlock[iPos + 6] << 16) | ((uint32_t)abBlock[iPos + 7] << 24);
+            bulkBenchStore(uiSeqNr, uiTime, &abBlock[iPos + BULK_RECORDHEADERSIZE], abBlock[iPos + 10]);
+            uiRecords += 1;
+        }
+        iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACBulkBench\r\nContent-Length: %i\r\n\r\nstored=%u\r\n", (int)snprintf(NULL, 0, "stored=%u\r\n", uiStore), uiStore);
+    }
+    else
+    {
+        uint8_t abPayload[STRUCTS_SENDCMDPAYLOADSIZE];
+        unsigned long ulTime = 0;
+        unsigned int uiSeqNr = 0;
+        unsigned int uiByte;
+        const char *pTime = strstr(sBuffer, "&time=");
+        const char *pSeqNr = strstr(sBuffer, "&seqNumber=");
+        const char *pData = strstr(sBuffer, "&data=");
+        int i;
+
+        if(pTime != NULL && pSeqNr != NULL && pData != NULL)
+        {
+            sscanf(pTime + 6, "%lu", &ulTime);
+            sscanf(pSeqNr + 11, "%u", &uiSeqNr);
+            for(i=0; i<STRUCTS_SENDCMDPAYLOADSIZE && sscanf(pData + 6 + 2 * i, "%2x", &uiByte) == 1; i+=1)
+            {
+                abPayload[i] = (uint8_t)uiByte;
+            }
+            bulkBenchStore(uiSeqNr, (uint32_t)ulTime, abPayload, i);
+        }
+        iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACBulkBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n0000000000000000\r\n0\r\n\r\n");
+    }
+    pthread_mutex_unlock(&msServerLock);
+
+    if(bAnswer)
+    {
+        send(iFd, sResponse, iResult, MSG_NOSIGNAL);
+    }
+    close(iFd);
+    return NULL;
+}
+
+/****************** bulkBenchReadRequest ********************
+    Reads header and Content-Length body, returns the total
+    length.
+************************************************************/
+int bulkBenchReadRequest(int iFd, char *sBuffer, int *pHeaderLength)
+{
+    int iLength = 0;
+    int iTotal = -1;
+    int iResult;
+    char *pEnd;
+    char *pContentLength;
+
+    while(iTotal < 0 || iLength < iTotal)
+    {
+        iResult = read(iFd, &sBuffer[iLength], BULKBENCH_BUFSIZE - 1 - iLength);
+        if(iResult <= 0)
+        {
+            return -1;
+        }
+        iLength += iResult;
+        sBuffer[iLength] = 0x00;
+        pEnd = strstr(sBuffer, "\r\n\r\n");
+        if(iTotal < 0 && pEnd != NULL)
+        {
+            *pHeaderLength = (pEnd - sBuffer) + 4;
+            pContentLength = strstr(sBuffer, "Content-Length: ");
+            iTotal = *pHeaderLength + ((pContentLength != NULL && pContentLength < pEnd) ? atoi(pContentLength + 16) : 0);
+        }
+    }
+    return iLength;
+}
+
+/********************* bulkBenchStore ***********************
+    Server side, under msServerLock. The first 4 payload
+    bytes are the event number, its timestamp is
+    muiStartTime + the event number.
+************************************************************/
+void bulkBenchStore(uint32_t uiSeqNr, uint32_t uiTime, const uint8_t *pPayload, int iLength)
+{
+    uint32_t uiEvent;
+
+    if(mabSeqSeen[uiSeqNr % BULKBENCH_MAXSEQNRS])
+    {
+        muiDuplicates += 1;
+        return;
+    }
+    mabSeqSeen[uiSeqNr % BULKBENCH_MAXSEQNRS] = 1;
+    if(iLength < 4)
+    {
+        muiBadTime += 1;
+        return;
+    }
+    memcpy(&uiEvent, pPayload, sizeof(uiEvent));
+    if(uiEvent >= muiEvents || uiTime != muiStartTime + uiEvent)
+    {
+        muiBadTime += 1;
+        return;
+    }
+    if(!mpEventSeen[uiEvent])
+    {
+        mpEventSeen[uiEvent] = 1;
+        muiUnique += 1;
+    }
+}
+
+int bulkBenchWriteConfig(bool bBulk)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n\n[bulk]\nenabled = %s\n",
+        muiPort, bBulk ? "yes" : "no");
+    fclose(pFile);
+    return 0;
+}
+
+/********************** bulkBenchRun ************************
+    The outage left a full backlog, then the link is back:
+    drain it, topped up until every event went out.
+************************************************************/
+int bulkBenchRun(tBulkBenchRun *pRun, uint32_t uiEvents)
+{
+    uint32_t uiNext = 0;
+    uint64_t ulTxBefore;
+    uint64_t ulRxBefore;
+    uint64_t ulStartUs;
+
+    bulkBenchQuiet(true);
+    if(bulkBenchWriteConfig(pRun->bulk) < 0 || configInit(msConfigPath) < 0 || commsInit() < 0)
+    {
+        bulkBenchQuiet(false);
+        return -1;
+    }
+    uplinkSchedInit();
+    bulkUploadInit();
+    pthread_mutex_lock(&msServerLock);
+    memset(mabSeqSeen, 0, sizeof(mabSeqSeen));
+    memset(mpEventSeen, 0, uiEvents);
+    muiEvents = uiEvents;
+    muiStartTime = (uint32_t)time(NULL) - uiEvents;
+    muiFaultEvery = pRun->faultEvery;
+    muiBlocks = 0;
+    muiRequests = 0;
+    muiUnique = 0;
+    muiDuplicates = 0;
+    muiBadTime = 0;
+    pthread_mutex_unlock(&msServerLock);
+    muiInFlight = 0;
+
+    while(uiNext < uiEvents && uplinkSchedPending() < BULKBENCH_BACKLOG && bulkBenchEnqueue(uiNext))
+    {
+        uiNext += 1;
+    }
+    commsGetByteCounts(&ulTxBefore, &ulRxBefore);
+    ulStartUs = printGetMonotonicTimeUs();
+    while(uiNext < uiEvents || uplinkSchedPending() > 0 || muiInFlight > 0 || bulkUploadBusy())
+    {
+        while(uiNext < uiEvents && uplinkSchedPending() + muiInFlight + (bulkUploadBusy() ? BULK_MAXRECORDS : 0) < BULKBENCH_BACKLOG && bulkBenchEnqueue(uiNext))
+        {
+            uiNext += 1;
+        }
+        bulkBenchDrain();
+        reactorRunOnce(100);
+        if(printGetMonotonicTimeUs() - ulStartUs > BULKBENCH_MAXSECONDS * 1000000ULL)
+        {
+            break;
+        }
+    }
+    pRun->seconds = (printGetMonotonicTimeUs() - ulStartUs) / 1e6;
+    commsGetByteCounts(&pRun->txBytes, &pRun->rxBytes);
+    bulkBenchQuiet(false);
+    pRun->txBytes -= ulTxBefore;
+    pRun->rxBytes -= ulRxBefore;
+    memcpy(&pRun->bulkStats, bulkUploadStats(), sizeof(tBulkStats));
+    pthread_mutex_lock(&msServerLock);
+    pRun->requests = muiRequests;
+    pRun->unique = muiUnique;
+    pRun->duplicates = muiDuplicates;
+    pRun->badTime = muiBadTime;
+    pthread_mutex_unlock(&msServerLock);
+    return 0;
+}
+
+/******************** bulkBenchEnqueue **********************
+    Dispenser counters: event number, litres, level,
+    temperature, status. Returns false when the event queue
+    refused it, it is offered again later.
+************************************************************/
+bool bulkBenchEnqueue(uint32_t uiEvent)
+{
+    tCtrlSendCmd sCmd;
+    uint32_t uiLitres = uiEvent * 7 / 3;
+
+    memset(&sCmd, 0, sizeof(sCmd));
+    sCmd.startTag = IOT_FRMSTARTTAG;
+    sCmd.cmdCode = 0x02;
+    sCmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sCmd.downlinkIndicator = (uiEvent % 4 == 0) ? 0x01 : 0x00;
+    memcpy(&sCmd.payload[0], &uiEvent, sizeof(uiEvent));
+    memcpy(&sCmd.payload[4], &uiLitres, sizeof(uiLitres));
+    sCmd.payload[8] = 100 - (uiEvent % 50);
+    sCmd.payload[9] = 20 + (uiEvent / 100) % 5;
+    sCmd.endTag = IOT_FRMENDTAG;
+    return (uplinkSchedEnqueueEncoded(&sCmd, UPLENC_RAW, muiStartTime + uiEvent) >= 0);
+}
+
+/******************** bulkBenchDrain ************************
+    Same as slaveDrainBacklog().
+************************************************************/
+void bulkBenchDrain()
+{
+    tUplinkRecord sRecord;
+
+    while(commsCanStartUplink())
+    {
+        if(bulkUploadActive())
+        {
+            if(bulkUploadBusy() || bulkUploadStart(NULL) < 0)
+            {
+                break;
+            }
+            continue;
+        }
+        if(!uplinkSchedTake(&sRecord))
+        {
+            break;
+        }
+        if(commsStartUplink(&sRecord, bulkBenchDone) < 0)
+        {
+            uplinkSchedPutBack(&sRecord);
+            break;
+        }
+        muiInFlight += 1;
+    }
+}
+
+void bulkBenchDone(tUplinkRecord *pRecord, int iResult)
+{
+    muiInFlight -= 1;
+    if(iResult < 0)
+    {
+        uplinkSchedPutBack(pRecord);
+    }
+}
+
+void bulkBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,874 @@
+/*
+    CoAP over DTLS against the https webhook per event, run
+    with "make coapbench".
+
+    Two local servers on one self-signed P-256 certificate
+    stand in for the backends: the webhook (an echo of the
+    first 4 payload bytes as the chunked reply) and a CoAP
+    server on DTLS that answers every confirmable POST with a
+    piggybacked 2.04 carrying the same echo. The daemon
+    reaches each through a proxy thread that holds everything
+    RTT/2 in each direction (plus one RTT on a TCP
+    connection's first chunk for the handshake) and counts
+    what passes the daemon's side: packets (TCP segments from
+    TCP_INFO, datagrams) and payload bytes (TLS and DTLS
+    records).
+    The blocking path sends -n events asking for a downlink
+    over each transport, reported per transport: ms for the
+    first event (connection and handshake), median of the
+    others and in RTTs, packets and bytes of the first and
+    per event after it, bytes per event with IPv4 and TCP
+    (timestamps) or UDP headers.
+    Then the retransmission check: the proxy drops the first
+    two datagrams of one event, the daemon must send it again
+    after ACK_TIMEOUT (2..3 s with the random factor) and
+    again after twice that, the server must see it once and
+    the downlink must arrive.
+
+    Usage:
+        SACCoapBench [-n events] [-r rtt ms]
+    Exit code 1 when a check fails or CoAP is not faster
+    with fewer packets and bytes per event than https.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h> /* struct tcp_info with the segment counters */
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACCoapClient.h"
+
+#define COAPBENCH_EVENTS        20
+#define COAPBENCH_RTTMS         50
+#define COAPBENCH_MAXEVENTS     1000
+#define COAPBENCH_DEVICEID      "bench01"
+#define COAPBENCH_BUFSIZE       8192
+#define COAPBENCH_CHUNKSIZE     4096
+#define COAPBENCH_MAXCHUNKS     16 // held per direction and connection
+#define COAPBENCH_MAXDATAGRAMS  64 // held by the udp proxy
+#define COAPBENCH_DATAGRAMSIZE  2048 // the handshake flights as well
+#define COAPBENCH_DROPS         2 // datagrams dropped for the retransmission check
+#define COAPBENCH_SLACKMS       20 // scheduling slack on the retransmission gaps
+#define COAPBENCH_TCPHEADER     52 // IPv4 + TCP with timestamps
+#define COAPBENCH_UDPHEADER     28 // IPv4 + UDP
+
+typedef struct
+{
+    uint64_t dueUs;
+    int length;
+    uint8_t data[COAPBENCH_CHUNKSIZE];
+} tCoapBenchChunk;
+
+typedef struct
+{
+    int fromFd;
+    int toFd;
+    tCoapBenchChunk chunks[COAPBENCH_MAXCHUNKS];
+    uint32_t head;
+    uint32_t count;
+    bool eof;
+} tCoapBenchDirection;
+
+typedef struct
+{
+    int listenFd;
+    uint16_t port;
+    uint16_t targetPort; // tcp proxy: where to
+} tCoapBenchListener;
+
+typedef struct
+{
+    int fd;
+    uint16_t targetPort;
+} tCoapBenchConnection;
+
+typedef struct
+{
+    uint64_t dueUs;
+    bool toServer;
+    int length;
+    uint8_t data[COAPBENCH_DATAGRAMSIZE];
+} tCoapBenchDatagram;
+
+typedef struct
+{
+    const char *name;
+    const char *transport;
+    uint16_t port;
+    uint32_t headerBytes; // per packet, for the bytes with headers
+    uint32_t ok;
+    uint32_t firstUs;
+    uint32_t medianUs;
+    uint32_t maxUs;
+    uint64_t firstPackets; // both directions, through the first downlink
+    uint64_t firstBytes;
+    uint64_t packets; // all events
+    uint64_t bytes;
+} tCoapBenchRun;
+
+/****************** private function prototypes *********************/
+int coapBenchListen(tCoapBenchListener *pListener, int iType);
+int coapBenchServerContexts();
+void *coapBenchAccept(void *pArg);
+void *coapBenchHttpServer(void *pArg);
+void *coapBenchCoapServer(void *pArg);
+int coapBenchCoapReply(const uint8_t *pRequest, int iLength, uint8_t *pReply);
+void *coapBenchTcpProxy(void *pArg);
+int coapBenchPump(tCoapBenchDirection *pDirection, uint32_t uiExtraUs);
+int coapBenchFlush(tCoapBenchDirection *pDirection, uint64_t ulNowUs);
+void *coapBenchUdpProxy(void *pArg);
+void coapBenchCount(uint64_t ulPackets, uint64_t ulBytes);
+int coapBenchLoad(const char *sTransport, uint16_t uiPort);
+int coapBenchSend(uint32_t uiCounter);
+int coapBenchRun(tCoapBenchRun *pRun, uint32_t uiEvents);
+int coapBenchCompare(const void *pA, const void *pB);
+void coapBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static uint32_t muiRttMs = COAPBENCH_RTTMS;
+static SSL_CTX *mpServerContext = NULL;
+static SSL_CTX *mpDtlsServerContext = NULL;
+static pthread_mutex_t msLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t mulPackets = 0; // on the daemon's side of the proxies
+static uint64_t mulBytes = 0;
+static uint32_t muiRequests = 0; // confirmable POSTs the coap server answered
+static uint32_t muiDrop = 0; // client datagrams the udp proxy still drops
+static uint32_t muiSeen = 0; // client datagrams the udp proxy got since the drops were set
+static uint64_t maulSeenUs[COAPBENCH_DROPS + 1];
+static uint32_t mauiLatencyUs[COAPBENCH_MAXEVENTS];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tCoapBenchListener sHttp;
+    tCoapBenchListener sCoap;
+    tCoapBenchListener sHttpProxy;
+    tCoapBenchListener sCoapProxy;
+    tCoapBenchRun asRuns[] =
+    {
+        {.name = "https", .transport = "http", .headerBytes = COAPBENCH_TCPHEADER},
+        {.name = "coaps", .transport = "coap", .headerBytes = COAPBENCH_UDPHEADER},
+    };
+    uint32_t uiEvents = COAPBENCH_EVENTS;
+    uint32_t uiRequests;
+    uint32_t uiGap1Ms = 0;
+    uint32_t uiGap2Ms = 0;
+    uint64_t ulStartUs;
+    uint32_t uiLatencyUs;
+    pthread_t sThread;
+    bool bPass = true;
+    bool bOk;
+    int iOption;
+    uint32_t i;
+
+    while((iOption = getopt(argc, argv, "n:r:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiEvents = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n events] [-r rtt ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiEvents < 2 || uiEvents > COAPBENCH_MAXEVENTS)
+    {
+        fprintf(stderr, "Need 2..%u events.\n", COAPBENCH_MAXEVENTS);
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "/tmp/SACCoapBench.%i.conf", (int)getpid());
+    if(coapBenchServerContexts() < 0 || coapBenchListen(&sHttp, SOCK_STREAM) < 0 || coapBenchListen(&sHttpProxy, SOCK_STREAM) < 0 ||
+        coapBenchListen(&sCoap, SOCK_DGRAM) < 0 || coapBenchListen(&sCoapProxy, SOCK_DGRAM) < 0)
+    {
+        fprintf(stderr, "Could not open the local servers and their proxies.\n");
+        return 2;
+    }
+    sHttp.targetPort = 0;
+    sHttpProxy.targetPort = sHttp.port;
+    sCoapProxy.targetPort = sCoap.port;
+    asRuns[0].port = sHttpProxy.port;
+    asRuns[1].port = sCoapProxy.port;
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, coapBenchAccept, &sHttp);
+    pthread_create(&sThread, NULL, coapBenchAccept, &sHttpProxy);
+    pthread_create(&sThread, NULL, coapBenchCoapServer, &sCoap);
+    pthread_create(&sThread, NULL, coapBenchUdpProxy, &sCoapProxy);
+
+    coapBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    sslInit();
+    coapBenchQuiet(false);
+
+    fprintf(stderr, "%u events asking for a downlink, %u ms rtt\n", uiEvents, muiRttMs);
+    fprintf(stderr, "%-6s %7s %9s %8s %5s %8s %11s %11s %9s %9s %11s\n", "run", "ok", "first ms", "p50 ms", "RTTs", "max ms",
+        "first pkts", "first bytes", "pkts/ev", "bytes/ev", "+hdrs/ev");
+    for(i=0; i<sizeof(asRuns) / sizeof(asRuns[0]); i+=1)
+    {
+        tCoapBenchRun *pRun = &asRuns[i];
+        if(coapBenchRun(pRun, uiEvents) < 0)
+        {
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return 1;
+        }
+        fprintf(stderr, "%-6s %3u/%-3u %9.1f %8.1f %5.2f %8.1f %11llu %11llu %9.1f %9.1f %11.1f\n", pRun->name, pRun->ok, uiEvents,
+            pRun->firstUs / 1000.0, pRun->medianUs / 1000.0, pRun->medianUs / 1000.0 / muiRttMs, pRun->maxUs / 1000.0,
+            (unsigned long long)pRun->firstPackets, (unsigned long long)pRun->firstBytes,
+            (double)(pRun->packets - pRun->firstPackets) / (uiEvents - 1), (double)(pRun->bytes - pRun->firstBytes) / (uiEvents - 1),
+            (double)(pRun->bytes - pRun->firstBytes + (pRun->packets - pRun->firstPackets) * pRun->headerBytes) / (uiEvents - 1));
+        bPass = bPass && pRun->ok == uiEvents;
+        if(i == 0)
+        {
+            commsClose();
+        }
+    }
+    bPass = bPass && asRuns[1].medianUs < asRuns[0].medianUs &&
+        (asRuns[1].packets - asRuns[1].firstPackets) < (asRuns[0].packets - asRuns[0].firstPackets) &&
+        (asRuns[1].bytes - asRuns[1].firstBytes) < (asRuns[0].bytes - asRuns[0].firstBytes);
+
+    /* the DTLS session is still up */
+    coapBenchQuiet(true);
+    pthread_mutex_lock(&msLock);
+    uiRequests = muiRequests;
+    muiSeen = 0;
+    muiDrop = COAPBENCH_DROPS;
+    pthread_mutex_unlock(&msLock);
+    ulStartUs = printGetMonotonicTimeUs();
+    bOk = (coapBenchSend(uiEvents) == 0);
+    uiLatencyUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    coapBenchQuiet(false);
+    pthread_mutex_lock(&msLock);
+    if(muiSeen == COAPBENCH_DROPS + 1)
+    {
+        uiGap1Ms = (uint32_t)((maulSeenUs[1] - maulSeenUs[0]) / 1000);
+        uiGap2Ms = (uint32_t)((maulSeenUs[2] - maulSeenUs[1]) / 1000);
+    }
+    fprintf(stderr, "retransmission: %u datagrams for one event, resent after %u ms and %u ms more, server answered %u, downlink %s after %.1f ms\n",
+        muiSeen, uiGap1Ms, uiGap2Ms, muiRequests - uiRequests, bOk ? "ok" : "missing", uiLatencyUs / 1000.0);
+    bPass = bPass && bOk && muiSeen == COAPBENCH_DROPS + 1 && muiRequests - uiRequests == 1 &&
+        uiGap1Ms + COAPBENCH_SLACKMS >= COAP_ACKTIMEOUTMS && uiGap1Ms <= COAP_ACKTIMEOUTMS * (100 + COAP_ACKRANDOMPERCENT) / 100 + COAPBENCH_SLACKMS &&
+        uiGap2Ms + COAPBENCH_SLACKMS >= 2 * uiGap1Ms && uiGap2Ms <= 2 * uiGap1Ms + COAPBENCH_SLACKMS;
+    pthread_mutex_unlock(&msLock);
+
+    commsClose();
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/********************* coapBenchListen **********************
+    Loopback socket on a free port, listening when it is a
+    stream socket.
+************************************************************/
+int coapBenchListen(tCoapBenchListener *pListener, int iType)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    pListener->listenFd = socket(AF_INET, iType, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(pListener->listenFd < 0 || bind(pListener->listenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 ||
+        (iType == SOCK_STREAM && listen(pListener->listenFd, 16) < 0))
+    {
+        return -1;
+    }
+    getsockname(pListener->listenFd, (struct sockaddr *)&sAddr, &uiLength);
+    pListener->port = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/***************** coapBenchServerContexts ******************
+    TLS and DTLS on one self-signed P-256 certificate made
+    up on the spot.
+************************************************************/
+int coapBenchServerContexts()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        mpDtlsServerContext = SSL_CTX_new(DTLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL && mpDtlsServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1 &&
+            SSL_CTX_use_certificate(mpDtlsServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpDtlsServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/********************* coapBenchAccept **********************
+    Accept loop of the webhook (no target port) or its
+    proxy, a thread per connection.
+************************************************************/
+void *coapBenchAccept(void *pArg)
+{
+    tCoapBenchListener *pListener = (tCoapBenchListener *)pArg;
+    tCoapBenchConnection *pConnection;
+    pthread_t sThread;
+    int iFd;
+
+    while(1)
+    {
+        iFd = accept(pListener->listenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pConnection = malloc(sizeof(tCoapBenchConnection));
+        pConnection->fd = iFd;
+        pConnection->targetPort = pListener->targetPort;
+        pthread_create(&sThread, NULL, (pListener->targetPort == 0) ? coapBenchHttpServer : coapBenchTcpProxy, pConnection);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/******************* coapBenchHttpServer ********************
+    Requests on the connection until the client closes, the
+    first 4 payload bytes go back as the downlink.
+************************************************************/
+void *coapBenchHttpServer(void *pArg)
+{
+    int iFd = ((tCoapBenchConnection *)pArg)->fd;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[COAPBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9];
+    char *pEnd;
+    char *pValue;
+    SSL *pSsl;
+    int iBuffered = 0;
+    int iLength;
+    int iResult;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while(iBuffered < COAPBENCH_BUFSIZE - 1)
+    {
+        iResult = SSL_read(pSsl, &sBuffer[iBuffered], COAPBENCH_BUFSIZE - 1 - iBuffered);
+        if(iResult <= 0)
+        {
+            break;
+        }
+        iBuffered += iResult;
+        sBuffer[iBuffered] = 0x00;
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL)
+        {
+            memcpy(sData, "00000000", sizeof(sData));
+            pValue = strstr(sBuffer, "&data=");
+            if(pValue != NULL && pValue < pEnd)
+            {
+                memcpy(sData, pValue + 6, 8);
+            }
+            iLength = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACCoapBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+            if(SSL_write(pSsl, sResponse, iLength) != iLength)
+            {
+                iBuffered = COAPBENCH_BUFSIZE;
+                break;
+            }
+            iLength = (int)(pEnd - sBuffer) + 4;
+            memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength + 1);
+            iBuffered -= iLength;
+        }
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/******************* coapBenchCoapServer ********************
+    One DTLS session at a time: the socket is connected to
+    whoever sent the first datagram, the session ends with
+    the client's close notify or after 10 s of silence.
+************************************************************/
+void *coapBenchCoapServer(void *pArg)
+{
+    int iFd = ((tCoapBenchListener *)pArg)->listenFd;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    struct sockaddr_in sPeer;
+    struct sockaddr sUnspec = {.sa_family = AF_UNSPEC};
+    socklen_t uiPeerLength;
+    uint8_t abRequest[COAP_MESSAGEMAXSIZE];
+    uint8_t abReply[COAP_MESSAGEMAXSIZE];
+    uint8_t bByte;
+    SSL *pSsl;
+    BIO *pBio;
+    int iLength;
+
+    while(1)
+    {
+        uiPeerLength = sizeof(sPeer);
+        if(recvfrom(iFd, &bByte, 1, MSG_PEEK, (struct sockaddr *)&sPeer, &uiPeerLength) < 0 || connect(iFd, (struct sockaddr *)&sPeer, uiPeerLength) < 0)
+        {
+            continue;
+        }
+        pBio = BIO_new_dgram(iFd, BIO_NOCLOSE);
+        BIO_ctrl(pBio, BIO_CTRL_DGRAM_SET_CONNECTED, 0, &sPeer);
+        BIO_ctrl(pBio, BIO_CTRL_DGRAM_SET_RECV_TIMEOUT, 0, &sTimeout);
+        pSsl = SSL_new(mpDtlsServerContext);
+        SSL_set_bio(pSsl, pBio, pBio);
+        if(SSL_accept(pSsl) == 1)
+        {
+            while((iLength = SSL_read(pSsl, abRequest, sizeof(abRequest))) > 0)
+            {
+                iLength = coapBenchCoapReply(abRequest, iLength, abReply);
+                if(iLength > 0 && SSL_write(pSsl, abReply, iLength) != iLength)
+                {
+                    break;
+                }
+            }
+            SSL_shutdown(pSsl);
+        }
+        SSL_free(pSsl); // also frees the dgram BIO
+        connect(iFd, &sUnspec, sizeof(sUnspec));
+    }
+    return NULL;
+}
+
+/******************* coapBenchCoapReply *********************
+    ACK with a piggybacked 2.04 and the first 4 payload
+    bytes as the downlink, 0 for anything but a confirmable
+    POST with payload.
+************************************************************/
+int coapBenchCoapReply(const uint8_t *pRequest, int iLength, uint8_t *pReply)
+{
+    int iTokenLength = pRequest[0] & 0x0f;
+    int iPos = 4 + iTokenLength;
+    int iOptionLength;
+    int iDelta;
+
+    if(iLength < 4 || (pRequest[0] >> 6) != 1 || ((pRequest[0] >> 4) & 0x03) != 0 || pRequest[1] != 0x02)
+    {
+        return 0;
+    }
+    while(iPos < iLength && pRequest[iPos] != 0xFF)
+    {
+        iDelta = pRequest[iPos] >> 4;
+        iOptionLength = pRequest[iPos] & 0x0f;
+        iPos += 1 + ((iDelta == 13) ? 1 : 0);
+        if(iOptionLength == 13)
+        {
+            iOptionLength = pRequest[iPos] + 13;
+            iPos += 1;
+        }
+        iPos += iOptionLength;
+    }
+    if(iPos + 1 + (int)sizeof(uint32_t) > iLength)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&msLock);
+    muiRequests += 1;
+    pthread_mutex_unlock(&msLock);
+    pReply[0] = (1 << 6) | (2 << 4) | iTokenLength; // ACK
+    pReply[1] = 0x44; // 2.04 Changed
+    pReply[2] = pRequest[2];
+    pReply[3] = pRequest[3];
+    memcpy(&pReply[4], &pRequest[4], iTokenLength);
+    iLength = 4 + iTokenLength;
+    pReply[iLength++] = 0xFF;
+    memset(&pReply[iLength], 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    memcpy(&pReply[iLength], &pRequest[iPos + 1], sizeof(uint32_t));
+    return iLength + STRUCTS_DECKEDREPLYPAYLOADSIZE;
+}
+
+/******************** coapBenchTcpProxy *********************
+    Relays one client connection to the webhook, every chunk
+    RTT/2 late, the first client chunk one RTT more for the
+    TCP handshake. Counts the bytes both ways and the
+    segments on the client's side.
+************************************************************/
+void *coapBenchTcpProxy(void *pArg)
+{
+    tCoapBenchConnection *pConnection = (tCoapBenchConnection *)pArg;
+    int iClientFd = pConnection->fd;
+    tCoapBenchDirection *pUp = calloc(1, sizeof(tCoapBenchDirection));
+    tCoapBenchDirection *pDown = calloc(1, sizeof(tCoapBenchDirection));
+    struct sockaddr_in sAddr;
+    struct pollfd asPoll[2];
+    struct tcp_info sInfo;
+    socklen_t uiInfoLength = sizeof(sInfo);
+    uint32_t uiHandshakeUs = muiRttMs * 1000;
+    uint64_t ulNowUs;
+    uint64_t ulDueUs;
+    int iTimeoutMs;
+    int iServerFd;
+    int iNoDelay = 1;
+
+    iServerFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(pConnection->targetPort);
+    free(pArg);
+    setsockopt(iClientFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay)); // a held chunk goes out when due, not after the peer's delayed ack
+    setsockopt(iServerFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+    if(pUp != NULL && pDown != NULL && iServerFd >= 0 && connect(iServerFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) == 0)
+    {
+        pUp->fromFd = iClientFd;
+        pUp->toFd = iServerFd;
+        pDown->fromFd = iServerFd;
+        pDown->toFd = iClientFd;
+        while(!(pUp->eof && pUp->count == 0 && pDown->eof && pDown->count == 0))
+        {
+            asPoll[0].fd = (pUp->eof || pUp->count == COAPBENCH_MAXCHUNKS) ? -1 : iClientFd;
+            asPoll[1].fd = (pDown->eof || pDown->count == COAPBENCH_MAXCHUNKS) ? -1 : iServerFd;
+            asPoll[0].events = POLLIN;
+            asPoll[1].events = POLLIN;
+            ulNowUs = printGetMonotonicTimeUs();
+            iTimeoutMs = 100;
+            if(pUp->count > 0 || pDown->count > 0)
+            {
+                ulDueUs = (pDown->count == 0 || (pUp->count > 0 && pUp->chunks[pUp->head].dueUs < pDown->chunks[pDown->head].dueUs)) ? pUp->chunks[pUp->head].dueUs : pDown->chunks[pDown->head].dueUs;
+                iTimeoutMs = (ulDueUs > ulNowUs) ? (int)((ulDueUs - ulNowUs + 999) / 1000) : 0;
+            }
+            poll(asPoll, 2, iTimeoutMs);
+            if((asPoll[0].fd >= 0 && (asPoll[0].revents & (POLLIN | POLLHUP | POLLERR)) && coapBenchPump(pUp, uiHandshakeUs) < 0) ||
+                (asPoll[1].fd >= 0 && (asPoll[1].revents & (POLLIN | POLLHUP | POLLERR)) && coapBenchPump(pDown, 0) < 0))
+            {
+                break;
+            }
+            uiHandshakeUs = (pUp->count > 0 || pUp->eof) ? 0 : uiHandshakeUs;
+            ulNowUs = printGetMonotonicTimeUs();
+            if(coapBenchFlush(pUp, ulNowUs) < 0 || coapBenchFlush(pDown, ulNowUs) < 0)
+            {
+                break;
+            }
+        }
+    }
+    if(getsockopt(iClientFd, IPPROTO_TCP, TCP_INFO, &sInfo, &uiInfoLength) == 0)
+    {
+        coapBenchCount(sInfo.tcpi_segs_in + sInfo.tcpi_segs_out, 0);
+    }
+    if(iServerFd >= 0)
+    {
+        close(iServerFd);
+    }
+    close(iClientFd);
+    free(pUp);
+    free(pDown);
+    return NULL;
+}
+
+/********************** coapBenchPump ***********************
+    Reads what arrived into a chunk held until RTT/2 (plus
+    uiExtraUs) from now.
+************************************************************/
+int coapBenchPump(tCoapBenchDirection *pDirection, uint32_t uiExtraUs)
+{
+    tCoapBenchChunk *pChunk = &pDirection->chunks[(pDirection->head + pDirection->count) % COAPBENCH_MAXCHUNKS];
+    int iResult = read(pDirection->fromFd, pChunk->data, COAPBENCH_CHUNKSIZE);
+
+    if(iResult < 0)
+    {
+        return -1;
+    }
+    if(iResult == 0)
+    {
+        pDirection->eof = true;
+        return 0;
+    }
+    coapBenchCount(0, iResult);
+    pChunk->length = iResult;
+    pChunk->dueUs = printGetMonotonicTimeUs() + muiRttMs * 500 + uiExtraUs;
+    pDirection->count += 1;
+    return 0;
+}
+
+/********************** coapBenchFlush **********************
+    Forwards the chunks that are due, passes the end of the
+    stream on once nothing is held anymore.
+************************************************************/
+int coapBenchFlush(tCoapBenchDirection *pDirection, uint64_t ulNowUs)
+{
+    tCoapBenchChunk *pChunk;
+
+    while(pDirection->count > 0 && pDirection->chunks[pDirection->head].dueUs <= ulNowUs)
+    {
+        pChunk = &pDirection->chunks[pDirection->head];
+        if(send(pDirection->toFd, pChunk->data, pChunk->length, MSG_NOSIGNAL) != pChunk->length)
+        {
+            return -1;
+        }
+        pDirection->head = (pDirection->head + 1) % COAPBENCH_MAXCHUNKS;
+        pDirection->count -= 1;
+        if(pDirection->count == 0 && pDirection->eof)
+        {
+            shutdown(pDirection->toFd, SHUT_WR);
+        }
+    }
+    return 0;
+}
+
+/******************** coapBenchUdpProxy *********************
+    Holds every datagram RTT/2 in either direction, drops
+    the client's while muiDrop says so and notes when they
+    arrived. Answers go to the client that sent last.
+************************************************************/
+void *coapBenchUdpProxy(void *pArg)
+{
+    tCoapBenchListener *pListener = (tCoapBenchListener *)pArg;
+    static tCoapBenchDatagram asHeld[COAPBENCH_MAXDATAGRAMS];
+    tCoapBenchDatagram *pDatagram;
+    struct sockaddr_in sClient;
+    struct sockaddr_in sServer;
+    struct pollfd asPoll[2];
+    socklen_t uiClientLength = sizeof(sClient);
+    uint32_t uiHead = 0;
+    uint32_t uiCount = 0;
+    uint64_t ulNowUs;
+    bool bDrop;
+    int iServerFd = socket(AF_INET, SOCK_DGRAM, 0);
+    int iTimeoutMs;
+    int i;
+
+    memset(&sClient, 0, sizeof(sClient));
+    memset(&sServer, 0, sizeof(sServer));
+    sServer.sin_family = AF_INET;
+    sServer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sServer.sin_port = htons(pListener->targetPort);
+    if(iServerFd < 0 || connect(iServerFd, (struct sockaddr *)&sServer, sizeof(sServer)) < 0)
+    {
+        return NULL;
+    }
+    while(1)
+    {
+        asPoll[0].fd = (uiCount == COAPBENCH_MAXDATAGRAMS) ? -1 : pListener->listenFd;
+        asPoll[1].fd = (uiCount == COAPBENCH_MAXDATAGRAMS) ? -1 : iServerFd;
+        asPoll[0].events = POLLIN;
+        asPoll[1].events = POLLIN;
+        ulNowUs = printGetMonotonicTimeUs();
+        iTimeoutMs = 100;
+        if(uiCount > 0)
+        {
+            iTimeoutMs = (asHeld[uiHead].dueUs > ulNowUs) ? (int)((asHeld[uiHead].dueUs - ulNowUs + 999) / 1000) : 0;
+        }
+        poll(asPoll, 2, iTimeoutMs);
+        for(i=0; i<2; i+=1)
+        {
+            if(asPoll[i].fd < 0 || (asPoll[i].revents & POLLIN) == 0)
+            {
+                continue;
+            }
+            pDatagram = &asHeld[(uiHead + uiCount) % COAPBENCH_MAXDATAGRAMS];
+            uiClientLength = sizeof(sClient);
+            pDatagram->length = (i == 0) ? recvfrom(asPoll[i].fd, pDatagram->data, sizeof(pDatagram->data), 0, (struct sockaddr *)&sClient, &uiClientLength) :
+                recv(asPoll[i].fd, pDatagram->data, sizeof(pDatagram->data), 0);
+            if(pDatagram->length < 0)
+            {
+                continue;
+            }
+            coapBenchCount(1, pDatagram->length);
+            bDrop = false;
+            if(i == 0)
+            {
+                pthread_mutex_lock(&msLock);
+                if(muiSeen <= COAPBENCH_DROPS)
+                {
+                    maulSeenUs[muiSeen] = printGetMonotonicTimeUs();
+                }
+                muiSeen += 1;
+                bDrop = (muiDrop > 0);
+                muiDrop -= bDrop ? 1 : 0;
+                pthread_mutex_unlock(&msLock);
+            }
+            if(!bDrop)
+            {
+                pDatagram->toServer = (i == 0);
+                pDatagram->dueUs = printGetMonotonicTimeUs() + muiRttMs * 500;
+                uiCount += 1;
+            }
+        }
+        ulNowUs = printGetMonotonicTimeUs();
+        while(uiCount > 0 && asHeld[uiHead].dueUs <= ulNowUs)
+        {
+            pDatagram = &asHeld[uiHead];
+            if(pDatagram->toServer)
+            {
+                send(iServerFd, pDatagram->data, pDatagram->length, 0);
+            }
+            else
+            {
+                sendto(pListener->listenFd, pDatagram->data, pDatagram->length, 0, (struct sockaddr *)&sClient, sizeof(sClient));
+            }
+            uiHead = (uiHead + 1) % COAPBENCH_MAXDATAGRAMS;
+            uiCount -= 1;
+        }
+    }
+    return NULL;
+}
+
+void coapBenchCount(uint64_t ulPackets, uint64_t ulBytes)
+{
+    pthread_mutex_lock(&msLock);
+    mulPackets += ulPackets;
+    mulBytes += ulBytes;
+    pthread_mutex_unlock(&msLock);
+}
+
+int coapBenchLoad(const char *sTransport, uint16_t uiPort)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = %s\nhost = 127.0.0.1\ndevice_id = %s\nhttp_port = %u\ncoap_port = %u\nuse_ssl = yes\nktls = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 2\n",
+        sTransport, COAPBENCH_DEVICEID, uiPort, uiPort);
+    fclose(pFile);
+    return (configInit(msConfigPath) < 0 || commsInit() < 0) ? -1 : 0;
+}
+
+/********************** coapBenchSend ***********************
+    One event asking for a downlink, 0 when the decked
+    reply got its echo.
+************************************************************/
+int coapBenchSend(uint32_t uiCounter)
+{
+    tUplinkRecord sRecord;
+
+    memset(&sRecord, 0, sizeof(sRecord));
+    memset(getCtrlDeckedReply()->payload, 0xff, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    sRecord.cmd.cmdCode = 0x02;
+    sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sRecord.cmd.downlinkIndicator = 0x01;
+    sRecord.priorityClass = UPLCLASS_EVENT;
+    memcpy(sRecord.cmd.payload, &uiCounter, sizeof(uiCounter));
+    sRecord.time = time(NULL);
+    if(commsSendUplink(&sRecord) < 0 || memcmp(getCtrlDeckedReply()->payload, &uiCounter, sizeof(uiCounter)) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*********************** coapBenchRun ***********************
+    The events one after the other, each timed from
+    commsSendUplink() to its downlink. Counters are read
+    two RTTs after an event, when its connection is closed.
+************************************************************/
+int coapBenchRun(tCoapBenchRun *pRun, uint32_t uiEvents)
+{
+    uint64_t ulPacketsBefore;
+    uint64_t ulBytesBefore;
+    uint64_t ulStartUs;
+    uint32_t i;
+
+    coapBenchQuiet(true);
+    if(coapBenchLoad(pRun->transport, pRun->port) < 0)
+    {
+        coapBenchQuiet(false);
+        return -1;
+    }
+    pthread_mutex_lock(&msLock);
+    ulPacketsBefore = mulPackets;
+    ulBytesBefore = mulBytes;
+    pthread_mutex_unlock(&msLock);
+    for(i=0; i<uiEvents; i+=1)
+    {
+        ulStartUs = printGetMonotonicTimeUs();
+        pRun->ok += (coapBenchSend(i) == 0) ? 1 : 0;
+        mauiLatencyUs[i] = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+        if(i == 0)
+        {
+            usleep(2 * muiRttMs * 1000);
+            pthread_mutex_lock(&msLock);
+            pRun->firstPackets = mulPackets - ulPacketsBefore;
+            pRun->firstBytes = mulBytes - ulBytesBefore;
+            pthread_mutex_unlock(&msLock);
+        }
+    }
+    usleep(2 * muiRttMs * 1000);
+    pthread_mutex_lock(&msLock);
+    pRun->packets = mulPackets - ulPacketsBefore;
+    pRun->bytes = mulBytes - ulBytesBefore;
+    pthread_mutex_unlock(&msLock);
+    coapBenchQuiet(false);
+
+    pRun->firstUs = mauiLatencyUs[0];
+    qsort(&mauiLatencyUs[1], uiEvents - 1, sizeof(uint32_t), coapBenchCompare);
+    pRun->medianUs = mauiLatencyUs[1 + (uiEvents - 2) / 2];
+    pRun->maxUs = mauiLatencyUs[uiEvents - 1];
+    return 0;
+}
+
+int coapBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void coapBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,431 @@
+/*
+    Edge aggregation on a day of dispenser traffic, run with
+    "make aggbench".
+
+    The day is synthetic (seeded, so runs compare) or read
+    from a recording. It goes through edgeAggSubmit() twice,
+    aggregation off and on, in simulated time with an
+    edgeAggPoll() every second like the housekeeping timer.
+    Every uplink is counted with its payload bytes and the
+    size of the http request built for it, and is applied to
+    a server side state with edgeAggApply().
+    Checked with aggregation on:
+        - the server's state equals the last telemetry record
+          at the end of the day (ignored fields aside), no
+          delta was rejected;
+        - no rolled up change was held longer than
+          max_staleness_sec (+1 s poll period);
+        - every alarm went out in the call that submitted it.
+
+    Synthetic dispenser, layout C4C2G1G1G2I2: dispense count,
+    refill count, fill level %, status flags, battery mV,
+    ticks. A record after every dispense, a heartbeat every
+    minute, a downlink request (event) every 15 minutes, an
+    alarm when the level drops to 10%.
+    Recording (-r): one record per line,
+        <second of day> <cmd code> <downlink 0/1> <payload hex, 24 digits>
+
+    Usage:
+        SACEdgeAggBench [-r recording] [-s seed] [-f fields] [-m max staleness s] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strlen */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACConfig.h"
+#include "SACEdgeAgg.h"
+
+#define AGGBENCH_DAYSEC         86400
+#define AGGBENCH_MAXRECORDS     200000
+#define AGGBENCH_FIELDS         "C4C2G1G1G2I2"
+#define AGGBENCH_STALENESSSEC   300
+#define AGGBENCH_STARTUS        1000000000ULL // simulated monotonic time at midnight
+
+typedef struct
+{
+    uint32_t second;
+    tCtrlSendCmd cmd;
+} tAggBenchRecord;
+
+typedef struct
+{
+    const char *name;
+    bool enabled;
+    uint32_t uplinks;
+    uint64_t payloadBytes;
+    uint64_t httpBytes;
+    uint32_t rejected; // deltas edgeAggApply() refused
+    uint32_t alarmsHeld; // alarms that did not go out in their own edgeAggSubmit()
+    tEdgeAggStats stats;
+    bool stateOk; // server state equals the last telemetry record
+} tAggBenchRun;
+
+/****************** daemon internals driven by the benchmark *********************/
+extern char msHttpTxMessage[HTTPMSGMAXSIZE];
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int aggBenchGenerate(uint32_t uiSeed);
+int aggBenchLoad(const char *sPath);
+void aggBenchAdd(uint32_t uiSecond, uint8_t bCmdCode, uint8_t bDownlink, const uint8_t *pPayload);
+int aggBenchWriteConfig(bool bEnabled, const char *sFields, uint32_t uiStalenessSec);
+int aggBenchRun(tAggBenchRun *pRun, const char *sFields, uint32_t uiStalenessSec);
+int32_t aggBenchSink(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime);
+uint32_t aggBenchRandom();
+void aggBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static tAggBenchRecord masRecords[AGGBENCH_MAXRECORDS];
+static uint32_t muiRecords = 0;
+static uint32_t muiRandom = 1;
+static char msConfigPath[256];
+static tAggBenchRun *mpRun = NULL;
+static tEdgeAggLayout msLayout;
+static uint8_t mabServerState[STRUCTS_SENDCMDPAYLOADSIZE];
+static uint8_t mbServerChainSeq = 0;
+static uint32_t muiAlarmsOut = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sRecording = NULL;
+    const char *sDir = "/tmp";
+    const char *sFields = AGGBENCH_FIELDS;
+    uint32_t uiStalenessSec = AGGBENCH_STALENESSSEC;
+    uint32_t uiSeed = 1;
+    tAggBenchRun asRuns[2] = {{.name = "off", .enabled = false}, {.name = "on", .enabled = true}};
+    bool bPass;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "r:s:f:m:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'r': sRecording = optarg; break;
+            case 's': uiSeed = atoi(optarg); break;
+            case 'f': sFields = optarg; break;
+            case 'm': uiStalenessSec = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-r recording] [-s seed] [-f fields] [-m max staleness s] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(edgeAggParseLayout(sFields, &msLayout) < 0)
+    {
+        fprintf(stderr, "Bad field layout \'%s\'.\n", sFields);
+        return 2;
+    }
+    if((sRecording != NULL) ? (aggBenchLoad(sRecording) < 0) : (aggBenchGenerate(uiSeed) < 0))
+    {
+        fprintf(stderr, "No traffic, %s.\n", (sRecording != NULL) ? "could not read the recording" : "too many records");
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACEdgeAggBench.%i.conf", sDir, (int)getpid());
+
+    for(i=0; i<2; i+=1)
+    {
+        if(aggBenchRun(&asRuns[i], sFields, uiStalenessSec) < 0)
+        {
+            fprintf(stderr, "Could not write %s.\n", msConfigPath);
+            return 2;
+        }
+    }
+    unlink(msConfigPath);
+
+    fprintf(stderr, "%u records from the controller (%s), fields %s, max staleness %u s\n", muiRecords, (sRecording != NULL) ? sRecording : "synthetic day", sFields, uiStalenessSec);
+    fprintf(stderr, "%-4s %8s %14s %12s %11s %10s %10s %7s %14s\n", "agg", "uplinks", "payload bytes", "http bytes", "suppressed", "rolled up", "keyframes", "deltas", "max staleness");
+    for(i=0; i<2; i+=1)
+    {
+        fprintf(stderr, "%-4s %8u %14llu %12llu %11llu %10llu %10llu %7llu %12u s\n", asRuns[i].name, asRuns[i].uplinks,
+            (unsigned long long)asRuns[i].payloadBytes, (unsigned long long)asRuns[i].httpBytes,
+            (unsigned long long)asRuns[i].stats.suppressed, (unsigned long long)asRuns[i].stats.rolledUp,
+            (unsigned long long)asRuns[i].stats.keyframes, (unsigned long long)asRuns[i].stats.deltas, asRuns[i].stats.maxStalenessUs / 1000000);
+    }
+    fprintf(stderr, "uplinks -%.1f%%, http bytes -%.1f%%\n",
+        100.0 - 100.0 * asRuns[1].uplinks / asRuns[0].uplinks, 100.0 - 100.0 * asRuns[1].httpBytes / asRuns[0].httpBytes);
+
+    bPass = asRuns[1].stateOk && asRuns[1].rejected == 0 && asRuns[1].alarmsHeld == 0 && asRuns[1].stats.maxStalenessUs <= (uiStalenessSec + 1) * 1000000U
+        && asRuns[1].stats.records == asRuns[0].stats.records && asRuns[1].uplinks <= asRuns[0].uplinks;
+    if(!asRuns[1].stateOk || asRuns[1].rejected > 0)
+    {
+        fprintf(stderr, "server state differs from the last record (%u deltas rejected)\n", asRuns[1].rejected);
+    }
+    if(asRuns[1].alarmsHeld > 0)
+    {
+        fprintf(stderr, "%u alarms held back\n", asRuns[1].alarmsHeld);
+    }
+    fprintf(stderr, bPass ? "PASS\n" : "FAIL\n");
+    return bPass ? 0 : 1;
+}
+
+/******************** aggBenchGenerate **********************
+    One day of a washroom dispenser, see the header.
+************************************************************/
+int aggBenchGenerate(uint32_t uiSeed)
+{
+    uint32_t uiDispenses = 120345;
+    uint16_t uiRefills = 87;
+    uint8_t bLevel = 36;
+    uint8_t bFlags = 0x00;
+    uint16_t uiBatteryMv = 3020;
+    uint32_t uiLevelSteps = 0;
+    bool bAlarmSent = false;
+    uint8_t abPayload[STRUCTS_SENDCMDPAYLOADSIZE];
+    uint32_t uiSecond;
+    uint32_t uiPerMille;
+
+    muiRandom = (uiSeed != 0) ? uiSeed : 1;
+    muiRecords = 0;
+    for(uiSecond=0; uiSecond<AGGBENCH_DAYSEC; uiSecond+=1)
+    {
+        uint32_t uiHour = uiSecond / 3600;
+        bool bDispense;
+        uint8_t bCmdCode = 0x02;
+        uint8_t bDownlink = 0x00;
+
+        // per mille chance of a dispense in this second: night, day, rush hours
+        uiPerMille = (uiHour < 6 || uiHour >= 22) ? 1 : ((uiHour == 8 || uiHour == 12 || uiHour == 17) ? 80 : 20);
+        bDispense = (aggBenchRandom() % 1000) < uiPerMille;
+        if(bDispense)
+        {
+            uiDispenses += 1;
+            uiLevelSteps += 1;
+            if(uiLevelSteps == 40)
+            {
+                uiLevelSteps = 0;
+                bLevel -= 1;
+            }
+            if(bLevel <= 10 && !bAlarmSent)
+            {
+                bCmdCode = UPLSCHED_CMDCODE_ALARM;
+                bAlarmSent = true;
+            }
+        }
+        if(uiSecond == 15 * 3600 && bLevel < 50)
+        {
+            bLevel = 100; // afternoon round of the cleaning staff
+            uiRefills += 1;
+            bAlarmSent = false;
+        }
+        if(uiSecond % (4 * 3600) == 0 && uiSecond > 0)
+        {
+            uiBatteryMv -= 10;
+        }
+        if(uiSecond == 9 * 3600 + 1234 || uiSecond == 18 * 3600 + 4321)
+        {
+            bFlags ^= 0x04; // paper jam and cleared again
+        }
+        if(!bDispense && uiSecond % 60 != 0 && uiSecond % 900 != 0)
+        {
+            continue;
+        }
+        if(uiSecond % 900 == 0 && !bDispense)
+        {
+            bDownlink = 0x01; // asks for its settings
+        }
+        abPayload[0] = (uint8_t)uiDispenses;
+        abPayload[1] = (uint8_t)(uiDispenses >> 8);
+        abPayload[2] = (uint8_t)(uiDispenses >> 16);
+        abPayload[3] = (uint8_t)(uiDispenses >> 24);
+        abPayload[4] = (uint8_t)uiRefills;
+        abPayload[5] = (uint8_t)(uiRefills >> 8);
+        abPayload[6] = bLevel;
+        abPayload[7] = bFlags;
+        abPayload[8] = (uint8_t)uiBatteryMv;
+        abPayload[9] = (uint8_t)(uiBatteryMv >> 8);
+        abPayload[10] = (uint8_t)uiSecond; // controller ticks, different in every record
+        abPayload[11] = (uint8_t)(uiSecond >> 8);
+        if(muiRecords == AGGBENCH_MAXRECORDS)
+        {
+            return -1;
+        }
+        aggBenchAdd(uiSecond, bCmdCode, bDownlink, abPayload);
+    }
+    return (int)muiRecords;
+}
+
+int aggBenchLoad(const char *sPath)
+{
+    FILE *pFile = fopen(sPath, "r");
+    char sLine[128];
+    char sHex[32];
+    uint8_t abPayload[STRUCTS_SENDCMDPAYLOADSIZE];
+    unsigned int uiSecond;
+    unsigned int uiCmdCode;
+    unsigned int uiDownlink;
+
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    muiRecords = 0;
+    while(fgets(sLine, sizeof(sLine), pFile) != NULL && muiRecords < AGGBENCH_MAXRECORDS)
+    {
+        if(sLine[0] == '#' || sscanf(sLine, "%u %x %u %31s", &uiSecond, &uiCmdCode, &uiDownlink, sHex) != 4)
+        {
+            continue;
+        }
+        memset(abPayload, 0, sizeof(abPayload));
+        if(printParseHexStringToBytes(sHex, abPayload, sizeof(abPayload)) != STRUCTS_SENDCMDPAYLOADSIZE)
+        {
+            continue;
+        }
+        aggBenchAdd(uiSecond, (uint8_t)uiCmdCode, (uint8_t)uiDownlink, abPayload);
+    }
+    fclose(pFile);
+    return (muiRecords > 0) ? (int)muiRecords : -1;
+}
+
+void aggBenchAdd(uint32_t uiSecond, uint8_t bCmdCode, uint8_t bDownlink, const uint8_t *pPayload)
+{
+    tCtrlSendCmd *pCmd = &masRecords[muiRecords].cmd;
+    masRecords[muiRecords].second = uiSecond;
+    pCmd->startTag = IOT_FRMSTARTTAG;
+    pCmd->cmdCode = bCmdCode;
+    pCmd->payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    pCmd->downlinkIndicator = bDownlink;
+    memcpy(pCmd->payload, pPayload, STRUCTS_SENDCMDPAYLOADSIZE);
+    pCmd->endTag = IOT_FRMENDTAG;
+    muiRecords += 1;
+}
+
+int aggBenchWriteConfig(bool bEnabled, const char *sFields, uint32_t uiStalenessSec)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = dashboard.example.com\nuse_ssl = no\nuser_reply =\n\n[aggregation]\nenabled = %s\nfields = %s\nmax_staleness_sec = %u\n",
+        bEnabled ? "yes" : "no", sFields, uiStalenessSec);
+    fclose(pFile);
+    return 0;
+}
+
+/*********************** aggBenchRun ************************
+    The day in simulated time: records at their second, a
+    poll every second, a flush at the end like a config
+    change would do.
+************************************************************/
+int aggBenchRun(tAggBenchRun *pRun, const char *sFields, uint32_t uiStalenessSec)
+{
+    const uint8_t *pLast = NULL;
+    uint32_t uiAlarmsIn = 0;
+    uint32_t uiSecond;
+    uint32_t uiNext = 0;
+    int i;
+
+    if(aggBenchWriteConfig(pRun->enabled, sFields, uiStalenessSec) < 0)
+    {
+        return -1;
+    }
+    aggBenchQuiet(true);
+    configInit(msConfigPath);
+    uplinkSchedInit();
+    edgeAggInit();
+    edgeAggSetSink(aggBenchSink);
+    mpRun = pRun;
+    memset(mabServerState, 0, sizeof(mabServerState));
+    mbServerChainSeq = 0;
+    muiAlarmsOut = 0;
+    for(uiSecond=0; uiSecond<AGGBENCH_DAYSEC; uiSecond+=1)
+    {
+        uint64_t ulNowUs = AGGBENCH_STARTUS + (uint64_t)uiSecond * 1000000ULL;
+        while(uiNext < muiRecords && masRecords[uiNext].second <= uiSecond)
+        {
+            tCtrlSendCmd *pCmd = &masRecords[uiNext].cmd;
+            if(uplinkSchedClassify(pCmd) == UPLCLASS_ALARM)
+            {
+                uiAlarmsIn += 1;
+            }
+            edgeAggSubmit(pCmd, ulNowUs);
+            pRun->alarmsHeld += uiAlarmsIn - muiAlarmsOut;
+            muiAlarmsOut = uiAlarmsIn; // counted once
+            if(uplinkSchedClassify(pCmd) == UPLCLASS_TELEMETRY)
+            {
+                pLast = pCmd->payload;
+            }
+            uiNext += 1;
+        }
+        edgeAggPoll(ulNowUs);
+    }
+    edgeAggFlush();
+    memcpy(&pRun->stats, edgeAggStats(), sizeof(tEdgeAggStats));
+    edgeAggSetSink(NULL);
+    aggBenchQuiet(false);
+
+    pRun->stateOk = true;
+    for(i=0; i<msLayout.nFields && pLast != NULL; i+=1)
+    {
+        const tEdgeAggField *pField = &msLayout.fields[i];
+        if(pField->kind != EDGEAGG_IGNORED && memcmp(&mabServerState[pField->offset], &pLast[pField->offset], pField->width) != 0)
+        {
+            pRun->stateOk = false;
+        }
+    }
+    return 0;
+}
+
+/*********************** aggBenchSink ***********************
+    Stands in for the uplink queues: counts, sizes the http
+    request and applies the record on the server side. Raw
+    telemetry (aggregation off) is absolute as well.
+************************************************************/
+int32_t aggBenchSink(tCtrlSendCmd *pCmd, uint8_t bEncoding, long unsigned int ulTime)
+{
+    tUplinkClass eClass = uplinkSchedClassify(pCmd);
+
+    mpRun->uplinks += 1;
+    mpRun->payloadBytes += pCmd->payloadSize - 1;
+    httpBuildRequestMsg((uintptr_t)pCmd->payload, pCmd->payloadSize - 1, ulTime, bEncoding);
+    mpRun->httpBytes += strlen(msHttpTxMessage);
+    if(eClass == UPLCLASS_ALARM)
+    {
+        muiAlarmsOut += 1;
+    }
+    if(eClass == UPLCLASS_TELEMETRY && edgeAggApply(&msLayout, mabServerState, &mbServerChainSeq, pCmd->payload, pCmd->payloadSize - 1, bEncoding) < 0)
+    {
+        mpRun->rejected += 1;
+    }
+    return (int32_t)mpRun->uplinks;
+}
+
+uint32_t aggBenchRandom()
+{
+    muiRandom ^= muiRandom << 13; // xorshift32
+    muiRandom ^= muiRandom >> 17;
+    muiRandom ^= muiRandom << 5;
+    return muiRandom;
+}
+
+void aggBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,526 @@
+/*
+    Upstream endpoint selection, failover and hedging, run
+    with "make endpointtest".
+
+    Every phase starts three local servers that stand in for
+    the backend nodes A, B and C, each with its own injected
+    faults: a latency, every K-th answer late by a spike, a
+    share of 503 answers, or the listener closed (connection
+    refused). An answer echoes the first 4 payload bytes as
+    the downlink, so an answer handed to the wrong uplink is
+    caught. Uplinks go through the reactor with a connection
+    each, the failover phase sends some blocking ones too.
+        latency   A 60 ms, B 10 ms, C 30 ms: most go to B
+        weights   A and B 20 ms, A weight 4: most go to A
+        errors    B 10 ms with 50% 503, C 30 ms: most go to C
+        failover  B refuses connections halfway: nothing fails
+        hedging   A 10 ms, every 20th answer 300 ms late, B 60 ms:
+                  p99 with [comms] hedge_percentile 0 and 90
+        reload    the endpoint list changes to C only: all go to C
+
+    Usage:
+        SACEndpointTest [-n uplinks per phase] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACEndpoints.h"
+
+#define EPTEST_UPLINKS          200
+#define EPTEST_SERVERS          3
+#define EPTEST_CONCURRENCY      2 // uplinks in flight, leaves COMMS_MAXINFLIGHT room for hedges
+#define EPTEST_BLOCKING         20 // blocking uplinks in the failover phase
+#define EPTEST_BUFSIZE          4096
+#define EPTEST_MAXUPLINKS       10000
+
+typedef struct
+{
+    uint32_t latencyMs;
+    uint32_t spikeEvery; // 0: no spikes
+    uint32_t spikeMs;
+    uint32_t errorPermille; // answered with 503
+    volatile bool down; // listener closed
+    volatile uint32_t received;
+    int listenFd;
+    uint16_t port;
+    volatile bool running;
+    pthread_t thread;
+} tEpTestServer;
+
+typedef struct
+{
+    tEpTestServer *pServer;
+    int iFd;
+} tEpTestConnection;
+
+/****************** private function prototypes *********************/
+int epTestStart(tEpTestServer *pServer);
+int epTestListen(tEpTestServer *pServer);
+void epTestStop(tEpTestServer *pServer);
+void *epTestServer(void *pArg);
+void *epTestConnection(void *pArg);
+int epTestWriteConfig(const char *sEndpoints, uint32_t uiHedgePercentile);
+int epTestRun(uint32_t uiUplinks, uint32_t uiDownAfter, tEpTestServer *pDown, bool bLoadConfig);
+void epTestDone(tUplinkRecord *pRecord, int iResult);
+uint32_t epTestPercentile(uint32_t uiPercentile);
+bool epTestCheck(const char *sPhase, bool bPass, const char *sDetail);
+void epTestQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static tEpTestServer masServers[EPTEST_SERVERS];
+static uint32_t muiDone = 0;
+static uint32_t muiOk = 0;
+static uint32_t muiFailed = 0;
+static uint32_t muiMismatched = 0;
+static uint32_t mauiLatencyMs[EPTEST_MAXUPLINKS];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    tEpTestServer *pA = &masServers[0];
+    tEpTestServer *pB = &masServers[1];
+    tEpTestServer *pC = &masServers[2];
+    char sEndpoints[CONFIG_ENDPOINTSMAXSIZE];
+    char sDetail[160];
+    uint32_t uiUplinks = EPTEST_UPLINKS;
+    uint32_t auiP99[2];
+    uint32_t auiP50[2];
+    uint32_t uiHedges;
+    uint32_t uiBlockingOk;
+    uint32_t uiReceived[EPTEST_SERVERS];
+    uint32_t uiChanged = 0;
+    tUplinkRecord sRecord;
+    bool bPass = true;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "n:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiUplinks = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n uplinks per phase] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiUplinks < 20 || uiUplinks > EPTEST_MAXUPLINKS)
+    {
+        fprintf(stderr, "-n must be 20..%u.\n", EPTEST_MAXUPLINKS);
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACEndpointTest.%i.conf", sDir, (int)getpid());
+    signal(SIGPIPE, SIG_IGN);
+    epTestQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    epTestQuiet(false);
+    fprintf(stderr, "%u uplinks per phase, %u in flight\n", uiUplinks, EPTEST_CONCURRENCY);
+
+#define EPTEST_SETUP(a, b, c) \
+    memset(masServers, 0, sizeof(masServers)); \
+    pA->latencyMs = (a); pB->latencyMs = (b); pC->latencyMs = (c); \
+    if(epTestStart(pA) < 0 || epTestStart(pB) < 0 || epTestStart(pC) < 0) { fprintf(stderr, "Could not open the local servers.\n"); return 2; }
+#define EPTEST_TEARDOWN() epTestStop(pA); epTestStop(pB); epTestStop(pC);
+
+    /* latency: the fastest one gets the traffic, probes keep the others measured */
+    EPTEST_SETUP(60, 10, 30);
+    snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u,127.0.0.1:%u,127.0.0.1:%u", pA->port, pB->port, pC->port);
+    if(epTestWriteConfig(sEndpoints, 0) < 0 || epTestRun(uiUplinks, 0, NULL, true) < 0) { return 1; }
+    snprintf(sDetail, sizeof(sDetail), "A %u, B %u, C %u, failed %u", pA->received, pB->received, pC->received, muiFailed);
+    bPass &= epTestCheck("latency", pB->received >= uiUplinks * 7 / 10 && muiOk == uiUplinks, sDetail);
+    EPTEST_TEARDOWN();
+
+    /* weights: same latency, A weighs 4 */
+    EPTEST_SETUP(20, 20, 20);
+    snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u*4,127.0.0.1:%u", pA->port, pB->port);
+    if(epTestWriteConfig(sEndpoints, 0) < 0 || epTestRun(uiUplinks, 0, NULL, true) < 0) { return 1; }
+    snprintf(sDetail, sizeof(sDetail), "A %u, B %u, failed %u", pA->received, pB->received, muiFailed);
+    bPass &= epTestCheck("weights", pA->received >= uiUplinks * 7 / 10 && muiOk == uiUplinks, sDetail);
+    EPTEST_TEARDOWN();
+
+    /* errors: the fast one answers 503 half the time */
+    EPTEST_SETUP(60, 10, 30);
+    pB->errorPermille = 500;
+    snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u,127.0.0.1:%u", pB->port, pC->port);
+    if(epTestWriteConfig(sEndpoints, 0) < 0 || epTestRun(uiUplinks, 0, NULL, true) < 0) { return 1; }
+    snprintf(sDetail, sizeof(sDetail), "B %u, C %u, failed %u", pB->received, pC->received, muiFailed);
+    bPass &= epTestCheck("errors", pC->received >= uiUplinks * 6 / 10 && muiFailed <= uiUplinks * 15 / 100 && muiMismatched == 0, sDetail);
+    EPTEST_TEARDOWN();
+
+    /* failover: the best one goes away halfway, reactor and blocking uplinks */
+    EPTEST_SETUP(60, 10, 30);
+    snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u,127.0.0.1:%u,127.0.0.1:%u", pA->port, pB->port, pC->port);
+    if(epTestWriteConfig(sEndpoints, 0) < 0 || epTestRun(uiUplinks, uiUplinks / 2, pB, true) < 0) { return 1; }
+    uiReceived[1] = pB->received;
+    uiBlockingOk = 0;
+    epTestQuiet(true);
+    for(i=0; i<EPTEST_BLOCKING; i+=1)
+    {
+        memset(&sRecord, 0, sizeof(sRecord));
+        sRecord.cmd.cmdCode = UPLSCHED_CMDCODE_ALARM;
+        sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+        memcpy(sRecord.cmd.payload, &i, sizeof(i));
+        sRecord.time = time(NULL);
+        uiBlockingOk += (commsSendUplink(&sRecord) >= 0 && memcmp(getCtrlDeckedReply()->payload, &i, sizeof(i)) == 0) ? 1 : 0;
+    }
+    epTestQuiet(false);
+    snprintf(sDetail, sizeof(sDetail), "A %u, B %u (down after %u), C %u, failed %u, blocking %u/%u ok", pA->received, uiReceived[1], uiUplinks / 2, pC->received, muiFailed, uiBlockingOk, EPTEST_BLOCKING);
+    bPass &= epTestCheck("failover", muiOk == uiUplinks && muiMismatched == 0 && uiBlockingOk == EPTEST_BLOCKING && pB->received == uiReceived[1], sDetail);
+    EPTEST_TEARDOWN();
+
+    /* hedging: occasional slow answers of the best endpoint, off and on */
+    for(i=0; i<2; i+=1)
+    {
+        EPTEST_SETUP(10, 60, 60);
+        pA->spikeEvery = 20;
+        pA->spikeMs = 300;
+        snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u,127.0.0.1:%u", pA->port, pB->port);
+        if(epTestWriteConfig(sEndpoints, (i == 0) ? 0 : 90) < 0 || epTestRun(uiUplinks, 0, NULL, true) < 0) { return 1; }
+        auiP50[i] = epTestPercentile(50);
+        auiP99[i] = epTestPercentile(99);
+        uiHedges = endpointsGet(1)->hedges + endpointsGet(0)->hedges;
+        snprintf(sDetail, sizeof(sDetail), "hedge_percentile %2u: p50 %u ms, p99 %u ms, %u hedged, A %u, B %u, failed %u", (i == 0) ? 0 : 90, auiP50[i], auiP99[i], uiHedges, pA->received, pB->received, muiFailed);
+        bPass &= epTestCheck("hedging", muiOk == uiUplinks && muiMismatched == 0 && (i == 0 || auiP99[1] * 2 < auiP99[0]), sDetail);
+        EPTEST_TEARDOWN();
+    }
+
+    /* reload: a new endpoint list through the SIGHUP path */
+    EPTEST_SETUP(10, 10, 30);
+    snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u,127.0.0.1:%u", pA->port, pB->port);
+    if(epTestWriteConfig(sEndpoints, 0) < 0 || epTestRun(uiUplinks / 2, 0, NULL, true) < 0) { return 1; }
+    snprintf(sEndpoints, sizeof(sEndpoints), "127.0.0.1:%u", pC->port);
+    epTestQuiet(true);
+    if(epTestWriteConfig(sEndpoints, 0) < 0 || configReloadStart(NULL) < 0)
+    {
+        epTestQuiet(false);
+        return 1;
+    }
+    for(i=0; i<200 && uiChanged == 0; i+=1)
+    {
+        usleep(10000);
+        uiChanged = configApplyPending();
+    }
+    commsApplyConfig(uiChanged);
+    epTestQuiet(false);
+    uiReceived[0] = pA->received;
+    uiReceived[1] = pB->received;
+    uiReceived[2] = pC->received;
+    if(epTestRun(uiUplinks / 2, 0, NULL, false) < 0) { return 1; }
+    snprintf(sDetail, sizeof(sDetail), "before A %u, B %u, C %u; after A %u, B %u, C %u, failed %u", uiReceived[0], uiReceived[1], uiReceived[2],
+        pA->received - uiReceived[0], pB->received - uiReceived[1], pC->received - uiReceived[2], muiFailed);
+    bPass &= epTestCheck("reload", (uiChanged & CONFIG_CHANGED_ENDPOINT) && pC->received - uiReceived[2] == uiUplinks / 2 && muiOk == uiUplinks / 2, sDetail);
+    EPTEST_TEARDOWN();
+
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+int epTestStart(tEpTestServer *pServer)
+{
+    pServer->port = 0;
+    if(epTestListen(pServer) < 0)
+    {
+        return -1;
+    }
+    pServer->running = true;
+    return pthread_create(&pServer->thread, NULL, epTestServer, pServer);
+}
+
+/********************** epTestListen ************************
+    Port 0: a new ephemeral port, else the server's port
+    again.
+************************************************************/
+int epTestListen(tEpTestServer *pServer)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+    int iEnable = 1;
+
+    pServer->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(pServer->listenFd, SOL_SOCKET, SO_REUSEADDR, &iEnable, sizeof(iEnable));
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(pServer->port);
+    if(pServer->listenFd < 0 || bind(pServer->listenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(pServer->listenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(pServer->listenFd, (struct sockaddr *)&sAddr, &uiLength);
+    pServer->port = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+void epTestStop(tEpTestServer *pServer)
+{
+    pServer->running = false;
+    pthread_join(pServer->thread, NULL);
+}
+
+/********************** epTestServer ************************
+    Accepts until stopped, a thread per connection. Down:
+    the listener is closed, connects are refused.
+************************************************************/
+void *epTestServer(void *pArg)
+{
+    tEpTestServer *pServer = (tEpTestServer *)pArg;
+    tEpTestConnection *pConnection;
+    struct pollfd sPoll;
+    pthread_t sThread;
+    int iFd;
+
+    while(pServer->running)
+    {
+        if(pServer->down)
+        {
+            if(pServer->listenFd >= 0)
+            {
+                close(pServer->listenFd);
+                pServer->listenFd = -1;
+            }
+            usleep(10000);
+            continue;
+        }
+        sPoll.fd = pServer->listenFd;
+        sPoll.events = POLLIN;
+        if(poll(&sPoll, 1, 20) <= 0)
+        {
+            continue;
+        }
+        iFd = accept(pServer->listenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pConnection = malloc(sizeof(tEpTestConnection));
+        pConnection->pServer = pServer;
+        pConnection->iFd = iFd;
+        if(pthread_create(&sThread, NULL, epTestConnection, pConnection) != 0)
+        {
+            close(iFd);
+            free(pConnection);
+            continue;
+        }
+        pthread_detach(sThread);
+    }
+    if(pServer->listenFd >= 0)
+    {
+        close(pServer->listenFd);
+        pServer->listenFd = -1;
+    }
+    return NULL;
+}
+
+/******************** epTestConnection **********************
+    One request per connection: waits the injected latency,
+    then answers with the echo or a 503.
+************************************************************/
+void *epTestConnection(void *pArg)
+{
+    tEpTestConnection *pConnection = (tEpTestConnection *)pArg;
+    tEpTestServer *pServer = pConnection->pServer;
+    int iFd = pConnection->iFd;
+    char sBuffer[EPTEST_BUFSIZE];
+    char sResponse[256];
+    char sData[9] = "00000000";
+    char *pData;
+    uint32_t uiNumber;
+    uint32_t uiDelayMs;
+    int iLength = 0;
+    int iResult;
+
+    free(pConnection);
+    sBuffer[0] = 0x00;
+    while(strstr(sBuffer, "\r\n\r\n") == NULL)
+    {
+        iResult = read(iFd, &sBuffer[iLength], sizeof(sBuffer) - 1 - iLength);
+        if(iResult <= 0)
+        {
+            close(iFd);
+            return NULL;
+        }
+        iLength += iResult;
+        sBuffer[iLength] = 0x00;
+    }
+    uiNumber = __atomic_add_fetch(&pServer->received, 1, __ATOMIC_RELAXED);
+    pData = strstr(sBuffer, "&data=");
+    if(pData != NULL)
+    {
+        memcpy(sData, pData + 6, 8);
+    }
+    uiDelayMs = pServer->latencyMs + ((pServer->spikeEvery > 0 && uiNumber % pServer->spikeEvery == 0) ? pServer->spikeMs : 0);
+    usleep(uiDelayMs * 1000);
+    if((uiNumber * 379) % 1000 < pServer->errorPermille)
+    {
+        iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+    }
+    else
+    {
+        iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACEndpointTest\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+    }
+    send(iFd, sResponse, iResult, MSG_NOSIGNAL);
+    close(iFd);
+    return NULL;
+}
+
+int epTestWriteConfig(const char *sEndpoints, uint32_t uiHedgePercentile)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = iot.example.com\nendpoints = %s\nhedge_percentile = %u\nuse_ssl = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n",
+        sEndpoints, uiHedgePercentile);
+    fclose(pFile);
+    return 0;
+}
+
+/*********************** epTestRun **************************
+    Sends uiUplinks uplinks, EPTEST_CONCURRENCY at a time.
+    pDown (may be NULL) stops accepting after uiDownAfter.
+    bLoadConfig: configInit() and commsInit() first, the new
+    ports of a phase are endpoints without history.
+************************************************************/
+int epTestRun(uint32_t uiUplinks, uint32_t uiDownAfter, tEpTestServer *pDown, bool bLoadConfig)
+{
+    uint32_t uiStarted = 0;
+    tUplinkRecord sRecord;
+
+    epTestQuiet(true);
+    if(bLoadConfig)
+    {
+        if(configInit(msConfigPath) < 0 || commsInit() < 0)
+        {
+            epTestQuiet(false);
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return -1;
+        }
+    }
+    muiDone = 0;
+    muiOk = 0;
+    muiFailed = 0;
+    muiMismatched = 0;
+    while(muiDone < uiUplinks)
+    {
+        if(pDown != NULL && muiDone >= uiDownAfter)
+        {
+            pDown->down = true;
+        }
+        while(uiStarted - muiDone < EPTEST_CONCURRENCY && uiStarted < uiUplinks && commsCanStartUplink())
+        {
+            memset(&sRecord, 0, sizeof(sRecord));
+            sRecord.cmd.cmdCode = UPLSCHED_CMDCODE_ALARM;
+            sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+            memcpy(sRecord.cmd.payload, &uiStarted, sizeof(uiStarted));
+            sRecord.time = time(NULL);
+            if(commsStartUplink(&sRecord, epTestDone) < 0)
+            {
+                break;
+            }
+            uiStarted += 1;
+        }
+        reactorRunOnce(100);
+    }
+    epTestQuiet(false);
+    return 0;
+}
+
+/*********************** epTestDone *************************
+    The downlink must be the echo of this uplink's payload.
+    Failed uplinks count as done, the test does not retry.
+************************************************************/
+void epTestDone(tUplinkRecord *pRecord, int iResult)
+{
+    if(muiDone < EPTEST_MAXUPLINKS)
+    {
+        mauiLatencyMs[muiDone] = (uint32_t)((printGetMonotonicTimeUs() - pRecord->sendStartUs) / 1000);
+    }
+    muiDone += 1;
+    if(iResult < 0)
+    {
+        muiFailed += 1;
+        return;
+    }
+    if(memcmp(getCtrlDeckedReply()->payload, pRecord->cmd.payload, sizeof(uint32_t)) != 0)
+    {
+        muiMismatched += 1;
+        return;
+    }
+    muiOk += 1;
+}
+
+/******************** epTestPercentile **********************
+    Of the uplink latencies of the last run.
+************************************************************/
+uint32_t epTestPercentile(uint32_t uiPercentile)
+{
+    static uint32_t auiSorted[EPTEST_MAXUPLINKS];
+    uint32_t uiCount = (muiDone < EPTEST_MAXUPLINKS) ? muiDone : EPTEST_MAXUPLINKS;
+    uint32_t uiValue;
+    uint32_t i;
+    uint32_t j;
+
+    for(i=0; i<uiCount; i+=1)
+    {
+        uiValue = mauiLatencyMs[i];
+        for(j=i; j>0 && auiSorted[j - 1] > uiValue; j-=1)
+        {
+            auiSorted[j] = auiSorted[j - 1];
+        }
+        auiSorted[j] = uiValue;
+    }
+    return (uiCount == 0) ? 0 : auiSorted[(uiCount * uiPercentile + 99) / 100 - 1];
+}
+
+bool epTestCheck(const char *sPhase, bool bPass, const char *sDetail)
+{
+    fprintf(stderr, "%-10s %-4s %s\n", sPhase, bPass ? "ok" : "FAIL", sDetail);
+    return bPass;
+}
+
+void epTestQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
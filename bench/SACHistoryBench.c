@@ -0,0 +1,479 @@
+/*
+    Uplink history, run with "make historybench".
+
+    A ring the size of a year at one uplink per minute is
+    filled with simulated records (one minute apart, now and
+    then a clock that steps back) and wrapped by another
+    third, so the oldest record sits in the middle of a
+    block. Meanwhile a reader thread attached like
+    SACHistoryQuery copies random records: it may drop one
+    the writer reached again, it must never get a record
+    that differs from the one written under its number.
+    Then:
+        insert:  ns per historyWrite() and the slowest one,
+                 historyPoll() stores them every
+                 HISTORYBENCH_TICKRECS like the daemon's
+                 housekeeping, its slowest store;
+        query:   historyFind() plus reading a 1 h and a 24 h
+                 range from random points of the year, with
+                 the file in the page cache (warm) and after
+                 dropping it (cold, a fresh mapping per query);
+                 every range must hold exactly the records of
+                 its time span;
+        reopen:  historyOpen() of the same file keeps the ring;
+        latency: HISTORYBENCH_LATENCYRECS more inserts on the
+                 reopened ring without the reader, each timed:
+                 how many blocked (a voluntary context switch,
+                 the disk) and the slowest one that was not
+                 preempted (one CPU: the scheduler's, not ours).
+
+    Usage:
+        SACHistoryBench [-n records] [-q queries] [-f file]
+    Exit code 1 when a record or range is wrong, the ring is
+    not kept, the disk usage is not what the layout says, an
+    insert blocked or took over HISTORYBENCH_INSERTUS: the
+    uplink path must not wait for the disk.
+*/
+
+#define _GNU_SOURCE /* posix_fadvise */
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memset */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h> /* getrusage */
+
+#include "SACHistory.h"
+#include "SACPrintUtils.h"
+
+#define HISTORYBENCH_PATH       "/tmp/SACHistoryBench.history"
+#define HISTORYBENCH_RECORDS    525600 // a year at one per minute
+#define HISTORYBENCH_QUERIES    1000 // per range, warm
+#define HISTORYBENCH_COLD       50 // per range, cold
+#define HISTORYBENCH_STEPMS     60000ULL
+#define HISTORYBENCH_BACKSTEP   100000 // every nth record comes from a clock two minutes behind
+#define HISTORYBENCH_STARTMS    1735689600000ULL // 2025-01-01
+#define HISTORYBENCH_TICKRECS   (HISTORY_PENDINGRECORDS / 2) // inserts between two housekeeping ticks
+#define HISTORYBENCH_INSERTUS   1000 // slowest historyWrite() that was not preempted: a copy into memory, a disk wait takes milliseconds
+#define HISTORYBENCH_LATENCYRECS 100000
+
+/****************** private function prototypes *********************/
+void historyBenchRecord(uint64_t n, tHistoryRecord *pRecord);
+uint64_t historyBenchUnixMs(uint64_t n);
+bool historyBenchSame(const tHistoryRecord *pA, const tHistoryRecord *pB);
+void *historyBenchReader(void *pArg);
+int historyBenchQuery(const tHistoryView *pView, uint64_t ulFromMs, uint64_t ulToMs, uint64_t *pFirst, uint32_t *pUs);
+bool historyBenchRange(const char *sName, uint64_t ulSpanMs, uint32_t uiQueries, bool bCold);
+bool historyBenchLatency(uint64_t ulFirst);
+uint32_t historyBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent);
+int historyBenchCompare(const void *pA, const void *pB);
+void historyBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static const char *msPath = HISTORYBENCH_PATH;
+static volatile bool mbWriting = true;
+static uint64_t mulReaderRead = 0;
+static uint64_t mulReaderDropped = 0;
+static uint64_t mulReaderWrong = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    uint32_t uiRecords = HISTORYBENCH_RECORDS;
+    uint32_t uiQueries = HISTORYBENCH_QUERIES;
+    uint64_t ulWrites;
+    uint64_t ulStartUs;
+    uint64_t ulUs;
+    uint64_t n;
+    tHistoryRecord sRecord;
+    tHistoryView sView;
+    pthread_t sThread;
+    struct stat sStat;
+    bool bPass = true;
+    int iResult;
+    int iOption;
+
+    while((iOption = getopt(argc, argv, "n:q:f:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiRecords = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'q': uiQueries = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'f': msPath = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n records] [-q queries] [-f file]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiRecords < HISTORY_MINRECORDS || uiRecords > HISTORY_MAXRECORDS || uiQueries == 0)
+    {
+        fprintf(stderr, "Need %u..%u records and at least one query.\n", HISTORY_MINRECORDS, HISTORY_MAXRECORDS);
+        return 2;
+    }
+    unlink(msPath);
+
+    historyBenchQuiet(true);
+    iResult = historyOpen(msPath, uiRecords);
+    historyBenchQuiet(false);
+    if(iResult != 1 || stat(msPath, &sStat) < 0)
+    {
+        fprintf(stderr, "Could not create %s.\n", msPath);
+        return 2;
+    }
+    fprintf(stderr, "ring of %u records (%u asked), %llu bytes, %llu on disk\n", historyStats()->capacity, uiRecords,
+        (unsigned long long)sStat.st_size, (unsigned long long)sStat.st_blocks * 512ULL);
+    bPass = bPass && (uint64_t)sStat.st_blocks * 512ULL >= (uint64_t)sStat.st_size;
+
+    // insert, wrapped by a third, with a reader next to the writer
+    ulWrites = historyStats()->capacity + historyStats()->capacity / 3 + HISTORY_BLOCKRECORDS / 2;
+    pthread_create(&sThread, NULL, historyBenchReader, NULL);
+    ulStartUs = printGetMonotonicTimeUs();
+    for(n=0; n<ulWrites; n+=1)
+    {
+        historyBenchRecord(n, &sRecord);
+        historyWrite(&sRecord);
+        if(n % HISTORYBENCH_TICKRECS == 0)
+        {
+            historyPoll(); // the daemon's housekeeping
+        }
+    }
+    historyPoll();
+    ulUs = printGetMonotonicTimeUs() - ulStartUs;
+    mbWriting = false;
+    pthread_join(sThread, NULL);
+    fprintf(stderr, "insert %llu records: %.1f ns per record (%.0f records/s), slowest %u us, slowest store %u us, %llu clock back steps\n",
+        (unsigned long long)ulWrites, ulUs * 1000.0 / ulWrites, ulWrites * 1000000.0 / (ulUs > 0 ? ulUs : 1),
+        historyStats()->maxAppendUs, historyStats()->maxStoreUs, (unsigned long long)historyStats()->clockBacksteps);
+    fprintf(stderr, "reader next to the writer: %llu records read, %llu dropped, %llu wrong\n",
+        (unsigned long long)mulReaderRead, (unsigned long long)mulReaderDropped, (unsigned long long)mulReaderWrong);
+    bPass = bPass && mulReaderWrong == 0 && mulReaderRead > 0 && historyStats()->clockBacksteps == (ulWrites - 1) / HISTORYBENCH_BACKSTEP;
+
+    // the whole ring, record by record
+    if(historyAttach(msPath, &sView) < 0)
+    {
+        fprintf(stderr, "Could not attach %s.\n", msPath);
+        return 2;
+    }
+    for(n=historyOldest(&sView), iResult=0; n<historyCount(&sView); n+=1)
+    {
+        tHistoryRecord sExpected;
+        historyBenchRecord(n, &sExpected);
+        if(!historyRead(&sView, n, &sRecord) || !historyBenchSame(&sRecord, &sExpected))
+        {
+            iResult += 1;
+        }
+    }
+    fprintf(stderr, "ring check: records %llu..%llu, %i wrong\n", (unsigned long long)historyOldest(&sView), (unsigned long long)historyCount(&sView) - 1, iResult);
+    bPass = bPass && iResult == 0 && historyCount(&sView) == ulWrites;
+    historyDetach(&sView);
+
+    fprintf(stderr, "%-10s %8s %10s %10s %10s %10s\n", "range", "queries", "records", "p50", "p99", "max");
+    bPass = historyBenchRange("1 h", 3600ULL * 1000ULL, uiQueries, false) && bPass;
+    bPass = historyBenchRange("24 h", 24ULL * 3600ULL * 1000ULL, uiQueries, false) && bPass;
+    historyBenchQuiet(true);
+    historyClose(); // msync, the cold queries drop clean pages only
+    historyBenchQuiet(false);
+    bPass = historyBenchRange("1 h cold", 3600ULL * 1000ULL, HISTORYBENCH_COLD, true) && bPass;
+    bPass = historyBenchRange("24 h cold", 24ULL * 3600ULL * 1000ULL, HISTORYBENCH_COLD, true) && bPass;
+
+    historyBenchQuiet(true);
+    iResult = historyOpen(msPath, uiRecords);
+    historyBenchQuiet(false);
+    fprintf(stderr, "reopen: %s, %llu records written in total\n", (iResult == 0) ? "ring kept" : "started over", (unsigned long long)historyStats()->count);
+    bPass = bPass && iResult == 0 && historyStats()->count == ulWrites;
+    bPass = historyBenchLatency(ulWrites) && bPass;
+    historyBenchQuiet(true);
+    historyClose();
+    historyBenchQuiet(false);
+
+    unlink(msPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/******************** historyBenchRecord ********************
+    Record number n as the bench writes it, unixMs as
+    historyPoll() stores it.
+************************************************************/
+void historyBenchRecord(uint64_t n, tHistoryRecord *pRecord)
+{
+    int i;
+
+    memset(pRecord, 0, sizeof(tHistoryRecord));
+    pRecord->unixMs = HISTORYBENCH_STARTMS + n * HISTORYBENCH_STEPMS;
+    if(n > 0 && n % HISTORYBENCH_BACKSTEP == 0)
+    {
+        pRecord->unixMs -= 2 * HISTORYBENCH_STEPMS; // the store clamps it to the record before
+    }
+    pRecord->eventTime = (uint32_t)(pRecord->unixMs / 1000);
+    pRecord->seqNr = (uint32_t)n;
+    pRecord->latencyUs = (uint32_t)(n % 250000);
+    pRecord->errorCode = (n % 97 == 0) ? -3 : 0;
+    pRecord->cmdCode = (uint8_t)(n % 7);
+    pRecord->uplinkSize = STRUCTS_SENDCMDPAYLOADSIZE;
+    for(i=0; i<STRUCTS_SENDCMDPAYLOADSIZE; i+=1)
+    {
+        pRecord->uplink[i] = (uint8_t)(n >> (i % 8));
+    }
+    if(pRecord->errorCode == 0)
+    {
+        pRecord->flags = HISTORY_FLAG_DOWNLINK;
+        for(i=0; i<STRUCTS_DECKEDREPLYPAYLOADSIZE; i+=1)
+        {
+            pRecord->downlink[i] = (uint8_t)(n * 31 + i);
+        }
+    }
+}
+
+uint64_t historyBenchUnixMs(uint64_t n)
+{
+    if(n > 0 && n % HISTORYBENCH_BACKSTEP == 0)
+    {
+        n -= 1;
+    }
+    return HISTORYBENCH_STARTMS + n * HISTORYBENCH_STEPMS;
+}
+
+bool historyBenchSame(const tHistoryRecord *pA, const tHistoryRecord *pB)
+{
+    return pA->unixMs == historyBenchUnixMs(pB->seqNr) && pA->seqNr == pB->seqNr && pA->latencyUs == pB->latencyUs && pA->errorCode == pB->errorCode &&
+        pA->flags == pB->flags && memcmp(pA->uplink, pB->uplink, sizeof(pA->uplink)) == 0 && memcmp(pA->downlink, pB->downlink, sizeof(pA->downlink)) == 0;
+}
+
+/******************* historyBenchReader *********************
+    Random records of the ring while the writer runs, from
+    its own read only mapping.
+************************************************************/
+void *historyBenchReader(void *pArg)
+{
+    tHistoryView sView;
+    tHistoryRecord sRecord;
+    tHistoryRecord sExpected;
+    uint64_t ulOldest;
+    uint64_t ulCount;
+    uint64_t n;
+    uint32_t uiSeed = 1;
+
+    if(historyAttach(msPath, &sView) < 0)
+    {
+        return NULL;
+    }
+    while(mbWriting)
+    {
+        ulCount = historyCount(&sView);
+        ulOldest = historyOldest(&sView);
+        if(ulCount == ulOldest)
+        {
+            continue;
+        }
+        // mostly the oldest records, the slots the writer is about to reach
+        n = (rand_r(&uiSeed) % 2 == 0) ? ulOldest + rand_r(&uiSeed) % 64 : ulOldest + rand_r(&uiSeed) % (ulCount - ulOldest);
+        if(!historyRead(&sView, n, &sRecord))
+        {
+            mulReaderDropped += 1;
+            continue;
+        }
+        historyBenchRecord(n, &sExpected);
+        mulReaderRead += 1;
+        if(!historyBenchSame(&sRecord, &sExpected) || sRecord.seqNr != (uint32_t)n)
+        {
+            mulReaderWrong += 1;
+        }
+    }
+    historyDetach(&sView);
+    return NULL;
+}
+
+/******************** historyBenchQuery *********************
+    Like SACHistoryQuery -s -e: historyFind(), then the
+    records up to ulToMs. Returns the number of records,
+    -1 when one is missing.
+************************************************************/
+int historyBenchQuery(const tHistoryView *pView, uint64_t ulFromMs, uint64_t ulToMs, uint64_t *pFirst, uint32_t *pUs)
+{
+    tHistoryRecord sRecord;
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    uint64_t n;
+    int iRecords = 0;
+
+    *pUs = 0;
+    *pFirst = historyFind(pView, ulFromMs);
+    for(n=*pFirst; n<historyCount(pView); n+=1)
+    {
+        if(!historyRead(pView, n, &sRecord))
+        {
+            return -1;
+        }
+        if(sRecord.unixMs > ulToMs)
+        {
+            break;
+        }
+        iRecords += 1;
+    }
+    *pUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    return iRecords;
+}
+
+/******************** historyBenchRange *********************
+    uiQueries ranges of ulSpanMs from random points, checked
+    against the records the bench wrote: the first one found
+    is the first at or after the start, the count is what
+    the span holds.
+************************************************************/
+bool historyBenchRange(const char *sName, uint64_t ulSpanMs, uint32_t uiQueries, bool bCold)
+{
+    uint32_t *auiUs = malloc(uiQueries * sizeof(uint32_t));
+    tHistoryView sView;
+    uint64_t ulOldestMs;
+    uint64_t ulNewestMs;
+    uint64_t ulFromMs;
+    uint64_t ulFirst;
+    uint64_t ulExpected;
+    uint64_t ulRecords = 0;
+    uint32_t uiWrong = 0;
+    uint32_t uiMax = 0;
+    uint32_t i;
+    int iFd = open(msPath, O_RDONLY);
+    int iRecords;
+
+    if(auiUs == NULL || iFd < 0 || historyAttach(msPath, &sView) < 0)
+    {
+        fprintf(stderr, "%-10s could not attach %s\n", sName, msPath);
+        free(auiUs);
+        if(iFd >= 0)
+        {
+            close(iFd);
+        }
+        return false;
+    }
+    ulOldestMs = historyBenchUnixMs(historyOldest(&sView));
+    ulNewestMs = historyBenchUnixMs(historyCount(&sView) - 1);
+    for(i=0; i<uiQueries; i+=1)
+    {
+        ulFromMs = ulOldestMs + ((uint64_t)rand() * 1000ULL + (uint64_t)rand() % 1000ULL) % (ulNewestMs - ulOldestMs);
+        if(bCold)
+        {
+            historyDetach(&sView);
+            posix_fadvise(iFd, 0, 0, POSIX_FADV_DONTNEED);
+            historyAttach(msPath, &sView);
+        }
+        iRecords = historyBenchQuery(&sView, ulFromMs, ulFromMs + ulSpanMs, &ulFirst, &auiUs[i]);
+        // the records are one minute apart, the clamped ones share the time of the record before
+        ulExpected = 0;
+        if(iRecords >= 0 && ulFirst < historyCount(&sView))
+        {
+            uint64_t n;
+            for(n=ulFirst; n<historyCount(&sView) && historyBenchUnixMs(n) <= ulFromMs + ulSpanMs; n+=1)
+            {
+                ulExpected += 1;
+            }
+        }
+        if(iRecords < 0 || (uint64_t)iRecords != ulExpected || historyBenchUnixMs(ulFirst) < ulFromMs ||
+            (ulFirst > historyOldest(&sView) && historyBenchUnixMs(ulFirst - 1) >= ulFromMs))
+        {
+            uiWrong += 1;
+            continue;
+        }
+        ulRecords += iRecords;
+        uiMax = (auiUs[i] > uiMax) ? auiUs[i] : uiMax;
+    }
+    fprintf(stderr, "%-10s %8u %10.1f %7u us %7u us %7u us%s\n", sName, uiQueries, (double)ulRecords / uiQueries,
+        historyBenchPercentile(auiUs, uiQueries, 50), historyBenchPercentile(auiUs, uiQueries, 99), uiMax,
+        (uiWrong > 0) ? "  WRONG RANGES" : "");
+    historyDetach(&sView);
+    close(iFd);
+    free(auiUs);
+    return uiWrong == 0;
+}
+
+/******************* historyBenchLatency ********************
+    HISTORYBENCH_LATENCYRECS inserts from record ulFirst on,
+    historyPoll() every HISTORYBENCH_TICKRECS like the
+    housekeeping. The thread's context switches around each
+    insert tell a wait (voluntary, the disk) from a
+    preemption (involuntary, the other processes).
+************************************************************/
+bool historyBenchLatency(uint64_t ulFirst)
+{
+    struct rusage sBefore;
+    struct rusage sAfter;
+    tHistoryRecord sRecord;
+    uint64_t ulStartUs;
+    uint32_t uiUs;
+    uint32_t uiMaxUs = 0;
+    uint32_t uiBlocked = 0;
+    uint32_t uiPreempted = 0;
+    uint32_t i;
+
+    for(i=0; i<HISTORYBENCH_LATENCYRECS; i+=1)
+    {
+        historyBenchRecord(ulFirst + i, &sRecord);
+        getrusage(RUSAGE_THREAD, &sBefore);
+        ulStartUs = printGetMonotonicTimeUs();
+        historyWrite(&sRecord);
+        uiUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+        getrusage(RUSAGE_THREAD, &sAfter);
+        if(sAfter.ru_nvcsw != sBefore.ru_nvcsw || sAfter.ru_majflt != sBefore.ru_majflt)
+        {
+            uiBlocked += 1;
+        }
+        if(sAfter.ru_nivcsw != sBefore.ru_nivcsw)
+        {
+            uiPreempted += 1;
+        }
+        else if(uiUs > uiMaxUs)
+        {
+            uiMaxUs = uiUs;
+        }
+        if(i % HISTORYBENCH_TICKRECS == 0)
+        {
+            historyPoll();
+        }
+    }
+    historyPoll();
+    fprintf(stderr, "latency: %u inserts, slowest %u us (bound %u us), %u blocked, %u preempted, slowest store %u us\n",
+        HISTORYBENCH_LATENCYRECS, uiMaxUs, HISTORYBENCH_INSERTUS, uiBlocked, uiPreempted, historyStats()->maxStoreUs);
+    return uiBlocked == 0 && uiMaxUs <= HISTORYBENCH_INSERTUS;
+}
+
+uint32_t historyBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent)
+{
+    if(uiCount == 0)
+    {
+        return 0;
+    }
+    qsort(auiSamples, uiCount, sizeof(uint32_t), historyBenchCompare);
+    return auiSamples[(uiCount - 1) * uiPercent / 100];
+}
+
+int historyBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void historyBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,506 @@
+/*
+    Kernel TLS offload, run with "make ktlsbench".
+
+    A local TLS server thread stands in for the webhook on
+    loopback (self-signed P-256 certificate, the daemon does
+    not verify it). The blocking http path of the daemon
+    sends
+        - N uplinks (commsSendUplink(), a connection each,
+          resumed sessions after the first);
+        - N bulk blocks of 3 kB incompressible data
+          (commsSendBulk(), a connection each);
+    once with [comms] ktls = no and once with ktls = yes.
+    Per run: CPU time of the sending thread per uplink and
+    per block (CLOCK_THREAD_CPUTIME_ID, kernel time included,
+    that is where the offloaded crypto runs), CPU cycles when
+    perf_event_open() may count the kernel as well
+    (kernel.perf_event_paranoid <= 1), bulk throughput and
+    how many connections the kernel took over.
+    Without the tls kernel module (or an OpenSSL without
+    ktls) the ktls run falls back to user space: it must
+    still deliver everything, the numbers are then the same
+    as without.
+
+    Usage:
+        SACKtlsBench [-n uplinks] [-b blocks] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+
+#define KTLSBENCH_UPLINKS       2000
+#define KTLSBENCH_BLOCKS        2000
+#define KTLSBENCH_BLOCKSIZE     3072 // a bulk block, fits HTTPMSGMAXSIZE with the request line
+#define KTLSBENCH_BLOCKRECORDS  128
+#define KTLSBENCH_BUFSIZE       (HTTPMSGMAXSIZE * 2)
+
+typedef struct
+{
+    const char *name;
+    bool ktls;
+    uint32_t uplinksOk;
+    uint32_t blocksOk;
+    double uplinkCpuUs; // per uplink
+    double uplinkCycles; // per uplink, < 0: not available
+    double blockCpuUs; // per block
+    double blockCycles;
+    double bulkMBps; // block payload, wall clock
+    tHttpKtlsStats ktlsStats; // this run only
+} tKtlsBenchRun;
+
+/****************** private function prototypes *********************/
+int ktlsBenchListen();
+int ktlsBenchServerContext();
+void *ktlsBenchServer(void *pArg);
+void *ktlsBenchConnection(void *pArg);
+int ktlsBenchReadRequest(SSL *pSsl, char *sBuffer, int *pBuffered, int *pHeaderLength);
+int ktlsBenchWriteConfig(bool bKtls);
+int ktlsBenchRun(tKtlsBenchRun *pRun, uint32_t uiUplinks, uint32_t uiBlocks);
+int ktlsBenchCyclesOpen();
+int64_t ktlsBenchCycles(int iFd);
+uint64_t ktlsBenchCpuUs();
+void ktlsBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static int miListenFd = -1;
+static uint16_t muiPort = 0;
+static SSL_CTX *mpServerContext = NULL;
+static uint64_t mulServerBodyBytes = 0; // bulk payload received, all connections
+static pthread_mutex_t msServerLock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t mabBlock[KTLSBENCH_BLOCKSIZE];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    tKtlsBenchRun asRuns[] =
+    {
+        {.name = "user space"},
+        {.name = "ktls", .ktls = true},
+    };
+    uint32_t uiUplinks = KTLSBENCH_UPLINKS;
+    uint32_t uiBlocks = KTLSBENCH_BLOCKS;
+    pthread_t sThread;
+    bool bPass = true;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "n:b:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiUplinks = atoi(optarg); break;
+            case 'b': uiBlocks = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n uplinks] [-b blocks] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACKtlsBench.%i.conf", sDir, (int)getpid());
+    if(ktlsBenchServerContext() < 0 || ktlsBenchListen() < 0)
+    {
+        fprintf(stderr, "Could not open the local TLS server.\n");
+        return 2;
+    }
+    for(i=0; i<KTLSBENCH_BLOCKSIZE; i+=1)
+    {
+        mabBlock[i] = (uint8_t)(rand() >> 7); // already compressed data doesn't shrink
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, ktlsBenchServer, NULL);
+
+    ktlsBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    sslInit();
+    ktlsBenchQuiet(false);
+
+    fprintf(stderr, "%u uplinks, %u bulk blocks of %u bytes, TLS on loopback, a connection per request\n", uiUplinks, uiBlocks, KTLSBENCH_BLOCKSIZE);
+    fprintf(stderr, "%-12s %9s %11s %9s %11s %9s %9s %9s %9s\n", "run", "us/uplink", "cyc/uplink", "us/block", "cyc/block", "bulk MB/s", "ktls tx", "ktls rx", "fallback");
+    for(i=0; i<(int)(sizeof(asRuns) / sizeof(asRuns[0])); i+=1)
+    {
+        tKtlsBenchRun *pRun = &asRuns[i];
+        char sUplinkCycles[16] = "-";
+        char sBlockCycles[16] = "-";
+        if(ktlsBenchRun(pRun, uiUplinks, uiBlocks) < 0)
+        {
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return 1;
+        }
+        if(pRun->uplinkCycles >= 0)
+        {
+            snprintf(sUplinkCycles, sizeof(sUplinkCycles), "%.0f", pRun->uplinkCycles);
+            snprintf(sBlockCycles, sizeof(sBlockCycles), "%.0f", pRun->blockCycles);
+        }
+        fprintf(stderr, "%-12s %9.1f %11s %9.1f %11s %9.2f %9llu %9llu %9llu\n", pRun->name, pRun->uplinkCpuUs, sUplinkCycles, pRun->blockCpuUs, sBlockCycles, pRun->bulkMBps,
+            (unsigned long long)pRun->ktlsStats.txOffloaded, (unsigned long long)pRun->ktlsStats.rxOffloaded, (unsigned long long)pRun->ktlsStats.fallbacks);
+        bPass = bPass && pRun->uplinksOk == uiUplinks && pRun->blocksOk == uiBlocks;
+        bPass = bPass && pRun->ktlsStats.connections == (pRun->ktls ? uiUplinks + uiBlocks : 0);
+    }
+    if(asRuns[1].ktlsStats.txOffloaded == 0)
+    {
+        fprintf(stderr, "kernel TLS not available here (tls module, OpenSSL built with ktls), the ktls run fell back to user space\n");
+    }
+    else
+    {
+        fprintf(stderr, "ktls: %.2fx CPU per uplink, %.2fx CPU per block, %.2fx bulk throughput\n", asRuns[1].uplinkCpuUs / asRuns[0].uplinkCpuUs, asRuns[1].blockCpuUs / asRuns[0].blockCpuUs, asRuns[1].bulkMBps / asRuns[0].bulkMBps);
+    }
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+int ktlsBenchListen()
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    miListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(miListenFd < 0 || bind(miListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(miListenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(miListenFd, (struct sockaddr *)&sAddr, &uiLength);
+    muiPort = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/**************** ktlsBenchServerContext ********************
+    Self-signed P-256 certificate made up on the spot.
+************************************************************/
+int ktlsBenchServerContext()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+void *ktlsBenchServer(void *pArg)
+{
+    pthread_t sThread;
+    int *pFd;
+
+    while(1)
+    {
+        pFd = malloc(sizeof(int));
+        *pFd = accept(miListenFd, NULL, NULL);
+        if(*pFd < 0)
+        {
+            free(pFd);
+            continue;
+        }
+        pthread_create(&sThread, NULL, ktlsBenchConnection, pFd);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/****************** ktlsBenchConnection *********************
+    Answers right away: an uplink gets its first 4 payload
+    bytes back as the downlink, a bulk block is stored
+    completely.
+************************************************************/
+void *ktlsBenchConnection(void *pArg)
+{
+    int iFd = *(int *)pArg;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[KTLSBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9] = "00000000";
+    SSL *pSsl;
+    char *pValue;
+    int iBuffered = 0;
+    int iHeaderLength;
+    int iLength;
+    int iResponse;
+    uint32_t uiRecords;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while((iLength = ktlsBenchReadRequest(pSsl, sBuffer, &iBuffered, &iHeaderLength)) > 0)
+    {
+        if(strncmp(sBuffer, "POST ", 5) == 0)
+        {
+            pValue = strstr(sBuffer, "&bulk=");
+            uiRecords = (pValue != NULL && pValue < &sBuffer[iHeaderLength]) ? (uint32_t)atoi(pValue + 6) : 0;
+            pthread_mutex_lock(&msServerLock);
+            mulServerBodyBytes += iLength - iHeaderLength;
+            pthread_mutex_unlock(&msServerLock);
+            iResponse = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACKtlsBench\r\nContent-Length: %i\r\n\r\nstored=%u\r\n", (int)snprintf(NULL, 0, "stored=%u\r\n", uiRecords), uiRecords);
+        }
+        else
+        {
+            pValue = strstr(sBuffer, "&data=");
+            if(pValue != NULL && pValue < &sBuffer[iHeaderLength])
+            {
+                memcpy(sData, pValue + 6, 8);
+            }
+            iResponse = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACKtlsBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+        }
+        if(SSL_write(pSsl, sResponse, iResponse) != iResponse)
+        {
+            break;
+        }
+        memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength);
+        iBuffered -= iLength;
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/***************** ktlsBenchReadRequest *********************
+    Returns the length of the first complete request in
+    sBuffer, header and body, or -1.
+************************************************************/
+int ktlsBenchReadRequest(SSL *pSsl, char *sBuffer, int *pBuffered, int *pHeaderLength)
+{
+    char *pEnd;
+    char *pContentLength;
+    int iTotal;
+    int iResult;
+
+    while(1)
+    {
+        sBuffer[*pBuffered] = 0x00;
+        pEnd = strstr(sBuffer, "\r\n\r\n");
+        if(pEnd != NULL)
+        {
+            *pHeaderLength = (pEnd - sBuffer) + 4;
+            pContentLength = strstr(sBuffer, "Content-Length: ");
+            iTotal = *pHeaderLength + ((pContentLength != NULL && pContentLength < pEnd) ? atoi(pContentLength + 16) : 0);
+            if(*pBuffered >= iTotal)
+            {
+                return iTotal;
+            }
+        }
+        if(*pBuffered >= KTLSBENCH_BUFSIZE - 1)
+        {
+            return -1;
+        }
+        iResult = SSL_read(pSsl, &sBuffer[*pBuffered], KTLSBENCH_BUFSIZE - 1 - *pBuffered);
+        if(iResult <= 0)
+        {
+            return -1;
+        }
+        *pBuffered += iResult;
+    }
+}
+
+int ktlsBenchWriteConfig(bool bKtls)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = yes\nktls = %s\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n",
+        muiPort, bKtls ? "yes" : "no");
+    fclose(pFile);
+    return 0;
+}
+
+/********************** ktlsBenchRun ************************
+    The uplinks, then the blocks, timed on this thread.
+************************************************************/
+int ktlsBenchRun(tKtlsBenchRun *pRun, uint32_t uiUplinks, uint32_t uiBlocks)
+{
+    tHttpKtlsStats sBefore;
+    tUplinkRecord sRecord;
+    uint32_t uiStored;
+    uint64_t ulBodyBefore;
+    uint64_t ulCpuUs;
+    uint64_t ulStartUs;
+    int64_t lCycles;
+    int iCyclesFd;
+    uint32_t i;
+
+    ktlsBenchQuiet(true);
+    if(ktlsBenchWriteConfig(pRun->ktls) < 0 || configInit(msConfigPath) < 0 || commsInit() < 0)
+    {
+        ktlsBenchQuiet(false);
+        return -1;
+    }
+    sBefore = *httpKtlsStats();
+    iCyclesFd = ktlsBenchCyclesOpen();
+
+    lCycles = ktlsBenchCycles(iCyclesFd);
+    ulCpuUs = ktlsBenchCpuUs();
+    for(i=0; i<uiUplinks; i+=1)
+    {
+        memset(&sRecord, 0, sizeof(sRecord));
+        sRecord.cmd.cmdCode = UPLSCHED_CMDCODE_ALARM; // no early data, a full request per connection
+        sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+        memcpy(sRecord.cmd.payload, &i, sizeof(i));
+        sRecord.time = time(NULL);
+        if(commsSendUplink(&sRecord) >= 0 && memcmp(getCtrlDeckedReply()->payload, &i, sizeof(i)) == 0)
+        {
+            pRun->uplinksOk += 1;
+        }
+    }
+    pRun->uplinkCpuUs = (double)(ktlsBenchCpuUs() - ulCpuUs) / ((uiUplinks > 0) ? uiUplinks : 1);
+    pRun->uplinkCycles = (lCycles >= 0) ? (double)(ktlsBenchCycles(iCyclesFd) - lCycles) / ((uiUplinks > 0) ? uiUplinks : 1) : -1;
+
+    pthread_mutex_lock(&msServerLock);
+    ulBodyBefore = mulServerBodyBytes;
+    pthread_mutex_unlock(&msServerLock);
+    lCycles = ktlsBenchCycles(iCyclesFd);
+    ulCpuUs = ktlsBenchCpuUs();
+    ulStartUs = printGetMonotonicTimeUs();
+    for(i=0; i<uiBlocks; i+=1)
+    {
+        uiStored = 0;
+        if(commsSendBulk(mabBlock, KTLSBENCH_BLOCKSIZE, KTLSBENCH_BLOCKRECORDS, &uiStored) >= 0 && uiStored == KTLSBENCH_BLOCKRECORDS)
+        {
+            pRun->blocksOk += 1;
+        }
+    }
+    pRun->bulkMBps = (double)uiBlocks * KTLSBENCH_BLOCKSIZE / (printGetMonotonicTimeUs() - ulStartUs + 1);
+    pRun->blockCpuUs = (double)(ktlsBenchCpuUs() - ulCpuUs) / ((uiBlocks > 0) ? uiBlocks : 1);
+    pRun->blockCycles = (lCycles >= 0) ? (double)(ktlsBenchCycles(iCyclesFd) - lCycles) / ((uiBlocks > 0) ? uiBlocks : 1) : -1;
+    pthread_mutex_lock(&msServerLock);
+    if(mulServerBodyBytes - ulBodyBefore != (uint64_t)pRun->blocksOk * KTLSBENCH_BLOCKSIZE)
+    {
+        pRun->blocksOk = 0; // the server didn't get what was sent
+    }
+    pthread_mutex_unlock(&msServerLock);
+
+    pRun->ktlsStats.connections = httpKtlsStats()->connections - sBefore.connections;
+    pRun->ktlsStats.txOffloaded = httpKtlsStats()->txOffloaded - sBefore.txOffloaded;
+    pRun->ktlsStats.rxOffloaded = httpKtlsStats()->rxOffloaded - sBefore.rxOffloaded;
+    pRun->ktlsStats.fallbacks = httpKtlsStats()->fallbacks - sBefore.fallbacks;
+    if(iCyclesFd >= 0)
+    {
+        close(iCyclesFd);
+    }
+    commsClose();
+    ktlsBenchQuiet(false);
+    return 0;
+}
+
+/****************** ktlsBenchCyclesOpen *********************
+    CPU cycles of this thread, kernel included: the offloaded
+    record crypto runs in send()/recv(). -1 when the kernel
+    doesn't let us count them.
+************************************************************/
+int ktlsBenchCyclesOpen()
+{
+    struct perf_event_attr sAttr;
+    int iFd;
+
+    memset(&sAttr, 0, sizeof(sAttr));
+    sAttr.type = PERF_TYPE_HARDWARE;
+    sAttr.size = sizeof(sAttr);
+    sAttr.config = PERF_COUNT_HW_CPU_CYCLES;
+    sAttr.exclude_hv = 1;
+    iFd = (int)syscall(SYS_perf_event_open, &sAttr, 0, -1, -1, 0);
+    if(iFd >= 0)
+    {
+        ioctl(iFd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    return iFd;
+}
+
+int64_t ktlsBenchCycles(int iFd)
+{
+    int64_t lCycles;
+
+    if(iFd < 0 || read(iFd, &lCycles, sizeof(lCycles)) != sizeof(lCycles))
+    {
+        return -1;
+    }
+    return lCycles;
+}
+
+uint64_t ktlsBenchCpuUs()
+{
+    struct timespec sTime;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &sTime);
+    return (uint64_t)sTime.tv_sec * 1000000 + sTime.tv_nsec / 1000;
+}
+
+void ktlsBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,554 @@
+/*
+    LAN gateway throughput and per-device latency, run with
+    "make gatewaybench".
+
+    Everything on loopback: a forked server stands in for the
+    webhook (one RTT per response, one more for a new
+    connection), M forked slaves each send N uplinks at a
+    fixed interval through their own reactor. Each response
+    carries the first 4 payload bytes of its request and the
+    index from its id= back as the downlink, so a downlink
+    handed to the wrong uplink or the wrong device is caught.
+    Two runs:
+        direct   every slave is on the http transport itself,
+                 a connection per uplink
+        gateway  the slaves are on the lan transport, this
+                 process is the aggregator with [comms]
+                 pipeline_depth D on one upstream connection
+    Reported: aggregate uplinks/s, upstream connections the
+    server saw and the latency (due time to downlink) of each
+    device.
+
+    Usage:
+        SACLanGwBench [-m slaves] [-n uplinks per slave] [-i interval ms] [-r rtt ms] [-p pipeline depth] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACLanGateway.h"
+
+#define GWBENCH_SLAVES          32
+#define GWBENCH_UPLINKS         20
+#define GWBENCH_INTERVALMS      500
+#define GWBENCH_RTTMS           100
+#define GWBENCH_DEPTH           16
+#define GWBENCH_MAXUPLINKS      1000 // per slave
+#define GWBENCH_MAXQUEUED       64 // requests the server holds per connection
+#define GWBENCH_BUFSIZE         8192
+#define GWBENCH_GATEWAYMAXCONNS 2 // upstream connections the gateway run may open
+
+typedef struct
+{
+    uint64_t dueUs;
+    char data[17]; // first 4 payload bytes and the device index as hex
+} tGwBenchPending;
+
+typedef struct
+{
+    uint32_t ok;
+    uint32_t failed;
+    uint32_t mismatched;
+    uint32_t latencyMs[GWBENCH_MAXUPLINKS]; // ok uplinks only
+} tGwBenchSlave;
+
+typedef struct
+{
+    volatile uint32_t connections;
+} tGwBenchServer;
+
+typedef struct
+{
+    bool gateway;
+    double seconds;
+    uint32_t ok;
+    uint32_t failed;
+    uint32_t mismatched;
+    uint32_t connections;
+    uint32_t p50Ms;
+    uint32_t p99Ms;
+} tGwBenchRun;
+
+/****************** private function prototypes *********************/
+int gwBenchListen(uint16_t *pPort);
+void gwBenchServer(int iListenFd);
+void *gwBenchServeConnection(void *pArg);
+int gwBenchWriteConfig(const char *sPath, bool bLan, bool bAggregator, const char *sDeviceId);
+int gwBenchRun(tGwBenchRun *pRun);
+void gwBenchSlave(int iSlave, int iStartFd, bool bLan);
+void gwBenchSlaveDone(tUplinkRecord *pRecord, int iResult);
+int gwBenchCompare(const void *pA, const void *pB);
+uint32_t gwBenchPercentile(uint32_t *auiValues, uint32_t uiCount, uint32_t uiPercent);
+void gwBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msDir[200] = "/tmp";
+static uint16_t muiServerPort = 0;
+static uint16_t muiGatewayPort = 0;
+static uint32_t muiSlaves = GWBENCH_SLAVES;
+static uint32_t muiUplinks = GWBENCH_UPLINKS;
+static uint32_t muiIntervalMs = GWBENCH_INTERVALMS;
+static uint32_t muiRttMs = GWBENCH_RTTMS;
+static uint32_t muiDepth = GWBENCH_DEPTH;
+static tGwBenchServer *mpServer = NULL; // shared with the server process
+static tGwBenchSlave *masSlaves = NULL; // shared with the slave processes
+static tGwBenchSlave *mpSlave = NULL; // slave process: its own entry
+static uint32_t muiSlaveIndex = 0;
+static uint64_t *maulDueUs = NULL; // slave process: due time of each uplink
+static uint32_t muiSlaveDone = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tGwBenchRun asRuns[] = {{.gateway = false}, {.gateway = true}};
+    uint16_t uiGatewayPort;
+    int iListenFd;
+    int iProbeFd;
+    pid_t iServer;
+    bool bPass = true;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "m:n:i:r:p:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'm': muiSlaves = atoi(optarg); break;
+            case 'n': muiUplinks = atoi(optarg); break;
+            case 'i': muiIntervalMs = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'p': muiDepth = atoi(optarg); break;
+            case 'd': snprintf(msDir, sizeof(msDir), "%s", optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-m slaves] [-n uplinks per slave] [-i interval ms] [-r rtt ms] [-p pipeline depth] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(muiSlaves < 1 || muiSlaves > LANGW_MAXSLAVES || muiUplinks < 1 || muiUplinks > GWBENCH_MAXUPLINKS || muiDepth < 1 || muiDepth > HTTPPIPE_MAXDEPTH)
+    {
+        fprintf(stderr, "1..%i slaves, 1..%i uplinks, pipeline depth 1..%i.\n", LANGW_MAXSLAVES, GWBENCH_MAXUPLINKS, HTTPPIPE_MAXDEPTH);
+        return 2;
+    }
+    mpServer = mmap(NULL, sizeof(tGwBenchServer), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    masSlaves = mmap(NULL, muiSlaves * sizeof(tGwBenchSlave), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    iListenFd = gwBenchListen(&muiServerPort);
+    iProbeFd = gwBenchListen(&uiGatewayPort); // a free port for the aggregator
+    if(mpServer == MAP_FAILED || masSlaves == MAP_FAILED || iListenFd < 0 || iProbeFd < 0)
+    {
+        fprintf(stderr, "Could not open the local server.\n");
+        return 2;
+    }
+    close(iProbeFd);
+    muiGatewayPort = uiGatewayPort;
+    signal(SIGPIPE, SIG_IGN);
+    iServer = fork();
+    if(iServer == 0)
+    {
+        gwBenchServer(iListenFd);
+        _exit(0);
+    }
+    close(iListenFd);
+
+    fprintf(stderr, "%u slaves x %u uplinks every %u ms, %u ms rtt, gateway pipeline depth %u\n", muiSlaves, muiUplinks, muiIntervalMs, muiRttMs, muiDepth);
+    for(i=0; i<(int)(sizeof(asRuns) / sizeof(asRuns[0])); i+=1)
+    {
+        tGwBenchRun *pRun = &asRuns[i];
+        uint32_t j;
+        if(gwBenchRun(pRun) < 0)
+        {
+            fprintf(stderr, "Could not start the %s run.\n", pRun->gateway ? "gateway" : "direct");
+            kill(iServer, SIGKILL);
+            return 1;
+        }
+        fprintf(stderr, "%-8s %7.2f s %8.1f uplinks/s  ok %u failed %u mismatched %u  upstream connections %u  latency p50 %u ms p99 %u ms\n",
+            pRun->gateway ? "gateway" : "direct", pRun->seconds, pRun->ok / pRun->seconds,
+            pRun->ok, pRun->failed, pRun->mismatched, pRun->connections, pRun->p50Ms, pRun->p99Ms);
+        fprintf(stderr, "  per device p50/p99 ms:");
+        for(j=0; j<muiSlaves; j+=1)
+        {
+            tGwBenchSlave *pSlave = &masSlaves[j];
+            fprintf(stderr, "%s %2u: %u/%u", (j % 8 == 0) ? "\n   " : "", j,
+                gwBenchPercentile(pSlave->latencyMs, pSlave->ok, 50), gwBenchPercentile(pSlave->latencyMs, pSlave->ok, 99));
+        }
+        fprintf(stderr, "\n");
+        bPass = bPass && pRun->ok == muiSlaves * muiUplinks && pRun->mismatched == 0;
+    }
+    kill(iServer, SIGKILL);
+    waitpid(iServer, NULL, 0);
+    bPass = bPass && asRuns[1].connections <= GWBENCH_GATEWAYMAXCONNS;
+    fprintf(stderr, "gateway: %u upstream connections instead of %u, %.2fx the throughput of direct\n",
+        asRuns[1].connections, asRuns[0].connections, (asRuns[1].ok / asRuns[1].seconds) / (asRuns[0].ok / asRuns[0].seconds));
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+int gwBenchListen(uint16_t *pPort)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+    int iFd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(iFd < 0 || bind(iFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(iFd, 64) < 0)
+    {
+        return -1;
+    }
+    getsockname(iFd, (struct sockaddr *)&sAddr, &uiLength);
+    *pPort = ntohs(sAddr.sin_port);
+    return iFd;
+}
+
+/********************* gwBenchServer ************************
+    Server process, a thread per connection, until killed.
+************************************************************/
+void gwBenchServer(int iListenFd)
+{
+    pthread_t sThread;
+    int iFd;
+
+    while(1)
+    {
+        iFd = accept(iListenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        __sync_fetch_and_add(&mpServer->connections, 1);
+        if(pthread_create(&sThread, NULL, gwBenchServeConnection, (void *)(intptr_t)iFd) != 0)
+        {
+            close(iFd);
+            continue;
+        }
+        pthread_detach(sThread);
+    }
+}
+
+/****************** gwBenchServeConnection ******************
+    Requests are answered in order, each one RTT after it
+    arrived but not before the connection is one RTT old.
+    Kept alive until the client closes it.
+************************************************************/
+void *gwBenchServeConnection(void *pArg)
+{
+    int iFd = (int)(intptr_t)pArg;
+    tGwBenchPending asPending[GWBENCH_MAXQUEUED];
+    uint32_t uiHead = 0;
+    uint32_t uiCount = 0;
+    char sBuffer[GWBENCH_BUFSIZE];
+    int iLength = 0;
+    uint64_t ulOpenUs = printGetMonotonicTimeUs() + (uint64_t)muiRttMs * 1000ULL;
+    uint64_t ulNowUs;
+    struct pollfd sPoll = {.fd = iFd, .events = POLLIN};
+    char sResponse[256];
+    char *pEnd;
+    char *pField;
+    int iTimeoutMs;
+    int iResult;
+
+    while(1)
+    {
+        ulNowUs = printGetMonotonicTimeUs();
+        while(uiCount > 0 && asPending[uiHead].dueUs <= ulNowUs)
+        {
+            iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACLanGwBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s\r\n0\r\n\r\n", asPending[uiHead].data);
+            if(send(iFd, sResponse, iResult, MSG_NOSIGNAL) != iResult)
+            {
+                close(iFd);
+                return NULL;
+            }
+            uiHead = (uiHead + 1) % GWBENCH_MAXQUEUED;
+            uiCount -= 1;
+        }
+        iTimeoutMs = (uiCount > 0) ? (int)((asPending[uiHead].dueUs - ulNowUs + 999) / 1000) : 1000;
+        if(poll(&sPoll, 1, iTimeoutMs) <= 0)
+        {
+            continue;
+        }
+        iResult = read(iFd, &sBuffer[iLength], sizeof(sBuffer) - 1 - iLength);
+        if(iResult <= 0)
+        {
+            close(iFd);
+            return NULL;
+        }
+        iLength += iResult;
+        sBuffer[iLength] = 0x00;
+        ulNowUs = printGetMonotonicTimeUs();
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL && uiCount < GWBENCH_MAXQUEUED)
+        {
+            tGwBenchPending *pPending = &asPending[(uiHead + uiCount) % GWBENCH_MAXQUEUED];
+            uint32_t uiDevice = 0xffffffff;
+            pEnd += 4;
+            memset(pPending->data, '0', 8);
+            pField = strstr(sBuffer, "&data=");
+            if(pField != NULL && pField < pEnd)
+            {
+                memcpy(pPending->data, pField + 6, 8);
+            }
+            pField = strstr(sBuffer, "?id=gwbench-");
+            if(pField != NULL && pField < pEnd)
+            {
+                uiDevice = strtoul(pField + 12, NULL, 10);
+            }
+            snprintf(&pPending->data[8], 9, "%08x", uiDevice);
+            pPending->dueUs = ((ulNowUs > ulOpenUs) ? ulNowUs : ulOpenUs) + (uint64_t)muiRttMs * 1000ULL;
+            uiCount += 1;
+            iLength -= (pEnd - sBuffer);
+            memmove(sBuffer, pEnd, iLength + 1);
+        }
+    }
+}
+
+int gwBenchWriteConfig(const char *sPath, bool bLan, bool bAggregator, const char *sDeviceId)
+{
+    FILE *pFile = fopen(sPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = %s\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = no\npipeline_depth = %u\ndevice_id = %s\nuser_reply =\n\n[timeouts]\nsocket_sec = 10\n\n[gateway]\naggregator = %s\naddress = 127.0.0.1\nport = %u\n",
+        bLan ? "lan" : "http", muiServerPort, bAggregator ? muiDepth : 0, sDeviceId, bAggregator ? "yes" : "no", muiGatewayPort);
+    fclose(pFile);
+    return 0;
+}
+
+/*********************** gwBenchRun *************************
+    Forks the slaves, they wait for the start byte. In the
+    gateway run this process aggregates until all of them
+    exited.
+************************************************************/
+int gwBenchRun(tGwBenchRun *pRun)
+{
+    char sPath[256];
+    uint32_t *auiLatencies;
+    uint32_t uiConnectionsBefore = mpServer->connections;
+    uint32_t uiExited = 0;
+    uint64_t ulStartUs;
+    int aiStart[2];
+    pid_t iPid;
+    uint32_t i;
+
+    memset(masSlaves, 0, muiSlaves * sizeof(tGwBenchSlave));
+    if(pipe(aiStart) < 0)
+    {
+        return -1;
+    }
+    for(i=0; i<muiSlaves; i+=1)
+    {
+        fflush(stdout);
+        iPid = fork();
+        if(iPid == 0)
+        {
+            close(aiStart[1]);
+            gwBenchSlave(i, aiStart[0], pRun->gateway);
+            _exit(0);
+        }
+    }
+    close(aiStart[0]);
+    snprintf(sPath, sizeof(sPath), "%s/SACLanGwBench.%i.conf", msDir, (int)getpid());
+    if(pRun->gateway)
+    {
+        gwBenchQuiet(true);
+        structsInit();
+        uplinkSchedInit();
+        reactorInit(NULL, 0, NULL);
+        if(gwBenchWriteConfig(sPath, false, true, "gwbench-agg") < 0 || configInit(sPath) < 0 || commsInit() < 0 || lanGatewayInit() < 0)
+        {
+            gwBenchQuiet(false);
+            close(aiStart[1]);
+            return -1;
+        }
+    }
+    ulStartUs = printGetMonotonicTimeUs();
+    for(i=0; i<muiSlaves; i+=1)
+    {
+        if(write(aiStart[1], "g", 1) != 1)
+        {
+            break;
+        }
+    }
+    close(aiStart[1]);
+    while(uiExited < muiSlaves)
+    {
+        if(pRun->gateway)
+        {
+            reactorRunOnce(20);
+        }
+        else
+        {
+            usleep(20000);
+        }
+        while(waitpid(-1, NULL, WNOHANG) > 0)
+        {
+            uiExited += 1;
+        }
+    }
+    pRun->seconds = (printGetMonotonicTimeUs() - ulStartUs) / 1e6;
+    if(pRun->gateway)
+    {
+        lanGatewayClose();
+        commsClose();
+        reactorClose();
+        gwBenchQuiet(false);
+    }
+    unlink(sPath);
+
+    auiLatencies = malloc(muiSlaves * muiUplinks * sizeof(uint32_t));
+    pRun->ok = 0;
+    for(i=0; i<muiSlaves; i+=1)
+    {
+        memcpy(&auiLatencies[pRun->ok], masSlaves[i].latencyMs, masSlaves[i].ok * sizeof(uint32_t));
+        pRun->ok += masSlaves[i].ok;
+        pRun->failed += masSlaves[i].failed;
+        pRun->mismatched += masSlaves[i].mismatched;
+    }
+    pRun->p50Ms = gwBenchPercentile(auiLatencies, pRun->ok, 50);
+    pRun->p99Ms = gwBenchPercentile(auiLatencies, pRun->ok, 99);
+    free(auiLatencies);
+    pRun->connections = mpServer->connections - uiConnectionsBefore;
+    return 0;
+}
+
+/********************** gwBenchSlave ************************
+    Slave process: uplink i is due i intervals after the
+    start, goes out as soon as the transport takes it.
+************************************************************/
+void gwBenchSlave(int iSlave, int iStartFd, bool bLan)
+{
+    char sPath[256];
+    char sDeviceId[32];
+    char bStart;
+    tUplinkRecord sRecord;
+    uint64_t ulStartUs;
+    uint32_t uiStarted = 0;
+    uint32_t uiCounter;
+
+    gwBenchQuiet(true);
+    muiSlaveIndex = iSlave;
+    mpSlave = &masSlaves[iSlave];
+    maulDueUs = malloc(muiUplinks * sizeof(uint64_t));
+    snprintf(sPath, sizeof(sPath), "%s/SACLanGwBench.%i.conf", msDir, (int)getpid());
+    snprintf(sDeviceId, sizeof(sDeviceId), "gwbench-%02i", iSlave);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    if(gwBenchWriteConfig(sPath, bLan, false, sDeviceId) < 0 || configInit(sPath) < 0 || commsInit() < 0)
+    {
+        mpSlave->failed = muiUplinks;
+        return;
+    }
+    unlink(sPath);
+    if(read(iStartFd, &bStart, 1) != 1)
+    {
+        return;
+    }
+    ulStartUs = printGetMonotonicTimeUs();
+    while(muiSlaveDone < muiUplinks)
+    {
+        while(uiStarted < muiUplinks && printGetMonotonicTimeUs() >= ulStartUs + (uint64_t)uiStarted * muiIntervalMs * 1000ULL && commsCanStartUplink())
+        {
+            memset(&sRecord, 0, sizeof(sRecord));
+            sRecord.id = uiStarted;
+            sRecord.cmd.cmdCode = UPLSCHED_CMDCODE_ALARM;
+            sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+            uiCounter = ((uint32_t)iSlave << 24) | uiStarted;
+            memcpy(sRecord.cmd.payload, &uiCounter, sizeof(uiCounter));
+            sRecord.time = time(NULL);
+            maulDueUs[uiStarted] = ulStartUs + (uint64_t)uiStarted * muiIntervalMs * 1000ULL;
+            if(commsStartUplink(&sRecord, gwBenchSlaveDone) < 0)
+            {
+                break;
+            }
+            uiStarted += 1;
+        }
+        reactorRunOnce(5);
+    }
+    commsClose();
+    reactorClose();
+}
+
+/******************* gwBenchSlaveDone ***********************
+    The downlink must be the echo of this uplink's payload
+    and this device's index. Failed uplinks count as done,
+    the bench does not retry.
+************************************************************/
+void gwBenchSlaveDone(tUplinkRecord *pRecord, int iResult)
+{
+    uint8_t abExpected[STRUCTS_DECKEDREPLYPAYLOADSIZE] = {0};
+
+    muiSlaveDone += 1;
+    if(iResult < 0)
+    {
+        mpSlave->failed += 1;
+        return;
+    }
+    memcpy(abExpected, pRecord->cmd.payload, sizeof(uint32_t));
+    abExpected[7] = (uint8_t)muiSlaveIndex;
+    if(memcmp(getCtrlDeckedReply()->payload, abExpected, sizeof(abExpected)) != 0)
+    {
+        mpSlave->mismatched += 1;
+        return;
+    }
+    mpSlave->latencyMs[mpSlave->ok] = (uint32_t)((printGetMonotonicTimeUs() - maulDueUs[pRecord->id]) / 1000);
+    mpSlave->ok += 1;
+}
+
+int gwBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+uint32_t gwBenchPercentile(uint32_t *auiValues, uint32_t uiCount, uint32_t uiPercent)
+{
+    if(uiCount == 0)
+    {
+        return 0;
+    }
+    qsort(auiValues, uiCount, sizeof(uint32_t), gwBenchCompare);
+    return auiValues[(uiCount - 1) * uiPercent / 100];
+}
+
+void gwBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
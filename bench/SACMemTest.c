@@ -0,0 +1,392 @@
+/*
+    Zero heap allocations in steady state, run with "make memtest".
+
+    Transactions like the daemon's: the controller sends an
+    alarm frame over the simulated BSC, the state machine
+    builds the http request, the request goes through a full
+    TLS handshake and exchange with an in process server
+    (memory BIO pair, the daemon's SSL context and session
+    callback), the reply is parsed and read back by the
+    controller. OpenSSL allocates from SACMemPool like in
+    the daemon, both ends of the connection.
+    After a warm up every malloc/calloc/realloc of the
+    process is counted (this binary wraps them) together with
+    the blocks cut from the pool's arena. Both have to stay
+    0 over the measured transactions, no frame may be missed
+    and no pool allocation may fail.
+
+    Usage:
+        SACMemTest [-n transactions] [-w warm up transactions]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACMemPool.h"
+#include "SACBenchBsc.h"
+
+#define MEMTEST_TRANSACTIONS    100000
+#define MEMTEST_WARMUP          1000
+#define MEMTEST_SMMAXSTEPS      64 // listeningTask() calls before a cycle is considered missed
+#define MEMTEST_TLSMAXROUNDS    16 // handshake flights before the exchange is considered stuck
+
+/****************** daemon internals driven by the test *************************/
+extern tSmState sState;
+extern char msHttpTxMessage[HTTPMSGMAXSIZE];
+extern char msHttpRxMessage[HTTPMSGMAXSIZE];
+uint8_t slave_init();
+void listeningTask();
+bool httpRespComplete(const char *sMessage, int iBytesReceived);
+/*********************************************************************************/
+
+/****************** heap allocations of the whole process ***********************/
+void *__libc_malloc(size_t uiSize);
+void *__libc_calloc(size_t uiCount, size_t uiSize);
+void *__libc_realloc(void *pBlock, size_t uiSize);
+void __libc_free(void *pBlock);
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int memTestServerInit();
+int memTestSendUplink(tUplinkRecord *pRecord);
+int memTestTlsExchange();
+int memTestRunUntilIdle();
+int memTestCycle(uint32_t uiFrame);
+void memTestQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static volatile bool mbCounting = false;
+static volatile uint64_t mulHeapAllocs = 0;
+static SSL_CTX *mpServerContext = NULL;
+static uint32_t muiTlsFailures = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const tCommsTransport msMemTestTransport =
+{
+    .name = "memtest",
+    .sendUplink = memTestSendUplink,
+};
+/********************************************************************/
+
+void *malloc(size_t uiSize)
+{
+    if(mbCounting)
+    {
+        mulHeapAllocs += 1;
+    }
+    return __libc_malloc(uiSize);
+}
+
+void *calloc(size_t uiCount, size_t uiSize)
+{
+    if(mbCounting)
+    {
+        mulHeapAllocs += 1;
+    }
+    return __libc_calloc(uiCount, uiSize);
+}
+
+void *realloc(void *pBlock, size_t uiSize)
+{
+    if(mbCounting)
+    {
+        mulHeapAllocs += 1;
+    }
+    return __libc_realloc(pBlock, uiSize);
+}
+
+void free(void *pBlock)
+{
+    __libc_free(pBlock);
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t uiTransactions = MEMTEST_TRANSACTIONS;
+    uint32_t uiWarmup = MEMTEST_WARMUP;
+    uint32_t uiFrame;
+    uint32_t uiMissed = 0;
+    tMemPoolStats sBefore;
+    tMemPoolStats sAfter;
+    uint64_t ulStartUs;
+    double dSeconds;
+    int iOption;
+
+    while((iOption = getopt(argc, argv, "n:w:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiTransactions = atoi(optarg); break;
+            case 'w': uiWarmup = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n transactions] [-w warm up transactions]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    memTestQuiet(true);
+    if(memPoolInit() < 0 || memTestServerInit() < 0)
+    {
+        memTestQuiet(false);
+        fprintf(stderr, "Could not set up OpenSSL.\n");
+        return 2;
+    }
+    structsInit();
+    uplinkSchedInit();
+    sslInit();
+    commsSetTransport(&msMemTestTransport);
+    benchBscReset();
+    slave_init();
+
+    for(uiFrame=0; uiFrame<uiWarmup; uiFrame+=1)
+    {
+        memTestCycle(uiFrame);
+    }
+    memPoolGetStats(&sBefore);
+    mbCounting = true;
+    ulStartUs = printGetMonotonicTimeUs();
+    for(uiFrame=uiWarmup; uiFrame<uiWarmup + uiTransactions; uiFrame+=1)
+    {
+        if(memTestCycle(uiFrame) < 0)
+        {
+            uiMissed += 1;
+        }
+    }
+    dSeconds = (printGetMonotonicTimeUs() - ulStartUs) / 1e6;
+    mbCounting = false;
+    memPoolGetStats(&sAfter);
+    memTestQuiet(false);
+
+    fprintf(stderr, "%u transactions in %.1f s (%.0f/s), %u missed, %u tls failures\n", uiTransactions, dSeconds, uiTransactions / dSeconds, uiMissed, muiTlsFailures);
+    fprintf(stderr, "heap allocations: %llu\n", (unsigned long long)mulHeapAllocs);
+    fprintf(stderr, "pool: %llu allocations, %llu failed, %llu blocks cut, peak %u of %u bytes, arena %u bytes cut in total\n",
+        (unsigned long long)(sAfter.allocs - sBefore.allocs), (unsigned long long)(sAfter.failed - sBefore.failed),
+        (unsigned long long)(sAfter.cut - sBefore.cut), sAfter.peak, MEMPOOL_BUDGETSIZE, sAfter.arenaUsed);
+    if(uiMissed > 0 || muiTlsFailures > 0 || mulHeapAllocs > 0 || sAfter.cut != sBefore.cut || sAfter.failed != sBefore.failed)
+    {
+        fprintf(stderr, "FAIL\n");
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
+
+/******************** memTestServerInit *********************
+    Server context with a fresh P-256 key and a self signed
+    certificate, the daemon doesn't verify the server.
+************************************************************/
+int memTestServerInit()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/******************* memTestSendUplink **********************
+    The http transport's work without the network: build,
+    TLS exchange, parse.
+************************************************************/
+int memTestSendUplink(tUplinkRecord *pRecord)
+{
+    httpBuildRequestMsg((uintptr_t)pRecord->cmd.payload, pRecord->cmd.payloadSize - 1, pRecord->time, pRecord->encoding);
+    if(memTestTlsExchange() < 0)
+    {
+        muiTlsFailures += 1;
+        return -1;
+    }
+    return (httpParseReplyMsg(msHttpRxMessage) < 0) ? -1 : 0;
+}
+
+/******************* memTestTlsExchange *********************
+    Handshake, request, reply over a BIO pair. The server
+    echoes the first 4 payload bytes of the request.
+************************************************************/
+int memTestTlsExchange()
+{
+    SSL *pClient = SSL_new(sslGetContext());
+    SSL *pServer = SSL_new(mpServerContext);
+    BIO *pClientBio = NULL;
+    BIO *pServerBio = NULL;
+    char sRequest[HTTPMSGMAXSIZE];
+    char sReply[256];
+    const char *pData;
+    int iClientDone = 0;
+    int iServerDone = 0;
+    int iRounds = 0;
+    int iLength = 0;
+    int iResult;
+    int iReturn = -1;
+
+    if(pClient == NULL || pServer == NULL || BIO_new_bio_pair(&pClientBio, 0, &pServerBio, 0) != 1)
+    {
+        goto cleanup;
+    }
+    SSL_set_bio(pClient, pClientBio, pClientBio);
+    SSL_set_bio(pServer, pServerBio, pServerBio);
+    SSL_set_connect_state(pClient);
+    SSL_set_accept_state(pServer);
+    while((iClientDone != 1 || iServerDone != 1) && iRounds < MEMTEST_TLSMAXROUNDS)
+    {
+        iClientDone = (iClientDone == 1) ? 1 : SSL_do_handshake(pClient);
+        iServerDone = (iServerDone == 1) ? 1 : SSL_do_handshake(pServer);
+        iRounds += 1;
+    }
+    if(iClientDone != 1 || iServerDone != 1)
+    {
+        goto cleanup;
+    }
+
+    if(SSL_write(pClient, msHttpTxMessage, strlen(msHttpTxMessage)) <= 0)
+    {
+        goto cleanup;
+    }
+    while(iLength < (int)sizeof(sRequest) - 1)
+    {
+        iResult = SSL_read(pServer, &sRequest[iLength], sizeof(sRequest) - 1 - iLength);
+        if(iResult <= 0)
+        {
+            goto cleanup;
+        }
+        iLength += iResult;
+        sRequest[iLength] = 0x00;
+        if(strstr(sRequest, "\r\n\r\n") != NULL)
+        {
+            break;
+        }
+    }
+    pData = strstr(sRequest, "&data=");
+    if(pData == NULL)
+    {
+        goto cleanup;
+    }
+    iLength = snprintf(sReply, sizeof(sReply), "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%.8s00000000\r\n0\r\n\r\n", pData + 6);
+    if(SSL_write(pServer, sReply, iLength) != iLength)
+    {
+        goto cleanup;
+    }
+    iLength = 0;
+    while(!httpRespComplete(msHttpRxMessage, iLength) && iLength < HTTPMSGMAXSIZE - 1)
+    {
+        iResult = SSL_read(pClient, &msHttpRxMessage[iLength], HTTPMSGMAXSIZE - 1 - iLength); // also takes the session tickets
+        if(iResult <= 0)
+        {
+            goto cleanup;
+        }
+        iLength += iResult;
+        msHttpRxMessage[iLength] = 0x00;
+    }
+    iReturn = 0;
+
+cleanup:
+    SSL_free(pClient); // also frees the bios
+    SSL_free(pServer);
+    return iReturn;
+}
+
+int memTestRunUntilIdle()
+{
+    int iSteps = 0;
+    do
+    {
+        listeningTask();
+        iSteps += 1;
+    } while(sState != S_IDLE && iSteps < MEMTEST_SMMAXSTEPS);
+    return (sState == S_IDLE) ? iSteps : -1;
+}
+
+/*********************** memTestCycle ***********************
+    One alarm send command carrying uiFrame, read enable,
+    read the decked reply, which must be uiFrame again.
+************************************************************/
+int memTestCycle(uint32_t uiFrame)
+{
+    tCtrlSendCmd sFrame;
+    uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    uint8_t abReply[BSC_FIFO_SIZE];
+    int iLength;
+
+    memset(&sFrame, 0, sizeof(sFrame));
+    sFrame.startTag = IOT_FRMSTARTTAG;
+    sFrame.cmdCode = UPLSCHED_CMDCODE_ALARM; // alarms bypass the token bucket
+    sFrame.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sFrame.downlinkIndicator = 0x01;
+    memcpy(sFrame.payload, &uiFrame, sizeof(uiFrame));
+    sFrame.endTag = IOT_FRMENDTAG;
+
+    benchBscControllerWrite(sFrame.ui8, sizeof(sFrame.ui8));
+    if(memTestRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    benchBscControllerWrite(abReadEnaFrame, sizeof(abReadEnaFrame));
+    if(memTestRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    iLength = benchBscControllerRead(abReply, sizeof(abReply));
+    if(iLength != STRUCTS_DECKEDREPLYTOTALSIZE || abReply[2] != I2CERRORCODE_OK || memcmp(&abReply[4], &uiFrame, sizeof(uiFrame)) != 0)
+    {
+        return -1;
+    }
+    return iLength;
+}
+
+void memTestQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
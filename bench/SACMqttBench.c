@@ -0,0 +1,929 @@
+/*
+    MQTT against the https webhook per event, run with
+    "make mqttbench".
+
+    Two local TLS servers on one self-signed P-256 context
+    stand in for the backends: the webhook (an echo of the
+    first 4 payload bytes as the chunked reply) and an MQTT
+    3.1.1 broker that keeps the device's session across
+    connections, acknowledges QoS 1 publishes and answers
+    every uplink with a QoS 1 publish of the echo on the
+    device's downlink topic. The daemon reaches each
+    through a proxy thread that holds every chunk RTT/2 in
+    each direction, plus one RTT on a connection's first
+    chunk for the TCP handshake, and counts the bytes on the
+    wire (TLS records, without TCP/IP headers).
+    The blocking path sends -n events asking for a downlink
+    over each transport, reported per transport: ms for the
+    first event (connection, TLS and for MQTT the session),
+    median of the others and in RTTs, wire bytes of the
+    first and per event after it, connections.
+    Then against the broker:
+        puback:   the broker withholds one PUBACK, the
+                  publish must fail (after [timeouts]
+                  socket_sec) and the next one go through;
+        resume:   the transport is closed and opened again,
+                  the broker reports the session present, the
+                  client must not subscribe again and still
+                  get its downlink;
+        downlink: the broker publishes without an uplink,
+                  commsPoll() must put it into the decked
+                  reply;
+    and every uplink was a QoS 1 publish, every downlink
+    acknowledged.
+
+    Usage:
+        SACMqttBench [-n events] [-r rtt ms]
+    Exit code 1 when a check fails or MQTT is not faster
+    with fewer bytes per event than https.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACMqttClient.h"
+
+#define MQTTBENCH_EVENTS        20
+#define MQTTBENCH_RTTMS         50
+#define MQTTBENCH_MAXEVENTS     1000
+#define MQTTBENCH_DEVICEID      "bench01"
+#define MQTTBENCH_SOCKETSEC     1 // [timeouts] socket_sec, the withheld PUBACK costs this long
+#define MQTTBENCH_BUFSIZE       8192
+#define MQTTBENCH_CHUNKSIZE     4096
+#define MQTTBENCH_MAXCHUNKS     16 // held per direction and connection
+#define MQTTBENCH_POLLMS        2000 // for the downlink without an uplink
+
+typedef struct
+{
+    uint64_t dueUs;
+    int length;
+    uint8_t data[MQTTBENCH_CHUNKSIZE];
+} tMqttBenchChunk;
+
+typedef struct
+{
+    int fromFd;
+    int toFd;
+    tMqttBenchChunk chunks[MQTTBENCH_MAXCHUNKS];
+    uint32_t head;
+    uint32_t count;
+    bool eof;
+} tMqttBenchDirection;
+
+typedef struct
+{
+    int listenFd;
+    uint16_t port;
+    void *(*pServe)(void *); // per connection
+    uint16_t targetPort; // proxies: where to
+} tMqttBenchListener;
+
+typedef struct
+{
+    int fd;
+    uint16_t targetPort;
+} tMqttBenchConnection;
+
+typedef struct
+{
+    const char *name;
+    const char *transport;
+    uint16_t port;
+    uint32_t ok;
+    uint32_t firstUs;
+    uint32_t medianUs;
+    uint32_t maxUs;
+    uint64_t firstBytes; // both directions, through the first downlink
+    uint64_t bytes; // all events
+    uint32_t connections;
+} tMqttBenchRun;
+
+typedef struct
+{
+    uint32_t connects;
+    uint32_t resumed; // CONNACK with session present
+    uint32_t subscribes;
+    uint32_t publishes;
+    uint32_t qos1; // of those
+    uint32_t downlinks;
+    uint32_t downlinkAcks;
+    uint32_t withheld;
+} tMqttBenchBroker;
+
+/****************** private function prototypes *********************/
+int mqttBenchListen(tMqttBenchListener *pListener);
+int mqttBenchServerContext();
+void *mqttBenchAccept(void *pArg);
+void *mqttBenchHttpServer(void *pArg);
+void *mqttBenchBrokerServer(void *pArg);
+int mqttBenchReadPacket(SSL *pSsl, int iFd, uint8_t *pType, uint8_t *pBody, int *pLength);
+int mqttBenchWritePacket(SSL *pSsl, uint8_t bType, const uint8_t *pBody, int iLength);
+int mqttBenchPublishDownlink(SSL *pSsl, const uint8_t *pPayload);
+void *mqttBenchProxy(void *pArg);
+int mqttBenchPump(tMqttBenchDirection *pDirection, uint32_t uiExtraUs);
+int mqttBenchFlush(tMqttBenchDirection *pDirection, uint64_t ulNowUs);
+int mqttBenchWriteConfig(const char *sTransport, uint16_t uiPort);
+int mqttBenchLoad(const char *sTransport, uint16_t uiPort);
+int mqttBenchSend(uint32_t uiCounter);
+int mqttBenchRun(tMqttBenchRun *pRun, uint32_t uiEvents);
+bool mqttBenchCheck(const char *sName, bool bPass, const char *sDetail);
+int mqttBenchCompare(const void *pA, const void *pB);
+void mqttBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static uint32_t muiRttMs = MQTTBENCH_RTTMS;
+static SSL_CTX *mpServerContext = NULL;
+static pthread_mutex_t msLock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t mulWireBytes = 0; // through the proxies
+static uint32_t muiProxied = 0; // connections through the proxies
+static tMqttBenchBroker msBroker;
+static bool mbSessionKnown = false; // the broker's session of the device
+static bool mbSessionSubscribed = false;
+static volatile bool mbWithholdPuback = false;
+static volatile bool mbUnsolicited = false; // publish a downlink without an uplink
+static char msUplinkTopic[64];
+static char msDownlinkTopic[64];
+static uint32_t mauiLatencyUs[MQTTBENCH_MAXEVENTS];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tMqttBenchListener sHttp = {.pServe = mqttBenchHttpServer};
+    tMqttBenchListener sBroker = {.pServe = mqttBenchBrokerServer};
+    tMqttBenchListener sHttpProxy = {.pServe = mqttBenchProxy};
+    tMqttBenchListener sBrokerProxy = {.pServe = mqttBenchProxy};
+    tMqttBenchRun asRuns[] =
+    {
+        {.name = "https", .transport = "http"},
+        {.name = "mqtt", .transport = "mqtt"},
+    };
+    static const uint8_t abMarker[STRUCTS_DECKEDREPLYPAYLOADSIZE] = {0xa5, 0x5a, 0xa5, 0x5a, 0x01, 0x02, 0x03, 0x04};
+    tMqttBenchBroker sBefore;
+    uint32_t uiEvents = MQTTBENCH_EVENTS;
+    uint32_t uiCounter;
+    uint64_t ulStartUs;
+    char sDetail[160];
+    pthread_t sThread;
+    bool bPass = true;
+    bool bFailed;
+    bool bOk;
+    int iOption;
+    uint32_t i;
+
+    while((iOption = getopt(argc, argv, "n:r:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiEvents = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n events] [-r rtt ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiEvents < 2 || uiEvents > MQTTBENCH_MAXEVENTS)
+    {
+        fprintf(stderr, "Need 2..%u events.\n", MQTTBENCH_MAXEVENTS);
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "/tmp/SACMqttBench.%i.conf", (int)getpid());
+    snprintf(msUplinkTopic, sizeof(msUplinkTopic), MQTT_UPLINKTOPICFMT, MQTTBENCH_DEVICEID);
+    snprintf(msDownlinkTopic, sizeof(msDownlinkTopic), MQTT_DOWNLINKTOPICFMT, MQTTBENCH_DEVICEID);
+    if(mqttBenchServerContext() < 0 || mqttBenchListen(&sHttp) < 0 || mqttBenchListen(&sBroker) < 0 || mqttBenchListen(&sHttpProxy) < 0 || mqttBenchListen(&sBrokerProxy) < 0)
+    {
+        fprintf(stderr, "Could not open the local TLS servers and their proxies.\n");
+        return 2;
+    }
+    sHttpProxy.targetPort = sHttp.port;
+    sBrokerProxy.targetPort = sBroker.port;
+    asRuns[0].port = sHttpProxy.port;
+    asRuns[1].port = sBrokerProxy.port;
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, mqttBenchAccept, &sHttp);
+    pthread_create(&sThread, NULL, mqttBenchAccept, &sBroker);
+    pthread_create(&sThread, NULL, mqttBenchAccept, &sHttpProxy);
+    pthread_create(&sThread, NULL, mqttBenchAccept, &sBrokerProxy);
+
+    mqttBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    sslInit();
+    mqttBenchQuiet(false);
+
+    fprintf(stderr, "%u events asking for a downlink, %u ms rtt\n", uiEvents, muiRttMs);
+    fprintf(stderr, "%-6s %6s %9s %9s %6s %9s %12s %12s %6s\n", "run", "ok", "first ms", "p50 ms", "RTTs", "max ms", "first bytes", "bytes/event", "conns");
+    for(i=0; i<sizeof(asRuns) / sizeof(asRuns[0]); i+=1)
+    {
+        tMqttBenchRun *pRun = &asRuns[i];
+        if(mqttBenchRun(pRun, uiEvents) < 0)
+        {
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return 1;
+        }
+        fprintf(stderr, "%-6s %3u/%-3u %8.1f %9.1f %6.2f %9.1f %12llu %12.1f %6u\n", pRun->name, pRun->ok, uiEvents, pRun->firstUs / 1000.0, pRun->medianUs / 1000.0,
+            pRun->medianUs / 1000.0 / muiRttMs, pRun->maxUs / 1000.0, (unsigned long long)pRun->firstBytes,
+            (double)(pRun->bytes - pRun->firstBytes) / (uiEvents - 1), pRun->connections);
+        bPass = bPass && pRun->ok == uiEvents;
+        if(i == 0)
+        {
+            commsClose();
+        }
+    }
+    bPass = bPass && asRuns[1].medianUs < asRuns[0].medianUs && (asRuns[1].bytes - asRuns[1].firstBytes) < (asRuns[0].bytes - asRuns[0].firstBytes);
+
+    /* the mqtt transport is still up, same session */
+    uiCounter = uiEvents;
+    mqttBenchQuiet(true);
+    pthread_mutex_lock(&msLock);
+    memcpy(&sBefore, &msBroker, sizeof(sBefore));
+    pthread_mutex_unlock(&msLock);
+    mbWithholdPuback = true;
+    ulStartUs = printGetMonotonicTimeUs();
+    bFailed = (mqttBenchSend(uiCounter++) < 0);
+    mauiLatencyUs[0] = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    bOk = (mqttBenchSend(uiCounter++) == 0);
+    mqttBenchQuiet(false);
+    snprintf(sDetail, sizeof(sDetail), "withheld %u, publish %s after %.0f ms, next one %s, reconnects %u", msBroker.withheld - sBefore.withheld,
+        bFailed ? "failed" : "went through", mauiLatencyUs[0] / 1000.0, bOk ? "ok" : "failed", msBroker.connects - sBefore.connects);
+    bPass &= mqttBenchCheck("puback", bFailed && bOk && msBroker.withheld - sBefore.withheld == 1, sDetail);
+
+    mqttBenchQuiet(true);
+    memcpy(&sBefore, &msBroker, sizeof(sBefore));
+    commsClose();
+    bOk = (mqttBenchLoad("mqtt", asRuns[1].port) == 0 && mqttBenchSend(uiCounter++) == 0);
+    mqttBenchQuiet(false);
+    snprintf(sDetail, sizeof(sDetail), "connects %u, session present %u, subscribes %u, downlink %s", msBroker.connects - sBefore.connects,
+        msBroker.resumed - sBefore.resumed, msBroker.subscribes - sBefore.subscribes, bOk ? "ok" : "missing");
+    bPass &= mqttBenchCheck("resume", bOk && msBroker.connects - sBefore.connects == 1 && msBroker.resumed - sBefore.resumed == 1 && msBroker.subscribes == sBefore.subscribes, sDetail);
+
+    mqttBenchQuiet(true);
+    memset(getCtrlDeckedReply()->payload, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    mbUnsolicited = true;
+    ulStartUs = printGetMonotonicTimeUs();
+    while(memcmp(getCtrlDeckedReply()->payload, abMarker, sizeof(abMarker)) != 0 && printGetMonotonicTimeUs() - ulStartUs < MQTTBENCH_POLLMS * 1000ULL)
+    {
+        commsPoll();
+        usleep(1000);
+    }
+    bOk = (memcmp(getCtrlDeckedReply()->payload, abMarker, sizeof(abMarker)) == 0);
+    mqttBenchQuiet(false);
+    snprintf(sDetail, sizeof(sDetail), "decked reply %s after %.1f ms of commsPoll()", bOk ? "filled" : "not filled", (printGetMonotonicTimeUs() - ulStartUs) / 1000.0);
+    bPass &= mqttBenchCheck("downlink", bOk, sDetail);
+
+    usleep(muiRttMs * 1000); // the last PUBACK reaches the broker
+    pthread_mutex_lock(&msLock);
+    snprintf(sDetail, sizeof(sDetail), "publishes %u, QoS 1 %u, downlinks %u, acknowledged %u", msBroker.publishes, msBroker.qos1, msBroker.downlinks, msBroker.downlinkAcks);
+    bPass &= mqttBenchCheck("qos 1", msBroker.publishes > 0 && msBroker.qos1 == msBroker.publishes && msBroker.downlinkAcks == msBroker.downlinks, sDetail);
+    pthread_mutex_unlock(&msLock);
+
+    commsClose();
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/********************* mqttBenchListen **********************
+    Loopback listening socket on a free port.
+************************************************************/
+int mqttBenchListen(tMqttBenchListener *pListener)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    pListener->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(pListener->listenFd < 0 || bind(pListener->listenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(pListener->listenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(pListener->listenFd, (struct sockaddr *)&sAddr, &uiLength);
+    pListener->port = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/***************** mqttBenchServerContext *******************
+    Self-signed P-256 certificate made up on the spot.
+************************************************************/
+int mqttBenchServerContext()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/********************* mqttBenchAccept **********************
+    Accept loop of a server or proxy, a thread per
+    connection.
+************************************************************/
+void *mqttBenchAccept(void *pArg)
+{
+    tMqttBenchListener *pListener = (tMqttBenchListener *)pArg;
+    tMqttBenchConnection *pConnection;
+    pthread_t sThread;
+    int iFd;
+
+    while(1)
+    {
+        iFd = accept(pListener->listenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pConnection = malloc(sizeof(tMqttBenchConnection));
+        pConnection->fd = iFd;
+        pConnection->targetPort = pListener->targetPort;
+        pthread_create(&sThread, NULL, pListener->pServe, pConnection);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/******************* mqttBenchHttpServer ********************
+    Requests on the connection until the client closes, the
+    first 4 payload bytes go back as the downlink.
+************************************************************/
+void *mqttBenchHttpServer(void *pArg)
+{
+    int iFd = ((tMqttBenchConnection *)pArg)->fd;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[MQTTBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9];
+    char *pEnd;
+    char *pValue;
+    SSL *pSsl;
+    int iBuffered = 0;
+    int iLength;
+    int iResult;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while(iBuffered < MQTTBENCH_BUFSIZE - 1)
+    {
+        iResult = SSL_read(pSsl, &sBuffer[iBuffered], MQTTBENCH_BUFSIZE - 1 - iBuffered);
+        if(iResult <= 0)
+        {
+            break;
+        }
+        iBuffered += iResult;
+        sBuffer[iBuffered] = 0x00;
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL)
+        {
+            memcpy(sData, "00000000", sizeof(sData));
+            pValue = strstr(sBuffer, "&data=");
+            if(pValue != NULL && pValue < pEnd)
+            {
+                memcpy(sData, pValue + 6, 8);
+            }
+            iLength = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACMqttBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+            if(SSL_write(pSsl, sResponse, iLength) != iLength)
+            {
+                iBuffered = MQTTBENCH_BUFSIZE;
+                break;
+            }
+            iLength = (int)(pEnd - sBuffer) + 4;
+            memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength + 1);
+            iBuffered -= iLength;
+        }
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/****************** mqttBenchBrokerServer *******************
+    The broker side of one connection. One device, one
+    session: it survives the connection unless the client
+    asks for a clean session, the subscription with it.
+************************************************************/
+void *mqttBenchBrokerServer(void *pArg)
+{
+    int iFd = ((tMqttBenchConnection *)pArg)->fd;
+    static const uint8_t abMarker[STRUCTS_DECKEDREPLYPAYLOADSIZE] = {0xa5, 0x5a, 0xa5, 0x5a, 0x01, 0x02, 0x03, 0x04};
+    uint8_t abBody[MQTTBENCH_BUFSIZE];
+    uint8_t abReply[8];
+    uint8_t abDownlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    uint8_t bType;
+    struct pollfd sPoll;
+    SSL *pSsl;
+    int iLength;
+    int iTopicLength;
+    int iPos;
+    bool bConnected = false;
+    bool bWithhold;
+
+    free(pArg);
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while(1)
+    {
+        if(bConnected && mbUnsolicited && mbSessionSubscribed)
+        {
+            mbUnsolicited = false;
+            if(mqttBenchPublishDownlink(pSsl, abMarker) < 0)
+            {
+                break;
+            }
+        }
+        if(SSL_pending(pSsl) == 0)
+        {
+            sPoll.fd = iFd;
+            sPoll.events = POLLIN;
+            if(poll(&sPoll, 1, 20) == 0)
+            {
+                continue;
+            }
+        }
+        if(mqttBenchReadPacket(pSsl, iFd, &bType, abBody, &iLength) < 0)
+        {
+            break;
+        }
+        pthread_mutex_lock(&msLock);
+        switch(bType & 0xf0)
+        {
+            case 0x10: // CONNECT: protocol name, level, flags, keep alive, client id
+                iPos = 2 + ((abBody[0] << 8) | abBody[1]);
+                abReply[0] = (mbSessionKnown && (abBody[iPos + 1] & 0x02) == 0) ? 0x01 : 0x00; // session present
+                if((abBody[iPos + 1] & 0x02) != 0)
+                {
+                    mbSessionSubscribed = false; // clean session
+                }
+                mbSessionKnown = true;
+                msBroker.connects += 1;
+                msBroker.resumed += abReply[0];
+                abReply[1] = 0x00;
+                bConnected = true;
+                pthread_mutex_unlock(&msLock);
+                if(mqttBenchWritePacket(pSsl, 0x20, abReply, 2) < 0)
+                {
+                    goto done;
+                }
+                continue;
+
+            case 0x80: // SUBSCRIBE: packet id, topic filter, QoS
+                iTopicLength = (abBody[2] << 8) | abBody[3];
+                mbSessionSubscribed = mbSessionSubscribed || (iTopicLength == (int)strlen(msDownlinkTopic) && memcmp(&abBody[4], msDownlinkTopic, iTopicLength) == 0);
+                msBroker.subscribes += 1;
+                pthread_mutex_unlock(&msLock);
+                abReply[0] = abBody[0];
+                abReply[1] = abBody[1];
+                abReply[2] = 0x01; // granted QoS 1
+                if(mqttBenchWritePacket(pSsl, 0x90, abReply, 3) < 0)
+                {
+                    goto done;
+                }
+                continue;
+
+            case 0x30: // PUBLISH: topic, packet id (QoS > 0), seqNr, time, controller payload
+                iTopicLength = (abBody[0] << 8) | abBody[1];
+                iPos = 2 + iTopicLength;
+                msBroker.publishes += 1;
+                msBroker.qos1 += (((bType >> 1) & 0x03) == 1 && iTopicLength >= (int)strlen(msUplinkTopic) && memcmp(&abBody[2], msUplinkTopic, strlen(msUplinkTopic)) == 0) ? 1 : 0;
+                bWithhold = mbWithholdPuback;
+                mbWithholdPuback = false;
+                msBroker.withheld += bWithhold ? 1 : 0;
+                pthread_mutex_unlock(&msLock);
+                if(bWithhold || ((bType >> 1) & 0x03) == 0)
+                {
+                    continue;
+                }
+                abReply[0] = abBody[iPos];
+                abReply[1] = abBody[iPos + 1];
+                memset(abDownlink, 0, sizeof(abDownlink));
+                memcpy(abDownlink, &abBody[iPos + 2 + 8], sizeof(uint32_t));
+                if(mqttBenchWritePacket(pSsl, 0x40, abReply, 2) < 0 || (mbSessionSubscribed && mqttBenchPublishDownlink(pSsl, abDownlink) < 0))
+                {
+                    goto done;
+                }
+                continue;
+
+            case 0x40: // PUBACK of a downlink
+                msBroker.downlinkAcks += 1;
+                pthread_mutex_unlock(&msLock);
+                continue;
+
+            case 0xC0: // PINGREQ
+                pthread_mutex_unlock(&msLock);
+                if(mqttBenchWritePacket(pSsl, 0xD0, NULL, 0) < 0)
+                {
+                    goto done;
+                }
+                continue;
+
+            default: // DISCONNECT and anything else
+                pthread_mutex_unlock(&msLock);
+                goto done;
+        }
+    }
+done:
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/****************** mqttBenchReadPacket *********************
+    Fixed header and body of one packet, the body must fit
+    MQTTBENCH_BUFSIZE.
+************************************************************/
+int mqttBenchReadPacket(SSL *pSsl, int iFd, uint8_t *pType, uint8_t *pBody, int *pLength)
+{
+    uint8_t bByte;
+    int iMultiplier = 1;
+    int iRead = 0;
+    int iResult;
+    int i;
+
+    if(SSL_read(pSsl, pType, 1) != 1)
+    {
+        return -1;
+    }
+    *pLength = 0;
+    for(i=0; i<4; i+=1)
+    {
+        if(SSL_read(pSsl, &bByte, 1) != 1)
+        {
+            return -1;
+        }
+        *pLength += (bByte & 0x7f) * iMultiplier;
+        iMultiplier *= 128;
+        if((bByte & 0x80) == 0)
+        {
+            break;
+        }
+    }
+    if(*pLength > MQTTBENCH_BUFSIZE)
+    {
+        return -1;
+    }
+    while(iRead < *pLength)
+    {
+        iResult = SSL_read(pSsl, &pBody[iRead], *pLength - iRead);
+        if(iResult <= 0)
+        {
+            return -1;
+        }
+        iRead += iResult;
+    }
+    return 0;
+}
+
+int mqttBenchWritePacket(SSL *pSsl, uint8_t bType, const uint8_t *pBody, int iLength)
+{
+    uint8_t abPacket[MQTTBENCH_BUFSIZE];
+    int iPos = 1;
+    int iRemaining = iLength;
+
+    abPacket[0] = bType;
+    do
+    {
+        abPacket[iPos] = iRemaining % 128;
+        iRemaining /= 128;
+        abPacket[iPos] |= (iRemaining > 0) ? 0x80 : 0x00;
+        iPos += 1;
+    } while(iRemaining > 0);
+    if(iLength > 0)
+    {
+        memcpy(&abPacket[iPos], pBody, iLength);
+    }
+    return (SSL_write(pSsl, abPacket, iPos + iLength) == iPos + iLength) ? 0 : -1;
+}
+
+/**************** mqttBenchPublishDownlink ******************
+    QoS 1 on the device's downlink topic.
+************************************************************/
+int mqttBenchPublishDownlink(SSL *pSsl, const uint8_t *pPayload)
+{
+    static uint16_t uiPacketId = 0;
+    uint8_t abBody[128];
+    int iTopicLength = strlen(msDownlinkTopic);
+    int iPos = 0;
+
+    uiPacketId = (uiPacketId == 0xffff) ? 1 : uiPacketId + 1;
+    abBody[iPos++] = (uint8_t)(iTopicLength >> 8);
+    abBody[iPos++] = (uint8_t)(iTopicLength & 0xff);
+    memcpy(&abBody[iPos], msDownlinkTopic, iTopicLength);
+    iPos += iTopicLength;
+    abBody[iPos++] = (uint8_t)(uiPacketId >> 8);
+    abBody[iPos++] = (uint8_t)(uiPacketId & 0xff);
+    memcpy(&abBody[iPos], pPayload, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    iPos += STRUCTS_DECKEDREPLYPAYLOADSIZE;
+    pthread_mutex_lock(&msLock);
+    msBroker.downlinks += 1;
+    pthread_mutex_unlock(&msLock);
+    return mqttBenchWritePacket(pSsl, 0x30 | (1 << 1), abBody, iPos);
+}
+
+/********************* mqttBenchProxy ***********************
+    Relays one client connection to its server, every chunk
+    RTT/2 late, the first client chunk one RTT more for the
+    TCP handshake. Counts the bytes both ways.
+************************************************************/
+void *mqttBenchProxy(void *pArg)
+{
+    tMqttBenchConnection *pConnection = (tMqttBenchConnection *)pArg;
+    int iClientFd = pConnection->fd;
+    tMqttBenchDirection *pUp = calloc(1, sizeof(tMqttBenchDirection));
+    tMqttBenchDirection *pDown = calloc(1, sizeof(tMqttBenchDirection));
+    struct sockaddr_in sAddr;
+    struct pollfd asPoll[2];
+    uint32_t uiHandshakeUs = muiRttMs * 1000;
+    uint64_t ulNowUs;
+    uint64_t ulDueUs;
+    int iTimeoutMs;
+    int iServerFd;
+    int iNoDelay = 1;
+
+    iServerFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(pConnection->targetPort);
+    free(pArg);
+    pthread_mutex_lock(&msLock);
+    muiProxied += 1;
+    pthread_mutex_unlock(&msLock);
+    setsockopt(iClientFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay)); // a held chunk goes out when due, not after the peer's delayed ack
+    setsockopt(iServerFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+    if(pUp != NULL && pDown != NULL && iServerFd >= 0 && connect(iServerFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) == 0)
+    {
+        pUp->fromFd = iClientFd;
+        pUp->toFd = iServerFd;
+        pDown->fromFd = iServerFd;
+        pDown->toFd = iClientFd;
+        while(!(pUp->eof && pUp->count == 0 && pDown->eof && pDown->count == 0))
+        {
+            asPoll[0].fd = (pUp->eof || pUp->count == MQTTBENCH_MAXCHUNKS) ? -1 : iClientFd;
+            asPoll[1].fd = (pDown->eof || pDown->count == MQTTBENCH_MAXCHUNKS) ? -1 : iServerFd;
+            asPoll[0].events = POLLIN;
+            asPoll[1].events = POLLIN;
+            ulNowUs = printGetMonotonicTimeUs();
+            iTimeoutMs = 100;
+            if(pUp->count > 0 || pDown->count > 0)
+            {
+                ulDueUs = (pDown->count == 0 || (pUp->count > 0 && pUp->chunks[pUp->head].dueUs < pDown->chunks[pDown->head].dueUs)) ? pUp->chunks[pUp->head].dueUs : pDown->chunks[pDown->head].dueUs;
+                iTimeoutMs = (ulDueUs > ulNowUs) ? (int)((ulDueUs - ulNowUs + 999) / 1000) : 0;
+            }
+            poll(asPoll, 2, iTimeoutMs);
+            if((asPoll[0].fd >= 0 && (asPoll[0].revents & (POLLIN | POLLHUP | POLLERR)) && mqttBenchPump(pUp, uiHandshakeUs) < 0) ||
+                (asPoll[1].fd >= 0 && (asPoll[1].revents & (POLLIN | POLLHUP | POLLERR)) && mqttBenchPump(pDown, 0) < 0))
+            {
+                break;
+            }
+            uiHandshakeUs = (pUp->count > 0 || pUp->eof) ? 0 : uiHandshakeUs;
+            ulNowUs = printGetMonotonicTimeUs();
+            if(mqttBenchFlush(pUp, ulNowUs) < 0 || mqttBenchFlush(pDown, ulNowUs) < 0)
+            {
+                break;
+            }
+        }
+    }
+    if(iServerFd >= 0)
+    {
+        close(iServerFd);
+    }
+    close(iClientFd);
+    free(pUp);
+    free(pDown);
+    return NULL;
+}
+
+/********************** mqttBenchPump ***********************
+    Reads what arrived into a chunk held until RTT/2 (plus
+    uiExtraUs) from now.
+************************************************************/
+int mqttBenchPump(tMqttBenchDirection *pDirection, uint32_t uiExtraUs)
+{
+    tMqttBenchChunk *pChunk = &pDirection->chunks[(pDirection->head + pDirection->count) % MQTTBENCH_MAXCHUNKS];
+    int iResult = read(pDirection->fromFd, pChunk->data, MQTTBENCH_CHUNKSIZE);
+
+    if(iResult < 0)
+    {
+        return -1;
+    }
+    if(iResult == 0)
+    {
+        pDirection->eof = true;
+        return 0;
+    }
+    pthread_mutex_lock(&msLock);
+    mulWireBytes += iResult;
+    pthread_mutex_unlock(&msLock);
+    pChunk->length = iResult;
+    pChunk->dueUs = printGetMonotonicTimeUs() + muiRttMs * 500 + uiExtraUs;
+    pDirection->count += 1;
+    return 0;
+}
+
+/********************** mqttBenchFlush **********************
+    Forwards the chunks that are due, passes the end of the
+    stream on once nothing is held anymore.
+************************************************************/
+int mqttBenchFlush(tMqttBenchDirection *pDirection, uint64_t ulNowUs)
+{
+    tMqttBenchChunk *pChunk;
+
+    while(pDirection->count > 0 && pDirection->chunks[pDirection->head].dueUs <= ulNowUs)
+    {
+        pChunk = &pDirection->chunks[pDirection->head];
+        if(send(pDirection->toFd, pChunk->data, pChunk->length, MSG_NOSIGNAL) != pChunk->length)
+        {
+            return -1;
+        }
+        pDirection->head = (pDirection->head + 1) % MQTTBENCH_MAXCHUNKS;
+        pDirection->count -= 1;
+        if(pDirection->count == 0 && pDirection->eof)
+        {
+            shutdown(pDirection->toFd, SHUT_WR);
+        }
+    }
+    return 0;
+}
+
+int mqttBenchWriteConfig(const char *sTransport, uint16_t uiPort)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = %s\nhost = 127.0.0.1\ndevice_id = %s\nhttp_port = %u\nmqtt_port = %u\nuse_ssl = yes\nktls = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = %u\n",
+        sTransport, MQTTBENCH_DEVICEID, uiPort, uiPort, MQTTBENCH_SOCKETSEC);
+    fclose(pFile);
+    return 0;
+}
+
+int mqttBenchLoad(const char *sTransport, uint16_t uiPort)
+{
+    return (mqttBenchWriteConfig(sTransport, uiPort) < 0 || configInit(msConfigPath) < 0 || commsInit() < 0) ? -1 : 0;
+}
+
+/********************** mqttBenchSend ***********************
+    One event asking for a downlink, 0 when the decked
+    reply got its echo.
+************************************************************/
+int mqttBenchSend(uint32_t uiCounter)
+{
+    tUplinkRecord sRecord;
+
+    memset(&sRecord, 0, sizeof(sRecord));
+    memset(getCtrlDeckedReply()->payload, 0xff, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    sRecord.cmd.cmdCode = 0x02;
+    sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sRecord.cmd.downlinkIndicator = 0x01;
+    sRecord.priorityClass = UPLCLASS_EVENT;
+    memcpy(sRecord.cmd.payload, &uiCounter, sizeof(uiCounter));
+    sRecord.time = time(NULL);
+    if(commsSendUplink(&sRecord) < 0 || memcmp(getCtrlDeckedReply()->payload, &uiCounter, sizeof(uiCounter)) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*********************** mqttBenchRun ***********************
+    The events one after the other, each timed from
+    commsSendUplink() to its downlink.
+************************************************************/
+int mqttBenchRun(tMqttBenchRun *pRun, uint32_t uiEvents)
+{
+    uint64_t ulBytesBefore;
+    uint32_t uiProxiedBefore;
+    uint64_t ulStartUs;
+    uint32_t i;
+
+    mqttBenchQuiet(true);
+    if(mqttBenchLoad(pRun->transport, pRun->port) < 0)
+    {
+        mqttBenchQuiet(false);
+        return -1;
+    }
+    pthread_mutex_lock(&msLock);
+    ulBytesBefore = mulWireBytes;
+    uiProxiedBefore = muiProxied;
+    pthread_mutex_unlock(&msLock);
+    for(i=0; i<uiEvents; i+=1)
+    {
+        ulStartUs = printGetMonotonicTimeUs();
+        pRun->ok += (mqttBenchSend(i) == 0) ? 1 : 0;
+        mauiLatencyUs[i] = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+        if(i == 0)
+        {
+            usleep(muiRttMs * 1000); // what is still on its way belongs to the first
+            pthread_mutex_lock(&msLock);
+            pRun->firstBytes = mulWireBytes - ulBytesBefore;
+            pthread_mutex_unlock(&msLock);
+        }
+    }
+    usleep(muiRttMs * 1000);
+    pthread_mutex_lock(&msLock);
+    pRun->bytes = mulWireBytes - ulBytesBefore;
+    pRun->connections = muiProxied - uiProxiedBefore;
+    pthread_mutex_unlock(&msLock);
+    mqttBenchQuiet(false);
+
+    pRun->firstUs = mauiLatencyUs[0];
+    qsort(&mauiLatencyUs[1], uiEvents - 1, sizeof(uint32_t), mqttBenchCompare);
+    pRun->medianUs = mauiLatencyUs[1 + (uiEvents - 2) / 2];
+    pRun->maxUs = mauiLatencyUs[uiEvents - 1];
+    return 0;
+}
+
+bool mqttBenchCheck(const char *sName, bool bPass, const char *sDetail)
+{
+    fprintf(stderr, "%-9s %-4s %s\n", sName, bPass ? "ok" : "FAIL", sDetail);
+    return bPass;
+}
+
+int mqttBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void mqttBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
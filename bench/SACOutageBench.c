@@ -0,0 +1,584 @@
+/*
+    Server outage against the circuit breaker, run with
+    "make outagebench".
+
+    The daemon's state machine runs over the simulated BSC
+    (like SACAsyncBench) with the real http transport to a
+    local stand-in server, [timeouts] socket_sec 1. Every
+    -i ms the controller sends a lockstep 0x02 asking for a
+    downlink, the server echoes its counter after -r ms.
+    After -u seconds the server goes silent for -o seconds:
+    it still accepts and reads, but never answers, like a
+    backend behind a dead mobile link. Then it answers again
+    and the run goes on until the breaker closed, the
+    backlog of the outage is out and OUTAGEBENCH_AFTERMS
+    more.
+    Reported per phase, as the controller sees it:
+        up:       command latency;
+        outage:   SERVERUNREACH without a network round
+                  (breaker open) and the ones that waited for
+                  the socket timeout (closed or half open
+                  trial), the open periods of the breaker;
+        recovery: the server answers, the breaker is still
+                  open until the half open trial;
+        backlog:  breaker closed, the events queued during
+                  the outage go out first (oldest first, up to
+                  UPLSCHED_MAXSENDSPERPASS per command, the
+                  drain on the other exchanges), the command
+                  they hold back gets BUSY, not SERVERUNREACH;
+        drained:  back to normal.
+
+    Usage:
+        SACOutageBench [-u seconds] [-o seconds] [-i ms] [-r ms] [-v]
+    Exit code 1 when a command failed with the server up, a
+    fast SERVERUNREACH took over OUTAGEBENCH_MAXFASTMS, more
+    commands than CB_FAILURETHRESHOLD and one per half open
+    trial waited for the timeout, the breaker did not close
+    through half open within the next open period, a
+    command got SERVERUNREACH after the close, the backlog
+    did not drain or a command after that failed.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACBenchBsc.h"
+
+#define OUTAGEBENCH_UPSEC       3
+#define OUTAGEBENCH_OUTAGESEC   20
+#define OUTAGEBENCH_INTERVALMS  200 // between two controller commands
+#define OUTAGEBENCH_LATENCYMS   20 // of the server
+#define OUTAGEBENCH_SOCKETSEC   1 // [timeouts] socket_sec
+#define OUTAGEBENCH_AFTERMS     3000 // traffic after the backlog drained
+#define OUTAGEBENCH_GRACESEC    30 // the run ends at the latest this long after twice the outage
+#define OUTAGEBENCH_MAXCOMMANDS 4096
+#define OUTAGEBENCH_MAXOPENS    32
+#define OUTAGEBENCH_MAXFASTMS   50 // fast SERVERUNREACH: the bus transfers and a pass of the state machine
+#define OUTAGEBENCH_BUFSIZE     4096
+#define OUTAGEBENCH_BYTEUS      90 // 9 bits per byte at 100 kHz
+#define OUTAGEBENCH_FRAMEUS     120 // start, address byte and stop per transfer
+#define OUTAGEBENCH_RETRYUS     2000 // controller retry after a NACK
+
+typedef enum
+{
+    CTRL_WAIT, // for the next command's turn
+    CTRL_READENA, // read enable until the slave takes it
+    CTRL_READREPLY,
+} tCtrlStep;
+
+typedef enum
+{
+    PHASE_UP,
+    PHASE_OUTAGE,
+    PHASE_RECOVERY, // server answers again, breaker not closed yet
+    PHASE_BACKLOG, // breaker closed, the outage's backlog goes out
+    PHASE_DRAINED,
+    PHASE_COUNT,
+} tOutagePhase;
+
+typedef struct
+{
+    uint32_t commands;
+    uint32_t ok;
+    uint32_t wrong; // not its own downlink or an error code other than SERVERUNREACH and BUSY
+    uint32_t busy; // BUSY, held back by the backlog
+    uint32_t fast; // SERVERUNREACH within OUTAGEBENCH_MAXFASTMS
+    uint32_t waited; // SERVERUNREACH after that
+    uint32_t fastUs[OUTAGEBENCH_MAXCOMMANDS];
+    uint32_t okUs[OUTAGEBENCH_MAXCOMMANDS];
+    uint32_t waitedMaxUs;
+} tOutagePhaseStats;
+
+typedef struct
+{
+    volatile bool silent; // accepts and reads, never answers
+    volatile bool running;
+    int listenFd;
+    uint16_t port;
+    pthread_t thread;
+} tOutageServer;
+
+/****************** daemon internals driven by the benchmark *********************/
+extern tSmState sState;
+uint8_t slave_init();
+void slaveService();
+void slaveHousekeeping(int iFd, uint32_t uiEvents, void *pContext);
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int outageBenchListen(tOutageServer *pServer);
+void *outageBenchServer(void *pArg);
+void *outageBenchConnection(void *pArg);
+int outageBenchWriteConfig(const char *sPath, uint16_t uiPort);
+void outageBenchControllerStep(uint64_t ulNowUs);
+void outageBenchTraceBreaker(uint64_t ulNowUs);
+uint32_t outageBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent);
+int outageBenchCompare(const void *pA, const void *pB);
+void outageBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static uint32_t muiIntervalMs = OUTAGEBENCH_INTERVALMS;
+static uint32_t muiLatencyMs = OUTAGEBENCH_LATENCYMS;
+static tOutageServer msServer;
+static tOutagePhaseStats masPhases[PHASE_COUNT];
+static tOutagePhase mePhase = PHASE_UP;
+static tOutagePhase meCtrlPhase = PHASE_UP; // when the command was written
+static tCtrlStep meCtrlStep = CTRL_WAIT;
+static uint64_t mulCtrlBusyUntilUs = 0; // bus transfer, retry wait or interval in progress
+static uint64_t mulCtrlSentUs = 0;
+static uint32_t muiCtrlCommands = 0;
+static tCircuitState meTracedState = CB_CLOSED;
+static uint64_t mulOpenedUs = 0;
+static uint32_t mauiOpenMs[OUTAGEBENCH_MAXOPENS]; // open periods until half open
+static uint32_t muiOpens = 0;
+static uint64_t mulClosedUs = 0; // breaker closed after the outage
+static uint32_t muiBacklogAtClose = 0;
+static uint64_t mulDrainedUs = 0;
+static bool mbHalfOpenAfterOutage = false; // went half open after the server answered again
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const char *masPhaseNames[PHASE_COUNT] = {"up", "outage", "recovery", "backlog", "drained"};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    char sConfigPath[64];
+    uint32_t uiUpSec = OUTAGEBENCH_UPSEC;
+    uint32_t uiOutageSec = OUTAGEBENCH_OUTAGESEC;
+    uint64_t ulStartUs;
+    uint64_t ulNowUs;
+    uint64_t ulHousekeepingUs;
+    uint64_t ulBackUs = 0; // server answers again
+    uint64_t ulDeadlineUs;
+    uint32_t uiRecoveryBoundMs;
+    bool bVerbose = false;
+    bool bPass = true;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "u:o:i:r:v")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'u': uiUpSec = atoi(optarg); break;
+            case 'o': uiOutageSec = atoi(optarg); break;
+            case 'i': muiIntervalMs = atoi(optarg); break;
+            case 'r': muiLatencyMs = atoi(optarg); break;
+            case 'v': bVerbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-u seconds] [-o seconds] [-i ms] [-r ms] [-v]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiUpSec == 0 || uiOutageSec == 0 || muiIntervalMs < 10 || (uiUpSec + 2 * uiOutageSec) * 1000 / muiIntervalMs >= OUTAGEBENCH_MAXCOMMANDS)
+    {
+        fprintf(stderr, "Need up and outage seconds and fewer than %u commands (interval >= 10 ms).\n", OUTAGEBENCH_MAXCOMMANDS);
+        return 2;
+    }
+    snprintf(sConfigPath, sizeof(sConfigPath), "/tmp/SACOutageBench.%i.conf", (int)getpid());
+    signal(SIGPIPE, SIG_IGN);
+    memset(&msServer, 0, sizeof(msServer));
+    msServer.running = true;
+    if(outageBenchListen(&msServer) < 0 || pthread_create(&msServer.thread, NULL, outageBenchServer, &msServer) != 0 || outageBenchWriteConfig(sConfigPath, msServer.port) < 0)
+    {
+        fprintf(stderr, "Could not start the local server.\n");
+        return 2;
+    }
+
+    outageBenchQuiet(!bVerbose);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    if(configInit(sConfigPath) < 0 || commsInit() < 0)
+    {
+        outageBenchQuiet(false);
+        fprintf(stderr, "Could not load %s.\n", sConfigPath);
+        return 2;
+    }
+    benchBscReset();
+    slave_init();
+    outageBenchQuiet(false);
+    fprintf(stderr, "up %u s, silent %u s, then up, a command every %u ms, server latency %u ms, socket timeout %u s\n",
+        uiUpSec, uiOutageSec, muiIntervalMs, muiLatencyMs, OUTAGEBENCH_SOCKETSEC);
+
+    outageBenchQuiet(!bVerbose);
+    ulStartUs = printGetMonotonicTimeUs();
+    ulNowUs = ulStartUs;
+    ulHousekeepingUs = ulStartUs;
+    mulCtrlBusyUntilUs = ulStartUs;
+    ulDeadlineUs = ulStartUs + (uiUpSec + 2ULL * uiOutageSec + OUTAGEBENCH_GRACESEC) * 1000000ULL;
+    while(ulNowUs < ulDeadlineUs && (mePhase != PHASE_DRAINED || ulNowUs - mulDrainedUs < OUTAGEBENCH_AFTERMS * 1000ULL || meCtrlStep != CTRL_WAIT))
+    {
+        if(mePhase == PHASE_UP && ulNowUs - ulStartUs >= uiUpSec * 1000000ULL)
+        {
+            mePhase = PHASE_OUTAGE;
+            msServer.silent = true;
+        }
+        else if(mePhase == PHASE_OUTAGE && ulNowUs - ulStartUs >= (uiUpSec + uiOutageSec) * 1000000ULL)
+        {
+            mePhase = PHASE_RECOVERY;
+            msServer.silent = false;
+            ulBackUs = ulNowUs;
+        }
+        else if(mePhase == PHASE_BACKLOG && uplinkSchedPending() == 0)
+        {
+            mePhase = PHASE_DRAINED;
+            mulDrainedUs = ulNowUs;
+        }
+        if(ulNowUs >= mulCtrlBusyUntilUs)
+        {
+            outageBenchControllerStep(ulNowUs);
+        }
+        slaveService();
+        if(ulNowUs >= ulHousekeepingUs)
+        {
+            slaveHousekeeping(-1, 0, NULL);
+            ulHousekeepingUs = ulNowUs + configGet()->housekeepingIntervalMs * 1000ULL;
+        }
+        reactorRunOnce(1);
+        ulNowUs = printGetMonotonicTimeUs();
+        outageBenchTraceBreaker(ulNowUs);
+    }
+    outageBenchQuiet(false);
+
+    fprintf(stderr, "%-9s %8s %6s %6s %6s %9s %9s %6s %9s %9s %7s %12s\n", "phase", "commands", "ok", "busy", "wrong", "ok p50", "ok p99", "fast", "fast p50", "fast p99", "waited", "waited max");
+    for(i=0; i<PHASE_COUNT; i+=1)
+    {
+        tOutagePhaseStats *pStats = &masPhases[i];
+        fprintf(stderr, "%-9s %8u %6u %6u %6u %6.1f ms %6.1f ms %6u %6.1f ms %6.1f ms %7u %9.1f ms\n", masPhaseNames[i], pStats->commands, pStats->ok, pStats->busy, pStats->wrong,
+            outageBenchPercentile(pStats->okUs, pStats->ok, 50) / 1000.0, outageBenchPercentile(pStats->okUs, pStats->ok, 99) / 1000.0,
+            pStats->fast, outageBenchPercentile(pStats->fastUs, pStats->fast, 50) / 1000.0, outageBenchPercentile(pStats->fastUs, pStats->fast, 99) / 1000.0,
+            pStats->waited, pStats->waitedMaxUs / 1000.0);
+    }
+    fprintf(stderr, "open periods until half open:");
+    for(i=0; i<(int)muiOpens; i+=1)
+    {
+        fprintf(stderr, " %u", mauiOpenMs[i]);
+    }
+    fprintf(stderr, " ms\n");
+    uiRecoveryBoundMs = ((muiOpens > 0) ? mauiOpenMs[muiOpens - 1] : CB_BACKOFFMINMS) * 3 + OUTAGEBENCH_SOCKETSEC * 1000; // the next period doubles, plus up to half of it jitter
+    if(mulClosedUs > 0)
+    {
+        fprintf(stderr, "recovery: breaker closed %.1f ms after the server answered again (%s half open), bound %u ms\n",
+            (mulClosedUs - ulBackUs) / 1000.0, mbHalfOpenAfterOutage ? "through" : "not through", uiRecoveryBoundMs);
+    }
+    else
+    {
+        fprintf(stderr, "recovery: breaker did not close\n");
+    }
+    if(mulDrainedUs > 0)
+    {
+        fprintf(stderr, "backlog: %u uplinks queued at the close, out %.1f ms later\n", muiBacklogAtClose, (mulDrainedUs - mulClosedUs) / 1000.0);
+    }
+    else
+    {
+        fprintf(stderr, "backlog: did not drain, %u queued\n", uplinkSchedPending());
+    }
+
+    bPass = bPass && masPhases[PHASE_UP].commands > 0 && masPhases[PHASE_UP].ok == masPhases[PHASE_UP].commands;
+    bPass = bPass && masPhases[PHASE_OUTAGE].fast > 0 && outageBenchPercentile(masPhases[PHASE_OUTAGE].fastUs, masPhases[PHASE_OUTAGE].fast, 100) <= OUTAGEBENCH_MAXFASTMS * 1000;
+    bPass = bPass && masPhases[PHASE_OUTAGE].wrong == 0 && masPhases[PHASE_OUTAGE].waited <= CB_FAILURETHRESHOLD + muiOpens;
+    bPass = bPass && mulClosedUs > 0 && mbHalfOpenAfterOutage && (mulClosedUs - ulBackUs) <= uiRecoveryBoundMs * 1000ULL;
+    bPass = bPass && masPhases[PHASE_BACKLOG].wrong == 0 && masPhases[PHASE_BACKLOG].fast + masPhases[PHASE_BACKLOG].waited == 0;
+    bPass = bPass && masPhases[PHASE_DRAINED].commands > 0 && masPhases[PHASE_DRAINED].ok == masPhases[PHASE_DRAINED].commands;
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+
+    msServer.running = false;
+    pthread_join(msServer.thread, NULL);
+    commsClose();
+    unlink(sConfigPath);
+    return bPass ? 0 : 1;
+}
+
+/************** outageBenchControllerStep *******************
+    One bus transaction of the controller: the command when
+    its turn came, read enables until the slave takes one,
+    the reply. Counted in the phase it was written in.
+************************************************************/
+void outageBenchControllerStep(uint64_t ulNowUs)
+{
+    static const uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    tOutagePhaseStats *pStats = &masPhases[meCtrlPhase];
+    tCtrlSendCmd sSend;
+    uint8_t abReply[STRUCTS_DECKEDREPLYTOTALSIZE];
+    uint32_t uiCounter = muiCtrlCommands;
+    uint32_t uiLatencyUs;
+    int iLength;
+
+    switch(meCtrlStep)
+    {
+        case CTRL_WAIT:
+            if(mePhase == PHASE_DRAINED && ulNowUs - mulDrainedUs >= OUTAGEBENCH_AFTERMS * 1000ULL)
+            {
+                break; // done
+            }
+            memset(&sSend, 0, sizeof(sSend));
+            sSend.startTag = IOT_FRMSTARTTAG;
+            sSend.cmdCode = 0x02;
+            sSend.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+            sSend.downlinkIndicator = 0x01;
+            memcpy(sSend.payload, &uiCounter, sizeof(uiCounter));
+            sSend.endTag = IOT_FRMENDTAG;
+            mulCtrlSentUs = ulNowUs;
+            meCtrlPhase = mePhase;
+            benchBscControllerWrite(sSend.ui8, sizeof(sSend.ui8));
+            mulCtrlBusyUntilUs = ulNowUs + OUTAGEBENCH_FRAMEUS + sizeof(sSend.ui8) * OUTAGEBENCH_BYTEUS;
+            meCtrlStep = CTRL_READENA;
+            break;
+
+        case CTRL_READENA:
+            if((getRawBCSCReg(3) & 0x1) == 0)
+            {
+                mulCtrlBusyUntilUs = ulNowUs + OUTAGEBENCH_FRAMEUS + OUTAGEBENCH_RETRYUS; // the slave holds the bus off while the uplink is on its way
+                break;
+            }
+            benchBscControllerWrite(abReadEnaFrame, sizeof(abReadEnaFrame));
+            mulCtrlBusyUntilUs = ulNowUs + OUTAGEBENCH_FRAMEUS + sizeof(abReadEnaFrame) * OUTAGEBENCH_BYTEUS;
+            meCtrlStep = CTRL_READREPLY;
+            break;
+
+        case CTRL_READREPLY:
+            memset(abReply, 0, sizeof(abReply));
+            iLength = benchBscControllerRead(abReply, sizeof(abReply));
+            uiLatencyUs = (uint32_t)(printGetMonotonicTimeUs() - mulCtrlSentUs);
+            pStats->commands += 1;
+            if(iLength == STRUCTS_DECKEDREPLYTOTALSIZE && abReply[2] == I2CERRORCODE_OK && memcmp(&abReply[4], &uiCounter, sizeof(uiCounter)) == 0)
+            {
+                pStats->okUs[pStats->ok++] = uiLatencyUs;
+            }
+            else if(abReply[2] == I2CERRORCODE_SERVERUNREACH && uiLatencyUs <= OUTAGEBENCH_MAXFASTMS * 1000)
+            {
+                pStats->fastUs[pStats->fast++] = uiLatencyUs;
+            }
+            else if(abReply[2] == I2CERRORCODE_BUSY)
+            {
+                pStats->busy += 1;
+            }
+            else if(abReply[2] == I2CERRORCODE_SERVERUNREACH)
+            {
+                pStats->waited += 1;
+                pStats->waitedMaxUs = (uiLatencyUs > pStats->waitedMaxUs) ? uiLatencyUs : pStats->waitedMaxUs;
+            }
+            else
+            {
+                pStats->wrong += 1;
+            }
+            muiCtrlCommands += 1;
+            mulCtrlBusyUntilUs = mulCtrlSentUs + muiIntervalMs * 1000ULL;
+            meCtrlStep = CTRL_WAIT;
+            break;
+    }
+}
+
+/************** outageBenchTraceBreaker *********************
+    Open periods until the breaker let the next trial out,
+    and the close after the server came back.
+************************************************************/
+void outageBenchTraceBreaker(uint64_t ulNowUs)
+{
+    tCircuitState eState = commsGetCircuitState();
+
+    if(eState == meTracedState)
+    {
+        return;
+    }
+    if(eState == CB_OPEN)
+    {
+        mulOpenedUs = ulNowUs;
+    }
+    else if(eState == CB_HALFOPEN && meTracedState == CB_OPEN && muiOpens < OUTAGEBENCH_MAXOPENS)
+    {
+        mauiOpenMs[muiOpens++] = (uint32_t)((ulNowUs - mulOpenedUs) / 1000);
+    }
+    if(eState == CB_HALFOPEN && mePhase == PHASE_RECOVERY)
+    {
+        mbHalfOpenAfterOutage = true;
+    }
+    if(eState == CB_CLOSED && mePhase == PHASE_RECOVERY)
+    {
+        mePhase = PHASE_BACKLOG;
+        mulClosedUs = ulNowUs;
+        muiBacklogAtClose = uplinkSchedPending();
+    }
+    meTracedState = eState;
+}
+
+/******************** outageBenchListen *********************/
+int outageBenchListen(tOutageServer *pServer)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+    int iEnable = 1;
+
+    pServer->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(pServer->listenFd, SOL_SOCKET, SO_REUSEADDR, &iEnable, sizeof(iEnable));
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(pServer->listenFd < 0 || bind(pServer->listenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(pServer->listenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(pServer->listenFd, (struct sockaddr *)&sAddr, &uiLength);
+    pServer->port = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/******************** outageBenchServer *********************
+    Accepts until stopped, a thread per connection.
+************************************************************/
+void *outageBenchServer(void *pArg)
+{
+    tOutageServer *pServer = (tOutageServer *)pArg;
+    struct pollfd sPoll;
+    pthread_t sThread;
+    int *pFd;
+    int iFd;
+
+    while(pServer->running)
+    {
+        sPoll.fd = pServer->listenFd;
+        sPoll.events = POLLIN;
+        if(poll(&sPoll, 1, 20) <= 0)
+        {
+            continue;
+        }
+        iFd = accept(pServer->listenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pFd = malloc(sizeof(int));
+        *pFd = iFd;
+        if(pthread_create(&sThread, NULL, outageBenchConnection, pFd) != 0)
+        {
+            close(iFd);
+            free(pFd);
+            continue;
+        }
+        pthread_detach(sThread);
+    }
+    close(pServer->listenFd);
+    return NULL;
+}
+
+/****************** outageBenchConnection *******************
+    One request per connection: the echo after the latency.
+    Silent: the request is read and left unanswered until
+    the client gives up or the server is back, the
+    connection is then closed without an answer.
+************************************************************/
+void *outageBenchConnection(void *pArg)
+{
+    int iFd = *(int *)pArg;
+    char sBuffer[OUTAGEBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9] = "00000000";
+    char *pData;
+    struct pollfd sPoll;
+    int iLength = 0;
+    int iResult;
+
+    free(pArg);
+    sBuffer[0] = 0x00;
+    while(strstr(sBuffer, "\r\n\r\n") == NULL)
+    {
+        iResult = read(iFd, &sBuffer[iLength], sizeof(sBuffer) - 1 - iLength);
+        if(iResult <= 0)
+        {
+            close(iFd);
+            return NULL;
+        }
+        iLength += iResult;
+        sBuffer[iLength] = 0x00;
+    }
+    if(msServer.silent)
+    {
+        sPoll.fd = iFd;
+        sPoll.events = POLLIN;
+        while(msServer.silent && msServer.running && poll(&sPoll, 1, 20) == 0)
+        {
+        }
+        close(iFd);
+        return NULL;
+    }
+    pData = strstr(sBuffer, "&data=");
+    if(pData != NULL)
+    {
+        memcpy(sData, pData + 6, 8);
+    }
+    usleep(muiLatencyMs * 1000);
+    iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACOutageBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+    send(iFd, sResponse, iResult, MSG_NOSIGNAL);
+    close(iFd);
+    return NULL;
+}
+
+int outageBenchWriteConfig(const char *sPath, uint16_t uiPort)
+{
+    FILE *pFile = fopen(sPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = %u\n",
+        uiPort, OUTAGEBENCH_SOCKETSEC);
+    fclose(pFile);
+    return 0;
+}
+
+uint32_t outageBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent)
+{
+    if(uiCount == 0)
+    {
+        return 0;
+    }
+    qsort(auiSamples, uiCount, sizeof(uint32_t), outageBenchCompare);
+    return auiSamples[(uiCount - 1) * uiPercent / 100];
+}
+
+int outageBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void outageBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,382 @@
+/*
+    HTTP/1.1 pipelining drain time, run with "make pipebench".
+
+    A local server thread stands in for the webhook: every
+    response goes out one RTT after its request arrived, a new
+    connection costs one more RTT before the first request is
+    seen. Each response carries the first 4 payload bytes of
+    its request back as the downlink, so a response handed to
+    the wrong request is caught.
+    The comms module drains N uplinks through the reactor with
+    [comms] pipeline_depth 1, 8 and 32, then once more with 8
+    while the server closes the connection after every K
+    responses (head of line failure, the tail is replayed).
+
+    Usage:
+        SACPipeBench [-n uplinks] [-r rtt ms] [-k responses per connection] [-d dir]
+    Exit code 1 when an uplink failed or got another one's
+    downlink, or a run reused the previous run's connection
+    instead of opening its own at the new depth.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+
+#define PIPEBENCH_UPLINKS       1000
+#define PIPEBENCH_RTTMS         200
+#define PIPEBENCH_CLOSEAFTER    50 // fault run: responses per connection
+#define PIPEBENCH_FAULTDEPTH    8
+#define PIPEBENCH_MAXQUEUED     64 // requests the server holds per connection
+#define PIPEBENCH_BUFSIZE       8192
+
+typedef struct
+{
+    uint64_t dueUs;
+    char data[9]; // first 4 payload bytes as hex
+} tPipeBenchPending;
+
+typedef struct
+{
+    uint32_t depth;
+    uint32_t closeAfter; // 0: never
+    double seconds;
+    uint32_t ok;
+    uint32_t failed;
+    uint32_t mismatched;
+    uint32_t replays;
+    uint32_t connections;
+} tPipeBenchRun;
+
+/****************** private function prototypes *********************/
+int pipeBenchListen();
+void *pipeBenchServer(void *pArg);
+void pipeBenchServeConnection(int iFd);
+int pipeBenchWriteConfig(uint32_t uiDepth);
+int pipeBenchRun(tPipeBenchRun *pRun);
+void pipeBenchDone(tUplinkRecord *pRecord, int iResult);
+void pipeBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static int miListenFd = -1;
+static uint16_t muiPort = 0;
+static uint32_t muiRttMs = PIPEBENCH_RTTMS;
+static volatile uint32_t muiCloseAfter = 0;
+static volatile uint32_t muiConnections = 0;
+static volatile bool mbServerRunning = true;
+static uint32_t muiDone = 0;
+static uint32_t muiOk = 0;
+static uint32_t muiFailed = 0;
+static uint32_t muiMismatched = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    tPipeBenchRun asRuns[] =
+    {
+        {.depth = 1},
+        {.depth = 8},
+        {.depth = 32},
+        {.depth = PIPEBENCH_FAULTDEPTH, .closeAfter = PIPEBENCH_CLOSEAFTER},
+    };
+    uint32_t uiUplinks = PIPEBENCH_UPLINKS;
+    uint32_t uiCloseAfter = PIPEBENCH_CLOSEAFTER;
+    pthread_t sThread;
+    bool bPass = true;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "n:r:k:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiUplinks = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'k': uiCloseAfter = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n uplinks] [-r rtt ms] [-k responses per connection] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    asRuns[3].closeAfter = uiCloseAfter;
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACPipeBench.%i.conf", sDir, (int)getpid());
+    if(pipeBenchListen() < 0)
+    {
+        fprintf(stderr, "Could not open the local server.\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, pipeBenchServer, NULL);
+
+    pipeBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    pipeBenchQuiet(false);
+
+    fprintf(stderr, "%u uplinks, %u ms rtt\n", uiUplinks, muiRttMs);
+    for(i=0; i<(int)(sizeof(asRuns) / sizeof(asRuns[0])); i+=1)
+    {
+        tPipeBenchRun *pRun = &asRuns[i];
+        pRun->ok = uiUplinks; // the run's uplink count on the way in
+        if(pipeBenchRun(pRun) < 0)
+        {
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return 1;
+        }
+        fprintf(stderr, "depth %2u%-18s %8.2f s %8.1f uplinks/s  ok %u failed %u mismatched %u replays %u connections %u\n",
+            pRun->depth, (pRun->closeAfter > 0) ? ", server closes" : "", pRun->seconds, pRun->ok / pRun->seconds,
+            pRun->ok, pRun->failed, pRun->mismatched, pRun->replays, pRun->connections);
+        bPass = bPass && pRun->ok == uiUplinks && pRun->mismatched == 0 && pRun->connections > 0;
+    }
+    mbServerRunning = false;
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+int pipeBenchListen()
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    miListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(miListenFd < 0 || bind(miListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(miListenFd, 8) < 0)
+    {
+        return -1;
+    }
+    getsockname(miListenFd, (struct sockaddr *)&sAddr, &uiLength);
+    muiPort = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/******************** pipeBenchServer ***********************
+    One connection at a time, that is all a pipelined client
+    opens.
+************************************************************/
+void *pipeBenchServer(void *pArg)
+{
+    int iFd;
+    while(mbServerRunning)
+    {
+        iFd = accept(miListenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        muiConnections += 1;
+        pipeBenchServeConnection(iFd);
+        close(iFd);
+    }
+    return NULL;
+}
+
+/***************** pipeBenchServeConnection *****************
+    Requests are answered in order, each one RTT after it
+    arrived but not before the connection is one RTT old.
+************************************************************/
+void pipeBenchServeConnection(int iFd)
+{
+    tPipeBenchPending asPending[PIPEBENCH_MAXQUEUED];
+    uint32_t uiHead = 0;
+    uint32_t uiCount = 0;
+    uint32_t uiAnswered = 0;
+    char sBuffer[PIPEBENCH_BUFSIZE];
+    int iLength = 0;
+    uint64_t ulOpenUs = printGetMonotonicTimeUs() + (uint64_t)muiRttMs * 1000ULL;
+    uint64_t ulNowUs;
+    struct pollfd sPoll = {.fd = iFd, .events = POLLIN};
+    char sResponse[256];
+    char *pEnd;
+    char *pData;
+    int iTimeoutMs;
+    int iResult;
+    bool bClosing;
+
+    while(1)
+    {
+        ulNowUs = printGetMonotonicTimeUs();
+        while(uiCount > 0 && asPending[uiHead].dueUs <= ulNowUs)
+        {
+            bClosing = (muiCloseAfter > 0 && (uiAnswered + 1) % muiCloseAfter == 0);
+            iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACPipeBench\r\n%sTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n",
+                bClosing ? "connection: Close\r\n" : "", asPending[uiHead].data); // announced in the case a proxy might use
+            if(send(iFd, sResponse, iResult, MSG_NOSIGNAL) != iResult)
+            {
+                return;
+            }
+            uiHead = (uiHead + 1) % PIPEBENCH_MAXQUEUED;
+            uiCount -= 1;
+            uiAnswered += 1;
+            if(bClosing)
+            {
+                return; // whatever is still queued was seen but never answered
+            }
+        }
+        iTimeoutMs = (uiCount > 0) ? (int)((asPending[uiHead].dueUs - ulNowUs + 999) / 1000) : 100;
+        if(poll(&sPoll, 1, iTimeoutMs) <= 0)
+        {
+            if(!mbServerRunning)
+            {
+                return;
+            }
+            continue;
+        }
+        iResult = read(iFd, &sBuffer[iLength], sizeof(sBuffer) - 1 - iLength);
+        if(iResult <= 0)
+        {
+            return;
+        }
+        iLength += iResult;
+        sBuffer[iLength] = 0x00;
+        ulNowUs = printGetMonotonicTimeUs();
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL && uiCount < PIPEBENCH_MAXQUEUED)
+        {
+            tPipeBenchPending *pPending = &asPending[(uiHead + uiCount) % PIPEBENCH_MAXQUEUED];
+            pEnd += 4;
+            pData = strstr(sBuffer, "&data=");
+            memset(pPending->data, '0', 8);
+            pPending->data[8] = 0x00;
+            if(pData != NULL && pData < pEnd)
+            {
+                memcpy(pPending->data, pData + 6, 8);
+            }
+            pPending->dueUs = ((ulNowUs > ulOpenUs) ? ulNowUs : ulOpenUs) + (uint64_t)muiRttMs * 1000ULL;
+            uiCount += 1;
+            iLength -= (pEnd - sBuffer);
+            memmove(sBuffer, pEnd, iLength + 1);
+        }
+    }
+}
+
+int pipeBenchWriteConfig(uint32_t uiDepth)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = no\npipeline_depth = %u\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n",
+        muiPort, uiDepth);
+    fclose(pFile);
+    return 0;
+}
+
+/********************** pipeBenchRun ************************
+    Keeps the pipeline full until every uplink got its
+    response (or failed for good).
+************************************************************/
+int pipeBenchRun(tPipeBenchRun *pRun)
+{
+    uint32_t uiUplinks = pRun->ok;
+    uint32_t uiStarted = 0;
+    uint32_t uiReplaysBefore = httpPipeReplays();
+    uint32_t uiConnectionsBefore = muiConnections;
+    uint64_t ulStartUs;
+    tUplinkRecord sRecord;
+
+    pipeBenchQuiet(true);
+    if(pipeBenchWriteConfig(pRun->depth) < 0 || configInit(msConfigPath) < 0 || commsInit() < 0)
+    {
+        pipeBenchQuiet(false);
+        return -1;
+    }
+    muiCloseAfter = pRun->closeAfter;
+    muiDone = 0;
+    muiOk = 0;
+    muiFailed = 0;
+    muiMismatched = 0;
+    ulStartUs = printGetMonotonicTimeUs();
+    while(muiDone < uiUplinks)
+    {
+        while(uiStarted - muiDone < pRun->depth && uiStarted < uiUplinks && commsCanStartUplink())
+        {
+            memset(&sRecord, 0, sizeof(sRecord));
+            sRecord.cmd.cmdCode = UPLSCHED_CMDCODE_ALARM;
+            sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+            memcpy(sRecord.cmd.payload, &uiStarted, sizeof(uiStarted));
+            sRecord.time = time(NULL);
+            sRecord.sendStartUs = printGetMonotonicTimeUs();
+            if(commsStartUplink(&sRecord, pipeBenchDone) < 0)
+            {
+                break;
+            }
+            uiStarted += 1;
+        }
+        reactorRunOnce(100);
+    }
+    pRun->seconds = (printGetMonotonicTimeUs() - ulStartUs) / 1e6;
+    pipeBenchQuiet(false);
+    pRun->ok = muiOk;
+    pRun->failed = muiFailed;
+    pRun->mismatched = muiMismatched;
+    pRun->replays = httpPipeReplays() - uiReplaysBefore;
+    pRun->connections = muiConnections - uiConnectionsBefore;
+    return 0;
+}
+
+/********************** pipeBenchDone ***********************
+    The downlink must be the echo of this uplink's payload.
+    Failed uplinks count as done, the bench does not retry.
+************************************************************/
+void pipeBenchDone(tUplinkRecord *pRecord, int iResult)
+{
+    muiDone += 1;
+    if(iResult < 0)
+    {
+        muiFailed += 1;
+        return;
+    }
+    if(memcmp(getCtrlDeckedReply()->payload, pRecord->cmd.payload, sizeof(uint32_t)) != 0)
+    {
+        muiMismatched += 1;
+        return;
+    }
+    muiOk += 1;
+}
+
+void pipeBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,665 @@
+/*
+    I2C service latency of the reactor with uplinks in
+    flight, run with "make reactorbench".
+
+    A thread plays pigpio's event thread: every 2..5 ms
+    (random) it signals the bsc eventfd, as the PI_EVENT_BSC
+    callback does. The service latency is the time from the
+    oldest signal the loop has not handled yet to its
+    callback, several signals before the loop gets to it
+    count as one service from the oldest.
+    Meanwhile the non-blocking http transport keeps N uplinks
+    in flight (commsStartUplink, a new one as soon as one is
+    done) against a local TLS webhook behind a proxy thread
+    that holds every chunk RTT/2 in each direction plus one
+    RTT on a connection's first chunk for the TCP handshake.
+    Runs of -s seconds each: 0, 1 and COMMS_MAXINFLIGHT in
+    flight through the reactor, then the blocking loop that
+    calls commsSendUplink() and serves the events in between.
+    Reported per run: events, p50, p99 and max service
+    latency, uplinks per second.
+
+    Usage:
+        SACReactorBench [-s seconds] [-r rtt ms]
+    Exit code 1 when an uplink failed, the reactor's p99 with
+    COMMS_MAXINFLIGHT in flight is over REACTORBENCH_MAXP99US
+    or its uplink rate did not grow with the exchanges.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+
+#define REACTORBENCH_SECONDS    5
+#define REACTORBENCH_RTTMS      100
+#define REACTORBENCH_MINGAPUS   2000 // between two bsc events
+#define REACTORBENCH_MAXGAPUS   5000
+#define REACTORBENCH_MAXSAMPLES 100000
+#define REACTORBENCH_MAXP99US   2000
+#define REACTORBENCH_MINSPEEDUP 2.0 // uplinks/s with COMMS_MAXINFLIGHT against 1 in flight
+#define REACTORBENCH_BUFSIZE    8192
+#define REACTORBENCH_CHUNKSIZE  4096
+#define REACTORBENCH_MAXCHUNKS  16 // held per direction and connection
+
+typedef struct
+{
+    uint64_t dueUs;
+    int length;
+    uint8_t data[REACTORBENCH_CHUNKSIZE];
+} tReactorBenchChunk;
+
+typedef struct
+{
+    int fromFd;
+    int toFd;
+    tReactorBenchChunk chunks[REACTORBENCH_MAXCHUNKS];
+    uint32_t head;
+    uint32_t count;
+    bool eof;
+} tReactorBenchDirection;
+
+typedef struct
+{
+    int listenFd;
+    uint16_t port;
+    uint16_t targetPort; // proxy: where to, 0 for the webhook
+} tReactorBenchListener;
+
+typedef struct
+{
+    int fd;
+    uint16_t targetPort;
+} tReactorBenchConnection;
+
+typedef struct
+{
+    const char *name;
+    uint32_t inFlight;
+    bool blocking;
+    uint32_t events;
+    uint32_t services;
+    uint32_t p50Us;
+    uint32_t p99Us;
+    uint32_t maxUs;
+    uint32_t uplinks;
+    uint32_t failed;
+    double uplinksPerSec;
+} tReactorBenchRun;
+
+/****************** private function prototypes *********************/
+int reactorBenchListen(tReactorBenchListener *pListener);
+int reactorBenchServerContext();
+void *reactorBenchAccept(void *pArg);
+void *reactorBenchServer(void *pArg);
+void *reactorBenchProxy(void *pArg);
+int reactorBenchPump(tReactorBenchDirection *pDirection, uint32_t uiExtraUs);
+int reactorBenchFlush(tReactorBenchDirection *pDirection, uint64_t ulNowUs);
+void *reactorBenchBscThread(void *pArg);
+void reactorBenchBscEvent(int iFd, uint32_t uiEvents, void *pContext);
+void reactorBenchUplinkDone(tUplinkRecord *pRecord, int iResult);
+void reactorBenchFill(tUplinkRecord *pRecord);
+void reactorBenchRun(tReactorBenchRun *pRun, uint32_t uiSeconds);
+int reactorBenchCompare(const void *pA, const void *pB);
+void reactorBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static uint32_t muiRttMs = REACTORBENCH_RTTMS;
+static SSL_CTX *mpServerContext = NULL;
+static pthread_mutex_t msLock = PTHREAD_MUTEX_INITIALIZER;
+static int miBscEventFd = -1;
+static volatile bool mbBscRunning = false;
+static uint64_t mulOldestSignalUs = 0; // oldest signal not handled yet, 0: none
+static uint32_t muiSignals = 0;
+static uint32_t mauiServiceUs[REACTORBENCH_MAXSAMPLES];
+static uint32_t muiServices = 0;
+static tUplinkRecord msRecord; // the transport keeps its own copy while in flight
+static uint32_t muiInFlight = 0;
+static uint32_t muiUplinks = 0;
+static uint32_t muiFailed = 0;
+static uint32_t muiCounter = 0;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tReactorBenchListener sServer = {.targetPort = 0};
+    tReactorBenchListener sProxy;
+    tReactorBenchRun asRuns[] =
+    {
+        {.name = "reactor", .inFlight = 0},
+        {.name = "reactor", .inFlight = 1},
+        {.name = "reactor", .inFlight = COMMS_MAXINFLIGHT},
+        {.name = "blocking", .inFlight = 1, .blocking = true},
+    };
+    uint32_t uiSeconds = REACTORBENCH_SECONDS;
+    pthread_t sThread;
+    FILE *pFile;
+    bool bPass = true;
+    int iOption;
+    uint32_t i;
+
+    while((iOption = getopt(argc, argv, "s:r:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 's': uiSeconds = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s seconds] [-r rtt ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiSeconds < 1 || uiSeconds * (1000000 / REACTORBENCH_MINGAPUS) > REACTORBENCH_MAXSAMPLES)
+    {
+        fprintf(stderr, "Need 1..%u seconds.\n", REACTORBENCH_MAXSAMPLES / (1000000 / REACTORBENCH_MINGAPUS));
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "/tmp/SACReactorBench.%i.conf", (int)getpid());
+    if(reactorBenchServerContext() < 0 || reactorBenchListen(&sServer) < 0 || reactorBenchListen(&sProxy) < 0)
+    {
+        fprintf(stderr, "Could not open the local TLS server and its proxy.\n");
+        return 2;
+    }
+    sProxy.targetPort = sServer.port;
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, reactorBenchAccept, &sServer);
+    pthread_create(&sThread, NULL, reactorBenchAccept, &sProxy);
+
+    pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        fprintf(stderr, "Could not write %s.\n", msConfigPath);
+        return 2;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = yes\nktls = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n", sProxy.port);
+    fclose(pFile);
+    reactorBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    miBscEventFd = reactorEventCreate(reactorBenchBscEvent, NULL);
+    if(miBscEventFd < 0 || configInit(msConfigPath) < 0)
+    {
+        reactorBenchQuiet(false);
+        fprintf(stderr, "Could not set up the reactor or load %s.\n", msConfigPath);
+        return 2;
+    }
+    sslInit();
+    commsInit();
+    reactorBenchQuiet(false);
+
+    fprintf(stderr, "bsc event every %u..%u ms, %u ms rtt, %u s per run\n", REACTORBENCH_MINGAPUS / 1000, REACTORBENCH_MAXGAPUS / 1000, muiRttMs, uiSeconds);
+    fprintf(stderr, "%-9s %9s %7s %9s %9s %9s %9s %9s\n", "loop", "in flight", "events", "p50 ms", "p99 ms", "max ms", "uplinks", "per s");
+    for(i=0; i<sizeof(asRuns) / sizeof(asRuns[0]); i+=1)
+    {
+        tReactorBenchRun *pRun = &asRuns[i];
+        reactorBenchRun(pRun, uiSeconds);
+        fprintf(stderr, "%-9s %9u %7u %9.3f %9.3f %9.3f %5u/%-3u %9.1f\n", pRun->name, pRun->inFlight, pRun->events, pRun->p50Us / 1000.0,
+            pRun->p99Us / 1000.0, pRun->maxUs / 1000.0, pRun->uplinks - pRun->failed, pRun->uplinks, pRun->uplinksPerSec);
+        bPass = bPass && pRun->failed == 0 && pRun->services > 0;
+    }
+    bPass = bPass && asRuns[2].p99Us <= REACTORBENCH_MAXP99US && asRuns[2].uplinksPerSec >= asRuns[1].uplinksPerSec * REACTORBENCH_MINSPEEDUP;
+
+    reactorBenchQuiet(true);
+    commsClose();
+    reactorBenchQuiet(false);
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/******************** reactorBenchListen ********************
+    Loopback listening socket on a free port.
+************************************************************/
+int reactorBenchListen(tReactorBenchListener *pListener)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    pListener->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(pListener->listenFd < 0 || bind(pListener->listenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(pListener->listenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(pListener->listenFd, (struct sockaddr *)&sAddr, &uiLength);
+    pListener->port = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/**************** reactorBenchServerContext *****************
+    Self-signed P-256 certificate made up on the spot.
+************************************************************/
+int reactorBenchServerContext()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/******************** reactorBenchAccept ********************
+    Accept loop of the webhook or its proxy, a thread per
+    connection.
+************************************************************/
+void *reactorBenchAccept(void *pArg)
+{
+    tReactorBenchListener *pListener = (tReactorBenchListener *)pArg;
+    tReactorBenchConnection *pConnection;
+    pthread_t sThread;
+    int iFd;
+
+    while(1)
+    {
+        iFd = accept(pListener->listenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pConnection = malloc(sizeof(tReactorBenchConnection));
+        pConnection->fd = iFd;
+        pConnection->targetPort = pListener->targetPort;
+        pthread_create(&sThread, NULL, (pListener->targetPort == 0) ? reactorBenchServer : reactorBenchProxy, pConnection);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/******************** reactorBenchServer ********************
+    Requests on the connection until the client closes, the
+    first 4 payload bytes go back as the downlink.
+************************************************************/
+void *reactorBenchServer(void *pArg)
+{
+    int iFd = ((tReactorBenchConnection *)pArg)->fd;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[REACTORBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9];
+    char *pEnd;
+    char *pValue;
+    SSL *pSsl;
+    int iBuffered = 0;
+    int iLength;
+    int iResult;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while(iBuffered < REACTORBENCH_BUFSIZE - 1)
+    {
+        iResult = SSL_read(pSsl, &sBuffer[iBuffered], REACTORBENCH_BUFSIZE - 1 - iBuffered);
+        if(iResult <= 0)
+        {
+            break;
+        }
+        iBuffered += iResult;
+        sBuffer[iBuffered] = 0x00;
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL)
+        {
+            memcpy(sData, "00000000", sizeof(sData));
+            pValue = strstr(sBuffer, "&data=");
+            if(pValue != NULL && pValue < pEnd)
+            {
+                memcpy(sData, pValue + 6, 8);
+            }
+            iLength = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACReactorBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+            if(SSL_write(pSsl, sResponse, iLength) != iLength)
+            {
+                iBuffered = REACTORBENCH_BUFSIZE;
+                break;
+            }
+            iLength = (int)(pEnd - sBuffer) + 4;
+            memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength + 1);
+            iBuffered -= iLength;
+        }
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/******************** reactorBenchProxy *********************
+    Relays one client connection to the webhook, every chunk
+    RTT/2 late, the first client chunk one RTT more for the
+    TCP handshake.
+************************************************************/
+void *reactorBenchProxy(void *pArg)
+{
+    tReactorBenchConnection *pConnection = (tReactorBenchConnection *)pArg;
+    int iClientFd = pConnection->fd;
+    tReactorBenchDirection *pUp = calloc(1, sizeof(tReactorBenchDirection));
+    tReactorBenchDirection *pDown = calloc(1, sizeof(tReactorBenchDirection));
+    struct sockaddr_in sAddr;
+    struct pollfd asPoll[2];
+    uint32_t uiHandshakeUs = muiRttMs * 1000;
+    uint64_t ulNowUs;
+    uint64_t ulDueUs;
+    int iTimeoutMs;
+    int iServerFd;
+    int iNoDelay = 1;
+
+    iServerFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(pConnection->targetPort);
+    free(pArg);
+    setsockopt(iClientFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay)); // a held chunk goes out when due, not after the peer's delayed ack
+    setsockopt(iServerFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+    if(pUp != NULL && pDown != NULL && iServerFd >= 0 && connect(iServerFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) == 0)
+    {
+        pUp->fromFd = iClientFd;
+        pUp->toFd = iServerFd;
+        pDown->fromFd = iServerFd;
+        pDown->toFd = iClientFd;
+        while(!(pUp->eof && pUp->count == 0 && pDown->eof && pDown->count == 0))
+        {
+            asPoll[0].fd = (pUp->eof || pUp->count == REACTORBENCH_MAXCHUNKS) ? -1 : iClientFd;
+            asPoll[1].fd = (pDown->eof || pDown->count == REACTORBENCH_MAXCHUNKS) ? -1 : iServerFd;
+            asPoll[0].events = POLLIN;
+            asPoll[1].events = POLLIN;
+            ulNowUs = printGetMonotonicTimeUs();
+            iTimeoutMs = 100;
+            if(pUp->count > 0 || pDown->count > 0)
+            {
+                ulDueUs = (pDown->count == 0 || (pUp->count > 0 && pUp->chunks[pUp->head].dueUs < pDown->chunks[pDown->head].dueUs)) ? pUp->chunks[pUp->head].dueUs : pDown->chunks[pDown->head].dueUs;
+                iTimeoutMs = (ulDueUs > ulNowUs) ? (int)((ulDueUs - ulNowUs + 999) / 1000) : 0;
+            }
+            poll(asPoll, 2, iTimeoutMs);
+            if((asPoll[0].fd >= 0 && (asPoll[0].revents & (POLLIN | POLLHUP | POLLERR)) && reactorBenchPump(pUp, uiHandshakeUs) < 0) ||
+                (asPoll[1].fd >= 0 && (asPoll[1].revents & (POLLIN | POLLHUP | POLLERR)) && reactorBenchPump(pDown, 0) < 0))
+            {
+                break;
+            }
+            uiHandshakeUs = (pUp->count > 0 || pUp->eof) ? 0 : uiHandshakeUs;
+            ulNowUs = printGetMonotonicTimeUs();
+            if(reactorBenchFlush(pUp, ulNowUs) < 0 || reactorBenchFlush(pDown, ulNowUs) < 0)
+            {
+                break;
+            }
+        }
+    }
+    if(iServerFd >= 0)
+    {
+        close(iServerFd);
+    }
+    close(iClientFd);
+    free(pUp);
+    free(pDown);
+    return NULL;
+}
+
+/********************* reactorBenchPump *********************
+    Reads what arrived into a chunk held until RTT/2 (plus
+    uiExtraUs) from now.
+************************************************************/
+int reactorBenchPump(tReactorBenchDirection *pDirection, uint32_t uiExtraUs)
+{
+    tReactorBenchChunk *pChunk = &pDirection->chunks[(pDirection->head + pDirection->count) % REACTORBENCH_MAXCHUNKS];
+    int iResult = read(pDirection->fromFd, pChunk->data, REACTORBENCH_CHUNKSIZE);
+
+    if(iResult < 0)
+    {
+        return -1;
+    }
+    if(iResult == 0)
+    {
+        pDirection->eof = true;
+        return 0;
+    }
+    pChunk->length = iResult;
+    pChunk->dueUs = printGetMonotonicTimeUs() + muiRttMs * 500 + uiExtraUs;
+    pDirection->count += 1;
+    return 0;
+}
+
+/******************** reactorBenchFlush *********************
+    Forwards the chunks that are due, passes the end of the
+    stream on once nothing is held anymore.
+************************************************************/
+int reactorBenchFlush(tReactorBenchDirection *pDirection, uint64_t ulNowUs)
+{
+    tReactorBenchChunk *pChunk;
+
+    while(pDirection->count > 0 && pDirection->chunks[pDirection->head].dueUs <= ulNowUs)
+    {
+        pChunk = &pDirection->chunks[pDirection->head];
+        if(send(pDirection->toFd, pChunk->data, pChunk->length, MSG_NOSIGNAL) != pChunk->length)
+        {
+            return -1;
+        }
+        pDirection->head = (pDirection->head + 1) % REACTORBENCH_MAXCHUNKS;
+        pDirection->count -= 1;
+        if(pDirection->count == 0 && pDirection->eof)
+        {
+            shutdown(pDirection->toFd, SHUT_WR);
+        }
+    }
+    return 0;
+}
+
+/****************** reactorBenchBscThread *******************
+    pigpio's event thread: signals the bsc eventfd every
+    REACTORBENCH_MINGAPUS..MAXGAPUS while a run lasts.
+************************************************************/
+void *reactorBenchBscThread(void *pArg)
+{
+    unsigned int uiSeed = (unsigned int)printGetMonotonicTimeUs();
+
+    while(mbBscRunning)
+    {
+        usleep(REACTORBENCH_MINGAPUS + rand_r(&uiSeed) % (REACTORBENCH_MAXGAPUS - REACTORBENCH_MINGAPUS + 1));
+        pthread_mutex_lock(&msLock);
+        if(mulOldestSignalUs == 0)
+        {
+            mulOldestSignalUs = printGetMonotonicTimeUs();
+        }
+        muiSignals += 1;
+        pthread_mutex_unlock(&msLock);
+        reactorEventSignal(miBscEventFd);
+    }
+    return NULL;
+}
+
+/****************** reactorBenchBscEvent ********************
+    The loop got to the bsc event: one service, timed from
+    the oldest signal it covers.
+************************************************************/
+void reactorBenchBscEvent(int iFd, uint32_t uiEvents, void *pContext)
+{
+    uint64_t ulNowUs = printGetMonotonicTimeUs();
+
+    pthread_mutex_lock(&msLock);
+    if(mulOldestSignalUs != 0 && muiServices < REACTORBENCH_MAXSAMPLES)
+    {
+        mauiServiceUs[muiServices++] = (uint32_t)(ulNowUs - mulOldestSignalUs);
+    }
+    mulOldestSignalUs = 0;
+    pthread_mutex_unlock(&msLock);
+}
+
+void reactorBenchUplinkDone(tUplinkRecord *pRecord, int iResult)
+{
+    muiInFlight -= 1;
+    muiUplinks += 1;
+    muiFailed += (iResult < 0) ? 1 : 0;
+}
+
+void reactorBenchFill(tUplinkRecord *pRecord)
+{
+    memset(pRecord, 0, sizeof(tUplinkRecord));
+    pRecord->cmd.cmdCode = 0x02;
+    pRecord->cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    pRecord->cmd.downlinkIndicator = 0x01;
+    pRecord->priorityClass = UPLCLASS_EVENT;
+    memcpy(pRecord->cmd.payload, &muiCounter, sizeof(muiCounter));
+    pRecord->time = time(NULL);
+    muiCounter += 1;
+}
+
+/********************** reactorBenchRun *********************
+    One run: the bsc thread signals, the loop serves it and
+    keeps pRun->inFlight uplinks going (or sends them one
+    after the other with the blocking call), then waits for
+    the last exchanges to finish.
+************************************************************/
+void reactorBenchRun(tReactorBenchRun *pRun, uint32_t uiSeconds)
+{
+    uint64_t ulEndUs;
+    uint64_t ulStartUs;
+    uint64_t ulLastDoneUs;
+    pthread_t sThread;
+    uint32_t uiDone;
+
+    reactorBenchQuiet(true);
+    while(reactorRunOnce(0) > 0)
+    {
+        // nothing left over from the run before
+    }
+    muiServices = 0;
+    muiSignals = 0;
+    muiUplinks = 0;
+    muiFailed = 0;
+    mulOldestSignalUs = 0;
+    mbBscRunning = true;
+    pthread_create(&sThread, NULL, reactorBenchBscThread, NULL);
+    ulStartUs = printGetMonotonicTimeUs();
+    ulEndUs = ulStartUs + uiSeconds * 1000000ULL;
+    ulLastDoneUs = ulStartUs;
+    while(printGetMonotonicTimeUs() < ulEndUs)
+    {
+        if(pRun->blocking)
+        {
+            reactorBenchFill(&msRecord);
+            muiFailed += (commsSendUplink(&msRecord) < 0) ? 1 : 0;
+            muiUplinks += 1;
+            ulLastDoneUs = printGetMonotonicTimeUs();
+            while(reactorRunOnce(0) > 0)
+            {
+                // the events that came in meanwhile
+            }
+            continue;
+        }
+        while(muiInFlight < pRun->inFlight)
+        {
+            reactorBenchFill(&msRecord);
+            if(commsStartUplink(&msRecord, reactorBenchUplinkDone) < 0)
+            {
+                muiUplinks += 1;
+                muiFailed += 1;
+                break;
+            }
+            muiInFlight += 1;
+        }
+        uiDone = muiUplinks;
+        reactorRunOnce(10);
+        ulLastDoneUs = (muiUplinks != uiDone) ? printGetMonotonicTimeUs() : ulLastDoneUs;
+    }
+    mbBscRunning = false;
+    pthread_join(sThread, NULL);
+    while(muiInFlight > 0)
+    {
+        reactorRunOnce(10);
+        ulLastDoneUs = printGetMonotonicTimeUs();
+    }
+    reactorRunOnce(0);
+    reactorBenchQuiet(false);
+
+    pRun->events = muiSignals;
+    pRun->services = muiServices;
+    pRun->uplinks = muiUplinks;
+    pRun->failed = muiFailed;
+    pRun->uplinksPerSec = (muiUplinks > 0) ? muiUplinks / ((ulLastDoneUs - ulStartUs) / 1000000.0) : 0.0;
+    if(muiServices > 0)
+    {
+        qsort(mauiServiceUs, muiServices, sizeof(uint32_t), reactorBenchCompare);
+        pRun->p50Us = mauiServiceUs[(muiServices - 1) * 50 / 100];
+        pRun->p99Us = mauiServiceUs[(muiServices - 1) * 99 / 100];
+        pRun->maxUs = mauiServiceUs[muiServices - 1];
+    }
+}
+
+int reactorBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void reactorBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
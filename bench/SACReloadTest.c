@@ -0,0 +1,339 @@
+/*
+    Config reload under load, run with "make reloadtest".
+
+    The daemon's state machine serves send / read enable /
+    read cycles over the simulated BSC (like SACBench) as fast
+    as it can. Meanwhile a thread keeps replacing the config
+    file with one of RELOAD_NFILES variants and starts a
+    reload. The loop applies the reloads between two state
+    machine passes, like the daemon does.
+    Checked:
+        - every frame gets its own reply back (the transport
+          echoes a per frame counter), no missed frames;
+        - every request is built from one snapshot: host, path
+          and device id always belong to the same variant;
+        - the transport is reconnected exactly when the
+          endpoint changed, not for path/timeout/i2c changes.
+
+    Usage:
+        SACReloadTest [-t seconds] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACConfig.h"
+#include "SACBenchBsc.h"
+
+#define RELOAD_SECONDS          5
+#define RELOAD_NFILES           4
+#define RELOAD_INTERVALUS       2000 // between two reloads
+#define RELOAD_SMMAXSTEPS       64 // listeningTask() calls before a cycle is considered missed
+
+typedef struct
+{
+    const char *host;
+    const char *path;
+    const char *deviceId;
+    uint32_t socketSec;
+    uint32_t pollUs;
+} tReloadVariant;
+
+/****************** daemon internals driven by the test *************************/
+extern tSmState sState;
+extern char msHttpTxMessage[HTTPMSGMAXSIZE];
+uint8_t slave_init();
+void listeningTask();
+void slaveConfigApply();
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+int reloadWriteVariant(int iVariant);
+void *reloadThread(void *pArg);
+int reloadInit();
+int reloadSendUplink(tUplinkRecord *pRecord);
+int reloadRunUntilIdle();
+int reloadCycle(uint32_t uiFrame);
+void reloadApply();
+void reloadQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static const tReloadVariant masVariants[RELOAD_NFILES] = // 0/1 and 2/3 share the endpoint
+{
+    {"a.example.com", "/a/webhook", "DEV-A", 10, 1000},
+    {"a.example.com", "/a/webhook2", "DEV-A", 5, 500},
+    {"b.example.com", "/b/webhook", "DEV-B", 10, 2000},
+    {"b.example.com", "/b/webhook2", "DEV-B", 20, 800},
+};
+static char msConfigPath[256];
+static char msConfigTmpPath[sizeof(msConfigPath) + 4];
+static volatile bool mbReloadRunning = false;
+static uint32_t muiReloadsStarted = 0;
+static uint32_t muiReloadsBusy = 0;
+static uint32_t muiInits = 0;
+static uint32_t muiInconsistent = 0;
+static uint32_t muiApplied = 0;
+static uint32_t muiEndpointChanges = 0;
+static uint32_t muiLastGeneration = 0;
+static char msLastHost[STRUCTS_SERVREQ_MAXSTRSIZE];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const tCommsTransport msReloadTransport =
+{
+    .name = "reloadtest",
+    .init = reloadInit,
+    .sendUplink = reloadSendUplink,
+};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    uint32_t uiSeconds = RELOAD_SECONDS;
+    uint64_t ulEndUs;
+    uint32_t uiFrames = 0;
+    uint32_t uiMissed = 0;
+    pthread_t sThread;
+    int iOption;
+
+    while((iOption = getopt(argc, argv, "t:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 't': uiSeconds = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACReloadTest.%i.conf", sDir, (int)getpid());
+    snprintf(msConfigTmpPath, sizeof(msConfigTmpPath), "%s.tmp", msConfigPath);
+    if(reloadWriteVariant(0) < 0)
+    {
+        fprintf(stderr, "Could not write %s.\n", msConfigPath);
+        return 2;
+    }
+
+    reloadQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    if(configInit(msConfigPath) < 0)
+    {
+        reloadQuiet(false);
+        fprintf(stderr, "Could not load %s.\n", msConfigPath);
+        return 1;
+    }
+    commsSetTransport(&msReloadTransport);
+    muiInits = 0;
+    benchBscReset();
+    slave_init();
+    muiLastGeneration = configGet()->generation;
+    snprintf(msLastHost, sizeof(msLastHost), "%s", configGet()->host);
+
+    mbReloadRunning = true;
+    pthread_create(&sThread, NULL, reloadThread, NULL);
+    ulEndUs = printGetMonotonicTimeUs() + (uint64_t)uiSeconds * 1000000ULL;
+    while(printGetMonotonicTimeUs() < ulEndUs)
+    {
+        if(reloadCycle(uiFrames) < 0)
+        {
+            uiMissed += 1;
+        }
+        uiFrames += 1;
+        reloadApply();
+    }
+    mbReloadRunning = false;
+    pthread_join(sThread, NULL);
+    usleep(10000);
+    reloadApply(); // the last reload may still be pending
+    reloadQuiet(false);
+    unlink(msConfigPath);
+
+    fprintf(stderr, "%u s: %u frames, %u missed, %u inconsistent requests, %u reloads started (%u while one was pending), %u applied, %u endpoint changes, %u reconnects\n",
+        uiSeconds, uiFrames, uiMissed, muiInconsistent, muiReloadsStarted, muiReloadsBusy, muiApplied, muiEndpointChanges, muiInits);
+    if(uiMissed > 0 || muiInconsistent > 0 || muiApplied == 0 || muiInits != muiEndpointChanges)
+    {
+        fprintf(stderr, "FAIL\n");
+        return 1;
+    }
+    fprintf(stderr, "PASS\n");
+    return 0;
+}
+
+/******************* reloadWriteVariant *********************
+    Write and rename, the reload worker never sees half a
+    file.
+************************************************************/
+int reloadWriteVariant(int iVariant)
+{
+    const tReloadVariant *pVariant = &masVariants[iVariant];
+    FILE *pFile = fopen(msConfigTmpPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "# variant %i\n[comms]\ntransport = http\nhost = %s\npath = %s\ndevice_id = %s\nuse_ssl = no\nuser_reply =\n\n[timeouts]\nsocket_sec = %u\n\n[i2c]\npoll_interval_us = %u\n",
+        iVariant, pVariant->host, pVariant->path, pVariant->deviceId, pVariant->socketSec, pVariant->pollUs);
+    fclose(pFile);
+    return rename(msConfigTmpPath, msConfigPath);
+}
+
+void *reloadThread(void *pArg)
+{
+    int iVariant = 0;
+    while(mbReloadRunning)
+    {
+        iVariant = (iVariant + 1) % RELOAD_NFILES;
+        reloadWriteVariant(iVariant);
+        if(configReloadStart(NULL) == 0)
+        {
+            muiReloadsStarted += 1;
+        }
+        else
+        {
+            muiReloadsBusy += 1;
+        }
+        usleep(RELOAD_INTERVALUS);
+    }
+    return NULL;
+}
+
+int reloadInit()
+{
+    muiInits += 1;
+    return 0;
+}
+
+/******************** reloadSendUplink **********************
+    Builds the request like the http transport, checks it
+    came from one variant and echoes the frame counter
+    (first payload bytes) as the downlink.
+************************************************************/
+int reloadSendUplink(tUplinkRecord *pRecord)
+{
+    char sExpected[128];
+    bool bConsistent = false;
+    int i;
+
+    httpBuildRequestMsg((uintptr_t)pRecord->cmd.payload, pRecord->cmd.payloadSize - 1, pRecord->time, pRecord->encoding);
+    for(i=0; i<RELOAD_NFILES; i+=1)
+    {
+        snprintf(sExpected, sizeof(sExpected), "GET %s?id=%s&", masVariants[i].path, masVariants[i].deviceId);
+        if(strncmp(msHttpTxMessage, sExpected, strlen(sExpected)) == 0)
+        {
+            snprintf(sExpected, sizeof(sExpected), "Host: %s\r\n", masVariants[i].host);
+            bConsistent = (strstr(msHttpTxMessage, sExpected) != NULL && strstr(msHttpTxMessage, "&response=") == NULL);
+            break;
+        }
+    }
+    if(!bConsistent)
+    {
+        muiInconsistent += 1;
+    }
+    memset(getCtrlDeckedReply()->payload, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    memcpy(getCtrlDeckedReply()->payload, pRecord->cmd.payload, sizeof(uint32_t));
+    return 0;
+}
+
+int reloadRunUntilIdle()
+{
+    int iSteps = 0;
+    do
+    {
+        listeningTask();
+        iSteps += 1;
+    } while(sState != S_IDLE && iSteps < RELOAD_SMMAXSTEPS);
+    return (sState == S_IDLE) ? iSteps : -1;
+}
+
+/*********************** reloadCycle ************************
+    One alarm send command carrying uiFrame, read enable,
+    read the decked reply. A reload is applied between the
+    send and the read enable as well, the daemon may do that
+    while the controller is between two frames.
+************************************************************/
+int reloadCycle(uint32_t uiFrame)
+{
+    tCtrlSendCmd sFrame;
+    uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    uint8_t abReply[BSC_FIFO_SIZE];
+    int iLength;
+
+    memset(&sFrame, 0, sizeof(sFrame));
+    sFrame.startTag = IOT_FRMSTARTTAG;
+    sFrame.cmdCode = UPLSCHED_CMDCODE_ALARM; // alarms bypass the token bucket
+    sFrame.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sFrame.downlinkIndicator = 0x01;
+    memcpy(sFrame.payload, &uiFrame, sizeof(uiFrame));
+    sFrame.endTag = IOT_FRMENDTAG;
+
+    benchBscControllerWrite(sFrame.ui8, sizeof(sFrame.ui8));
+    if(reloadRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    reloadApply();
+    benchBscControllerWrite(abReadEnaFrame, sizeof(abReadEnaFrame));
+    if(reloadRunUntilIdle() < 0)
+    {
+        return -1;
+    }
+    iLength = benchBscControllerRead(abReply, sizeof(abReply));
+    if(iLength != STRUCTS_DECKEDREPLYTOTALSIZE || abReply[2] != I2CERRORCODE_OK || memcmp(&abReply[4], &uiFrame, sizeof(uiFrame)) != 0)
+    {
+        return -1;
+    }
+    return iLength;
+}
+
+/*********************** reloadApply ************************
+    The daemon's apply step plus the bookkeeping of what a
+    reconnect should have been triggered by.
+************************************************************/
+void reloadApply()
+{
+    slaveConfigApply();
+    if(configGet()->generation == muiLastGeneration)
+    {
+        return;
+    }
+    muiApplied += configGet()->generation - muiLastGeneration;
+    muiLastGeneration = configGet()->generation;
+    if(strcmp(msLastHost, configGet()->host) != 0)
+    {
+        muiEndpointChanges += 1;
+        snprintf(msLastHost, sizeof(msLastHost), "%s", configGet()->host);
+    }
+}
+
+void reloadQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
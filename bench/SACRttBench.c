@@ -0,0 +1,667 @@
+/*
+    Round trips per uplink, run with "make rttbench".
+
+    A local TLS 1.3 server thread stands in for the webhook
+    (self-signed P-256 certificate, session tickets, 0-RTT
+    early data allowed). The daemon reaches it through a
+    proxy thread that holds every chunk RTT/2 in each
+    direction. The connection setup isn't visible on
+    loopback, so the proxy holds the first client bytes one
+    more RTT unless they came in the SYN (TCP_INFO of the
+    accepted socket has TCPI_OPT_SYN_DATA): that is the
+    three way handshake the client would have waited for.
+    The blocking http path sends N telemetry uplinks, a
+    connection each. Per build: ms to the first uplink (no
+    session, no fast open cookie yet), min / median / max of
+    the others and the median in RTTs, against
+        3 RTT  default (connect, TLS, request),
+        2 RTT  HTTPUSETCPFASTOPEN or HTTPUSEEARLYDATA,
+        1 RTT  both.
+    The server answers a request that came as early data
+    right away, before the client's Finished; its new
+    tickets only follow the Finished and the daemon has
+    closed by then, so it offers the used ticket again and
+    with replay protection every other uplink is a full
+    handshake. Builds with
+    HTTPUSEEARLYDATA run a second time with the server
+    rejecting early data: every uplink must still arrive,
+    once.
+    The settings are compile time, "make rttbench" builds
+    and runs all four.
+
+    Usage:
+        SACRttBench [-n uplinks] [-r rtt ms] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+
+#define RTTBENCH_UPLINKS        20
+#define RTTBENCH_RTTMS          100
+#define RTTBENCH_MAXUPLINKS     1000
+#define RTTBENCH_BUFSIZE        8192
+#define RTTBENCH_CHUNKSIZE      4096
+#define RTTBENCH_MAXCHUNKS      16 // held per direction and connection
+#define RTTBENCH_MAXEARLYDATA   16384
+#define RTTBENCH_SLACKPERCENT   50 // of an RTT, above the expected round trips
+
+typedef struct
+{
+    uint64_t dueUs;
+    int length;
+    uint8_t data[RTTBENCH_CHUNKSIZE];
+} tRttBenchChunk;
+
+typedef struct
+{
+    int fromFd;
+    int toFd;
+    tRttBenchChunk chunks[RTTBENCH_MAXCHUNKS];
+    uint32_t head;
+    uint32_t count;
+    bool eof;
+} tRttBenchDirection;
+
+typedef struct
+{
+    const char *name;
+    bool rejectEarlyData;
+    uint32_t ok;
+    uint32_t firstUs;
+    uint32_t minUs; // uplinks after the first
+    uint32_t medianUs;
+    uint32_t maxUs;
+    uint32_t answered; // requests the server answered
+    uint32_t synData; // connections with data in the SYN
+    uint32_t earlyData; // requests answered from early data
+} tRttBenchRun;
+
+/****************** private function prototypes *********************/
+int rttBenchListen(uint16_t *pPort, bool bFastOpen);
+int rttBenchServerContext();
+int rttBenchAllowEarlyData(SSL *pSsl, void *pArg);
+void *rttBenchAccept(void *pArg);
+void *rttBenchServer(void *pArg);
+void *rttBenchProxy(void *pArg);
+int rttBenchServeEarlyData(SSL *pSsl, char *sBuffer, int *pBuffered);
+int rttBenchRequestLength(const char *sBuffer, int iBuffered);
+int rttBenchAnswer(SSL *pSsl, const char *sRequest, bool bEarly);
+int rttBenchPump(tRttBenchDirection *pDirection, uint32_t uiExtraUs);
+int rttBenchFlush(tRttBenchDirection *pDirection, uint64_t ulNowUs);
+int rttBenchWriteConfig();
+int rttBenchRun(tRttBenchRun *pRun, uint32_t uiUplinks);
+int rttBenchCompare(const void *pA, const void *pB);
+void rttBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static int miServerFd = -1;
+static int miProxyFd = -1;
+static uint16_t muiServerPort = 0;
+static uint16_t muiProxyPort = 0;
+static uint32_t muiRttMs = RTTBENCH_RTTMS;
+static SSL_CTX *mpServerContext = NULL;
+static volatile bool mbRejectEarlyData = false;
+static uint32_t muiAnswered = 0;
+static uint32_t muiSynData = 0;
+static uint32_t muiEarlyData = 0;
+static pthread_mutex_t msServerLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t mauiLatencyUs[RTTBENCH_MAXUPLINKS];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    tRttBenchRun asRuns[] =
+    {
+        {.name = "early data accepted"},
+        {.name = "early data rejected", .rejectEarlyData = true},
+    };
+    uint32_t uiExpectedRtts = 3 - HTTPUSETCPFASTOPEN - HTTPUSEEARLYDATA;
+    uint32_t uiRuns = (HTTPUSEEARLYDATA == 1) ? 2 : 1;
+    uint32_t uiUplinks = RTTBENCH_UPLINKS;
+    pthread_t sThread;
+    bool bPass = true;
+    int iOption;
+    uint32_t i;
+
+    while((iOption = getopt(argc, argv, "n:r:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiUplinks = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n uplinks] [-r rtt ms] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiUplinks < 2 || uiUplinks > RTTBENCH_MAXUPLINKS)
+    {
+        fprintf(stderr, "Need 2..%u uplinks.\n", RTTBENCH_MAXUPLINKS);
+        return 2;
+    }
+    if(HTTPUSEEARLYDATA == 0)
+    {
+        asRuns[0].name = "default";
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACRttBench.%i.conf", sDir, (int)getpid());
+    miServerFd = rttBenchListen(&muiServerPort, false);
+    miProxyFd = rttBenchListen(&muiProxyPort, true);
+    if(rttBenchServerContext() < 0 || miServerFd < 0 || miProxyFd < 0)
+    {
+        fprintf(stderr, "Could not open the local TLS server and its proxy.\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    pthread_create(&sThread, NULL, rttBenchAccept, (void *)rttBenchServer);
+    pthread_create(&sThread, NULL, rttBenchAccept, (void *)rttBenchProxy);
+
+    rttBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    sslInit();
+    rttBenchQuiet(false);
+
+    fprintf(stderr, "%u uplinks, %u ms rtt, tcp fast open %s, early data %s, %u RTT expected\n", uiUplinks, muiRttMs,
+        (HTTPUSETCPFASTOPEN == 1) ? "on" : "off", (HTTPUSEEARLYDATA == 1) ? "on" : "off", uiExpectedRtts);
+    fprintf(stderr, "%-20s %6s %9s %9s %9s %9s %6s %8s %8s %6s\n", "run", "ok", "first ms", "min ms", "p50 ms", "max ms", "RTTs", "answered", "syn data", "early");
+    for(i=0; i<uiRuns; i+=1)
+    {
+        tRttBenchRun *pRun = &asRuns[i];
+        if(rttBenchRun(pRun, uiUplinks) < 0)
+        {
+            fprintf(stderr, "Could not load %s.\n", msConfigPath);
+            return 1;
+        }
+        fprintf(stderr, "%-20s %6u %9.1f %9.1f %9.1f %9.1f %6.2f %8u %8u %6u\n", pRun->name, pRun->ok, pRun->firstUs / 1000.0, pRun->minUs / 1000.0,
+            pRun->medianUs / 1000.0, pRun->maxUs / 1000.0, pRun->medianUs / 1000.0 / muiRttMs, pRun->answered, pRun->synData, pRun->earlyData);
+        bPass = bPass && pRun->ok == uiUplinks && pRun->answered == uiUplinks; // a request resent after rejected early data is answered once
+        bPass = bPass && (HTTPUSETCPFASTOPEN == 0 || pRun->synData > 0);
+        if(!pRun->rejectEarlyData)
+        {
+            bPass = bPass && pRun->minUs >= uiExpectedRtts * muiRttMs * 1000 && pRun->minUs <= (uiExpectedRtts * 100 + RTTBENCH_SLACKPERCENT) * muiRttMs * 10;
+            bPass = bPass && (HTTPUSEEARLYDATA == 0 || pRun->earlyData > 0);
+        }
+        else
+        {
+            bPass = bPass && pRun->earlyData == 0 && pRun->minUs >= (uiExpectedRtts + 1) * muiRttMs * 1000;
+        }
+    }
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/********************* rttBenchListen ***********************
+    Loopback listening socket on a free port, with the
+    fast open queue for the proxy. Returns the socket or -1.
+************************************************************/
+int rttBenchListen(uint16_t *pPort, bool bFastOpen)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+    int iQueue = 16;
+    int iFd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(bFastOpen)
+    {
+        setsockopt(iFd, IPPROTO_TCP, TCP_FASTOPEN, &iQueue, sizeof(iQueue)); // needs bit 1 of net.ipv4.tcp_fastopen
+    }
+    if(iFd < 0 || bind(iFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(iFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(iFd, (struct sockaddr *)&sAddr, &uiLength);
+    *pPort = ntohs(sAddr.sin_port);
+    return iFd;
+}
+
+/***************** rttBenchServerContext ********************
+    Self-signed P-256 certificate made up on the spot, TLS
+    1.3 with early data up to RTTBENCH_MAXEARLYDATA.
+************************************************************/
+int rttBenchServerContext()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            SSL_CTX_set_min_proto_version(mpServerContext, TLS1_3_VERSION);
+            SSL_CTX_set_max_early_data(mpServerContext, RTTBENCH_MAXEARLYDATA);
+            SSL_CTX_set_allow_early_data_cb(mpServerContext, rttBenchAllowEarlyData, NULL);
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+int rttBenchAllowEarlyData(SSL *pSsl, void *pArg)
+{
+    return mbRejectEarlyData ? 0 : 1;
+}
+
+/********************* rttBenchAccept ***********************
+    Accept loop of the server (pArg rttBenchServer) or the
+    proxy (pArg rttBenchProxy), a thread per connection.
+************************************************************/
+void *rttBenchAccept(void *pArg)
+{
+    void *(*pServe)(void *) = (void *(*)(void *))pArg;
+    int iListenFd = (pServe == rttBenchServer) ? miServerFd : miProxyFd;
+    pthread_t sThread;
+    int *pFd;
+
+    while(1)
+    {
+        pFd = malloc(sizeof(int));
+        *pFd = accept(iListenFd, NULL, NULL);
+        if(*pFd < 0)
+        {
+            free(pFd);
+            continue;
+        }
+        pthread_create(&sThread, NULL, pServe, pFd);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/********************* rttBenchServer ***********************
+    A request that came as early data is answered before
+    the handshake is over, the rest once it is.
+************************************************************/
+void *rttBenchServer(void *pArg)
+{
+    int iFd = *(int *)pArg;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[RTTBENCH_BUFSIZE];
+    SSL *pSsl;
+    int iBuffered = 0;
+    int iLength;
+    int iResult;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || rttBenchServeEarlyData(pSsl, sBuffer, &iBuffered) < 0 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while(1)
+    {
+        while((iLength = rttBenchRequestLength(sBuffer, iBuffered)) > 0)
+        {
+            if(rttBenchAnswer(pSsl, sBuffer, false) < 0)
+            {
+                iBuffered = -1;
+                break;
+            }
+            memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength);
+            iBuffered -= iLength;
+        }
+        if(iBuffered < 0 || iBuffered >= RTTBENCH_BUFSIZE - 1)
+        {
+            break;
+        }
+        iResult = SSL_read(pSsl, &sBuffer[iBuffered], RTTBENCH_BUFSIZE - 1 - iBuffered);
+        if(iResult <= 0)
+        {
+            break;
+        }
+        iBuffered += iResult;
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/***************** rttBenchServeEarlyData *******************
+    Reads the early data, answering complete requests in it
+    at once (0.5-RTT data), until the client ends it. Without
+    early data this returns right after the ClientHello.
+************************************************************/
+int rttBenchServeEarlyData(SSL *pSsl, char *sBuffer, int *pBuffered)
+{
+    size_t uiRead;
+    int iLength;
+    int iResult;
+
+    do
+    {
+        uiRead = 0;
+        iResult = SSL_read_early_data(pSsl, &sBuffer[*pBuffered], RTTBENCH_BUFSIZE - 1 - *pBuffered, &uiRead);
+        *pBuffered += (int)uiRead;
+        while((iLength = rttBenchRequestLength(sBuffer, *pBuffered)) > 0)
+        {
+            if(rttBenchAnswer(pSsl, sBuffer, true) < 0)
+            {
+                return -1;
+            }
+            memmove(sBuffer, &sBuffer[iLength], *pBuffered - iLength);
+            *pBuffered -= iLength;
+        }
+    }
+    while(iResult == SSL_READ_EARLY_DATA_SUCCESS && *pBuffered < RTTBENCH_BUFSIZE - 1);
+    return (iResult == SSL_READ_EARLY_DATA_ERROR) ? -1 : 0;
+}
+
+/****************** rttBenchRequestLength *******************
+    Length of the first complete request in sBuffer (the
+    uplinks have no body), 0 when it isn't complete yet.
+************************************************************/
+int rttBenchRequestLength(const char *sBuffer, int iBuffered)
+{
+    char sCopy[RTTBENCH_BUFSIZE];
+    char *pEnd;
+
+    memcpy(sCopy, sBuffer, iBuffered);
+    sCopy[iBuffered] = 0x00;
+    pEnd = strstr(sCopy, "\r\n\r\n");
+    return (pEnd == NULL) ? 0 : (int)(pEnd - sCopy) + 4;
+}
+
+/********************** rttBenchAnswer **********************
+    The first 4 payload bytes go back as the downlink.
+************************************************************/
+int rttBenchAnswer(SSL *pSsl, const char *sRequest, bool bEarly)
+{
+    char sResponse[256];
+    char sData[9] = "00000000";
+    const char *pValue = strstr(sRequest, "&data=");
+    const char *pEnd = strstr(sRequest, "\r\n\r\n");
+    size_t uiWritten = 0;
+    int iResponse;
+
+    if(pValue != NULL && pValue < pEnd)
+    {
+        memcpy(sData, pValue + 6, 8);
+    }
+    iResponse = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACRttBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+    if(bEarly ? (SSL_write_early_data(pSsl, sResponse, iResponse, &uiWritten) != 1 || uiWritten != (size_t)iResponse) : (SSL_write(pSsl, sResponse, iResponse) != iResponse))
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&msServerLock);
+    muiAnswered += 1;
+    muiEarlyData += bEarly ? 1 : 0;
+    pthread_mutex_unlock(&msServerLock);
+    return 0;
+}
+
+/********************** rttBenchProxy ***********************
+    Relays one client connection to the server, every chunk
+    RTT/2 late, the first client chunk one RTT more when the
+    SYN carried no data.
+************************************************************/
+void *rttBenchProxy(void *pArg)
+{
+    int iClientFd = *(int *)pArg;
+    tRttBenchDirection *pUp = calloc(1, sizeof(tRttBenchDirection));
+    tRttBenchDirection *pDown = calloc(1, sizeof(tRttBenchDirection));
+    struct sockaddr_in sAddr;
+    struct tcp_info sTcpInfo;
+    socklen_t uiTcpInfoLength = sizeof(sTcpInfo);
+    struct pollfd asPoll[2];
+    uint32_t uiHandshakeUs = muiRttMs * 1000;
+    uint64_t ulNowUs;
+    uint64_t ulDueUs;
+    int iTimeoutMs;
+    int iServerFd;
+    int iNoDelay = 1;
+
+    free(pArg);
+    if(getsockopt(iClientFd, IPPROTO_TCP, TCP_INFO, &sTcpInfo, &uiTcpInfoLength) == 0 && (sTcpInfo.tcpi_options & TCPI_OPT_SYN_DATA))
+    {
+        uiHandshakeUs = 0;
+        pthread_mutex_lock(&msServerLock);
+        muiSynData += 1;
+        pthread_mutex_unlock(&msServerLock);
+    }
+    iServerFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(muiServerPort);
+    setsockopt(iClientFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay)); // a held chunk goes out when due, not after the peer's delayed ack
+    setsockopt(iServerFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+    if(pUp != NULL && pDown != NULL && iServerFd >= 0 && connect(iServerFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) == 0)
+    {
+        pUp->fromFd = iClientFd;
+        pUp->toFd = iServerFd;
+        pDown->fromFd = iServerFd;
+        pDown->toFd = iClientFd;
+        while(!(pUp->eof && pUp->count == 0 && pDown->eof && pDown->count == 0))
+        {
+            asPoll[0].fd = (pUp->eof || pUp->count == RTTBENCH_MAXCHUNKS) ? -1 : iClientFd;
+            asPoll[1].fd = (pDown->eof || pDown->count == RTTBENCH_MAXCHUNKS) ? -1 : iServerFd;
+            asPoll[0].events = POLLIN;
+            asPoll[1].events = POLLIN;
+            ulNowUs = printGetMonotonicTimeUs();
+            iTimeoutMs = 100;
+            if(pUp->count > 0 || pDown->count > 0)
+            {
+                ulDueUs = (pDown->count == 0 || (pUp->count > 0 && pUp->chunks[pUp->head].dueUs < pDown->chunks[pDown->head].dueUs)) ? pUp->chunks[pUp->head].dueUs : pDown->chunks[pDown->head].dueUs;
+                iTimeoutMs = (ulDueUs > ulNowUs) ? (int)((ulDueUs - ulNowUs + 999) / 1000) : 0;
+            }
+            poll(asPoll, 2, iTimeoutMs);
+            if((asPoll[0].fd >= 0 && (asPoll[0].revents & (POLLIN | POLLHUP | POLLERR)) && rttBenchPump(pUp, uiHandshakeUs) < 0) ||
+                (asPoll[1].fd >= 0 && (asPoll[1].revents & (POLLIN | POLLHUP | POLLERR)) && rttBenchPump(pDown, 0) < 0))
+            {
+                break;
+            }
+            uiHandshakeUs = (pUp->count > 0 || pUp->eof) ? 0 : uiHandshakeUs;
+            ulNowUs = printGetMonotonicTimeUs();
+            if(rttBenchFlush(pUp, ulNowUs) < 0 || rttBenchFlush(pDown, ulNowUs) < 0)
+            {
+                break;
+            }
+        }
+    }
+    if(iServerFd >= 0)
+    {
+        close(iServerFd);
+    }
+    close(iClientFd);
+    free(pUp);
+    free(pDown);
+    return NULL;
+}
+
+/********************** rttBenchPump ************************
+    Reads what arrived into a chunk held until RTT/2 (plus
+    uiExtraUs) from now.
+************************************************************/
+int rttBenchPump(tRttBenchDirection *pDirection, uint32_t uiExtraUs)
+{
+    tRttBenchChunk *pChunk = &pDirection->chunks[(pDirection->head + pDirection->count) % RTTBENCH_MAXCHUNKS];
+    int iResult = read(pDirection->fromFd, pChunk->data, RTTBENCH_CHUNKSIZE);
+
+    if(iResult < 0)
+    {
+        return -1;
+    }
+    if(iResult == 0)
+    {
+        pDirection->eof = true;
+        return 0;
+    }
+    pChunk->length = iResult;
+    pChunk->dueUs = printGetMonotonicTimeUs() + muiRttMs * 500 + uiExtraUs;
+    pDirection->count += 1;
+    return 0;
+}
+
+/********************** rttBenchFlush ***********************
+    Forwards the chunks that are due, passes the end of the
+    stream on once nothing is held anymore.
+************************************************************/
+int rttBenchFlush(tRttBenchDirection *pDirection, uint64_t ulNowUs)
+{
+    tRttBenchChunk *pChunk;
+
+    while(pDirection->count > 0 && pDirection->chunks[pDirection->head].dueUs <= ulNowUs)
+    {
+        pChunk = &pDirection->chunks[pDirection->head];
+        if(send(pDirection->toFd, pChunk->data, pChunk->length, MSG_NOSIGNAL) != pChunk->length)
+        {
+            return -1;
+        }
+        pDirection->head = (pDirection->head + 1) % RTTBENCH_MAXCHUNKS;
+        pDirection->count -= 1;
+        if(pDirection->count == 0 && pDirection->eof)
+        {
+            shutdown(pDirection->toFd, SHUT_WR);
+        }
+    }
+    return 0;
+}
+
+int rttBenchWriteConfig()
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = yes\nktls = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n", muiProxyPort);
+    fclose(pFile);
+    return 0;
+}
+
+/*********************** rttBenchRun ************************
+    The uplinks one after the other, each timed from
+    commsSendUplink() to its downlink.
+************************************************************/
+int rttBenchRun(tRttBenchRun *pRun, uint32_t uiUplinks)
+{
+    tUplinkRecord sRecord;
+    uint32_t uiAnsweredBefore;
+    uint32_t uiSynDataBefore;
+    uint32_t uiEarlyDataBefore;
+    uint64_t ulStartUs;
+    uint32_t i;
+
+    rttBenchQuiet(true);
+    if(rttBenchWriteConfig() < 0 || configInit(msConfigPath) < 0 || commsInit() < 0)
+    {
+        rttBenchQuiet(false);
+        return -1;
+    }
+    mbRejectEarlyData = pRun->rejectEarlyData;
+    pthread_mutex_lock(&msServerLock);
+    uiAnsweredBefore = muiAnswered;
+    uiSynDataBefore = muiSynData;
+    uiEarlyDataBefore = muiEarlyData;
+    pthread_mutex_unlock(&msServerLock);
+    for(i=0; i<uiUplinks; i+=1)
+    {
+        memset(&sRecord, 0, sizeof(sRecord));
+        sRecord.cmd.cmdCode = 0x02;
+        sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+        sRecord.priorityClass = UPLCLASS_TELEMETRY; // the class that may go as early data
+        memcpy(sRecord.cmd.payload, &i, sizeof(i));
+        sRecord.time = time(NULL);
+        ulStartUs = printGetMonotonicTimeUs();
+        if(commsSendUplink(&sRecord) >= 0 && memcmp(getCtrlDeckedReply()->payload, &i, sizeof(i)) == 0)
+        {
+            pRun->ok += 1;
+        }
+        mauiLatencyUs[i] = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    }
+    usleep(muiRttMs * 1000); // the last connection's close reaches the server
+    pthread_mutex_lock(&msServerLock);
+    pRun->answered = muiAnswered - uiAnsweredBefore;
+    pRun->synData = muiSynData - uiSynDataBefore;
+    pRun->earlyData = muiEarlyData - uiEarlyDataBefore;
+    pthread_mutex_unlock(&msServerLock);
+    commsClose();
+    rttBenchQuiet(false);
+
+    pRun->firstUs = mauiLatencyUs[0];
+    qsort(&mauiLatencyUs[1], uiUplinks - 1, sizeof(uint32_t), rttBenchCompare);
+    pRun->minUs = mauiLatencyUs[1];
+    pRun->medianUs = mauiLatencyUs[1 + (uiUplinks - 2) / 2];
+    pRun->maxUs = mauiLatencyUs[uiUplinks - 1];
+    return 0;
+}
+
+int rttBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void rttBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
@@ -0,0 +1,656 @@
+/*
+    Local downlink rules, run with "make rulesbench".
+
+    Evaluation: ns per rulesEvaluate() on random payloads
+    with tables of 1, 8 and RULES_MAXRULES rules, the last
+    rule of each table is the only one sure to match.
+    Consistency: a local server thread stands in for the
+    webhook. It answers from its own policy (hot threshold,
+    sunday, night hours, a price table) coded independently
+    of SACRules.c, and sends that policy as a rule table
+    (RULES_HEADER) when a request carries another version.
+    The comms module sends the uplinks over http, each
+    command is answered locally first like in
+    S_PARSECMDSEND. Phases:
+        v1:     first uplink fetches the table, every later
+                command must be answered locally and agree;
+        v2:     the server changes thresholds and prices,
+                the next reply brings the new table;
+        drift:  the server changes a price but keeps the
+                version, the slave must see the disagreement
+                and stop answering locally;
+        v3:     the new version lifts the suspension.
+    Finally the table must come back from RULES_PATH after a
+    restart (rulesInit()).
+
+    Usage:
+        SACRulesBench [-n commands per phase] [-e evaluations] [-r rtt ms] [-d dir]
+    Exit code 1 when a phase ends up in the wrong state or
+    the local answers are slower than RULESBENCH_MAXLOCALUS.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <zlib.h> /* crc32 */
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACRules.h"
+
+#define RULESBENCH_COMMANDS     200 // per phase
+#define RULESBENCH_EVALUATIONS  1000000
+#define RULESBENCH_RTTMS        10
+#define RULESBENCH_MAXLOCALUS   200 // p99 of a local answer
+#define RULESBENCH_PRODUCTS     4 // product 0: no price
+#define RULESBENCH_BUFSIZE      4096
+#define RULESBENCH_HOT          0x01 // downlink codes of the policy
+#define RULESBENCH_CLOSED       0x02
+#define RULESBENCH_NIGHT        0x03
+#define RULESBENCH_PRICE        0x04
+#define RULESBENCH_DEFAULT      0x00
+
+/*
+    The bench's payload, fields little endian like the
+    controller's: temperature in 0.1 degrees (2 bytes) |
+    product | command counter (4 bytes).
+*/
+
+typedef struct
+{
+    uint32_t version;
+    uint16_t hotThreshold;
+    uint16_t nightStart; // minute of the day
+    uint16_t nightEnd;
+    uint16_t prices[RULESBENCH_PRODUCTS];
+} tRulesBenchPolicy;
+
+typedef struct
+{
+    const char *name;
+    const tRulesBenchPolicy *policy;
+    uint32_t commands;
+    uint32_t answered; // locally
+    uint32_t superseded; // answered by the table before the server's current version
+    uint32_t agreed; // local answer == server reply, counted here
+    uint32_t disagreed;
+    uint32_t failed;
+    uint64_t uplinkUsSum;
+    uint32_t localUs[RULESBENCH_COMMANDS * 10];
+} tRulesBenchPhase;
+
+/****************** private function prototypes *********************/
+int rulesBenchListen();
+void *rulesBenchServer(void *pArg);
+void rulesBenchServeConnection(int iFd);
+void rulesBenchPolicyDownlink(const tRulesBenchPolicy *pPolicy, const uint8_t *pPayload, long unsigned int ulTime, uint8_t *pDownlink);
+int rulesBenchPolicyTable(const tRulesBenchPolicy *pPolicy, uint8_t *pTable);
+int rulesBenchTableEnd(uint8_t *pTable, uint32_t uiVersion, int iRules);
+uint8_t *rulesBenchRule(uint8_t *pRule, uint8_t bField, uint8_t bWidth, tRulesOp eOp, uint32_t uiA, uint32_t uiB, uint8_t bCode, uint16_t uiValue);
+void rulesBenchPutU32(uint8_t *pDest, uint32_t uiValue);
+double rulesBenchEvaluate(int iRules, uint32_t uiEvaluations);
+int rulesBenchWriteConfig();
+void rulesBenchRunPhase(tRulesBenchPhase *pPhase);
+void rulesBenchDone(tUplinkRecord *pRecord, int iResult);
+void rulesBenchRandomCommand(tCtrlSendCmd *pCmd, uint32_t uiCounter);
+uint32_t rulesBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent);
+int rulesBenchCompare(const void *pA, const void *pB);
+void rulesBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static int miListenFd = -1;
+static uint16_t muiPort = 0;
+static uint32_t muiRttMs = RULESBENCH_RTTMS;
+static volatile bool mbServerRunning = true;
+static const tRulesBenchPolicy * volatile mpServerPolicy = NULL; // switched between phases, nothing is in flight then
+static uint32_t muiServerTables = 0; // tables the server handed out
+static bool mbDone = false;
+static int miDoneResult = 0;
+static uint8_t mabDoneDownlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+static const tRulesBenchPolicy msPolicyV1 =
+{
+    .version = 1, .hotThreshold = 800, .nightStart = 22 * 60, .nightEnd = 23 * 60 + 59,
+    .prices = {0, 150, 200, 250},
+};
+static const tRulesBenchPolicy msPolicyV2 =
+{
+    .version = 2, .hotThreshold = 750, .nightStart = 21 * 60, .nightEnd = 23 * 60 + 59,
+    .prices = {0, 160, 210, 260},
+};
+static const tRulesBenchPolicy msPolicyDrift = // the server's answers change, its version does not
+{
+    .version = 2, .hotThreshold = 750, .nightStart = 21 * 60, .nightEnd = 23 * 60 + 59,
+    .prices = {0, 160, 230, 260},
+};
+static const tRulesBenchPolicy msPolicyV3 =
+{
+    .version = 3, .hotThreshold = 750, .nightStart = 21 * 60, .nightEnd = 23 * 60 + 59,
+    .prices = {0, 160, 230, 260},
+};
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    static tRulesBenchPhase asPhases[] =
+    {
+        {.name = "v1", .policy = &msPolicyV1},
+        {.name = "v2", .policy = &msPolicyV2},
+        {.name = "drift", .policy = &msPolicyDrift},
+        {.name = "v3", .policy = &msPolicyV3},
+    };
+    const int aiTableSizes[] = {1, 8, RULES_MAXRULES};
+    uint32_t uiCommands = RULESBENCH_COMMANDS;
+    uint32_t uiEvaluations = RULESBENCH_EVALUATIONS;
+    uint32_t uiLocalP99 = 0;
+    pthread_t sThread;
+    bool bPass = true;
+    double dNs;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "n:e:r:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiCommands = atoi(optarg); break;
+            case 'e': uiEvaluations = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n commands per phase] [-e evaluations] [-r rtt ms] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiCommands < 2 || uiCommands > sizeof(asPhases[0].localUs) / sizeof(uint32_t) || uiEvaluations == 0)
+    {
+        fprintf(stderr, "Need 2..%u commands per phase and at least one evaluation.\n", (uint32_t)(sizeof(asPhases[0].localUs) / sizeof(uint32_t)));
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACRulesBench.%i.conf", sDir, (int)getpid());
+    if(rulesBenchListen() < 0)
+    {
+        fprintf(stderr, "Could not open the local server.\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand(1);
+    unlink(RULES_PATH);
+
+    rulesBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    if(rulesBenchWriteConfig() < 0 || configInit(msConfigPath) < 0 || commsInit() < 0)
+    {
+        rulesBenchQuiet(false);
+        fprintf(stderr, "Could not load %s.\n", msConfigPath);
+        return 1;
+    }
+    rulesInit();
+    rulesBenchQuiet(false);
+
+    fprintf(stderr, "evaluation, %u random payloads per table\n", uiEvaluations);
+    for(i=0; i<(int)(sizeof(aiTableSizes) / sizeof(aiTableSizes[0])); i+=1)
+    {
+        rulesBenchQuiet(true);
+        dNs = rulesBenchEvaluate(aiTableSizes[i], uiEvaluations);
+        rulesBenchQuiet(false);
+        fprintf(stderr, "%3i rules %10.1f ns per evaluation\n", aiTableSizes[i], dNs);
+        bPass = bPass && dNs > 0.0;
+    }
+
+    rulesBenchQuiet(true);
+    rulesInit(); // the evaluation tables were never stored
+    rulesBenchQuiet(false);
+    pthread_create(&sThread, NULL, rulesBenchServer, NULL);
+    fprintf(stderr, "consistency, %u commands per phase, %u ms rtt\n", uiCommands, muiRttMs);
+    fprintf(stderr, "%-8s %8s %9s %8s %10s %11s %7s %11s %11s %12s %8s\n", "phase", "version", "answered", "agreed", "disagreed", "superseded", "failed", "local p50", "local p99", "uplink avg", "state");
+    for(i=0; i<(int)(sizeof(asPhases) / sizeof(asPhases[0])); i+=1)
+    {
+        tRulesBenchPhase *pPhase = &asPhases[i];
+        const tRulesStats *pStats = rulesStats();
+        pPhase->commands = uiCommands;
+        mpServerPolicy = pPhase->policy;
+        rulesBenchQuiet(true);
+        rulesBenchRunPhase(pPhase);
+        rulesBenchQuiet(false);
+        fprintf(stderr, "%-8s %8u %9u %8u %10u %11u %7u %8u us %8u us %9.1f ms %8s\n", pPhase->name, pStats->version,
+            pPhase->answered, pPhase->agreed, pPhase->disagreed, pPhase->superseded, pPhase->failed,
+            rulesBenchPercentile(pPhase->localUs, pPhase->answered, 50), rulesBenchPercentile(pPhase->localUs, pPhase->answered, 99),
+            pPhase->uplinkUsSum / 1000.0 / uiCommands, pStats->suspended ? "suspended" : "ok");
+        if(pPhase->answered > 0 && rulesBenchPercentile(pPhase->localUs, pPhase->answered, 99) > uiLocalP99)
+        {
+            uiLocalP99 = rulesBenchPercentile(pPhase->localUs, pPhase->answered, 99);
+        }
+        bPass = bPass && pPhase->failed == 0 && pStats->version == pPhase->policy->version;
+        if(pPhase->policy == &msPolicyDrift)
+        {
+            // caught, and nothing answered locally after that
+            bPass = bPass && pPhase->disagreed == 1 && pStats->suspended && pPhase->answered == pPhase->agreed + 1;
+        }
+        else
+        {
+            // the first command of a phase may go without a table or with the old one
+            bPass = bPass && pPhase->disagreed == 0 && !pStats->suspended && pPhase->agreed >= uiCommands - 1;
+        }
+    }
+    fprintf(stderr, "%u tables sent by the server, %llu installed, %llu disagreements seen by the slave\n", muiServerTables,
+        (unsigned long long)rulesStats()->installed, (unsigned long long)rulesStats()->disagreed);
+    bPass = bPass && uiLocalP99 <= RULESBENCH_MAXLOCALUS;
+
+    rulesBenchQuiet(true);
+    rulesInit();
+    rulesBenchQuiet(false);
+    fprintf(stderr, "restart: table version %u with %u rules from %s\n", rulesVersion(), rulesStats()->rules, RULES_PATH);
+    bPass = bPass && rulesVersion() == msPolicyV3.version;
+
+    mbServerRunning = false;
+    commsClose();
+    unlink(msConfigPath);
+    unlink(RULES_PATH);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/******************** rulesBenchEvaluate ********************
+    Average ns per evaluation, the table is installed
+    without keeping it on disk.
+************************************************************/
+double rulesBenchEvaluate(int iRules, uint32_t uiEvaluations)
+{
+    static const tRulesOp aeOps[] = {RULES_OP_EQ, RULES_OP_GE, RULES_OP_IN, RULES_OP_MASK};
+    uint8_t abTable[RULES_TABLEMAXSIZE];
+    uint8_t abDownlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    tCtrlSendCmd asCmds[256];
+    uint8_t *pRule = &abTable[5];
+    uint32_t uiMatched = 0;
+    uint64_t ulStartUs;
+    uint64_t ulUs;
+    uint32_t i;
+
+    for(i=0; i<(uint32_t)iRules - 1; i+=1)
+    {
+        uint8_t bWidth = 1 + rand() % 4;
+        pRule = rulesBenchRule(pRule, rand() % (STRUCTS_SENDCMDPAYLOADSIZE - bWidth + 1), bWidth, aeOps[rand() % 4], 0xFFFFFFFF, 0xFFFFFFFF, i + 1, 0); // never matches the bench's payloads
+    }
+    pRule = rulesBenchRule(pRule, RULES_FIELD_MINUTE, 0, RULES_OP_IN, 0, 24 * 60, RULESBENCH_DEFAULT, 0);
+    rulesInstall(abTable, rulesBenchTableEnd(abTable, 1000 + iRules, iRules), false);
+    for(i=0; i<256; i+=1)
+    {
+        rulesBenchRandomCommand(&asCmds[i], i);
+    }
+    ulStartUs = printGetMonotonicTimeUs();
+    for(i=0; i<uiEvaluations; i+=1)
+    {
+        uiMatched += rulesEvaluate(&asCmds[i & 0xFF], 1700000000 + i, abDownlink) ? 1 : 0;
+    }
+    ulUs = printGetMonotonicTimeUs() - ulStartUs;
+    return (uiMatched == uiEvaluations) ? ulUs * 1000.0 / uiEvaluations : -1.0;
+}
+
+/******************** rulesBenchRunPhase ********************
+    One command after the other: local answer, then the
+    uplink, then the next command once the server replied.
+************************************************************/
+void rulesBenchRunPhase(tRulesBenchPhase *pPhase)
+{
+    static uint32_t uiCounter = 0;
+    uint8_t abLocal[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    tUplinkRecord sRecord;
+    uint64_t ulStartUs;
+    bool bLocal;
+    bool bCurrent;
+    uint32_t i;
+
+    for(i=0; i<pPhase->commands; i+=1)
+    {
+        memset(&sRecord, 0, sizeof(sRecord));
+        rulesBenchRandomCommand(&sRecord.cmd, uiCounter);
+        sRecord.id = uiCounter;
+        sRecord.time = 1700000000 + (rand() % (7 * 24 * 60)) * 60; // spread over a week, for the schedule rules
+        ulStartUs = printGetMonotonicTimeUs();
+        bLocal = rulesEvaluate(&sRecord.cmd, sRecord.time, abLocal);
+        bCurrent = (rulesVersion() == pPhase->policy->version);
+        if(bLocal)
+        {
+            rulesAnswered(sRecord.id, abLocal);
+            pPhase->localUs[pPhase->answered] = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+            pPhase->answered += 1;
+        }
+        uiCounter += 1;
+
+        mbDone = false;
+        sRecord.sendStartUs = printGetMonotonicTimeUs();
+        if(commsStartUplink(&sRecord, rulesBenchDone) < 0)
+        {
+            pPhase->failed += 1;
+            continue;
+        }
+        while(!mbDone)
+        {
+            reactorRunOnce(100);
+        }
+        pPhase->uplinkUsSum += printGetMonotonicTimeUs() - sRecord.sendStartUs;
+        if(miDoneResult < 0)
+        {
+            pPhase->failed += 1;
+        }
+        else if(bLocal && !bCurrent)
+        {
+            pPhase->superseded += 1; // the reply brought the new table, the slave does not compare this one
+        }
+        else if(bLocal && memcmp(abLocal, mabDoneDownlink, STRUCTS_DECKEDREPLYPAYLOADSIZE) == 0)
+        {
+            pPhase->agreed += 1;
+        }
+        else if(bLocal)
+        {
+            pPhase->disagreed += 1;
+        }
+    }
+}
+
+void rulesBenchDone(tUplinkRecord *pRecord, int iResult)
+{
+    mbDone = true;
+    miDoneResult = iResult;
+    memcpy(mabDoneDownlink, getCtrlDeckedReply()->payload, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+}
+
+void rulesBenchRandomCommand(tCtrlSendCmd *pCmd, uint32_t uiCounter)
+{
+    uint16_t uiTemperature = rand() % 1000;
+
+    memset(pCmd, 0, sizeof(tCtrlSendCmd));
+    pCmd->startTag = IOT_FRMSTARTTAG;
+    pCmd->cmdCode = 0x02;
+    pCmd->payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    pCmd->downlinkIndicator = 0x01;
+    structsSetPayloadField(pCmd->payload, 0, 2, uiTemperature);
+    pCmd->payload[2] = rand() % RULESBENCH_PRODUCTS;
+    structsSetPayloadField(pCmd->payload, 3, 4, uiCounter);
+    pCmd->endTag = IOT_FRMENDTAG;
+}
+
+/***************** rulesBenchPolicyDownlink *****************
+    The server's answer, written the way a backend would,
+    not from the table.
+************************************************************/
+void rulesBenchPolicyDownlink(const tRulesBenchPolicy *pPolicy, const uint8_t *pPayload, long unsigned int ulTime, uint8_t *pDownlink)
+{
+    time_t sTime = (time_t)ulTime;
+    struct tm sLocalTime;
+    uint16_t uiTemperature = pPayload[0] | (pPayload[1] << 8); // decoded by hand, not through SACStructs.c
+    uint8_t bProduct = pPayload[2];
+    int iMinute;
+
+    localtime_r(&sTime, &sLocalTime);
+    iMinute = sLocalTime.tm_hour * 60 + sLocalTime.tm_min;
+    memset(pDownlink, 0, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    if(uiTemperature >= pPolicy->hotThreshold)
+    {
+        pDownlink[0] = RULESBENCH_HOT;
+    }
+    else if(sLocalTime.tm_wday == 0)
+    {
+        pDownlink[0] = RULESBENCH_CLOSED;
+    }
+    else if(iMinute >= pPolicy->nightStart && iMinute <= pPolicy->nightEnd)
+    {
+        pDownlink[0] = RULESBENCH_NIGHT;
+    }
+    else if(bProduct > 0 && bProduct < RULESBENCH_PRODUCTS)
+    {
+        pDownlink[0] = RULESBENCH_PRICE;
+        pDownlink[1] = pPolicy->prices[bProduct] >> 8;
+        pDownlink[2] = pPolicy->prices[bProduct] & 0xFF;
+    }
+    else
+    {
+        pDownlink[0] = RULESBENCH_DEFAULT;
+    }
+}
+
+/****************** rulesBenchPolicyTable *******************
+    The same policy as a rule table, returns its length.
+************************************************************/
+int rulesBenchPolicyTable(const tRulesBenchPolicy *pPolicy, uint8_t *pTable)
+{
+    uint8_t *pRule = &pTable[5];
+    int i;
+
+    pRule = rulesBenchRule(pRule, 0, 2, RULES_OP_GE, pPolicy->hotThreshold, 0, RULESBENCH_HOT, 0);
+    pRule = rulesBenchRule(pRule, RULES_FIELD_WEEKDAY, 0, RULES_OP_EQ, 0, 0, RULESBENCH_CLOSED, 0);
+    pRule = rulesBenchRule(pRule, RULES_FIELD_MINUTE, 0, RULES_OP_IN, pPolicy->nightStart, pPolicy->nightEnd, RULESBENCH_NIGHT, 0);
+    for(i=1; i<RULESBENCH_PRODUCTS; i+=1)
+    {
+        pRule = rulesBenchRule(pRule, 2, 1, RULES_OP_EQ, i, 0, RULESBENCH_PRICE, pPolicy->prices[i]);
+    }
+    pRule = rulesBenchRule(pRule, 0, 1, RULES_OP_ANY, 0, 0, RULESBENCH_DEFAULT, 0);
+    return rulesBenchTableEnd(pTable, pPolicy->version, 3 + (RULESBENCH_PRODUCTS - 1) + 1);
+}
+
+int rulesBenchTableEnd(uint8_t *pTable, uint32_t uiVersion, int iRules)
+{
+    int iLength = 5 + iRules * RULES_RULESIZE;
+
+    rulesBenchPutU32(pTable, uiVersion);
+    pTable[4] = (uint8_t)iRules;
+    rulesBenchPutU32(&pTable[iLength], (uint32_t)crc32(0L, pTable, iLength));
+    return iLength + 4;
+}
+
+/********************* rulesBenchRule ***********************
+    One rule for any command code, the downlink is bCode
+    followed by uiValue, returns where the next one goes.
+************************************************************/
+uint8_t *rulesBenchRule(uint8_t *pRule, uint8_t bField, uint8_t bWidth, tRulesOp eOp, uint32_t uiA, uint32_t uiB, uint8_t bCode, uint16_t uiValue)
+{
+    memset(pRule, 0, RULES_RULESIZE);
+    pRule[1] = bField;
+    pRule[2] = bWidth;
+    pRule[3] = (uint8_t)eOp;
+    rulesBenchPutU32(&pRule[4], uiA);
+    rulesBenchPutU32(&pRule[8], uiB);
+    pRule[12] = bCode;
+    pRule[13] = uiValue >> 8;
+    pRule[14] = uiValue & 0xFF;
+    return pRule + RULES_RULESIZE;
+}
+
+void rulesBenchPutU32(uint8_t *pDest, uint32_t uiValue)
+{
+    pDest[0] = uiValue >> 24;
+    pDest[1] = (uiValue >> 16) & 0xFF;
+    pDest[2] = (uiValue >> 8) & 0xFF;
+    pDest[3] = uiValue & 0xFF;
+}
+
+int rulesBenchListen()
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    miListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(miListenFd < 0 || bind(miListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(miListenFd, 8) < 0)
+    {
+        return -1;
+    }
+    getsockname(miListenFd, (struct sockaddr *)&sAddr, &uiLength);
+    muiPort = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+void *rulesBenchServer(void *pArg)
+{
+    int iFd;
+    while(mbServerRunning)
+    {
+        iFd = accept(miListenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        rulesBenchServeConnection(iFd);
+        close(iFd);
+    }
+    return NULL;
+}
+
+/**************** rulesBenchServeConnection *****************
+    Requests one after the other, each answered one RTT
+    after it arrived.
+************************************************************/
+void rulesBenchServeConnection(int iFd)
+{
+    char sBuffer[RULESBENCH_BUFSIZE];
+    char sResponse[RULESBENCH_BUFSIZE];
+    char sHeader[2 * RULES_TABLEMAXSIZE + 32];
+    uint8_t abPayload[STRUCTS_SENDCMDPAYLOADSIZE];
+    uint8_t abDownlink[STRUCTS_DECKEDREPLYPAYLOADSIZE];
+    uint8_t abTable[RULES_TABLEMAXSIZE];
+    struct pollfd sPoll = {.fd = iFd, .events = POLLIN};
+    const tRulesBenchPolicy *pPolicy;
+    int iLength = 0;
+    char *pEnd;
+    char *pField;
+    unsigned int uiByte;
+    unsigned long ulTime;
+    int iResult;
+    int i;
+
+    while(1)
+    {
+        if(poll(&sPoll, 1, 100) <= 0)
+        {
+            if(!mbServerRunning)
+            {
+                return;
+            }
+            continue;
+        }
+        iResult = read(iFd, &sBuffer[iLength], sizeof(sBuffer) - 1 - iLength);
+        if(iResult <= 0)
+        {
+            return;
+        }
+        iLength += iResult;
+        sBuffer[iLength] = 0x00;
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL)
+        {
+            *pEnd = 0x00;
+            pPolicy = mpServerPolicy;
+            memset(abPayload, 0, sizeof(abPayload));
+            ulTime = 0;
+            if((pField = strstr(sBuffer, "&time=")) != NULL)
+            {
+                ulTime = strtoul(pField + 6, NULL, 10);
+            }
+            if((pField = strstr(sBuffer, "&data=")) != NULL)
+            {
+                for(i=0; i<STRUCTS_SENDCMDPAYLOADSIZE && sscanf(pField + 6 + 2 * i, "%2x", &uiByte) == 1; i+=1)
+                {
+                    abPayload[i] = (uint8_t)uiByte;
+                }
+            }
+            sHeader[0] = 0x00;
+            if((pField = strstr(sBuffer, "&rules=")) != NULL && strtoul(pField + 7, NULL, 10) != pPolicy->version)
+            {
+                int iTableLength = rulesBenchPolicyTable(pPolicy, abTable);
+                iResult = snprintf(sHeader, sizeof(sHeader), "%s ", RULES_HEADER);
+                for(i=0; i<iTableLength; i+=1)
+                {
+                    iResult += snprintf(&sHeader[iResult], sizeof(sHeader) - iResult, "%02X", abTable[i]);
+                }
+                snprintf(&sHeader[iResult], sizeof(sHeader) - iResult, "\r\n");
+                muiServerTables += 1;
+            }
+            rulesBenchPolicyDownlink(pPolicy, abPayload, ulTime, abDownlink);
+            iResult = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACRulesBench\r\n%sTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n", sHeader);
+            for(i=0; i<STRUCTS_DECKEDREPLYPAYLOADSIZE; i+=1)
+            {
+                iResult += snprintf(&sResponse[iResult], sizeof(sResponse) - iResult, "%02X", abDownlink[i]); // not printBytesAsHexString(), its buffer belongs to the comms thread
+            }
+            iResult += snprintf(&sResponse[iResult], sizeof(sResponse) - iResult, "\r\n0\r\n\r\n");
+            usleep(muiRttMs * 1000);
+            if(send(iFd, sResponse, iResult, MSG_NOSIGNAL) != iResult)
+            {
+                return;
+            }
+            pEnd += 4;
+            iLength -= (pEnd - sBuffer);
+            memmove(sBuffer, pEnd, iLength + 1);
+        }
+    }
+}
+
+int rulesBenchWriteConfig()
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = no\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n\n[rules]\nenabled = yes\n", muiPort);
+    fclose(pFile);
+    return 0;
+}
+
+uint32_t rulesBenchPercentile(uint32_t *auiSamples, uint32_t uiCount, uint32_t uiPercent)
+{
+    if(uiCount == 0)
+    {
+        return 0;
+    }
+    qsort(auiSamples, uiCount, sizeof(uint32_t), rulesBenchCompare);
+    return auiSamples[(uiCount - 1) * uiPercent / 100];
+}
+
+int rulesBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+void rulesBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
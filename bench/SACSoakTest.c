@@ -0,0 +1,1234 @@
+/*
+    Soak and endurance test, run with "make soaktest".
+
+    The whole daemon runs in a thread of this process: its
+    main() (built as slaveMain() with the config file, state
+    file and status segment under /tmp), the reactor, the
+    uplink queues, the http transport with TLS, all over the
+    simulated BSC. Around it:
+        controller  a thread playing the dispenser: telemetry
+                    0x02 and alarms 0x03 in lockstep, events
+                    as tagged sends 0x04 polled with 0x05.
+                    Every downlink must echo the command
+                    counter.
+        server      a child process with two TLS endpoints A
+                    and B (keep alive, pipelining, bulk POSTs)
+                    and injected faults: 503 answers,
+                    connections dropped without an answer,
+                    answers later than the socket timeout, B
+                    down for a while, both down (the backlog
+                    goes out in bulk afterwards).
+        faults      config reloads (SIGHUP) switching
+                    pipelining on and off, BSC stalls the daemon
+                    has to recover from.
+    Traffic and faults follow a schedule in simulated time,
+    -x runs it that many times faster (-x 60: an hour per
+    minute). The rate limit is scaled by -x as well, the
+    daemon's own timers (socket timeout, circuit breaker,
+    housekeeping) are not.
+    Every -i seconds a sample is taken: RSS, open fds, live
+    SSL and SSL_CTX objects (this binary wraps SSL_new and
+    friends), bytes OpenSSL holds in the memory pool, queued
+    uplinks (status segment) and the latency percentiles of
+    the commands of the window. After a warm up the samples
+    are cut in four quarters, a series whose quarter medians
+    rise from quarter to quarter by more than its tolerance
+    in total is flagged as drift.
+
+    Usage:
+        SACSoakTest [-t seconds] [-x compression] [-i sample seconds] [-o samples.csv] [-s seed] [-l daemon log]
+    Exit code 1 on drift, a wrong downlink, too many lost
+    commands, an unrecovered BSC stall or a daemon that
+    doesn't stop.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h> /* offsetof */
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/ec.h>
+#include <openssl/x509.h>
+#include <pigpio.h>
+
+#include "SACRPiIotSlave.h"
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACConfig.h"
+#include "SACStateFile.h"
+#include "SACStatusShm.h"
+#include "SACMemPool.h"
+#include "SACBulkUpload.h"
+#include "SACAsyncCmd.h"
+#include "SACTrace.h"
+#include "SACBenchBsc.h"
+
+#define SOAK_SECONDS            (4 * 3600) // wall clock
+#define SOAK_COMPRESSION        1
+#define SOAK_SAMPLESEC          10
+#define SOAK_MAXSAMPLES         20000
+#define SOAK_MINSAMPLES         12 // at least 2 per quarter after the warm up
+#define SOAK_WARMUPDIV          8 // the first 1/8 of the samples is the warm up
+#define SOAK_NODES              2 // A and B
+#define SOAK_SOCKETSEC          2 // [timeouts] socket_sec of the daemon
+#define SOAK_RATEPERMIN         60 // [uplink] rate_per_min of a metered link, in simulated time
+#define SOAK_PIPEDEPTH          4 // pipeline_depth after every other reload
+#define SOAK_CMDTIMEOUTMS       15000 // a frame the slave didn't finish by then is lost
+#define SOAK_QUERYMS            50 // tagged: status query interval of the controller
+#define SOAK_WINDOW             8 // tagged commands outstanding at the controller
+#define SOAK_WINDOWMAX          4096 // latencies kept per sample window
+#define SOAK_MAXLOSTPERMILLE    20
+#define SOAK_STOPMS             5000 // SIGTERM until the daemon's main() returned
+#define SOAK_BSCRECOVERMS       10000
+#define SOAK_BUFSIZE            (4 * HTTPMSGMAXSIZE)
+/* traffic, simulated seconds */
+#define SOAK_TELEMETRYSEC       60
+#define SOAK_EVENTSEC           30 // mean, uniform 0 .. 2x
+#define SOAK_ALARMSEC           1200
+/* fault schedule, simulated seconds: every SOAK_FAULTPERIODSEC the same, so every quarter of a whole number of periods sees the same faults */
+#define SOAK_FAULTPERIODSEC     3600
+#define SOAK_BDOWNATSEC         1200 // B refuses connections
+#define SOAK_BDOWNSEC           300
+#define SOAK_OUTAGEATSEC        2700 // A and B refuse connections
+#define SOAK_OUTAGESEC          240
+#define SOAK_RELOADSEC          900
+#define SOAK_BSCFAULTATSEC      600
+#define SOAK_BSCFAULTSEC        1800 // every other one an rx stall
+/* server faults, per request */
+#define SOAK_LATENCYMS          20
+#define SOAK_503PERMILLE        20
+#define SOAK_DROPPERMILLE       10
+#define SOAK_SLOWPERMILLE       3 // answered after the socket timeout
+
+typedef struct
+{
+    double wallSec;
+    double simSec;
+    double rssKb;
+    double fds;
+    double ssl;
+    double sslCtx;
+    double poolKb;
+    double queued;
+    double p50Ms; // lockstep commands, -1: none in the window
+    double p95Ms;
+    double p99Ms;
+    double taggedP95Ms; // tagged: accepted until done
+} tSoakSample;
+
+typedef struct
+{
+    const char *name;
+    size_t offset; // in tSoakSample
+    double tolerance; // total rise over the quarters that is still no drift
+    double toleranceRatio; // or this share of the first quarter's median, whichever is larger
+} tSoakSeries;
+
+typedef struct
+{
+    volatile uint32_t requests;
+    volatile uint32_t bulkPosts;
+    volatile uint32_t errors503;
+    volatile uint32_t dropped;
+    volatile uint32_t slow;
+    volatile uint32_t connections;
+    volatile uint32_t outages; // listener closed
+} tSoakServerStats;
+
+typedef struct
+{
+    uint8_t tag;
+    uint32_t counter;
+    uint64_t sentUs;
+} tSoakOutstanding;
+
+/****************** daemon internals used by the test ***************************/
+extern tSmState sState;
+int slaveMain(int argc, char* argv[]);
+SSL *__real_SSL_new(SSL_CTX *pContext);
+void __real_SSL_free(SSL *pSsl);
+SSL_CTX *__real_SSL_CTX_new(const SSL_METHOD *pMethod);
+void __real_SSL_CTX_free(SSL_CTX *pContext);
+/*********************************************************************************/
+
+/****************** private function prototypes *********************/
+double soakSimSeconds();
+bool soakNodeDown(int iNode, double dSimSec);
+int soakListen(uint16_t *pPort);
+int soakWriteConfig(uint32_t uiPipelineDepth);
+void *soakDaemon(void *pArg);
+void *soakController(void *pArg);
+int soakTransact(const uint8_t *pFrame, int iLength);
+void soakLockstep(uint8_t bCmdCode);
+void soakTaggedSend();
+void soakTaggedQuery();
+void soakRecordLatency(bool bTagged, uint64_t ulSentUs);
+void soakBscFault();
+void soakTakeSample(tSoakSample *pSample);
+double soakPercentile(uint32_t *pValues, uint32_t uiCount, uint32_t uiPercentile);
+int soakCompareMs(const void *pA, const void *pB);
+int soakCompare(const void *pA, const void *pB);
+double soakMedian(uint32_t uiFirst, uint32_t uiCount, size_t uiOffset);
+bool soakCheckDrift(uint32_t uiSamples);
+void soakServer(int *pListenFds, uint16_t *pPorts);
+int soakServerContext();
+void *soakServerConnection(void *pArg);
+int soakServerRead(SSL *pSsl, char *sBuffer, int *pBuffered, int *pHeaderLength);
+int soakServerAnswer(char *sRequest, int iLength, int iHeaderLength, char *sResponse, int iMaxLength);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static double mdCompression = SOAK_COMPRESSION;
+static uint64_t mulStartUs = 0;
+static volatile bool mbStop = false;
+static volatile bool mbDaemonDone = false;
+static pthread_t msDaemonThread;
+static uint16_t mauiPorts[SOAK_NODES];
+static tSoakServerStats *mpServerStats = NULL; // shared with the server process
+static SSL_CTX *mpServerContext = NULL; // server process
+static volatile int32_t miSslObjects = 0;
+static volatile int32_t miSslContexts = 0;
+static unsigned int muiSeed = 1;
+/* controller */
+static uint32_t muiCounter = 0;
+static tSoakOutstanding masOutstanding[SOAK_WINDOW];
+static uint32_t muiOutstanding = 0;
+static uint8_t mbNextTag = 1;
+static uint32_t muiLockstep = 0;
+static uint32_t muiTagged = 0;
+static uint32_t muiUnreachable = 0; // lockstep answered I2CERRORCODE_SERVERUNREACH
+static uint32_t muiTaggedDropped = 0;
+static uint32_t muiTaggedRefused = 0;
+static uint32_t muiLost = 0;
+static uint32_t muiWrong = 0;
+static uint32_t muiReloads = 0;
+static uint32_t muiBscFaults = 0;
+static uint32_t muiBscUnrecovered = 0;
+static pthread_mutex_t msLatencyLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t mauiLockstepMs[SOAK_WINDOWMAX];
+static uint32_t muiLockstepCount = 0;
+static uint32_t mauiTaggedMs[SOAK_WINDOWMAX];
+static uint32_t muiTaggedCount = 0;
+/* sampler */
+static tSoakSample masSamples[SOAK_MAXSAMPLES];
+static const tStatusShm *mpStatus = NULL;
+static const tSoakSeries masSeries[] =
+{
+    {"rss kB", offsetof(tSoakSample, rssKb), 1024, 0},
+    {"open fds", offsetof(tSoakSample, fds), 2, 0},
+    {"SSL objects", offsetof(tSoakSample, ssl), 2, 0},
+    {"SSL_CTX objects", offsetof(tSoakSample, sslCtx), 0, 0},
+    {"pool kB", offsetof(tSoakSample, poolKb), 64, 0},
+    {"queued uplinks", offsetof(tSoakSample, queued), 32, 0},
+    {"lockstep p50 ms", offsetof(tSoakSample, p50Ms), 50, 0.5},
+    {"lockstep p95 ms", offsetof(tSoakSample, p95Ms), 100, 0.5},
+    {"lockstep p99 ms", offsetof(tSoakSample, p99Ms), 200, 0.5},
+    {"tagged p95 ms", offsetof(tSoakSample, taggedP95Ms), 100, 0.5},
+};
+/********************************************************************/
+
+/****************** TLS object counts, -Wl,--wrap=... ***************/
+SSL *__wrap_SSL_new(SSL_CTX *pContext)
+{
+    SSL *pSsl = __real_SSL_new(pContext);
+    if(pSsl != NULL)
+    {
+        __atomic_add_fetch(&miSslObjects, 1, __ATOMIC_RELAXED);
+    }
+    return pSsl;
+}
+
+void __wrap_SSL_free(SSL *pSsl)
+{
+    if(pSsl != NULL)
+    {
+        __atomic_sub_fetch(&miSslObjects, 1, __ATOMIC_RELAXED);
+    }
+    __real_SSL_free(pSsl);
+}
+
+SSL_CTX *__wrap_SSL_CTX_new(const SSL_METHOD *pMethod)
+{
+    SSL_CTX *pContext = __real_SSL_CTX_new(pMethod);
+    if(pContext != NULL)
+    {
+        __atomic_add_fetch(&miSslContexts, 1, __ATOMIC_RELAXED);
+    }
+    return pContext;
+}
+
+void __wrap_SSL_CTX_free(SSL_CTX *pContext)
+{
+    if(pContext != NULL)
+    {
+        __atomic_sub_fetch(&miSslContexts, 1, __ATOMIC_RELAXED);
+    }
+    __real_SSL_CTX_free(pContext);
+}
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    uint32_t uiSeconds = SOAK_SECONDS;
+    uint32_t uiSampleSec = SOAK_SAMPLESEC;
+    uint32_t uiSamples = 0;
+    const char *sCsvPath = NULL;
+    const char *sLogPath = "/dev/null";
+    int aiListenFds[SOAK_NODES];
+    pthread_t sController;
+    sigset_t sSignals;
+    pid_t iServerPid;
+    FILE *pCsv = NULL;
+    uint64_t ulNextSampleUs;
+    uint64_t ulStopUs;
+    tStatusData sStatus;
+    bool bStopped;
+    bool bPass = true;
+    int iLogFd;
+    int iOption;
+    int i;
+
+    while((iOption = getopt(argc, argv, "t:x:i:o:s:l:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 't': uiSeconds = atoi(optarg); break;
+            case 'x': mdCompression = atof(optarg); break;
+            case 'i': uiSampleSec = atoi(optarg); break;
+            case 'o': sCsvPath = optarg; break;
+            case 's': muiSeed = atoi(optarg); break;
+            case 'l': sLogPath = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-t seconds] [-x compression] [-i sample seconds] [-o samples.csv] [-s seed] [-l daemon log]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(mdCompression < 1.0 || uiSampleSec == 0 || uiSeconds / uiSampleSec > SOAK_MAXSAMPLES)
+    {
+        fprintf(stderr, "-x must be at least 1, -t / -i at most %u samples.\n", SOAK_MAXSAMPLES);
+        return 2;
+    }
+    memset(masSamples, 0, sizeof(masSamples)); // resident from the start, the sample table must not look like a leak
+
+    /* the server first, before anything touches OpenSSL or starts a thread */
+    mpServerStats = mmap(NULL, sizeof(tSoakServerStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    for(i=0; i<SOAK_NODES; i+=1)
+    {
+        mauiPorts[i] = 0;
+        aiListenFds[i] = soakListen(&mauiPorts[i]);
+        if(aiListenFds[i] < 0 || mpServerStats == MAP_FAILED)
+        {
+            fprintf(stderr, "Could not set up the stand-in server.\n");
+            return 2;
+        }
+    }
+    mulStartUs = printGetMonotonicTimeUs();
+    iServerPid = fork();
+    if(iServerPid == 0)
+    {
+        soakServer(aiListenFds, mauiPorts);
+        _exit(0);
+    }
+    for(i=0; i<SOAK_NODES; i+=1)
+    {
+        close(aiListenFds[i]);
+    }
+    if(iServerPid < 0)
+    {
+        fprintf(stderr, "Could not start the stand-in server.\n");
+        return 2;
+    }
+
+    /* the daemon's signals go to its signalfd, Ctrl-C included */
+    sigemptyset(&sSignals);
+    sigaddset(&sSignals, SIGINT);
+    sigaddset(&sSignals, SIGTERM);
+    sigaddset(&sSignals, SIGHUP);
+    sigaddset(&sSignals, TRACE_TOGGLESIGNAL);
+    pthread_sigmask(SIG_BLOCK, &sSignals, NULL);
+    unlink(STATEFILE_PATH); // no warm restart from an earlier run
+    if(soakWriteConfig(0) < 0)
+    {
+        fprintf(stderr, "Could not write %s.\n", CONFIG_PATH);
+        kill(iServerPid, SIGKILL);
+        return 2;
+    }
+    fflush(stdout);
+    iLogFd = open(sLogPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(iLogFd >= 0)
+    {
+        dup2(iLogFd, STDOUT_FILENO);
+        close(iLogFd);
+    }
+    benchBscReset();
+    pthread_create(&msDaemonThread, NULL, soakDaemon, NULL);
+    for(i=0; i<1000 && mpStatus == NULL && !mbDaemonDone; i+=1)
+    {
+        usleep(10000);
+        mpStatus = statusShmAttach(STATUSSHM_NAME);
+    }
+    if(mpStatus == NULL)
+    {
+        fprintf(stderr, "The daemon did not come up, see %s.\n", sLogPath);
+        kill(iServerPid, SIGKILL);
+        return 1;
+    }
+    if(sCsvPath != NULL)
+    {
+        pCsv = fopen(sCsvPath, "w");
+        if(pCsv != NULL)
+        {
+            fprintf(pCsv, "wall_s,sim_s,rss_kb,fds,ssl,ssl_ctx,pool_kb,queued,p50_ms,p95_ms,p99_ms,tagged_p95_ms\n");
+        }
+    }
+    fprintf(stderr, "soak: %u s at %.0fx (%.1f simulated hours), a sample every %u s, endpoints 127.0.0.1:%u and :%u, seed %u\n",
+        uiSeconds, mdCompression, uiSeconds * mdCompression / 3600.0, uiSampleSec, mauiPorts[0], mauiPorts[1], muiSeed);
+    pthread_create(&sController, NULL, soakController, NULL);
+
+    ulNextSampleUs = printGetMonotonicTimeUs() + uiSampleSec * 1000000ULL;
+    ulStopUs = mulStartUs + uiSeconds * 1000000ULL;
+    while(!mbDaemonDone && printGetMonotonicTimeUs() < ulStopUs)
+    {
+        usleep(100000);
+        if(printGetMonotonicTimeUs() < ulNextSampleUs)
+        {
+            continue;
+        }
+        ulNextSampleUs += uiSampleSec * 1000000ULL;
+        tSoakSample *pSample = &masSamples[uiSamples];
+        soakTakeSample(pSample);
+        uiSamples += (uiSamples < SOAK_MAXSAMPLES - 1) ? 1 : 0;
+        if(pCsv != NULL)
+        {
+            fprintf(pCsv, "%.1f,%.0f,%.0f,%.0f,%.0f,%.0f,%.1f,%.0f,%.1f,%.1f,%.1f,%.1f\n", pSample->wallSec, pSample->simSec, pSample->rssKb, pSample->fds,
+                pSample->ssl, pSample->sslCtx, pSample->poolKb, pSample->queued, pSample->p50Ms, pSample->p95Ms, pSample->p99Ms, pSample->taggedP95Ms);
+            fflush(pCsv);
+        }
+    }
+    if(mbDaemonDone)
+    {
+        fprintf(stderr, "The daemon stopped after %.0f s.\n", (printGetMonotonicTimeUs() - mulStartUs) / 1e6);
+        bPass = false;
+    }
+
+    mbStop = true;
+    pthread_join(sController, NULL);
+    memset(&sStatus, 0, sizeof(sStatus));
+    statusShmRead(mpStatus, &sStatus, NULL);
+    pthread_kill(msDaemonThread, SIGTERM);
+    for(i=0; i<SOAK_STOPMS / 10 && !mbDaemonDone; i+=1)
+    {
+        usleep(10000);
+    }
+    bStopped = mbDaemonDone;
+    if(bStopped)
+    {
+        pthread_join(msDaemonThread, NULL);
+    }
+    kill(iServerPid, SIGTERM);
+    waitpid(iServerPid, NULL, 0);
+    if(pCsv != NULL)
+    {
+        fclose(pCsv);
+    }
+    unlink(CONFIG_PATH);
+    unlink(STATEFILE_PATH);
+
+    fprintf(stderr, "commands: %u lockstep (%u unreachable), %u tagged (%u dropped, %u refused), %u lost, %u wrong downlinks\n",
+        muiLockstep, muiUnreachable, muiTagged, muiTaggedDropped, muiTaggedRefused, muiLost, muiWrong);
+    fprintf(stderr, "daemon: %llu i2c frames, %llu uplinks ok, %llu failed, %u queued at the end, bsc recoveries %u/%u/%u\n",
+        (unsigned long long)sStatus.i2cFrames, (unsigned long long)sStatus.uplinksOk, (unsigned long long)sStatus.uplinksFailed, sStatus.uplinksPending,
+        sStatus.bscRecoveries[0], sStatus.bscRecoveries[1], sStatus.bscRecoveries[2]);
+    fprintf(stderr, "server: %u connections, %u requests (%u bulk), %u answered 503, %u dropped, %u late, %u outages\n",
+        mpServerStats->connections, mpServerStats->requests, mpServerStats->bulkPosts, mpServerStats->errors503, mpServerStats->dropped,
+        mpServerStats->slow, mpServerStats->outages);
+    fprintf(stderr, "faults: %u config reloads, %u bsc stalls (%u not recovered)\n", muiReloads, muiBscFaults, muiBscUnrecovered);
+    bPass &= soakCheckDrift(uiSamples);
+    if(muiWrong > 0 || muiBscUnrecovered > 0 || muiLost * 1000 > (muiLockstep + muiTagged) * SOAK_MAXLOSTPERMILLE)
+    {
+        bPass = false;
+    }
+    if(!bStopped)
+    {
+        fprintf(stderr, "The daemon did not stop within %u ms of SIGTERM.\n", SOAK_STOPMS);
+        bPass = false;
+    }
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+double soakSimSeconds()
+{
+    return (printGetMonotonicTimeUs() - mulStartUs) / 1e6 * mdCompression;
+}
+
+/********************** soakNodeDown ************************
+    B is down for SOAK_BDOWNSEC once per fault period, both
+    for SOAK_OUTAGESEC.
+************************************************************/
+bool soakNodeDown(int iNode, double dSimSec)
+{
+    double dInPeriod = dSimSec - SOAK_FAULTPERIODSEC * (uint64_t)(dSimSec / SOAK_FAULTPERIODSEC);
+
+    if(dInPeriod >= SOAK_OUTAGEATSEC && dInPeriod < SOAK_OUTAGEATSEC + SOAK_OUTAGESEC)
+    {
+        return true;
+    }
+    return (iNode == 1 && dInPeriod >= SOAK_BDOWNATSEC && dInPeriod < SOAK_BDOWNATSEC + SOAK_BDOWNSEC);
+}
+
+/*********************** soakListen *************************
+    *pPort 0: a new ephemeral port, else that port again.
+************************************************************/
+int soakListen(uint16_t *pPort)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+    int iEnable = 1;
+    int iFd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(iFd < 0)
+    {
+        return -1;
+    }
+    setsockopt(iFd, SOL_SOCKET, SO_REUSEADDR, &iEnable, sizeof(iEnable));
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(*pPort);
+    if(bind(iFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(iFd, 16) < 0)
+    {
+        close(iFd);
+        return -1;
+    }
+    getsockname(iFd, (struct sockaddr *)&sAddr, &uiLength);
+    *pPort = ntohs(sAddr.sin_port);
+    return iFd;
+}
+
+int soakWriteConfig(uint32_t uiPipelineDepth)
+{
+    FILE *pFile = fopen(CONFIG_PATH, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = localhost\nendpoints = 127.0.0.1:%u,127.0.0.1:%u\nuse_ssl = yes\npipeline_depth = %u\nuser_reply =\n\n"
+        "[timeouts]\nsocket_sec = %u\n\n[bulk]\nenabled = yes\n\n[uplink]\nrate_per_min = %u\n",
+        mauiPorts[0], mauiPorts[1], uiPipelineDepth, SOAK_SOCKETSEC, (uint32_t)(SOAK_RATEPERMIN * mdCompression)); // the link budget runs in simulated time too
+    fclose(pFile);
+    return 0;
+}
+
+void *soakDaemon(void *pArg)
+{
+    char sName[] = "SACRPiIotSlave";
+    char *asArgv[] = {sName, NULL};
+
+    slaveMain(1, asArgv);
+    mbDaemonDone = true;
+    return NULL;
+}
+
+/********************* soakController ***********************
+    The dispenser, on the simulated clock. Reloads and BSC
+    stalls are scheduled here too, between two commands
+    like they would happen on a real bus.
+************************************************************/
+void *soakController(void *pArg)
+{
+    double dTelemetryAt = 0;
+    double dEventAt = 0;
+    double dAlarmAt = SOAK_ALARMSEC / 2;
+    double dReloadAt = SOAK_RELOADSEC;
+    double dBscFaultAt = SOAK_BSCFAULTATSEC;
+    uint64_t ulQueryAtUs = 0;
+    double dSimSec;
+
+    while(!mbStop && !mbDaemonDone)
+    {
+        dSimSec = soakSimSeconds();
+        if(dSimSec >= dTelemetryAt)
+        {
+            soakLockstep(0x02);
+            dTelemetryAt += SOAK_TELEMETRYSEC;
+        }
+        else if(dSimSec >= dAlarmAt)
+        {
+            soakLockstep(UPLSCHED_CMDCODE_ALARM);
+            dAlarmAt += SOAK_ALARMSEC;
+        }
+        else if(dSimSec >= dEventAt && muiOutstanding < SOAK_WINDOW)
+        {
+            soakTaggedSend();
+            dEventAt += (rand_r(&muiSeed) % 2001) * SOAK_EVENTSEC / 1000.0;
+        }
+        else if(muiOutstanding > 0 && printGetMonotonicTimeUs() >= ulQueryAtUs)
+        {
+            soakTaggedQuery();
+            ulQueryAtUs = printGetMonotonicTimeUs() + SOAK_QUERYMS * 1000;
+        }
+        else if(dSimSec >= dReloadAt)
+        {
+            muiReloads += 1;
+            soakWriteConfig((muiReloads % 2 == 1) ? SOAK_PIPEDEPTH : 0);
+            pthread_kill(msDaemonThread, SIGHUP);
+            dReloadAt += SOAK_RELOADSEC;
+        }
+        else if(dSimSec >= dBscFaultAt)
+        {
+            soakBscFault();
+            dBscFaultAt += SOAK_BSCFAULTSEC;
+        }
+        else
+        {
+            usleep(1000);
+        }
+    }
+    return NULL;
+}
+
+/*********************** soakTransact ***********************
+    Writes a frame and waits until the slave is done with it:
+    the frame was taken, the state machine stepped past it,
+    is idle again and has the bus enabled.
+************************************************************/
+int soakTransact(const uint8_t *pFrame, int iLength)
+{
+    uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + SOAK_CMDTIMEOUTMS * 1000ULL;
+    uint32_t uiXfers;
+
+    benchBscControllerWrite(pFrame, iLength);
+    while(benchBscRxPending() > 0)
+    {
+        if(printGetMonotonicTimeUs() > ulDeadlineUs || mbStop)
+        {
+            return -1;
+        }
+        usleep(200);
+    }
+    uiXfers = benchBscXferCount();
+    while(benchBscXferCount() == uiXfers || __atomic_load_n(&sState, __ATOMIC_RELAXED) != S_IDLE || (getRawBCSCReg(3) & 0x1) == 0)
+    {
+        if(printGetMonotonicTimeUs() > ulDeadlineUs || mbStop)
+        {
+            return -1;
+        }
+        usleep(200);
+    }
+    return 0;
+}
+
+/*********************** soakLockstep ***********************
+    Send command, read enable, decked reply. A downlink must
+    be the command counter.
+************************************************************/
+void soakLockstep(uint8_t bCmdCode)
+{
+    static const uint8_t abReadEnaFrame[4] = {IOT_FRMSTARTTAG, 0x01, 0x00, IOT_FRMENDTAG};
+    tCtrlSendCmd sSend;
+    uint8_t abReply[BSC_FIFO_SIZE];
+    uint32_t uiCounter = muiCounter++;
+    uint64_t ulSentUs = printGetMonotonicTimeUs();
+
+    benchBscControllerRead(abReply, sizeof(abReply)); // leftovers of a lost command
+    memset(&sSend, 0, sizeof(sSend));
+    sSend.startTag = IOT_FRMSTARTTAG;
+    sSend.cmdCode = bCmdCode;
+    sSend.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sSend.downlinkIndicator = 0x01;
+    memcpy(sSend.payload, &uiCounter, sizeof(uiCounter));
+    sSend.endTag = IOT_FRMENDTAG;
+    muiLockstep += 1;
+    if(soakTransact(sSend.ui8, sizeof(sSend.ui8)) < 0 || soakTransact(abReadEnaFrame, sizeof(abReadEnaFrame)) < 0 ||
+        benchBscControllerRead(abReply, STRUCTS_DECKEDREPLYTOTALSIZE) != STRUCTS_DECKEDREPLYTOTALSIZE)
+    {
+        muiLost += 1;
+        return;
+    }
+    soakRecordLatency(false, ulSentUs);
+    if(abReply[2] == I2CERRORCODE_SERVERUNREACH)
+    {
+        muiUnreachable += 1;
+    }
+    else if(abReply[2] != I2CERRORCODE_OK || memcmp(&abReply[4], &uiCounter, sizeof(uiCounter)) != 0)
+    {
+        muiWrong += 1;
+    }
+}
+
+void soakTaggedSend()
+{
+    tCtrlTaggedSendCmd sTagged;
+    uint8_t abReply[BSC_FIFO_SIZE];
+    uint32_t uiCounter = muiCounter++;
+
+    benchBscControllerRead(abReply, sizeof(abReply));
+    memset(&sTagged, 0, sizeof(sTagged));
+    sTagged.startTag = IOT_FRMSTARTTAG;
+    sTagged.cmdCode = ASYNCCMD_CMDCODE_SEND;
+    sTagged.tag = mbNextTag;
+    sTagged.sendCmdCode = 0x02;
+    sTagged.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sTagged.downlinkIndicator = 0x01;
+    memcpy(sTagged.payload, &uiCounter, sizeof(uiCounter));
+    sTagged.endTag = IOT_FRMENDTAG;
+    mbNextTag = (mbNextTag == 0xff) ? 1 : mbNextTag + 1; // 0 is the summary
+    muiTagged += 1;
+    if(soakTransact(sTagged.ui8, sizeof(sTagged.ui8)) < 0 || benchBscControllerRead(abReply, sizeof(tCtrlEmptyReply)) != sizeof(tCtrlEmptyReply))
+    {
+        muiLost += 1;
+        return;
+    }
+    if(abReply[2] == I2CERRORCODE_PENDING || abReply[2] == I2CERRORCODE_OK)
+    {
+        masOutstanding[muiOutstanding].tag = sTagged.tag;
+        masOutstanding[muiOutstanding].counter = uiCounter;
+        masOutstanding[muiOutstanding].sentUs = printGetMonotonicTimeUs();
+        muiOutstanding += 1;
+    }
+    else
+    {
+        muiTaggedRefused += 1;
+    }
+}
+
+/********************* soakTaggedQuery **********************
+    Status of the oldest outstanding tag. Delivered by a bulk
+    block it has no downlink (all 0), else the downlink must
+    be its counter.
+************************************************************/
+void soakTaggedQuery()
+{
+    static const uint8_t abZero[sizeof(uint32_t)] = {0};
+    tSoakOutstanding *pOldest = &masOutstanding[0];
+    tCtrlStatusCmd sStatus;
+    uint8_t abReply[BSC_FIFO_SIZE];
+
+    benchBscControllerRead(abReply, sizeof(abReply));
+    sStatus.startTag = IOT_FRMSTARTTAG;
+    sStatus.cmdCode = ASYNCCMD_CMDCODE_STATUS;
+    sStatus.tag = pOldest->tag;
+    sStatus.endTag = IOT_FRMENDTAG;
+    if(soakTransact(sStatus.ui8, sizeof(sStatus.ui8)) < 0 || benchBscControllerRead(abReply, STRUCTS_DECKEDREPLYTOTALSIZE) != STRUCTS_DECKEDREPLYTOTALSIZE)
+    {
+        return; // asked again next time
+    }
+    switch(abReply[2])
+    {
+        case I2CERRORCODE_PENDING:
+            return;
+        case I2CERRORCODE_OK:
+            soakRecordLatency(true, pOldest->sentUs);
+            if(memcmp(&abReply[4], &pOldest->counter, sizeof(uint32_t)) != 0 && memcmp(&abReply[4], abZero, sizeof(abZero)) != 0)
+            {
+                muiWrong += 1;
+            }
+            break;
+        case I2CERRORCODE_SERVERUNREACH:
+            muiTaggedDropped += 1;
+            break;
+        default:
+            muiLost += 1; // forgotten by the slave
+            break;
+    }
+    muiOutstanding -= 1;
+    memmove(&masOutstanding[0], &masOutstanding[1], muiOutstanding * sizeof(tSoakOutstanding));
+}
+
+void soakRecordLatency(bool bTagged, uint64_t ulSentUs)
+{
+    uint32_t uiMs = (uint32_t)((printGetMonotonicTimeUs() - ulSentUs) / 1000);
+
+    pthread_mutex_lock(&msLatencyLock);
+    if(bTagged && muiTaggedCount < SOAK_WINDOWMAX)
+    {
+        mauiTaggedMs[muiTaggedCount++] = uiMs;
+    }
+    else if(!bTagged && muiLockstepCount < SOAK_WINDOWMAX)
+    {
+        mauiLockstepMs[muiLockstepCount++] = uiMs;
+    }
+    pthread_mutex_unlock(&msLatencyLock);
+}
+
+/*********************** soakBscFault ***********************
+    Wedges the simulated BSC, alternately with a failing
+    transfer (an abort clears it) and a stuck receiver (a
+    reopen clears it), and waits for the daemon to recover.
+************************************************************/
+void soakBscFault()
+{
+    uint64_t ulDeadlineUs = printGetMonotonicTimeUs() + SOAK_BSCRECOVERMS * 1000ULL;
+
+    muiBscFaults += 1;
+    if(muiBscFaults % 2 == 1)
+    {
+        benchBscInjectFault(BENCHBSC_FAULT_XFERERROR, BSCRECOVERY_ABORT);
+    }
+    else
+    {
+        benchBscInjectFault(BENCHBSC_FAULT_RXSTUCK, BSCRECOVERY_REOPEN);
+    }
+    while(benchBscFault() != BENCHBSC_FAULT_NONE && !mbStop)
+    {
+        if(printGetMonotonicTimeUs() > ulDeadlineUs)
+        {
+            muiBscUnrecovered += 1;
+            benchBscInjectFault(BENCHBSC_FAULT_NONE, BSCRECOVERY_NONE);
+            break;
+        }
+        usleep(1000);
+    }
+}
+
+void soakTakeSample(tSoakSample *pSample)
+{
+    static uint32_t auiLockstepMs[SOAK_WINDOWMAX];
+    static uint32_t auiTaggedMs[SOAK_WINDOWMAX];
+    uint32_t uiLockstepCount;
+    uint32_t uiTaggedCount;
+    tMemPoolStats sPool;
+    tStatusData sStatus;
+    struct dirent *pEntry;
+    DIR *pDir;
+    FILE *pFile;
+    long lSize = 0;
+    long lPages = 0;
+
+    pSample->wallSec = (printGetMonotonicTimeUs() - mulStartUs) / 1e6;
+    pSample->simSec = pSample->wallSec * mdCompression;
+    pFile = fopen("/proc/self/statm", "r");
+    if(pFile != NULL)
+    {
+        if(fscanf(pFile, "%ld %ld", &lSize, &lPages) != 2) // pages: total, resident
+        {
+            lPages = 0;
+        }
+        fclose(pFile);
+    }
+    pSample->rssKb = lPages * (sysconf(_SC_PAGESIZE) / 1024);
+    pSample->fds = 0;
+    pDir = opendir("/proc/self/fd");
+    if(pDir != NULL)
+    {
+        while((pEntry = readdir(pDir)) != NULL)
+        {
+            pSample->fds += (pEntry->d_name[0] != '.') ? 1 : 0;
+        }
+        closedir(pDir);
+        pSample->fds -= 1; // the directory itself
+    }
+    pSample->ssl = __atomic_load_n(&miSslObjects, __ATOMIC_RELAXED);
+    pSample->sslCtx = __atomic_load_n(&miSslContexts, __ATOMIC_RELAXED);
+    memPoolGetStats(&sPool);
+    pSample->poolKb = sPool.inUse / 1024.0;
+    pSample->queued = statusShmRead(mpStatus, &sStatus, NULL) ? sStatus.uplinksPending : 0;
+
+    pthread_mutex_lock(&msLatencyLock);
+    uiLockstepCount = muiLockstepCount;
+    memcpy(auiLockstepMs, mauiLockstepMs, uiLockstepCount * sizeof(uint32_t));
+    uiTaggedCount = muiTaggedCount;
+    memcpy(auiTaggedMs, mauiTaggedMs, uiTaggedCount * sizeof(uint32_t));
+    muiLockstepCount = 0;
+    muiTaggedCount = 0;
+    pthread_mutex_unlock(&msLatencyLock);
+    pSample->p50Ms = soakPercentile(auiLockstepMs, uiLockstepCount, 50);
+    pSample->p95Ms = soakPercentile(auiLockstepMs, uiLockstepCount, 95);
+    pSample->p99Ms = soakPercentile(auiLockstepMs, uiLockstepCount, 99);
+    pSample->taggedP95Ms = soakPercentile(auiTaggedMs, uiTaggedCount, 95);
+}
+
+/********************** soakPercentile **********************
+    Nearest rank, -1 without values. Sorts pValues.
+************************************************************/
+double soakPercentile(uint32_t *pValues, uint32_t uiCount, uint32_t uiPercentile)
+{
+    uint32_t uiRank;
+
+    if(uiCount == 0)
+    {
+        return -1;
+    }
+    qsort(pValues, uiCount, sizeof(uint32_t), soakCompareMs);
+    uiRank = (uiCount * uiPercentile + 99) / 100;
+    return pValues[(uiRank > 0) ? uiRank - 1 : 0];
+}
+
+int soakCompareMs(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
+
+int soakCompare(const void *pA, const void *pB)
+{
+    double dA = *(const double *)pA;
+    double dB = *(const double *)pB;
+    return (dA > dB) - (dA < dB);
+}
+
+/*********************** soakMedian *************************
+    Of one series over uiCount samples, the windows without
+    latencies (-1) left out.
+************************************************************/
+double soakMedian(uint32_t uiFirst, uint32_t uiCount, size_t uiOffset)
+{
+    static double adValues[SOAK_MAXSAMPLES];
+    uint32_t uiValues = 0;
+    uint32_t i;
+
+    for(i=uiFirst; i<uiFirst + uiCount; i+=1)
+    {
+        double dValue = *(const double *)((const uint8_t *)&masSamples[i] + uiOffset);
+        if(dValue >= 0)
+        {
+            adValues[uiValues++] = dValue;
+        }
+    }
+    if(uiValues == 0)
+    {
+        return -1;
+    }
+    qsort(adValues, uiValues, sizeof(double), soakCompare);
+    return (uiValues % 2 == 1) ? adValues[uiValues / 2] : (adValues[uiValues / 2 - 1] + adValues[uiValues / 2]) / 2;
+}
+
+/********************* soakCheckDrift ***********************
+    Per series the medians of the four quarters after the
+    warm up and the least squares slope per simulated hour.
+    Drift: every quarter above the one before, and the last
+    above the first by more than the tolerance.
+************************************************************/
+bool soakCheckDrift(uint32_t uiSamples)
+{
+    uint32_t uiWarmup = uiSamples / SOAK_WARMUPDIV;
+    uint32_t uiQuarter = (uiSamples - uiWarmup) / 4;
+    bool bPass = true;
+    int iSeries;
+    int q;
+
+    if(uiSamples < SOAK_MINSAMPLES)
+    {
+        fprintf(stderr, "%u samples, at least %u are needed for the drift check.\n", uiSamples, SOAK_MINSAMPLES);
+        return false;
+    }
+    fprintf(stderr, "%-18s %9s %9s %9s %9s %12s %10s  %s\n", "series", "q1", "q2", "q3", "q4", "slope/sim h", "tolerance", "drift");
+    for(iSeries=0; iSeries<(int)(sizeof(masSeries) / sizeof(masSeries[0])); iSeries+=1)
+    {
+        const tSoakSeries *pSeries = &masSeries[iSeries];
+        double adMedian[4];
+        double dSumX = 0, dSumY = 0, dSumXX = 0, dSumXY = 0;
+        double dSlope = 0;
+        double dTolerance;
+        uint32_t uiPoints = 0;
+        bool bRising = true;
+        bool bDrift;
+        uint32_t i;
+
+        for(q=0; q<4; q+=1)
+        {
+            adMedian[q] = soakMedian(uiWarmup + q * uiQuarter, uiQuarter, pSeries->offset);
+            bRising &= (q == 0 || (adMedian[q] > adMedian[q - 1] && adMedian[q - 1] >= 0));
+        }
+        for(i=uiWarmup; i<uiWarmup + 4 * uiQuarter; i+=1)
+        {
+            double dX = masSamples[i].simSec / 3600.0;
+            double dY = *(const double *)((const uint8_t *)&masSamples[i] + pSeries->offset);
+            if(dY >= 0)
+            {
+                dSumX += dX;
+                dSumY += dY;
+                dSumXX += dX * dX;
+                dSumXY += dX * dY;
+                uiPoints += 1;
+            }
+        }
+        if(uiPoints > 1 && uiPoints * dSumXX - dSumX * dSumX > 0)
+        {
+            dSlope = (uiPoints * dSumXY - dSumX * dSumY) / (uiPoints * dSumXX - dSumX * dSumX);
+        }
+        dTolerance = pSeries->tolerance;
+        if(adMedian[0] > 0 && pSeries->toleranceRatio * adMedian[0] > dTolerance)
+        {
+            dTolerance = pSeries->toleranceRatio * adMedian[0];
+        }
+        bDrift = bRising && adMedian[3] - adMedian[0] > dTolerance;
+        fprintf(stderr, "%-18s %9.1f %9.1f %9.1f %9.1f %12.2f %10.1f  %s\n", pSeries->name, adMedian[0], adMedian[1], adMedian[2], adMedian[3],
+            dSlope, dTolerance, bDrift ? "DRIFT" : (bRising ? "rising, within tolerance" : "no"));
+        bPass &= !bDrift;
+    }
+    return bPass;
+}
+
+/*********************** soakServer *************************
+    The stand-in backend, in its own process: its OpenSSL
+    objects, memory and fds don't count for the daemon.
+    Closes a node's listener while it is down (connection
+    refused) and opens it on the same port afterwards.
+************************************************************/
+void soakServer(int *pListenFds, uint16_t *pPorts)
+{
+    struct pollfd asPoll[SOAK_NODES];
+    pthread_t sThread;
+    int *pConnection;
+    int iFd;
+    int i;
+
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    signal(SIGPIPE, SIG_IGN);
+    if(soakServerContext() < 0)
+    {
+        fprintf(stderr, "Could not set up the server's TLS context.\n");
+        return;
+    }
+    while(1)
+    {
+        double dSimSec = soakSimSeconds();
+        for(i=0; i<SOAK_NODES; i+=1)
+        {
+            bool bDown = soakNodeDown(i, dSimSec);
+            if(bDown && pListenFds[i] >= 0)
+            {
+                close(pListenFds[i]);
+                pListenFds[i] = -1;
+                __atomic_add_fetch(&mpServerStats->outages, 1, __ATOMIC_RELAXED);
+            }
+            else if(!bDown && pListenFds[i] < 0)
+            {
+                pListenFds[i] = soakListen(&pPorts[i]);
+            }
+            asPoll[i].fd = pListenFds[i]; // -1 is ignored by poll()
+            asPoll[i].events = POLLIN;
+            asPoll[i].revents = 0;
+        }
+        if(poll(asPoll, SOAK_NODES, 20) <= 0)
+        {
+            continue;
+        }
+        for(i=0; i<SOAK_NODES; i+=1)
+        {
+            if(!(asPoll[i].revents & POLLIN))
+            {
+                continue;
+            }
+            iFd = accept(pListenFds[i], NULL, NULL);
+            if(iFd < 0)
+            {
+                continue;
+            }
+            __atomic_add_fetch(&mpServerStats->connections, 1, __ATOMIC_RELAXED);
+            pConnection = malloc(2 * sizeof(int));
+            pConnection[0] = iFd;
+            pConnection[1] = i;
+            if(pthread_create(&sThread, NULL, soakServerConnection, pConnection) != 0)
+            {
+                close(iFd);
+                free(pConnection);
+                continue;
+            }
+            pthread_detach(sThread);
+        }
+    }
+}
+
+/******************** soakServerContext *********************
+    A fresh P-256 key and a self signed certificate, the
+    daemon doesn't verify the server.
+************************************************************/
+int soakServerContext()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/****************** soakServerConnection ********************
+    TLS, then requests in order until the daemon closes the
+    connection, each one after SOAK_LATENCYMS or with one of
+    the injected faults. A node that went down drops its
+    open connections with the next request.
+************************************************************/
+void *soakServerConnection(void *pArg)
+{
+    int iFd = ((int *)pArg)[0];
+    int iNode = ((int *)pArg)[1];
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    unsigned int uiSeed = (unsigned int)(iFd * 7919 + printGetMonotonicTimeUs());
+    char sBuffer[SOAK_BUFSIZE];
+    char sResponse[256];
+    SSL *pSsl;
+    int iBuffered = 0;
+    int iHeaderLength;
+    int iLength;
+    int iResponse;
+    int iRoll;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while((iLength = soakServerRead(pSsl, sBuffer, &iBuffered, &iHeaderLength)) > 0)
+    {
+        __atomic_add_fetch(&mpServerStats->requests, 1, __ATOMIC_RELAXED);
+        if(soakNodeDown(iNode, soakSimSeconds()))
+        {
+            break;
+        }
+        iRoll = rand_r(&uiSeed) % 1000;
+        if(iRoll < SOAK_503PERMILLE)
+        {
+            __atomic_add_fetch(&mpServerStats->errors503, 1, __ATOMIC_RELAXED);
+            iLength = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            SSL_write(pSsl, sResponse, iLength);
+            break;
+        }
+        if(iRoll < SOAK_503PERMILLE + SOAK_DROPPERMILLE)
+        {
+            __atomic_add_fetch(&mpServerStats->dropped, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if(iRoll < SOAK_503PERMILLE + SOAK_DROPPERMILLE + SOAK_SLOWPERMILLE)
+        {
+            __atomic_add_fetch(&mpServerStats->slow, 1, __ATOMIC_RELAXED);
+            usleep((SOAK_SOCKETSEC + 1) * 1000000);
+        }
+        usleep(SOAK_LATENCYMS * 1000);
+        iResponse = soakServerAnswer(sBuffer, iLength, iHeaderLength, sResponse, sizeof(sResponse));
+        if(SSL_write(pSsl, sResponse, iResponse) != iResponse)
+        {
+            break;
+        }
+        iBuffered -= iLength;
+        memmove(sBuffer, &sBuffer[iLength], iBuffered); // pipelined requests behind it
+    }
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/********************* soakServerRead ***********************
+    Until sBuffer starts with a whole request (header and
+    Content-Length body), returns its length, -1 when the
+    connection is closed.
+************************************************************/
+int soakServerRead(SSL *pSsl, char *sBuffer, int *pBuffered, int *pHeaderLength)
+{
+    char *pEnd;
+    char *pContentLength;
+    int iTotal;
+    int iResult;
+
+    while(1)
+    {
+        sBuffer[*pBuffered] = 0x00;
+        pEnd = strstr(sBuffer, "\r\n\r\n");
+        if(pEnd != NULL)
+        {
+            *pHeaderLength = (pEnd - sBuffer) + 4;
+            pContentLength = strstr(sBuffer, "Content-Length: ");
+            iTotal = *pHeaderLength + ((pContentLength != NULL && pContentLength < pEnd) ? atoi(pContentLength + 16) : 0);
+            if(*pBuffered >= iTotal)
+            {
+                return iTotal;
+            }
+        }
+        if(*pBuffered >= SOAK_BUFSIZE - 1)
+        {
+            return -1;
+        }
+        iResult = SSL_read(pSsl, &sBuffer[*pBuffered], SOAK_BUFSIZE - 1 - *pBuffered);
+        if(iResult <= 0)
+        {
+            return -1;
+        }
+        *pBuffered += iResult;
+    }
+}
+
+/******************** soakServerAnswer **********************
+    A bulk POST is stored completely, an uplink gets its
+    first 4 payload bytes back as the downlink. Returns the
+    length of the response.
+************************************************************/
+int soakServerAnswer(char *sRequest, int iLength, int iHeaderLength, char *sResponse, int iMaxLength)
+{
+    static __thread uint8_t abBlock[BULK_BLOCKMAXSIZE];
+    uLongf ulBlockLength = sizeof(abBlock);
+    uint32_t uiRecords = 0;
+    char sData[9] = "00000000";
+    char cSaved = sRequest[iHeaderLength];
+    char *pData;
+    int iPos;
+
+    if(strncmp(sRequest, "POST ", 5) == 0)
+    {
+        __atomic_add_fetch(&mpServerStats->bulkPosts, 1, __ATOMIC_RELAXED);
+        if(uncompress(abBlock, &ulBlockLength, (uint8_t *)&sRequest[iHeaderLength], iLength - iHeaderLength) != Z_OK)
+        {
+            ulBlockLength = 0;
+        }
+        for(iPos=0; iPos + BULK_RECORDHEADERSIZE <= (int)ulBlockLength; iPos += BULK_RECORDHEADERSIZE + abBlock[iPos + 10])
+        {
+            uiRecords += 1;
+        }
+        return snprintf(sResponse, iMaxLength, "HTTP/1.1 200 OK\r\nServer: SACSoakTest\r\nContent-Length: %i\r\n\r\nstored=%u\r\n", (int)snprintf(NULL, 0, "stored=%u\r\n", uiRecords), uiRecords);
+    }
+    sRequest[iHeaderLength] = 0x00; // the next pipelined request is not this one's data
+    pData = strstr(sRequest, "&data=");
+    if(pData != NULL)
+    {
+        memcpy(sData, pData + 6, 8);
+    }
+    sRequest[iHeaderLength] = cSaved;
+    return snprintf(sResponse, iMaxLength, "HTTP/1.1 200 OK\r\nServer: SACSoakTest\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+}
@@ -0,0 +1,736 @@
+/*
+    io_uring comms backend, run with "make uringbench".
+
+    A local TLS server process stands in for the webhook on
+    loopback (self-signed P-256 certificate, the daemon does
+    not verify it). N uplinks go out at several request
+    rates, a connection each, over
+        - the blocking path (commsSendUplink(), a sleep until
+          the next uplink is due);
+        - reactor exchanges on epoll ([comms] io_uring = no);
+        - reactor exchanges on io_uring ([comms] io_uring =
+          yes), connect, send and receive batched;
+    every run in a process of its own. Per run: system calls
+    per uplink, counted with ptrace in a second pass of the
+    same run (the tracer stops the child at every call, its
+    CPU numbers would be meaningless), and CPU time per
+    uplink of the untraced pass (CLOCK_PROCESS_CPUTIME_ID,
+    the io_uring workers of the process included). Not
+    counted: the log output and the warm up uplink (ring and
+    TLS session set up).
+    PASS when every uplink got its downlink and io_uring
+    needed fewer system calls per uplink than epoll at every
+    rate.
+
+    Usage:
+        SACUringBench [-n uplinks] [-r rate,rate,...] [-d dir]
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACReactor.h"
+#include "SACConfig.h"
+#include "SACUring.h"
+
+#define URINGBENCH_UPLINKS      100
+#define URINGBENCH_MAXRATES     8
+#define URINGBENCH_SYSCALLS     512 // syscall numbers counted
+#define URINGBENCH_TOP          4 // most frequent calls printed per run
+#define URINGBENCH_BUFSIZE      (HTTPMSGMAXSIZE * 2)
+
+typedef enum
+{
+    URINGBENCH_BLOCKING,
+    URINGBENCH_EPOLL,
+    URINGBENCH_URING,
+    URINGBENCH_MODES,
+} tUringBenchMode;
+
+typedef struct
+{
+    uint32_t uplinksOk;
+    uint64_t cpuUs; // whole run, process
+    uint64_t wallUs;
+    uint64_t enters; // io_uring_enter() calls
+} tUringBenchResult;
+
+typedef struct
+{
+    tUringBenchResult result; // untraced pass
+    uint32_t tracedOk;
+    uint64_t syscalls;
+    uint32_t aulCalls[URINGBENCH_SYSCALLS];
+} tUringBenchRun;
+
+/****************** private function prototypes *********************/
+int uringBenchListen();
+int uringBenchServerContext();
+void uringBenchServe();
+void *uringBenchConnection(void *pArg);
+int uringBenchReadRequest(SSL *pSsl, char *sBuffer, int *pBuffered, int *pHeaderLength);
+int uringBenchWriteConfig(tUringBenchMode eMode);
+int uringBenchRun(tUringBenchMode eMode, uint32_t uiRate, uint32_t uiUplinks, bool bTraced, tUringBenchRun *pRun);
+void uringBenchChild(tUringBenchMode eMode, uint32_t uiRate, uint32_t uiUplinks, int iResultFd);
+int uringBenchTrace(pid_t iPid, tUringBenchRun *pRun);
+void uringBenchRecord(uint32_t i, tUplinkRecord *pRecord);
+void uringBenchDue(int iFd, uint32_t uiEvents, void *pContext);
+void uringBenchDone(tUplinkRecord *pRecord, int iResult);
+void uringBenchStartDue();
+const char *uringBenchSyscallName(int iNr);
+uint64_t uringBenchCpuUs();
+void uringBenchQuiet(bool bQuiet);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static const char *masModeNames[URINGBENCH_MODES] = {"blocking", "epoll", "io_uring"};
+static char msConfigPath[256];
+static int miListenFd = -1;
+static uint16_t muiPort = 0;
+static SSL_CTX *mpServerContext = NULL;
+static uint32_t muiDue = 0; // child: uplinks the rate asked for so far
+static uint32_t muiStarted = 0;
+static uint32_t muiFinished = 0;
+static uint32_t muiOk = 0;
+static uint32_t muiUplinks = 0;
+static uint32_t muiRate = 1;
+static uint64_t mulStartUs = 0;
+static int miTimerFd = -1;
+static int miStdoutFd = -1;
+static int miNullFd = -1;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    const char *sDir = "/tmp";
+    static tUringBenchRun asRuns[URINGBENCH_MAXRATES][URINGBENCH_MODES];
+    uint32_t auiRates[URINGBENCH_MAXRATES] = {20, 100, 500};
+    int iRates = 3;
+    uint32_t uiUplinks = URINGBENCH_UPLINKS;
+    bool bPass = true;
+    pid_t iServer;
+    char *pRate;
+    int iOption;
+    int iTop[URINGBENCH_TOP];
+    uint32_t auiTopCalls[URINGBENCH_TOP];
+    int iMode;
+    int i;
+    int j;
+    int k;
+
+    while((iOption = getopt(argc, argv, "n:r:d:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 'n': uiUplinks = atoi(optarg); break;
+            case 'r':
+                iRates = 0;
+                for(pRate = strtok(optarg, ","); pRate != NULL && iRates < URINGBENCH_MAXRATES; pRate = strtok(NULL, ","))
+                {
+                    auiRates[iRates++] = atoi(pRate);
+                }
+                break;
+            case 'd': sDir = optarg; break;
+            default:
+                fprintf(stderr, "usage: %s [-n uplinks] [-r rate,rate,...] [-d dir]\n", argv[0]);
+                return 2;
+        }
+    }
+    for(i=0; i<iRates; i+=1)
+    {
+        if(auiRates[i] == 0 || auiRates[i] > 1000000)
+        {
+            fprintf(stderr, "Rates are uplinks per second, 1 .. 1000000.\n");
+            return 2;
+        }
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "%s/SACUringBench.%i.conf", sDir, (int)getpid());
+    if(uringBenchServerContext() < 0 || uringBenchListen() < 0)
+    {
+        fprintf(stderr, "Could not open the local TLS server.\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    iServer = fork();
+    if(iServer == 0)
+    {
+        uringBenchServe();
+        _exit(0);
+    }
+    close(miListenFd);
+
+    fprintf(stderr, "%u uplinks per run, TLS on loopback, a connection per uplink\n", uiUplinks);
+    fprintf(stderr, "%-9s %6s %5s %10s %9s %8s  %s\n", "backend", "rate/s", "ok", "calls/upl", "us/upl", "enter/upl", "most frequent calls per uplink");
+    for(i=0; i<iRates; i+=1)
+    {
+        for(iMode=0; iMode<URINGBENCH_MODES; iMode+=1)
+        {
+            tUringBenchRun *pRun = &asRuns[i][iMode];
+            if(uringBenchRun(iMode, auiRates[i], uiUplinks, false, pRun) < 0 || uringBenchRun(iMode, auiRates[i], uiUplinks, true, pRun) < 0)
+            {
+                fprintf(stderr, "Could not run %s at %u/s.\n", masModeNames[iMode], auiRates[i]);
+                kill(iServer, SIGKILL);
+                unlink(msConfigPath);
+                return 1;
+            }
+            for(k=0; k<URINGBENCH_TOP; k+=1)
+            {
+                iTop[k] = -1;
+                for(j=0; j<URINGBENCH_SYSCALLS; j+=1)
+                {
+                    if(pRun->aulCalls[j] > 0 && (iTop[k] < 0 || pRun->aulCalls[j] > pRun->aulCalls[iTop[k]]))
+                    {
+                        iTop[k] = j;
+                    }
+                }
+                if(iTop[k] >= 0)
+                {
+                    auiTopCalls[k] = pRun->aulCalls[iTop[k]];
+                    pRun->aulCalls[iTop[k]] = 0; // not again for the next place
+                }
+            }
+            fprintf(stderr, "%-9s %6u %5u %10.1f %9.1f %8.2f ", masModeNames[iMode], auiRates[i], pRun->result.uplinksOk,
+                (double)pRun->syscalls / uiUplinks, (double)pRun->result.cpuUs / uiUplinks, (double)pRun->result.enters / uiUplinks);
+            for(k=0; k<URINGBENCH_TOP && iTop[k] >= 0; k+=1)
+            {
+                fprintf(stderr, " %s %.1f", uringBenchSyscallName(iTop[k]), (double)auiTopCalls[k] / uiUplinks);
+            }
+            fprintf(stderr, "\n");
+            bPass = bPass && pRun->result.uplinksOk == uiUplinks && pRun->tracedOk == uiUplinks;
+        }
+        if(asRuns[i][URINGBENCH_URING].result.enters == 0)
+        {
+            fprintf(stderr, "io_uring not available here, the io_uring runs fell back to epoll\n");
+            bPass = false;
+        }
+        else
+        {
+            bPass = bPass && asRuns[i][URINGBENCH_URING].syscalls < asRuns[i][URINGBENCH_EPOLL].syscalls;
+        }
+    }
+    for(i=0; i<iRates; i+=1)
+    {
+        fprintf(stderr, "%u/s: io_uring %.2fx the calls of epoll, %.2fx of blocking; %.2fx the CPU of epoll, %.2fx of blocking\n", auiRates[i],
+            (double)asRuns[i][URINGBENCH_URING].syscalls / (asRuns[i][URINGBENCH_EPOLL].syscalls + 1),
+            (double)asRuns[i][URINGBENCH_URING].syscalls / (asRuns[i][URINGBENCH_BLOCKING].syscalls + 1),
+            (double)asRuns[i][URINGBENCH_URING].result.cpuUs / (asRuns[i][URINGBENCH_EPOLL].result.cpuUs + 1),
+            (double)asRuns[i][URINGBENCH_URING].result.cpuUs / (asRuns[i][URINGBENCH_BLOCKING].result.cpuUs + 1));
+    }
+    kill(iServer, SIGKILL);
+    waitpid(iServer, NULL, 0);
+    unlink(msConfigPath);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+int uringBenchListen()
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    miListenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(miListenFd < 0 || bind(miListenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(miListenFd, 64) < 0)
+    {
+        return -1;
+    }
+    getsockname(miListenFd, (struct sockaddr *)&sAddr, &uiLength);
+    muiPort = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/**************** uringBenchServerContext *******************
+    Self-signed P-256 certificate made up on the spot.
+************************************************************/
+int uringBenchServerContext()
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        mpServerContext = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && mpServerContext != NULL &&
+            SSL_CTX_use_certificate(mpServerContext, pCert) == 1 && SSL_CTX_use_PrivateKey(mpServerContext, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/******************** uringBenchServe ***********************
+    Server process, a thread per connection, killed by main.
+************************************************************/
+void uringBenchServe()
+{
+    pthread_t sThread;
+    int *pFd;
+
+    while(1)
+    {
+        pFd = malloc(sizeof(int));
+        *pFd = accept(miListenFd, NULL, NULL);
+        if(*pFd < 0)
+        {
+            free(pFd);
+            continue;
+        }
+        pthread_create(&sThread, NULL, uringBenchConnection, pFd);
+        pthread_detach(sThread);
+    }
+}
+
+/***************** uringBenchConnection *********************
+    Answers right away, an uplink gets its first 4 payload
+    bytes back as the downlink.
+************************************************************/
+void *uringBenchConnection(void *pArg)
+{
+    int iFd = *(int *)pArg;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[URINGBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9] = "00000000";
+    SSL *pSsl;
+    char *pValue;
+    int iBuffered = 0;
+    int iHeaderLength;
+    int iLength;
+    int iResponse;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(mpServerContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    while((iLength = uringBenchReadRequest(pSsl, sBuffer, &iBuffered, &iHeaderLength)) > 0)
+    {
+        pValue = strstr(sBuffer, "&data=");
+        if(pValue != NULL && pValue < &sBuffer[iHeaderLength])
+        {
+            memcpy(sData, pValue + 6, 8);
+        }
+        iResponse = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACUringBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+        if(SSL_write(pSsl, sResponse, iResponse) != iResponse)
+        {
+            break;
+        }
+        memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength);
+        iBuffered -= iLength;
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/***************** uringBenchReadRequest ********************
+    Returns the length of the first complete request in
+    sBuffer, header and body, or -1.
+************************************************************/
+int uringBenchReadRequest(SSL *pSsl, char *sBuffer, int *pBuffered, int *pHeaderLength)
+{
+    char *pEnd;
+    char *pContentLength;
+    int iTotal;
+    int iResult;
+
+    while(1)
+    {
+        sBuffer[*pBuffered] = 0x00;
+        pEnd = strstr(sBuffer, "\r\n\r\n");
+        if(pEnd != NULL)
+        {
+            *pHeaderLength = (pEnd - sBuffer) + 4;
+            pContentLength = strstr(sBuffer, "Content-Length: ");
+            iTotal = *pHeaderLength + ((pContentLength != NULL && pContentLength < pEnd) ? atoi(pContentLength + 16) : 0);
+            if(*pBuffered >= iTotal)
+            {
+                return iTotal;
+            }
+        }
+        if(*pBuffered >= URINGBENCH_BUFSIZE - 1)
+        {
+            return -1;
+        }
+        iResult = SSL_read(pSsl, &sBuffer[*pBuffered], URINGBENCH_BUFSIZE - 1 - *pBuffered);
+        if(iResult <= 0)
+        {
+            return -1;
+        }
+        *pBuffered += iResult;
+    }
+}
+
+int uringBenchWriteConfig(tUringBenchMode eMode)
+{
+    FILE *pFile = fopen(msConfigPath, "w");
+    if(pFile == NULL)
+    {
+        return -1;
+    }
+    fprintf(pFile, "[comms]\ntransport = http\nhost = 127.0.0.1\nhttp_port = %u\nuse_ssl = yes\nio_uring = %s\npipeline_depth = 0\nhedge_percentile = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 5\n",
+        muiPort, (eMode == URINGBENCH_URING) ? "yes" : "no");
+    fclose(pFile);
+    return 0;
+}
+
+/********************* uringBenchRun ************************
+    One backend at one rate in a child process, traced or
+    not. The child reports its tUringBenchResult through a
+    pipe.
+************************************************************/
+int uringBenchRun(tUringBenchMode eMode, uint32_t uiRate, uint32_t uiUplinks, bool bTraced, tUringBenchRun *pRun)
+{
+    tUringBenchResult sResult;
+    int aiPipe[2];
+    int iStatus;
+    pid_t iPid;
+
+    if(uringBenchWriteConfig(eMode) < 0 || pipe(aiPipe) < 0)
+    {
+        return -1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    iPid = fork();
+    if(iPid == 0)
+    {
+        close(aiPipe[0]);
+        if(bTraced)
+        {
+            ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+            raise(SIGSTOP);
+        }
+        uringBenchChild(eMode, uiRate, uiUplinks, aiPipe[1]);
+        _exit(0);
+    }
+    close(aiPipe[1]);
+    if(bTraced && uringBenchTrace(iPid, pRun) < 0)
+    {
+        kill(iPid, SIGKILL);
+    }
+    memset(&sResult, 0, sizeof(sResult));
+    if(read(aiPipe[0], &sResult, sizeof(sResult)) != sizeof(sResult))
+    {
+        memset(&sResult, 0, sizeof(sResult));
+    }
+    close(aiPipe[0]);
+    waitpid(iPid, &iStatus, 0);
+    if(bTraced)
+    {
+        pRun->tracedOk = sResult.uplinksOk;
+    }
+    else
+    {
+        pRun->result = sResult;
+    }
+    return 0;
+}
+
+/******************** uringBenchChild ***********************
+    Sets up comms, sends one uplink to warm up (TLS session,
+    the ring), then getppid() marks the start of the measured
+    part for the tracer, and again its end.
+************************************************************/
+void uringBenchChild(tUringBenchMode eMode, uint32_t uiRate, uint32_t uiUplinks, int iResultFd)
+{
+    tUringBenchResult sResult;
+    tUplinkRecord sRecord;
+    struct timespec sDue;
+    uint64_t ulCpuUs;
+    uint64_t ulStartUs;
+    uint32_t i;
+
+    uringBenchQuiet(true);
+    structsInit();
+    uplinkSchedInit();
+    reactorInit(NULL, 0, NULL);
+    sslInit();
+    memset(&sResult, 0, sizeof(sResult));
+    if(configInit(msConfigPath) < 0 || commsInit() < 0)
+    {
+        write(iResultFd, &sResult, sizeof(sResult));
+        return;
+    }
+    muiUplinks = uiUplinks;
+    uringBenchRecord(0xffffffff, &sRecord);
+    if(eMode == URINGBENCH_BLOCKING)
+    {
+        commsSendUplink(&sRecord);
+    }
+    else
+    {
+        muiUplinks = 1;
+        commsStartUplink(&sRecord, uringBenchDone);
+        while(muiFinished < 1)
+        {
+            reactorRunOnce(1000);
+        }
+        muiUplinks = uiUplinks;
+        muiFinished = 0;
+        muiOk = 0;
+        miTimerFd = reactorTimerCreate(uringBenchDue, NULL);
+    }
+
+    sResult.enters = uringReady() ? uringStats()->enters : 0;
+    syscall(SYS_getppid); // start
+    ulCpuUs = uringBenchCpuUs();
+    ulStartUs = printGetMonotonicTimeUs();
+    if(eMode == URINGBENCH_BLOCKING)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &sDue);
+        for(i=0; i<uiUplinks; i+=1)
+        {
+            uringBenchRecord(i, &sRecord);
+            if(commsSendUplink(&sRecord) >= 0 && memcmp(getCtrlDeckedReply()->payload, &i, sizeof(i)) == 0)
+            {
+                muiOk += 1;
+            }
+            sDue.tv_nsec += 1000000000 / uiRate;
+            sDue.tv_sec += sDue.tv_nsec / 1000000000;
+            sDue.tv_nsec %= 1000000000;
+            while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &sDue, NULL) == EINTR);
+        }
+    }
+    else
+    {
+        muiRate = uiRate;
+        mulStartUs = ulStartUs;
+        reactorTimerArmUs(miTimerFd, 1000000 / uiRate, 1000000 / uiRate);
+        while(muiFinished < uiUplinks && printGetMonotonicTimeUs() - ulStartUs < (uint64_t)uiUplinks * 1000000 / uiRate + 30000000)
+        {
+            reactorRunOnce(1000);
+        }
+        reactorTimerDisarm(miTimerFd);
+    }
+    sResult.cpuUs = uringBenchCpuUs() - ulCpuUs;
+    sResult.wallUs = printGetMonotonicTimeUs() - ulStartUs;
+    syscall(SYS_getppid); // end
+
+    sResult.uplinksOk = muiOk;
+    sResult.enters = uringReady() ? uringStats()->enters - sResult.enters : 0;
+    write(iResultFd, &sResult, sizeof(sResult));
+    commsClose();
+    uringClose();
+    reactorClose();
+    uringBenchQuiet(false);
+}
+
+/******************** uringBenchTrace ***********************
+    Counts the system calls of the child between the two
+    getppid() markers, by number.
+************************************************************/
+int uringBenchTrace(pid_t iPid, tUringBenchRun *pRun)
+{
+    struct __ptrace_syscall_info sInfo;
+    bool bCounting = false;
+    int iMarkers = 0;
+    int iStatus;
+    int iSignal;
+
+    if(waitpid(iPid, &iStatus, 0) != iPid || !WIFSTOPPED(iStatus))
+    {
+        return -1;
+    }
+    ptrace(PTRACE_SETOPTIONS, iPid, NULL, (void *)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+    memset(pRun->aulCalls, 0, sizeof(pRun->aulCalls));
+    pRun->syscalls = 0;
+    iSignal = 0;
+    while(1)
+    {
+        if(ptrace(PTRACE_SYSCALL, iPid, NULL, (void *)(intptr_t)iSignal) < 0 || waitpid(iPid, &iStatus, 0) != iPid)
+        {
+            return -1;
+        }
+        if(WIFEXITED(iStatus) || WIFSIGNALED(iStatus))
+        {
+            return (iMarkers == 2) ? 0 : -1;
+        }
+        iSignal = 0;
+        if(WSTOPSIG(iStatus) != (SIGTRAP | 0x80))
+        {
+            iSignal = (WSTOPSIG(iStatus) == SIGSTOP || WSTOPSIG(iStatus) == SIGTRAP) ? 0 : WSTOPSIG(iStatus);
+            continue;
+        }
+        if(ptrace(PTRACE_GET_SYSCALL_INFO, iPid, (void *)sizeof(sInfo), &sInfo) <= 0 || sInfo.op != PTRACE_SYSCALL_INFO_ENTRY)
+        {
+            continue;
+        }
+        if(sInfo.entry.nr == SYS_getppid)
+        {
+            bCounting = !bCounting;
+            iMarkers += 1;
+            continue;
+        }
+        if(bCounting && !(sInfo.entry.nr == SYS_write && sInfo.entry.args[0] == STDOUT_FILENO)) // the log isn't comms
+        {
+            pRun->syscalls += 1;
+            if(sInfo.entry.nr < URINGBENCH_SYSCALLS)
+            {
+                pRun->aulCalls[sInfo.entry.nr] += 1;
+            }
+        }
+    }
+}
+
+void uringBenchRecord(uint32_t i, tUplinkRecord *pRecord)
+{
+    memset(pRecord, 0, sizeof(tUplinkRecord));
+    pRecord->cmd.cmdCode = UPLSCHED_CMDCODE_ALARM; // no early data, a full request per connection
+    pRecord->cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    memcpy(pRecord->cmd.payload, &i, sizeof(i));
+    pRecord->time = time(NULL);
+}
+
+/********************* uringBenchDue ************************
+    Rate timer: the uplinks due by now, from the elapsed
+    time (a late timer doesn't lower the rate). Uplinks that
+    can't start (all exchanges busy) start when one
+    finishes.
+************************************************************/
+void uringBenchDue(int iFd, uint32_t uiEvents, void *pContext)
+{
+    uint64_t ulDue = (printGetMonotonicTimeUs() - mulStartUs) * muiRate / 1000000;
+
+    muiDue = (ulDue < muiUplinks) ? (uint32_t)ulDue : muiUplinks;
+    if(muiDue == muiUplinks)
+    {
+        reactorTimerDisarm(iFd);
+    }
+    uringBenchStartDue();
+}
+
+void uringBenchStartDue()
+{
+    tUplinkRecord sRecord;
+
+    while(muiStarted < muiDue && commsCanStartUplink())
+    {
+        uringBenchRecord(muiStarted, &sRecord);
+        muiStarted += 1;
+        if(commsStartUplink(&sRecord, uringBenchDone) < 0)
+        {
+            muiFinished += 1;
+        }
+    }
+}
+
+void uringBenchDone(tUplinkRecord *pRecord, int iResult)
+{
+    muiFinished += 1;
+    if(iResult >= 0 && memcmp(getCtrlDeckedReply()->payload, pRecord->cmd.payload, sizeof(uint32_t)) == 0)
+    {
+        muiOk += 1;
+    }
+    uringBenchStartDue();
+}
+
+const char *uringBenchSyscallName(int iNr)
+{
+    static char sName[16];
+
+    switch(iNr)
+    {
+        case SYS_read: return "read";
+        case SYS_write: return "write";
+        case SYS_close: return "close";
+        case SYS_socket: return "socket";
+        case SYS_connect: return "connect";
+        case SYS_sendto: return "sendto";
+        case SYS_recvfrom: return "recvfrom";
+        case SYS_setsockopt: return "setsockopt";
+        case SYS_getsockopt: return "getsockopt";
+        case SYS_fcntl: return "fcntl";
+        case SYS_epoll_ctl: return "epoll_ctl";
+        case SYS_epoll_pwait: return "epoll_pwait";
+        case SYS_timerfd_create: return "timerfd_create";
+        case SYS_timerfd_settime: return "timerfd_settime";
+        case SYS_clock_nanosleep: return "clock_nanosleep";
+        case SYS_io_uring_enter: return "io_uring_enter";
+        case SYS_getrandom: return "getrandom";
+        case SYS_getpid: return "getpid";
+        case SYS_clock_gettime: return "clock_gettime";
+        case SYS_openat: return "openat";
+        #ifdef SYS_epoll_wait
+        case SYS_epoll_wait: return "epoll_wait";
+        #endif
+        #ifdef SYS_poll
+        case SYS_poll: return "poll";
+        #endif
+        default:
+            snprintf(sName, sizeof(sName), "#%i", iNr);
+            return sName;
+    }
+}
+
+uint64_t uringBenchCpuUs()
+{
+    struct timespec sTime;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &sTime);
+    return (uint64_t)sTime.tv_sec * 1000000 + sTime.tv_nsec / 1000;
+}
+
+void uringBenchQuiet(bool bQuiet)
+{
+    fflush(stdout);
+    if(bQuiet)
+    {
+        miStdoutFd = dup(STDOUT_FILENO);
+        miNullFd = open("/dev/null", O_WRONLY);
+        dup2(miNullFd, STDOUT_FILENO);
+    }
+    else if(miStdoutFd >= 0)
+    {
+        dup2(miStdoutFd, STDOUT_FILENO);
+        close(miStdoutFd);
+        close(miNullFd);
+        miStdoutFd = -1;
+    }
+}
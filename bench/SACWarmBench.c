@@ -0,0 +1,647 @@
+/*
+    Startup to the first uplink, cold against warm, run with
+    "make warmbench".
+
+    A local https webhook (an echo of the first 4 payload
+    bytes as the chunked reply, the seqNumber of every
+    request noted) stands in for the server, behind a proxy
+    thread that holds every chunk RTT/2 in each direction
+    plus one RTT on a connection's first chunk for the TCP
+    handshake. The host is "localhost", so a cold start
+    resolves it.
+    Each start is a forked child doing the daemon's startup
+    (stateFileOpen, configInit, sslInit, commsInit) and
+    sending two uplinks on the blocking path: the first timed
+    from the fork, the second alone as the steady state.
+    A cold start removes the state file first, -s warm starts
+    follow on the file the one before left. All of it twice,
+    with the server capped at TLS 1.2 (a resumed session
+    saves a round trip) and at TLS 1.3 (it saves the
+    certificate, not the round trip).
+    Reported per server: median of the first uplink after a
+    cold and a warm start and of the steady state, in ms and
+    RTTs, the handshakes the server resumed.
+    Checks: every warm start resumed the TLS session, its
+    first seqNr continues where the start before stopped
+    (a cold one starts at 0), and its first uplink is within
+    half an RTT of the steady state.
+
+    Usage:
+        SACWarmBench [-s warm starts] [-r rtt ms]
+    Exit code 1 when a check fails.
+*/
+
+#include "stdio.h"
+#include <stdlib.h>
+#include "string.h" /* memcpy, memset, strstr */
+#include "unistd.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "SACServerComms.h"
+#include "SACPrintUtils.h"
+#include "SACStructs.h"
+#include "SACUplinkSched.h"
+#include "SACConfig.h"
+#include "SACStateFile.h"
+
+#define WARMBENCH_STARTS        5
+#define WARMBENCH_RTTMS         50
+#define WARMBENCH_MAXSTARTS     50
+#define WARMBENCH_MAXREQUESTS   1024
+#define WARMBENCH_BUFSIZE       8192
+#define WARMBENCH_CHUNKSIZE     4096
+#define WARMBENCH_MAXCHUNKS     16 // held per direction and connection
+
+typedef struct
+{
+    uint64_t dueUs;
+    int length;
+    uint8_t data[WARMBENCH_CHUNKSIZE];
+} tWarmBenchChunk;
+
+typedef struct
+{
+    int fromFd;
+    int toFd;
+    tWarmBenchChunk chunks[WARMBENCH_MAXCHUNKS];
+    uint32_t head;
+    uint32_t count;
+    bool eof;
+} tWarmBenchDirection;
+
+typedef struct
+{
+    int listenFd;
+    uint16_t port;
+    SSL_CTX *pContext; // webhook
+    uint16_t targetPort; // proxy: where to
+} tWarmBenchListener;
+
+typedef struct
+{
+    int fd;
+    SSL_CTX *pContext;
+    uint16_t targetPort;
+} tWarmBenchConnection;
+
+typedef struct
+{
+    uint32_t firstUs; // fork to the first downlink
+    uint32_t steadyUs; // the second uplink
+    uint32_t ok;
+} tWarmBenchStart;
+
+/****************** private function prototypes *********************/
+int warmBenchListen(tWarmBenchListener *pListener);
+int warmBenchServerContexts(SSL_CTX **ppTls12, SSL_CTX **ppTls13);
+void *warmBenchAccept(void *pArg);
+void *warmBenchServer(void *pArg);
+void *warmBenchProxy(void *pArg);
+int warmBenchPump(tWarmBenchDirection *pDirection, uint32_t uiExtraUs);
+int warmBenchFlush(tWarmBenchDirection *pDirection, uint64_t ulNowUs);
+int warmBenchStart(uint16_t uiPort, bool bCold, tWarmBenchStart *pStart);
+void warmBenchChild(uint16_t uiPort, int iPipeFd);
+int warmBenchSend(uint32_t uiCounter);
+uint32_t warmBenchMedian(uint32_t *pValues, uint32_t uiCount);
+int warmBenchCompare(const void *pA, const void *pB);
+/********************************************************************/
+
+/******************** private global variables **********************/
+static char msConfigPath[256];
+static uint32_t muiRttMs = WARMBENCH_RTTMS;
+static pthread_mutex_t msLock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t muiHandshakes = 0;
+static uint32_t muiResumed = 0;
+static uint32_t mauiSeqNrs[WARMBENCH_MAXREQUESTS]; // of every request, in order
+static uint32_t muiRequests = 0;
+/********************************************************************/
+
+int main(int argc, char* argv[])
+{
+    tWarmBenchListener asServers[2];
+    tWarmBenchListener asProxies[2];
+    static const char *asNames[] = {"tls1.2", "tls1.3"};
+    tWarmBenchStart sStart;
+    uint32_t auiWarmUs[WARMBENCH_MAXSTARTS];
+    uint32_t auiSteadyUs[WARMBENCH_MAXSTARTS + 1];
+    uint32_t uiStarts = WARMBENCH_STARTS;
+    uint32_t uiColdUs;
+    uint32_t uiSteadyUs;
+    uint32_t uiWarmUs;
+    uint32_t uiHandshakes;
+    uint32_t uiResumed;
+    uint32_t uiExpectedSeqNr;
+    uint32_t uiSeqNrErrors;
+    uint32_t uiFirstRequest;
+    pthread_t sThread;
+    bool bPass = true;
+    bool bRunPass;
+    int iOption;
+    uint32_t i, j;
+
+    while((iOption = getopt(argc, argv, "s:r:")) != -1)
+    {
+        switch(iOption)
+        {
+            case 's': uiStarts = atoi(optarg); break;
+            case 'r': muiRttMs = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-s warm starts] [-r rtt ms]\n", argv[0]);
+                return 2;
+        }
+    }
+    if(uiStarts < 1 || uiStarts > WARMBENCH_MAXSTARTS)
+    {
+        fprintf(stderr, "Need 1..%u warm starts.\n", WARMBENCH_MAXSTARTS);
+        return 2;
+    }
+    snprintf(msConfigPath, sizeof(msConfigPath), "/tmp/SACWarmBench.%i.conf", (int)getpid());
+    memset(asServers, 0, sizeof(asServers));
+    memset(asProxies, 0, sizeof(asProxies));
+    if(warmBenchServerContexts(&asServers[0].pContext, &asServers[1].pContext) < 0)
+    {
+        fprintf(stderr, "Could not set up the TLS server contexts.\n");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    for(i=0; i<2; i+=1)
+    {
+        if(warmBenchListen(&asServers[i]) < 0 || warmBenchListen(&asProxies[i]) < 0)
+        {
+            fprintf(stderr, "Could not open the local servers and their proxies.\n");
+            return 2;
+        }
+        asProxies[i].targetPort = asServers[i].port;
+        pthread_create(&sThread, NULL, warmBenchAccept, &asServers[i]);
+        pthread_create(&sThread, NULL, warmBenchAccept, &asProxies[i]);
+    }
+
+    fprintf(stderr, "1 cold and %u warm starts per server, %u ms rtt, state file %s\n", uiStarts, muiRttMs, STATEFILE_PATH);
+    fprintf(stderr, "%-7s %9s %6s %9s %6s %9s %6s %9s %6s\n", "server", "cold ms", "RTTs", "warm ms", "RTTs", "steady ms", "RTTs", "resumed", "seqNr");
+    for(i=0; i<2; i+=1)
+    {
+        pthread_mutex_lock(&msLock);
+        uiHandshakes = muiHandshakes;
+        uiResumed = muiResumed;
+        uiFirstRequest = muiRequests;
+        pthread_mutex_unlock(&msLock);
+        bRunPass = true;
+        if(warmBenchStart(asProxies[i].port, true, &sStart) < 0)
+        {
+            fprintf(stderr, "Could not run a start.\n");
+            return 1;
+        }
+        uiColdUs = sStart.firstUs;
+        auiSteadyUs[0] = sStart.steadyUs;
+        bRunPass = bRunPass && sStart.ok == 2;
+        for(j=0; j<uiStarts; j+=1)
+        {
+            if(warmBenchStart(asProxies[i].port, false, &sStart) < 0)
+            {
+                fprintf(stderr, "Could not run a start.\n");
+                return 1;
+            }
+            auiWarmUs[j] = sStart.firstUs;
+            auiSteadyUs[j + 1] = sStart.steadyUs;
+            bRunPass = bRunPass && sStart.ok == 2;
+        }
+        uiWarmUs = warmBenchMedian(auiWarmUs, uiStarts);
+        uiSteadyUs = warmBenchMedian(auiSteadyUs, uiStarts + 1);
+
+        /* two uplinks per start, the cold one starts at 0 */
+        pthread_mutex_lock(&msLock);
+        uiSeqNrErrors = 0;
+        uiExpectedSeqNr = 0;
+        for(j=uiFirstRequest; j<muiRequests; j+=1)
+        {
+            uiSeqNrErrors += (mauiSeqNrs[j] != uiExpectedSeqNr) ? 1 : 0;
+            uiExpectedSeqNr = mauiSeqNrs[j] + 1;
+        }
+        uiSeqNrErrors += (muiRequests - uiFirstRequest != 2 * (uiStarts + 1)) ? 1 : 0;
+        uiHandshakes = muiHandshakes - uiHandshakes;
+        uiResumed = muiResumed - uiResumed;
+        pthread_mutex_unlock(&msLock);
+
+        /* the cold start's second uplink already resumes */
+        bRunPass = bRunPass && uiResumed == uiHandshakes - 1 && uiSeqNrErrors == 0 && uiWarmUs <= uiSteadyUs + muiRttMs * 500;
+        fprintf(stderr, "%-7s %9.1f %6.2f %9.1f %6.2f %9.1f %6.2f %5u/%-3u %6s %s\n", asNames[i], uiColdUs / 1000.0, uiColdUs / 1000.0 / muiRttMs,
+            uiWarmUs / 1000.0, uiWarmUs / 1000.0 / muiRttMs, uiSteadyUs / 1000.0, uiSteadyUs / 1000.0 / muiRttMs,
+            uiResumed, uiHandshakes, (uiSeqNrErrors == 0) ? "ok" : "broken", bRunPass ? "" : "FAIL");
+        bPass = bPass && bRunPass;
+    }
+
+    unlink(msConfigPath);
+    unlink(STATEFILE_PATH);
+    fprintf(stderr, "%s\n", bPass ? "PASS" : "FAIL");
+    return bPass ? 0 : 1;
+}
+
+/********************* warmBenchListen **********************
+    Loopback listening socket on a free port.
+************************************************************/
+int warmBenchListen(tWarmBenchListener *pListener)
+{
+    struct sockaddr_in sAddr;
+    socklen_t uiLength = sizeof(sAddr);
+
+    pListener->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = 0;
+    if(pListener->listenFd < 0 || bind(pListener->listenFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) < 0 || listen(pListener->listenFd, 16) < 0)
+    {
+        return -1;
+    }
+    getsockname(pListener->listenFd, (struct sockaddr *)&sAddr, &uiLength);
+    pListener->port = ntohs(sAddr.sin_port);
+    return 0;
+}
+
+/**************** warmBenchServerContexts *******************
+    Self-signed P-256 certificate made up on the spot, one
+    context capped at TLS 1.2 and one at TLS 1.3. Both live
+    as long as the bench, so do their ticket keys.
+************************************************************/
+int warmBenchServerContexts(SSL_CTX **ppTls12, SSL_CTX **ppTls13)
+{
+    EVP_PKEY_CTX *pKeyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pKey = NULL;
+    X509 *pCert = X509_new();
+    int iResult = -1;
+
+    if(pKeyContext != NULL && pCert != NULL &&
+        EVP_PKEY_keygen_init(pKeyContext) == 1 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(pKeyContext, NID_X9_62_prime256v1) == 1 &&
+        EVP_PKEY_keygen(pKeyContext, &pKey) == 1)
+    {
+        X509_set_version(pCert, 2);
+        ASN1_INTEGER_set(X509_get_serialNumber(pCert), 1);
+        X509_gmtime_adj(X509_getm_notBefore(pCert), 0);
+        X509_gmtime_adj(X509_getm_notAfter(pCert), 7 * 24 * 3600);
+        X509_set_pubkey(pCert, pKey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(pCert), "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+        X509_set_issuer_name(pCert, X509_get_subject_name(pCert));
+        *ppTls12 = SSL_CTX_new(TLS_server_method());
+        *ppTls13 = SSL_CTX_new(TLS_server_method());
+        if(X509_sign(pCert, pKey, EVP_sha256()) > 0 && *ppTls12 != NULL && *ppTls13 != NULL &&
+            SSL_CTX_set_max_proto_version(*ppTls12, TLS1_2_VERSION) == 1 && SSL_CTX_set_min_proto_version(*ppTls13, TLS1_3_VERSION) == 1 &&
+            SSL_CTX_use_certificate(*ppTls12, pCert) == 1 && SSL_CTX_use_PrivateKey(*ppTls12, pKey) == 1 &&
+            SSL_CTX_use_certificate(*ppTls13, pCert) == 1 && SSL_CTX_use_PrivateKey(*ppTls13, pKey) == 1)
+        {
+            iResult = 0;
+        }
+    }
+    EVP_PKEY_CTX_free(pKeyContext);
+    EVP_PKEY_free(pKey);
+    X509_free(pCert);
+    return iResult;
+}
+
+/********************* warmBenchAccept **********************
+    Accept loop of the webhook or its proxy, a thread per
+    connection.
+************************************************************/
+void *warmBenchAccept(void *pArg)
+{
+    tWarmBenchListener *pListener = (tWarmBenchListener *)pArg;
+    tWarmBenchConnection *pConnection;
+    pthread_t sThread;
+    int iFd;
+
+    while(1)
+    {
+        iFd = accept(pListener->listenFd, NULL, NULL);
+        if(iFd < 0)
+        {
+            continue;
+        }
+        pConnection = malloc(sizeof(tWarmBenchConnection));
+        pConnection->fd = iFd;
+        pConnection->pContext = pListener->pContext;
+        pConnection->targetPort = pListener->targetPort;
+        pthread_create(&sThread, NULL, (pListener->pContext != NULL) ? warmBenchServer : warmBenchProxy, pConnection);
+        pthread_detach(sThread);
+    }
+    return NULL;
+}
+
+/********************* warmBenchServer **********************
+    Requests on the connection until the client closes, the
+    first 4 payload bytes go back as the downlink. Notes
+    whether the handshake resumed and every seqNumber.
+************************************************************/
+void *warmBenchServer(void *pArg)
+{
+    int iFd = ((tWarmBenchConnection *)pArg)->fd;
+    SSL_CTX *pContext = ((tWarmBenchConnection *)pArg)->pContext;
+    struct timeval sTimeout = {.tv_sec = 10, .tv_usec = 0};
+    char sBuffer[WARMBENCH_BUFSIZE];
+    char sResponse[256];
+    char sData[9];
+    char *pEnd;
+    char *pValue;
+    SSL *pSsl;
+    int iBuffered = 0;
+    int iLength;
+    int iResult;
+
+    free(pArg);
+    setsockopt(iFd, SOL_SOCKET, SO_RCVTIMEO, &sTimeout, sizeof(sTimeout));
+    pSsl = SSL_new(pContext);
+    if(pSsl == NULL || SSL_set_fd(pSsl, iFd) != 1 || SSL_accept(pSsl) != 1)
+    {
+        SSL_free(pSsl);
+        close(iFd);
+        return NULL;
+    }
+    pthread_mutex_lock(&msLock);
+    muiHandshakes += 1;
+    muiResumed += SSL_session_reused(pSsl) ? 1 : 0;
+    pthread_mutex_unlock(&msLock);
+    while(iBuffered < WARMBENCH_BUFSIZE - 1)
+    {
+        iResult = SSL_read(pSsl, &sBuffer[iBuffered], WARMBENCH_BUFSIZE - 1 - iBuffered);
+        if(iResult <= 0)
+        {
+            break;
+        }
+        iBuffered += iResult;
+        sBuffer[iBuffered] = 0x00;
+        while((pEnd = strstr(sBuffer, "\r\n\r\n")) != NULL)
+        {
+            pValue = strstr(sBuffer, "seqNumber=");
+            pthread_mutex_lock(&msLock);
+            if(pValue != NULL && pValue < pEnd && muiRequests < WARMBENCH_MAXREQUESTS)
+            {
+                mauiSeqNrs[muiRequests++] = strtoul(pValue + 10, NULL, 10);
+            }
+            pthread_mutex_unlock(&msLock);
+            memcpy(sData, "00000000", sizeof(sData));
+            pValue = strstr(sBuffer, "&data=");
+            if(pValue != NULL && pValue < pEnd)
+            {
+                memcpy(sData, pValue + 6, 8);
+            }
+            iLength = snprintf(sResponse, sizeof(sResponse), "HTTP/1.1 200 OK\r\nServer: SACWarmBench\r\nTransfer-Encoding: chunked\r\nContent-Type: text/html; charset=UTF-8\r\n\r\n10\r\n%s00000000\r\n0\r\n\r\n", sData);
+            if(SSL_write(pSsl, sResponse, iLength) != iLength)
+            {
+                iBuffered = WARMBENCH_BUFSIZE;
+                break;
+            }
+            iLength = (int)(pEnd - sBuffer) + 4;
+            memmove(sBuffer, &sBuffer[iLength], iBuffered - iLength + 1);
+            iBuffered -= iLength;
+        }
+    }
+    SSL_shutdown(pSsl);
+    SSL_free(pSsl);
+    close(iFd);
+    return NULL;
+}
+
+/********************* warmBenchProxy ***********************
+    Relays one client connection to the webhook, every chunk
+    RTT/2 late, the first client chunk one RTT more for the
+    TCP handshake.
+************************************************************/
+void *warmBenchProxy(void *pArg)
+{
+    tWarmBenchConnection *pConnection = (tWarmBenchConnection *)pArg;
+    int iClientFd = pConnection->fd;
+    tWarmBenchDirection *pUp = calloc(1, sizeof(tWarmBenchDirection));
+    tWarmBenchDirection *pDown = calloc(1, sizeof(tWarmBenchDirection));
+    struct sockaddr_in sAddr;
+    struct pollfd asPoll[2];
+    uint32_t uiHandshakeUs = muiRttMs * 1000;
+    uint64_t ulNowUs;
+    uint64_t ulDueUs;
+    int iTimeoutMs;
+    int iServerFd;
+    int iNoDelay = 1;
+
+    iServerFd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sAddr.sin_port = htons(pConnection->targetPort);
+    free(pArg);
+    setsockopt(iClientFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay)); // a held chunk goes out when due, not after the peer's delayed ack
+    setsockopt(iServerFd, IPPROTO_TCP, TCP_NODELAY, &iNoDelay, sizeof(iNoDelay));
+    if(pUp != NULL && pDown != NULL && iServerFd >= 0 && connect(iServerFd, (struct sockaddr *)&sAddr, sizeof(sAddr)) == 0)
+    {
+        pUp->fromFd = iClientFd;
+        pUp->toFd = iServerFd;
+        pDown->fromFd = iServerFd;
+        pDown->toFd = iClientFd;
+        while(!(pUp->eof && pUp->count == 0 && pDown->eof && pDown->count == 0))
+        {
+            asPoll[0].fd = (pUp->eof || pUp->count == WARMBENCH_MAXCHUNKS) ? -1 : iClientFd;
+            asPoll[1].fd = (pDown->eof || pDown->count == WARMBENCH_MAXCHUNKS) ? -1 : iServerFd;
+            asPoll[0].events = POLLIN;
+            asPoll[1].events = POLLIN;
+            ulNowUs = printGetMonotonicTimeUs();
+            iTimeoutMs = 100;
+            if(pUp->count > 0 || pDown->count > 0)
+            {
+                ulDueUs = (pDown->count == 0 || (pUp->count > 0 && pUp->chunks[pUp->head].dueUs < pDown->chunks[pDown->head].dueUs)) ? pUp->chunks[pUp->head].dueUs : pDown->chunks[pDown->head].dueUs;
+                iTimeoutMs = (ulDueUs > ulNowUs) ? (int)((ulDueUs - ulNowUs + 999) / 1000) : 0;
+            }
+            poll(asPoll, 2, iTimeoutMs);
+            if((asPoll[0].fd >= 0 && (asPoll[0].revents & (POLLIN | POLLHUP | POLLERR)) && warmBenchPump(pUp, uiHandshakeUs) < 0) ||
+                (asPoll[1].fd >= 0 && (asPoll[1].revents & (POLLIN | POLLHUP | POLLERR)) && warmBenchPump(pDown, 0) < 0))
+            {
+                break;
+            }
+            uiHandshakeUs = (pUp->count > 0 || pUp->eof) ? 0 : uiHandshakeUs;
+            ulNowUs = printGetMonotonicTimeUs();
+            if(warmBenchFlush(pUp, ulNowUs) < 0 || warmBenchFlush(pDown, ulNowUs) < 0)
+            {
+                break;
+            }
+        }
+    }
+    if(iServerFd >= 0)
+    {
+        close(iServerFd);
+    }
+    close(iClientFd);
+    free(pUp);
+    free(pDown);
+    return NULL;
+}
+
+/********************** warmBenchPump ***********************
+    Reads what arrived into a chunk held until RTT/2 (plus
+    uiExtraUs) from now.
+************************************************************/
+int warmBenchPump(tWarmBenchDirection *pDirection, uint32_t uiExtraUs)
+{
+    tWarmBenchChunk *pChunk = &pDirection->chunks[(pDirection->head + pDirection->count) % WARMBENCH_MAXCHUNKS];
+    int iResult = read(pDirection->fromFd, pChunk->data, WARMBENCH_CHUNKSIZE);
+
+    if(iResult < 0)
+    {
+        return -1;
+    }
+    if(iResult == 0)
+    {
+        pDirection->eof = true;
+        return 0;
+    }
+    pChunk->length = iResult;
+    pChunk->dueUs = printGetMonotonicTimeUs() + muiRttMs * 500 + uiExtraUs;
+    pDirection->count += 1;
+    return 0;
+}
+
+/********************** warmBenchFlush **********************
+    Forwards the chunks that are due, passes the end of the
+    stream on once nothing is held anymore.
+************************************************************/
+int warmBenchFlush(tWarmBenchDirection *pDirection, uint64_t ulNowUs)
+{
+    tWarmBenchChunk *pChunk;
+
+    while(pDirection->count > 0 && pDirection->chunks[pDirection->head].dueUs <= ulNowUs)
+    {
+        pChunk = &pDirection->chunks[pDirection->head];
+        if(send(pDirection->toFd, pChunk->data, pChunk->length, MSG_NOSIGNAL) != pChunk->length)
+        {
+            return -1;
+        }
+        pDirection->head = (pDirection->head + 1) % WARMBENCH_MAXCHUNKS;
+        pDirection->count -= 1;
+        if(pDirection->count == 0 && pDirection->eof)
+        {
+            shutdown(pDirection->toFd, SHUT_WR);
+        }
+    }
+    return 0;
+}
+
+/********************** warmBenchStart **********************
+    One daemon start in a child process, its times come back
+    through a pipe.
+************************************************************/
+int warmBenchStart(uint16_t uiPort, bool bCold, tWarmBenchStart *pStart)
+{
+    int aiPipe[2];
+    int iStatus;
+    pid_t iPid;
+
+    if(bCold)
+    {
+        unlink(STATEFILE_PATH);
+    }
+    if(pipe(aiPipe) < 0)
+    {
+        return -1;
+    }
+    iPid = fork();
+    if(iPid < 0)
+    {
+        return -1;
+    }
+    if(iPid == 0)
+    {
+        close(aiPipe[0]);
+        warmBenchChild(uiPort, aiPipe[1]);
+        _exit(0);
+    }
+    close(aiPipe[1]);
+    memset(pStart, 0, sizeof(tWarmBenchStart));
+    iStatus = (read(aiPipe[0], pStart, sizeof(tWarmBenchStart)) == sizeof(tWarmBenchStart)) ? 0 : -1;
+    close(aiPipe[0]);
+    waitpid(iPid, NULL, 0);
+    return iStatus;
+}
+
+/********************** warmBenchChild **********************
+    The daemon's startup as far as comms go, then the first
+    uplink and one more.
+************************************************************/
+void warmBenchChild(uint16_t uiPort, int iPipeFd)
+{
+    uint64_t ulStartUs = printGetMonotonicTimeUs();
+    tWarmBenchStart sStart;
+    int iNullFd = open("/dev/null", O_WRONLY);
+    FILE *pFile;
+
+    memset(&sStart, 0, sizeof(sStart));
+    dup2(iNullFd, STDOUT_FILENO);
+    structsInit();
+    uplinkSchedInit();
+    stateFileOpen();
+    pFile = fopen(msConfigPath, "w");
+    if(pFile != NULL)
+    {
+        fprintf(pFile, "[comms]\ntransport = http\nhost = localhost\nhttp_port = %u\nuse_ssl = yes\nktls = no\npipeline_depth = 0\nuser_reply =\n\n[timeouts]\nsocket_sec = 2\n", uiPort);
+        fclose(pFile);
+    }
+    configInit(msConfigPath);
+    sslInit();
+    commsInit();
+    sStart.ok += (warmBenchSend(1) == 0) ? 1 : 0;
+    sStart.firstUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    ulStartUs = printGetMonotonicTimeUs();
+    sStart.ok += (warmBenchSend(2) == 0) ? 1 : 0;
+    sStart.steadyUs = (uint32_t)(printGetMonotonicTimeUs() - ulStartUs);
+    commsClose();
+    stateFileClose();
+    fflush(stdout);
+    if(write(iPipeFd, &sStart, sizeof(sStart)) != sizeof(sStart))
+    {
+        _exit(1);
+    }
+}
+
+/********************** warmBenchSend ***********************
+    One event asking for a downlink, 0 when the decked
+    reply got its echo.
+************************************************************/
+int warmBenchSend(uint32_t uiCounter)
+{
+    tUplinkRecord sRecord;
+
+    memset(&sRecord, 0, sizeof(sRecord));
+    memset(getCtrlDeckedReply()->payload, 0xff, STRUCTS_DECKEDREPLYPAYLOADSIZE);
+    sRecord.cmd.cmdCode = 0x02;
+    sRecord.cmd.payloadSize = STRUCTS_SENDCMDPAYLOADSIZE + 1;
+    sRecord.cmd.downlinkIndicator = 0x01;
+    sRecord.priorityClass = UPLCLASS_EVENT;
+    memcpy(sRecord.cmd.payload, &uiCounter, sizeof(uiCounter));
+    sRecord.time = time(NULL);
+    if(commsSendUplink(&sRecord) < 0 || memcmp(getCtrlDeckedReply()->payload, &uiCounter, sizeof(uiCounter)) != 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t warmBenchMedian(uint32_t *pValues, uint32_t uiCount)
+{
+    qsort(pValues, uiCount, sizeof(uint32_t), warmBenchCompare);
+    return pValues[(uiCount - 1) / 2];
+}
+
+int warmBenchCompare(const void *pA, const void *pB)
+{
+    uint32_t uiA = *(const uint32_t *)pA;
+    uint32_t uiB = *(const uint32_t *)pB;
+    return (uiA > uiB) - (uiA < uiB);
+}
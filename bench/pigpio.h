@@ -0,0 +1,36 @@
+#ifndef PIGPIO_H
+#define PIGPIO_H
+
+/*
+    Stand in for pigpio.h when the daemon is linked into the
+    benchmarks: the bsc calls go to a simulated BSC slave
+    (SACBenchBsc.c) instead of the hardware, so the i2c state
+    machine runs on any linux machine.
+    Only what SACRPiIotSlave.c uses, same signatures as
+    pigpio.
+*/
+
+#include <stdint.h>
+
+#define BSC_FIFO_SIZE   512
+#define PI_EVENT_BSC    31
+
+typedef struct
+{
+    uint32_t control;          // Write
+    int rxCnt;                 // Read only
+    char rxBuf[BSC_FIFO_SIZE]; // Read only
+    int txCnt;                 // Write
+    char txBuf[BSC_FIFO_SIZE]; // Write
+} bsc_xfer_t;
+
+typedef void (*eventFunc_t)(int event, uint32_t tick);
+
+int gpioInitialise(void);
+void gpioTerminate(void);
+uint32_t gpioTick(void);
+int bscXfer(bsc_xfer_t *bscxfer);
+uint32_t getRawBCSCReg(int iRegister);
+int eventSetFunc(unsigned event, eventFunc_t f);
+
+#endif
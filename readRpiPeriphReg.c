@@ -2,8 +2,22 @@
     Compile met:
     gcc -Wall -pthread -o readRpiPeriphReg readRpiPeriphReg.c
 
+    Gebruik:
+    readRpiPeriphReg                  print the 16 BSC slave registers once
+    readRpiPeriphReg -s [options]     sample RSR/SLV/CR/FR (and DR) into a binary file
+      -r <hz>     sample rate, 0 = as fast as possible (default 10000)
+      -t <sec>    duration (default 10)
+      -o <file>   sample file (default bsc_samples.bin), bsc_file_header + bsc_sample[]
+      -d          also sample DR. Careful: reading DR pops a byte from the rx fifo,
+                  the slave never sees that byte. Off by default.
+    readRpiPeriphReg -T               self test of the sampler against a simulated BSC
+
+    Map source (all modes):
+      -m <file>   map the first 4k of <file> instead of /dev/mem, e.g. a register dump
+      -M          map an anonymous memfd, to benchmark the sampler itself
 */
 
+#define _GNU_SOURCE // memfd_create
 
 #define BCM2708_PERI_BASE          0x3F000000
 #define GPIO_BASE                (BCM2708_PERI_BASE + 0x214000) /* SPI/BSC slave */
@@ -22,28 +36,161 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sched.h>
+
+#include "SACRPiIotSlave.h" // tBscStatus
 
 #define PAGE_SIZE (4*1024)
 #define BLOCK_SIZE (4*1024)
 
+// BSC slave register word offsets
+#define BSC_DR    0
+#define BSC_RSR   1
+#define BSC_SLV   2
+#define BSC_CR    3
+#define BSC_FR    4
+
+#define BSC_DR_OE     (1 << 8) // rx overrun, as seen through DR
+#define BSC_RSR_OE    (1 << 0) // rx overrun, sticky until RSR is written
+#define BSC_RSR_UE    (1 << 1) // tx underrun, sticky until RSR is written
+#define BSC_FIFO_SIZE 16
+
+#define SAMPLE_RING_SIZE    8192 // samples, power of 2
+#define SAMPLE_FILE_MAGIC   0x53425343 // "CSBS"
+#define SAMPLE_FILE_VERSION 1
+#define SAMPLE_SPINUS       100 // closer to the next sample than this: busy wait instead of sleep
+
+#define TEST_STEPS          2000
+
+// one sample in the file, little endian
+typedef struct
+{
+  uint32_t time_us; // since the start of sampling
+  uint32_t dr;      // 0 without -d
+  uint16_t fr;      // FR only has 16 bits, same layout as tBscStatus
+  uint16_t cr;
+  uint8_t rsr;
+  uint8_t slv;
+  uint16_t reserved;
+} bsc_sample;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sample_size; // sizeof(bsc_sample)
+  uint32_t rate_hz;     // requested, 0 = as fast as possible
+  uint64_t start_unix_us;
+} bsc_file_header;
+
+typedef struct
+{
+  uint64_t samples;
+  uint64_t dropped;      // ring full, the writer didn't keep up
+  uint64_t late;         // sampler missed its slot and resynced
+  uint32_t max_rx_level;
+  uint32_t max_tx_level;
+  uint64_t rx_full;      // samples with a full rx fifo
+  uint64_t overruns;     // RSR.OE rising edges
+  uint64_t underruns;    // RSR.UE rising edges
+  uint64_t dr_overruns;  // DR.OE seen, only with -d
+  uint8_t prev_rsr;
+  uint64_t elapsed_us;
+} sample_stats;
+
 int  mem_fd;
 void *periph_map;
 
 // I/O access
 volatile unsigned int *periph;
 
-void setup_io();
+// sampler ring, single producer (sampler thread) single consumer (main)
+bsc_sample ring[SAMPLE_RING_SIZE];
+uint32_t ring_head = 0;
+uint32_t ring_tail = 0;
+volatile bool sampling = false;
+uint64_t sampler_dropped = 0; // only the sampler writes these, read after the join
+uint64_t sampler_late = 0;
+
+uint32_t sample_rate = 10000;
+uint32_t sample_seconds = 10;
+bool sample_dr = false;
+
+void setup_io(const char *map_file, bool map_memfd);
+uint64_t now_ns();
+void *sampler_thread(void *arg);
+int run_sampler(FILE *out, sample_stats *stats);
+uint32_t drain_ring(FILE *out, sample_stats *stats);
+void account_sample(const bsc_sample *s, sample_stats *stats);
+void print_stats(const sample_stats *stats);
+void *simulator_thread(void *arg);
+int self_test();
 
 int main(int argc, char **argv)
 {
   int g;
+  int opt;
+  bool mode_sample = false;
+  bool mode_test = false;
+  bool map_memfd = false;
+  const char *map_file = NULL;
+  const char *out_file = "bsc_samples.bin";
+  FILE *out;
+  sample_stats stats;
+
+  while((opt = getopt(argc, argv, "sTr:t:o:dm:M")) != -1)
+  {
+    switch(opt)
+    {
+      case 's': mode_sample = true; break;
+      case 'T': mode_test = true; map_memfd = true; break;
+      case 'r': sample_rate = atoi(optarg); break;
+      case 't': sample_seconds = atoi(optarg); break;
+      case 'o': out_file = optarg; break;
+      case 'd': sample_dr = true; break;
+      case 'm': map_file = optarg; break;
+      case 'M': map_memfd = true; break;
+      default:
+        printf("usage: %s [-s [-r hz] [-t sec] [-o file] [-d]] [-T] [-m file | -M]\n", argv[0]);
+        return 2;
+    }
+  }
 
   // Set up gpi pointer for direct register access
-  setup_io();
-  
+  setup_io(map_file, map_memfd);
+
+  if(mode_test)
+  {
+    return self_test();
+  }
+  if(mode_sample)
+  {
+    out = fopen(out_file, "wb");
+    if(out == NULL)
+    {
+      printf("can't open %s\n", out_file);
+      return 1;
+    }
+    if(run_sampler(out, &stats) < 0)
+    {
+      fclose(out);
+      return 1;
+    }
+    fclose(out);
+    print_stats(&stats);
+    return 0;
+  }
+
   printf("reg startaddress = 0x%08x\n", GPIO_BASE);
 
   for(g=0; g<16; g+=1)
@@ -57,11 +204,34 @@ int main(int argc, char **argv)
 
 //
 // Set up a memory regions to access GPIO
+// /dev/mem by default, a regular file or a memfd to run without a Pi.
 //
-void setup_io()
+void setup_io(const char *map_file, bool map_memfd)
 {
+   off_t offset = GPIO_BASE;
+   struct stat st;
+
+   if (map_memfd) {
+      mem_fd = memfd_create("bsc", 0);
+      if (mem_fd < 0 || ftruncate(mem_fd, BLOCK_SIZE) < 0) {
+         printf("can't create memfd\n");
+         exit(-1);
+      }
+      offset = 0;
+   }
+   else if (map_file != NULL) {
+      if ((mem_fd = open(map_file, O_RDWR) ) < 0) {
+         printf("can't open %s \n", map_file);
+         exit(-1);
+      }
+      if (fstat(mem_fd, &st) < 0 || st.st_size < BLOCK_SIZE) {
+         printf("%s needs at least %d bytes\n", map_file, BLOCK_SIZE); // mapping past the end gives SIGBUS
+         exit(-1);
+      }
+      offset = 0;
+   }
    /* open /dev/mem */
-   if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
+   else if ((mem_fd = open("/dev/mem", O_RDWR|O_SYNC) ) < 0) {
       printf("can't open /dev/mem \n");
       exit(-1);
    }
@@ -73,13 +243,13 @@ void setup_io()
       PROT_READ|PROT_WRITE,// Enable reading & writting to mapped memory
       MAP_SHARED,       //Shared with other processes
       mem_fd,           //File to map
-      GPIO_BASE         //Offset to GPIO peripheral
+      offset            //Offset to GPIO peripheral
    );
 
    close(mem_fd); //No need to keep mem_fd open after mmap
 
    if (periph_map == MAP_FAILED) {
-      printf("mmap error %d\n", (int)periph_map);//errno also set!
+      printf("mmap error %d\n", errno);
       exit(-1);
    }
 
@@ -87,4 +257,281 @@ void setup_io()
    periph = (volatile unsigned *)periph_map;
 
 
-} // setup_io
\ No newline at end of file
+} // setup_io
+
+uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Reads the registers at sample_rate into the ring. Never blocks on the
+// writer: a full ring drops the sample. FR and RSR are read before DR so
+// they show the fifo as it was before a -d read popped a byte.
+//
+void *sampler_thread(void *arg)
+{
+  uint64_t start_ns = now_ns();
+  uint64_t next_ns = start_ns;
+  uint64_t period_ns = (sample_rate > 0) ? 1000000000ULL / sample_rate : 0;
+  uint64_t t_ns;
+  uint32_t head = 0;
+  bsc_sample *s;
+  struct timespec ts;
+
+  while(sampling)
+  {
+    if(period_ns > 0)
+    {
+      next_ns += period_ns;
+      t_ns = now_ns();
+      if(t_ns > next_ns + period_ns)
+      {
+        sampler_late += 1; // don't burst to catch up, that would skew the timing
+        next_ns = t_ns;
+      }
+      else if(next_ns > t_ns + SAMPLE_SPINUS * 1000ULL)
+      {
+        ts.tv_sec = next_ns / 1000000000ULL;
+        ts.tv_nsec = next_ns % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+      while(now_ns() < next_ns)
+      {
+      }
+    }
+    if(head - __atomic_load_n(&ring_tail, __ATOMIC_ACQUIRE) >= SAMPLE_RING_SIZE)
+    {
+      sampler_dropped += 1;
+      continue;
+    }
+    s = &ring[head & (SAMPLE_RING_SIZE - 1)];
+    s->fr = (uint16_t)periph[BSC_FR];
+    s->rsr = (uint8_t)periph[BSC_RSR];
+    s->slv = (uint8_t)periph[BSC_SLV];
+    s->cr = (uint16_t)periph[BSC_CR];
+    s->dr = sample_dr ? periph[BSC_DR] : 0;
+    s->reserved = 0;
+    s->time_us = (uint32_t)((now_ns() - start_ns) / 1000);
+    head += 1;
+    __atomic_store_n(&ring_head, head, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+//
+// Samples for sample_seconds, the calling thread writes the ring to out.
+//
+int run_sampler(FILE *out, sample_stats *stats)
+{
+  pthread_t thread;
+  bsc_file_header header;
+  uint64_t start_ns;
+  uint64_t end_ns;
+  struct timespec ts;
+
+  memset(stats, 0, sizeof(*stats));
+  memset(&header, 0, sizeof(header));
+  header.magic = SAMPLE_FILE_MAGIC;
+  header.version = SAMPLE_FILE_VERSION;
+  header.sample_size = sizeof(bsc_sample);
+  header.rate_hz = sample_rate;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  header.start_unix_us = (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+  fwrite(&header, sizeof(header), 1, out);
+
+  ring_head = 0;
+  ring_tail = 0;
+  sampler_dropped = 0;
+  sampler_late = 0;
+  sampling = true;
+  start_ns = now_ns();
+  end_ns = start_ns + sample_seconds * 1000000000ULL;
+  if(pthread_create(&thread, NULL, sampler_thread, NULL) != 0)
+  {
+    printf("can't start sampler thread\n");
+    return -1;
+  }
+  while(sampling)
+  {
+    if(drain_ring(out, stats) < SAMPLE_RING_SIZE / 2)
+    {
+      usleep(1000); // keep going while the sampler fills the ring faster than that
+    }
+    if(now_ns() >= end_ns)
+    {
+      sampling = false;
+    }
+  }
+  pthread_join(thread, NULL);
+  drain_ring(out, stats);
+  stats->elapsed_us = (now_ns() - start_ns) / 1000;
+  stats->dropped = sampler_dropped;
+  stats->late = sampler_late;
+  return 0;
+}
+
+uint32_t drain_ring(FILE *out, sample_stats *stats)
+{
+  uint32_t head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+  uint32_t tail = ring_tail;
+  uint32_t drained = head - tail;
+  uint32_t span;
+  uint32_t i;
+
+  while(tail != head)
+  {
+    // contiguous part up to the end of the ring
+    span = head - tail;
+    if(span > SAMPLE_RING_SIZE - (tail & (SAMPLE_RING_SIZE - 1)))
+    {
+      span = SAMPLE_RING_SIZE - (tail & (SAMPLE_RING_SIZE - 1));
+    }
+    for(i=0; i<span; i+=1)
+    {
+      account_sample(&ring[(tail + i) & (SAMPLE_RING_SIZE - 1)], stats);
+    }
+    fwrite(&ring[tail & (SAMPLE_RING_SIZE - 1)], sizeof(bsc_sample), span, out);
+    tail += span;
+    __atomic_store_n(&ring_tail, tail, __ATOMIC_RELEASE);
+  }
+  return drained;
+}
+
+void account_sample(const bsc_sample *s, sample_stats *stats)
+{
+  tBscStatus status;
+
+  status.i32 = s->fr;
+  stats->samples += 1;
+  if(status.nBytesInRxFifo > stats->max_rx_level)
+  {
+    stats->max_rx_level = status.nBytesInRxFifo;
+  }
+  if(status.nBytesInTxFifo > stats->max_tx_level)
+  {
+    stats->max_tx_level = status.nBytesInTxFifo;
+  }
+  if(status.rxFifoFull)
+  {
+    stats->rx_full += 1;
+  }
+  if((s->rsr & BSC_RSR_OE) && !(stats->prev_rsr & BSC_RSR_OE))
+  {
+    stats->overruns += 1;
+  }
+  if((s->rsr & BSC_RSR_UE) && !(stats->prev_rsr & BSC_RSR_UE))
+  {
+    stats->underruns += 1;
+  }
+  if(s->dr & BSC_DR_OE)
+  {
+    stats->dr_overruns += 1;
+  }
+  stats->prev_rsr = s->rsr;
+}
+
+void print_stats(const sample_stats *stats)
+{
+  double seconds = stats->elapsed_us / 1e6;
+
+  printf("samples      %llu in %.3f s (%.0f Hz), dropped %llu, late %llu\n",
+    (unsigned long long)stats->samples, seconds, (seconds > 0) ? stats->samples / seconds : 0.0,
+    (unsigned long long)stats->dropped, (unsigned long long)stats->late);
+  printf("rx fifo      max %u/%d, full in %llu samples\n", stats->max_rx_level, BSC_FIFO_SIZE, (unsigned long long)stats->rx_full);
+  printf("tx fifo      max %u/%d\n", stats->max_tx_level, BSC_FIFO_SIZE);
+  printf("overruns     %llu (RSR.OE)%s, underruns %llu (RSR.UE)\n", (unsigned long long)stats->overruns,
+    sample_dr ? "" : ", DR not sampled", (unsigned long long)stats->underruns);
+  if(sample_dr)
+  {
+    printf("             %llu samples with DR.OE\n", (unsigned long long)stats->dr_overruns);
+  }
+}
+
+//
+// Simulates the BSC on the memfd: walks the rx fifo level through 0..16 and
+// raises RSR.OE every 100 steps. Each step waits until the sampler took two
+// samples after the write, so every step is seen whatever the machine load.
+//
+void *simulator_thread(void *arg)
+{
+  uint32_t *overruns = (uint32_t *)arg;
+  tBscStatus status;
+  uint32_t step;
+  uint32_t head;
+
+  for(step=0; step<TEST_STEPS; step+=1)
+  {
+    status.i32 = 0;
+    status.nBytesInRxFifo = step % (BSC_FIFO_SIZE + 1);
+    status.rxFifoFull = (status.nBytesInRxFifo == BSC_FIFO_SIZE);
+    status.rxFifoEmpty = (status.nBytesInRxFifo == 0);
+    status.nBytesInTxFifo = step % 4;
+    periph[BSC_FR] = (uint32_t)status.i32 & 0xFFFF;
+    periph[BSC_RSR] = ((step % 100) == 50) ? BSC_RSR_OE : 0;
+    if((step % 100) == 50)
+    {
+      *overruns += 1;
+    }
+    head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+    while(sampling && __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) - head < 2)
+    {
+      sched_yield(); // the sampler spins too, don't starve it on a small Pi
+    }
+  }
+  sampling = false;
+  return NULL;
+}
+
+//
+// Runs the sampler against the simulator and checks the stats and the
+// sample file. Returns 0 on success.
+//
+int self_test()
+{
+  pthread_t thread;
+  sample_stats stats;
+  bsc_file_header header;
+  bsc_sample sample;
+  uint64_t samples_in_file = 0;
+  uint32_t overruns = 0;
+  bool pass;
+  FILE *out = tmpfile();
+
+  if(out == NULL)
+  {
+    printf("can't create temporary file\n");
+    return 1;
+  }
+  memset(ring, 0, sizeof(ring));
+  periph[BSC_SLV] = I2CSALAVEADDRESS7;
+  periph[BSC_CR] = 0x305; // EN | I2C | TXE | RXE
+  sample_rate = 5000; // slow enough to sleep between samples, so it also runs on one core
+  sample_seconds = 60; // upper bound, the simulator ends the run
+  sampling = true; // the simulator must not see the flag low before run_sampler starts
+  pthread_create(&thread, NULL, simulator_thread, &overruns);
+  run_sampler(out, &stats);
+  pthread_join(thread, NULL);
+
+  rewind(out);
+  if(fread(&header, sizeof(header), 1, out) != 1)
+  {
+    header.magic = 0;
+  }
+  while(fread(&sample, sizeof(sample), 1, out) == 1)
+  {
+    samples_in_file += 1;
+  }
+  fclose(out);
+
+  print_stats(&stats);
+  pass = (header.magic == SAMPLE_FILE_MAGIC && header.sample_size == sizeof(bsc_sample));
+  pass = pass && samples_in_file == stats.samples;
+  pass = pass && stats.max_rx_level == BSC_FIFO_SIZE && stats.max_tx_level == 3;
+  pass = pass && stats.overruns == overruns && stats.rx_full > 0;
+  printf("self test    %u steps, %u overruns simulated, %llu samples in file: %s\n",
+    TEST_STEPS, overruns, (unsigned long long)samples_in_file, pass ? "PASS" : "FAIL");
+  return pass ? 0 : 1;
+}